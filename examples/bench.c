@@ -0,0 +1,261 @@
+/*
+ * Offline benchmark of the libfprint image processing pipeline
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Runs a corpus of PGM images, as written by fp_img_save_to_file(), through
+ * the same steps as an imaging device and reports the latency of each one:
+ *
+ *	bench [-n iterations] [-t threshold] image.pgm...
+ *
+ * The internal functions are only reachable from a static link, hence the
+ * -static flag for this program in Makefile.am.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fp_internal.h"
+#include <lfs.h>
+
+#include "pgm.h"
+#include "timing.h"
+
+#define DEFAULT_ITERATIONS	5
+#define DEFAULT_THRESHOLD	40
+
+enum metric {
+	M_STANDARDIZE,
+	M_EXTRACT,
+	M_STAGE_FIRST,
+	M_TO_PRINT = M_STAGE_FIRST + LFS_NUM_STAGES,
+	M_MATCH,
+	M_IDENTIFY,
+	NUM_METRICS
+};
+
+static const char *metric_names[NUM_METRICS] = {
+	[M_STANDARDIZE] = "fp_img_standardize",
+	[M_EXTRACT] = "fpi_img_detect_minutiae",
+	[M_STAGE_FIRST + LFS_STAGE_INIT] = "  init and padding",
+	[M_STAGE_FIRST + LFS_STAGE_MAPS] = "  maps",
+	[M_STAGE_FIRST + LFS_STAGE_BINARIZATION] = "  binarization",
+	[M_STAGE_FIRST + LFS_STAGE_DETECTION] = "  detection",
+	[M_STAGE_FIRST + LFS_STAGE_RIDGE_COUNT] = "  ridge counts",
+	[M_STAGE_FIRST + LFS_STAGE_QUALITY] = "  quality",
+	[M_TO_PRINT] = "fpi_img_to_print_data",
+	[M_MATCH] = "1:1 match",
+	[M_IDENTIFY] = "1:N identify",
+};
+
+/* latencies of each metric, in seconds */
+static GArray *samples[NUM_METRICS];
+
+/* print data needs a device to record where it comes from */
+static struct fp_driver bench_driver = {
+	.name = "bench",
+	.full_name = "Offline benchmark",
+	.type = DRIVER_IMAGING,
+};
+static struct fp_dev bench_dev = {
+	.drv = &bench_driver,
+};
+static struct fp_img_dev bench_imgdev = {
+	.dev = &bench_dev,
+};
+
+struct stage_timer {
+	double last;
+};
+
+static void stage_done(const int stage, void *data)
+{
+	struct stage_timer *timer = data;
+	double t = timing_now();
+
+	timing_add_sample(samples[M_STAGE_FIRST + stage], t - timer->last);
+	timer->last = t;
+}
+
+/* Returns a copy of img, in the orientation which fp_img_standardize() turns
+ * back into img, so that standardization does some actual work */
+static struct fp_img *unstandardize(struct fp_img *img)
+{
+	struct fp_img *raw = fpi_img_new(img->length);
+
+	raw->width = img->width;
+	raw->height = img->height;
+	memcpy(raw->data, img->data, img->length);
+	raw->flags = FP_IMG_V_FLIPPED | FP_IMG_H_FLIPPED | FP_IMG_COLORS_INVERTED;
+	fp_img_standardize(raw);
+	raw->flags = FP_IMG_V_FLIPPED | FP_IMG_H_FLIPPED | FP_IMG_COLORS_INVERTED;
+	return raw;
+}
+
+/* Processes one image as imgdev.c does, returning its print */
+static struct fp_print_data *process(struct fp_img *raw)
+{
+	struct fp_print_data *print = NULL;
+	struct stage_timer timer;
+	struct fp_img *img;
+	double t;
+	int r;
+
+	img = fpi_img_new(raw->length);
+	img->width = raw->width;
+	img->height = raw->height;
+	img->flags = raw->flags;
+	memcpy(img->data, raw->data, raw->length);
+
+	t = timing_now();
+	fp_img_standardize(img);
+	timing_add_sample(samples[M_STANDARDIZE], timing_now() - t);
+
+	timer.last = t = timing_now();
+	r = fpi_img_detect_minutiae_staged(img, stage_done, &timer);
+	timing_add_sample(samples[M_EXTRACT], timing_now() - t);
+	if (r < 0) {
+		fprintf(stderr, "minutiae detection failed, code %d\n", r);
+		goto out;
+	}
+
+	t = timing_now();
+	r = fpi_img_to_print_data(&bench_imgdev, img, &print);
+	timing_add_sample(samples[M_TO_PRINT], timing_now() - t);
+	if (r < 0)
+		fprintf(stderr, "print conversion failed, code %d\n", r);
+
+out:
+	fp_img_free(img);
+	return print;
+}
+
+static void match_all(struct fp_print_data **prints, int nr_prints,
+	int threshold)
+{
+	size_t offset;
+	double t;
+	int i, j;
+
+	for (i = 0; i < nr_prints; i++) {
+		for (j = 0; j < nr_prints; j++) {
+			t = timing_now();
+			fpi_img_compare_print_data(prints[j], prints[i]);
+			timing_add_sample(samples[M_MATCH], timing_now() - t);
+		}
+
+		t = timing_now();
+		fpi_img_compare_print_data_to_gallery(prints[i], prints,
+			threshold, &offset);
+		timing_add_sample(samples[M_IDENTIFY], timing_now() - t);
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-n iterations] [-t threshold] "
+		"image.pgm...\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	struct fp_img **corpus;
+	struct fp_print_data **prints;
+	int iterations = DEFAULT_ITERATIONS;
+	int threshold = DEFAULT_THRESHOLD;
+	int nr_images, nr_prints = 0;
+	int i, n, opt, r;
+
+	while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 't':
+			threshold = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	nr_images = argc - optind;
+	if (nr_images <= 0 || iterations <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	r = fp_init();
+	if (r < 0) {
+		fprintf(stderr, "Failed to initialize libfprint\n");
+		return 1;
+	}
+
+	for (i = 0; i < NUM_METRICS; i++)
+		samples[i] = g_array_new(FALSE, FALSE, sizeof(double));
+
+	corpus = g_new0(struct fp_img *, nr_images);
+	for (i = 0; i < nr_images; i++) {
+		struct fp_img *img = load_pgm(argv[optind + i]);
+
+		if (!img) {
+			r = 1;
+			goto out;
+		}
+		corpus[i] = unstandardize(img);
+		fp_img_free(img);
+	}
+
+	/* the prints of the last iteration are kept for matching */
+	prints = g_new0(struct fp_print_data *, nr_images + 1);
+	for (n = 0; n < iterations; n++) {
+		nr_prints = 0;
+		for (i = 0; i < nr_images; i++) {
+			struct fp_print_data *print = process(corpus[i]);
+
+			fp_print_data_free(prints[nr_prints]);
+			prints[nr_prints] = NULL;
+			if (print)
+				prints[nr_prints++] = print;
+		}
+	}
+
+	for (n = 0; n < iterations; n++)
+		match_all(prints, nr_prints, threshold);
+
+	printf("%d images, %d iterations, %d prints\n\n", nr_images,
+		iterations, nr_prints);
+	timing_report(samples, metric_names, NUM_METRICS, &timing_ms);
+
+	for (i = 0; i < nr_prints; i++)
+		fp_print_data_free(prints[i]);
+	g_free(prints);
+	r = 0;
+
+out:
+	for (i = 0; i < nr_images; i++)
+		if (corpus[i])
+			fp_img_free(corpus[i]);
+	g_free(corpus);
+	for (i = 0; i < NUM_METRICS; i++)
+		g_array_free(samples[i], TRUE);
+	fp_exit();
+	return r;
+}
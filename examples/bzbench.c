@@ -0,0 +1,408 @@
+/*
+ * Microbenchmark of the bozorth3 matcher on synthetic templates
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Generates pairs of xyt templates and times each step of matching them:
+ *
+ *	bzbench [-m minutiae] [-o overlap] [-p pairs] [-n iterations]
+ *		[-j threads] [-s seed]
+ *
+ * Each gallery template keeps overlap percent of the minutiae of its probe,
+ * moved by a small rotation, translation and jitter, and fills up with
+ * random ones. 0 gives impostor pairs, 100 nearly identical ones.
+ *
+ * Every pair is also scored through each way of calling the matcher: the
+ * legacy global context, bozorth_main_ctx(), a precompiled gallery
+ * template and the worker threads. Any score differing from the staged,
+ * single threaded one is reported and makes the program fail, so changes
+ * to the matcher can be checked against its previous behaviour.
+ *
+ * Like bench, this is statically linked to reach the library internals.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <bozorth.h>
+
+#include "timing.h"
+
+#define DEFAULT_MINUTIAE	40
+#define DEFAULT_OVERLAP		60
+#define DEFAULT_PAIRS		50
+#define DEFAULT_ITERATIONS	5
+
+/* Area over which the minutiae are spread, about the size of a swipe
+ * sensor image */
+#define AREA_WIDTH	256
+#define AREA_HEIGHT	400
+
+enum metric {
+	M_PROBE_INIT,
+	M_GALLERY_INIT,
+	M_MATCH,
+	M_MATCH_SCORE,
+	M_TEMPLATE,
+	NUM_METRICS
+};
+
+static const char *metric_names[NUM_METRICS] = {
+	[M_PROBE_INIT] = "bozorth_probe_init",
+	[M_GALLERY_INIT] = "bozorth_gallery_init",
+	[M_MATCH] = "bz_match",
+	[M_MATCH_SCORE] = "bz_match_score",
+	[M_TEMPLATE] = "bozorth_to_template",
+};
+
+/* latencies of each metric, in seconds */
+static GArray *samples[NUM_METRICS];
+
+struct template {
+	struct xyt_struct xyt;
+	int cols[3 * MAX_BOZORTH_MINUTIAE];
+};
+
+struct pair {
+	struct template probe;
+	struct template gallery;
+	int score;		/* staged, single threaded score */
+};
+
+struct thread_data {
+	struct pair *pairs;
+	int nr_pairs;
+	int iterations;
+	int mismatches;
+	GThread *thread;
+};
+
+static int clamp(int v, int lo, int hi)
+{
+	return v < lo ? lo : v > hi ? hi : v;
+}
+
+/* Angles as stored in prints, in ( -180, 180 ] */
+static int wrap_angle(int theta)
+{
+	while (theta > 180)
+		theta -= 360;
+	while (theta <= -180)
+		theta += 360;
+	return theta;
+}
+
+static int cmp_minutia(const void *a, const void *b)
+{
+	const int *ma = a, *mb = b;
+
+	if (ma[0] != mb[0])
+		return ma[0] - mb[0];
+	return ma[1] - mb[1];
+}
+
+/* Stores minutiae as the xyt columns of a template, in the x then y order
+ * of the prints, which bz_comp() relies on */
+static void set_template(struct template *t, int minutiae[][3], int n)
+{
+	int i;
+
+	qsort(minutiae, n, sizeof(minutiae[0]), cmp_minutia);
+	t->xyt.nrows = n;
+	t->xyt.xcol = t->cols;
+	t->xyt.ycol = t->cols + n;
+	t->xyt.thetacol = t->cols + 2 * n;
+	for (i = 0; i < n; i++) {
+		t->xyt.xcol[i] = minutiae[i][0];
+		t->xyt.ycol[i] = minutiae[i][1];
+		t->xyt.thetacol[i] = minutiae[i][2];
+	}
+}
+
+static void random_minutia(GRand *rand, int m[3])
+{
+	m[0] = g_rand_int_range(rand, 0, AREA_WIDTH);
+	m[1] = g_rand_int_range(rand, 0, AREA_HEIGHT);
+	m[2] = wrap_angle(g_rand_int_range(rand, 0, 360));
+}
+
+static void make_pair(GRand *rand, struct pair *pair, int nr_minutiae,
+	int overlap)
+{
+	int probe[MAX_BOZORTH_MINUTIAE][3];
+	int gallery[MAX_BOZORTH_MINUTIAE][3];
+	double angle = g_rand_double_range(rand, -0.2, 0.2);
+	int tx = g_rand_int_range(rand, -20, 21);
+	int ty = g_rand_int_range(rand, -20, 21);
+	int degrees = (int) (angle * 180 / M_PI);
+	int kept = nr_minutiae * overlap / 100;
+	int i;
+
+	for (i = 0; i < nr_minutiae; i++)
+		random_minutia(rand, probe[i]);
+
+	/* the same finger, seen a little moved, loses and gains minutiae */
+	for (i = 0; i < kept; i++) {
+		int cx = probe[i][0] - AREA_WIDTH / 2;
+		int cy = probe[i][1] - AREA_HEIGHT / 2;
+		int x = cx * cos(angle) - cy * sin(angle) + AREA_WIDTH / 2 + tx;
+		int y = cx * sin(angle) + cy * cos(angle) + AREA_HEIGHT / 2 + ty;
+
+		gallery[i][0] = clamp(x + g_rand_int_range(rand, -2, 3), 0,
+			AREA_WIDTH - 1);
+		gallery[i][1] = clamp(y + g_rand_int_range(rand, -2, 3), 0,
+			AREA_HEIGHT - 1);
+		gallery[i][2] = wrap_angle(probe[i][2] + degrees +
+			g_rand_int_range(rand, -5, 6));
+	}
+	for (; i < nr_minutiae; i++)
+		random_minutia(rand, gallery[i]);
+
+	set_template(&pair->probe, probe, nr_minutiae);
+	set_template(&pair->gallery, gallery, nr_minutiae);
+}
+
+/* Scores one pair step by step, timing each step */
+static int staged_score(struct bz_ctx *ctx, struct pair *pair)
+{
+	int probe_len, gallery_len, np, score;
+	double t;
+
+	t = timing_now();
+	probe_len = bozorth_probe_init_ctx(ctx, &pair->probe.xyt);
+	timing_add_sample(samples[M_PROBE_INIT], timing_now() - t);
+
+	t = timing_now();
+	gallery_len = bozorth_gallery_init_ctx(ctx, &pair->gallery.xyt);
+	timing_add_sample(samples[M_GALLERY_INIT], timing_now() - t);
+
+	t = timing_now();
+	np = bz_match(ctx, probe_len, gallery_len);
+	timing_add_sample(samples[M_MATCH], timing_now() - t);
+
+	t = timing_now();
+	score = bz_match_score(ctx, np, &pair->probe.xyt, &pair->gallery.xyt);
+	timing_add_sample(samples[M_MATCH_SCORE], timing_now() - t);
+
+	return score;
+}
+
+static int check_score(struct pair *pair, int index, const char *path,
+	int score)
+{
+	if (score == pair->score)
+		return 0;
+	fprintf(stderr, "pair %d: %s scored %d instead of %d\n", index, path,
+		score, pair->score);
+	return 1;
+}
+
+/* Scores every pair through the other entry points of the matcher */
+static int check_paths(struct bz_ctx *ctx, struct pair *pairs, int nr_pairs)
+{
+	int mismatches = 0;
+	int i;
+
+	for (i = 0; i < nr_pairs; i++) {
+		struct pair *pair = &pairs[i];
+		struct bz_template *tmpl;
+		int probe_len;
+		double t;
+
+		mismatches += check_score(pair, i, "bozorth_main",
+			bozorth_main(&pair->probe.xyt, &pair->gallery.xyt));
+		mismatches += check_score(pair, i, "bozorth_main_ctx",
+			bozorth_main_ctx(ctx, &pair->probe.xyt, &pair->gallery.xyt));
+
+		tmpl = bozorth_gallery_compile_ctx(ctx, &pair->gallery.xyt);
+		if (!tmpl) {
+			fprintf(stderr, "out of memory\n");
+			return mismatches + 1;
+		}
+		probe_len = bozorth_probe_init_ctx(ctx, &pair->probe.xyt);
+		t = timing_now();
+		mismatches += check_score(pair, i, "bozorth_to_template",
+			bozorth_to_template_ctx(ctx, probe_len, &pair->probe.xyt,
+				&pair->gallery.xyt, tmpl));
+		timing_add_sample(samples[M_TEMPLATE], timing_now() - t);
+		bozorth_template_free(tmpl);
+	}
+
+	return mismatches;
+}
+
+/* Matches every pair on a context of its own, as the identification pool
+ * does, comparing the scores with the single threaded ones */
+static gpointer thread_main(gpointer user_data)
+{
+	struct thread_data *data = user_data;
+	struct bz_ctx *ctx = bz_ctx_new();
+	int i, n;
+
+	for (n = 0; n < data->iterations; n++) {
+		for (i = 0; i < data->nr_pairs; i++) {
+			struct pair *pair = &data->pairs[i];
+			int score = bozorth_main_ctx(ctx, &pair->probe.xyt,
+				&pair->gallery.xyt);
+
+			if (score != pair->score)
+				data->mismatches++;
+		}
+	}
+
+	bz_ctx_free(ctx);
+	return NULL;
+}
+
+static int run_threads(struct pair *pairs, int nr_pairs, int iterations,
+	int nr_threads)
+{
+	struct thread_data *threads = g_new0(struct thread_data, nr_threads);
+	int mismatches = 0;
+	double t;
+	int i;
+
+	t = timing_now();
+	for (i = 0; i < nr_threads; i++) {
+		threads[i].pairs = pairs;
+		threads[i].nr_pairs = nr_pairs;
+		threads[i].iterations = iterations;
+		threads[i].thread = g_thread_new("bzbench", thread_main,
+			&threads[i]);
+	}
+	for (i = 0; i < nr_threads; i++) {
+		g_thread_join(threads[i].thread);
+		mismatches += threads[i].mismatches;
+	}
+	t = timing_now() - t;
+
+	printf("\n%d threads: %.1f matches/s\n", nr_threads,
+		(double) nr_threads * iterations * nr_pairs / t);
+	if (mismatches)
+		fprintf(stderr, "%d threaded scores differ\n", mismatches);
+
+	g_free(threads);
+	return mismatches;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-m minutiae] [-o overlap] [-p pairs] "
+		"[-n iterations] [-j threads] [-s seed]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	struct bz_ctx *ctx;
+	struct pair *pairs;
+	GRand *rand;
+	int nr_minutiae = DEFAULT_MINUTIAE;
+	int overlap = DEFAULT_OVERLAP;
+	int nr_pairs = DEFAULT_PAIRS;
+	int iterations = DEFAULT_ITERATIONS;
+	int nr_threads = 0;
+	guint32 seed = 1;
+	int mismatches = 0;
+	double total = 0;
+	int i, n, opt;
+
+	while ((opt = getopt(argc, argv, "m:o:p:n:j:s:")) != -1) {
+		switch (opt) {
+		case 'm':
+			nr_minutiae = atoi(optarg);
+			break;
+		case 'o':
+			overlap = atoi(optarg);
+			break;
+		case 'p':
+			nr_pairs = atoi(optarg);
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'j':
+			nr_threads = atoi(optarg);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind != argc || nr_minutiae < 2 ||
+			nr_minutiae > MAX_BOZORTH_MINUTIAE || overlap < 0 ||
+			overlap > 100 || nr_pairs <= 0 || iterations <= 0 ||
+			nr_threads < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (!nr_threads)
+		nr_threads = g_get_num_processors();
+
+	for (i = 0; i < NUM_METRICS; i++)
+		samples[i] = g_array_new(FALSE, FALSE, sizeof(double));
+
+	rand = g_rand_new_with_seed(seed);
+	pairs = g_new0(struct pair, nr_pairs);
+	for (i = 0; i < nr_pairs; i++)
+		make_pair(rand, &pairs[i], nr_minutiae, overlap);
+	g_rand_free(rand);
+
+	ctx = bz_ctx_new();
+	for (n = 0; n < iterations; n++) {
+		for (i = 0; i < nr_pairs; i++) {
+			int score = staged_score(ctx, &pairs[i]);
+
+			if (n == 0)
+				pairs[i].score = score;
+			else
+				mismatches += check_score(&pairs[i], i,
+					"a later iteration", score);
+		}
+	}
+	for (i = 0; i < nr_pairs; i++)
+		total += pairs[i].score;
+
+	mismatches += check_paths(ctx, pairs, nr_pairs);
+	bz_ctx_free(ctx);
+
+	printf("%d pairs of %d minutiae, %d%% overlap, mean score %.1f\n\n",
+		nr_pairs, nr_minutiae, overlap, total / nr_pairs);
+	timing_report(samples, metric_names, NUM_METRICS, &timing_us);
+
+	mismatches += run_threads(pairs, nr_pairs, iterations, 1);
+	if (nr_threads > 1)
+		mismatches += run_threads(pairs, nr_pairs, iterations,
+			nr_threads);
+
+	for (i = 0; i < NUM_METRICS; i++)
+		g_array_free(samples[i], TRUE);
+	g_free(pairs);
+
+	if (mismatches) {
+		fprintf(stderr, "%d scores differ\n", mismatches);
+		return 1;
+	}
+	return 0;
+}
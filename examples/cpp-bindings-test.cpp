@@ -0,0 +1,18 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <libfprint/fprint.hpp>
+
+int main (int argc, char **argv)
+{
+	fp_init ();
+	try {
+		fp::discovered_devices devs = fp::discovered_devices::discover ();
+		printf ("%zu devices\n", devs.devices ().size ());
+	} catch (const std::system_error &e) {
+		fprintf (stderr, "%s\n", e.what ());
+	}
+	fp_exit ();
+	return 0;
+}
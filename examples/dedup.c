@@ -0,0 +1,161 @@
+/*
+ * Duplicate finger detection over a print database
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Matches all the prints of a database against each other and lists the
+ * groups of prints which seem to come from the same finger:
+ *
+ *	dedup [-t threshold] [-s min_similarity] [-j threads] database
+ *
+ * Prints which can't be loaded, or don't come from imaging devices, are
+ * skipped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <libfprint/fprint.h>
+
+#include "timing.h"
+
+#define DEFAULT_THRESHOLD	40
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-t threshold] [-s min_similarity] "
+		"[-j threads] database\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	struct fp_print_db *db;
+	struct fp_print_data **prints;
+	int *indices, *clusters, *next, *tail;
+	int threshold = DEFAULT_THRESHOLD;
+	int min_similarity = 0;
+	int nr_threads = 0;
+	int nr_entries, nr_prints = 0, nr_clusters = 0;
+	double start;
+	int i, j, r, opt;
+
+	while ((opt = getopt(argc, argv, "t:s:j:")) != -1) {
+		switch (opt) {
+		case 't':
+			threshold = atoi(optarg);
+			break;
+		case 's':
+			min_similarity = atoi(optarg);
+			break;
+		case 'j':
+			nr_threads = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind != argc - 1 || threshold <= 0 || min_similarity < 0 ||
+			min_similarity > 100 || nr_threads < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	r = fp_init();
+	if (r < 0) {
+		fprintf(stderr, "Failed to initialize libfprint\n");
+		return 1;
+	}
+
+	r = fp_print_db_open(argv[optind], &db);
+	if (r < 0) {
+		fprintf(stderr, "Failed to open %s: %d\n", argv[optind], r);
+		fp_exit();
+		return 1;
+	}
+
+	nr_entries = fp_print_db_get_nr_prints(db);
+	prints = calloc(nr_entries + 1, sizeof(*prints));
+	indices = calloc(nr_entries, sizeof(*indices));
+	clusters = calloc(nr_entries, sizeof(*clusters));
+	next = calloc(nr_entries, sizeof(*next));
+	tail = calloc(nr_entries, sizeof(*tail));
+	if (!prints || !indices || !clusters || !next || !tail) {
+		fprintf(stderr, "Out of memory\n");
+		r = -1;
+		goto out;
+	}
+
+	start = timing_now();
+	for (i = 0; i < nr_entries; i++) {
+		r = fp_print_db_load(db, i, &prints[nr_prints]);
+		if (r < 0) {
+			fprintf(stderr, "Skipping print %d: %d\n", i, r);
+			continue;
+		}
+		indices[nr_prints++] = i;
+	}
+	printf("Loaded %d prints out of %d in %.1fs\n", nr_prints, nr_entries,
+		timing_now() - start);
+
+	start = timing_now();
+	r = fp_print_data_find_duplicates(prints, threshold, min_similarity,
+		nr_threads, clusters);
+	if (r < 0) {
+		fprintf(stderr, "Matching failed: %d\n", r);
+		goto out;
+	}
+	printf("Found %d duplicates in %.1fs\n\n", r, timing_now() - start);
+
+	/* Chain the prints of each cluster, the first one comes before all the
+	 * other ones */
+	for (i = 0; i < nr_prints; i++) {
+		next[i] = -1;
+		tail[i] = i;
+		if (clusters[i] != i) {
+			next[tail[clusters[i]]] = i;
+			tail[clusters[i]] = i;
+		}
+	}
+
+	for (i = 0; i < nr_prints; i++) {
+		if (clusters[i] != i || next[i] < 0)
+			continue;
+		printf("Cluster %d:\n", ++nr_clusters);
+		for (j = i; j >= 0; j = next[j])
+			printf("\t%s, finger %d\n",
+				fp_print_db_get_name(db, indices[j]),
+				fp_print_db_get_finger(db, indices[j]));
+	}
+	r = 0;
+
+out:
+	if (prints) {
+		for (i = 0; i < nr_prints; i++)
+			fp_print_data_free(prints[i]);
+	}
+	free(prints);
+	free(indices);
+	free(clusters);
+	free(next);
+	free(tail);
+	fp_print_db_close(db);
+	fp_exit();
+	return r < 0;
+}
@@ -0,0 +1,251 @@
+/*
+ * Accuracy check of the fast minutiae detection
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Runs minutiae detection on a corpus of PGM images, as written by
+ * fp_img_save_to_file(), once in double precision and once with
+ * FP_EXTRACTION_FAST, and compares the direction maps and the minutiae:
+ *
+ *	dftcheck [-b] [-m min_paired] image.pgm...
+ *
+ * With -b, the fast extraction also scans for minutiae in bands, as with
+ * fp_set_extraction_scan_bands().
+ *
+ * A minutia of the reference is paired with a minutia of the same type found
+ * nearby in the same direction. The exit status is 1 if less than min_paired
+ * percent of the reference minutiae are paired over the whole corpus.
+ *
+ * The internal functions are only reachable from a static link, hence the
+ * -static flag for this program in Makefile.am.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "fp_internal.h"
+#include <lfs.h>
+
+#include "pgm.h"
+
+#define DEFAULT_MIN_PAIRED	95
+
+/* Pairing tolerances: pixels, and minutia direction units (of 32 per turn) */
+#define PAIR_DIST		4
+#define PAIR_DIRECTION		2
+
+struct totals {
+	long blocks;
+	long blocks_near;
+	long blocks_far;
+	long ref_minutiae;
+	long fast_minutiae;
+	long paired;
+};
+
+struct extraction {
+	MINUTIAE *minutiae;
+	int *direction_map;
+	int map_w;
+	int map_h;
+};
+
+/* Whether the fast extraction scans for minutiae in bands, set by -b */
+static int fast_bands;
+
+static int extract(struct fp_img *img, int single, struct extraction *ex)
+{
+	LFSPARMS lfsparms = g_lfsparms_V2;
+	int *quality_map, *low_contrast_map, *low_flow_map, *high_curve_map;
+	int r;
+
+	lfsparms.dft_single = single;
+	lfsparms.scan_bands = single && fast_bands;
+	r = get_minutiae(&ex->minutiae, &quality_map, &ex->direction_map,
+		&low_contrast_map, &low_flow_map, &high_curve_map,
+		&ex->map_w, &ex->map_h, NULL, NULL, NULL, NULL, img->data,
+		img->width, img->height, 8, DEFAULT_PPI / (double)25.4,
+		&lfsparms, NULL, NULL);
+	if (r)
+		return r;
+
+	free(quality_map);
+	free(low_contrast_map);
+	free(low_flow_map);
+	free(high_curve_map);
+	return 0;
+}
+
+static void compare_maps(struct extraction *ref, struct extraction *fast,
+	struct totals *t, long *near, long *far)
+{
+	int i, n = ref->map_w * ref->map_h;
+
+	*near = *far = 0;
+	for (i = 0; i < n; i++) {
+		int a = ref->direction_map[i];
+		int b = fast->direction_map[i];
+		int d;
+
+		if (a == b)
+			continue;
+		d = abs(a - b);
+		if (a >= 0 && b >= 0 &&
+		    MIN(d, NUM_DIRECTIONS - d) == 1)
+			(*near)++;
+		else
+			(*far)++;
+	}
+	t->blocks += n;
+	t->blocks_near += *near;
+	t->blocks_far += *far;
+}
+
+static gboolean minutiae_pair(MINUTIA *a, MINUTIA *b)
+{
+	int dx = a->x - b->x;
+	int dy = a->y - b->y;
+	int dd = abs(a->direction - b->direction);
+
+	return a->type == b->type &&
+		dx * dx + dy * dy <= PAIR_DIST * PAIR_DIST &&
+		MIN(dd, 2 * NUM_DIRECTIONS - dd) <= PAIR_DIRECTION;
+}
+
+/* Pairs each reference minutia with the first unpaired one close to it */
+static int compare_minutiae(struct extraction *ref, struct extraction *fast)
+{
+	gboolean *taken = g_new0(gboolean, fast->minutiae->num);
+	int i, j, paired = 0;
+
+	for (i = 0; i < ref->minutiae->num; i++)
+		for (j = 0; j < fast->minutiae->num; j++)
+			if (!taken[j] && minutiae_pair(ref->minutiae->list[i],
+					fast->minutiae->list[j])) {
+				taken[j] = TRUE;
+				paired++;
+				break;
+			}
+
+	g_free(taken);
+	return paired;
+}
+
+static void extraction_free(struct extraction *ex)
+{
+	free_minutiae(ex->minutiae);
+	free(ex->direction_map);
+}
+
+static int check(const char *path, struct totals *t)
+{
+	struct extraction ref, fast;
+	struct fp_img *img;
+	long near, far;
+	int paired, r;
+
+	img = load_pgm(path);
+	if (!img)
+		return -EIO;
+
+	r = extract(img, FALSE, &ref);
+	if (r) {
+		fprintf(stderr, "%s: minutiae detection failed, code %d\n",
+			path, r);
+		goto out;
+	}
+	r = extract(img, TRUE, &fast);
+	if (r) {
+		fprintf(stderr, "%s: fast minutiae detection failed, code %d\n",
+			path, r);
+		extraction_free(&ref);
+		goto out;
+	}
+
+	compare_maps(&ref, &fast, t, &near, &far);
+	paired = compare_minutiae(&ref, &fast);
+	t->ref_minutiae += ref.minutiae->num;
+	t->fast_minutiae += fast.minutiae->num;
+	t->paired += paired;
+
+	printf("%s: %d blocks, %ld off by one direction, %ld otherwise; "
+		"%d minutiae, %d fast, %d paired\n", path,
+		ref.map_w * ref.map_h, near, far, ref.minutiae->num,
+		fast.minutiae->num, paired);
+
+	extraction_free(&ref);
+	extraction_free(&fast);
+out:
+	fp_img_free(img);
+	return r;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-b] [-m min_paired] image.pgm...\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	struct totals t = { 0 };
+	int min_paired = DEFAULT_MIN_PAIRED;
+	int i, opt, r;
+	double ratio;
+
+	while ((opt = getopt(argc, argv, "bm:")) != -1) {
+		switch (opt) {
+		case 'b':
+			fast_bands = TRUE;
+			break;
+		case 'm':
+			min_paired = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	r = fp_init();
+	if (r < 0) {
+		fprintf(stderr, "Failed to initialize libfprint\n");
+		return 1;
+	}
+
+	for (i = optind; i < argc; i++)
+		if (check(argv[i], &t) < 0) {
+			fp_exit();
+			return 1;
+		}
+
+	ratio = t.ref_minutiae ? 100.0 * t.paired / t.ref_minutiae : 100.0;
+	printf("\n%ld blocks: %.3f%% off by one direction, %.3f%% otherwise\n",
+		t.blocks, t.blocks ? 100.0 * t.blocks_near / t.blocks : 0.0,
+		t.blocks ? 100.0 * t.blocks_far / t.blocks : 0.0);
+	printf("%ld minutiae, %ld fast: %.2f%% paired\n", t.ref_minutiae,
+		t.fast_minutiae, ratio);
+
+	fp_exit();
+	return ratio < min_paired ? 1 : 0;
+}
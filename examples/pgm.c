@@ -0,0 +1,58 @@
+/*
+ * PGM images for the example programs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pgm.h"
+
+/* Reads a binary PGM with 8-bit samples, as written by
+ * fp_img_save_to_file() */
+struct fp_img *load_pgm(const char *path)
+{
+	struct fp_img *img;
+	FILE *fd;
+	int width, height, maxval;
+
+	fd = fopen(path, "rb");
+	if (!fd) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	if (fscanf(fd, "P5 %d %d %d", &width, &height, &maxval) != 3 ||
+			fgetc(fd) == EOF || width <= 0 || height <= 0 ||
+			maxval != 255) {
+		fprintf(stderr, "%s: not an 8-bit binary PGM\n", path);
+		fclose(fd);
+		return NULL;
+	}
+
+	img = fpi_img_new(width * height);
+	img->width = width;
+	img->height = height;
+	if (fread(img->data, 1, img->length, fd) != img->length) {
+		fprintf(stderr, "%s: short read\n", path);
+		fp_img_free(img);
+		img = NULL;
+	}
+
+	fclose(fd);
+	return img;
+}
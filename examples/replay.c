@@ -0,0 +1,163 @@
+/*
+ * Replays a recorded USB trace through its driver
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Record a capture with a reader attached:
+ *
+ *	LIBFPRINT_USB_TRACE=capture.trace ./img_capture
+ *
+ * then run the same capture again, as many times as needed, without it:
+ *
+ *	replay [-n iterations] [-r] [-o image.pgm] capture.trace
+ *
+ * -r replays the transfers as slowly as they were recorded, otherwise they
+ * complete as soon as the driver submits them, which only leaves the
+ * processing time of the driver. Like bench, this is statically linked to
+ * reach the library internals.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "fp_internal.h"
+
+#include "timing.h"
+
+struct open_data {
+	gboolean done;
+	struct fp_dev *dev;
+	int status;
+};
+
+static void open_cb(struct fp_dev *dev, int status, void *user_data)
+{
+	struct open_data *data = user_data;
+
+	data->done = TRUE;
+	data->dev = dev;
+	data->status = status;
+}
+
+static struct fp_dev *replay_open(const char *path, gboolean realtime)
+{
+	struct open_data data = { FALSE, NULL, 0 };
+	int r;
+
+	r = fpi_usb_replay_open(fpi_default_ctx, path, realtime, open_cb, &data);
+	if (r < 0)
+		return NULL;
+
+	while (!data.done)
+		if (fp_context_handle_events(fpi_default_ctx) < 0)
+			return NULL;
+
+	if (data.status) {
+		fp_dev_close(data.dev);
+		return NULL;
+	}
+	return data.dev;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-n iterations] [-r] [-o image.pgm] "
+		"trace\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	const char *output = NULL;
+	gboolean realtime = FALSE;
+	int iterations = 1;
+	double *times;
+	int i, opt, r = 1;
+
+	while ((opt = getopt(argc, argv, "n:ro:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'r':
+			realtime = TRUE;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind != argc - 1 || iterations <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (fp_init() < 0) {
+		fprintf(stderr, "Failed to initialize libfprint\n");
+		return 1;
+	}
+
+	times = g_new(double, iterations);
+	for (i = 0; i < iterations; i++) {
+		struct fp_img *img = NULL;
+		struct fp_dev *dev;
+		unsigned int mismatches;
+		double t;
+
+		dev = replay_open(argv[optind], realtime);
+		if (!dev) {
+			fprintf(stderr, "Could not replay %s\n", argv[optind]);
+			goto out;
+		}
+
+		t = timing_now();
+		r = fp_dev_img_capture(dev, 0, &img);
+		times[i] = timing_now() - t;
+		mismatches = fpi_usb_replay_mismatches(dev);
+		fp_dev_close(dev);
+
+		if (r) {
+			fprintf(stderr, "Capture failed with error %d\n", r);
+			goto out;
+		}
+		if (mismatches)
+			fprintf(stderr, "%u transfers differ from the trace\n",
+				mismatches);
+
+		if (i == 0 && output) {
+			fp_img_standardize(img);
+			if (fp_img_save_to_file(img, (char *) output) < 0)
+				fprintf(stderr, "Could not save %s\n", output);
+		}
+		fp_img_free(img);
+	}
+
+	qsort(times, iterations, sizeof(*times), timing_cmp_double);
+	printf("%d captures: min %.3f ms, median %.3f ms, max %.3f ms\n",
+		iterations, times[0] * 1e3, times[iterations / 2] * 1e3,
+		times[iterations - 1] * 1e3);
+	r = 0;
+
+out:
+	g_free(times);
+	fp_exit();
+	return r;
+}
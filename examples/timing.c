@@ -0,0 +1,87 @@
+/*
+ * Timing and latency statistics for the example programs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "timing.h"
+
+const struct timing_unit timing_ms = { "ms", 1e3, 3 };
+const struct timing_unit timing_us = { "us", 1e6, 1 };
+
+double timing_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int timing_cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+void timing_add_sample(GArray *samples, double t)
+{
+	g_array_append_val(samples, t);
+}
+
+/* s must be sorted */
+static double percentile(GArray *s, int p, const struct timing_unit *unit)
+{
+	guint i = (s->len - 1) * p / 100;
+
+	return g_array_index(s, double, i) * unit->scale;
+}
+
+/* Prints the rate and the latency percentiles of each metric with samples,
+ * sorting them */
+void timing_report(GArray **samples, const char **names, int nr_metrics,
+	const struct timing_unit *unit)
+{
+	char head[4][16];
+	int m;
+
+	snprintf(head[0], sizeof(head[0]), "p50 %s", unit->name);
+	snprintf(head[1], sizeof(head[1]), "p90 %s", unit->name);
+	snprintf(head[2], sizeof(head[2]), "p99 %s", unit->name);
+	snprintf(head[3], sizeof(head[3]), "max %s", unit->name);
+	printf("%-24s %8s %10s %9s %9s %9s %9s\n", "", "count", "ops/s",
+		head[0], head[1], head[2], head[3]);
+	for (m = 0; m < nr_metrics; m++) {
+		GArray *s = samples[m];
+		double total = 0;
+		guint i;
+
+		if (!s->len)
+			continue;
+
+		for (i = 0; i < s->len; i++)
+			total += g_array_index(s, double, i);
+		g_array_sort(s, timing_cmp_double);
+		printf("%-24s %8u %10.1f %9.*f %9.*f %9.*f %9.*f\n",
+			names[m], s->len, total > 0 ? s->len / total : 0,
+			unit->precision, percentile(s, 50, unit),
+			unit->precision, percentile(s, 90, unit),
+			unit->precision, percentile(s, 99, unit),
+			unit->precision, percentile(s, 100, unit));
+	}
+}
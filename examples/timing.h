@@ -0,0 +1,42 @@
+/*
+ * Timing and latency statistics for the example programs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __TIMING_H__
+#define __TIMING_H__
+
+#include <glib.h>
+
+/* How latencies are reported */
+struct timing_unit {
+	const char *name;
+	double scale;		/* from seconds */
+	int precision;		/* decimal places */
+};
+
+extern const struct timing_unit timing_ms;
+extern const struct timing_unit timing_us;
+
+double timing_now(void);
+int timing_cmp_double(const void *a, const void *b);
+
+/* samples are GArrays of double latencies, in seconds */
+void timing_add_sample(GArray *samples, double t);
+void timing_report(GArray **samples, const char **names, int nr_metrics,
+	const struct timing_unit *unit);
+
+#endif
@@ -35,111 +35,154 @@
 #define EP_IN			(1 | LIBUSB_ENDPOINT_IN)
 #define EP_OUT			(2 | LIBUSB_ENDPOINT_OUT)
 
-struct write_regv_data {
+/* A register program holds the writes of a register table packed into the
+ * payloads of the URBs which carry them, so that running it again doesn't need
+ * any allocation: the payloads are sent one after the other from the same
+ * transfer. */
+struct aes_regprog {
+	unsigned char *payload;
+	unsigned int *chunk_len;
+	unsigned int num_chunks;
+	struct libusb_transfer *transfer;
+
+	/* state of the current run */
 	struct fp_img_dev *imgdev;
-	unsigned int num_regs;
-	const struct aes_regwrite *regs;
-	unsigned int offset;
+	unsigned int chunk;
+	size_t offset;
 	aes_write_regv_cb callback;
 	void *user_data;
+	/* free the program once it has run */
+	gboolean oneshot;
 };
 
-static void continue_write_regv(struct write_regv_data *wdata);
-
-/* libusb bulk callback for regv write completion transfer. continues the
- * transaction */
-static void write_regv_trf_complete(struct libusb_transfer *transfer)
+/* pack the writes of a register table, combining several of them in the same
+ * URB up to a limit. writes to non-existent register 0 force specific groups
+ * of writes to be separated in different URBs. */
+struct aes_regprog *aes_regprog_compile(const struct aes_regwrite *regs,
+	unsigned int num_regs)
 {
-	struct write_regv_data *wdata = transfer->user_data;
+	struct aes_regprog *prog;
+	unsigned int offset = 0;
+	size_t data_offset = 0;
 
-	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
-		wdata->callback(wdata->imgdev, -EIO, wdata->user_data);
-	else if (transfer->length != transfer->actual_length)
-		wdata->callback(wdata->imgdev, -EPROTO, wdata->user_data);
-	else
-		continue_write_regv(wdata);
+	prog = g_malloc0(sizeof(*prog));
+	prog->transfer = libusb_alloc_transfer(0);
+	if (!prog->transfer) {
+		g_free(prog);
+		return NULL;
+	}
+	prog->payload = g_malloc(num_regs * 2);
+	prog->chunk_len = g_new(unsigned int, num_regs);
 
-	g_free(transfer->buffer);
-	libusb_free_transfer(transfer);
-}
+	while (TRUE) {
+		unsigned int limit, upper_bound, i;
 
-/* write from wdata->offset to upper_bound (inclusive) of wdata->regs */
-static int do_write_regv(struct write_regv_data *wdata, int upper_bound)
-{
-	unsigned int offset = wdata->offset;
-	unsigned int num = upper_bound - offset + 1;
-	size_t alloc_size = num * 2;
-	unsigned char *data = g_malloc(alloc_size);
-	unsigned int i;
-	size_t data_offset = 0;
-	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
-	int r;
+		/* skip all zeros and ensure there is still work to do */
+		while (offset < num_regs && !regs[offset].reg)
+			offset++;
+		if (offset >= num_regs)
+			break;
 
-	if (!transfer) {
-		g_free(data);
-		return -ENOMEM;
-	}
+		limit = MIN(num_regs - offset, MAX_REGWRITES_PER_REQUEST);
+		upper_bound = offset + limit - 1;
 
-	for (i = offset; i < offset + num; i++) {
-		const struct aes_regwrite *regwrite = &wdata->regs[i];
-		data[data_offset++] = regwrite->reg;
-		data[data_offset++] = regwrite->value;
-	}
+		/* determine if we can write the entire of the regs at once, or if
+		 * there is a zero dividing things up */
+		for (i = offset; i <= upper_bound; i++)
+			if (!regs[i].reg) {
+				upper_bound = i - 1;
+				break;
+			}
 
-	libusb_fill_bulk_transfer(transfer, wdata->imgdev->udev, EP_OUT, data,
-		alloc_size, write_regv_trf_complete, wdata, BULK_TIMEOUT);
-	r = libusb_submit_transfer(transfer);
-	if (r < 0) {
-		g_free(data);
-		libusb_free_transfer(transfer);
+		for (i = offset; i <= upper_bound; i++) {
+			prog->payload[data_offset++] = regs[i].reg;
+			prog->payload[data_offset++] = regs[i].value;
+		}
+		prog->chunk_len[prog->num_chunks++] = (upper_bound - offset + 1) * 2;
+		offset = upper_bound + 1;
 	}
 
-	return r;
+	return prog;
 }
 
-/* write the next batch of registers to be written, or if there are no more,
- * indicate completion to the caller */
-static void continue_write_regv(struct write_regv_data *wdata)
+/* must not be called while the program runs */
+void aes_regprog_free(struct aes_regprog *prog)
 {
-	unsigned int offset = wdata->offset;
-	unsigned int regs_remaining;
-	unsigned int limit;
-	unsigned int upper_bound;
-	int i;
-	int r;
+	if (!prog)
+		return;
 
-	/* skip all zeros and ensure there is still work to do */
-	while (TRUE) {
-		if (offset >= wdata->num_regs) {
-			fp_dbg("all registers written");
-			wdata->callback(wdata->imgdev, 0, wdata->user_data);
-			return;
-		}
-		if (wdata->regs[offset].reg)
-			break;
-		offset++;
-	}
+	libusb_free_transfer(prog->transfer);
+	g_free(prog->chunk_len);
+	g_free(prog->payload);
+	g_free(prog);
+}
 
-	wdata->offset = offset;
-	regs_remaining = wdata->num_regs - offset;
-	limit = MIN(regs_remaining, MAX_REGWRITES_PER_REQUEST);
-	upper_bound = offset + limit - 1;
+static void regprog_complete(struct aes_regprog *prog, int result)
+{
+	struct fp_img_dev *dev = prog->imgdev;
+	aes_write_regv_cb callback = prog->callback;
+	void *user_data = prog->user_data;
+
+	prog->callback = NULL;
+	if (prog->oneshot)
+		aes_regprog_free(prog);
+	callback(dev, result, user_data);
+}
 
-	/* determine if we can write the entire of the regs at once, or if there
-	 * is a zero dividing things up */
-	for (i = offset; i <= upper_bound; i++)
-		if (!wdata->regs[i].reg) {
-			upper_bound = i - 1;
-			break;
-		}
+static void regprog_trf_complete(struct libusb_transfer *transfer);
 
-	r = do_write_regv(wdata, upper_bound);
-	if (r < 0) {
-		wdata->callback(wdata->imgdev, r, wdata->user_data);
+/* send the current chunk of a program, or if there are no more, indicate
+ * completion to the caller */
+static void regprog_continue(struct aes_regprog *prog)
+{
+	unsigned int len;
+	int r;
+
+	if (prog->chunk >= prog->num_chunks) {
+		fp_dbg("all registers written");
+		regprog_complete(prog, 0);
 		return;
 	}
 
-	wdata->offset = upper_bound + 1;
+	len = prog->chunk_len[prog->chunk];
+	libusb_fill_bulk_transfer(prog->transfer, prog->imgdev->udev, EP_OUT,
+		prog->payload + prog->offset, len, regprog_trf_complete, prog,
+		BULK_TIMEOUT);
+	r = fpi_usb_submit_transfer(prog->transfer);
+	if (r < 0)
+		regprog_complete(prog, r);
+}
+
+/* libusb bulk callback for regv write completion transfer. continues the
+ * transaction */
+static void regprog_trf_complete(struct libusb_transfer *transfer)
+{
+	struct aes_regprog *prog = transfer->user_data;
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		regprog_complete(prog, -EIO);
+	} else if (transfer->length != transfer->actual_length) {
+		regprog_complete(prog, -EPROTO);
+	} else {
+		prog->offset += prog->chunk_len[prog->chunk];
+		prog->chunk++;
+		regprog_continue(prog);
+	}
+}
+
+/* write the registers of a program to the device. a program only runs once at
+ * a time. */
+void aes_regprog_run(struct fp_img_dev *dev, struct aes_regprog *prog,
+	aes_write_regv_cb callback, void *user_data)
+{
+	BUG_ON(prog->callback);
+	fp_dbg("write %d URBs", prog->num_chunks);
+	prog->imgdev = dev;
+	prog->chunk = 0;
+	prog->offset = 0;
+	prog->callback = callback;
+	prog->user_data = user_data;
+	regprog_continue(prog);
 }
 
 /* write a load of registers to the device, combining multiple writes in a
@@ -148,15 +191,16 @@ static void continue_write_regv(struct write_regv_data *wdata)
 void aes_write_regv(struct fp_img_dev *dev, const struct aes_regwrite *regs,
 	unsigned int num_regs, aes_write_regv_cb callback, void *user_data)
 {
-	struct write_regv_data *wdata = g_malloc(sizeof(*wdata));
+	struct aes_regprog *prog;
+
 	fp_dbg("write %d regs", num_regs);
-	wdata->imgdev = dev;
-	wdata->num_regs = num_regs;
-	wdata->regs = regs;
-	wdata->offset = 0;
-	wdata->callback = callback;
-	wdata->user_data = user_data;
-	continue_write_regv(wdata);
+	prog = aes_regprog_compile(regs, num_regs);
+	if (!prog) {
+		callback(dev, -ENOMEM, user_data);
+		return;
+	}
+	prog->oneshot = TRUE;
+	aes_regprog_run(dev, prog, callback, user_data);
 }
 
 unsigned char aes_get_pixel(struct fpi_frame_asmbl_ctx *ctx,
@@ -164,11 +208,6 @@ unsigned char aes_get_pixel(struct fpi_frame_asmbl_ctx *ctx,
 					  unsigned int x,
 					  unsigned int y)
 {
-	unsigned char ret;
-
-	ret = frame->data[x * (ctx->frame_height >> 1) + (y >> 1)];
-	ret = y % 2 ? ret >> 4 : ret & 0xf;
-	ret *= 17;
-
-	return ret;
+	return aes_pixel(frame->data, ctx->frame_width, ctx->frame_height,
+			 x, y);
 }
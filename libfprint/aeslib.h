@@ -36,6 +36,28 @@ typedef void (*aes_write_regv_cb)(struct fp_img_dev *dev, int result,
 void aes_write_regv(struct fp_img_dev *dev, const struct aes_regwrite *regs,
 	unsigned int num_regs, aes_write_regv_cb callback, void *user_data);
 
+struct aes_regprog;
+
+struct aes_regprog *aes_regprog_compile(const struct aes_regwrite *regs,
+	unsigned int num_regs);
+void aes_regprog_free(struct aes_regprog *prog);
+void aes_regprog_run(struct fp_img_dev *dev, struct aes_regprog *prog,
+	aes_write_regv_cb callback, void *user_data);
+
+/* Pixel of a frame as the sensors send them, 4 bits per pixel, column after
+ * column */
+static inline unsigned char aes_pixel(const unsigned char *data,
+				      unsigned int width,
+				      unsigned int height,
+				      unsigned int x,
+				      unsigned int y)
+{
+	unsigned char ret = data[x * (height >> 1) + (y >> 1)];
+
+	ret = y % 2 ? ret >> 4 : ret & 0xf;
+	return ret * 17;
+}
+
 unsigned char aes_get_pixel(struct fpi_frame_asmbl_ctx *ctx,
 			    struct fpi_frame *frame,
 			    unsigned int x,
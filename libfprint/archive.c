@@ -0,0 +1,420 @@
+/*
+ * Captured image archiving for libfprint
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "archive"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "fp_internal.h"
+
+/** @defgroup img_archive Image archives
+ * An image archive keeps every image captured by the devices it is attached
+ * to with fp_dev_set_img_archive(), as the sensor delivered it. Images are
+ * copied when captured and written out by a thread of the archive, so that
+ * enrollment, verification and identification never wait for the disk.
+ * Writes are synced in batches, see fp_img_archive_set_sync_batch().
+ *
+ * An archive is a single file which is only ever appended to. Each image is
+ * stored as a record made of a little-endian header followed by the pixels,
+ * optionally compressed with PackBits:
+ *  - magic "FPAR"
+ *  - 1 byte encoding: 0 for raw pixels, 1 for PackBits
+ *  - 2 bytes driver ID and 4 bytes device type of the capturing device
+ *  - 8 bytes capture time, in microseconds since the epoch
+ *  - 4 bytes width, 4 bytes height and 2 bytes image flags
+ *  - 4 bytes length of the data which follows, and its 4 bytes FNV-1a hash
+ *
+ * A record left incomplete by a crash is dropped when the archive is opened
+ * again.
+ */
+
+#define ARCHIVE_MAGIC		"FPAR"
+#define ARCHIVE_PERMS		0600
+#define MAX_QUEUED		64
+#define DEFAULT_SYNC_BATCH	32
+
+enum archive_encoding {
+	ARCHIVE_RAW = 0,
+	ARCHIVE_PACKBITS = 1,
+};
+
+struct archive_record {
+	char magic[4];
+	uint8_t encoding;
+	uint16_t driver_id;
+	uint32_t devtype;
+	int64_t captured;
+	uint32_t width;
+	uint32_t height;
+	uint16_t flags;
+	uint32_t length;
+	uint32_t checksum;
+} __attribute__((__packed__));
+
+/* An image waiting to be written */
+struct archive_item {
+	uint16_t driver_id;
+	uint32_t devtype;
+	gint64 captured;
+	int width;
+	int height;
+	uint16_t flags;
+	size_t length;
+	unsigned char pixels[0];
+};
+
+struct fp_img_archive {
+	int fd;
+	unsigned int flags;
+	GThread *thread;
+	GAsyncQueue *queue;
+	volatile gint queued;
+	volatile gint sync_batch;
+
+	/* protected by lock */
+	GMutex lock;
+	int error;
+	guint64 dropped;
+};
+
+/* pushed to stop the thread */
+static struct archive_item stop_item;
+
+/* FNV-1a */
+static uint32_t archive_checksum(const unsigned char *data, size_t length)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < length; i++) {
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/* Largest PackBits output for length bytes */
+#define PACKBITS_BOUND(length)	((length) + (length) / 128 + 1)
+
+/* PackBits: a header byte n from 0 to 127 is followed by n + 1 literal
+ * bytes, and n from -127 to -1 by one byte repeated 1 - n times. Runs of two
+ * bytes are left within literals, where they cost nothing more. Returns the
+ * length of the output. */
+static size_t packbits(const unsigned char *src, size_t length,
+	unsigned char *dst)
+{
+	size_t i = 0, o = 0;
+
+	while (i < length) {
+		size_t run = 1;
+		size_t start, n;
+
+		while (i + run < length && run < 128 && src[i + run] == src[i])
+			run++;
+		if (run >= 3) {
+			dst[o++] = (unsigned char) (1 - (int) run);
+			dst[o++] = src[i];
+			i += run;
+			continue;
+		}
+
+		/* literals, up to the next run worth encoding */
+		start = i;
+		for (n = 0; i < length && n < 128; i++, n++)
+			if (i + 2 < length && src[i] == src[i + 1] &&
+			    src[i] == src[i + 2])
+				break;
+		dst[o++] = n - 1;
+		memcpy(dst + o, src + start, n);
+		o += n;
+	}
+
+	return o;
+}
+
+static int archive_write_all(int fd, const void *buf, size_t length)
+{
+	const unsigned char *p = buf;
+
+	while (length) {
+		ssize_t r = write(fd, p, length);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += r;
+		length -= r;
+	}
+
+	return 0;
+}
+
+static void archive_set_error(struct fp_img_archive *archive, int error)
+{
+	fp_err("archiving failed: %s", g_strerror(-error));
+	g_mutex_lock(&archive->lock);
+	if (!archive->error)
+		archive->error = error;
+	g_mutex_unlock(&archive->lock);
+}
+
+static void archive_write_item(struct fp_img_archive *archive,
+	struct archive_item *item, unsigned char **buf, size_t *buf_size)
+{
+	struct archive_record rec;
+	const unsigned char *data = item->pixels;
+	size_t length = item->length;
+	int r;
+
+	memcpy(rec.magic, ARCHIVE_MAGIC, sizeof(rec.magic));
+	rec.encoding = ARCHIVE_RAW;
+	if (archive->flags & FP_IMG_ARCHIVE_COMPRESS) {
+		size_t packed_length;
+
+		if (*buf_size < PACKBITS_BOUND(item->length)) {
+			*buf_size = PACKBITS_BOUND(item->length);
+			*buf = g_realloc(*buf, *buf_size);
+		}
+		packed_length = packbits(item->pixels, item->length, *buf);
+		if (packed_length < item->length) {
+			rec.encoding = ARCHIVE_PACKBITS;
+			data = *buf;
+			length = packed_length;
+		}
+	}
+	rec.driver_id = GUINT16_TO_LE(item->driver_id);
+	rec.devtype = GUINT32_TO_LE(item->devtype);
+	rec.captured = GINT64_TO_LE(item->captured);
+	rec.width = GUINT32_TO_LE(item->width);
+	rec.height = GUINT32_TO_LE(item->height);
+	rec.flags = GUINT16_TO_LE(item->flags);
+	rec.length = GUINT32_TO_LE(length);
+	rec.checksum = GUINT32_TO_LE(archive_checksum(data, length));
+
+	r = archive_write_all(archive->fd, &rec, sizeof(rec));
+	if (r == 0)
+		r = archive_write_all(archive->fd, data, length);
+	if (r < 0)
+		archive_set_error(archive, r);
+}
+
+static void archive_sync(struct fp_img_archive *archive)
+{
+	if (fdatasync(archive->fd) < 0)
+		archive_set_error(archive, -errno);
+}
+
+/* Writes queued images until stopped, syncing after every batch and
+ * whenever the queue runs empty */
+static gpointer archive_thread(gpointer data)
+{
+	struct fp_img_archive *archive = data;
+	struct archive_item *item;
+	unsigned char *buf = NULL;
+	size_t buf_size = 0;
+	int unsynced = 0;
+
+	while ((item = g_async_queue_pop(archive->queue)) != &stop_item) {
+		archive_write_item(archive, item, &buf, &buf_size);
+		g_atomic_int_add(&archive->queued, -1);
+		g_free(item);
+
+		if (++unsynced >= g_atomic_int_get(&archive->sync_batch) ||
+		    g_async_queue_length(archive->queue) == 0) {
+			archive_sync(archive);
+			unsynced = 0;
+		}
+	}
+	if (unsynced)
+		archive_sync(archive);
+
+	g_free(buf);
+	return NULL;
+}
+
+/* Finds the end of the last complete record, from which to append */
+static int archive_recover(int fd, const char *path)
+{
+	struct archive_record rec;
+	off_t end, offset = 0;
+
+	end = lseek(fd, 0, SEEK_END);
+	if (end < 0)
+		return -errno;
+
+	while (offset + (off_t) sizeof(rec) <= end) {
+		ssize_t r = pread(fd, &rec, sizeof(rec), offset);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if ((size_t) r < sizeof(rec) ||
+		    memcmp(rec.magic, ARCHIVE_MAGIC, sizeof(rec.magic)) ||
+		    offset + (off_t) sizeof(rec) + GUINT32_FROM_LE(rec.length) > end)
+			break;
+		offset += sizeof(rec) + GUINT32_FROM_LE(rec.length);
+	}
+
+	if (offset < end) {
+		fp_err("dropping %lld trailing bytes of %s", (long long) (end - offset),
+			path);
+		if (ftruncate(fd, offset) < 0)
+			return -errno;
+	}
+	return 0;
+}
+
+/** \ingroup img_archive
+ * Opens an image archive, creating it if needed. Images are appended to the
+ * ones already in the file.
+ *
+ * \param path the file to archive images to
+ * \param flags a combination of #fp_img_archive_flags
+ * \param archive output location for the archive, to be closed with
+ * fp_img_archive_close()
+ * \returns 0 on success, negative error code otherwise
+ */
+API_EXPORTED int fp_img_archive_open(const char *path, unsigned int flags,
+	struct fp_img_archive **archive)
+{
+	struct fp_img_archive *a;
+	GError *error = NULL;
+	int fd, r;
+
+	fd = g_open(path, O_RDWR | O_CREAT | O_APPEND, ARCHIVE_PERMS);
+	if (fd < 0) {
+		r = -errno;
+		fp_err("couldn't open %s: %s", path, g_strerror(errno));
+		return r;
+	}
+
+	r = archive_recover(fd, path);
+	if (r < 0) {
+		fp_err("couldn't recover %s: %s", path, g_strerror(-r));
+		close(fd);
+		return r;
+	}
+
+	a = g_malloc0(sizeof(*a));
+	a->fd = fd;
+	a->flags = flags;
+	a->sync_batch = DEFAULT_SYNC_BATCH;
+	a->queue = g_async_queue_new();
+	g_mutex_init(&a->lock);
+	a->thread = g_thread_try_new("fp-archive", archive_thread, a, &error);
+	if (!a->thread) {
+		fp_err("couldn't start archive thread: %s", error->message);
+		g_error_free(error);
+		g_async_queue_unref(a->queue);
+		g_mutex_clear(&a->lock);
+		g_free(a);
+		close(fd);
+		return -ENOMEM;
+	}
+
+	*archive = a;
+	return 0;
+}
+
+/** \ingroup img_archive
+ * Sets how many images are written to an archive between two syncs to
+ * disk, whatever comes first between that and the queue of images to write
+ * running empty. Larger batches let the archive keep up with more captures,
+ * at the cost of more images lost on a power failure. The default is 32.
+ *
+ * \param archive the archive
+ * \param nr_images the number of images, 1 to sync after every image
+ */
+API_EXPORTED void fp_img_archive_set_sync_batch(
+	struct fp_img_archive *archive, unsigned int nr_images)
+{
+	g_atomic_int_set(&archive->sync_batch,
+		CLAMP(nr_images, 1, G_MAXINT));
+}
+
+/** \ingroup img_archive
+ * Closes an archive, once the images waiting to be written are written and
+ * synced. The archive must have been detached from all devices.
+ *
+ * \param archive the archive to close, or NULL
+ * \returns 0 if every image captured since the archive was opened got
+ * written, the first write error, or -ENOSPC if images had to be dropped
+ * because the disk could not keep up
+ */
+API_EXPORTED int fp_img_archive_close(struct fp_img_archive *archive)
+{
+	int r;
+
+	if (!archive)
+		return 0;
+
+	g_async_queue_push(archive->queue, &stop_item);
+	g_thread_join(archive->thread);
+	g_async_queue_unref(archive->queue);
+
+	r = archive->error;
+	if (!r && archive->dropped) {
+		fp_err("%" G_GUINT64_FORMAT " images were dropped",
+			archive->dropped);
+		r = -ENOSPC;
+	}
+	if (close(archive->fd) < 0 && !r)
+		r = -errno;
+
+	g_mutex_clear(&archive->lock);
+	g_free(archive);
+	return r;
+}
+
+/* Queues a copy of a captured image. The image is dropped if too many are
+ * already waiting, rather than holding up the device. */
+void fpi_img_archive_add(struct fp_img_archive *archive, struct fp_dev *dev,
+	struct fp_img *img)
+{
+	struct archive_item *item;
+	size_t length = (size_t) img->width * img->height;
+
+	if (g_atomic_int_get(&archive->queued) >= MAX_QUEUED) {
+		fp_err("archive queue full, dropping image");
+		g_mutex_lock(&archive->lock);
+		archive->dropped++;
+		g_mutex_unlock(&archive->lock);
+		return;
+	}
+
+	item = g_malloc(sizeof(*item) + length);
+	item->driver_id = dev->drv->id;
+	item->devtype = dev->devtype;
+	item->captured = g_get_real_time();
+	item->width = img->width;
+	item->height = img->height;
+	item->flags = img->flags;
+	item->length = length;
+	memcpy(item->pixels, img->data, length);
+
+	g_atomic_int_inc(&archive->queued);
+	g_async_queue_push(archive->queue, item);
+}
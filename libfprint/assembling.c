@@ -22,55 +22,412 @@
 #define FP_COMPONENT "assembling"
 
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <libusb.h>
 #include <glib.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "fp_internal.h"
 #include "assembling.h"
 
+/* Pixel difference kernels.
+ *
+ * The movement estimation and the get_deviation callbacks of the line
+ * assembling drivers spend most of their time reducing rows of pixels. The
+ * vector versions are picked at build time, from the instruction sets the
+ * compiler targets; the scalar loops handle the remaining pixels and the
+ * other architectures.
+ */
+
+/* Sum of absolute differences of two rows of len pixels */
+unsigned int fpi_sad(const unsigned char *buf1, const unsigned char *buf2,
+		     unsigned int len)
+{
+	unsigned int i = 0, res = 0;
+
+#if defined(__AVX2__)
+	__m256i acc = _mm256_setzero_si256();
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i v1 = _mm256_loadu_si256((const __m256i *)(buf1 + i));
+		__m256i v2 = _mm256_loadu_si256((const __m256i *)(buf2 + i));
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(v1, v2));
+	}
+	acc = _mm256_add_epi64(acc, _mm256_srli_si256(acc, 8));
+	res = _mm256_extract_epi32(acc, 0) + _mm256_extract_epi32(acc, 4);
+#elif defined(__SSE2__)
+	__m128i acc = _mm_setzero_si128();
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(buf1 + i));
+		__m128i v2 = _mm_loadu_si128((const __m128i *)(buf2 + i));
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(v1, v2));
+	}
+	acc = _mm_add_epi64(acc, _mm_srli_si128(acc, 8));
+	res = _mm_cvtsi128_si32(acc);
+#elif defined(__ARM_NEON)
+	uint32x4_t acc = vdupq_n_u32(0);
+
+	while (i + 16 <= len) {
+		/* 16-bit lanes hold up to 128 iterations */
+		uint16x8_t acc16 = vdupq_n_u16(0);
+		unsigned int end = MIN(len, i + 128 * 16);
+
+		for (; i + 16 <= end; i += 16)
+			acc16 = vpadalq_u8(acc16, vabdq_u8(vld1q_u8(buf1 + i),
+							  vld1q_u8(buf2 + i)));
+		acc = vpadalq_u16(acc, acc16);
+	}
+	res = vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) +
+	      vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+#endif
+
+	for (; i < len; i++)
+		res += abs((int)buf1[i] - (int)buf2[i]);
+
+	return res;
+}
+
+/* Sum of squared differences of two rows of len pixels */
+unsigned int fpi_ssd(const unsigned char *buf1, const unsigned char *buf2,
+		     unsigned int len)
+{
+	unsigned int i = 0, res = 0;
+
+#if defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128();
+	__m128i acc = _mm_setzero_si128();
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(buf1 + i));
+		__m128i v2 = _mm_loadu_si128((const __m128i *)(buf2 + i));
+		__m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(v1, zero),
+					   _mm_unpacklo_epi8(v2, zero));
+		__m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(v1, zero),
+					   _mm_unpackhi_epi8(v2, zero));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+	}
+	acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 8));
+	acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 4));
+	res = _mm_cvtsi128_si32(acc);
+#elif defined(__ARM_NEON)
+	uint32x4_t acc = vdupq_n_u32(0);
+
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t d = vabdq_u8(vld1q_u8(buf1 + i), vld1q_u8(buf2 + i));
+		uint16x8_t lo = vmull_u8(vget_low_u8(d), vget_low_u8(d));
+		uint16x8_t hi = vmull_u8(vget_high_u8(d), vget_high_u8(d));
+		acc = vpadalq_u16(acc, lo);
+		acc = vpadalq_u16(acc, hi);
+	}
+	res = vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) +
+	      vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+#endif
+
+	for (; i < len; i++) {
+		int dev = (int)buf1[i] - (int)buf2[i];
+		res += dev * dev;
+	}
+
+	return res;
+}
+
+/* Squared standard deviation of buf1[i] + buf2[i], taking len pixels every
+ * stride pixels. Same result as computing the mean first, then the
+ * deviations from it, but in a single pass.
+ */
+int fpi_std_sq_dev2(const unsigned char *buf1, const unsigned char *buf2,
+		    unsigned int len, unsigned int stride)
+{
+	unsigned int i = 0;
+	guint64 sum = 0, sq = 0;
+	guint64 mean;
+
+	if (len == 0)
+		return 0;
+
+#if defined(__SSE2__)
+	if (stride == 1 || stride == 2) {
+		__m128i zero = _mm_setzero_si128();
+		__m128i ones = _mm_set1_epi16(1);
+		__m128i even = _mm_set1_epi16(0xff);
+		__m128i acc_sum = _mm_setzero_si128();
+		__m128i acc_sq = _mm_setzero_si128();
+		unsigned int step = stride == 2 ? 8 : 16, j;
+		guint32 lanes[4];
+
+		/* Loads are 16 bytes, so don't let them run past the last
+		 * pixel when pixels are interleaved */
+		for (; i + step <= len - (stride == 2); i += step) {
+			__m128i v1 = _mm_loadu_si128((const __m128i *)(buf1 + i * stride));
+			__m128i v2 = _mm_loadu_si128((const __m128i *)(buf2 + i * stride));
+			__m128i lo, hi;
+
+			if (stride == 2) {
+				lo = _mm_add_epi16(_mm_and_si128(v1, even),
+						   _mm_and_si128(v2, even));
+				acc_sum = _mm_add_epi32(acc_sum, _mm_madd_epi16(lo, ones));
+				acc_sq = _mm_add_epi32(acc_sq, _mm_madd_epi16(lo, lo));
+				continue;
+			}
+
+			lo = _mm_add_epi16(_mm_unpacklo_epi8(v1, zero),
+					   _mm_unpacklo_epi8(v2, zero));
+			hi = _mm_add_epi16(_mm_unpackhi_epi8(v1, zero),
+					   _mm_unpackhi_epi8(v2, zero));
+			acc_sum = _mm_add_epi32(acc_sum, _mm_madd_epi16(lo, ones));
+			acc_sum = _mm_add_epi32(acc_sum, _mm_madd_epi16(hi, ones));
+			acc_sq = _mm_add_epi32(acc_sq, _mm_madd_epi16(lo, lo));
+			acc_sq = _mm_add_epi32(acc_sq, _mm_madd_epi16(hi, hi));
+		}
+
+		_mm_storeu_si128((__m128i *)lanes, acc_sum);
+		for (j = 0; j < 4; j++)
+			sum += lanes[j];
+		_mm_storeu_si128((__m128i *)lanes, acc_sq);
+		for (j = 0; j < 4; j++)
+			sq += lanes[j];
+	}
+#elif defined(__ARM_NEON)
+	if (stride == 1 || stride == 2) {
+		uint32x4_t acc_sum = vdupq_n_u32(0);
+		uint32x4_t acc_sq = vdupq_n_u32(0);
+
+		/* Interleaved loads are 32 bytes, so don't let them run past
+		 * the last pixel */
+		for (; i + 16 <= len - (stride == 2); i += 16) {
+			uint16x8_t lo, hi;
+
+			if (stride == 2) {
+				uint8x16_t v1 = vld2q_u8(buf1 + i * 2).val[0];
+				uint8x16_t v2 = vld2q_u8(buf2 + i * 2).val[0];
+
+				lo = vaddl_u8(vget_low_u8(v1), vget_low_u8(v2));
+				hi = vaddl_u8(vget_high_u8(v1), vget_high_u8(v2));
+			} else {
+				uint8x16_t v1 = vld1q_u8(buf1 + i);
+				uint8x16_t v2 = vld1q_u8(buf2 + i);
+
+				lo = vaddl_u8(vget_low_u8(v1), vget_low_u8(v2));
+				hi = vaddl_u8(vget_high_u8(v1), vget_high_u8(v2));
+			}
+			acc_sum = vpadalq_u16(acc_sum, vaddq_u16(lo, hi));
+			acc_sq = vmlal_u16(acc_sq, vget_low_u16(lo), vget_low_u16(lo));
+			acc_sq = vmlal_u16(acc_sq, vget_high_u16(lo), vget_high_u16(lo));
+			acc_sq = vmlal_u16(acc_sq, vget_low_u16(hi), vget_low_u16(hi));
+			acc_sq = vmlal_u16(acc_sq, vget_high_u16(hi), vget_high_u16(hi));
+		}
+
+		sum = (guint64)vgetq_lane_u32(acc_sum, 0) +
+		      vgetq_lane_u32(acc_sum, 1) +
+		      vgetq_lane_u32(acc_sum, 2) + vgetq_lane_u32(acc_sum, 3);
+		sq = (guint64)vgetq_lane_u32(acc_sq, 0) +
+		     vgetq_lane_u32(acc_sq, 1) +
+		     vgetq_lane_u32(acc_sq, 2) + vgetq_lane_u32(acc_sq, 3);
+	}
+#endif
+
+	for (; i < len; i++) {
+		unsigned int v = (unsigned int)buf1[i * stride] + buf2[i * stride];
+		sum += v;
+		sq += v * v;
+	}
+
+	/* sum((v - mean)^2) = sum(v^2) - 2 * mean * sum(v) + len * mean^2 */
+	mean = sum / len;
+	return (sq - 2 * mean * sum + len * mean * mean) / len;
+}
+
+/* Statistics the swipe drivers check on every line they read, to tell when
+ * the finger is gone and which lines repeat the previous one, in a single
+ * pass over the line: the same results as fpi_std_sq_dev(line, len) and
+ * fpi_mean_sq_diff_norm(prev, line, len). prev may be NULL, mean_sq_diff is
+ * 0 then.
+ */
+void fpi_line_stats(const unsigned char *line, const unsigned char *prev,
+		    unsigned int len, struct fpi_line_stats *stats)
+{
+	unsigned int i = 0;
+	guint64 sum = 0, sq = 0, diff = 0;
+	guint64 mean;
+
+	if (len == 0) {
+		stats->std_sq_dev = 0;
+		stats->mean_sq_diff = 0;
+		return;
+	}
+
+#if defined(__SSE2__)
+	{
+		__m128i zero = _mm_setzero_si128();
+		__m128i ones = _mm_set1_epi16(1);
+		__m128i acc_sum = _mm_setzero_si128();
+		__m128i acc_sq = _mm_setzero_si128();
+		__m128i acc_diff = _mm_setzero_si128();
+		guint32 lanes[4];
+		unsigned int j;
+
+		for (; i + 16 <= len; i += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(line + i));
+			__m128i lo = _mm_unpacklo_epi8(v, zero);
+			__m128i hi = _mm_unpackhi_epi8(v, zero);
+
+			acc_sum = _mm_add_epi32(acc_sum, _mm_madd_epi16(lo, ones));
+			acc_sum = _mm_add_epi32(acc_sum, _mm_madd_epi16(hi, ones));
+			acc_sq = _mm_add_epi32(acc_sq, _mm_madd_epi16(lo, lo));
+			acc_sq = _mm_add_epi32(acc_sq, _mm_madd_epi16(hi, hi));
+			if (prev) {
+				__m128i p = _mm_loadu_si128((const __m128i *)(prev + i));
+
+				lo = _mm_sub_epi16(lo, _mm_unpacklo_epi8(p, zero));
+				hi = _mm_sub_epi16(hi, _mm_unpackhi_epi8(p, zero));
+				acc_diff = _mm_add_epi32(acc_diff, _mm_madd_epi16(lo, lo));
+				acc_diff = _mm_add_epi32(acc_diff, _mm_madd_epi16(hi, hi));
+			}
+		}
+
+		_mm_storeu_si128((__m128i *)lanes, acc_sum);
+		for (j = 0; j < 4; j++)
+			sum += lanes[j];
+		_mm_storeu_si128((__m128i *)lanes, acc_sq);
+		for (j = 0; j < 4; j++)
+			sq += lanes[j];
+		_mm_storeu_si128((__m128i *)lanes, acc_diff);
+		for (j = 0; j < 4; j++)
+			diff += lanes[j];
+	}
+#elif defined(__ARM_NEON)
+	{
+		uint32x4_t acc_sum = vdupq_n_u32(0);
+		uint32x4_t acc_sq = vdupq_n_u32(0);
+		uint32x4_t acc_diff = vdupq_n_u32(0);
+
+		for (; i + 16 <= len; i += 16) {
+			uint8x16_t v = vld1q_u8(line + i);
+			uint16x8_t lo = vmull_u8(vget_low_u8(v), vget_low_u8(v));
+			uint16x8_t hi = vmull_u8(vget_high_u8(v), vget_high_u8(v));
+
+			acc_sum = vpadalq_u16(acc_sum, vpaddlq_u8(v));
+			acc_sq = vpadalq_u16(acc_sq, lo);
+			acc_sq = vpadalq_u16(acc_sq, hi);
+			if (prev) {
+				uint8x16_t d = vabdq_u8(v, vld1q_u8(prev + i));
+
+				lo = vmull_u8(vget_low_u8(d), vget_low_u8(d));
+				hi = vmull_u8(vget_high_u8(d), vget_high_u8(d));
+				acc_diff = vpadalq_u16(acc_diff, lo);
+				acc_diff = vpadalq_u16(acc_diff, hi);
+			}
+		}
+
+		sum = (guint64)vgetq_lane_u32(acc_sum, 0) +
+		      vgetq_lane_u32(acc_sum, 1) +
+		      vgetq_lane_u32(acc_sum, 2) + vgetq_lane_u32(acc_sum, 3);
+		sq = (guint64)vgetq_lane_u32(acc_sq, 0) +
+		     vgetq_lane_u32(acc_sq, 1) +
+		     vgetq_lane_u32(acc_sq, 2) + vgetq_lane_u32(acc_sq, 3);
+		diff = (guint64)vgetq_lane_u32(acc_diff, 0) +
+		       vgetq_lane_u32(acc_diff, 1) +
+		       vgetq_lane_u32(acc_diff, 2) + vgetq_lane_u32(acc_diff, 3);
+	}
+#endif
+
+	for (; i < len; i++) {
+		unsigned int v = line[i];
+
+		sum += v;
+		sq += v * v;
+		if (prev) {
+			int d = (int)v - prev[i];
+			diff += d * d;
+		}
+	}
+
+	mean = sum / len;
+	stats->std_sq_dev = (sq - 2 * mean * sum + len * mean * mean) / len;
+	stats->mean_sq_diff = diff / len;
+}
+
+/* Frames are unpacked once into row-major 8-bit planes, so that movement
+ * estimation and blitting don't go through get_pixel for every access.
+ */
+static void unpack_frame(struct fpi_frame_asmbl_ctx *ctx,
+			 struct fpi_frame *frame,
+			 unsigned char *plane)
+{
+	unsigned int x, y;
+
+	if (ctx->unpack_frame) {
+		ctx->unpack_frame(ctx, frame, plane);
+		return;
+	}
+
+	for (y = 0; y < ctx->frame_height; y++)
+		for (x = 0; x < ctx->frame_width; x++)
+			*plane++ = ctx->get_pixel(ctx, frame, x, y);
+}
+
+static unsigned char *unpack_frames(struct fpi_frame_asmbl_ctx *ctx,
+				    GSList *stripes, size_t num_stripes)
+{
+	size_t frame_size = ctx->frame_width * ctx->frame_height;
+	unsigned char *planes = g_malloc(num_stripes * frame_size);
+	GSList *list_entry;
+	size_t i;
+
+	for (i = 0, list_entry = stripes; i < num_stripes;
+	     i++, list_entry = g_slist_next(list_entry))
+		unpack_frame(ctx, list_entry->data, planes + i * frame_size);
+
+	return planes;
+}
+
 static unsigned int calc_error(struct fpi_frame_asmbl_ctx *ctx,
-			       struct fpi_frame *first_frame,
-			       struct fpi_frame *second_frame,
+			       const unsigned char *first_plane,
+			       const unsigned char *second_plane,
 			       int dx,
-			       int dy)
+			       int dy,
+			       unsigned int step)
 {
 	unsigned int width, height;
-	unsigned int x1, y1, x2, y2, err, i, j;
+	unsigned int x, y, err, npix;
+	const unsigned char *p1, *p2;
 
 	width = ctx->frame_width - (dx > 0 ? dx : -dx);
 	height = ctx->frame_height - dy;
 
-	y1 = 0;
-	y2 = dy;
-	i = 0;
+	p1 = first_plane + (dx < 0 ? 0 : dx);
+	p2 = second_plane + dy * ctx->frame_width + (dx < 0 ? -dx : 0);
 	err = 0;
-	do {
-		x1 = dx < 0 ? 0 : dx;
-		x2 = dx < 0 ? -dx : 0;
-		j = 0;
-
-		do {
-			unsigned char v1, v2;
-
-
-			v1 = ctx->get_pixel(ctx, first_frame, x1, y1);
-			v2 = ctx->get_pixel(ctx, second_frame, x2, y2);
-			err += v1 > v2 ? v1 - v2 : v2 - v1;
-			j++;
-			x1++;
-			x2++;
-
-		} while (j < width);
-		i++;
-		y1++;
-		y2++;
-	} while (i < height);
+	npix = 0;
+	for (y = 0; y < height; y += step) {
+		if (step == 1) {
+			err += fpi_sad(p1, p2, width);
+			npix += width;
+		} else {
+			for (x = 0; x < width; x += step) {
+				err += abs((int)p1[x] - (int)p2[x]);
+				npix++;
+			}
+		}
+		p1 += step * ctx->frame_width;
+		p2 += step * ctx->frame_width;
+	}
 
 	/* Normalize error */
 	err *= (ctx->frame_height * ctx->frame_width);
-	err /= (height * width);
+	err /= npix;
 
 	if (err == 0)
 		return INT_MAX;
@@ -78,68 +435,232 @@ static unsigned int calc_error(struct fpi_frame_asmbl_ctx *ctx,
 	return err;
 }
 
+/* Seeking in horizontal and vertical dimensions,
+ * for horizontal dimension we'll check only 8 pixels
+ * in both directions. For vertical direction diff is
+ * rarely less than 2, so start with it.
+ */
+#define MIN_DX		-8
+#define MAX_DX		7
+#define MIN_DY		2
+
+/* Coarse-to-fine search: every other offset is tried on frames subsampled
+ * by COARSE_STEP, then the offsets around the COARSE_CANDIDATES best ones
+ * are tried at full resolution.
+ */
+#define COARSE_STEP		2
+#define COARSE_CANDIDATES	4
+
+/* Offsets tried around a hint, in both dimensions */
+#define HINT_RADIUS		2
+
+static void try_overlap(struct fpi_frame_asmbl_ctx *ctx,
+			const unsigned char *first_plane,
+			const unsigned char *second_plane,
+			struct fpi_frame *second_frame,
+			int dx, int dy,
+			unsigned int *min_error)
+{
+	unsigned int err;
+
+	err = calc_error(ctx, first_plane, second_plane, dx, dy, 1);
+	if (err < *min_error) {
+		*min_error = err;
+		second_frame->delta_x = -dx;
+		second_frame->delta_y = dy;
+	}
+}
+
+static void find_overlap_coarse(struct fpi_frame_asmbl_ctx *ctx,
+				const unsigned char *first_plane,
+				const unsigned char *second_plane,
+				struct fpi_frame *second_frame,
+				unsigned int *min_error)
+{
+	unsigned int errs[COARSE_CANDIDATES];
+	int dxs[COARSE_CANDIDATES], dys[COARSE_CANDIDATES];
+	int num = 0;
+	int dx, dy, i, j;
+	unsigned int err;
+
+	/* Keep the best candidates sorted by error */
+	for (dy = MIN_DY; dy < ctx->frame_height; dy += COARSE_STEP) {
+		for (dx = MIN_DX; dx <= MAX_DX; dx += COARSE_STEP) {
+			err = calc_error(ctx, first_plane, second_plane,
+				dx, dy, COARSE_STEP);
+			if (num == COARSE_CANDIDATES && err >= errs[num - 1])
+				continue;
+			if (num < COARSE_CANDIDATES)
+				num++;
+			for (i = num - 1; i > 0 && errs[i - 1] > err; i--) {
+				errs[i] = errs[i - 1];
+				dxs[i] = dxs[i - 1];
+				dys[i] = dys[i - 1];
+			}
+			errs[i] = err;
+			dxs[i] = dx;
+			dys[i] = dy;
+		}
+	}
+
+	for (i = 0; i < num; i++) {
+		for (dy = MAX(dys[i] - 1, MIN_DY);
+		     dy <= MIN(dys[i] + 1, (int)ctx->frame_height - 1); dy++) {
+			for (dx = MAX(dxs[i] - 1, MIN_DX);
+			     dx <= MIN(dxs[i] + 1, MAX_DX); dx++) {
+				/* Skip offsets a better candidate covered */
+				for (j = 0; j < i; j++)
+					if (ABS(dx - dxs[j]) <= 1 &&
+					    ABS(dy - dys[j]) <= 1)
+						break;
+				if (j == i)
+					try_overlap(ctx, first_plane,
+						second_plane, second_frame,
+						dx, dy, min_error);
+			}
+		}
+	}
+}
+
+/* Tries the offsets around a hint. Returns FALSE if the best one is at the
+ * edge of the window, where the actual offset may well be outside of it. */
+static gboolean find_overlap_hinted(struct fpi_frame_asmbl_ctx *ctx,
+				    const unsigned char *first_plane,
+				    const unsigned char *second_plane,
+				    struct fpi_frame *second_frame,
+				    const struct fpi_delta_hint *hint,
+				    unsigned int *min_error)
+{
+	unsigned int max_error = *min_error;
+	int max_dy = ctx->frame_height - 1;
+	int x0 = MAX(-hint->delta_x - HINT_RADIUS, MIN_DX);
+	int x1 = MIN(-hint->delta_x + HINT_RADIUS, MAX_DX);
+	int y0 = MAX(hint->delta_y - HINT_RADIUS, MIN_DY);
+	int y1 = MIN(hint->delta_y + HINT_RADIUS, max_dy);
+	int dx, dy;
+
+	if (x0 > x1 || y0 > y1)
+		return FALSE;
+
+	for (dy = y0; dy <= y1; dy++)
+		for (dx = x0; dx <= x1; dx++)
+			try_overlap(ctx, first_plane, second_plane,
+				second_frame, dx, dy, min_error);
+
+	if (*min_error == max_error)
+		return FALSE;
+
+	/* The window edges which are also the search limits are fine */
+	dx = -second_frame->delta_x;
+	dy = second_frame->delta_y;
+	return (dx > x0 || x0 == MIN_DX) && (dx < x1 || x1 == MAX_DX) &&
+	       (dy > y0 || y0 == MIN_DY) && (dy < y1 || y1 == max_dy);
+}
+
 /* This function is rather CPU-intensive. It's better to use hardware
  * to detect movement direction when possible.
  */
 static void find_overlap(struct fpi_frame_asmbl_ctx *ctx,
-			 struct fpi_frame *first_frame,
+			 const unsigned char *first_plane,
+			 const unsigned char *second_plane,
 			 struct fpi_frame *second_frame,
+			 const struct fpi_delta_hint *hint,
 			 unsigned int *min_error)
 {
 	int dx, dy;
-	unsigned int err;
 	*min_error = 255 * ctx->frame_height * ctx->frame_width;
 
-	/* Seeking in horizontal and vertical dimensions,
-	 * for horizontal dimension we'll check only 8 pixels
-	 * in both directions. For vertical direction diff is
-	 * rarely less than 2, so start with it.
-	 */
-	for (dy = 2; dy < ctx->frame_height; dy++) {
-		for (dx = -8; dx < 8; dx++) {
-			err = calc_error(ctx, first_frame, second_frame,
-				dx, dy);
-			if (err < *min_error) {
-				*min_error = err;
-				second_frame->delta_x = -dx;
-				second_frame->delta_y = dy;
-			}
-		}
+	if (hint) {
+		if (find_overlap_hinted(ctx, first_plane, second_plane,
+					second_frame, hint, min_error))
+			return;
+		*min_error = 255 * ctx->frame_height * ctx->frame_width;
 	}
+
+	if (ctx->overlap_search == FPI_OVERLAP_SEARCH_COARSE_TO_FINE) {
+		find_overlap_coarse(ctx, first_plane, second_plane,
+			second_frame, min_error);
+		return;
+	}
+
+	for (dy = MIN_DY; dy < ctx->frame_height; dy++)
+		for (dx = MIN_DX; dx <= MAX_DX; dx++)
+			try_overlap(ctx, first_plane, second_plane,
+				second_frame, dx, dy, min_error);
+}
+
+/* A stock get_delta_hint: swipes are smooth, so the offset between two
+ * frames is close to the one between the previous two. */
+gboolean fpi_delta_hint_last(struct fpi_frame_asmbl_ctx *ctx,
+			     struct fpi_frame *prev, struct fpi_frame *frame,
+			     struct fpi_delta_hint *hint)
+{
+	if (!hint->have_last)
+		return FALSE;
+
+	hint->delta_x = hint->last_x;
+	hint->delta_y = hint->last_y;
+	return TRUE;
+}
+
+/* Asks the driver for a hint, returns NULL without one */
+static const struct fpi_delta_hint *get_hint(struct fpi_frame_asmbl_ctx *ctx,
+					     struct fpi_frame *prev,
+					     struct fpi_frame *frame,
+					     struct fpi_delta_hint *hint)
+{
+	if (!ctx->get_delta_hint || !ctx->get_delta_hint(ctx, prev, frame, hint))
+		return NULL;
+	return hint;
 }
 
 static unsigned int do_movement_estimation(struct fpi_frame_asmbl_ctx *ctx,
-			    GSList *stripes, size_t num_stripes,
-			    gboolean reverse)
+			    GSList *stripes, const unsigned char *planes,
+			    size_t num_stripes, gboolean reverse)
 {
 	GSList *list_entry = stripes;
 	GTimer *timer;
 	int frame = 1;
 	struct fpi_frame *prev_stripe = list_entry->data;
+	size_t frame_size = ctx->frame_width * ctx->frame_height;
+	const unsigned char *prev_plane = planes;
 	unsigned int min_error;
 	/* Max error is width * height * 255, for AES2501 which has the largest
 	 * sensor its 192*16*255 = 783360. So for 32bit value it's ~5482 frame before
 	 * we might get int overflow. Use 64bit value here to prevent integer overflow
 	 */
 	unsigned long long total_error = 0;
+	struct fpi_delta_hint hint = { .reverse = reverse };
 
 	list_entry = g_slist_next(list_entry);
 
 	timer = g_timer_new();
 	do {
 		struct fpi_frame *cur_stripe = list_entry->data;
+		const unsigned char *cur_plane = prev_plane + frame_size;
+		const struct fpi_delta_hint *h;
 
+		h = get_hint(ctx, prev_stripe, cur_stripe, &hint);
 		if (reverse) {
-			find_overlap(ctx, prev_stripe, cur_stripe, &min_error);
+			find_overlap(ctx, prev_plane, cur_plane, cur_stripe,
+				h, &min_error);
+			hint.last_x = cur_stripe->delta_x;
+			hint.last_y = cur_stripe->delta_y;
 			prev_stripe->delta_y = -prev_stripe->delta_y;
 			prev_stripe->delta_x = -prev_stripe->delta_x;
 		}
-		else
-			find_overlap(ctx, cur_stripe, prev_stripe, &min_error);
+		else {
+			find_overlap(ctx, cur_plane, prev_plane, prev_stripe,
+				h, &min_error);
+			hint.last_x = prev_stripe->delta_x;
+			hint.last_y = prev_stripe->delta_y;
+		}
+		hint.have_last = TRUE;
 		total_error += min_error;
 
 		frame++;
 		prev_stripe = cur_stripe;
+		prev_plane = cur_plane;
 		list_entry = g_slist_next(list_entry);
 
 	} while (frame < num_stripes);
@@ -155,18 +676,62 @@ void fpi_do_movement_estimation(struct fpi_frame_asmbl_ctx *ctx,
 			    GSList *stripes, size_t num_stripes)
 {
 	int err, rev_err;
-	err = do_movement_estimation(ctx, stripes, num_stripes, FALSE);
-	rev_err = do_movement_estimation(ctx, stripes, num_stripes, TRUE);
+	unsigned char *planes;
+	int *deltas;
+	GSList *list_entry;
+	size_t i;
+
+	planes = unpack_frames(ctx, stripes, num_stripes);
+	deltas = g_new(int, 2 * num_stripes);
+
+	err = do_movement_estimation(ctx, stripes, planes, num_stripes, FALSE);
+	for (i = 0, list_entry = stripes; i < num_stripes;
+	     i++, list_entry = g_slist_next(list_entry)) {
+		struct fpi_frame *frame = list_entry->data;
+		deltas[2 * i] = frame->delta_x;
+		deltas[2 * i + 1] = frame->delta_y;
+	}
+
+	rev_err = do_movement_estimation(ctx, stripes, planes, num_stripes, TRUE);
 	fp_dbg("errors: %d rev: %d", err, rev_err);
+
+	/* Forward pass won: put its deltas back instead of running it again.
+	 * It doesn't set the last frame's one, keep it as the reverse pass
+	 * left it. */
 	if (err < rev_err) {
-		do_movement_estimation(ctx, stripes, num_stripes, FALSE);
+		for (i = 0, list_entry = stripes; i < num_stripes - 1;
+		     i++, list_entry = g_slist_next(list_entry)) {
+			struct fpi_frame *frame = list_entry->data;
+			frame->delta_x = deltas[2 * i];
+			frame->delta_y = deltas[2 * i + 1];
+		}
+	}
+
+	g_free(deltas);
+	g_free(planes);
+}
+
+/* Copies a row of a frame into the image, in standard orientation and
+ * colors: the frames are inverted, and upside down unless the swipe was
+ * reversed */
+static inline void blit_row(unsigned char *dst, const unsigned char *src,
+			    unsigned int len, gboolean rotate)
+{
+	unsigned int i;
+
+	if (rotate) {
+		for (i = 0; i < len; i++)
+			dst[-(int)i] = src[i] ^ 0xff;
+	} else {
+		for (i = 0; i < len; i++)
+			dst[i] = src[i] ^ 0xff;
 	}
 }
 
 static inline void aes_blit_stripe(struct fpi_frame_asmbl_ctx *ctx,
 				   struct fp_img *img,
-				   struct fpi_frame *stripe,
-				   int x, int y)
+				   const unsigned char *plane,
+				   int x, int y, gboolean rotate)
 {
 	unsigned int ix, iy;
 	unsigned int fx, fy;
@@ -210,17 +775,18 @@ static inline void aes_blit_stripe(struct fpi_frame_asmbl_ctx *ctx,
 	if ((iy + height) > img->height)
 		height = img->height - iy;
 
+	/* Rows start at fx and stop at width */
+	if (fx >= width)
+		return;
+
 	for (; fy < height; fy++, iy++) {
-		if (x < 0) {
-			ix = 0;
-			fx = -x;
-		} else {
-			ix = x;
-			fx = 0;
-		}
-		for (; fx < width; fx++, ix++) {
-			img->data[ix + (iy * img->width)] = ctx->get_pixel(ctx, stripe, fx, fy);
-		}
+		unsigned int offset = rotate ?
+		    img->width * img->height - 1 - ix - iy * img->width :
+		    ix + iy * img->width;
+
+		blit_row(&img->data[offset],
+			 &plane[fx + (fy * ctx->frame_width)], width - fx,
+			 rotate);
 	}
 }
 
@@ -233,6 +799,7 @@ struct fp_img *fpi_assemble_frames(struct fpi_frame_asmbl_ctx *ctx,
 	int i, y, x;
 	gboolean reverse = FALSE;
 	struct fpi_frame *fpi_frame;
+	unsigned char *plane;
 
 	BUG_ON(stripes_len == 0);
 	BUG_ON(ctx->image_width < ctx->frame_width);
@@ -263,10 +830,10 @@ struct fp_img *fpi_assemble_frames(struct fpi_frame_asmbl_ctx *ctx,
 	/* For last frame */
 	height += ctx->frame_height;
 
-	/* Create buffer big enough for max image */
+	/* Create buffer big enough for max image. The stripes are blitted in
+	 * standard form, so there is nothing left for fp_img_standardize(). */
 	img = fpi_img_new(ctx->image_width * height);
-	img->flags = FP_IMG_COLORS_INVERTED;
-	img->flags |= reverse ? 0 :  FP_IMG_H_FLIPPED | FP_IMG_V_FLIPPED;
+	memset(img->data, 0xff, ctx->image_width * height);
 	img->width = ctx->image_width;
 	img->height = height;
 
@@ -275,6 +842,7 @@ struct fp_img *fpi_assemble_frames(struct fpi_frame_asmbl_ctx *ctx,
 	stripe = stripes;
 	y = reverse ? (height - ctx->frame_height) : 0;
 	x = (ctx->image_width - ctx->frame_width) / 2;
+	plane = g_malloc(ctx->frame_width * ctx->frame_height);
 
 	do {
 		fpi_frame = stripe->data;
@@ -282,142 +850,446 @@ struct fp_img *fpi_assemble_frames(struct fpi_frame_asmbl_ctx *ctx,
 		y += fpi_frame->delta_y;
 		x += fpi_frame->delta_x;
 
-		aes_blit_stripe(ctx, img, fpi_frame, x, y);
+		unpack_frame(ctx, fpi_frame, plane);
+		aes_blit_stripe(ctx, img, plane, x, y, !reverse);
 
 		stripe = g_slist_next(stripe);
 		i++;
 	} while (i < stripes_len);
 
+	g_free(plane);
 	return img;
 }
 
-static int cmpint(const void *p1, const void *p2, gpointer data)
+/* Incremental movement estimation. Both search directions are run against
+ * the previous frame as soon as a frame is pushed, so that only the choice
+ * of the direction and the blitting are left once the finger is removed.
+ * The result is the same as fpi_do_movement_estimation() followed by
+ * fpi_assemble_frames() on the whole swipe.
+ */
+void fpi_frame_asmbl_stream_init(struct fpi_frame_asmbl_stream *stream,
+				 struct fpi_frame_asmbl_ctx *ctx)
 {
-	int a = *((int *)p1);
-	int b = *((int *)p2);
-	if (a < b)
-		return -1;
-	else if (a == b)
-		return 0;
-	else
-		return 1;
+	memset(stream, 0, sizeof(*stream));
+	stream->ctx = ctx;
+}
+
+/* Drops the frames pushed so far */
+void fpi_frame_asmbl_stream_reset(struct fpi_frame_asmbl_stream *stream)
+{
+	g_slist_free_full(stream->frames, g_free);
+	g_free(stream->planes);
+	g_free(stream->rev_deltas);
+	fpi_frame_asmbl_stream_init(stream, stream->ctx);
+}
+
+/* Takes ownership of frame, which must have been allocated with g_malloc */
+void fpi_frame_asmbl_stream_push(struct fpi_frame_asmbl_stream *stream,
+				 struct fpi_frame *frame)
+{
+	struct fpi_frame_asmbl_ctx *ctx = stream->ctx;
+	size_t frame_size = ctx->frame_width * ctx->frame_height;
+	size_t n = stream->frames_len;
+	unsigned char *plane, *prev_plane;
+	unsigned int min_error;
+
+	if (!stream->planes)
+		stream->planes = g_malloc(2 * frame_size);
+	plane = stream->planes + (n & 1) * frame_size;
+	prev_plane = stream->planes + (~n & 1) * frame_size;
+	unpack_frame(ctx, frame, plane);
+
+	/* Skip both searches for frames adding nothing to the last one. The
+	 * next frame is unpacked over this one and compared to the last frame
+	 * kept, which is still close enough to overlap. */
+	if (n > 0 && ctx->still_threshold &&
+	    fpi_sad(plane, prev_plane, frame_size) <
+	    ctx->still_threshold * frame_size) {
+		stream->frames_dropped++;
+		g_free(frame);
+		return;
+	}
+
+	if (n > 0) {
+		struct fpi_frame *prev_frame = stream->frames->data;
+		/* left at no offset if no offset beats the worst error */
+		struct fpi_frame rev_frame = { .delta_x = 0, .delta_y = 0 };
+		struct fpi_delta_hint hint = { .have_last = n > 1 };
+		const struct fpi_delta_hint *h;
+
+		/* Forward search, the offset belongs to the previous frame */
+		if (hint.have_last) {
+			struct fpi_frame *before = stream->frames->next->data;
+			hint.last_x = before->delta_x;
+			hint.last_y = before->delta_y;
+		}
+		h = get_hint(ctx, prev_frame, frame, &hint);
+		find_overlap(ctx, plane, prev_plane, prev_frame, h, &min_error);
+		stream->error += min_error;
+
+		/* Reverse search, the offset belongs to this frame */
+		hint.reverse = TRUE;
+		if (hint.have_last) {
+			hint.last_x = stream->rev_deltas[2 * (n - 1)];
+			hint.last_y = stream->rev_deltas[2 * (n - 1) + 1];
+		}
+		h = get_hint(ctx, prev_frame, frame, &hint);
+		find_overlap(ctx, prev_plane, plane, &rev_frame, h, &min_error);
+		stream->rev_error += min_error;
+
+		if (n >= stream->rev_deltas_size) {
+			stream->rev_deltas_size = MAX(2 * n, 64);
+			stream->rev_deltas = g_renew(int, stream->rev_deltas,
+				2 * stream->rev_deltas_size);
+		}
+		stream->rev_deltas[2 * n] = rev_frame.delta_x;
+		stream->rev_deltas[2 * n + 1] = rev_frame.delta_y;
+	}
+
+	stream->frames = g_slist_prepend(stream->frames, frame);
+	stream->frames_len++;
+}
+
+/* Assembles the frames pushed so far and resets the stream */
+struct fp_img *fpi_frame_asmbl_stream_finish(struct fpi_frame_asmbl_stream *stream)
+{
+	size_t n = stream->frames_len;
+	struct fp_img *img;
+	GSList *list_entry;
+	size_t i;
+
+	if (n >= 2) {
+		int err = stream->error / n;
+		int rev_err = stream->rev_error / n;
+		gboolean reverse = !(err < rev_err);
+
+		fp_dbg("errors: %d rev: %d, %zu still frames dropped", err,
+		       rev_err, stream->frames_dropped);
+
+		/* Frames are most recent first. The last frame only has
+		 * a reverse offset, the first frame's one is not used. */
+		for (i = n - 1, list_entry = stream->frames; list_entry;
+		     i--, list_entry = g_slist_next(list_entry)) {
+			struct fpi_frame *frame = list_entry->data;
+
+			if (i == n - 1) {
+				frame->delta_x = stream->rev_deltas[2 * i];
+				frame->delta_y = stream->rev_deltas[2 * i + 1];
+			} else if (reverse && i > 0) {
+				frame->delta_x = -stream->rev_deltas[2 * i];
+				frame->delta_y = -stream->rev_deltas[2 * i + 1];
+			} else if (reverse) {
+				frame->delta_x = -frame->delta_x;
+				frame->delta_y = -frame->delta_y;
+			}
+		}
+	}
+
+	stream->frames = g_slist_reverse(stream->frames);
+	img = fpi_assemble_frames(stream->ctx, stream->frames, n);
+	fpi_frame_asmbl_stream_reset(stream);
+
+	return img;
+}
+
+void fpi_asmbl_buf_init(struct fpi_asmbl_buf *buf, size_t entry_size)
+{
+	memset(buf, 0, sizeof(*buf));
+	/* Keep the entries aligned, they may start with a struct fpi_frame */
+	buf->entry_size = (entry_size + sizeof(void *) - 1) &
+	    ~(sizeof(void *) - 1);
+}
+
+/* Forgets the entries, but keeps the memory for the next capture */
+void fpi_asmbl_buf_clear(struct fpi_asmbl_buf *buf)
+{
+	buf->len = 0;
+}
+
+void fpi_asmbl_buf_free(struct fpi_asmbl_buf *buf)
+{
+	g_free(buf->data);
+	g_free(buf->links);
+	fpi_asmbl_buf_init(buf, buf->entry_size);
+}
+
+/* Makes room for n entries at once, so that a capture of up to n frames or
+ * lines doesn't need to grow the buffer. The memory is kept by
+ * fpi_asmbl_buf_clear(), later captures don't allocate either. */
+void fpi_asmbl_buf_reserve(struct fpi_asmbl_buf *buf, size_t n)
+{
+	if (buf->size >= n)
+		return;
+
+	buf->size = n;
+	buf->data = g_realloc(buf->data, buf->size * buf->entry_size);
+}
+
+/* Returns room for a new entry, at the end of the buffer. Pointers to the
+ * previous entries are no longer valid afterwards. */
+void *fpi_asmbl_buf_add(struct fpi_asmbl_buf *buf)
+{
+	if (buf->len == buf->size) {
+		buf->size = MAX(2 * buf->size, 64);
+		buf->data = g_realloc(buf->data, buf->size * buf->entry_size);
+	}
+
+	return fpi_asmbl_buf_get(buf, buf->len++);
 }
 
+/* Chains the entries, oldest first, to be handed to the assembling
+ * functions. The list belongs to buf and is valid until buf changes. */
+GSList *fpi_asmbl_buf_list(struct fpi_asmbl_buf *buf)
+{
+	size_t i;
+
+	if (buf->len == 0)
+		return NULL;
+
+	buf->links = g_renew(GSList, buf->links, buf->len);
+	for (i = 0; i < buf->len; i++) {
+		buf->links[i].data = fpi_asmbl_buf_get(buf, i);
+		buf->links[i].next = i + 1 < buf->len ? &buf->links[i + 1] : NULL;
+	}
+
+	return buf->links;
+}
+
+/* Sliding window median. The offsets only take a few different values, so
+ * the window is kept as a histogram which is updated as it slides instead of
+ * sorting every window. */
 static void median_filter(int *data, int size, int filtersize)
 {
-	int i;
-	int *result = (int *)g_malloc0(size*sizeof(int));
-	int *sortbuf = (int *)g_malloc0(filtersize*sizeof(int));
+	int i, v, min_v, max_v;
+	int i1 = 0, i2 = -1;
+	int *result, *hist;
+
+	if (size <= 0)
+		return;
+
+	min_v = max_v = data[0];
+	for (i = 1; i < size; i++) {
+		min_v = MIN(min_v, data[i]);
+		max_v = MAX(max_v, data[i]);
+	}
+
+	result = (int *)g_malloc0(size*sizeof(int));
+	hist = (int *)g_malloc0((max_v - min_v + 1)*sizeof(int));
 	for (i = 0; i < size; i++) {
-		int i1 = i - (filtersize-1)/2;
-		int i2 = i + (filtersize-1)/2;
-		if (i1 < 0)
-			i1 = 0;
-		if (i2 >= size)
-			i2 = size-1;
-		g_memmove(sortbuf, data+i1, (i2-i1+1)*sizeof(int));
-		g_qsort_with_data(sortbuf, i2-i1+1, sizeof(int), cmpint, NULL);
-		result[i] = sortbuf[(i2-i1+1)/2];
+		int first = MAX(i - (filtersize-1)/2, 0);
+		int last = MIN(i + (filtersize-1)/2, size-1);
+		int count;
+
+		for (; i2 < last; i2++)
+			hist[data[i2 + 1] - min_v]++;
+		for (; i1 < first; i1++)
+			hist[data[i1] - min_v]--;
+
+		/* Same element as sorting the window and taking its middle */
+		count = (last - first + 1)/2;
+		for (v = 0; count >= hist[v]; v++)
+			count -= hist[v];
+		result[i] = v + min_v;
 	}
 	memmove(data, result, size*sizeof(int));
 	g_free(result);
-	g_free(sortbuf);
+	g_free(hist);
 }
 
-static void interpolate_lines(struct fpi_line_asmbl_ctx *ctx,
-			      GSList *line1, float y1, GSList *line2,
-			      float y2, unsigned char *output, float yi, int size)
+/* Fetches a whole line once, so that it can be blended into several output
+ * lines without going through get_pixel again */
+static void unpack_line(struct fpi_line_asmbl_ctx *ctx, GSList *line,
+			unsigned char *output)
 {
-	int i;
-	unsigned char p1, p2;
+	unsigned int i;
 
-	if (!line1 || !line2)
+	if (ctx->unpack_line) {
+		ctx->unpack_line(ctx, line, output);
 		return;
-
-	for (i = 0; i < size; i++) {
-		p1 = ctx->get_pixel(ctx, line1, i);
-		p2 = ctx->get_pixel(ctx, line2, i);
-		output[i] = (float)p1
-			    + (yi - y1)/(y2 - y1)*(p2 - p1);
 	}
+
+	for (i = 0; i < ctx->line_width; i++)
+		output[i] = ctx->get_pixel(ctx, line, i);
+}
+
+/* Blends two lines with a 8-bit fixed-point weight, 0 gives line1 and 256
+ * gives line2 */
+static void interpolate_lines(const unsigned char *line1,
+			      const unsigned char *line2,
+			      unsigned char *output, unsigned int weight,
+			      int size)
+{
+	const unsigned int weight1 = 256 - weight;
+	int i;
+
+	for (i = 0; i < size; i++)
+		output[i] = (line1[i] * weight1 + line2[i] * weight) >> 8;
 }
 
 static int min(int a, int b) {return (a < b) ? a : b; }
 
-/* Rescale image to account for variable swiping speed */
-struct fp_img *fpi_assemble_lines(struct fpi_line_asmbl_ctx *ctx,
-				  GSList *lines, size_t lines_len)
+/* Threads of the parallel offset search, and least number of line pairs
+ * worth a thread */
+#define LINE_SEARCH_MAX_THREADS	4
+#define LINE_SEARCH_MIN_PAIRS	256
+
+struct line_offsets_work {
+	struct fpi_line_asmbl_ctx *ctx;
+	GSList **rows;
+	int lines_len;
+	int *offsets;
+	/* Range of line pairs */
+	int first;
+	int last;
+};
+
+/* For every other line, finds the line that looks the most like it further
+ * down, within max_search_offset lines */
+static gpointer find_line_offsets_thread(gpointer data)
 {
-	/* Number of output lines per distance between two scanners */
+	struct line_offsets_work *work = data;
+	struct fpi_line_asmbl_ctx *ctx = work->ctx;
 	int i;
-	GSList *row1, *row2;
-	float y = 0.0;
-	int line_ind = 0;
-	int *offsets = (int *)g_malloc0((lines_len / 2) * sizeof(int));
-	unsigned char *output = g_malloc0(ctx->line_width * ctx->max_height);
-	struct fp_img *img;
-
-	fp_dbg("%llu", g_get_real_time());
 
-	row1 = lines;
-	for (i = 0; (i < lines_len - 1) && row1; i += 2) {
+	for (i = work->first * 2; i < work->last * 2; i += 2) {
 		int bestmatch = i;
 		int bestdiff = 0;
 		int j, firstrow, lastrow;
 
 		firstrow = i + 1;
-		lastrow = min(i + ctx->max_search_offset, lines_len - 1);
+		lastrow = min(i + ctx->max_search_offset,
+			      work->lines_len - 1);
 
-		row2 = g_slist_next(row1);
 		for (j = firstrow; j <= lastrow; j++) {
 			int diff = ctx->get_deviation(ctx,
-					row1,
-					row2);
+					work->rows[i],
+					work->rows[j]);
 			if ((j == firstrow) || (diff < bestdiff)) {
 				bestdiff = diff;
 				bestmatch = j;
 			}
-			row2 = g_slist_next(row2);
 		}
-		offsets[i / 2] = bestmatch - i;
-		fp_dbg("%d", offsets[i / 2]);
-		row1 = g_slist_next(row1);
-		if (row1)
-			row1 = g_slist_next(row1);
+		work->offsets[i / 2] = bestmatch - i;
+	}
+
+	return NULL;
+}
+
+static void find_line_offsets(struct fpi_line_asmbl_ctx *ctx, GSList **rows,
+			      int lines_len, int *offsets)
+{
+	int npairs = lines_len / 2;
+	struct line_offsets_work works[LINE_SEARCH_MAX_THREADS];
+	GThread *threads[LINE_SEARCH_MAX_THREADS];
+	int i, nthreads = 1;
+
+	if (ctx->line_search == FPI_LINE_SEARCH_PARALLEL) {
+		long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		nthreads = MIN(nr_cpus, LINE_SEARCH_MAX_THREADS);
+		nthreads = MIN(nthreads, npairs / LINE_SEARCH_MIN_PAIRS);
+		nthreads = MAX(nthreads, 1);
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		works[i].ctx = ctx;
+		works[i].rows = rows;
+		works[i].lines_len = lines_len;
+		works[i].offsets = offsets;
+		works[i].first = npairs * i / nthreads;
+		works[i].last = npairs * (i + 1) / nthreads;
 	}
 
+	/* The calling thread takes the first chunk, and also the chunks of
+	 * threads which couldn't be started */
+	for (i = 1; i < nthreads; i++)
+		threads[i] = g_thread_try_new("line_offsets",
+					      find_line_offsets_thread,
+					      &works[i], NULL);
+	find_line_offsets_thread(&works[0]);
+	for (i = 1; i < nthreads; i++) {
+		if (threads[i])
+			g_thread_join(threads[i]);
+		else
+			find_line_offsets_thread(&works[i]);
+	}
+}
+
+/* Rescale image to account for variable swiping speed */
+struct fp_img *fpi_assemble_lines(struct fpi_line_asmbl_ctx *ctx,
+				  GSList *lines, size_t lines_len)
+{
+	/* Number of output lines per distance between two scanners */
+	int i;
+	GSList *row1, **rows;
+	float y = 0.0;
+	int line_ind = 0;
+	int *offsets = (int *)g_malloc0((lines_len / 2) * sizeof(int));
+	unsigned char *line1 = g_malloc(ctx->line_width);
+	unsigned char *line2 = g_malloc(ctx->line_width);
+	/* Index of the line pair in line1 and line2, none yet */
+	int unpacked = -2;
+	struct fp_img *img;
+
+	fp_dbg("%llu", g_get_real_time());
+
+	/* Index the rows, the offset search looks far ahead of each one */
+	rows = g_new(GSList *, lines_len);
+	for (i = 0, row1 = lines; i < lines_len && row1;
+	     i++, row1 = g_slist_next(row1))
+		rows[i] = row1;
+	lines_len = i;
+
+	find_line_offsets(ctx, rows, lines_len, offsets);
+	for (i = 0; i < lines_len / 2; i++)
+		fp_dbg("%d", offsets[i]);
+
 	median_filter(offsets, (lines_len / 2) - 1, ctx->median_filter_size);
 
 	fp_dbg("offsets_filtered: %llu", g_get_real_time());
-	for (i = 0; i <= (lines_len / 2) - 1; i++)
+	for (i = 0; i < lines_len / 2; i++)
 		fp_dbg("%d", offsets[i]);
-	row1 = lines;
-	for (i = 0; i < lines_len - 1; i++, row1 = g_slist_next(row1)) {
+	/* The output lines are written straight into the image, which is
+	 * shrunk to the actual height afterwards */
+	img = fpi_img_new(ctx->line_width * ctx->max_height);
+	for (i = 0; i < lines_len - 1; i++) {
 		int offset = offsets[i/2];
 		if (offset > 0) {
 			float ynext = y + (float)ctx->resolution / offset;
 			while (line_ind < ynext) {
+				unsigned int weight;
+
 				if (line_ind > ctx->max_height - 1)
 					goto out;
-				interpolate_lines(ctx,
-					row1, y,
-					g_slist_next(row1),
-					ynext,
-					output + line_ind * ctx->line_width,
-					line_ind,
-					ctx->line_width);
+				if (unpacked != i) {
+					unsigned char *tmp = line1;
+
+					/* Line i is usually the previous line2 */
+					line1 = line2;
+					line2 = tmp;
+					if (unpacked != i - 1)
+						unpack_line(ctx, rows[i], line1);
+					unpack_line(ctx, rows[i + 1], line2);
+					unpacked = i;
+				}
+				weight = (line_ind - y) * 256 / (ynext - y);
+				interpolate_lines(line1, line2,
+					img->data + line_ind * ctx->line_width,
+					MIN(weight, 256), ctx->line_width);
 				line_ind++;
 			}
 			y = ynext;
 		}
 	}
 out:
-	img = fpi_img_new(ctx->line_width * line_ind);
+	img = fpi_img_resize(img, ctx->line_width * line_ind);
+	img->length = ctx->line_width * line_ind;
 	img->height = line_ind;
 	img->width = ctx->line_width;
 	img->flags = FP_IMG_V_FLIPPED;
-	g_memmove(img->data, output, ctx->line_width * line_ind);
+	g_free(rows);
 	g_free(offsets);
-	g_free(output);
+	g_free(line1);
+	g_free(line2);
 	return img;
 }
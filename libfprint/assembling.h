@@ -30,36 +30,189 @@ struct fpi_frame {
 	unsigned char data[0];
 };
 
+/* How fpi_do_movement_estimation() looks for the offset between frames */
+enum fpi_overlap_search {
+	/* Try every offset at full resolution */
+	FPI_OVERLAP_SEARCH_FULL = 0,
+	/* Try every other offset on subsampled frames first, then refine
+	 * around the best ones. Several times faster, for long swipes. */
+	FPI_OVERLAP_SEARCH_COARSE_TO_FINE,
+};
+
+/* Guess of the offset between two frames, see get_delta_hint */
+struct fpi_delta_hint {
+	/* Search for a swipe in the other direction */
+	gboolean reverse;
+	/* Offset found between the two previous frames in this direction */
+	gboolean have_last;
+	int last_x;
+	int last_y;
+	/* Filled in by the driver */
+	int delta_x;
+	int delta_y;
+};
+
 struct fpi_frame_asmbl_ctx {
 	unsigned frame_width;
 	unsigned frame_height;
 	unsigned image_width;
+	enum fpi_overlap_search overlap_search;
 	unsigned char (*get_pixel)(struct fpi_frame_asmbl_ctx *ctx,
 				   struct fpi_frame *frame,
 				   unsigned x,
 				   unsigned y);
+	/* Optional. Guesses the offset the movement estimation is about to
+	 * store in prev, between prev and frame, from data the sensor reports
+	 * or from the previous offsets. Only the offsets around the guess are
+	 * tried then, with a full search if the best one is at the edge of
+	 * that window. Returns FALSE when there is no guess. */
+	gboolean (*get_delta_hint)(struct fpi_frame_asmbl_ctx *ctx,
+				   struct fpi_frame *prev,
+				   struct fpi_frame *frame,
+				   struct fpi_delta_hint *hint);
+	/* Optional. Fetches all the pixels of frame into plane, row after
+	 * row, instead of calling get_pixel for each of them. See
+	 * FPI_FRAME_UNPACKER(). */
+	void (*unpack_frame)(struct fpi_frame_asmbl_ctx *ctx,
+			     struct fpi_frame *frame,
+			     unsigned char *plane);
+	/* Optional. Frames whose pixels differ from the last frame kept by
+	 * less than this on average are dropped by
+	 * fpi_frame_asmbl_stream_push(), as the finger has barely moved. */
+	unsigned still_threshold;
 };
 
+gboolean fpi_delta_hint_last(struct fpi_frame_asmbl_ctx *ctx,
+			     struct fpi_frame *prev, struct fpi_frame *frame,
+			     struct fpi_delta_hint *hint);
+
 void fpi_do_movement_estimation(struct fpi_frame_asmbl_ctx *ctx,
 			    GSList *stripes, size_t stripes_len);
 
 struct fp_img *fpi_assemble_frames(struct fpi_frame_asmbl_ctx *ctx,
 			    GSList *stripes, size_t stripes_len);
 
+struct fpi_frame_asmbl_stream {
+	struct fpi_frame_asmbl_ctx *ctx;
+	/* Most recent first */
+	GSList *frames;
+	size_t frames_len;
+	/* Previous and last frames, unpacked */
+	unsigned char *planes;
+	/* Offsets found by the reverse search, 2 per frame */
+	int *rev_deltas;
+	size_t rev_deltas_size;
+	unsigned long long error;
+	unsigned long long rev_error;
+	/* Frames dropped as the finger didn't move */
+	size_t frames_dropped;
+};
+
+void fpi_frame_asmbl_stream_init(struct fpi_frame_asmbl_stream *stream,
+				 struct fpi_frame_asmbl_ctx *ctx);
+void fpi_frame_asmbl_stream_reset(struct fpi_frame_asmbl_stream *stream);
+void fpi_frame_asmbl_stream_push(struct fpi_frame_asmbl_stream *stream,
+				 struct fpi_frame *frame);
+struct fp_img *fpi_frame_asmbl_stream_finish(struct fpi_frame_asmbl_stream *stream);
+
+/* Frames or lines stored back to back in a single buffer, for drivers to
+ * copy them there straight from their transfers */
+struct fpi_asmbl_buf {
+	unsigned char *data;
+	size_t entry_size;
+	size_t len;
+	size_t size;
+	GSList *links;
+};
+
+void fpi_asmbl_buf_init(struct fpi_asmbl_buf *buf, size_t entry_size);
+void fpi_asmbl_buf_clear(struct fpi_asmbl_buf *buf);
+void fpi_asmbl_buf_free(struct fpi_asmbl_buf *buf);
+void fpi_asmbl_buf_reserve(struct fpi_asmbl_buf *buf, size_t n);
+void *fpi_asmbl_buf_add(struct fpi_asmbl_buf *buf);
+GSList *fpi_asmbl_buf_list(struct fpi_asmbl_buf *buf);
+
+static inline void *fpi_asmbl_buf_get(struct fpi_asmbl_buf *buf, size_t i)
+{
+	return buf->data + i * buf->entry_size;
+}
+
+enum fpi_line_search {
+	/* Compare the lines from the calling thread */
+	FPI_LINE_SEARCH_SERIAL = 0,
+	/* Split long swipes into chunks searched by several threads.
+	 * get_deviation must then be safe to call concurrently. */
+	FPI_LINE_SEARCH_PARALLEL,
+};
+
 struct fpi_line_asmbl_ctx {
 	unsigned line_width;
 	unsigned max_height;
 	unsigned resolution;
 	unsigned median_filter_size;
 	unsigned max_search_offset;
+	enum fpi_line_search line_search;
 	int (*get_deviation)(struct fpi_line_asmbl_ctx *ctx,
 			     GSList *line1, GSList *line2);
 	unsigned char (*get_pixel)(struct fpi_line_asmbl_ctx *ctx,
 				   GSList *line,
 				   unsigned x);
+	/* Optional. Fetches all the pixels of line into output, instead of
+	 * calling get_pixel for each of them. See FPI_LINE_UNPACKER(). */
+	void (*unpack_line)(struct fpi_line_asmbl_ctx *ctx,
+			    GSList *line,
+			    unsigned char *output);
 };
 
 struct fp_img *fpi_assemble_lines(struct fpi_line_asmbl_ctx *ctx,
 				  GSList *lines, size_t lines_len);
 
+/* Define unpack_frame and unpack_line callbacks for drivers with a fixed
+ * geometry. pixel is an inline function: with the size of the frames or
+ * lines known at compile time, the compiler can unroll and vectorize the
+ * whole loop, where get_pixel costs an indirect call per pixel.
+ *
+ * FPI_FRAME_UNPACKER() fetches pixels with
+ * pixel(frame->data, width, height, x, y), FPI_LINE_UNPACKER() with
+ * pixel(line, x).
+ */
+#define FPI_FRAME_UNPACKER(name, width, height, pixel)			\
+static void name(struct fpi_frame_asmbl_ctx *ctx,			\
+		 struct fpi_frame *frame, unsigned char *plane)		\
+{									\
+	unsigned int x, y;						\
+									\
+	for (y = 0; y < (height); y++)					\
+		for (x = 0; x < (width); x++)				\
+			*plane++ = pixel(frame->data, (width), (height),	\
+					 x, y);				\
+}
+
+#define FPI_LINE_UNPACKER(name, width, pixel)				\
+static void name(struct fpi_line_asmbl_ctx *ctx,			\
+		 GSList *line, unsigned char *output)			\
+{									\
+	unsigned int x;							\
+									\
+	for (x = 0; x < (width); x++)					\
+		output[x] = pixel(line, x);				\
+}
+
+unsigned int fpi_sad(const unsigned char *buf1, const unsigned char *buf2,
+		     unsigned int len);
+unsigned int fpi_ssd(const unsigned char *buf1, const unsigned char *buf2,
+		     unsigned int len);
+int fpi_std_sq_dev2(const unsigned char *buf1, const unsigned char *buf2,
+		    unsigned int len, unsigned int stride);
+
+struct fpi_line_stats {
+	/* Squared standard deviation of the line */
+	int std_sq_dev;
+	/* Mean squared difference with the previous line */
+	int mean_sq_diff;
+};
+
+void fpi_line_stats(const unsigned char *line, const unsigned char *prev,
+		    unsigned int len, struct fpi_line_stats *stats);
+
 #endif
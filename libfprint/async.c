@@ -31,33 +31,29 @@ void fpi_drvcb_open_complete(struct fp_dev *dev, int status)
 	fp_dbg("status %d", status);
 	BUG_ON(dev->state != DEV_STATE_INITIALIZING);
 	dev->state = (status) ? DEV_STATE_ERROR : DEV_STATE_INITIALIZED;
-	opened_devices = g_slist_prepend(opened_devices, dev);
+	dev->ctx->opened_devices = g_slist_prepend(dev->ctx->opened_devices, dev);
 	if (dev->open_cb)
 		dev->open_cb(dev, status, dev->open_cb_data);
 }
 
-API_EXPORTED int fp_async_dev_open(struct fp_dscv_dev *ddev, fp_dev_open_cb cb,
-	void *user_data)
+/* Opens a device for a driver, on an already opened usb handle. The handle
+ * is closed if this fails. */
+int fpi_dev_open_handle(struct fp_context *ctx, struct fp_driver *drv,
+	unsigned long driver_data, libusb_device_handle *udevh,
+	fp_dev_open_cb cb, void *user_data)
 {
-	struct fp_driver *drv = ddev->drv;
 	struct fp_dev *dev;
-	libusb_device_handle *udevh;
 	int r;
 
-	fp_dbg("");
-	r = libusb_open(ddev->udev, &udevh);
-	if (r < 0) {
-		fp_err("usb_open failed, error %d", r);
-		return r;
-	}
-
 	dev = g_malloc0(sizeof(*dev));
+	dev->ctx = ctx;
 	dev->drv = drv;
 	dev->udev = udevh;
 	dev->__enroll_stage = -1;
 	dev->state = DEV_STATE_INITIALIZING;
 	dev->open_cb = cb;
 	dev->open_cb_data = user_data;
+	fpi_usb_trace_attach(dev, driver_data);
 
 	if (!drv->open) {
 		fpi_drvcb_open_complete(dev, 0);
@@ -65,23 +61,40 @@ API_EXPORTED int fp_async_dev_open(struct fp_dscv_dev *ddev, fp_dev_open_cb cb,
 	}
 
 	dev->state = DEV_STATE_INITIALIZING;
-	r = drv->open(dev, ddev->driver_data);
+	r = drv->open(dev, driver_data);
 	if (r) {
 		fp_err("device initialisation failed, driver=%s", drv->name);
-		libusb_close(udevh);
+		fpi_usb_close(udevh);
 		g_free(dev);
 	}
 
 	return r;
 }
 
+API_EXPORTED int fp_async_dev_open(struct fp_dscv_dev *ddev, fp_dev_open_cb cb,
+	void *user_data)
+{
+	libusb_device_handle *udevh;
+	int r;
+
+	fp_dbg("");
+	r = libusb_open(ddev->udev, &udevh);
+	if (r < 0) {
+		fp_err("usb_open failed, error %d", r);
+		return r;
+	}
+
+	return fpi_dev_open_handle(ddev->ctx, ddev->drv, ddev->driver_data,
+		udevh, cb, user_data);
+}
+
 /* Drivers call this when device deinitialisation has completed */
 void fpi_drvcb_close_complete(struct fp_dev *dev)
 {
 	fp_dbg("");
 	BUG_ON(dev->state != DEV_STATE_DEINITIALIZING);
 	dev->state = DEV_STATE_DEINITIALIZED;
-	libusb_close(dev->udev);
+	fpi_usb_close(dev->udev);
 	if (dev->close_cb)
 		dev->close_cb(dev, dev->close_cb_data);
 	g_free(dev);
@@ -92,9 +105,10 @@ API_EXPORTED void fp_async_dev_close(struct fp_dev *dev,
 {
 	struct fp_driver *drv = dev->drv;
 
-	if (g_slist_index(opened_devices, (gconstpointer) dev) == -1)
+	if (g_slist_index(dev->ctx->opened_devices, (gconstpointer) dev) == -1)
 		fp_err("device %p not in opened list!", dev);
-	opened_devices = g_slist_remove(opened_devices, (gconstpointer) dev);
+	dev->ctx->opened_devices = g_slist_remove(dev->ctx->opened_devices,
+		(gconstpointer) dev);
 
 	dev->close_cb = callback;
 	dev->close_cb_data = user_data;
@@ -144,6 +158,7 @@ API_EXPORTED int fp_async_enroll_start(struct fp_dev *dev,
 	dev->enroll_stage_cb_data = user_data;
 
 	dev->state = DEV_STATE_ENROLL_STARTING;
+	fpi_stats_begin(dev);
 	r = drv->enroll_start(dev);
 	if (r < 0) {
 		dev->enroll_stage_cb = NULL;
@@ -160,6 +175,7 @@ void fpi_drvcb_enroll_stage_completed(struct fp_dev *dev, int result,
 {
 	BUG_ON(dev->state != DEV_STATE_ENROLLING);
 	fp_dbg("result %d", result);
+	fpi_stats_report(dev, result);
 	if (!dev->enroll_stage_cb) {
 		fp_dbg("ignoring enroll result as no callback is subscribed");
 		return;
@@ -177,6 +193,7 @@ void fpi_drvcb_enroll_stopped(struct fp_dev *dev)
 	fp_dbg("");
 	BUG_ON(dev->state != DEV_STATE_ENROLL_STOPPING);
 	dev->state = DEV_STATE_INITIALIZED;
+	fpi_stats_stopped(dev);
 	if (dev->enroll_stop_cb)
 		dev->enroll_stop_cb(dev, dev->enroll_stop_cb_data);
 }
@@ -195,6 +212,7 @@ API_EXPORTED int fp_async_enroll_stop(struct fp_dev *dev,
 	dev->enroll_stop_cb = callback;
 	dev->enroll_stop_cb_data = user_data;
 	dev->state = DEV_STATE_ENROLL_STOPPING;
+	fpi_stats_stop_begin(dev);
 
 	if (!drv->enroll_stop) {
 		fpi_drvcb_enroll_stopped(dev);
@@ -221,6 +239,7 @@ API_EXPORTED int fp_async_verify_start(struct fp_dev *dev,
 		return -ENOTSUP;
 
 	dev->state = DEV_STATE_VERIFY_STARTING;
+	fpi_stats_begin(dev);
 	dev->verify_cb = callback;
 	dev->verify_cb_data = user_data;
 	dev->verify_data = data;
@@ -258,6 +277,7 @@ void fpi_drvcb_report_verify_result(struct fp_dev *dev, int result,
 {
 	fp_dbg("result %d", result);
 	BUG_ON(dev->state != DEV_STATE_VERIFYING);
+	fpi_stats_report(dev, result);
 	if (result < 0 || result == FP_VERIFY_NO_MATCH
 			|| result == FP_VERIFY_MATCH)
 		dev->state = DEV_STATE_VERIFY_DONE;
@@ -274,6 +294,7 @@ void fpi_drvcb_verify_stopped(struct fp_dev *dev)
 	fp_dbg("");
 	BUG_ON(dev->state != DEV_STATE_VERIFY_STOPPING);
 	dev->state = DEV_STATE_INITIALIZED;
+	fpi_stats_stopped(dev);
 	if (dev->verify_stop_cb)
 		dev->verify_stop_cb(dev, dev->verify_stop_cb_data);
 }
@@ -297,6 +318,8 @@ API_EXPORTED int fp_async_verify_stop(struct fp_dev *dev,
 
 	if (!drv->verify_start)
 		return -ENOTSUP;
+	fpi_stats_stop_begin(dev);
+
 	if (!drv->verify_stop) {
 		dev->state = DEV_STATE_INITIALIZED;
 		fpi_drvcb_verify_stopped(dev);
@@ -311,8 +334,9 @@ API_EXPORTED int fp_async_verify_stop(struct fp_dev *dev,
 	return r;
 }
 
-API_EXPORTED int fp_async_identify_start(struct fp_dev *dev,
-	struct fp_print_data **gallery, fp_identify_cb callback, void *user_data)
+static int start_identify(struct fp_dev *dev, struct fp_print_data **gallery,
+	struct fp_gallery *indexed_gallery, struct fp_identify_session *session,
+	gboolean continuous, fp_identify_cb callback, void *user_data)
 {
 	struct fp_driver *drv = dev->drv;
 	int r;
@@ -321,9 +345,13 @@ API_EXPORTED int fp_async_identify_start(struct fp_dev *dev,
 	if (!drv->identify_start)
 		return -ENOTSUP;
 	dev->state = DEV_STATE_IDENTIFY_STARTING;
+	fpi_stats_begin(dev);
 	dev->identify_cb = callback;
 	dev->identify_cb_data = user_data;
 	dev->identify_gallery = gallery;
+	dev->identify_indexed_gallery = indexed_gallery;
+	dev->identify_session = session;
+	dev->identify_continuous = continuous;
 
 	r = drv->identify_start(dev);
 	if (r < 0) {
@@ -334,6 +362,107 @@ API_EXPORTED int fp_async_identify_start(struct fp_dev *dev,
 	return r;
 }
 
+API_EXPORTED int fp_async_identify_start(struct fp_dev *dev,
+	struct fp_print_data **gallery, fp_identify_cb callback, void *user_data)
+{
+	return start_identify(dev, gallery, NULL, NULL, FALSE, callback,
+		user_data);
+}
+
+/** \ingroup dev
+ * Starts identification against an indexed gallery. The match_offset passed
+ * to the callback is the ID of the matched print within the gallery. This is
+ * only supported by imaging devices, -ENOTSUP is returned for the others.
+ *
+ * \param dev the device to perform the scan
+ * \param gallery the gallery to identify against
+ * \param callback the callback to call with the result
+ * \param user_data user data to pass to the callback
+ * \returns 0 on success, negative error code otherwise
+ */
+API_EXPORTED int fp_async_identify_gallery_start(struct fp_dev *dev,
+	struct fp_gallery *gallery, fp_identify_cb callback, void *user_data)
+{
+	if (dev->drv->type != DRIVER_IMAGING)
+		return -ENOTSUP;
+	return start_identify(dev, NULL, gallery, NULL, FALSE, callback,
+		user_data);
+}
+
+/** \ingroup dev
+ * Starts identifying fingers one after the other, without deactivating the
+ * device in between, which spares devices their initialisation and
+ * calibration for each finger. The callback is called with the result for
+ * each finger, after it is removed from the sensor, and the device then
+ * waits for the next finger, until fp_async_identify_stop() is called. The
+ * callback owns the image it gets, if any. The session ends after an error
+ * is reported, the application still having to stop it.
+ *
+ * This is only supported by imaging devices, -ENOTSUP is returned for the
+ * others.
+ *
+ * \param dev the device to perform the scans
+ * \param gallery NULL-terminated array of pointers to the prints to
+ * identify against
+ * \param callback the callback to call with each result
+ * \param user_data user data to pass to the callback
+ * \returns 0 on success, negative error code otherwise
+ */
+API_EXPORTED int fp_async_identify_continuous_start(struct fp_dev *dev,
+	struct fp_print_data **gallery, fp_identify_cb callback, void *user_data)
+{
+	if (dev->drv->type != DRIVER_IMAGING)
+		return -ENOTSUP;
+	return start_identify(dev, gallery, NULL, NULL, TRUE, callback,
+		user_data);
+}
+
+/** \ingroup dev
+ * Starts identifying fingers against an indexed gallery one after the
+ * other, like fp_async_identify_continuous_start(). The match_offset passed
+ * to the callback is the ID of the matched print within the gallery.
+ *
+ * \param dev the device to perform the scans
+ * \param gallery the gallery to identify against
+ * \param callback the callback to call with each result
+ * \param user_data user data to pass to the callback
+ * \returns 0 on success, negative error code otherwise
+ */
+API_EXPORTED int fp_async_identify_gallery_continuous_start(
+	struct fp_dev *dev, struct fp_gallery *gallery, fp_identify_cb callback,
+	void *user_data)
+{
+	if (dev->drv->type != DRIVER_IMAGING)
+		return -ENOTSUP;
+	return start_identify(dev, NULL, gallery, NULL, TRUE, callback,
+		user_data);
+}
+
+/** \ingroup dev
+ * Starts identifying fingers against the gallery of an identification
+ * session one after the other, like
+ * fp_async_identify_gallery_continuous_start(). The scans of all devices
+ * started in the same session are processed by the threads of the session,
+ * and the callback of each device is called with the results of its own
+ * scans, from the context the device belongs to.
+ *
+ * \param dev the device to perform the scans
+ * \param session the identification session
+ * \param callback the callback to call with each result
+ * \param user_data user data to pass to the callback
+ * \returns 0 on success, negative error code otherwise
+ */
+API_EXPORTED int fp_async_identify_session_start(struct fp_dev *dev,
+	struct fp_identify_session *session, fp_identify_cb callback,
+	void *user_data)
+{
+	if (dev->drv->type != DRIVER_IMAGING)
+		return -ENOTSUP;
+	return start_identify(dev, NULL,
+		fpi_identify_session_get_gallery(session), session, TRUE,
+		callback, user_data);
+}
+
 /* Driver-lib: identification has started, expect results soon */
 void fpi_drvcb_identify_started(struct fp_dev *dev, int status)
 {
@@ -359,8 +488,9 @@ void fpi_drvcb_report_identify_result(struct fp_dev *dev, int result,
 	fp_dbg("result %d", result);
 	BUG_ON(dev->state != DEV_STATE_IDENTIFYING
 		&& dev->state != DEV_STATE_ERROR);
-	if (result < 0 || result == FP_VERIFY_NO_MATCH
-			|| result == FP_VERIFY_MATCH)
+	fpi_stats_report(dev, result);
+	if (result < 0 || (!dev->identify_continuous &&
+			(result == FP_VERIFY_NO_MATCH || result == FP_VERIFY_MATCH)))
 		dev->state = DEV_STATE_IDENTIFY_DONE;
 
 	if (dev->identify_cb)
@@ -387,6 +517,8 @@ API_EXPORTED int fp_async_identify_stop(struct fp_dev *dev,
 
 	if (!drv->identify_start)
 		return -ENOTSUP;	
+	fpi_stats_stop_begin(dev);
+
 	if (!drv->identify_stop) {
 		dev->state = DEV_STATE_INITIALIZED;
 		fpi_drvcb_identify_stopped(dev);
@@ -408,6 +540,7 @@ void fpi_drvcb_identify_stopped(struct fp_dev *dev)
 	fp_dbg("");
 	BUG_ON(dev->state != DEV_STATE_IDENTIFY_STOPPING);
 	dev->state = DEV_STATE_INITIALIZED;
+	fpi_stats_stopped(dev);
 	if (dev->identify_stop_cb)
 		dev->identify_stop_cb(dev, dev->identify_stop_cb_data);
 }
@@ -423,6 +556,7 @@ API_EXPORTED int fp_async_capture_start(struct fp_dev *dev, int unconditional,
 		return -ENOTSUP;
 
 	dev->state = DEV_STATE_CAPTURE_STARTING;
+	fpi_stats_begin(dev);
 	dev->capture_cb = callback;
 	dev->capture_cb_data = user_data;
 	dev->unconditional_capture = unconditional;
@@ -460,6 +594,7 @@ void fpi_drvcb_report_capture_result(struct fp_dev *dev, int result,
 {
 	fp_dbg("result %d", result);
 	BUG_ON(dev->state != DEV_STATE_CAPTURING);
+	fpi_stats_report(dev, result);
 	if (result < 0 || result == FP_CAPTURE_COMPLETE)
 		dev->state = DEV_STATE_CAPTURE_DONE;
 
@@ -475,6 +610,7 @@ void fpi_drvcb_capture_stopped(struct fp_dev *dev)
 	fp_dbg("");
 	BUG_ON(dev->state != DEV_STATE_CAPTURE_STOPPING);
 	dev->state = DEV_STATE_INITIALIZED;
+	fpi_stats_stopped(dev);
 	if (dev->capture_stop_cb)
 		dev->capture_stop_cb(dev, dev->capture_stop_cb_data);
 }
@@ -497,6 +633,8 @@ API_EXPORTED int fp_async_capture_stop(struct fp_dev *dev,
 
 	if (!drv->capture_start)
 		return -ENOTSUP;
+	fpi_stats_stop_begin(dev);
+
 	if (!drv->capture_stop) {
 		dev->state = DEV_STATE_INITIALIZED;
 		fpi_drvcb_capture_stopped(dev);
@@ -0,0 +1,222 @@
+/*
+ * Per-device calibration cache for libfprint
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "calibration"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "fp_internal.h"
+
+/*
+ * Drivers which tune their sensor at activation can keep the result here,
+ * so that the next process opening the same sensor can skip the tuning.
+ *
+ * Entries live next to the print store, in
+ * calibration/<driver>/<bus>-<port path>, one per sensor. The port path
+ * identifies a sensor without talking to it, which matters as reading a
+ * serial number string would cost the very round trips the cache is meant
+ * to save. A sensor moved to another port is simply tuned again.
+ *
+ * An entry is only handed back when it was saved by the same driver for the
+ * same device type, with the version of the layout the driver asks for, has
+ * the expected length and checksum, and is not older than the driver allows.
+ * Drivers should still forget an entry as soon as the sensor disagrees with
+ * it.
+ *
+ * Nothing is cached for traced devices, as recording or replaying a trace
+ * needs the driver to do the same transfers every time.
+ */
+
+#define CALIBRATION_MAGIC	"FPC1"
+
+struct calibration_header {
+	char magic[4];
+	uint16_t driver_id;
+	uint32_t devtype;
+	uint8_t version;
+	uint32_t length;
+	int64_t saved;		/* wall clock, in seconds */
+	uint32_t checksum;
+} __attribute__((__packed__));
+
+/* FNV-1a */
+static uint32_t calibration_checksum(const unsigned char *data, size_t length)
+{
+	uint32_t hash = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < length; i++) {
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/* Port paths need libusb 1.0.16, older versions go without a cache */
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000102
+static char *get_path_to_calibration(struct fp_dev *dev)
+{
+	uint8_t ports[8];
+	libusb_device *udev;
+	GString *name;
+	char *dir, *path;
+	int i, n;
+
+	if (fpi_usb_is_traced(dev->udev))
+		return NULL;
+
+	udev = libusb_get_device(dev->udev);
+	n = libusb_get_port_numbers(udev, ports, G_N_ELEMENTS(ports));
+	if (n <= 0)
+		return NULL;
+
+	dir = fpi_data_get_store_sibling("calibration");
+	if (!dir)
+		return NULL;
+
+	name = g_string_new(NULL);
+	g_string_printf(name, "%u-%u", libusb_get_bus_number(udev), ports[0]);
+	for (i = 1; i < n; i++)
+		g_string_append_printf(name, ".%u", ports[i]);
+
+	path = g_build_filename(dir, dev->drv->name, name->str, NULL);
+	g_string_free(name, TRUE);
+	g_free(dir);
+	return path;
+}
+#else
+static char *get_path_to_calibration(struct fp_dev *dev)
+{
+	return NULL;
+}
+#endif
+
+/* Fills data with the calibration saved for the device, if there is a valid
+ * one no older than max_age seconds, 0 meaning any age. Returns 0 on
+ * success, a negative error code when there is nothing usable. */
+int fpi_calibration_load(struct fp_dev *dev, uint8_t version, void *data,
+	size_t length, unsigned int max_age)
+{
+	struct calibration_header *hdr;
+	GError *err = NULL;
+	gchar *contents;
+	gsize len;
+	gint64 now;
+	char *path;
+	int r = -EINVAL;
+
+	path = get_path_to_calibration(dev);
+	if (!path)
+		return -ENOENT;
+
+	if (!g_file_get_contents(path, &contents, &len, &err)) {
+		r = err->code == G_FILE_ERROR_NOENT ? -ENOENT : -EIO;
+		g_error_free(err);
+		g_free(path);
+		return r;
+	}
+
+	hdr = (struct calibration_header *) contents;
+	now = g_get_real_time() / G_USEC_PER_SEC;
+	if (len != sizeof(*hdr) + length ||
+			memcmp(hdr->magic, CALIBRATION_MAGIC, sizeof(hdr->magic)) ||
+			GUINT16_FROM_LE(hdr->driver_id) != dev->drv->id ||
+			GUINT32_FROM_LE(hdr->devtype) != dev->devtype ||
+			hdr->version != version ||
+			GUINT32_FROM_LE(hdr->length) != length ||
+			GUINT32_FROM_LE(hdr->checksum) !=
+			calibration_checksum((unsigned char *) (hdr + 1), length)) {
+		fp_dbg("ignoring invalid calibration %s", path);
+		goto out;
+	}
+
+	/* a clock gone backwards makes the age unknown */
+	if (max_age && (GINT64_FROM_LE(hdr->saved) > now ||
+			now - GINT64_FROM_LE(hdr->saved) > max_age)) {
+		fp_dbg("calibration %s has expired", path);
+		r = -ESTALE;
+		goto out;
+	}
+
+	fp_dbg("using calibration %s", path);
+	memcpy(data, hdr + 1, length);
+	r = 0;
+out:
+	g_free(contents);
+	g_free(path);
+	return r;
+}
+
+/* Saves the calibration of the device, replacing any previous one */
+void fpi_calibration_save(struct fp_dev *dev, uint8_t version,
+	const void *data, size_t length)
+{
+	struct calibration_header *hdr;
+	GError *err = NULL;
+	char *path, *dirpath;
+
+	path = get_path_to_calibration(dev);
+	if (!path)
+		return;
+
+	dirpath = g_path_get_dirname(path);
+	if (g_mkdir_with_parents(dirpath, 0700) < 0) {
+		fp_err("couldn't create calibration directory");
+		goto out;
+	}
+
+	hdr = g_malloc(sizeof(*hdr) + length);
+	memcpy(hdr->magic, CALIBRATION_MAGIC, sizeof(hdr->magic));
+	hdr->driver_id = GUINT16_TO_LE(dev->drv->id);
+	hdr->devtype = GUINT32_TO_LE(dev->devtype);
+	hdr->version = version;
+	hdr->length = GUINT32_TO_LE(length);
+	hdr->saved = GINT64_TO_LE(g_get_real_time() / G_USEC_PER_SEC);
+	memcpy(hdr + 1, data, length);
+	hdr->checksum = GUINT32_TO_LE(calibration_checksum(
+		(unsigned char *) (hdr + 1), length));
+
+	fp_dbg("saving calibration to %s", path);
+	if (!g_file_set_contents(path, (const gchar *) hdr,
+			sizeof(*hdr) + length, &err)) {
+		fp_err("saving calibration failed: %s", err->message);
+		g_error_free(err);
+	}
+	g_free(hdr);
+out:
+	g_free(dirpath);
+	g_free(path);
+}
+
+/* Drops the calibration of the device, for when the sensor no longer agrees
+ * with it */
+void fpi_calibration_forget(struct fp_dev *dev)
+{
+	char *path = get_path_to_calibration(dev);
+
+	if (!path)
+		return;
+	if (g_unlink(path) == 0)
+		fp_dbg("forgot calibration %s", path);
+	g_free(path);
+}
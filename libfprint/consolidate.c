@@ -0,0 +1,457 @@
+/*
+ * Enrolled print consolidation for libfprint
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "consolidate"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "fp_internal.h"
+#include "nbis/include/bozorth.h"
+
+/* The samples of an enrolled print are aligned on the one which matches the
+ * others best, the reference, using the minutiae correspondences found by
+ * bz_match(). The aligned minutiae are merged with the nearby minutiae of the
+ * other samples, and the merged ones seen in the most samples make up the
+ * consolidated sample. Samples which can't be aligned are kept as they are. */
+
+/* Samples scoring less than this against the reference are kept apart */
+#define MIN_ALIGN_SCORE		24
+/* Correspondences backed by fewer compatible edge pairs are ignored */
+#define MIN_VOTES		2
+/* Correspondences needed to estimate an alignment */
+#define MIN_PAIRS		3
+/* Aligned minutiae of different samples closer than this, in pixels and
+ * degrees, are the same minutia */
+#define MERGE_DIST		12
+#define MERGE_ANGLE		30
+
+struct correspondence {
+	int votes;
+	int probe;
+	int ref;
+};
+
+struct alignment {
+	double cos_rot, sin_rot;
+	/* rotation in degrees, for the minutiae directions */
+	double rot;
+	double tx, ty;
+};
+
+struct merged_minutia {
+	/* sums over the merged minutiae, of the positions and of the unit
+	 * vectors of the directions */
+	double x, y;
+	double dx, dy;
+	int support;
+	/* sample which contributed last, each one contributes once */
+	int sample;
+};
+
+static volatile gint consolidate_enrollments = FALSE;
+
+static int cmp_correspondences(const void *a, const void *b)
+{
+	const struct correspondence *ca = a;
+	const struct correspondence *cb = b;
+
+	if (ca->votes != cb->votes)
+		return cb->votes - ca->votes;
+	if (ca->probe != cb->probe)
+		return ca->probe - cb->probe;
+	return ca->ref - cb->ref;
+}
+
+/* Weighted least squares rotation and translation taking the probe minutiae
+ * of the correspondences onto their reference ones */
+static void fit_alignment(struct xyt_struct *probe, struct xyt_struct *ref,
+	struct correspondence *pairs, int nr_pairs, struct alignment *align)
+{
+	double pcx = 0, pcy = 0, rcx = 0, rcy = 0, total = 0;
+	double sin_sum = 0, cos_sum = 0, rot;
+	int i;
+
+	for (i = 0; i < nr_pairs; i++) {
+		double w = pairs[i].votes;
+
+		pcx += w * probe->xcol[pairs[i].probe];
+		pcy += w * probe->ycol[pairs[i].probe];
+		rcx += w * ref->xcol[pairs[i].ref];
+		rcy += w * ref->ycol[pairs[i].ref];
+		total += w;
+	}
+	pcx /= total;
+	pcy /= total;
+	rcx /= total;
+	rcy /= total;
+
+	for (i = 0; i < nr_pairs; i++) {
+		double w = pairs[i].votes;
+		double px = probe->xcol[pairs[i].probe] - pcx;
+		double py = probe->ycol[pairs[i].probe] - pcy;
+		double rx = ref->xcol[pairs[i].ref] - rcx;
+		double ry = ref->ycol[pairs[i].ref] - rcy;
+
+		cos_sum += w * (px * rx + py * ry);
+		sin_sum += w * (px * ry - py * rx);
+	}
+
+	rot = atan2(sin_sum, cos_sum);
+	align->cos_rot = cos(rot);
+	align->sin_rot = sin(rot);
+	align->rot = rot * 180.0 / M_PI;
+	align->tx = rcx - (align->cos_rot * pcx - align->sin_rot * pcy);
+	align->ty = rcy - (align->sin_rot * pcx + align->cos_rot * pcy);
+}
+
+static void align_point(struct alignment *align, int x, int y, double *ax,
+	double *ay)
+{
+	*ax = align->cos_rot * x - align->sin_rot * y + align->tx;
+	*ay = align->sin_rot * x + align->cos_rot * y + align->ty;
+}
+
+/* Angle between two directions, in degrees, from 0 to 180 */
+static double angle_diff(double a, double b)
+{
+	double d = fmod(fabs(a - b), 360.0);
+
+	return d > 180.0 ? 360.0 - d : d;
+}
+
+/* Matches probe against the reference, whose gallery side is already set up
+ * in ctx, and estimates how to align the probe on it. Returns FALSE if the
+ * samples don't match well enough to be aligned. */
+static gboolean align_sample(struct bz_ctx *ctx, int ref_len,
+	struct xyt_struct *probe, struct xyt_struct *ref,
+	struct alignment *align)
+{
+	guint16 *votes = g_new0(guint16, probe->nrows * ref->nrows);
+	struct correspondence *pairs;
+	gboolean *probe_used, *ref_used;
+	int probe_len, np, score;
+	int nr_pairs = 0, nr_kept = 0;
+	int i, j;
+
+	probe_len = bozorth_probe_init_ctx(ctx, probe);
+	np = bz_match(ctx, probe_len, ref_len);
+
+	/* Each compatible edge pair, see bz_match(), votes for the two
+	 * correspondences of its end points */
+	for (i = 0; i < np; i++) {
+		const short *row = ctx->colp[i];
+
+		votes[(row[1] - 1) * ref->nrows + row[3] - 1]++;
+		votes[(row[2] - 1) * ref->nrows + row[4] - 1]++;
+	}
+
+	score = bz_match_score(ctx, np, probe, ref);
+	fp_dbg("score %d, %d edge pairs", score, np);
+	if (score < MIN_ALIGN_SCORE) {
+		g_free(votes);
+		return FALSE;
+	}
+
+	pairs = g_new(struct correspondence, probe->nrows * ref->nrows);
+	for (i = 0; i < probe->nrows; i++)
+		for (j = 0; j < ref->nrows; j++)
+			if (votes[i * ref->nrows + j] >= MIN_VOTES) {
+				pairs[nr_pairs].votes = votes[i * ref->nrows + j];
+				pairs[nr_pairs].probe = i;
+				pairs[nr_pairs].ref = j;
+				nr_pairs++;
+			}
+	g_free(votes);
+
+	/* Keep the best backed correspondences, one per minutia */
+	qsort(pairs, nr_pairs, sizeof(*pairs), cmp_correspondences);
+	probe_used = g_new0(gboolean, probe->nrows);
+	ref_used = g_new0(gboolean, ref->nrows);
+	for (i = 0; i < nr_pairs; i++) {
+		if (probe_used[pairs[i].probe] || ref_used[pairs[i].ref])
+			continue;
+		probe_used[pairs[i].probe] = ref_used[pairs[i].ref] = TRUE;
+		pairs[nr_kept++] = pairs[i];
+	}
+	g_free(probe_used);
+	g_free(ref_used);
+
+	if (nr_kept < MIN_PAIRS) {
+		g_free(pairs);
+		return FALSE;
+	}
+
+	/* Fit again without the correspondences which end up far off */
+	fit_alignment(probe, ref, pairs, nr_kept, align);
+	for (i = 0, j = 0; i < nr_kept; i++) {
+		double x, y;
+
+		align_point(align, probe->xcol[pairs[i].probe],
+			probe->ycol[pairs[i].probe], &x, &y);
+		if (hypot(x - ref->xcol[pairs[i].ref], y - ref->ycol[pairs[i].ref])
+				<= 2 * MERGE_DIST)
+			pairs[j++] = pairs[i];
+	}
+	if (j >= MIN_PAIRS && j < nr_kept)
+		fit_alignment(probe, ref, pairs, j, align);
+	fp_dbg("%d correspondences, %d consistent, rotation %.1f", nr_kept, j,
+		align->rot);
+
+	g_free(pairs);
+	return j >= MIN_PAIRS;
+}
+
+static void merge_sample(GArray *merged, struct xyt_struct *xyt,
+	struct alignment *align, int sample)
+{
+	int i, j;
+
+	for (i = 0; i < xyt->nrows; i++) {
+		struct merged_minutia *best = NULL;
+		double best_dist = MERGE_DIST;
+		double x, y, theta;
+
+		align_point(align, xyt->xcol[i], xyt->ycol[i], &x, &y);
+		theta = xyt->thetacol[i] + align->rot;
+
+		for (j = 0; j < merged->len; j++) {
+			struct merged_minutia *m = &g_array_index(merged,
+				struct merged_minutia, j);
+			double dist;
+
+			if (m->sample == sample)
+				continue;
+			dist = hypot(m->x / m->support - x, m->y / m->support - y);
+			if (dist <= best_dist && angle_diff(theta,
+					atan2(m->dy, m->dx) * 180.0 / M_PI) <= MERGE_ANGLE) {
+				best = m;
+				best_dist = dist;
+			}
+		}
+
+		if (!best) {
+			struct merged_minutia m = { 0, };
+
+			g_array_append_val(merged, m);
+			best = &g_array_index(merged, struct merged_minutia,
+				merged->len - 1);
+		}
+		best->x += x;
+		best->y += y;
+		best->dx += cos(theta * M_PI / 180.0);
+		best->dy += sin(theta * M_PI / 180.0);
+		best->support++;
+		best->sample = sample;
+	}
+}
+
+/* Most supported first */
+static int cmp_support(const void *a, const void *b)
+{
+	const struct minutiae_struct *ma = a;
+	const struct minutiae_struct *mb = b;
+
+	return mb->col[3] - ma->col[3];
+}
+
+static struct fp_print_data_item *merged_to_item(GArray *merged)
+{
+	struct minutiae_struct *c;
+	struct fp_print_data_item *item;
+	struct fpi_xyt *xyt;
+	int i, nmin;
+
+	c = g_new(struct minutiae_struct, merged->len);
+	for (i = 0; i < merged->len; i++) {
+		struct merged_minutia *m = &g_array_index(merged,
+			struct merged_minutia, i);
+		int theta = (int) lround(atan2(m->dy, m->dx) * 180.0 / M_PI);
+
+		c[i].col[0] = (int) lround(m->x / m->support);
+		c[i].col[1] = (int) lround(m->y / m->support);
+		c[i].col[2] = theta <= -180 ? theta + 360 : theta;
+		c[i].col[3] = m->support;
+	}
+
+	/* The matcher then expects the minutiae sorted by position */
+	nmin = MIN(merged->len, fpi_img_get_template_max_minutiae());
+	qsort(c, merged->len, sizeof(*c), cmp_support);
+	qsort(c, nmin, sizeof(*c), sort_x_y);
+
+	item = fpi_print_data_item_new(FPI_XYT_SIZE(nmin));
+	xyt = (struct fpi_xyt *) item->data;
+	xyt->nrows = nmin;
+	for (i = 0; i < nmin; i++) {
+		xyt->cols[i]            = c[i].col[0];
+		xyt->cols[nmin + i]     = c[i].col[1];
+		xyt->cols[2 * nmin + i] = c[i].col[2];
+	}
+	g_free(c);
+	return item;
+}
+
+static struct fp_print_data_item *item_copy(struct fp_print_data_item *item)
+{
+	struct fp_print_data_item *copy = fpi_print_data_item_new(item->length);
+
+	memcpy(copy->data, item->data, item->length);
+	return copy;
+}
+
+/* Picks the sample scoring best against all the other ones */
+static int pick_reference(struct bz_ctx *ctx, struct xyt_struct *xyts,
+	int nr_samples)
+{
+	int best = 0, best_total = -1;
+	int i, j;
+
+	for (i = 0; i < nr_samples; i++) {
+		int total = 0;
+
+		for (j = 0; j < nr_samples; j++)
+			if (j != i)
+				total += bozorth_main_ctx(ctx, &xyts[j], &xyts[i]);
+		if (total > best_total) {
+			best_total = total;
+			best = i;
+		}
+	}
+	return best;
+}
+
+int fpi_print_data_consolidate(struct fp_print_data *print,
+	struct fp_print_data **ret)
+{
+	struct alignment identity = { 1.0, 0.0, 0.0, 0.0, 0.0 };
+	struct fp_print_data *result;
+	struct fp_print_data_item **items;
+	struct xyt_struct *xyts;
+	gboolean *aligned;
+	GArray *merged;
+	struct bz_ctx *ctx;
+	int nr_samples, ref, ref_len, nr_aligned = 1;
+	GSList *elem;
+	int i;
+
+	if (print->type != PRINT_DATA_NBIS_MINUTIAE) {
+		fp_err("only image-based prints can be consolidated");
+		return -EINVAL;
+	}
+
+	ctx = fpi_img_get_bz_ctx();
+	if (!ctx)
+		return -ENOMEM;
+
+	nr_samples = g_slist_length(print->prints);
+	if (nr_samples == 0) {
+		fp_err("no samples to consolidate");
+		return -EINVAL;
+	}
+
+	items = g_new(struct fp_print_data_item *, nr_samples);
+	xyts = g_new(struct xyt_struct, nr_samples);
+	aligned = g_new0(gboolean, nr_samples);
+	for (i = 0, elem = print->prints; elem; i++, elem = g_slist_next(elem)) {
+		items[i] = elem->data;
+		fpi_print_data_item_get_xyt(items[i], &xyts[i]);
+	}
+
+	ref = pick_reference(ctx, xyts, nr_samples);
+	aligned[ref] = TRUE;
+
+	merged = g_array_new(FALSE, FALSE, sizeof(struct merged_minutia));
+	merge_sample(merged, &xyts[ref], &identity, ref);
+
+	ref_len = bozorth_gallery_init_ctx(ctx, &xyts[ref]);
+	for (i = 0; i < nr_samples; i++) {
+		struct alignment align;
+
+		if (i == ref || !align_sample(ctx, ref_len, &xyts[i], &xyts[ref],
+				&align))
+			continue;
+		merge_sample(merged, &xyts[i], &align, i);
+		aligned[i] = TRUE;
+		nr_aligned++;
+	}
+
+	/* The consolidated sample comes first, followed by the samples which
+	 * couldn't be aligned */
+	result = fpi_print_data_new_typed(print->driver_id, print->devtype,
+		print->type);
+	for (i = nr_samples - 1; i >= 0; i--)
+		if (!aligned[i])
+			result->prints = g_slist_prepend(result->prints,
+				item_copy(items[i]));
+	result->prints = g_slist_prepend(result->prints,
+		nr_aligned > 1 ? merged_to_item(merged) : item_copy(items[ref]));
+	fp_dbg("%d of %d samples merged into %u minutiae", nr_aligned,
+		nr_samples,
+		MIN(merged->len, fpi_img_get_template_max_minutiae()));
+
+	g_array_free(merged, TRUE);
+	g_free(aligned);
+	g_free(xyts);
+	g_free(items);
+	*ret = result;
+	return 0;
+}
+
+gboolean fpi_print_data_consolidation_enabled(void)
+{
+	return g_atomic_int_get(&consolidate_enrollments);
+}
+
+/** \ingroup print_data
+ * Merges the samples of an enrolled print into a single one. The samples
+ * are aligned on the one matching the others best, and the minutiae found
+ * at the same place in several samples are merged. The merged minutiae seen
+ * in the most samples are kept, up to the number set with
+ * fp_set_template_max_minutiae().
+ *
+ * Samples which don't match the others well enough to be aligned are kept
+ * as separate samples in the new print. Verification and identification
+ * then match once against the consolidated sample, instead of once per
+ * sample of the original print.
+ *
+ * \param print the enrolled print, from an imaging device
+ * \param ret output location for the consolidated print, to be freed with
+ * fp_print_data_free()
+ * \returns 0 on success, negative error code otherwise
+ */
+API_EXPORTED int fp_print_data_consolidate(struct fp_print_data *print,
+	struct fp_print_data **ret)
+{
+	return fpi_print_data_consolidate(print, ret);
+}
+
+/** \ingroup dev
+ * Sets whether the prints enrolled from imaging devices are consolidated
+ * once all their samples have been scanned, as done by
+ * fp_print_data_consolidate(). This is disabled by default.
+ *
+ * \param enabled non-zero to consolidate enrolled prints
+ */
+API_EXPORTED void fp_set_enroll_consolidation(int enabled)
+{
+	g_atomic_int_set(&consolidate_enrollments, !!enabled);
+}
@@ -21,6 +21,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <glib.h>
 #include <libusb.h>
@@ -30,8 +31,27 @@
 static int log_level = 0;
 static int log_level_fixed = 0;
 
-libusb_context *fpi_usb_ctx = NULL;
-GSList *opened_devices = NULL;
+#ifdef ENABLE_DEBUG_LOGGING
+int fpi_log_threshold = FPRINT_LOG_LEVEL_DEBUG;
+#else
+int fpi_log_threshold = FPRINT_LOG_LEVEL_NONE;
+#endif
+
+/* Per component limits on the number of messages printed each second */
+struct log_limit {
+	char *component;
+	unsigned int per_second;
+	gint64 window_start;
+	unsigned int count;
+	unsigned int suppressed;
+};
+
+static GSList *log_limits = NULL;
+static GMutex log_limit_lock;
+
+/* the context set up by fp_init(), used by the functions which don't take
+ * a context */
+struct fp_context *fpi_default_ctx = NULL;
 
 /**
  * \mainpage libfprint API Reference
@@ -281,21 +301,147 @@ GSList *opened_devices = NULL;
 
 static GSList *registered_drivers = NULL;
 
+/* The USB IDs of all registered drivers, sorted by VID:PID and then in the
+ * order drivers were tried before the table existed, which is what
+ * find_supporting_driver() falls back to between drivers supporting the
+ * same device */
+struct driver_usb_id {
+	uint16_t vendor;
+	uint16_t product;
+	unsigned int order;
+	struct fp_driver *drv;
+	const struct usb_id *id;
+};
+
+static struct driver_usb_id *driver_usb_ids = NULL;
+static unsigned int nr_driver_usb_ids = 0;
+
+static void set_log_level(int level)
+{
+	log_level = level;
+	if (level <= 0)
+		fpi_log_threshold = FPRINT_LOG_LEVEL_NONE;
+	else if (level == 1)
+		fpi_log_threshold = FPRINT_LOG_LEVEL_ERROR;
+	else if (level == 2)
+		fpi_log_threshold = FPRINT_LOG_LEVEL_WARNING;
+	else if (level == 3)
+		fpi_log_threshold = FPRINT_LOG_LEVEL_INFO;
+	else
+		fpi_log_threshold = FPRINT_LOG_LEVEL_DEBUG;
+}
+
+static struct log_limit *find_log_limit(const char *component)
+{
+	GSList *elem;
+
+	for (elem = log_limits; elem; elem = g_slist_next(elem)) {
+		struct log_limit *limit = elem->data;
+		if (strcmp(limit->component, component) == 0)
+			return limit;
+	}
+	return NULL;
+}
+
+/* Limits the messages of a component, other than errors, to per_second
+ * messages each second. 0 removes the limit. */
+void fpi_log_set_limit(const char *component, unsigned int per_second)
+{
+	struct log_limit *limit;
+
+	g_mutex_lock(&log_limit_lock);
+	limit = find_log_limit(component);
+	if (!limit && per_second) {
+		limit = g_malloc0(sizeof(*limit));
+		limit->component = g_strdup(component);
+		log_limits = g_slist_prepend(log_limits, limit);
+	} else if (limit && !per_second) {
+		log_limits = g_slist_remove(log_limits, limit);
+		g_free(limit->component);
+		g_free(limit);
+		limit = NULL;
+	}
+	if (limit)
+		limit->per_second = per_second;
+	g_mutex_unlock(&log_limit_lock);
+}
+
+/* Parses LIBFPRINT_DEBUG_LIMIT, a list such as "aes2501:20,upeksonly:50" */
+static void parse_log_limits(const char *str)
+{
+	gchar **items = g_strsplit(str, ",", 0);
+	int i;
+
+	for (i = 0; items[i]; i++) {
+		char *sep = strchr(items[i], ':');
+
+		if (!sep || sep == items[i])
+			continue;
+		*sep = '\0';
+		fpi_log_set_limit(items[i], atoi(sep + 1));
+	}
+	g_strfreev(items);
+}
+
+static void free_log_limits(void)
+{
+	GSList *elem;
+
+	for (elem = log_limits; elem; elem = g_slist_next(elem)) {
+		struct log_limit *limit = elem->data;
+		g_free(limit->component);
+		g_free(limit);
+	}
+	g_slist_free(log_limits);
+	log_limits = NULL;
+}
+
+/* Returns whether a message of a component may be printed, and in
+ * *suppressed how many were dropped before it, if it opens a new window */
+static gboolean log_allowed(const char *component, unsigned int *suppressed)
+{
+	struct log_limit *limit;
+	gboolean allowed = TRUE;
+	gint64 now;
+
+	*suppressed = 0;
+	g_mutex_lock(&log_limit_lock);
+	limit = find_log_limit(component);
+	if (limit) {
+		now = g_get_monotonic_time();
+		if (now - limit->window_start >= G_USEC_PER_SEC) {
+			*suppressed = limit->suppressed;
+			limit->window_start = now;
+			limit->count = 0;
+			limit->suppressed = 0;
+		}
+		if (limit->count < limit->per_second) {
+			limit->count++;
+		} else {
+			limit->suppressed++;
+			allowed = FALSE;
+		}
+	}
+	g_mutex_unlock(&log_limit_lock);
+	return allowed;
+}
+
 void fpi_log(enum fpi_log_level level, const char *component,
 	const char *function, const char *format, ...)
 {
 	va_list args;
 	FILE *stream = stdout;
 	const char *prefix;
+	unsigned int suppressed = 0;
 
-#ifndef ENABLE_DEBUG_LOGGING
-	if (!log_level)
+	if (level < fpi_log_threshold)
 		return;
-	if (level == FPRINT_LOG_LEVEL_WARNING && log_level < 2)
-		return;
-	if (level == FPRINT_LOG_LEVEL_INFO && log_level < 3)
+
+	if (!component)
+		component = "fp";
+	if (log_limits && level != FPRINT_LOG_LEVEL_ERROR &&
+			!log_allowed(component, &suppressed))
 		return;
-#endif
 
 	switch (level) {
 	case FPRINT_LOG_LEVEL_INFO:
@@ -319,8 +465,11 @@ void fpi_log(enum fpi_log_level level, const char *component,
 		break;
 	}
 
-	fprintf(stream, "%s:%s [%s] ", component ? component : "fp", prefix,
-		function);
+	if (suppressed)
+		fprintf(stream, "%s:%s [%s] %u messages suppressed\n", component,
+			prefix, function, suppressed);
+
+	fprintf(stream, "%s:%s [%s] ", component, prefix, function);
 
 	va_start (args, format);
 	vfprintf(stream, format, args);
@@ -410,6 +559,50 @@ static struct fp_img_driver * const img_drivers[] = {
 	*/
 };
 
+static int driver_usb_id_cmp(const void *a, const void *b)
+{
+	const struct driver_usb_id *ida = a;
+	const struct driver_usb_id *idb = b;
+
+	if (ida->vendor != idb->vendor)
+		return ida->vendor < idb->vendor ? -1 : 1;
+	if (ida->product != idb->product)
+		return ida->product < idb->product ? -1 : 1;
+	if (ida->order != idb->order)
+		return ida->order < idb->order ? -1 : 1;
+	return 0;
+}
+
+static void build_driver_usb_ids(void)
+{
+	GSList *elem;
+	const struct usb_id *id;
+	unsigned int n = 0;
+
+	for (elem = registered_drivers; elem; elem = g_slist_next(elem)) {
+		struct fp_driver *drv = elem->data;
+		for (id = drv->id_table; id->vendor; id++)
+			n++;
+	}
+
+	driver_usb_ids = g_new(struct driver_usb_id, n);
+	n = 0;
+	for (elem = registered_drivers; elem; elem = g_slist_next(elem)) {
+		struct fp_driver *drv = elem->data;
+		for (id = drv->id_table; id->vendor; id++) {
+			driver_usb_ids[n].vendor = id->vendor;
+			driver_usb_ids[n].product = id->product;
+			driver_usb_ids[n].order = n;
+			driver_usb_ids[n].drv = drv;
+			driver_usb_ids[n].id = id;
+			n++;
+		}
+	}
+	nr_driver_usb_ids = n;
+	qsort(driver_usb_ids, n, sizeof(*driver_usb_ids), driver_usb_id_cmp);
+	fp_dbg("%u USB IDs", n);
+}
+
 static void register_drivers(void)
 {
 	unsigned int i;
@@ -422,6 +615,32 @@ static void register_drivers(void)
 		fpi_img_driver_setup(imgdriver);
 		register_driver(&imgdriver->driver);
 	}
+
+	build_driver_usb_ids();
+}
+
+/* Returns the first entry of the table with the given VID:PID, or NULL */
+static const struct driver_usb_id *lookup_driver_usb_id(uint16_t vendor,
+	uint16_t product)
+{
+	unsigned int lo = 0;
+	unsigned int hi = nr_driver_usb_ids;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		const struct driver_usb_id *entry = &driver_usb_ids[mid];
+
+		if (entry->vendor < vendor ||
+		    (entry->vendor == vendor && entry->product < product))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == nr_driver_usb_ids || driver_usb_ids[lo].vendor != vendor ||
+	    driver_usb_ids[lo].product != product)
+		return NULL;
+	return &driver_usb_ids[lo];
 }
 
 API_EXPORTED struct fp_driver **fprint_get_drivers (void)
@@ -446,8 +665,8 @@ static struct fp_driver *find_supporting_driver(libusb_device *udev,
 	const struct usb_id **usb_id, uint32_t *devtype)
 {
 	int ret;
-	GSList *elem = registered_drivers;
 	struct libusb_device_descriptor dsc;
+	const struct driver_usb_id *entry, *end;
 
 	const struct usb_id *best_usb_id;
 	struct fp_driver *best_drv;
@@ -463,39 +682,42 @@ static struct fp_driver *find_supporting_driver(libusb_device *udev,
 	best_drv = NULL;
 	best_devtype = 0;
 
-	do {
-		struct fp_driver *drv = elem->data;
+	entry = lookup_driver_usb_id(dsc.idVendor, dsc.idProduct);
+	if (!entry)
+		return NULL;
+	end = driver_usb_ids + nr_driver_usb_ids;
+
+	/* Only the drivers listing this VID:PID are left to try, in the order
+	 * they always were */
+	for (; entry < end && entry->vendor == dsc.idVendor &&
+	     entry->product == dsc.idProduct; entry++) {
+		struct fp_driver *drv = entry->drv;
 		uint32_t type = 0;
-		const struct usb_id *id;
 
-		for (id = drv->id_table; id->vendor; id++) {
-			if (dsc.idVendor == id->vendor && dsc.idProduct == id->product) {
-				if (drv->discover) {
-					int r = drv->discover(&dsc, &type);
-					if (r < 0)
-						fp_err("%s discover failed, code %d", drv->name, r);
-					if (r <= 0)
-						continue;
-					/* Has a discover function, and matched our device */
-					drv_score = 100;
-				} else {
-					/* Already got a driver as good */
-					if (drv_score >= 50)
-						continue;
-					drv_score = 50;
-				}
-				fp_dbg("driver %s supports USB device %04x:%04x",
-					drv->name, id->vendor, id->product);
-				best_usb_id = id;
-				best_drv = drv;
-				best_devtype = type;
-
-				/* We found the best possible driver */
-				if (drv_score == 100)
-					break;
-			}
+		/* We found the best possible driver of this one */
+		if (drv == best_drv && drv_score == 100)
+			continue;
+
+		if (drv->discover) {
+			int r = drv->discover(&dsc, &type);
+			if (r < 0)
+				fp_err("%s discover failed, code %d", drv->name, r);
+			if (r <= 0)
+				continue;
+			/* Has a discover function, and matched our device */
+			drv_score = 100;
+		} else {
+			/* Already got a driver as good */
+			if (drv_score >= 50)
+				continue;
+			drv_score = 50;
 		}
-	} while ((elem = g_slist_next(elem)));
+		fp_dbg("driver %s supports USB device %04x:%04x",
+			drv->name, entry->vendor, entry->product);
+		best_usb_id = entry->id;
+		best_drv = drv;
+		best_devtype = type;
+	}
 
 	if (best_drv != NULL) {
 		fp_dbg("selected driver %s supports USB device %04x:%04x",
@@ -507,7 +729,8 @@ static struct fp_driver *find_supporting_driver(libusb_device *udev,
 	return best_drv;
 }
 
-static struct fp_dscv_dev *discover_dev(libusb_device *udev)
+static struct fp_dscv_dev *discover_dev(struct fp_context *ctx,
+	libusb_device *udev)
 {
 	const struct usb_id *usb_id;
 	struct fp_driver *drv;
@@ -520,6 +743,7 @@ static struct fp_dscv_dev *discover_dev(libusb_device *udev)
 		return NULL;
 
 	ddev = g_malloc0(sizeof(*ddev));
+	ddev->ctx = ctx;
 	ddev->drv = drv;
 	ddev->udev = udev;
 	ddev->driver_data = usb_id->driver_data;
@@ -528,12 +752,15 @@ static struct fp_dscv_dev *discover_dev(libusb_device *udev)
 }
 
 /** \ingroup dscv_dev
- * Scans the system and returns a list of discovered devices. This is your
- * entry point into finding a fingerprint reader to operate.
+ * Scans the system and returns a list of discovered devices, which belong
+ * to a context: once opened, their events are handled by
+ * fp_context_handle_events() on that context.
+ * \param ctx the context to discover devices from
  * \returns a NULL-terminated list of discovered devices. Must be freed with
  * fp_dscv_devs_free() after use.
  */
-API_EXPORTED struct fp_dscv_dev **fp_discover_devs(void)
+API_EXPORTED struct fp_dscv_dev **fp_context_discover_devs(
+	struct fp_context *ctx)
 {
 	GSList *tmplist = NULL;
 	struct fp_dscv_dev **list;
@@ -546,19 +773,16 @@ API_EXPORTED struct fp_dscv_dev **fp_discover_devs(void)
 	if (registered_drivers == NULL)
 		return NULL;
 
-	r = libusb_get_device_list(fpi_usb_ctx, &devs);
+	r = libusb_get_device_list(ctx->usb_ctx, &devs);
 	if (r < 0) {
 		fp_err("couldn't enumerate USB devices, error %d", r);
 		return NULL;
 	}
 
-	/* Check each device against each driver, temporarily storing successfully
-	 * discovered devices in a GSList.
-	 *
-	 * Quite inefficient but excusable as we'll only be dealing with small
-	 * sets of drivers against small sets of USB devices */
+	/* Look each device up in the sorted USB ID table, temporarily storing
+	 * successfully discovered devices in a GSList. */
 	while ((udev = devs[i++]) != NULL) {
-		struct fp_dscv_dev *ddev = discover_dev(udev);
+		struct fp_dscv_dev *ddev = discover_dev(ctx, udev);
 		if (!ddev)
 			continue;
 		tmplist = g_slist_prepend(tmplist, (gpointer) ddev);
@@ -581,6 +805,165 @@ API_EXPORTED struct fp_dscv_dev **fp_discover_devs(void)
 	return list;
 }
 
+/** \ingroup dscv_dev
+ * Scans the system and returns a list of discovered devices. This is your
+ * entry point into finding a fingerprint reader to operate. The devices
+ * belong to the default context.
+ * \returns a NULL-terminated list of discovered devices. Must be freed with
+ * fp_dscv_devs_free() after use.
+ */
+API_EXPORTED struct fp_dscv_dev **fp_discover_devs(void)
+{
+	return fp_context_discover_devs(fpi_default_ctx);
+}
+
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000102
+static void hotplug_devs_free(struct fp_context *ctx)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->hotplug_devs->len - 1; i++) {
+		struct fp_dscv_dev *ddev = g_ptr_array_index(ctx->hotplug_devs, i);
+		libusb_unref_device(ddev->udev);
+		g_free(ddev);
+	}
+	g_ptr_array_free(ctx->hotplug_devs, TRUE);
+	ctx->hotplug_devs = NULL;
+}
+
+static int hotplug_cb(libusb_context *usb_ctx, libusb_device *udev,
+	libusb_hotplug_event event, void *user_data)
+{
+	struct fp_context *ctx = user_data;
+	struct fp_dscv_dev *ddev = NULL;
+	unsigned int i;
+
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+		ddev = discover_dev(ctx, libusb_ref_device(udev));
+		if (!ddev) {
+			libusb_unref_device(udev);
+			return 0;
+		}
+		fp_dbg("%s device arrived", ddev->drv->name);
+		/* keep the array NULL-terminated */
+		g_ptr_array_index(ctx->hotplug_devs,
+			ctx->hotplug_devs->len - 1) = ddev;
+		g_ptr_array_add(ctx->hotplug_devs, NULL);
+		if (ctx->hotplug_cb)
+			ctx->hotplug_cb(ctx, ddev, FP_HOTPLUG_DEVICE_ARRIVED,
+				ctx->hotplug_cb_data);
+		return 0;
+	}
+
+	for (i = 0; i < ctx->hotplug_devs->len - 1; i++) {
+		ddev = g_ptr_array_index(ctx->hotplug_devs, i);
+		if (ddev->udev == udev)
+			break;
+	}
+	if (i == ctx->hotplug_devs->len - 1)
+		return 0;
+
+	fp_dbg("%s device left", ddev->drv->name);
+	g_ptr_array_remove_index(ctx->hotplug_devs, i);
+	if (ctx->hotplug_cb)
+		ctx->hotplug_cb(ctx, ddev, FP_HOTPLUG_DEVICE_LEFT,
+			ctx->hotplug_cb_data);
+	libusb_unref_device(ddev->udev);
+	g_free(ddev);
+	return 0;
+}
+#endif
+
+/** \ingroup dscv_dev
+ * Tracks supported devices being plugged in and unplugged, so that
+ * applications waiting for a reader don't have to call
+ * fp_context_discover_devs() over and over. The callback is called for the
+ * devices which are already plugged in before this function returns, and
+ * then for devices plugged in or unplugged from
+ * fp_context_handle_events(). Only one callback can be registered on a
+ * context at a time.
+ *
+ * \param ctx the context to track devices on
+ * \param cb the callback to notify, or NULL to only maintain the list
+ * returned by fp_context_get_hotplug_devs()
+ * \param user_data user data to pass to the callback
+ * \returns 0 on success, -EBUSY if a callback is already registered,
+ * -ENOTSUP if hotplug is not supported on this platform, or another
+ * negative error code
+ */
+API_EXPORTED int fp_context_hotplug_register(struct fp_context *ctx,
+	fp_hotplug_cb cb, void *user_data)
+{
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000102
+	int r;
+
+	if (ctx->hotplug_registered)
+		return -EBUSY;
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return -ENOTSUP;
+
+	ctx->hotplug_cb = cb;
+	ctx->hotplug_cb_data = user_data;
+	ctx->hotplug_devs = g_ptr_array_new();
+	g_ptr_array_add(ctx->hotplug_devs, NULL);
+
+	/* the devices already there are reported from here */
+	r = libusb_hotplug_register_callback(ctx->usb_ctx,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+		LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_ENUMERATE,
+		LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+		LIBUSB_HOTPLUG_MATCH_ANY, hotplug_cb, ctx, &ctx->hotplug_handle);
+	if (r < 0) {
+		fp_err("couldn't register hotplug callback, error %d", r);
+		hotplug_devs_free(ctx);
+		ctx->hotplug_cb = NULL;
+		ctx->hotplug_cb_data = NULL;
+		return -EIO;
+	}
+	ctx->hotplug_registered = TRUE;
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+/** \ingroup dscv_dev
+ * Stops tracking devices on a context, and frees the discovered devices
+ * returned by fp_context_get_hotplug_devs(). Devices opened in the meantime
+ * stay open.
+ * \param ctx the context to stop tracking devices on
+ */
+API_EXPORTED void fp_context_hotplug_deregister(struct fp_context *ctx)
+{
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000102
+	if (!ctx->hotplug_registered)
+		return;
+
+	libusb_hotplug_deregister_callback(ctx->usb_ctx, ctx->hotplug_handle);
+	hotplug_devs_free(ctx);
+	ctx->hotplug_cb = NULL;
+	ctx->hotplug_cb_data = NULL;
+	ctx->hotplug_registered = FALSE;
+#endif
+}
+
+/** \ingroup dscv_dev
+ * Gets the supported devices which are plugged in, as tracked since
+ * fp_context_hotplug_register(). Unlike fp_context_discover_devs(), this
+ * doesn't scan the system.
+ * \param ctx the context tracking devices
+ * \returns a NULL-terminated list of discovered devices, which belongs to the
+ * context and may change whenever its events are handled, or NULL if devices
+ * aren't tracked on this context
+ */
+API_EXPORTED struct fp_dscv_dev **fp_context_get_hotplug_devs(
+	struct fp_context *ctx)
+{
+	if (!ctx->hotplug_registered)
+		return NULL;
+	return (struct fp_dscv_dev **) ctx->hotplug_devs->pdata;
+}
+
 /** \ingroup dscv_dev
  * Free a list of discovered devices. This function destroys the list and all
  * discovered devices that it included, so make sure you have opened your
@@ -874,6 +1257,79 @@ API_EXPORTED int fp_dev_get_img_height(struct fp_dev *dev)
 	return fpi_imgdev_get_img_height(imgdev);
 }
 
+/** \ingroup dev
+ * Sets how long an imaging device stays initialised after an enroll, verify,
+ * identify or capture action has stopped. An action started within that time
+ * skips the initialisation of the sensor, which some drivers spend a good
+ * part of a second on. Afterwards, or after closing the device, the sensor
+ * is initialised from scratch again.
+ *
+ * The default is 10 seconds, for the drivers supporting it.
+ * \param dev the device
+ * \param timeout the time in milliseconds, or 0 to initialise the sensor for
+ * every action
+ * \returns 0 on success, -ENOTSUP if the driver doesn't support keeping the
+ * sensor initialised
+ */
+API_EXPORTED int fp_dev_set_standby_timeout(struct fp_dev *dev,
+	unsigned int timeout)
+{
+	struct fp_img_dev *imgdev = dev_to_img_dev(dev);
+
+	if (!imgdev)
+		return -ENOTSUP;
+	return fpi_imgdev_set_standby_timeout(imgdev, timeout);
+}
+
+/** \ingroup dev
+ * Attaches an image archive to an imaging device: every image the device
+ * captures from then on is archived, whatever the action, before it is
+ * processed. Several devices may share an archive, which must be detached
+ * from all of them before it is closed.
+ * \param dev the device
+ * \param archive the archive, or NULL to detach the current one
+ * \returns 0 on success, -ENOTSUP for devices which don't capture images
+ */
+API_EXPORTED int fp_dev_set_img_archive(struct fp_dev *dev,
+	struct fp_img_archive *archive)
+{
+	struct fp_img_dev *imgdev = dev_to_img_dev(dev);
+
+	if (!imgdev)
+		return -ENOTSUP;
+	imgdev->archive = archive;
+	return 0;
+}
+
+/** \ingroup dev
+ * Sets a callback showing the progress of swipes while they are captured,
+ * for drivers assembling images from strips or lines. The callback gets
+ * the latest strip, or the lines read so far, straight from the buffers
+ * of the driver, without copies. It is called from fp_handle_events(), at
+ * most once per interval: the strips and lines read in the meantime are
+ * only seen as part of a later preview, or not at all.
+ *
+ * Other drivers never call the callback.
+ * \param dev the device
+ * \param callback the callback, or NULL to stop the previews
+ * \param interval the minimum time between two previews, in milliseconds
+ * \param user_data data to pass to the callback
+ * \returns 0 on success, -ENOTSUP for devices which don't capture images
+ */
+API_EXPORTED int fp_dev_set_img_preview(struct fp_dev *dev,
+	fp_img_preview_cb callback, unsigned int interval, void *user_data)
+{
+	struct fp_img_dev *imgdev = dev_to_img_dev(dev);
+
+	if (!imgdev)
+		return -ENOTSUP;
+	imgdev->preview_cb = callback;
+	imgdev->preview_data = user_data;
+	imgdev->preview_interval = interval;
+	imgdev->preview_last = 0;
+	return 0;
+}
+
 /** \ingroup core
  * Set message verbosity.
  *  - Level 0: no messages ever printed by the library (default)
@@ -897,10 +1353,17 @@ API_EXPORTED int fp_dev_get_img_height(struct fp_dev *dev)
  * If libfprint was compiled without any message logging, this function does
  * nothing: you'll never get any messages.
  *
- * If libfprint was compiled with verbose debug message logging, this function
- * does nothing: you'll always get messages from all levels.
+ * If libfprint was compiled with verbose debug message logging, messages
+ * from all levels are printed until a level is set, and level 4 or above
+ * includes the debug messages.
+ *
+ * The LIBFPRINT_DEBUG_LIMIT environment variable limits how many messages
+ * noisy components print each second, for example "aes2501:20,upeksonly:50".
+ * Errors are never limited.
+ *
+ * The level applies to the contexts created afterwards, and to the default
+ * context.
  *
- * \param ctx the context to operate on, or NULL for the default context
  * \param level debug level to set
  */
 API_EXPORTED void fp_set_debug(int level)
@@ -908,8 +1371,81 @@ API_EXPORTED void fp_set_debug(int level)
 	if (log_level_fixed)
 		return;
 
-	log_level = level;
-	libusb_set_debug(fpi_usb_ctx, level);
+	set_log_level(level);
+	libusb_set_debug(fpi_default_ctx->usb_ctx, level);
+}
+
+static struct fp_context *context_new(void)
+{
+	struct fp_context *ctx = g_malloc0(sizeof(*ctx));
+	int r;
+
+	r = libusb_init(&ctx->usb_ctx);
+	if (r < 0) {
+		fp_err("libusb_init failed, error %d", r);
+		g_free(ctx);
+		return NULL;
+	}
+	if (log_level)
+		libusb_set_debug(ctx->usb_ctx, log_level);
+
+	g_mutex_init(&ctx->worker_lock);
+	fpi_poll_init(ctx);
+	return ctx;
+}
+
+static void context_free(struct fp_context *ctx)
+{
+	fp_context_hotplug_deregister(ctx);
+
+	if (ctx->opened_devices) {
+		GSList *copy = g_slist_copy(ctx->opened_devices);
+		GSList *elem = copy;
+		fp_dbg("naughty app left devices open on exit!");
+
+		do
+			fp_dev_close((struct fp_dev *) elem->data);
+		while ((elem = g_slist_next(elem)));
+
+		g_slist_free(copy);
+		g_slist_free(ctx->opened_devices);
+		ctx->opened_devices = NULL;
+	}
+
+	fpi_poll_exit(ctx);
+	g_mutex_clear(&ctx->worker_lock);
+	libusb_exit(ctx->usb_ctx);
+	g_free(ctx);
+}
+
+/** \ingroup core
+ * Creates a context, with its own USB context, timers and worker thread.
+ * Devices discovered from different contexts can be used from different
+ * threads at once, each thread handling the events of its own context. A
+ * context must not be used from several threads at a time.
+ *
+ * fp_init() must be called before creating contexts, and the contexts must
+ * be freed before calling fp_exit().
+ *
+ * \returns the new context, or NULL on error
+ */
+API_EXPORTED struct fp_context *fp_context_new(void)
+{
+	fp_dbg("");
+	return context_new();
+}
+
+/** \ingroup core
+ * Frees a context created by fp_context_new(). The devices left open on the
+ * context are closed.
+ *
+ * \param ctx the context to free. If NULL, function simply returns.
+ */
+API_EXPORTED void fp_context_free(struct fp_context *ctx)
+{
+	fp_dbg("");
+	if (ctx)
+		context_free(ctx);
 }
 
 /** \ingroup core
@@ -920,23 +1456,22 @@ API_EXPORTED void fp_set_debug(int level)
 API_EXPORTED int fp_init(void)
 {
 	char *dbg = getenv("LIBFPRINT_DEBUG");
-	int r;
+	char *limits = getenv("LIBFPRINT_DEBUG_LIMIT");
 	fp_dbg("");
 
-	r = libusb_init(&fpi_usb_ctx);
-	if (r < 0)
-		return r;
-
 	if (dbg) {
-		log_level = atoi(dbg);
-		if (log_level) {
+		set_log_level(atoi(dbg));
+		if (log_level)
 			log_level_fixed = 1;
-			libusb_set_debug(fpi_usb_ctx, log_level);
-		}
 	}
+	if (limits)
+		parse_log_limits(limits);
+
+	fpi_default_ctx = context_new();
+	if (!fpi_default_ctx)
+		return -EIO;
 
 	register_drivers();
-	fpi_poll_init();
 	return 0;
 }
 
@@ -949,24 +1484,18 @@ API_EXPORTED void fp_exit(void)
 {
 	fp_dbg("");
 
-	if (opened_devices) {
-		GSList *copy = g_slist_copy(opened_devices);
-		GSList *elem = copy;
-		fp_dbg("naughty app left devices open on exit!");
-
-		do
-			fp_dev_close((struct fp_dev *) elem->data);
-		while ((elem = g_slist_next(elem)));
-
-		g_slist_free(copy);
-		g_slist_free(opened_devices);
-		opened_devices = NULL;
-	}
+	/* close the devices, and complete the pending work, before the
+	 * storage and image processing state goes away */
+	context_free(fpi_default_ctx);
+	fpi_default_ctx = NULL;
 
 	fpi_data_exit();
-	fpi_poll_exit();
+	fpi_img_exit();
 	g_slist_free(registered_drivers);
 	registered_drivers = NULL;
-	libusb_exit(fpi_usb_ctx);
+	g_free(driver_usb_ids);
+	driver_usb_ids = NULL;
+	nr_driver_usb_ids = 0;
+	free_log_limits();
 }
 
@@ -19,8 +19,10 @@
 
 #include <config.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -29,6 +31,7 @@
 #include <glib/gstdio.h>
 
 #include "fp_internal.h"
+#include "nbis/include/bozorth.h"
 
 #define DIR_PERMS 0700
 
@@ -48,24 +51,76 @@
  */
 
 static char *base_store = NULL;
+static GMutex storage_lock;
+
+/* Prints loaded by fp_print_data_load() are kept in a least recently used
+ * cache, disabled by default, see fp_set_print_data_cache_limits(). The
+ * cache holds private copies of the prints. */
+struct print_cache_entry {
+	GList link;
+	guint64 key;
+	size_t size;
+	struct fp_print_data *data;
+};
+
+static GHashTable *print_cache = NULL;
+static GQueue print_cache_lru = G_QUEUE_INIT;
+static unsigned int print_cache_max_prints = 0;
+static size_t print_cache_max_size = 0;
+static size_t print_cache_size = 0;
+static guint64 print_cache_hits = 0;
+static guint64 print_cache_misses = 0;
+static GMutex print_cache_lock;
+
+#define PRINT_CACHE_KEY(driver_id, devtype, finger) \
+	(((guint64) (driver_id) << 40) | ((guint64) (devtype) << 8) | (finger))
 
+static void print_cache_clear(void);
+
+/* Whether saved prints have their minutiae packed, see
+ * fp_set_print_data_compression() */
+static gint compress_prints = 0;
+
+/* Sets up base_store on first use, from whichever thread gets there first */
 static void storage_setup(void)
 {
 	const char *homedir;
 
+	g_mutex_lock(&storage_lock);
+	if (base_store)
+		goto out;
+
 	homedir = g_getenv("HOME");
 	if (!homedir)
 		homedir = g_get_home_dir();
 	if (!homedir)
-		return;
+		goto out;
 
 	base_store = g_build_filename(homedir, ".fprint/prints", NULL);
 	g_mkdir_with_parents(base_store, DIR_PERMS);
 	/* FIXME handle failure */
+out:
+	g_mutex_unlock(&storage_lock);
+}
+
+/* Path of a directory next to the print store, for other per-user state */
+char *fpi_data_get_store_sibling(const char *name)
+{
+	char *parent, *path;
+
+	storage_setup();
+	if (!base_store)
+		return NULL;
+
+	parent = g_path_get_dirname(base_store);
+	path = g_build_filename(parent, name, NULL);
+	g_free(parent);
+	return path;
 }
 
 void fpi_data_exit(void)
 {
+	print_cache_clear();
 	g_free(base_store);
 }
 
@@ -102,11 +157,14 @@ static struct fp_print_data *print_data_new(uint16_t driver_id,
 	data->driver_id = driver_id;
 	data->devtype = devtype;
 	data->type = type;
+	data->refcount = 1;
 	return data;
 }
 
 void fpi_print_data_item_free(struct fp_print_data_item *item)
 {
+	if (!item->template_borrowed)
+		bozorth_template_free(item->bz_template);
 	g_free(item);
 }
 
@@ -114,100 +172,446 @@ struct fp_print_data_item *fpi_print_data_item_new(size_t length)
 {
 	struct fp_print_data_item *item = g_malloc0(sizeof(*item) + length);
 	item->length = length;
+	item->data = item->buf;
+
+	return item;
+}
+
+/* Creates an item referring to data, which must outlive it */
+struct fp_print_data_item *fpi_print_data_item_borrow(
+	const unsigned char *data, size_t length)
+{
+	struct fp_print_data_item *item = g_malloc0(sizeof(*item));
+	item->length = length;
+	item->data = (unsigned char *) data;
 
 	return item;
 }
 
+struct fp_print_data *fpi_print_data_new_typed(uint16_t driver_id,
+	uint32_t devtype, enum fp_print_data_type type)
+{
+	return print_data_new(driver_id, devtype, type);
+}
+
 struct fp_print_data *fpi_print_data_new(struct fp_dev *dev)
 {
 	return print_data_new(dev->drv->id, dev->devtype,
 		fpi_driver_get_data_type(dev->drv));
 }
 
-/** \ingroup print_data
- * Convert a stored print into a unified representation inside a data buffer.
- * You can then store this data buffer in any way that suits you, and load
- * it back at some later time using fp_print_data_from_data().
- * \param data the stored print
- * \param ret output location for the data buffer. Must be freed with free()
- * after use.
- * \returns the size of the freshly allocated buffer, or 0 on error.
- */
-API_EXPORTED size_t fp_print_data_get_data(struct fp_print_data *data,
-	unsigned char **ret)
+/* FP3 data has the same header as FP2, followed by the samples, each one
+ * prefixed with its length as a varint. NBIS samples hold a varint number of
+ * minutiae and the zigzag varint x, y and theta of every minutia, so that
+ * they don't depend on the byte order or word size of the host. Anything
+ * following the minutiae is left for optional sections, and ignored. */
+
+/* Writes v to buf, unless buf is NULL. Returns the size of the varint. */
+static size_t put_varint(unsigned char *buf, uint32_t v)
+{
+	size_t len = 1;
+
+	for (; v >= 0x80; v >>= 7, len++)
+		if (buf)
+			*buf++ = (v & 0x7f) | 0x80;
+	if (buf)
+		*buf = v;
+	return len;
+}
+
+static gboolean get_varint(const unsigned char **buf,
+	const unsigned char *end, uint32_t *v)
+{
+	const unsigned char *p = *buf;
+	uint32_t value = 0;
+	int shift;
+
+	for (shift = 0; p < end && shift < 32; shift += 7) {
+		value |= (uint32_t) (*p & 0x7f) << shift;
+		if (!(*p++ & 0x80)) {
+			*v = value;
+			*buf = p;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+#define ZIGZAG_ENCODE(v)	(((uint32_t) (v) << 1) ^ (uint32_t) -((v) < 0))
+#define ZIGZAG_DECODE(v)	((int) (((v) >> 1) ^ -((v) & 1)))
+
+/* FP4 data is laid out as FP3, except for NBIS samples, whose minutiae
+ * are packed in as few bits as possible. After a varint number of minutiae
+ * come the first x and the smallest y and theta as zigzag varints, then the
+ * number of bits used for each column, in 3 bytes. Each minutia then takes
+ * the zigzag difference between its x and the previous one, as minutiae
+ * are sorted by x, and its y and theta relative to the smallest ones, in
+ * that many bits, starting from the least significant bit of each byte. */
+
+static int bit_width(uint32_t v)
+{
+	int width = 0;
+
+	for (; v; v >>= 1)
+		width++;
+	return width;
+}
+
+static void put_bits(unsigned char *buf, size_t *pos, uint32_t v, int width)
+{
+	while (width > 0) {
+		int shift = *pos % 8;
+		int n = MIN(8 - shift, width);
+
+		buf[*pos / 8] |= (v & ((1u << n) - 1)) << shift;
+		v >>= n;
+		width -= n;
+		*pos += n;
+	}
+}
+
+struct bit_reader {
+	const unsigned char *p;
+	const unsigned char *end;
+	uint64_t bits;
+	int nr_bits;
+};
+
+static gboolean get_bits(struct bit_reader *reader, int width, uint32_t *v)
+{
+	while (reader->nr_bits < width) {
+		if (reader->p == reader->end)
+			return FALSE;
+		reader->bits |= (uint64_t) *reader->p++ << reader->nr_bits;
+		reader->nr_bits += 8;
+	}
+
+	*v = reader->bits & (((uint64_t) 1 << width) - 1);
+	reader->bits >>= width;
+	reader->nr_bits -= width;
+	return TRUE;
+}
+
+static size_t xyt_to_packed(struct xyt_struct *xyt, unsigned char *buf)
+{
+	uint32_t mask[3] = { 0, 0, 0 };
+	int min_y, min_t;
+	int widths[3];
+	size_t len, pos;
+	int i, j;
+
+	if (xyt->nrows == 0)
+		return put_varint(buf, 0);
+
+	min_y = xyt->ycol[0];
+	min_t = xyt->thetacol[0];
+	for (i = 1; i < xyt->nrows; i++) {
+		min_y = MIN(min_y, xyt->ycol[i]);
+		min_t = MIN(min_t, xyt->thetacol[i]);
+	}
+	/* the widths only depend on the highest bits set */
+	for (i = 0; i < xyt->nrows; i++) {
+		int dx = i ? (uint32_t) xyt->xcol[i] - xyt->xcol[i - 1] : 0;
+
+		mask[0] |= ZIGZAG_ENCODE(dx);
+		mask[1] |= (uint32_t) xyt->ycol[i] - min_y;
+		mask[2] |= (uint32_t) xyt->thetacol[i] - min_t;
+	}
+	for (j = 0; j < 3; j++)
+		widths[j] = bit_width(mask[j]);
+
+	len = put_varint(buf, xyt->nrows);
+	len += put_varint(buf ? buf + len : NULL, ZIGZAG_ENCODE(xyt->xcol[0]));
+	len += put_varint(buf ? buf + len : NULL, ZIGZAG_ENCODE(min_y));
+	len += put_varint(buf ? buf + len : NULL, ZIGZAG_ENCODE(min_t));
+	if (buf) {
+		for (j = 0; j < 3; j++)
+			buf[len + j] = widths[j];
+	}
+	len += 3;
+
+	pos = (size_t) xyt->nrows * (widths[0] + widths[1] + widths[2]);
+	if (!buf)
+		return len + (pos + 7) / 8;
+
+	buf += len;
+	memset(buf, 0, (pos + 7) / 8);
+	pos = 0;
+	for (i = 0; i < xyt->nrows; i++) {
+		int dx = i ? (uint32_t) xyt->xcol[i] - xyt->xcol[i - 1] : 0;
+
+		put_bits(buf, &pos, ZIGZAG_ENCODE(dx), widths[0]);
+		put_bits(buf, &pos, (uint32_t) xyt->ycol[i] - min_y, widths[1]);
+		put_bits(buf, &pos, (uint32_t) xyt->thetacol[i] - min_t,
+			widths[2]);
+	}
+	return len + (pos + 7) / 8;
+}
+
+static struct fp_print_data_item *xyt_from_packed(const unsigned char *buf,
+	size_t length)
 {
+	const unsigned char *end = buf + length;
+	struct fp_print_data_item *item;
+	struct bit_reader reader = { 0, };
+	struct fpi_xyt *xyt;
+	uint32_t nrows, x, y, t, v;
+	int widths[3];
+	int i, j;
+
+	if (!get_varint(&buf, end, &nrows) || nrows > MAX_BOZORTH_MINUTIAE) {
+		fp_err("invalid number of minutiae");
+		return NULL;
+	}
+
+	item = fpi_print_data_item_new(FPI_XYT_SIZE(nrows));
+	xyt = (struct fpi_xyt *) item->data;
+	xyt->nrows = nrows;
+	if (nrows == 0)
+		return item;
+
+	if (!get_varint(&buf, end, &x) || !get_varint(&buf, end, &y) ||
+	    !get_varint(&buf, end, &t) || end - buf < 3)
+		goto err;
+	for (j = 0; j < 3; j++) {
+		widths[j] = buf[j];
+		if (widths[j] > 32)
+			goto err;
+	}
+
+	x = ZIGZAG_DECODE(x);
+	y = ZIGZAG_DECODE(y);
+	t = ZIGZAG_DECODE(t);
+	reader.p = buf + 3;
+	reader.end = end;
+	for (i = 0; i < nrows; i++) {
+		if (!get_bits(&reader, widths[0], &v))
+			goto err;
+		x += ZIGZAG_DECODE(v);
+		xyt->cols[i] = x;
+		if (!get_bits(&reader, widths[1], &v))
+			goto err;
+		xyt->cols[nrows + i] = y + v;
+		if (!get_bits(&reader, widths[2], &v))
+			goto err;
+		xyt->cols[2 * nrows + i] = t + v;
+	}
+
+	return item;
+
+err:
+	fp_err("minutiae data too short");
+	fpi_print_data_item_free(item);
+	return NULL;
+}
+
+/* Converts a sample to its FP3 or FP4 payload, written to buf unless it is
+ * NULL. Returns the size of the payload. */
+static size_t item_to_fp3(enum fp_print_data_type type,
+	struct fp_print_data_item *item, unsigned char *buf, gboolean packed)
+{
+	struct xyt_struct xyt;
+	size_t len;
+	int i;
+
+	if (type != PRINT_DATA_NBIS_MINUTIAE) {
+		if (buf)
+			memcpy(buf, item->data, item->length);
+		return item->length;
+	}
+
+	fpi_print_data_item_get_xyt(item, &xyt);
+	if (packed)
+		return xyt_to_packed(&xyt, buf);
+
+	len = put_varint(buf, xyt.nrows);
+	for (i = 0; i < xyt.nrows; i++) {
+		len += put_varint(buf ? buf + len : NULL,
+			ZIGZAG_ENCODE(xyt.xcol[i]));
+		len += put_varint(buf ? buf + len : NULL,
+			ZIGZAG_ENCODE(xyt.ycol[i]));
+		len += put_varint(buf ? buf + len : NULL,
+			ZIGZAG_ENCODE(xyt.thetacol[i]));
+	}
+	return len;
+}
+
+static struct fp_print_data_item *xyt_from_fp3(const unsigned char *buf,
+	size_t length)
+{
+	const unsigned char *end = buf + length;
+	struct fp_print_data_item *item;
+	struct fpi_xyt *xyt;
+	uint32_t nrows, v;
+	int i, j;
+
+	if (!get_varint(&buf, end, &nrows) || nrows > MAX_BOZORTH_MINUTIAE) {
+		fp_err("invalid number of minutiae");
+		return NULL;
+	}
+
+	item = fpi_print_data_item_new(FPI_XYT_SIZE(nrows));
+	xyt = (struct fpi_xyt *) item->data;
+	xyt->nrows = nrows;
+	for (i = 0; i < nrows; i++)
+		for (j = 0; j < 3; j++) {
+			if (!get_varint(&buf, end, &v)) {
+				fp_err("minutiae data too short");
+				fpi_print_data_item_free(item);
+				return NULL;
+			}
+			xyt->cols[j * nrows + i] = ZIGZAG_DECODE(v);
+		}
+
+	return item;
+}
+
+/* Converts a stored print to data of the given format. FP2 keeps NBIS
+ * samples in the host's layout, so that they can be used in place when the
+ * data is loaded back on the same machine. Returns the size of the data,
+ * and only writes it if buflen is large enough. */
+size_t fpi_print_data_copy_data(struct fp_print_data *data,
+	unsigned char *buf, size_t buflen, enum fpi_print_data_format format)
+{
+	gboolean native = format == FPI_PRINT_DATA_FP2;
+	gboolean packed = format == FPI_PRINT_DATA_FP4;
 	struct fpi_print_data_fp2 *out_data;
 	struct fpi_print_data_item_fp2 *out_item;
 	struct fp_print_data_item *item;
-	size_t buflen = 0;
+	size_t length = sizeof(*out_data);
+	size_t item_len;
 	GSList *list_item;
-	unsigned char *buf;
 
 	fp_dbg("");
 
-	list_item = data->prints;
-	while (list_item) {
+	for (list_item = data->prints; list_item;
+	     list_item = g_slist_next(list_item)) {
 		item = list_item->data;
-		buflen += sizeof(*out_item);
-		buflen += item->length;
-		list_item = g_slist_next(list_item);
+		if (native) {
+			length += sizeof(*out_item) + item->length;
+		} else {
+			item_len = item_to_fp3(data->type, item, NULL, packed);
+			length += put_varint(NULL, item_len) + item_len;
+		}
 	}
 
-	buflen += sizeof(*out_data);
-	out_data = g_malloc(buflen);
+	if (length > buflen)
+		return length;
 
-	*ret = (unsigned char *) out_data;
+	out_data = (struct fpi_print_data_fp2 *) buf;
 	buf = out_data->data;
 	out_data->prefix[0] = 'F';
 	out_data->prefix[1] = 'P';
-	out_data->prefix[2] = '2';
+	out_data->prefix[2] = native ? '2' : packed ? '4' : '3';
 	out_data->driver_id = GUINT16_TO_LE(data->driver_id);
 	out_data->devtype = GUINT32_TO_LE(data->devtype);
 	out_data->data_type = data->type;
 
-	list_item = data->prints;
-	while (list_item) {
+	for (list_item = data->prints; list_item;
+	     list_item = g_slist_next(list_item)) {
 		item = list_item->data;
-		out_item = (struct fpi_print_data_item_fp2 *)buf;
-		out_item->length = GUINT32_TO_LE(item->length);
-		/* FIXME: fp_print_data_item->data content is not endianess agnostic */
-		memcpy(out_item->data, item->data, item->length);
-		buf += sizeof(*out_item);
-		buf += item->length;
-		list_item = g_slist_next(list_item);
+		if (native) {
+			out_item = (struct fpi_print_data_item_fp2 *)buf;
+			out_item->length = GUINT32_TO_LE(item->length);
+			memcpy(out_item->data, item->data, item->length);
+			buf += sizeof(*out_item);
+			buf += item->length;
+		} else {
+			item_len = item_to_fp3(data->type, item, NULL, packed);
+			buf += put_varint(buf, item_len);
+			buf += item_to_fp3(data->type, item, buf, packed);
+		}
 	}
 
-	return buflen;
+	return length;
 }
 
-static struct fp_print_data *fpi_print_data_from_fp1_data(unsigned char *buf,
-	size_t buflen)
+/** \ingroup print_data
+ * Converts a stored print into the representation used by
+ * fp_print_data_get_data(), in a buffer provided by the caller. Call it with
+ * a NULL buffer first to find out the size needed.
+ * \param data the stored print
+ * \param buf the buffer to write to, may be NULL if buflen is 0
+ * \param buflen the size of the buffer
+ * \returns the size of the data. Nothing is written if this is larger than
+ * buflen.
+ */
+API_EXPORTED size_t fp_print_data_copy_data(struct fp_print_data *data,
+	unsigned char *buf, size_t buflen)
+{
+	return fpi_print_data_copy_data(data, buf, buflen, FPI_PRINT_DATA_FP3);
+}
+
+/** \ingroup print_data
+ * Convert a stored print into a unified representation inside a data buffer.
+ * You can then store this data buffer in any way that suits you, and load
+ * it back at some later time using fp_print_data_from_data(). The data
+ * doesn't depend on the architecture of the host, so it can be loaded on
+ * any other machine.
+ * \param data the stored print
+ * \param ret output location for the data buffer. Must be freed with free()
+ * after use.
+ * \returns the size of the freshly allocated buffer, or 0 on error.
+ */
+API_EXPORTED size_t fp_print_data_get_data(struct fp_print_data *data,
+	unsigned char **ret)
+{
+	size_t buflen = fp_print_data_copy_data(data, NULL, 0);
+
+	*ret = g_malloc(buflen);
+	return fp_print_data_copy_data(data, *ret, buflen);
+}
+
+static struct fp_print_data_item *print_data_item_from_data(
+	enum fp_print_data_type type, const unsigned char *buf, size_t length,
+	gboolean borrow)
+{
+	struct fp_print_data_item *item;
+
+	if (type == PRINT_DATA_NBIS_MINUTIAE)
+		return fpi_print_data_item_from_xyt(buf, length, borrow);
+
+	if (borrow)
+		return fpi_print_data_item_borrow(buf, length);
+
+	item = fpi_print_data_item_new(length);
+	memcpy(item->data, buf, length);
+	return item;
+}
+
+static struct fp_print_data *fpi_print_data_from_fp1_data(
+	const unsigned char *buf, size_t buflen, gboolean borrow)
 {
 	size_t print_data_len;
 	struct fp_print_data *data;
 	struct fp_print_data_item *item;
-	struct fpi_print_data_fp2 *raw = (struct fpi_print_data_fp2 *) buf;
+	const struct fpi_print_data_fp2 *raw =
+		(const struct fpi_print_data_fp2 *) buf;
 
 	print_data_len = buflen - sizeof(*raw);
 	data = print_data_new(GUINT16_FROM_LE(raw->driver_id),
 		GUINT32_FROM_LE(raw->devtype), raw->data_type);
-	item = fpi_print_data_item_new(print_data_len);
-	/* FIXME: fp_print_data->data content is not endianess agnostic */
-	memcpy(item->data, raw->data, print_data_len);
+	item = print_data_item_from_data(data->type, raw->data, print_data_len,
+		borrow);
+	if (!item) {
+		fp_print_data_free(data);
+		return NULL;
+	}
 	data->prints = g_slist_prepend(data->prints, item);
 
 	return data;
 }
 
-static struct fp_print_data *fpi_print_data_from_fp2_data(unsigned char *buf,
-	size_t buflen)
+static struct fp_print_data *fpi_print_data_from_fp2_data(
+	const unsigned char *buf, size_t buflen, gboolean borrow)
 {
 	size_t total_data_len, item_len;
 	struct fp_print_data *data;
 	struct fp_print_data_item *item;
-	struct fpi_print_data_fp2 *raw = (struct fpi_print_data_fp2 *) buf;
-	unsigned char *raw_buf;
-	struct fpi_print_data_item_fp2 *raw_item;
+	const struct fpi_print_data_fp2 *raw =
+		(const struct fpi_print_data_fp2 *) buf;
+	const unsigned char *raw_buf;
+	const struct fpi_print_data_item_fp2 *raw_item;
 
 	total_data_len = buflen - sizeof(*raw);
 	data = print_data_new(GUINT16_FROM_LE(raw->driver_id),
@@ -218,7 +622,7 @@ static struct fp_print_data *fpi_print_data_from_fp2_data(unsigned char *buf,
 			break;
 		total_data_len -= sizeof(*raw_item);
 
-		raw_item = (struct fpi_print_data_item_fp2 *)raw_buf;
+		raw_item = (const struct fpi_print_data_item_fp2 *)raw_buf;
 		item_len = GUINT32_FROM_LE(raw_item->length);
 		fp_dbg("item len %d, total_data_len %d", item_len, total_data_len);
 		if (total_data_len < item_len) {
@@ -227,9 +631,12 @@ static struct fp_print_data *fpi_print_data_from_fp2_data(unsigned char *buf,
 		}
 		total_data_len -= item_len;
 
-		item = fpi_print_data_item_new(item_len);
-		/* FIXME: fp_print_data->data content is not endianess agnostic */
-		memcpy(item->data, raw_item->data, item_len);
+		item = print_data_item_from_data(data->type, raw_item->data,
+			item_len, borrow);
+		if (!item) {
+			fp_err("corrupted fingerprint data");
+			break;
+		}
 		data->prints = g_slist_prepend(data->prints, item);
 
 		raw_buf += sizeof(*raw_item);
@@ -245,28 +652,69 @@ static struct fp_print_data *fpi_print_data_from_fp2_data(unsigned char *buf,
 
 }
 
-/** \ingroup print_data
- * Load a stored print from a data buffer. The contents of said buffer must
- * be the untouched contents of a buffer previously supplied to you by the
- * fp_print_data_get_data() function.
- * \param buf the data buffer
- * \param buflen the length of the buffer
- * \returns the stored print represented by the data, or NULL on error. Must
- * be freed with fp_print_data_free() after use.
- */
-API_EXPORTED struct fp_print_data *fp_print_data_from_data(unsigned char *buf,
-	size_t buflen)
+/* Parses FP3 data, or FP4 data if packed is set */
+static struct fp_print_data *fpi_print_data_from_fp3_data(
+	const unsigned char *buf, size_t buflen, gboolean packed)
+{
+	const unsigned char *end = buf + buflen;
+	struct fp_print_data *data;
+	struct fp_print_data_item *item;
+	const struct fpi_print_data_fp2 *raw =
+		(const struct fpi_print_data_fp2 *) buf;
+	uint32_t item_len;
+
+	data = print_data_new(GUINT16_FROM_LE(raw->driver_id),
+		GUINT32_FROM_LE(raw->devtype), raw->data_type);
+	buf = raw->data;
+	while (buf < end) {
+		if (!get_varint(&buf, end, &item_len) || item_len > end - buf) {
+			fp_err("corrupted fingerprint data");
+			break;
+		}
+
+		if (data->type == PRINT_DATA_NBIS_MINUTIAE) {
+			item = packed ? xyt_from_packed(buf, item_len) :
+				xyt_from_fp3(buf, item_len);
+		} else {
+			item = fpi_print_data_item_new(item_len);
+			memcpy(item->data, buf, item_len);
+		}
+		if (!item) {
+			fp_err("corrupted fingerprint data");
+			break;
+		}
+		data->prints = g_slist_prepend(data->prints, item);
+		buf += item_len;
+	}
+
+	if (g_slist_length(data->prints) == 0) {
+		fp_print_data_free(data);
+		data = NULL;
+	}
+
+	return data;
+}
+
+/* Parses FP1 to FP4 data. If borrow is set, the samples refer to buf
+ * whenever they can, so buf must outlive the print. */
+struct fp_print_data *fpi_print_data_from_data(const unsigned char *buf,
+	size_t buflen, gboolean borrow)
 {
-	struct fpi_print_data_fp2 *raw = (struct fpi_print_data_fp2 *) buf;
+	const struct fpi_print_data_fp2 *raw =
+		(const struct fpi_print_data_fp2 *) buf;
 
 	fp_dbg("buffer size %zd", buflen);
 	if (buflen < sizeof(*raw))
 		return NULL;
 
 	if (strncmp(raw->prefix, "FP1", 3) == 0) {
-		return fpi_print_data_from_fp1_data(buf, buflen);
+		return fpi_print_data_from_fp1_data(buf, buflen, borrow);
 	} else if (strncmp(raw->prefix, "FP2", 3) == 0) {
-		return fpi_print_data_from_fp2_data(buf, buflen);
+		return fpi_print_data_from_fp2_data(buf, buflen, borrow);
+	} else if (strncmp(raw->prefix, "FP3", 3) == 0) {
+		return fpi_print_data_from_fp3_data(buf, buflen, FALSE);
+	} else if (strncmp(raw->prefix, "FP4", 3) == 0) {
+		return fpi_print_data_from_fp3_data(buf, buflen, TRUE);
 	} else {
 		fp_dbg("bad header prefix");
 	}
@@ -274,6 +722,40 @@ API_EXPORTED struct fp_print_data *fp_print_data_from_data(unsigned char *buf,
 	return NULL;
 }
 
+/** \ingroup print_data
+ * Load a stored print from a data buffer. The contents of said buffer must
+ * be the untouched contents of a buffer previously supplied to you by the
+ * fp_print_data_get_data() function.
+ * \param buf the data buffer
+ * \param buflen the length of the buffer
+ * \returns the stored print represented by the data, or NULL on error. Must
+ * be freed with fp_print_data_free() after use.
+ */
+API_EXPORTED struct fp_print_data *fp_print_data_from_data(unsigned char *buf,
+	size_t buflen)
+{
+	return fpi_print_data_from_data(buf, buflen, FALSE);
+}
+
+/** \ingroup print_data
+ * Loads a stored print from a data buffer like fp_print_data_from_data(),
+ * but without copying the samples it holds: the print refers to the buffer
+ * instead. Samples which aren't suitably aligned in the buffer, or which
+ * aren't stored in the host's layout, are still copied. This is the case
+ * of the portable data returned by fp_print_data_get_data().
+ * \param buf the data buffer, which must not be changed or freed before the
+ * print is freed
+ * \param buflen the length of the buffer
+ * \returns the stored print represented by the data, or NULL on error. Must
+ * be freed with fp_print_data_free() after use, which leaves the buffer
+ * alone.
+ */
+API_EXPORTED struct fp_print_data *fp_print_data_from_data_borrowed(
+	const unsigned char *buf, size_t buflen)
+{
+	return fpi_print_data_from_data(buf, buflen, TRUE);
+}
+
 static char *get_path_to_storedir(uint16_t driver_id, uint32_t devtype)
 {
 	char idstr[5];
@@ -294,15 +776,346 @@ static char *__get_path_to_print(uint16_t driver_id, uint32_t devtype,
 
 	g_snprintf(fingername, 2, "%x", finger);
 
-	dirpath = get_path_to_storedir(driver_id, devtype);
-	path = g_build_filename(dirpath, fingername, NULL);
-	g_free(dirpath);
-	return path;
-}
+	dirpath = get_path_to_storedir(driver_id, devtype);
+	path = g_build_filename(dirpath, fingername, NULL);
+	g_free(dirpath);
+	return path;
+}
+
+static char *get_path_to_print(struct fp_dev *dev, enum fp_finger finger)
+{
+	return __get_path_to_print(dev->drv->id, dev->devtype, finger);
+}
+
+static struct fp_print_data *print_data_copy(struct fp_print_data *data,
+	size_t *size)
+{
+	struct fp_print_data *copy = print_data_new(data->driver_id,
+		data->devtype, data->type);
+	struct fp_print_data_item *item, *item_copy;
+	GSList *list_item;
+
+	*size = sizeof(*copy);
+	for (list_item = data->prints; list_item;
+	     list_item = g_slist_next(list_item)) {
+		item = list_item->data;
+		item_copy = fpi_print_data_item_new(item->length);
+		memcpy(item_copy->data, item->data, item->length);
+		copy->prints = g_slist_prepend(copy->prints, item_copy);
+		*size += sizeof(*item_copy) + item->length;
+	}
+	copy->prints = g_slist_reverse(copy->prints);
+
+	return copy;
+}
+
+/* Must be called with print_cache_lock held */
+static void print_cache_remove_entry(struct print_cache_entry *entry)
+{
+	g_hash_table_remove(print_cache, &entry->key);
+	g_queue_unlink(&print_cache_lru, &entry->link);
+	print_cache_size -= entry->size;
+	fp_print_data_free(entry->data);
+	g_free(entry);
+}
+
+/* Must be called with print_cache_lock held */
+static void print_cache_trim(void)
+{
+	GList *link;
+
+	while ((link = g_queue_peek_tail_link(&print_cache_lru)) &&
+	       (g_queue_get_length(&print_cache_lru) > print_cache_max_prints ||
+	        (print_cache_max_size && print_cache_size > print_cache_max_size)))
+		print_cache_remove_entry(link->data);
+}
+
+static void print_cache_clear(void)
+{
+	GList *link;
+
+	g_mutex_lock(&print_cache_lock);
+	while ((link = g_queue_peek_tail_link(&print_cache_lru)))
+		print_cache_remove_entry(link->data);
+	if (print_cache) {
+		g_hash_table_destroy(print_cache);
+		print_cache = NULL;
+	}
+	g_mutex_unlock(&print_cache_lock);
+}
+
+/* Returns the cached print of finger loaded for dev, or NULL if there is
+ * none */
+static struct fp_print_data *print_cache_lookup(struct fp_dev *dev,
+	enum fp_finger finger)
+{
+	guint64 key = PRINT_CACHE_KEY(dev->drv->id, dev->devtype, finger);
+	struct print_cache_entry *entry = NULL;
+	struct fp_print_data *data = NULL;
+
+	g_mutex_lock(&print_cache_lock);
+	if (print_cache_max_prints == 0)
+		goto out;
+
+	if (print_cache)
+		entry = g_hash_table_lookup(print_cache, &key);
+	if (!entry) {
+		print_cache_misses++;
+		goto out;
+	}
+
+	print_cache_hits++;
+	g_queue_unlink(&print_cache_lru, &entry->link);
+	g_queue_push_head_link(&print_cache_lru, &entry->link);
+	/* prints are immutable, the cached one is shared */
+	data = fp_print_data_ref(entry->data);
+out:
+	g_mutex_unlock(&print_cache_lock);
+	return data;
+}
+
+/* Caches data as the print of finger loaded for dev. Like the path it was
+ * loaded from, the key comes from dev, whose driver and devtype may differ
+ * from those recorded in a compatible print. */
+static void print_cache_insert(struct fp_dev *dev,
+	struct fp_print_data *data, enum fp_finger finger)
+{
+	guint64 key = PRINT_CACHE_KEY(dev->drv->id, dev->devtype, finger);
+	struct print_cache_entry *entry;
+
+	g_mutex_lock(&print_cache_lock);
+	if (print_cache_max_prints == 0)
+		goto out;
+
+	if (!print_cache)
+		print_cache = g_hash_table_new(g_int64_hash, g_int64_equal);
+	entry = g_hash_table_lookup(print_cache, &key);
+	if (entry)
+		print_cache_remove_entry(entry);
+
+	entry = g_malloc0(sizeof(*entry));
+	entry->key = key;
+	entry->link.data = entry;
+	entry->data = print_data_copy(data, &entry->size);
+	g_hash_table_insert(print_cache, &entry->key, entry);
+	g_queue_push_head_link(&print_cache_lru, &entry->link);
+	print_cache_size += entry->size;
+	print_cache_trim();
+out:
+	g_mutex_unlock(&print_cache_lock);
+}
+
+static void print_cache_invalidate(uint16_t driver_id, uint32_t devtype,
+	enum fp_finger finger)
+{
+	guint64 key = PRINT_CACHE_KEY(driver_id, devtype, finger);
+	struct print_cache_entry *entry;
+
+	g_mutex_lock(&print_cache_lock);
+	if (print_cache) {
+		entry = g_hash_table_lookup(print_cache, &key);
+		if (entry)
+			print_cache_remove_entry(entry);
+	}
+	g_mutex_unlock(&print_cache_lock);
+}
+
+/** \ingroup print_data
+ * Enables caching of the prints loaded with fp_print_data_load(), so that
+ * loading the same print again doesn't go through the disk. Prints are
+ * dropped from the cache when they are saved or deleted with libfprint,
+ * and the least recently used ones are dropped when the cache is full.
+ * Changes made to the stored prints by other processes aren't noticed.
+ *
+ * The cache is disabled by default.
+ *
+ * \param max_prints the maximum number of prints to cache, or 0 to disable
+ * the cache and empty it
+ * \param max_size the maximum amount of memory used by the cached prints,
+ * in bytes, or 0 for no limit
+ */
+API_EXPORTED void fp_set_print_data_cache_limits(unsigned int max_prints,
+	size_t max_size)
+{
+	g_mutex_lock(&print_cache_lock);
+	print_cache_max_prints = max_prints;
+	print_cache_max_size = max_size;
+	print_cache_trim();
+	g_mutex_unlock(&print_cache_lock);
+}
+
+/** \ingroup print_data
+ * Gets the number of fp_print_data_load() calls which found their print in
+ * the cache, and the number of those which had to load it from disk, since
+ * the last call to fp_reset_print_data_cache_stats(). Calls made while the
+ * cache is disabled aren't counted.
+ *
+ * \param hits location to store the number of cache hits, or NULL
+ * \param misses location to store the number of cache misses, or NULL
+ */
+API_EXPORTED void fp_get_print_data_cache_stats(uint64_t *hits,
+	uint64_t *misses)
+{
+	g_mutex_lock(&print_cache_lock);
+	if (hits)
+		*hits = print_cache_hits;
+	if (misses)
+		*misses = print_cache_misses;
+	g_mutex_unlock(&print_cache_lock);
+}
+
+/** \ingroup print_data
+ * Resets the counters returned by fp_get_print_data_cache_stats().
+ */
+API_EXPORTED void fp_reset_print_data_cache_stats(void)
+{
+	g_mutex_lock(&print_cache_lock);
+	print_cache_hits = 0;
+	print_cache_misses = 0;
+	g_mutex_unlock(&print_cache_lock);
+}
+
+/** \ingroup print_data
+ * Sets whether prints are saved with their minutiae packed in as few bits
+ * as possible, by fp_print_data_save() and in print databases. This makes
+ * galleries of NBIS prints about half as large as they would otherwise be,
+ * at the cost of decoding their samples when they are loaded, rather than
+ * using the stored data in place.
+ *
+ * Compressed prints can only be loaded by versions of libfprint which know
+ * about them. Prints are saved uncompressed by default; prints saved
+ * either way can be loaded whatever the setting.
+ *
+ * \param enabled non-zero to compress saved prints
+ */
+API_EXPORTED void fp_set_print_data_compression(int enabled)
+{
+	g_atomic_int_set(&compress_prints, !!enabled);
+}
+
+gboolean fpi_print_data_compression_enabled(void)
+{
+	return g_atomic_int_get(&compress_prints);
+}
+
+/* Serializes a print as it is written to the store */
+static size_t get_storage_data(struct fp_print_data *data,
+	unsigned char **ret)
+{
+	enum fpi_print_data_format format = FPI_PRINT_DATA_FP3;
+	size_t len;
+
+	if (fpi_print_data_compression_enabled())
+		format = FPI_PRINT_DATA_FP4;
+
+	len = fpi_print_data_copy_data(data, NULL, 0, format);
+	*ret = g_malloc(len);
+	fpi_print_data_copy_data(data, *ret, len, format);
+	return len;
+}
+
+static int save_to_file(const char *path, const unsigned char *buf,
+	size_t len)
+{
+	GError *err = NULL;
+	char *dirpath;
+	int r;
+
+	dirpath = g_path_get_dirname(path);
+	r = g_mkdir_with_parents(dirpath, DIR_PERMS);
+	g_free(dirpath);
+	if (r < 0) {
+		fp_err("couldn't create storage directory");
+		return r;
+	}
+
+	fp_dbg("saving to %s", path);
+	g_file_set_contents(path, (const gchar *) buf, len, &err);
+	if (err) {
+		r = err->code;
+		fp_err("save failed: %s", err->message);
+		g_error_free(err);
+		/* FIXME interpret error codes */
+		return r;
+	}
+
+	return 0;
+}
+
+/* Saves to a temporary file which is then linked to path, which fails if
+ * path already exists */
+static int save_new_to_file(const char *path, const unsigned char *buf,
+	size_t len)
+{
+	char *dirpath;
+	char *tmppath;
+	size_t done = 0;
+	int fd, r;
+
+	dirpath = g_path_get_dirname(path);
+	r = g_mkdir_with_parents(dirpath, DIR_PERMS);
+	g_free(dirpath);
+	if (r < 0) {
+		fp_err("couldn't create storage directory");
+		return r;
+	}
+
+	tmppath = g_strconcat(path, ".XXXXXX", NULL);
+	fd = g_mkstemp(tmppath);
+	if (fd < 0) {
+		r = -errno;
+		fp_err("couldn't create %s: %s", tmppath, g_strerror(errno));
+		g_free(tmppath);
+		return r;
+	}
+
+	while (done < len) {
+		ssize_t w = write(fd, buf + done, len - done);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w < 0) {
+			r = -errno;
+			break;
+		}
+		done += w;
+	}
+	if (r == 0 && fsync(fd) < 0)
+		r = -errno;
+	close(fd);
+
+	fp_dbg("saving to %s", path);
+	if (r == 0 && link(tmppath, path) < 0)
+		r = -errno;
+	unlink(tmppath);
+	g_free(tmppath);
+	if (r < 0 && r != -EEXIST)
+		fp_err("save failed: %d", r);
+	return r;
+}
+
+static int print_data_save(struct fp_print_data *data, enum fp_finger finger,
+	gboolean replace)
+{
+	char *path;
+	unsigned char *buf;
+	size_t len;
+	int r;
+
+	storage_setup();
+
+	fp_dbg("save %s print from driver %04x", finger_num_to_str(finger),
+		data->driver_id);
+	len = get_storage_data(data, &buf);
 
-static char *get_path_to_print(struct fp_dev *dev, enum fp_finger finger)
-{
-	return __get_path_to_print(dev->drv->id, dev->devtype, finger);
+	print_cache_invalidate(data->driver_id, data->devtype, finger);
+	path = __get_path_to_print(data->driver_id, data->devtype, finger);
+	if (replace)
+		r = save_to_file(path, buf, len);
+	else
+		r = save_new_to_file(path, buf, len);
+	g_free(buf);
+	g_free(path);
+	return r;
 }
 
 /** \ingroup print_data
@@ -314,8 +1127,9 @@ static char *get_path_to_print(struct fp_dev *dev, enum fp_finger finger)
  * one will be automatically selected.
  *
  * This function will unconditionally overwrite a fingerprint previously
- * saved for the same finger and device type. The print is saved in a hidden
- * directory beneath the current user's home directory.
+ * saved for the same finger and device type, use fp_print_data_save_new()
+ * to avoid that. The print is saved in a hidden directory beneath the
+ * current user's home directory.
  * \param data the stored print to save to disk
  * \param finger the finger that this print corresponds to
  * \returns 0 on success, non-zero on error.
@@ -323,46 +1137,23 @@ static char *get_path_to_print(struct fp_dev *dev, enum fp_finger finger)
 API_EXPORTED int fp_print_data_save(struct fp_print_data *data,
 	enum fp_finger finger)
 {
-	GError *err = NULL;
-	char *path;
-	char *dirpath;
-	unsigned char *buf;
-	size_t len;
-	int r;
-
-	if (!base_store)
-		storage_setup();
-
-	fp_dbg("save %s print from driver %04x", finger_num_to_str(finger),
-		data->driver_id);
-	len = fp_print_data_get_data(data, &buf);
-	if (!len)
-		return -ENOMEM;
-
-	path = __get_path_to_print(data->driver_id, data->devtype, finger);
-	dirpath = g_path_get_dirname(path);
-	r = g_mkdir_with_parents(dirpath, DIR_PERMS);
-	if (r < 0) {
-		fp_err("couldn't create storage directory");
-		g_free(path);
-		g_free(dirpath);
-		return r;
-	}
-
-	fp_dbg("saving to %s", path);
-	g_file_set_contents(path, buf, len, &err);
-	free(buf);
-	g_free(dirpath);
-	g_free(path);
-	if (err) {
-		r = err->code;
-		fp_err("save failed: %s", err->message);
-		g_error_free(err);
-		/* FIXME interpret error codes */
-		return r;
-	}
+	return print_data_save(data, finger, TRUE);
+}
 
-	return 0;
+/** \ingroup print_data
+ * Saves a stored print to disk like fp_print_data_save(), unless a print
+ * is already saved for the same finger and device type. The check and the
+ * save happen as one operation, so an existing print is never overwritten,
+ * even by concurrent calls.
+ * \param data the stored print to save to disk
+ * \param finger the finger that this print corresponds to
+ * \returns 0 on success, -EEXIST if there already is such a print, other
+ * non-zero values on error.
+ */
+API_EXPORTED int fp_print_data_save_new(struct fp_print_data *data,
+	enum fp_finger finger)
+{
+	return print_data_save(data, finger, FALSE);
 }
 
 gboolean fpi_print_data_compatible(uint16_t driver_id1, uint32_t devtype1,
@@ -436,8 +1227,13 @@ API_EXPORTED int fp_print_data_load(struct fp_dev *dev,
 	struct fp_print_data *fdata;
 	int r;
 
-	if (!base_store)
-		storage_setup();
+	fdata = print_cache_lookup(dev, finger);
+	if (fdata) {
+		*data = fdata;
+		return 0;
+	}
+
+	storage_setup();
 
 	path = get_path_to_print(dev, finger);
 	r = load_from_file(path, &fdata);
@@ -451,10 +1247,163 @@ API_EXPORTED int fp_print_data_load(struct fp_dev *dev,
 		return -EINVAL;
 	}
 
+	print_cache_insert(dev, fdata, finger);
 	*data = fdata;
 	return 0;
 }
 
+/* Room for a NULL-terminated gallery of nr_prints prints, followed by
+ * extra bytes aligned for any use */
+#define GALLERY_HEADER_SIZE(nr_prints) \
+	((((nr_prints) + 1) * sizeof(struct fp_print_data *) + \
+	  sizeof(double) - 1) & ~(sizeof(double) - 1))
+
+/* Allocates a gallery along with extra bytes, which start at *extra. The
+ * gallery is freed with fp_print_data_gallery_free(). */
+struct fp_print_data **fpi_print_data_gallery_new(size_t nr_prints,
+	size_t extra_size, void **extra)
+{
+	size_t header_size = GALLERY_HEADER_SIZE(nr_prints);
+	struct fp_print_data **gallery = g_malloc0(header_size + extra_size);
+
+	if (extra)
+		*extra = (unsigned char *) gallery + header_size;
+	return gallery;
+}
+
+/* Reads up to length bytes of a file, returns the number of bytes read */
+static ssize_t read_file(const char *path, unsigned char *buf, size_t length)
+{
+	size_t done = 0;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return -errno;
+
+	while (done < length) {
+		ssize_t r = read(fd, buf + done, length - done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		done += r;
+	}
+
+	close(fd);
+	return done;
+}
+
+/* Samples are int aligned when FP2 data starts 2 bytes past a multiple of 4,
+ * see printdb.c */
+#define FP2_DATA_ALIGN(offset)	((((offset) + 1) | 3) - 1)
+
+/** \ingroup print_data
+ * Loads all the prints saved with fp_print_data_save() which are compatible
+ * with a device, for use as an identification gallery.
+ *
+ * All the prints are read into a single buffer, which they refer to rather
+ * than holding their own copy of the data, and which is freed along with the
+ * gallery. Only the storage directory of the device type is looked at, so
+ * the prints of other devices are never read.
+ *
+ * \param dev the device to load prints for
+ * \param gallery output location for a NULL-terminated array of prints, in
+ * finger order. Must be freed with fp_print_data_gallery_free() after use.
+ * \param fingers output location for the corresponding fingers, may be NULL.
+ * Freed along with the gallery.
+ * \returns the number of prints loaded, which may be 0, or negative on error
+ */
+API_EXPORTED int fp_print_data_load_gallery(struct fp_dev *dev,
+	struct fp_print_data ***gallery, enum fp_finger **fingers)
+{
+	size_t sizes[RIGHT_LITTLE + 1] = { 0, };
+	char *paths[RIGHT_LITTLE + 1] = { NULL, };
+	struct fp_print_data **prints;
+	enum fp_finger *finger_list;
+	unsigned char *buf;
+	size_t total = 0, offset;
+	int finger, nr_files = 0, n = 0;
+
+	storage_setup();
+
+	/* Size everything up front, for a single allocation */
+	for (finger = LEFT_THUMB; finger <= RIGHT_LITTLE; finger++) {
+		struct stat st;
+
+		paths[finger] = get_path_to_print(dev, finger);
+		if (stat(paths[finger], &st) < 0 || !S_ISREG(st.st_mode))
+			continue;
+
+		sizes[finger] = st.st_size;
+		total = FP2_DATA_ALIGN(total) + st.st_size;
+		nr_files++;
+	}
+
+	prints = fpi_print_data_gallery_new(nr_files,
+		nr_files * sizeof(*finger_list) + sizeof(double) + total,
+		(void **) &finger_list);
+	buf = (unsigned char *) (finger_list + nr_files);
+	/* Offsets are relative to an 8 byte boundary */
+	buf += (sizeof(double) - ((uintptr_t) buf % sizeof(double))) %
+		sizeof(double);
+
+	for (finger = LEFT_THUMB, offset = 0; finger <= RIGHT_LITTLE; finger++) {
+		struct fp_print_data *fdata;
+		ssize_t length;
+
+		if (!sizes[finger])
+			continue;
+
+		offset = FP2_DATA_ALIGN(offset);
+		length = read_file(paths[finger], buf + offset, sizes[finger]);
+		if (length < 0) {
+			fp_dbg("couldn't read %s: %zd", paths[finger], length);
+			continue;
+		}
+
+		fdata = fpi_print_data_from_data(buf + offset, length, TRUE);
+		offset += sizes[finger];
+		if (!fdata) {
+			fp_err("%s is corrupted", paths[finger]);
+			continue;
+		}
+		if (!fp_dev_supports_print_data(dev, fdata)) {
+			fp_err("%s is not compatible", paths[finger]);
+			fp_print_data_free(fdata);
+			continue;
+		}
+
+		finger_list[n] = finger;
+		prints[n++] = fdata;
+	}
+
+	for (finger = LEFT_THUMB; finger <= RIGHT_LITTLE; finger++)
+		g_free(paths[finger]);
+
+	fp_dbg("loaded %d prints", n);
+	*gallery = prints;
+	if (fingers)
+		*fingers = finger_list;
+	return n;
+}
+
+/** \ingroup print_data
+ * Frees a gallery returned by fp_print_data_load_gallery() or
+ * fp_print_db_load_gallery(), along with its prints.
+ * \param gallery the gallery to free. If NULL, function simply returns.
+ */
+API_EXPORTED void fp_print_data_gallery_free(struct fp_print_data **gallery)
+{
+	int i;
+
+	if (!gallery)
+		return;
+
+	for (i = 0; gallery[i]; i++)
+		fp_print_data_free(gallery[i]);
+	g_free(gallery);
+}
+
 /** \ingroup print_data
  * Removes a stored print from disk previously saved with fp_print_data_save().
  * \param dev the device that the print belongs to
@@ -467,6 +1416,7 @@ API_EXPORTED int fp_print_data_delete(struct fp_dev *dev,
 	int r;
 	gchar *path = get_path_to_print(dev, finger);
 
+	print_cache_invalidate(dev->drv->id, dev->devtype, finger);
 	fp_dbg("remove finger %d at %s", finger, path);
 	r = g_unlink(path);
 	g_free(path);
@@ -497,16 +1447,88 @@ API_EXPORTED int fp_print_data_from_dscv_print(struct fp_dscv_print *print,
 }
 
 /** \ingroup print_data
- * Frees a stored print. Must be called when you are finished using the print.
- * \param data the stored print to destroy. If NULL, function simply returns.
+ * Releases a reference on a stored print, and frees it once the last one is
+ * gone. Must be called when you are finished using the print.
+ * \param data the stored print to release. If NULL, function simply returns.
  */
 API_EXPORTED void fp_print_data_free(struct fp_print_data *data)
 {
-	if (data)
-		g_slist_free_full(data->prints, (GDestroyNotify)fpi_print_data_item_free);
+	if (!data || !g_atomic_int_dec_and_test(&data->refcount))
+		return;
+
+	g_slist_free_full(data->prints, (GDestroyNotify)fpi_print_data_item_free);
 	g_free(data);
 }
 
+/** \ingroup print_data
+ * Takes a reference on a print, so that it can be used from several parts
+ * of the application, possibly several threads, without copying it. Prints
+ * never change once created. Each reference is released with
+ * fp_print_data_free().
+ * \param data the stored print
+ * \returns data
+ */
+API_EXPORTED struct fp_print_data *fp_print_data_ref(struct fp_print_data *data)
+{
+	g_atomic_int_inc(&data->refcount);
+	return data;
+}
+
+/* Moves all the samples of a print being built, which nobody else holds, to
+ * the front of another one */
+void fpi_print_data_move_samples(struct fp_print_data *to,
+	struct fp_print_data *from)
+{
+	to->prints = g_slist_concat(from->prints, to->prints);
+	from->prints = NULL;
+}
+
+static size_t item_memory_usage(struct fp_print_data_item *item)
+{
+	struct bz_template *tmpl = g_atomic_pointer_get(&item->bz_template);
+	size_t size = sizeof(*item) + sizeof(GSList);
+
+	/* borrowed data belongs to whoever lent it */
+	if (item->data == item->buf)
+		size += item->length;
+	if (tmpl && !item->template_borrowed)
+		size += BZ_TEMPLATE_SIZE(tmpl->nedges);
+	return size;
+}
+
+/** \ingroup print_data
+ * Gets the memory held by a print: its samples, and the matcher templates
+ * compiled from them once the print was used for matching. Data borrowed
+ * with fp_print_data_from_data_borrowed() is not included.
+ * \param data the stored print
+ * \returns the size of the print in memory, in bytes
+ */
+API_EXPORTED size_t fp_print_data_get_memory_usage(struct fp_print_data *data)
+{
+	size_t size = sizeof(*data);
+	GSList *elem;
+
+	for (elem = data->prints; elem; elem = g_slist_next(elem))
+		size += item_memory_usage(elem->data);
+	return size;
+}
+
+/** \ingroup print_data
+ * Gets the memory held by a gallery loaded with fp_print_data_load_gallery()
+ * or fp_print_db_load_gallery(), including all of its prints.
+ * \param gallery NULL-terminated array of prints
+ * \returns the size of the gallery in memory, in bytes
+ */
+API_EXPORTED size_t fp_print_data_gallery_get_memory_usage(
+	struct fp_print_data **gallery)
+{
+	size_t size = sizeof(*gallery);
+
+	for (; *gallery; gallery++)
+		size += sizeof(*gallery) + fp_print_data_get_memory_usage(*gallery);
+	return size;
+}
+
 /** \ingroup print_data
  * Gets the \ref driver_id "driver ID" for a stored print. The driver ID
  * indicates which driver the print originally came from. The print is
@@ -562,14 +1584,166 @@ API_EXPORTED uint32_t fp_print_data_get_devtype(struct fp_print_data *data)
  * been deleted by the time you come to load it.
  */
 
+/* Discovery results are kept in a manifest next to the print directory,
+ * along with the modification times of all the directories that were
+ * scanned. Adding or removing a print changes the time of its directory,
+ * so discovery only has to stat the directories to find out whether the
+ * manifest is still valid. The manifest is a text file:
+ *   FPIDX1 <sec> <nsec>		time the scan started
+ *   D <sec> <nsec> <path>		a directory, relative to base_store
+ *   P <driver_id> <devtype> <finger>	a print
+ */
+#define MANIFEST_MAGIC		"FPIDX1"
+#define MANIFEST_SUFFIX		".index"
+/* Some filesystems only keep times to the second or two, changes done that
+ * long before the scan may not show in the directory times */
+#define MANIFEST_RACY_SECONDS	2
+
+static char *get_path_to_manifest(void)
+{
+	return g_strconcat(base_store, MANIFEST_SUFFIX, NULL);
+}
+
+static void manifest_add_dir(GString *manifest, const char *path)
+{
+	struct stat st;
+	const char *relpath = path + strlen(base_store);
+
+	if (!manifest)
+		return;
+	if (*relpath == G_DIR_SEPARATOR)
+		relpath++;
+	if (*relpath == 0)
+		relpath = ".";
+
+	if (stat(path, &st) < 0) {
+		/* can't be checked later on */
+		g_string_truncate(manifest, 0);
+		return;
+	}
+	g_string_append_printf(manifest, "D %lld %ld %s\n",
+		(long long) st.st_mtim.tv_sec, (long) st.st_mtim.tv_nsec, relpath);
+}
+
+static void manifest_add_print(GString *manifest, struct fp_dscv_print *print)
+{
+	if (manifest)
+		g_string_append_printf(manifest, "P %04x %08x %x\n",
+			print->driver_id, print->devtype, print->finger);
+}
+
+static void dscv_print_free(struct fp_dscv_print *print)
+{
+	g_free(print->path);
+	g_free(print);
+}
+
+static int timespec_cmp(long long sec1, long nsec1, long long sec2,
+	long nsec2)
+{
+	if (sec1 != sec2)
+		return sec1 < sec2 ? -1 : 1;
+	if (nsec1 != nsec2)
+		return nsec1 < nsec2 ? -1 : 1;
+	return 0;
+}
+
+/* Returns the prints listed by the manifest, or NULL if it is missing or
+ * out of date */
+static GSList *read_manifest(gboolean *valid)
+{
+	gchar *path = get_path_to_manifest();
+	gchar *contents;
+	gchar **lines;
+	GSList *list = NULL;
+	long long scan_sec, sec;
+	long scan_nsec, nsec;
+	int i;
+
+	*valid = FALSE;
+	if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+		g_free(path);
+		return NULL;
+	}
+	g_free(path);
+
+	lines = g_strsplit(contents, "\n", -1);
+	g_free(contents);
+	if (sscanf(lines[0], MANIFEST_MAGIC " %lld %ld", &scan_sec,
+	           &scan_nsec) != 2)
+		goto out;
+
+	for (i = 1; lines[i]; i++) {
+		char relpath[32];
+		unsigned int driver_id, devtype, finger;
+		struct fp_dscv_print *print;
+		struct stat st;
+
+		if (sscanf(lines[i], "D %lld %ld %31s", &sec, &nsec,
+		           relpath) == 3) {
+			/* the directory may have changed again without its
+			 * time changing if it did shortly before the scan */
+			if (timespec_cmp(sec + MANIFEST_RACY_SECONDS, nsec,
+			    scan_sec, scan_nsec) >= 0)
+				goto out;
+			path = g_build_filename(base_store, relpath, NULL);
+			if (stat(path, &st) < 0 ||
+			    timespec_cmp(sec, nsec, st.st_mtim.tv_sec,
+			    	st.st_mtim.tv_nsec) != 0) {
+				g_free(path);
+				goto out;
+			}
+			g_free(path);
+		} else if (sscanf(lines[i], "P %x %x %x", &driver_id, &devtype,
+		                  &finger) == 3) {
+			if (!FP_FINGER_IS_VALID(finger))
+				goto out;
+			print = g_malloc(sizeof(*print));
+			print->driver_id = driver_id;
+			print->devtype = devtype;
+			print->finger = finger;
+			print->path = __get_path_to_print(driver_id, devtype,
+				finger);
+			list = g_slist_prepend(list, print);
+		} else if (lines[i][0] != 0) {
+			goto out;
+		}
+	}
+	*valid = TRUE;
+
+out:
+	g_strfreev(lines);
+	if (!*valid) {
+		fp_dbg("print manifest is out of date");
+		g_slist_free_full(list, (GDestroyNotify) dscv_print_free);
+		list = NULL;
+	}
+	return list;
+}
+
+static void write_manifest(GString *manifest)
+{
+	gchar *path;
+
+	if (!g_str_has_prefix(manifest->str, MANIFEST_MAGIC))
+		return;
+
+	path = get_path_to_manifest();
+	if (!g_file_set_contents(path, manifest->str, manifest->len, NULL))
+		fp_dbg("couldn't write print manifest");
+	g_free(path);
+}
+
 static GSList *scan_dev_store_dir(char *devpath, uint16_t driver_id,
-	uint32_t devtype, GSList *list)
+	uint32_t devtype, GSList *list, GString *manifest)
 {
 	GError *err = NULL;
 	const gchar *ent;
 	struct fp_dscv_print *print;
+	GDir *dir;
 
-	GDir *dir = g_dir_open(devpath, 0, &err);
+	manifest_add_dir(manifest, devpath);
+	dir = g_dir_open(devpath, 0, &err);
 	if (!dir) {
 		fp_err("opendir %s failed: %s", devpath, err->message);
 		g_error_free(err);
@@ -598,6 +1772,7 @@ static GSList *scan_dev_store_dir(char *devpath, uint16_t driver_id,
 		print->path = g_build_filename(devpath, ent, NULL);
 		print->finger = finger;
 		list = g_slist_prepend(list, print);
+		manifest_add_print(manifest, print);
 	}
 
 	g_dir_close(dir);
@@ -605,12 +1780,14 @@ static GSList *scan_dev_store_dir(char *devpath, uint16_t driver_id,
 }
 
 static GSList *scan_driver_store_dir(char *drvpath, uint16_t driver_id,
-	GSList *list)
+	GSList *list, GString *manifest)
 {
 	GError *err = NULL;
 	const gchar *ent;
+	GDir *dir;
 
-	GDir *dir = g_dir_open(drvpath, 0, &err);
+	manifest_add_dir(manifest, drvpath);
+	dir = g_dir_open(drvpath, 0, &err);
 	if (!dir) {
 		fp_err("opendir %s failed: %s", drvpath, err->message);
 		g_error_free(err);
@@ -635,7 +1812,8 @@ static GSList *scan_driver_store_dir(char *drvpath, uint16_t driver_id,
 
 		devtype = (uint32_t) val;
 		path = g_build_filename(drvpath, ent, NULL);
-		list = scan_dev_store_dir(path, driver_id, devtype, list);
+		list = scan_dev_store_dir(path, driver_id, devtype, list,
+			manifest);
 		g_free(path);
 	}
 
@@ -645,7 +1823,9 @@ static GSList *scan_driver_store_dir(char *drvpath, uint16_t driver_id,
 
 /** \ingroup dscv_print
  * Scans the users home directory and returns a list of prints that were
- * previously saved using fp_print_data_save().
+ * previously saved using fp_print_data_save(). The results are kept in a
+ * manifest, which later calls read instead of scanning again as long as
+ * the print directories haven't changed.
  * \returns a NULL-terminated list of discovered prints, must be freed with
  * fp_dscv_prints_free() after use.
  */
@@ -659,14 +1839,27 @@ API_EXPORTED struct fp_dscv_print **fp_discover_prints(void)
 	unsigned int tmplist_len;
 	struct fp_dscv_print **list;
 	unsigned int i;
+	GString *manifest;
+	struct timespec scan_start;
+	gboolean valid;
 
-	if (!base_store)
-		storage_setup();
+	storage_setup();
+
+	tmplist = read_manifest(&valid);
+	if (valid)
+		goto out;
+
+	clock_gettime(CLOCK_REALTIME, &scan_start);
+	manifest = g_string_new(NULL);
+	g_string_append_printf(manifest, MANIFEST_MAGIC " %lld %ld\n",
+		(long long) scan_start.tv_sec, (long) scan_start.tv_nsec);
+	manifest_add_dir(manifest, base_store);
 
 	dir = g_dir_open(base_store, 0, &err);
 	if (!dir) {
 		fp_err("opendir %s failed: %s", base_store, err->message);
 		g_error_free(err);
+		g_string_free(manifest, TRUE);
 		return NULL;
 	}
 
@@ -688,11 +1881,16 @@ API_EXPORTED struct fp_dscv_print **fp_discover_prints(void)
 
 		driver_id = (uint16_t) val;
 		path = g_build_filename(base_store, ent, NULL);
-		tmplist = scan_driver_store_dir(path, driver_id, tmplist);
+		tmplist = scan_driver_store_dir(path, driver_id, tmplist,
+			manifest);
 		g_free(path);
 	}
 
 	g_dir_close(dir);
+	write_manifest(manifest);
+	g_string_free(manifest, TRUE);
+
+out:
 	tmplist_len = g_slist_length(tmplist);
 	list = g_malloc(sizeof(*list) * (tmplist_len + 1));
 	elem = tmplist;
@@ -772,6 +1970,8 @@ API_EXPORTED enum fp_finger fp_dscv_print_get_finger(struct fp_dscv_print *print
 API_EXPORTED int fp_dscv_print_delete(struct fp_dscv_print *print)
 {
 	int r;
+
+	print_cache_invalidate(print->driver_id, print->devtype, print->finger);
 	fp_dbg("remove at %s", print->path);
 	r = g_unlink(print->path);
 	if (r < 0)
@@ -781,3 +1981,162 @@ API_EXPORTED int fp_dscv_print_delete(struct fp_dscv_print *print)
 	return r;
 }
 
+/* Storage operations run on the worker thread, see fpi_worker_run() */
+struct storage_op {
+	struct fp_dev *dev;
+	enum fp_finger finger;
+	char *path;
+	unsigned char *buf;
+	size_t len;
+	int status;
+	struct fp_print_data *data;
+	struct fp_dscv_print **prints;
+	void *callback;
+	void *user_data;
+};
+
+static struct storage_op *storage_op_new(void *callback, void *user_data)
+{
+	struct storage_op *op = g_malloc0(sizeof(*op));
+
+	storage_setup();
+
+	op->callback = callback;
+	op->user_data = user_data;
+	return op;
+}
+
+static int storage_op_run(struct storage_op *op, fpi_work_fn work,
+	fpi_work_fn done)
+{
+	/* operations without a device complete on the default context */
+	struct fp_context *ctx = op->dev ? op->dev->ctx : fpi_default_ctx;
+	int r = fpi_worker_run(ctx, work, done, op);
+
+	if (r < 0) {
+		g_free(op->path);
+		g_free(op->buf);
+		g_free(op);
+	}
+	return r;
+}
+
+static void load_work(void *data)
+{
+	struct storage_op *op = data;
+
+	op->status = fp_print_data_load(op->dev, op->finger, &op->data);
+}
+
+static void load_done(void *data)
+{
+	struct storage_op *op = data;
+	fp_print_data_load_cb callback = op->callback;
+
+	callback(op->status, op->data, op->user_data);
+	g_free(op);
+}
+
+/** \ingroup print_data
+ * Loads a previously stored print from disk without blocking, like
+ * fp_print_data_load() does on a worker thread. The callback is called from
+ * fp_context_handle_events() on the device's context once the print is
+ * loaded. The device must stay open until then. Operations started with
+ * the asynchronous storage functions complete in the order they were
+ * started, as long as their callbacks are called from the same context.
+ *
+ * \param dev the device you are loading the print for
+ * \param finger the finger of the file you are loading
+ * \param callback the function to call with the result of fp_print_data_load()
+ * and the loaded print, which must be freed with fp_print_data_free() after
+ * use
+ * \param user_data user data to pass to the callback
+ * \returns 0 if the load was started, negative on error
+ */
+API_EXPORTED int fp_async_print_data_load(struct fp_dev *dev,
+	enum fp_finger finger, fp_print_data_load_cb callback, void *user_data)
+{
+	struct storage_op *op = storage_op_new(callback, user_data);
+
+	op->dev = dev;
+	op->finger = finger;
+	return storage_op_run(op, load_work, load_done);
+}
+
+static void save_work(void *data)
+{
+	struct storage_op *op = data;
+
+	op->status = save_to_file(op->path, op->buf, op->len);
+}
+
+static void save_done(void *data)
+{
+	struct storage_op *op = data;
+	fp_print_data_save_cb callback = op->callback;
+
+	if (callback)
+		callback(op->status, op->user_data);
+	g_free(op->path);
+	g_free(op->buf);
+	g_free(op);
+}
+
+/** \ingroup print_data
+ * Saves a stored print to disk without blocking, like fp_print_data_save()
+ * does on a worker thread. The print is serialized before this function
+ * returns, so it can be freed or changed straight away. The callback is
+ * called from fp_handle_events() once the print is saved.
+ *
+ * \param data the stored print to save to disk
+ * \param finger the finger that this print corresponds to
+ * \param callback the function to call with the result of the save, the
+ * same as fp_print_data_save() would return, or NULL
+ * \param user_data user data to pass to the callback
+ * \returns 0 if the save was started, negative on error
+ */
+API_EXPORTED int fp_async_print_data_save(struct fp_print_data *data,
+	enum fp_finger finger, fp_print_data_save_cb callback, void *user_data)
+{
+	struct storage_op *op = storage_op_new(callback, user_data);
+
+	op->len = get_storage_data(data, &op->buf);
+	print_cache_invalidate(data->driver_id, data->devtype, finger);
+	op->path = __get_path_to_print(data->driver_id, data->devtype, finger);
+	return storage_op_run(op, save_work, save_done);
+}
+
+static void discover_work(void *data)
+{
+	struct storage_op *op = data;
+
+	op->prints = fp_discover_prints();
+}
+
+static void discover_done(void *data)
+{
+	struct storage_op *op = data;
+	fp_discover_prints_cb callback = op->callback;
+
+	callback(op->prints, op->user_data);
+	g_free(op);
+}
+
+/** \ingroup dscv_print
+ * Scans the users home directory for stored prints without blocking, like
+ * fp_discover_prints() does on a worker thread. The callback is called from
+ * fp_handle_events() once the scan is complete.
+ *
+ * \param callback the function to call with the discovered prints, as
+ * returned by fp_discover_prints(). They must be freed with
+ * fp_dscv_prints_free() after use.
+ * \param user_data user data to pass to the callback
+ * \returns 0 if the scan was started, negative on error
+ */
+API_EXPORTED int fp_async_discover_prints(fp_discover_prints_cb callback,
+	void *user_data)
+{
+	struct storage_op *op = storage_op_new(callback, user_data);
+
+	return storage_op_run(op, discover_work, discover_done);
+}
@@ -0,0 +1,341 @@
+/*
+ * Duplicate print detection for libfprint
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "dedup"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "fp_internal.h"
+#include "nbis/include/bozorth.h"
+
+/* Prints are compared block against block. Within a block pair, each probe
+ * sample is set up once for all the gallery prints of the other block, and
+ * the templates of those stay in cache while the probes go by. */
+#define DEDUP_BLOCK_SIZE	64
+
+struct dedup_sample {
+	struct xyt_struct xyt;
+	struct bz_template *tmpl;
+};
+
+struct dedup_job {
+	struct fp_print_data **prints;
+	gint nr_prints;
+	/* samples of all prints, those of print i start at first_sample[i] */
+	struct dedup_sample *samples;
+	gint *first_sample;
+	gint nr_samples;
+	int match_threshold;
+	int min_similarity;
+	gint nr_blocks;
+	gint nr_tiles;
+
+	/* next sample or block pair to be claimed by a worker */
+	volatile gint next;
+	/* each print points at a print of its cluster with a lower offset, or
+	 * at itself for the first print of a cluster. Entries are read without
+	 * the lock, and only ever move closer to the first print. */
+	volatile gint *parent;
+
+	/* protected by lock */
+	GMutex lock;
+	int error;
+	guint64 comparisons;
+	guint64 rejected;
+};
+
+static gint find_first(struct dedup_job *job, gint i)
+{
+	gint p;
+
+	while ((p = g_atomic_int_get(&job->parent[i])) != i)
+		i = p;
+	return i;
+}
+
+static void join_clusters(struct dedup_job *job, gint a, gint b)
+{
+	g_mutex_lock(&job->lock);
+	a = find_first(job, a);
+	b = find_first(job, b);
+	if (a < b)
+		g_atomic_int_set(&job->parent[b], a);
+	else if (b < a)
+		g_atomic_int_set(&job->parent[a], b);
+	g_mutex_unlock(&job->lock);
+}
+
+static void compile_worker(gpointer data, gpointer user_data)
+{
+	struct dedup_job *job = data;
+	gint i;
+
+	while ((i = g_atomic_int_add(&job->next, 1)) < job->nr_prints) {
+		GSList *elem = job->prints[i]->prints;
+		struct dedup_sample *sample = &job->samples[job->first_sample[i]];
+
+		for (; elem; elem = g_slist_next(elem), sample++) {
+			fpi_print_data_item_get_xyt(elem->data, &sample->xyt);
+			sample->tmpl = fpi_print_data_item_get_template(elem->data);
+			if (!sample->tmpl) {
+				g_mutex_lock(&job->lock);
+				job->error = -ENOMEM;
+				g_mutex_unlock(&job->lock);
+			}
+		}
+	}
+}
+
+/* Block pairs are numbered row by row, with the second block never before
+ * the first one */
+static void tile_blocks(struct dedup_job *job, gint tile, gint *block_a,
+	gint *block_b)
+{
+	gint a = 0;
+
+	while (tile >= job->nr_blocks - a) {
+		tile -= job->nr_blocks - a;
+		a++;
+	}
+	*block_a = a;
+	*block_b = a + tile;
+}
+
+/* Returns TRUE if the samples can possibly reach a meaningful score */
+static gboolean prefilter_pass(struct dedup_job *job,
+	struct dedup_sample *probe, struct dedup_sample *sample)
+{
+	/* bz_match_score() scores these as zero anyway */
+	if (sample->xyt.nrows < MIN_COMPUTABLE_BOZORTH_MINUTIAE)
+		return FALSE;
+
+	/* The probe and gallery tables of a sample are the same, so the
+	 * histogram of its template serves both sides */
+	return job->min_similarity <= 0 ||
+		bozorth_hist_similarity(probe->tmpl->hist, sample->tmpl->hist)
+			>= job->min_similarity;
+}
+
+static void match_tile(struct dedup_job *job, struct bz_ctx *ctx, gint tile,
+	guint64 *comparisons, guint64 *rejected)
+{
+	gint block_a, block_b;
+	gint a, a_end, b, b_start, b_end;
+	gint s, t;
+
+	tile_blocks(job, tile, &block_a, &block_b);
+	a_end = MIN((block_a + 1) * DEDUP_BLOCK_SIZE, job->nr_prints);
+	b_start = block_b * DEDUP_BLOCK_SIZE;
+	b_end = MIN(b_start + DEDUP_BLOCK_SIZE, job->nr_prints);
+
+	for (a = block_a * DEDUP_BLOCK_SIZE; a < a_end; a++)
+		for (s = job->first_sample[a]; s < job->first_sample[a + 1]; s++) {
+			struct dedup_sample *probe = &job->samples[s];
+			int probe_len = -1;
+
+			if (probe->xyt.nrows < MIN_COMPUTABLE_BOZORTH_MINUTIAE)
+				continue;
+
+			for (b = MAX(b_start, a + 1); b < b_end; b++) {
+				if (find_first(job, a) == find_first(job, b))
+					continue;
+
+				for (t = job->first_sample[b];
+				     t < job->first_sample[b + 1]; t++) {
+					struct dedup_sample *sample = &job->samples[t];
+					int score;
+
+					if (!prefilter_pass(job, probe, sample)) {
+						(*rejected)++;
+						continue;
+					}
+
+					/* The probe is only set up once it is needed */
+					if (probe_len < 0)
+						probe_len = bozorth_probe_init_ctx(ctx,
+							&probe->xyt);
+					score = bozorth_to_template_bounded_ctx(ctx,
+						probe_len, &probe->xyt, &sample->xyt,
+						sample->tmpl, job->match_threshold);
+					(*comparisons)++;
+					if (score >= job->match_threshold) {
+						join_clusters(job, a, b);
+						break;
+					}
+				}
+			}
+		}
+}
+
+static void match_worker(gpointer data, gpointer user_data)
+{
+	struct dedup_job *job = data;
+	struct bz_ctx *ctx = fpi_img_get_bz_ctx();
+	guint64 comparisons = 0;
+	guint64 rejected = 0;
+	gint tile;
+
+	if (!ctx) {
+		g_mutex_lock(&job->lock);
+		job->error = -ENOMEM;
+		g_mutex_unlock(&job->lock);
+		return;
+	}
+
+	while ((tile = g_atomic_int_add(&job->next, 1)) < job->nr_tiles)
+		match_tile(job, ctx, tile, &comparisons, &rejected);
+
+	g_mutex_lock(&job->lock);
+	job->comparisons += comparisons;
+	job->rejected += rejected;
+	g_mutex_unlock(&job->lock);
+}
+
+/* Runs a stage of the job on the calling thread and on a group of threads
+ * of its own, returns once the stage is done */
+static void dedup_run(struct dedup_job *job, GFunc worker,
+	unsigned int nr_threads)
+{
+	GThreadPool *pool = NULL;
+	GError *error = NULL;
+	unsigned int i;
+
+	job->next = 0;
+	if (nr_threads > 1) {
+		pool = g_thread_pool_new(worker, NULL, nr_threads - 1, TRUE, &error);
+		if (!pool) {
+			fp_err("couldn't create thread pool: %s, "
+				"running on a single thread", error->message);
+			g_error_free(error);
+		}
+	}
+
+	for (i = 1; pool && i < nr_threads; i++)
+		g_thread_pool_push(pool, job, NULL);
+
+	/* The calling thread takes its share of the work too */
+	worker(job, NULL);
+	if (pool)
+		g_thread_pool_free(pool, FALSE, TRUE);
+}
+
+/** \ingroup print_data
+ * Finds the prints of a store which belong to the same finger, for instance
+ * to spot fingers enrolled twice under different names. Every print is
+ * matched against every other one, and prints are grouped into clusters:
+ * two prints matching each other, directly or through other prints, end up
+ * in the same cluster.
+ *
+ * The matcher templates of all samples are compiled once, then pairs of
+ * prints are matched in blocks spread over a group of threads. Pairs of
+ * prints already known to be in the same cluster are skipped. When
+ * min_similarity is positive, pairs of samples whose edge length
+ * distribution overlap by less than min_similarity percent are not passed
+ * to the matcher, see fp_set_identify_prefilter().
+ *
+ * All prints must come from imaging devices.
+ *
+ * \param prints NULL-terminated array of the prints to look at
+ * \param match_threshold the score from which two prints are considered the
+ * same finger, 40 is a reasonable value for most sensors
+ * \param min_similarity prefilter threshold, from 0 (disabled) to 100
+ * \param nr_threads the number of threads to use, including the calling one,
+ * 0 for one per online CPU
+ * \param clusters output array, with room for one entry per print. Each
+ * entry is set to the offset of the first print of the cluster of the print,
+ * which is the offset of the print itself if no earlier print matches it.
+ * \returns the number of prints found to duplicate an earlier one, or a
+ * negative error code
+ */
+API_EXPORTED int fp_print_data_find_duplicates(struct fp_print_data **prints,
+	int match_threshold, int min_similarity, unsigned int nr_threads,
+	int *clusters)
+{
+	struct dedup_job job;
+	gint nr_prints = 0;
+	gint nr_samples = 0;
+	int nr_duplicates = 0;
+	gint i;
+
+	while (prints[nr_prints]) {
+		struct fp_print_data *print = prints[nr_prints];
+		if (print->type != PRINT_DATA_NBIS_MINUTIAE) {
+			fp_err("invalid print format at offset %d", nr_prints);
+			return -EINVAL;
+		}
+		nr_samples += g_slist_length(print->prints);
+		if (++nr_prints > G_MAXINT / 2 || nr_samples > G_MAXINT / 2) {
+			fp_err("too many prints");
+			return -EINVAL;
+		}
+	}
+	if (nr_prints == 0)
+		return 0;
+
+	if (nr_threads == 0) {
+		long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nr_threads = nr_cpus > 0 ? nr_cpus : 1;
+	}
+
+	job.prints = prints;
+	job.nr_prints = nr_prints;
+	job.samples = g_new(struct dedup_sample, nr_samples);
+	job.first_sample = g_new(gint, nr_prints + 1);
+	job.nr_samples = nr_samples;
+	job.match_threshold = match_threshold;
+	job.min_similarity = CLAMP(min_similarity, 0, 100);
+	job.nr_blocks = (nr_prints + DEDUP_BLOCK_SIZE - 1) / DEDUP_BLOCK_SIZE;
+	job.nr_tiles = job.nr_blocks * (job.nr_blocks + 1) / 2;
+	job.parent = g_new(gint, nr_prints);
+	g_mutex_init(&job.lock);
+	job.error = 0;
+	job.comparisons = 0;
+	job.rejected = 0;
+
+	nr_samples = 0;
+	for (i = 0; i < nr_prints; i++) {
+		job.first_sample[i] = nr_samples;
+		nr_samples += g_slist_length(prints[i]->prints);
+		job.parent[i] = i;
+	}
+	job.first_sample[nr_prints] = nr_samples;
+
+	fp_dbg("%d prints, %d samples, %d block pairs, %u threads", nr_prints,
+		nr_samples, job.nr_tiles, nr_threads);
+	dedup_run(&job, compile_worker, MIN(nr_threads, nr_prints));
+	if (job.error == 0)
+		dedup_run(&job, match_worker, MIN(nr_threads, job.nr_tiles));
+	fp_dbg("%" G_GUINT64_FORMAT " comparisons, %" G_GUINT64_FORMAT
+		" rejected by the prefilter", job.comparisons, job.rejected);
+
+	if (job.error == 0)
+		for (i = 0; i < nr_prints; i++) {
+			clusters[i] = find_first(&job, i);
+			if (clusters[i] != i)
+				nr_duplicates++;
+		}
+
+	g_mutex_clear(&job.lock);
+	g_free((gint *) job.parent);
+	g_free(job.first_sample);
+	g_free(job.samples);
+	return job.error ? job.error : nr_duplicates;
+}
@@ -76,17 +76,23 @@ static int adjust_gain(unsigned char *buffer, int status);
 
 struct aes1610_dev {
 	uint8_t read_regs_retry_count;
-	GSList *strips;
-	size_t strips_len;
+	struct fpi_frame_asmbl_stream strips;
 	gboolean deactivating;
 	uint8_t blanks_count;
 };
 
+FPI_FRAME_UNPACKER(aes1610_unpack_frame, FRAME_WIDTH, FRAME_HEIGHT, aes_pixel)
+
 static struct fpi_frame_asmbl_ctx assembling_ctx = {
 	.frame_width = FRAME_WIDTH,
 	.frame_height = FRAME_HEIGHT,
 	.image_width = IMAGE_WIDTH,
+	.overlap_search = FPI_OVERLAP_SEARCH_COARSE_TO_FINE,
 	.get_pixel = aes_get_pixel,
+	.unpack_frame = aes1610_unpack_frame,
+	.get_delta_hint = fpi_delta_hint_last,
+	/* half a grey level of the 4 bits per pixel frames */
+	.still_threshold = 8,
 };
 
 typedef void (*aes1610_read_regs_cb)(struct fp_img_dev *dev, int status,
@@ -149,7 +155,7 @@ static void generic_read_ignore_data(struct fpi_ssm *ssm, size_t bytes)
 	libusb_fill_bulk_transfer(transfer, ssm->dev->udev, EP_IN, data, bytes,
 		generic_ignore_data_cb, ssm, BULK_TIMEOUT);
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(data);
 		libusb_free_transfer(transfer);
@@ -242,7 +248,7 @@ static void finger_det_reqs_cb(struct fp_img_dev *dev, int result, void *user_da
 	libusb_fill_bulk_transfer(transfer, dev->udev, EP_IN, data, 19,
 		finger_det_data_cb, dev, BULK_TIMEOUT);
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(data);
 		libusb_free_transfer(transfer);
@@ -594,8 +600,9 @@ static void capture_read_strip_cb(struct libusb_transfer *transfer)
 		stripe->delta_y = 0;
 		stripdata = stripe->data;
 		memcpy(stripdata, data + 1, FRAME_WIDTH * (FRAME_HEIGHT / 2));
-		aesdev->strips = g_slist_prepend(aesdev->strips, stripe);
-		aesdev->strips_len++;
+		fpi_imgdev_preview(dev, FP_IMG_PREVIEW_GREY4_COLUMNS, stripdata,
+				   FRAME_WIDTH, FRAME_HEIGHT, FRAME_HEIGHT / 2);
+		fpi_frame_asmbl_stream_push(&aesdev->strips, stripe);
 		aesdev->blanks_count = 0;
 	}
 
@@ -619,19 +626,16 @@ static void capture_read_strip_cb(struct libusb_transfer *transfer)
 	adjust_gain(data, GAIN_STATUS_NORMAL);
 
 	/* stop capturing if MAX_FRAMES is reached */
-	if (aesdev->blanks_count > 10 || g_slist_length(aesdev->strips) >= MAX_FRAMES) {
+	if (aesdev->blanks_count > 10 || aesdev->strips.frames_len >= MAX_FRAMES) {
 		struct fp_img *img;
+		size_t nr_frames = aesdev->strips.frames_len;
 
-		fp_dbg("sending stop capture.... blanks=%d  frames=%d", aesdev->blanks_count, g_slist_length(aesdev->strips));
+		fp_dbg("sending stop capture.... blanks=%d  frames=%zd", aesdev->blanks_count, aesdev->strips.frames_len);
 		/* send stop capture bits */
 		aes_write_regv(dev, capture_stop, G_N_ELEMENTS(capture_stop), stub_capture_stop_cb, NULL);
-		aesdev->strips = g_slist_reverse(aesdev->strips);
-		fpi_do_movement_estimation(&assembling_ctx, aesdev->strips, aesdev->strips_len);
-		img = fpi_assemble_frames(&assembling_ctx, aesdev->strips, aesdev->strips_len);
+		img = fpi_frame_asmbl_stream_finish(&aesdev->strips);
+		fpi_imgdev_report_assembled(dev, nr_frames);
 		img->flags |= FP_IMG_PARTIAL;
-		g_slist_free_full(aesdev->strips, g_free);
-		aesdev->strips = NULL;
-		aesdev->strips_len = 0;
 		aesdev->blanks_count = 0;
 		fpi_imgdev_image_captured(dev, img);
 		fpi_imgdev_report_finger_status(dev, FALSE);
@@ -686,7 +690,7 @@ static void capture_run_state(struct fpi_ssm *ssm)
 		libusb_fill_bulk_transfer(transfer, dev->udev, EP_IN, data, 665,
 			capture_read_strip_cb, ssm, BULK_TIMEOUT);
 
-		r = libusb_submit_transfer(transfer);
+		r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			g_free(data);
 			libusb_free_transfer(transfer);
@@ -797,9 +801,7 @@ static void complete_deactivation(struct fp_img_dev *dev)
 	 * maybe we can do this with a master reset, unconditionally? */
 
 	aesdev->deactivating = FALSE;
-	g_slist_free(aesdev->strips);
-	aesdev->strips = NULL;
-	aesdev->strips_len = 0;
+	fpi_frame_asmbl_stream_reset(&aesdev->strips);
 	aesdev->blanks_count = 0;
 	fpi_imgdev_deactivate_complete(dev);
 }
@@ -807,23 +809,29 @@ static void complete_deactivation(struct fp_img_dev *dev)
 static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 {
 	/* FIXME check endpoints */
+	struct aes1610_dev *aesdev;
 	int r;
 
-	r = libusb_claim_interface(dev->udev, 0);
+	r = fpi_usb_claim_interface(dev->udev, 0);
 	if (r < 0) {
 		fp_err("could not claim interface 0: %s", libusb_error_name(r));
 		return r;
 	}
 
-	dev->priv = g_malloc0(sizeof(struct aes1610_dev));
+	dev->priv = aesdev = g_malloc0(sizeof(struct aes1610_dev));
+	fpi_dev_mem_account(dev->dev, sizeof(*aesdev));
+	fpi_frame_asmbl_stream_init(&aesdev->strips, &assembling_ctx);
 	fpi_imgdev_open_complete(dev, 0);
 	return 0;
 }
 
 static void dev_deinit(struct fp_img_dev *dev)
 {
-	g_free(dev->priv);
-	libusb_release_interface(dev->udev, 0);
+	struct aes1610_dev *aesdev = dev->priv;
+
+	fpi_frame_asmbl_stream_reset(&aesdev->strips);
+	g_free(aesdev);
+	fpi_usb_release_interface(dev->udev, 0);
 	fpi_imgdev_close_complete(dev);
 }
 
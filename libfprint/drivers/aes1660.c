@@ -38,11 +38,15 @@
 #define FRAME_WIDTH 128
 #define IMAGE_WIDTH	(FRAME_WIDTH + (FRAME_WIDTH / 2))
 
+FPI_FRAME_UNPACKER(aes1660_unpack_frame, FRAME_WIDTH, AESX660_FRAME_HEIGHT, aes_pixel)
+
 static struct fpi_frame_asmbl_ctx assembling_ctx = {
 	.frame_width = FRAME_WIDTH,
 	.frame_height = AESX660_FRAME_HEIGHT,
 	.image_width = IMAGE_WIDTH,
+	.overlap_search = FPI_OVERLAP_SEARCH_COARSE_TO_FINE,
 	.get_pixel = aes_get_pixel,
+	.unpack_frame = aes1660_unpack_frame,
 };
 
 static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
@@ -51,7 +55,7 @@ static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 	int r;
 	struct aesX660_dev *aesdev;
 
-	r = libusb_claim_interface(dev->udev, 0);
+	r = fpi_usb_claim_interface(dev->udev, 0);
 	if (r < 0) {
 		fp_err("could not claim interface 0: %s", libusb_error_name(r));
 		return r;
@@ -59,6 +63,8 @@ static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 
 	dev->priv = aesdev = g_malloc0(sizeof(struct aesX660_dev));
 	aesdev->buffer = g_malloc0(AES1660_FRAME_SIZE + AESX660_HEADER_SIZE);
+	fpi_dev_mem_account(dev->dev, sizeof(*aesdev) +
+		AES1660_FRAME_SIZE + AESX660_HEADER_SIZE);
 	aesdev->init_seqs[0] = aes1660_init_1;
 	aesdev->init_seqs_len[0] = array_n_elements(aes1660_init_1);
 	aesdev->init_seqs[1] = aes1660_init_2;
@@ -77,7 +83,7 @@ static void dev_deinit(struct fp_img_dev *dev)
 	struct aesX660_dev *aesdev = dev->priv;
 	g_free(aesdev->buffer);
 	g_free(aesdev);
-	libusb_release_interface(dev->udev, 0);
+	fpi_usb_release_interface(dev->udev, 0);
 	fpi_imgdev_close_complete(dev);
 }
 
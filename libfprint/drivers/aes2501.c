@@ -66,19 +66,39 @@ static void complete_deactivation(struct fp_img_dev *dev);
 
 /****** GENERAL FUNCTIONS ******/
 
+enum aes2501_regprog {
+	PROG_FINGER_DET,
+	PROG_CAPTURE_1,
+	PROG_CAPTURE_2,
+	PROG_INIT_1,
+	PROG_INIT_2,
+	PROG_INIT_4,
+	PROG_INIT_5,
+	NUM_PROGS
+};
+
 struct aes2501_dev {
 	uint8_t read_regs_retry_count;
-	GSList *strips;
-	size_t strips_len;
+	struct aes_regprog *progs[NUM_PROGS];
+	struct fpi_frame_asmbl_stream strips;
 	gboolean deactivating;
 	int no_finger_cnt;
+	/* initialised, and deactivated at a cancellation point */
+	gboolean warm;
 };
 
+FPI_FRAME_UNPACKER(aes2501_unpack_frame, FRAME_WIDTH, FRAME_HEIGHT, aes_pixel)
+
 static struct fpi_frame_asmbl_ctx assembling_ctx = {
 	.frame_width = FRAME_WIDTH,
 	.frame_height = FRAME_HEIGHT,
 	.image_width = IMAGE_WIDTH,
+	.overlap_search = FPI_OVERLAP_SEARCH_COARSE_TO_FINE,
 	.get_pixel = aes_get_pixel,
+	.unpack_frame = aes2501_unpack_frame,
+	.get_delta_hint = fpi_delta_hint_last,
+	/* half a grey level of the 4 bits per pixel frames */
+	.still_threshold = 8,
 };
 
 typedef void (*aes2501_read_regs_cb)(struct fp_img_dev *dev, int status,
@@ -133,7 +153,7 @@ static void read_regs_rq_cb(struct fp_img_dev *dev, int result, void *user_data)
 	libusb_fill_bulk_transfer(transfer, dev->udev, EP_IN, data, 126,
 		read_regs_data_cb, rdata, BULK_TIMEOUT);
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(data);
 		libusb_free_transfer(transfer);
@@ -228,7 +248,7 @@ static void generic_read_ignore_data(struct fpi_ssm *ssm, size_t bytes)
 	libusb_fill_bulk_transfer(transfer, ssm->dev->udev, EP_IN, data, bytes,
 		generic_ignore_data_cb, ssm, BULK_TIMEOUT);
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(data);
 		libusb_free_transfer(transfer);
@@ -289,11 +309,16 @@ static const struct aes_regwrite finger_det_reqs[] = {
 
 static void start_finger_detection(struct fp_img_dev *dev);
 
+static void finger_det_poll_cb(void *data)
+{
+	start_finger_detection(data);
+}
+
 static void finger_det_data_cb(struct libusb_transfer *transfer)
 {
 	struct fp_img_dev *dev = transfer->user_data;
 	unsigned char *data = transfer->buffer;
-	int i;
+	int i, r;
 	int sum = 0;
 
 	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
@@ -313,7 +338,9 @@ static void finger_det_data_cb(struct libusb_transfer *transfer)
 		start_capture(dev);
 	} else {
 		/* no finger, poll for a new histogram */
-		start_finger_detection(dev);
+		r = fpi_imgdev_schedule_poll(dev, finger_det_poll_cb, dev);
+		if (r < 0)
+			fpi_imgdev_session_error(dev, r);
 	}
 
 out:
@@ -343,7 +370,7 @@ static void finger_det_reqs_cb(struct fp_img_dev *dev, int result,
 	libusb_fill_bulk_transfer(transfer, dev->udev, EP_IN, data, 20,
 		finger_det_data_cb, dev, BULK_TIMEOUT);
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(data);
 		libusb_free_transfer(transfer);
@@ -361,7 +388,7 @@ static void start_finger_detection(struct fp_img_dev *dev)
 		return;
 	}
 
-	aes_write_regv(dev, finger_det_reqs, G_N_ELEMENTS(finger_det_reqs),
+	aes_regprog_run(dev, aesdev->progs[PROG_FINGER_DET],
 		finger_det_reqs_cb, NULL);
 }
 
@@ -490,16 +517,11 @@ static void capture_read_strip_cb(struct libusb_transfer *transfer)
 		aesdev->no_finger_cnt++;
 		if (aesdev->no_finger_cnt == 3) {
 			struct fp_img *img;
+			size_t nr_frames = aesdev->strips.frames_len;
 
-			aesdev->strips = g_slist_reverse(aesdev->strips);
-			fpi_do_movement_estimation(&assembling_ctx,
-					aesdev->strips, aesdev->strips_len);
-			img = fpi_assemble_frames(&assembling_ctx,
-						  aesdev->strips, aesdev->strips_len);
+			img = fpi_frame_asmbl_stream_finish(&aesdev->strips);
+			fpi_imgdev_report_assembled(dev, nr_frames);
 			img->flags |= FP_IMG_PARTIAL;
-			g_slist_free_full(aesdev->strips, g_free);
-			aesdev->strips = NULL;
-			aesdev->strips_len = 0;
 			fpi_imgdev_image_captured(dev, img);
 			fpi_imgdev_report_finger_status(dev, FALSE);
 			/* marking machine complete will re-trigger finger detection loop */
@@ -515,9 +537,10 @@ static void capture_read_strip_cb(struct libusb_transfer *transfer)
 		stripe->delta_y = 0;
 		stripdata = stripe->data;
 		memcpy(stripdata, data + 1, 192*8);
+		fpi_imgdev_preview(dev, FP_IMG_PREVIEW_GREY4_COLUMNS, stripdata,
+				   FRAME_WIDTH, FRAME_HEIGHT, FRAME_HEIGHT / 2);
 		aesdev->no_finger_cnt = 0;
-		aesdev->strips = g_slist_prepend(aesdev->strips, stripe);
-		aesdev->strips_len++;
+		fpi_frame_asmbl_stream_push(&aesdev->strips, stripe);
 
 		fpi_ssm_jump_to_state(ssm, CAPTURE_REQUEST_STRIP);
 	}
@@ -535,14 +558,14 @@ static void capture_run_state(struct fpi_ssm *ssm)
 
 	switch (ssm->cur_state) {
 	case CAPTURE_WRITE_REQS_1:
-		aes_write_regv(dev, capture_reqs_1, G_N_ELEMENTS(capture_reqs_1),
+		aes_regprog_run(dev, aesdev->progs[PROG_CAPTURE_1],
 			generic_write_regv_cb, ssm);
 		break;
 	case CAPTURE_READ_DATA_1:
 		generic_read_ignore_data(ssm, 159);
 		break;
 	case CAPTURE_WRITE_REQS_2:
-		aes_write_regv(dev, capture_reqs_2, G_N_ELEMENTS(capture_reqs_2),
+		aes_regprog_run(dev, aesdev->progs[PROG_CAPTURE_2],
 			generic_write_regv_cb, ssm);
 		break;
 	case CAPTURE_READ_DATA_2:
@@ -568,7 +591,7 @@ static void capture_run_state(struct fpi_ssm *ssm)
 		libusb_fill_bulk_transfer(transfer, dev->udev, EP_IN, data, 1705,
 			capture_read_strip_cb, ssm, BULK_TIMEOUT);
 
-		r = libusb_submit_transfer(transfer);
+		r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			g_free(data);
 			libusb_free_transfer(transfer);
@@ -747,6 +770,7 @@ static void activate_init3_cb(struct fp_img_dev *dev, int result,
 static void activate_run_state(struct fpi_ssm *ssm)
 {
 	struct fp_img_dev *dev = ssm->priv;
+	struct aes2501_dev *aesdev = dev->priv;
 
 	/* This state machine isn't as linear as it may appear. After doing init1
 	 * and init2 register configuration writes, we have to poll a register
@@ -769,7 +793,7 @@ static void activate_run_state(struct fpi_ssm *ssm)
 
 	switch (ssm->cur_state) {
 	case WRITE_INIT_1:
-		aes_write_regv(dev, init_1, G_N_ELEMENTS(init_1),
+		aes_regprog_run(dev, aesdev->progs[PROG_INIT_1],
 			generic_write_regv_cb, ssm);
 		break;
 	case READ_DATA_1:
@@ -777,22 +801,22 @@ static void activate_run_state(struct fpi_ssm *ssm)
 		generic_read_ignore_data(ssm, 20);
 		break;
 	case WRITE_INIT_2:
-		aes_write_regv(dev, init_2, G_N_ELEMENTS(init_2),
+		aes_regprog_run(dev, aesdev->progs[PROG_INIT_2],
 			generic_write_regv_cb, ssm);
 		break;
 	case READ_REGS:
 		read_regs(dev, activate_read_regs_cb, ssm);
 		break;
 	case WRITE_INIT_3:
-		aes_write_regv(dev, init_4, G_N_ELEMENTS(init_4),
+		aes_regprog_run(dev, aesdev->progs[PROG_INIT_4],
 			activate_init3_cb, ssm);
 		break;
 	case WRITE_INIT_4:
-		aes_write_regv(dev, init_4, G_N_ELEMENTS(init_4),
+		aes_regprog_run(dev, aesdev->progs[PROG_INIT_4],
 			generic_write_regv_cb, ssm);
 		break;
 	case WRITE_INIT_5:
-		aes_write_regv(dev, init_5, G_N_ELEMENTS(init_5),
+		aes_regprog_run(dev, aesdev->progs[PROG_INIT_5],
 			generic_write_regv_cb, ssm);
 		break;
 	}
@@ -812,10 +836,22 @@ static void activate_sm_complete(struct fpi_ssm *ssm)
 static int dev_activate(struct fp_img_dev *dev, enum fp_imgdev_state state)
 {
 	struct aes2501_dev *aesdev = dev->priv;
-	struct fpi_ssm *ssm = fpi_ssm_new(dev->dev, activate_run_state,
-		ACTIVATE_NUM_STATES);
-	ssm->priv = dev;
+	struct fpi_ssm *ssm;
+
 	aesdev->read_regs_retry_count = 0;
+
+	/* finger detection starts with a master reset and sets up the
+	 * sensor, init_1 to init_5 only have to run once */
+	if (dev->standby && aesdev->warm) {
+		fp_dbg("resuming from standby");
+		fpi_imgdev_activate_complete(dev, 0);
+		start_finger_detection(dev);
+		return 0;
+	}
+
+	aesdev->warm = FALSE;
+	ssm = fpi_ssm_new(dev->dev, activate_run_state, ACTIVATE_NUM_STATES);
+	ssm->priv = dev;
 	fpi_ssm_start(ssm, activate_sm_complete);
 	return 0;
 }
@@ -837,32 +873,71 @@ static void complete_deactivation(struct fp_img_dev *dev)
 	 * maybe we can do this with a master reset, unconditionally? */
 
 	aesdev->deactivating = FALSE;
-	g_slist_free(aesdev->strips);
-	aesdev->strips = NULL;
-	aesdev->strips_len = 0;
+	aesdev->warm = TRUE;
+	fpi_frame_asmbl_stream_reset(&aesdev->strips);
 	fpi_imgdev_deactivate_complete(dev);
 }
 
+/* the register tables which are fixed, compiled when the device is opened */
+static const struct {
+	const struct aes_regwrite *regs;
+	unsigned int num_regs;
+} regprogs[NUM_PROGS] = {
+	[PROG_FINGER_DET] = { finger_det_reqs, G_N_ELEMENTS(finger_det_reqs) },
+	[PROG_CAPTURE_1] = { capture_reqs_1, G_N_ELEMENTS(capture_reqs_1) },
+	[PROG_CAPTURE_2] = { capture_reqs_2, G_N_ELEMENTS(capture_reqs_2) },
+	[PROG_INIT_1] = { init_1, G_N_ELEMENTS(init_1) },
+	[PROG_INIT_2] = { init_2, G_N_ELEMENTS(init_2) },
+	[PROG_INIT_4] = { init_4, G_N_ELEMENTS(init_4) },
+	[PROG_INIT_5] = { init_5, G_N_ELEMENTS(init_5) },
+};
+
+static void free_regprogs(struct aes2501_dev *aesdev)
+{
+	int i;
+
+	for (i = 0; i < NUM_PROGS; i++)
+		aes_regprog_free(aesdev->progs[i]);
+}
+
 static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 {
 	/* FIXME check endpoints */
+	struct aes2501_dev *aesdev;
+	int i;
 	int r;
 
-	r = libusb_claim_interface(dev->udev, 0);
+	r = fpi_usb_claim_interface(dev->udev, 0);
 	if (r < 0) {
 		fp_err("could not claim interface 0: %s", libusb_error_name(r));
 		return r;
 	}
 
-	dev->priv = g_malloc0(sizeof(struct aes2501_dev));
+	dev->priv = aesdev = g_malloc0(sizeof(struct aes2501_dev));
+	fpi_dev_mem_account(dev->dev, sizeof(*aesdev));
+	for (i = 0; i < NUM_PROGS; i++) {
+		aesdev->progs[i] = aes_regprog_compile(regprogs[i].regs,
+			regprogs[i].num_regs);
+		if (!aesdev->progs[i]) {
+			free_regprogs(aesdev);
+			g_free(aesdev);
+			fpi_usb_release_interface(dev->udev, 0);
+			return -ENOMEM;
+		}
+	}
+	fpi_frame_asmbl_stream_init(&aesdev->strips, &assembling_ctx);
 	fpi_imgdev_open_complete(dev, 0);
 	return 0;
 }
 
 static void dev_deinit(struct fp_img_dev *dev)
 {
-	g_free(dev->priv);
-	libusb_release_interface(dev->udev, 0);
+	struct aes2501_dev *aesdev = dev->priv;
+
+	fpi_frame_asmbl_stream_reset(&aesdev->strips);
+	free_regprogs(aesdev);
+	g_free(aesdev);
+	fpi_usb_release_interface(dev->udev, 0);
 	fpi_imgdev_close_complete(dev);
 }
 
@@ -880,7 +955,7 @@ struct fp_img_driver aes2501_driver = {
 		.id_table = id_table,
 		.scan_type = FP_SCAN_TYPE_SWIPE,
 	},
-	.flags = 0,
+	.flags = FP_IMGDRV_SUPPORTS_STANDBY,
 	.img_height = -1,
 	.img_width = IMAGE_WIDTH,
 
@@ -64,15 +64,58 @@ struct aes2550_dev {
 	size_t strips_len;
 	gboolean deactivating;
 	int heartbeat_cnt;
+	/* requests are written from static buffers, replies read into the
+	 * in_pool ones */
+	struct fpi_transfer_pool *out_pool;
+	struct fpi_transfer_pool *in_pool;
 };
 
+FPI_FRAME_UNPACKER(aes2550_unpack_frame, FRAME_WIDTH, FRAME_HEIGHT, aes_pixel)
+
 static struct fpi_frame_asmbl_ctx assembling_ctx = {
 	.frame_width = FRAME_WIDTH,
 	.frame_height = FRAME_HEIGHT,
 	.image_width = IMAGE_WIDTH,
 	.get_pixel = aes_get_pixel,
+	.unpack_frame = aes2550_unpack_frame,
 };
 
+static int write_reqs(struct fp_img_dev *dev, unsigned char *reqs,
+	int len, libusb_transfer_cb_fn callback, void *user_data)
+{
+	struct aes2550_dev *aesdev = dev->priv;
+	struct libusb_transfer *transfer;
+	int r;
+
+	transfer = fpi_transfer_pool_get(aesdev->out_pool);
+	if (!transfer)
+		return -ENOMEM;
+	libusb_fill_bulk_transfer(transfer, dev->udev, EP_OUT, reqs, len,
+		callback, user_data, BULK_TIMEOUT);
+	r = fpi_usb_submit_transfer(transfer);
+	if (r < 0)
+		fpi_transfer_pool_put(aesdev->out_pool, transfer);
+	return r;
+}
+
+static int read_data(struct fp_img_dev *dev, libusb_transfer_cb_fn callback,
+	void *user_data)
+{
+	struct aes2550_dev *aesdev = dev->priv;
+	struct libusb_transfer *transfer;
+	int r;
+
+	transfer = fpi_transfer_pool_get(aesdev->in_pool);
+	if (!transfer)
+		return -ENOMEM;
+	libusb_fill_bulk_transfer(transfer, dev->udev, EP_IN, transfer->buffer,
+		AES2550_EP_IN_BUF_SIZE, callback, user_data, BULK_TIMEOUT);
+	r = fpi_usb_submit_transfer(transfer);
+	if (r < 0)
+		fpi_transfer_pool_put(aesdev->in_pool, transfer);
+	return r;
+}
+
 /****** FINGER PRESENCE DETECTION ******/
 
 static unsigned char finger_det_reqs[] = {
@@ -91,6 +134,11 @@ static void start_finger_detection(struct fp_img_dev *dev);
 static void finger_det_data_cb(struct libusb_transfer *transfer)
 {
 	struct fp_img_dev *dev = transfer->user_data;
+	struct aes2550_dev *aesdev = dev->priv;
+	/* start_finger_detection() completes a pending deactivation, after
+	 * which aesdev may be freed by a close. The pool itself is kept until
+	 * this transfer is put back. */
+	struct fpi_transfer_pool *pool = aesdev->in_pool;
 	unsigned char *data = transfer->buffer;
 
 	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
@@ -112,16 +160,15 @@ static void finger_det_data_cb(struct libusb_transfer *transfer)
 		start_finger_detection(dev);
 	}
 out:
-	g_free(data);
-	libusb_free_transfer(transfer);
+	fpi_transfer_pool_put(pool, transfer);
 }
 
 static void finger_det_reqs_cb(struct libusb_transfer *t)
 {
-	struct libusb_transfer *transfer;
-	unsigned char *data;
 	int r;
 	struct fp_img_dev *dev = t->user_data;
+	struct aes2550_dev *aesdev = dev->priv;
+	struct fpi_transfer_pool *pool = aesdev->out_pool;
 
 	if (t->status != LIBUSB_TRANSFER_COMPLETED) {
 		fp_dbg("req transfer status %d\n", t->status);
@@ -133,32 +180,18 @@ static void finger_det_reqs_cb(struct libusb_transfer *t)
 		goto exit_free_transfer;
 	}
 
-	transfer = libusb_alloc_transfer(0);
-	if (!transfer) {
-		fpi_imgdev_session_error(dev, -ENOMEM);
-		goto exit_free_transfer;
-	}
-
 	/* 2 bytes of result */
-	data = g_malloc(AES2550_EP_IN_BUF_SIZE);
-	libusb_fill_bulk_transfer(transfer, dev->udev, EP_IN, data, AES2550_EP_IN_BUF_SIZE,
-		finger_det_data_cb, dev, BULK_TIMEOUT);
-
-	r = libusb_submit_transfer(transfer);
-	if (r < 0) {
-		g_free(data);
-		libusb_free_transfer(transfer);
+	r = read_data(dev, finger_det_data_cb, dev);
+	if (r < 0)
 		fpi_imgdev_session_error(dev, r);
-	}
 exit_free_transfer:
-	libusb_free_transfer(t);
+	fpi_transfer_pool_put(pool, t);
 }
 
 static void start_finger_detection(struct fp_img_dev *dev)
 {
 	int r;
 	struct aes2550_dev *aesdev = dev->priv;
-	struct libusb_transfer *transfer;
 	fp_dbg("");
 
 	if (aesdev->deactivating) {
@@ -166,18 +199,10 @@ static void start_finger_detection(struct fp_img_dev *dev)
 		return;
 	}
 
-	transfer = libusb_alloc_transfer(0);
-	if (!transfer) {
-		fpi_imgdev_session_error(dev, -ENOMEM);
-		return;
-	}
-	libusb_fill_bulk_transfer(transfer, dev->udev, EP_OUT, finger_det_reqs,
-		sizeof(finger_det_reqs), finger_det_reqs_cb, dev, BULK_TIMEOUT);
-	r = libusb_submit_transfer(transfer);
-	if (r < 0) {
-		libusb_free_transfer(transfer);
+	r = write_reqs(dev, finger_det_reqs, sizeof(finger_det_reqs),
+		finger_det_reqs_cb, dev);
+	if (r < 0)
 		fpi_imgdev_session_error(dev, r);
-	}
 }
 
 /****** CAPTURE ******/
@@ -229,6 +254,16 @@ static int process_strip_data(struct fpi_ssm *ssm, unsigned char *data)
 	stripe->delta_y = -(int8_t)data[7];
 	stripdata = stripe->data;
 	memcpy(stripdata, data + 33, FRAME_WIDTH * FRAME_HEIGHT / 2);
+	fpi_imgdev_preview(dev, FP_IMG_PREVIEW_GREY4_COLUMNS, stripdata,
+			   FRAME_WIDTH, FRAME_HEIGHT, FRAME_HEIGHT / 2);
+
+	/* The sensor saw no movement since the previous strip, which
+	 * already covers this part of the finger */
+	if (aesdev->strips_len && !stripe->delta_x && !stripe->delta_y) {
+		g_free(stripe);
+		return 0;
+	}
+
 	aesdev->strips = g_slist_prepend(aesdev->strips, stripe);
 	aesdev->strips_len++;
 
@@ -240,6 +275,9 @@ static int process_strip_data(struct fpi_ssm *ssm, unsigned char *data)
 static void capture_reqs_cb(struct libusb_transfer *transfer)
 {
 	struct fpi_ssm *ssm = transfer->user_data;
+	struct fp_img_dev *dev = ssm->priv;
+	struct aes2550_dev *aesdev = dev->priv;
+	struct fpi_transfer_pool *pool = aesdev->out_pool;
 
 	if ((transfer->status == LIBUSB_TRANSFER_COMPLETED) &&
 		(transfer->length == transfer->actual_length)) {
@@ -247,7 +285,7 @@ static void capture_reqs_cb(struct libusb_transfer *transfer)
 	} else {
 		fpi_ssm_mark_aborted(ssm, -EIO);
 	}
-	libusb_free_transfer(transfer);
+	fpi_transfer_pool_put(pool, transfer);
 }
 
 static void capture_set_idle_reqs_cb(struct libusb_transfer *transfer)
@@ -255,6 +293,7 @@ static void capture_set_idle_reqs_cb(struct libusb_transfer *transfer)
 	struct fpi_ssm *ssm = transfer->user_data;
 	struct fp_img_dev *dev = ssm->priv;
 	struct aes2550_dev *aesdev = dev->priv;
+	struct fpi_transfer_pool *pool = aesdev->out_pool;
 
 	if ((transfer->status == LIBUSB_TRANSFER_COMPLETED) &&
 		(transfer->length == transfer->actual_length) &&
@@ -264,6 +303,7 @@ static void capture_set_idle_reqs_cb(struct libusb_transfer *transfer)
 		aesdev->strips = g_slist_reverse(aesdev->strips);
 		img = fpi_assemble_frames(&assembling_ctx,
 					  aesdev->strips, aesdev->strips_len);
+		fpi_imgdev_report_assembled(dev, aesdev->strips_len);
 		img->flags |= FP_IMG_PARTIAL;
 		g_slist_free_full(aesdev->strips, g_free);
 		aesdev->strips = NULL;
@@ -275,7 +315,7 @@ static void capture_set_idle_reqs_cb(struct libusb_transfer *transfer)
 	} else {
 		fpi_ssm_mark_aborted(ssm, -EIO);
 	}
-	libusb_free_transfer(transfer);
+	fpi_transfer_pool_put(pool, transfer);
 }
 
 static void capture_read_data_cb(struct libusb_transfer *transfer)
@@ -283,6 +323,7 @@ static void capture_read_data_cb(struct libusb_transfer *transfer)
 	struct fpi_ssm *ssm = transfer->user_data;
 	struct fp_img_dev *dev = ssm->priv;
 	struct aes2550_dev *aesdev = dev->priv;
+	struct fpi_transfer_pool *pool = aesdev->in_pool;
 	unsigned char *data = transfer->buffer;
 	int r;
 
@@ -327,8 +368,7 @@ static void capture_read_data_cb(struct libusb_transfer *transfer)
 			break;
 	}
 out:
-	g_free(transfer->buffer);
-	libusb_free_transfer(transfer);
+	fpi_transfer_pool_put(pool, transfer);
 }
 
 static void capture_run_state(struct fpi_ssm *ssm)
@@ -338,59 +378,22 @@ static void capture_run_state(struct fpi_ssm *ssm)
 
 	switch (ssm->cur_state) {
 	case CAPTURE_WRITE_REQS:
-	{
-		struct libusb_transfer *transfer = libusb_alloc_transfer(0);
-		if (!transfer) {
-			fpi_ssm_mark_aborted(ssm, -ENOMEM);
-			return;
-		}
-		libusb_fill_bulk_transfer(transfer, dev->udev, EP_OUT, capture_reqs,
-			sizeof(capture_reqs), capture_reqs_cb, ssm, BULK_TIMEOUT);
-		r = libusb_submit_transfer(transfer);
-		if (r < 0) {
-			libusb_free_transfer(transfer);
+		r = write_reqs(dev, capture_reqs, sizeof(capture_reqs),
+			capture_reqs_cb, ssm);
+		if (r < 0)
 			fpi_ssm_mark_aborted(ssm, -ENOMEM);
-		}
-	}
-	break;
+		break;
 	case CAPTURE_READ_DATA:
-	{
-		struct libusb_transfer *transfer = libusb_alloc_transfer(0);
-		unsigned char *data;
-
-		if (!transfer) {
-			fpi_ssm_mark_aborted(ssm, -ENOMEM);
-			break;
-		}
-
-		data = g_malloc(AES2550_EP_IN_BUF_SIZE);
-		libusb_fill_bulk_transfer(transfer, dev->udev, EP_IN, data, AES2550_EP_IN_BUF_SIZE,
-			capture_read_data_cb, ssm, BULK_TIMEOUT);
-
-		r = libusb_submit_transfer(transfer);
-		if (r < 0) {
-			g_free(data);
-			libusb_free_transfer(transfer);
+		r = read_data(dev, capture_read_data_cb, ssm);
+		if (r < 0)
 			fpi_ssm_mark_aborted(ssm, r);
-		}
-	}
-	break;
+		break;
 	case CAPTURE_SET_IDLE:
-	{
-		struct libusb_transfer *transfer = libusb_alloc_transfer(0);
-		if (!transfer) {
+		r = write_reqs(dev, capture_set_idle_reqs, sizeof(capture_set_idle_reqs),
+			capture_set_idle_reqs_cb, ssm);
+		if (r < 0)
 			fpi_ssm_mark_aborted(ssm, -ENOMEM);
-			return;
-		}
-		libusb_fill_bulk_transfer(transfer, dev->udev, EP_OUT, capture_set_idle_reqs,
-			sizeof(capture_set_idle_reqs), capture_set_idle_reqs_cb, ssm, BULK_TIMEOUT);
-		r = libusb_submit_transfer(transfer);
-		if (r < 0) {
-			libusb_free_transfer(transfer);
-			fpi_ssm_mark_aborted(ssm, -ENOMEM);
-		}
-	}
-	break;
+		break;
 	};
 }
 
@@ -453,6 +456,9 @@ enum activate_states {
 static void init_reqs_cb(struct libusb_transfer *transfer)
 {
 	struct fpi_ssm *ssm = transfer->user_data;
+	struct fp_img_dev *dev = ssm->priv;
+	struct aes2550_dev *aesdev = dev->priv;
+	struct fpi_transfer_pool *pool = aesdev->out_pool;
 
 	if ((transfer->status == LIBUSB_TRANSFER_COMPLETED) &&
 		(transfer->length == transfer->actual_length)) {
@@ -460,20 +466,22 @@ static void init_reqs_cb(struct libusb_transfer *transfer)
 	} else {
 		fpi_ssm_mark_aborted(ssm, -EIO);
 	}
-	libusb_free_transfer(transfer);
+	fpi_transfer_pool_put(pool, transfer);
 }
 
 static void init_read_data_cb(struct libusb_transfer *transfer)
 {
 	struct fpi_ssm *ssm = transfer->user_data;
+	struct fp_img_dev *dev = ssm->priv;
+	struct aes2550_dev *aesdev = dev->priv;
+	struct fpi_transfer_pool *pool = aesdev->in_pool;
 
 	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
 		fpi_ssm_next_state(ssm);
 	} else {
 		fpi_ssm_mark_aborted(ssm, -EIO);
 	}
-	g_free(transfer->buffer);
-	libusb_free_transfer(transfer);
+	fpi_transfer_pool_put(pool, transfer);
 }
 
 /* TODO: use calibration table, datasheet is rather terse on that
@@ -481,14 +489,16 @@ static void init_read_data_cb(struct libusb_transfer *transfer)
 static void calibrate_read_data_cb(struct libusb_transfer *transfer)
 {
 	struct fpi_ssm *ssm = transfer->user_data;
+	struct fp_img_dev *dev = ssm->priv;
+	struct aes2550_dev *aesdev = dev->priv;
+	struct fpi_transfer_pool *pool = aesdev->in_pool;
 
 	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
 		fpi_ssm_next_state(ssm);
 	} else {
 		fpi_ssm_mark_aborted(ssm, -EIO);
 	}
-	g_free(transfer->buffer);
-	libusb_free_transfer(transfer);
+	fpi_transfer_pool_put(pool, transfer);
 }
 
 static void activate_run_state(struct fpi_ssm *ssm)
@@ -498,81 +508,27 @@ static void activate_run_state(struct fpi_ssm *ssm)
 
 	switch (ssm->cur_state) {
 	case WRITE_INIT:
-	{
-		struct libusb_transfer *transfer = libusb_alloc_transfer(0);
-		if (!transfer) {
+		r = write_reqs(dev, init_reqs, sizeof(init_reqs),
+			init_reqs_cb, ssm);
+		if (r < 0)
 			fpi_ssm_mark_aborted(ssm, -ENOMEM);
-			return;
-		}
-		libusb_fill_bulk_transfer(transfer, dev->udev, EP_OUT, init_reqs,
-			sizeof(init_reqs), init_reqs_cb, ssm, BULK_TIMEOUT);
-		r = libusb_submit_transfer(transfer);
-		if (r < 0) {
-			libusb_free_transfer(transfer);
-			fpi_ssm_mark_aborted(ssm, -ENOMEM);
-		}
-	}
-	break;
+		break;
 	case READ_DATA:
-	{
-		struct libusb_transfer *transfer = libusb_alloc_transfer(0);
-		unsigned char *data;
-
-		if (!transfer) {
-			fpi_ssm_mark_aborted(ssm, -ENOMEM);
-			break;
-		}
-
-		data = g_malloc(AES2550_EP_IN_BUF_SIZE);
-		libusb_fill_bulk_transfer(transfer, dev->udev, EP_IN, data, AES2550_EP_IN_BUF_SIZE,
-			init_read_data_cb, ssm, BULK_TIMEOUT);
-
-		r = libusb_submit_transfer(transfer);
-		if (r < 0) {
-			g_free(data);
-			libusb_free_transfer(transfer);
+		r = read_data(dev, init_read_data_cb, ssm);
+		if (r < 0)
 			fpi_ssm_mark_aborted(ssm, r);
-		}
-	}
-	break;
+		break;
 	case CALIBRATE:
-	{
-		struct libusb_transfer *transfer = libusb_alloc_transfer(0);
-		if (!transfer) {
+		r = write_reqs(dev, calibrate_reqs, sizeof(calibrate_reqs),
+			init_reqs_cb, ssm);
+		if (r < 0)
 			fpi_ssm_mark_aborted(ssm, -ENOMEM);
-			return;
-		}
-		libusb_fill_bulk_transfer(transfer, dev->udev, EP_OUT, calibrate_reqs,
-			sizeof(calibrate_reqs), init_reqs_cb, ssm, BULK_TIMEOUT);
-		r = libusb_submit_transfer(transfer);
-		if (r < 0) {
-			libusb_free_transfer(transfer);
-			fpi_ssm_mark_aborted(ssm, -ENOMEM);
-		}
-	}
-	break;
+		break;
 	case READ_CALIB_TABLE:
-	{
-		struct libusb_transfer *transfer = libusb_alloc_transfer(0);
-		unsigned char *data;
-
-		if (!transfer) {
-			fpi_ssm_mark_aborted(ssm, -ENOMEM);
-			break;
-		}
-
-		data = g_malloc(AES2550_EP_IN_BUF_SIZE);
-		libusb_fill_bulk_transfer(transfer, dev->udev, EP_IN, data, AES2550_EP_IN_BUF_SIZE,
-			calibrate_read_data_cb, ssm, BULK_TIMEOUT);
-
-		r = libusb_submit_transfer(transfer);
-		if (r < 0) {
-			g_free(data);
-			libusb_free_transfer(transfer);
+		r = read_data(dev, calibrate_read_data_cb, ssm);
+		if (r < 0)
 			fpi_ssm_mark_aborted(ssm, r);
-		}
-	}
-	break;
+		break;
 	}
 }
 
@@ -618,23 +574,31 @@ static void complete_deactivation(struct fp_img_dev *dev)
 static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 {
 	/* TODO check that device has endpoints we're using */
+	struct aes2550_dev *aesdev;
 	int r;
 
-	r = libusb_claim_interface(dev->udev, 0);
+	r = fpi_usb_claim_interface(dev->udev, 0);
 	if (r < 0) {
 		fp_err("could not claim interface 0: %s", libusb_error_name(r));
 		return r;
 	}
 
-	dev->priv = g_malloc0(sizeof(struct aes2550_dev));
+	dev->priv = aesdev = g_malloc0(sizeof(struct aes2550_dev));
+	fpi_dev_mem_account(dev->dev, sizeof(*aesdev));
+	aesdev->out_pool = fpi_transfer_pool_new(0);
+	aesdev->in_pool = fpi_transfer_pool_new(AES2550_EP_IN_BUF_SIZE);
 	fpi_imgdev_open_complete(dev, 0);
 	return 0;
 }
 
 static void dev_deinit(struct fp_img_dev *dev)
 {
-	g_free(dev->priv);
-	libusb_release_interface(dev->udev, 0);
+	struct aes2550_dev *aesdev = dev->priv;
+
+	fpi_transfer_pool_free(aesdev->out_pool);
+	fpi_transfer_pool_free(aesdev->in_pool);
+	g_free(aesdev);
+	fpi_usb_release_interface(dev->udev, 0);
 	fpi_imgdev_close_complete(dev);
 }
 
@@ -129,13 +129,14 @@ static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 	int r;
 	struct aes3k_dev *aesdev;
 
-	r = libusb_claim_interface(dev->udev, 0);
+	r = fpi_usb_claim_interface(dev->udev, 0);
 	if (r < 0) {
 		fp_err("could not claim interface 0: %s", libusb_error_name(r));
 		return r;
 	}
 
 	aesdev = dev->priv = g_malloc0(sizeof(struct aes3k_dev));
+	fpi_dev_mem_account(dev->dev, sizeof(*aesdev));
 
 	if (!aesdev)
 		return -ENOMEM;
@@ -145,8 +146,15 @@ static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 	aesdev->frame_size = FRAME_SIZE;
 	aesdev->frame_number = FRAME_NUMBER;
 	aesdev->enlarge_factor = ENLARGE_FACTOR;
-	aesdev->init_reqs = init_reqs;
-	aesdev->init_reqs_len = G_N_ELEMENTS(init_reqs);
+	aesdev->init_prog = aes_regprog_compile(init_reqs,
+		G_N_ELEMENTS(init_reqs));
+	if (!aesdev->init_prog) {
+		fpi_dev_mem_account(dev->dev, -(gssize) sizeof(*aesdev));
+		g_free(aesdev);
+		dev->priv = NULL;
+		fpi_usb_release_interface(dev->udev, 0);
+		return -ENOMEM;
+	}
 	fpi_imgdev_open_complete(dev, 0);
 
 	return r;
@@ -155,8 +163,9 @@ static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 static void dev_deinit(struct fp_img_dev *dev)
 {
 	struct aes3k_dev *aesdev = dev->priv;
+	aes_regprog_free(aesdev->init_prog);
 	g_free(aesdev);
-	libusb_release_interface(dev->udev, 0);
+	fpi_usb_release_interface(dev->udev, 0);
 	fpi_imgdev_close_complete(dev);
 }
 
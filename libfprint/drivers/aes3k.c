@@ -132,7 +132,7 @@ static void do_capture(struct fp_img_dev *dev)
 	libusb_fill_bulk_transfer(aesdev->img_trf, dev->udev, EP_IN, data,
 		aesdev->data_buflen, img_cb, dev, 0);
 
-	r = libusb_submit_transfer(aesdev->img_trf);
+	r = fpi_usb_submit_transfer(aesdev->img_trf);
 	if (r < 0) {
 		g_free(data);
 		libusb_free_transfer(aesdev->img_trf);
@@ -151,7 +151,7 @@ static void init_reqs_cb(struct fp_img_dev *dev, int result, void *user_data)
 int aes3k_dev_activate(struct fp_img_dev *dev, enum fp_imgdev_state state)
 {
 	struct aes3k_dev *aesdev = dev->priv;
-	aes_write_regv(dev, aesdev->init_reqs, aesdev->init_reqs_len, init_reqs_cb, NULL);
+	aes_regprog_run(dev, aesdev->init_prog, init_reqs_cb, NULL);
 	return 0;
 }
 
@@ -163,7 +163,7 @@ void aes3k_dev_deactivate(struct fp_img_dev *dev)
 	 * from deactivation, otherwise app may legally exit before we've
 	 * cleaned up */
 	if (aesdev->img_trf)
-		libusb_cancel_transfer(aesdev->img_trf);
+		fpi_usb_cancel_transfer(aesdev->img_trf);
 	fpi_imgdev_deactivate_complete(dev);
 }
 
@@ -47,8 +47,7 @@ struct aes3k_dev {
 	size_t enlarge_factor;
 
 	size_t data_buflen;             /* buffer length of usb bulk transfer */
-	struct aes_regwrite *init_reqs; /* initial values sent to device */
-	size_t init_reqs_len;
+	struct aes_regprog *init_prog;  /* initial values sent to device */
 };
 
 
@@ -61,7 +61,7 @@ static void aesX660_send_cmd_timeout(struct fpi_ssm *ssm, const unsigned char *c
 	libusb_fill_bulk_transfer(transfer, dev->udev, EP_OUT,
 		(unsigned char *)cmd, cmd_len,
 		callback, ssm, timeout);
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		fp_dbg("failed to submit transfer\n");
 		libusb_free_transfer(transfer);
@@ -93,7 +93,7 @@ static void aesX660_read_response(struct fpi_ssm *ssm, size_t buf_len,
 		data, buf_len,
 		callback, ssm, BULK_TIMEOUT);
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		fp_dbg("Failed to submit rx transfer: %d\n", r);
 		g_free(data);
@@ -291,6 +291,9 @@ static int process_stripe_data(struct fpi_ssm *ssm, unsigned char *data)
 
 	if (data[AESX660_IMAGE_OK_OFFSET] == AESX660_IMAGE_OK) {
 		memcpy(stripdata, data + AESX660_IMAGE_OFFSET, aesdev->assembling_ctx->frame_width * FRAME_HEIGHT / 2);
+		fpi_imgdev_preview(dev, FP_IMG_PREVIEW_GREY4_COLUMNS, stripdata,
+			aesdev->assembling_ctx->frame_width, FRAME_HEIGHT,
+			FRAME_HEIGHT / 2);
 
 		aesdev->strips = g_slist_prepend(aesdev->strips, stripe);
 		aesdev->strips_len++;
@@ -313,6 +316,7 @@ static void capture_set_idle_cmd_cb(struct libusb_transfer *transfer)
 
 		aesdev->strips = g_slist_reverse(aesdev->strips);
 		img = fpi_assemble_frames(aesdev->assembling_ctx, aesdev->strips, aesdev->strips_len);
+		fpi_imgdev_report_assembled(dev, aesdev->strips_len);
 		img->flags |= aesdev->extra_img_flags;
 		g_slist_foreach(aesdev->strips, (GFunc) g_free, NULL);
 		g_slist_free(aesdev->strips);
@@ -615,7 +619,7 @@ void aesX660_dev_deactivate(struct fp_img_dev *dev)
 	struct aesX660_dev *aesdev = dev->priv;
 
 	if (aesdev->fd_data_transfer)
-		libusb_cancel_transfer(aesdev->fd_data_transfer);
+		fpi_usb_cancel_transfer(aesdev->fd_data_transfer);
 
 	aesdev->deactivating = TRUE;
 }
@@ -40,6 +40,7 @@ static struct fpi_frame_asmbl_ctx assembling_ctx = {
 	.frame_width = 0,
 	.frame_height = 0,
 	.image_width = 0,
+	.overlap_search = FPI_OVERLAP_SEARCH_COARSE_TO_FINE,
 	.get_pixel = elan_get_pixel,
 };
 
@@ -56,10 +57,21 @@ struct elan_dev {
 	unsigned char frame_width;
 	unsigned char frame_height;
 	unsigned char raw_frame_width;
-	int num_frames;
-	GSList *frames;
+	/* Raw frames, oldest first */
+	struct fpi_asmbl_buf frames;
+
+	/* sensor dimensions and calibration come from the calibration cache,
+	 * neither is queried nor redone until the sensor disagrees */
+	gboolean calibrated;
+	/* calibrating again in the middle of a capture session */
+	gboolean recalibrating;
 };
 
+struct elan_calibration {
+	unsigned char frame_width;
+	unsigned char raw_frame_width;
+} __attribute__((__packed__));
+
 static void elan_dev_reset(struct elan_dev *elandev)
 {
 	fp_dbg("");
@@ -75,9 +87,47 @@ static void elan_dev_reset(struct elan_dev *elandev)
 	g_free(elandev->last_read);
 	elandev->last_read = NULL;
 
-	g_slist_free_full(elandev->frames, g_free);
-	elandev->frames = NULL;
-	elandev->num_frames = 0;
+	fpi_asmbl_buf_clear(&elandev->frames);
+}
+
+static void elan_set_sensor_dim(struct elan_dev *elandev,
+				unsigned char frame_width,
+				unsigned char raw_frame_width)
+{
+	elandev->frame_width = frame_width;
+	elandev->raw_frame_width = raw_frame_width;
+	elandev->frame_height = raw_frame_width - 2 * ELAN_FRAME_MARGIN;
+	fpi_asmbl_buf_free(&elandev->frames);
+	fpi_asmbl_buf_init(&elandev->frames, elandev->frame_width *
+			   elandev->frame_height * sizeof(unsigned short));
+}
+
+static void elan_load_calibration(struct fp_img_dev *dev)
+{
+	struct elan_dev *elandev = dev->priv;
+	struct elan_calibration cal;
+
+	if (fpi_calibration_load(dev->dev, ELAN_CALIBRATION_VERSION, &cal,
+				 sizeof(cal), ELAN_CALIBRATION_MAX_AGE))
+		return;
+	if (!cal.frame_width || cal.raw_frame_width <= 2 * ELAN_FRAME_MARGIN) {
+		fpi_calibration_forget(dev->dev);
+		return;
+	}
+	elan_set_sensor_dim(elandev, cal.frame_width, cal.raw_frame_width);
+	elandev->calibrated = TRUE;
+}
+
+static void elan_save_calibration(struct fp_img_dev *dev)
+{
+	struct elan_dev *elandev = dev->priv;
+	struct elan_calibration cal = {
+		.frame_width = elandev->frame_width,
+		.raw_frame_width = elandev->raw_frame_width,
+	};
+
+	fpi_calibration_save(dev->dev, ELAN_CALIBRATION_VERSION, &cal,
+			     sizeof(cal));
 }
 
 static void elan_save_frame(struct fp_img_dev *dev)
@@ -85,8 +135,7 @@ static void elan_save_frame(struct fp_img_dev *dev)
 	struct elan_dev *elandev = dev->priv;
 	unsigned char raw_height = elandev->frame_width;
 	unsigned char raw_width = elandev->raw_frame_width;
-	unsigned short *frame =
-	    g_malloc(elandev->frame_width * elandev->frame_height * 2);
+	unsigned short *frame = fpi_asmbl_buf_add(&elandev->frames);
 
 	fp_dbg("");
 
@@ -94,72 +143,54 @@ static void elan_save_frame(struct fp_img_dev *dev)
 	 * normalized image, which means we need to make them horizontal before
 	 * assembling. We also discard stirpes of ELAN_FRAME_MARGIN along raw
 	 * height. */
-	for (int y = 0; y < raw_height; y++)
-		for (int x = ELAN_FRAME_MARGIN;
-		     x < raw_width - ELAN_FRAME_MARGIN; x++) {
-			int frame_idx =
-			    y + (x - ELAN_FRAME_MARGIN) * raw_height;
-			int raw_idx = x + y * raw_width;
-			frame[frame_idx] =
-			    ((unsigned short *)elandev->last_read)[raw_idx];
-		}
-
-	elandev->frames = g_slist_prepend(elandev->frames, frame);
-	elandev->num_frames += 1;
+	fpi_transpose_u16((unsigned short *)elandev->last_read + ELAN_FRAME_MARGIN,
+			  raw_width, frame, raw_height,
+			  raw_width - 2 * ELAN_FRAME_MARGIN, raw_height);
 }
 
 /* Transform raw sesnsor data to normalized 8-bit grayscale image. */
-static void elan_process_frame(unsigned short *raw_frame, GSList ** frames)
+static void elan_process_frame(unsigned short *raw_frame,
+			       struct fpi_frame *frame)
 {
 	unsigned int frame_size =
 	    assembling_ctx.frame_width * assembling_ctx.frame_height;
-	struct fpi_frame *frame =
-	    g_malloc(frame_size + sizeof(struct fpi_frame));
 
 	fp_dbg("");
 
-	unsigned short min = 0xffff, max = 0;
-	for (int i = 0; i < frame_size; i++) {
-		if (raw_frame[i] < min)
-			min = raw_frame[i];
-		if (raw_frame[i] > max)
-			max = raw_frame[i];
-	}
+	frame->delta_x = 0;
+	frame->delta_y = 0;
 
-	unsigned short px;
-	for (int i = 0; i < frame_size; i++) {
-		px = raw_frame[i];
-		if (px <= min)
-			px = 0;
-		else if (px >= max)
-			px = 0xff;
-		else
-			px = (px - min) * 0xff / (max - min);
-		frame->data[i] = (unsigned char)px;
-	}
-
-	*frames = g_slist_prepend(*frames, frame);
+	unsigned short min, max;
+	fpi_minmax_u16(raw_frame, frame_size, &min, &max);
+	fpi_normalize_u16(raw_frame, frame_size, min, max, frame->data);
 }
 
 static void elan_submit_image(struct fp_img_dev *dev)
 {
 	struct elan_dev *elandev = dev->priv;
-	GSList *frames = NULL;
+	/* The last frames are skipped */
+	size_t num_frames = elandev->frames.len - ELAN_SKIP_LAST_FRAMES;
+	struct fpi_asmbl_buf frames;
+	GSList *list;
 	struct fp_img *img;
 
 	fp_dbg("");
 
-	for (int i = 0; i < ELAN_SKIP_LAST_FRAMES; i++)
-		elandev->frames = g_slist_next(elandev->frames);
-
 	assembling_ctx.frame_width = elandev->frame_width;
 	assembling_ctx.frame_height = elandev->frame_height;
 	assembling_ctx.image_width = elandev->frame_width * 3 / 2;
-	g_slist_foreach(elandev->frames, (GFunc) elan_process_frame, &frames);
-	fpi_do_movement_estimation(&assembling_ctx, frames,
-				   elandev->num_frames - ELAN_SKIP_LAST_FRAMES);
-	img = fpi_assemble_frames(&assembling_ctx, frames,
-				  elandev->num_frames - ELAN_SKIP_LAST_FRAMES);
+
+	fpi_asmbl_buf_init(&frames, sizeof(struct fpi_frame) +
+			   elandev->frame_width * elandev->frame_height);
+	for (size_t i = 0; i < num_frames; i++)
+		elan_process_frame(fpi_asmbl_buf_get(&elandev->frames, i),
+				   fpi_asmbl_buf_add(&frames));
+
+	list = fpi_asmbl_buf_list(&frames);
+	fpi_do_movement_estimation(&assembling_ctx, list, num_frames);
+	img = fpi_assemble_frames(&assembling_ctx, list, num_frames);
+	fpi_asmbl_buf_free(&frames);
+	fpi_imgdev_report_assembled(dev, num_frames);
 
 	img->flags |= FP_IMG_PARTIAL;
 	fpi_imgdev_image_captured(dev, img);
@@ -250,7 +281,7 @@ static void elan_cmd_read(struct fpi_ssm *ssm)
 				  elandev->last_read, response_len, elan_cmd_cb,
 				  ssm, elandev->cmd_timeout);
 	transfer->flags = LIBUSB_TRANSFER_FREE_TRANSFER;
-	int r = libusb_submit_transfer(transfer);
+	int r = fpi_usb_submit_transfer(transfer);
 	if (r < 0)
 		fpi_ssm_mark_aborted(ssm, r);
 }
@@ -275,7 +306,7 @@ static void elan_run_next_cmd(struct fpi_ssm *ssm)
 				  ELAN_CMD_LEN, elan_cmd_cb, ssm,
 				  elandev->cmd_timeout);
 	transfer->flags = LIBUSB_TRANSFER_FREE_TRANSFER;
-	int r = libusb_submit_transfer(transfer);
+	int r = fpi_usb_submit_transfer(transfer);
 	if (r < 0)
 		fpi_ssm_mark_aborted(ssm, r);
 
@@ -362,12 +393,19 @@ static void elan_capture_run_state(struct fpi_ssm *ssm)
 			fpi_imgdev_report_finger_status(dev, TRUE);
 			elan_run_cmds(ssm, read_cmds, read_cmds_len,
 				      ELAN_CMD_TIMEOUT);
+		} else if (elandev->calibrated && elandev->last_read
+			   && elandev->last_read[0] == 0xff) {
+			fp_dbg("cached calibration no longer holds");
+			fpi_calibration_forget(dev->dev);
+			elandev->calibrated = FALSE;
+			elandev->recalibrating = TRUE;
+			fpi_ssm_mark_aborted(ssm, -EAGAIN);
 		} else
 			fpi_ssm_mark_aborted(ssm, FP_VERIFY_RETRY);
 		break;
 	case CAPTURE_SAVE_FRAME:
 		elan_save_frame(dev);
-		if (elandev->num_frames < ELAN_MAX_FRAMES) {
+		if (elandev->frames.len < ELAN_MAX_FRAMES) {
 			/* quickly stop if finger is removed */
 			elandev->cmd_timeout = ELAN_FINGER_TIMEOUT;
 			fpi_ssm_jump_to_state(ssm, CAPTURE_WAIT_FINGER);
@@ -381,6 +419,8 @@ static void elan_capture_async(void *data)
 	elan_capture((struct fp_img_dev *)data);
 }
 
+static void elan_calibrate(struct fp_img_dev *dev);
+
 static void capture_complete(struct fpi_ssm *ssm)
 {
 	struct fp_img_dev *dev = ssm->priv;
@@ -391,11 +431,18 @@ static void capture_complete(struct fpi_ssm *ssm)
 	if (elandev->deactivating)
 		elan_deactivate(dev);
 
+	/* the capture resumes once the sensor is calibrated again */
+	else if (elandev->recalibrating) {
+		fpi_ssm_free(ssm);
+		elan_calibrate(dev);
+		return;
+	}
+
 	/* either max frames captured or timed out waiting for the next frame */
 	else if (!ssm->error
 		 || (ssm->error == -ETIMEDOUT
 		     && ssm->cur_state == CAPTURE_WAIT_FINGER))
-		if (elandev->num_frames >= ELAN_MIN_FRAMES) {
+		if (elandev->frames.len >= ELAN_MIN_FRAMES) {
 			elan_submit_image(dev);
 			fpi_imgdev_report_finger_status(dev, FALSE);
 		} else
@@ -413,7 +460,7 @@ static void capture_complete(struct fpi_ssm *ssm)
 	 * But after that it can't finalize enrollemnt until this callback exits.
 	 * That's why we schedule elan_capture instead of running it directly. */
 	if (dev->dev->state == DEV_STATE_ENROLLING
-	    && !fpi_timeout_add(10, elan_capture_async, dev))
+	    && !fpi_timeout_add(dev->dev, 10, elan_capture_async, dev))
 		fpi_imgdev_session_error(dev, -ETIME);
 
 	fpi_ssm_free(ssm);
@@ -473,7 +520,11 @@ static void calibrate_complete(struct fpi_ssm *ssm)
 	else if (ssm->error)
 		fpi_imgdev_session_error(dev, ssm->error);
 	else {
-		fpi_imgdev_activate_complete(dev, ssm->error);
+		elan_save_calibration(dev);
+		if (elandev->recalibrating)
+			elandev->recalibrating = FALSE;
+		else
+			fpi_imgdev_activate_complete(dev, ssm->error);
 		elan_capture(dev);
 	}
 	fpi_ssm_free(ssm);
@@ -508,14 +559,16 @@ static void elan_activate_run_state(struct fpi_ssm *ssm)
 
 	switch (ssm->cur_state) {
 	case ACTIVATE_GET_SENSOR_DIM:
+		if (elandev->calibrated) {
+			fpi_ssm_jump_to_state(ssm, ACTIVATE_START);
+			break;
+		}
 		elan_run_cmds(ssm, get_sensor_dim_cmds, get_sensor_dim_cmds_len,
 			      ELAN_CMD_TIMEOUT);
 		break;
 	case ACTIVATE_SET_SENSOR_DIM:
-		elandev->frame_width = elandev->last_read[2];
-		elandev->raw_frame_width = elandev->last_read[0];
-		elandev->frame_height =
-		    elandev->raw_frame_width - 2 * ELAN_FRAME_MARGIN;
+		elan_set_sensor_dim(elandev, elandev->last_read[2],
+				    elandev->last_read[0]);
 		fpi_ssm_next_state(ssm);
 		break;
 	case ACTIVATE_START:
@@ -542,7 +595,10 @@ static void activate_complete(struct fpi_ssm *ssm)
 		elan_deactivate(dev);
 	else if (ssm->error)
 		fpi_imgdev_session_error(dev, ssm->error);
-	else
+	else if (elandev->calibrated) {
+		fpi_imgdev_activate_complete(dev, 0);
+		elan_capture(dev);
+	} else
 		elan_calibrate(dev);
 	fpi_ssm_free(ssm);
 }
@@ -554,6 +610,7 @@ static int dev_activate(struct fp_img_dev *dev, enum fp_imgdev_state state)
 	fp_dbg("");
 
 	elan_dev_reset(elandev);
+	elandev->recalibrating = FALSE;
 	struct fpi_ssm *ssm =
 	    fpi_ssm_new(dev->dev, elan_activate_run_state, ACTIVATE_NUM_STATES);
 	ssm->priv = dev;
@@ -569,13 +626,15 @@ static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 
 	fp_dbg("");
 
-	r = libusb_claim_interface(dev->udev, 0);
+	r = fpi_usb_claim_interface(dev->udev, 0);
 	if (r < 0) {
 		fp_err("could not claim interface 0: %s", libusb_error_name(r));
 		return r;
 	}
 
 	dev->priv = elandev = g_malloc0(sizeof(struct elan_dev));
+	fpi_dev_mem_account(dev->dev, sizeof(*elandev));
+	elan_load_calibration(dev);
 	fpi_imgdev_open_complete(dev, 0);
 	return 0;
 }
@@ -587,8 +646,9 @@ static void dev_deinit(struct fp_img_dev *dev)
 	fp_dbg("");
 
 	elan_dev_reset(elandev);
+	fpi_asmbl_buf_free(&elandev->frames);
 	g_free(elandev);
-	libusb_release_interface(dev->udev, 0);
+	fpi_usb_release_interface(dev->udev, 0);
 	fpi_imgdev_close_complete(dev);
 }
 
@@ -601,7 +661,7 @@ static void dev_deactivate(struct fp_img_dev *dev)
 	elandev->deactivating = TRUE;
 
 	if (elandev->cur_transfer)
-		libusb_cancel_transfer(elandev->cur_transfer);
+		fpi_usb_cancel_transfer(elandev->cur_transfer);
 	else
 		elan_deactivate(dev);
 }
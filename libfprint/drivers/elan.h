@@ -46,6 +46,11 @@
 #define ELAN_CMD_TIMEOUT 10000
 #define ELAN_FINGER_TIMEOUT 200
 
+/* sensor dimensions and calibration are kept across processes for this long,
+ * in seconds, see calibration.c */
+#define ELAN_CALIBRATION_VERSION 1
+#define ELAN_CALIBRATION_MAX_AGE (24 * 60 * 60)
+
 struct elan_cmd {
 	unsigned char cmd[ELAN_CMD_LEN];
 	int response_len;
@@ -67,6 +67,10 @@
 #define DCOFFSET_MIN       0x00 /* Minimum value for DCoffset */
 #define DCOFFSET_MAX       0x35 /* Maximum value for DCoffset */
 
+/* Tuning kept across processes, see calibration.c */
+#define CALIBRATION_VERSION 1
+#define CALIBRATION_MAX_AGE (7 * 24 * 60 * 60) /* in seconds */
+
 /* es603 commands */
 #define CMD_READ_REG       0x01
 #define CMD_WRITE_REG      0x02
@@ -213,8 +217,18 @@ struct etes603_dev {
 	uint8_t vrb;
 
 	unsigned int is_active;
+	/* Parameters come from the calibration cache and the sensor still
+	 * needs its initialization. */
+	unsigned int from_cache;
 };
 
+struct etes603_calibration {
+	uint8_t gain;
+	uint8_t dcoffset;
+	uint8_t vrt;
+	uint8_t vrb;
+} __attribute__((packed));
+
 static void m_start_fingerdetect(struct fp_img_dev *idev);
 /*
  * Prepare the header of the message to be sent to the device.
@@ -519,17 +533,6 @@ static int process_frame_empty(uint8_t *frame, size_t size)
 }
 
 /* Transform 4 bits image to 8 bits image */
-static void process_4to8_bpp(uint8_t *input, unsigned int input_size,
-	uint8_t *output)
-{
-	unsigned int i, j = 0;
-	for (i = 0; i < input_size; i++, j += 2) {
-		/* 16 gray levels transform to 256 levels using << 4 */
-		output[j] = input[i] & 0xF0;
-		output[j+1] = input[i] << 4;
-	}
-}
-
 /*
  * Remove duplicated lines at the end of a fingerprint.
  */
@@ -546,12 +549,52 @@ static void process_remove_fp_end(struct etes603_dev *dev)
 	fp_dbg("Removing %d empty lines from image", i - 2);
 }
 
-static void reset_param(struct etes603_dev *dev)
+static void reset_param(struct fp_img_dev *idev)
 {
+	struct etes603_dev *dev = idev->priv;
+
+	/* Tune from scratch next time, this process or another. */
+	if (dev->dcoffset)
+		fpi_calibration_forget(idev->dev);
 	dev->dcoffset = 0;
 	dev->vrt = 0;
 	dev->vrb = 0;
 	dev->gain = 0;
+	dev->from_cache = FALSE;
+}
+
+static void load_param(struct fp_img_dev *idev)
+{
+	struct etes603_dev *dev = idev->priv;
+	struct etes603_calibration cal;
+
+	if (fpi_calibration_load(idev->dev, CALIBRATION_VERSION, &cal,
+			sizeof(cal), CALIBRATION_MAX_AGE))
+		return;
+	if (cal.dcoffset == 0 || cal.dcoffset > DCOFFSET_MAX ||
+			cal.vrt > VRT_MAX || cal.vrb > VRB_MAX) {
+		fpi_calibration_forget(idev->dev);
+		return;
+	}
+	dev->gain = cal.gain;
+	dev->dcoffset = cal.dcoffset;
+	dev->vrt = cal.vrt;
+	dev->vrb = cal.vrb;
+	dev->from_cache = TRUE;
+}
+
+static void save_param(struct fp_img_dev *idev)
+{
+	struct etes603_dev *dev = idev->priv;
+	struct etes603_calibration cal = {
+		.gain = dev->gain,
+		.dcoffset = dev->dcoffset,
+		.vrt = dev->vrt,
+		.vrb = dev->vrb,
+	};
+
+	fpi_calibration_save(idev->dev, CALIBRATION_VERSION, &cal,
+		sizeof(cal));
 }
 
 
@@ -666,7 +709,7 @@ static int async_tx(struct fp_img_dev *idev, unsigned int ep, void *cb,
 	libusb_fill_bulk_transfer(transfer, idev->udev, ep, buffer, length,
 				  cb, cb_arg, BULK_TIMEOUT);
 
-	if (libusb_submit_transfer(transfer)) {
+	if (fpi_usb_submit_transfer(transfer)) {
 		libusb_free_transfer(transfer);
 		return -EIO;
 	}
@@ -818,7 +861,8 @@ static void m_capture_state(struct fpi_ssm *ssm)
 			/* TODO detect sweep direction */
 			img->flags = FP_IMG_COLORS_INVERTED | FP_IMG_V_FLIPPED;
 			img->height = dev->fp_height;
-			process_4to8_bpp(dev->fp, img_size / 2, img->data);
+			/* 16 gray levels transform to 256 levels using << 4 */
+			fpi_expand_4bpp(dev->fp, img_size / 2, img->data);
 			fp_dbg("Sending the raw fingerprint image (%dx%d)",
 				img->width, img->height);
 			fpi_imgdev_image_captured(idev, img);
@@ -859,6 +903,11 @@ static void m_capture_complete(struct fpi_ssm *ssm)
 	}
 }
 
+static void m_finger_poll_cb(void *data)
+{
+	fpi_ssm_jump_to_state(data, FGR_FPA_GET_FRAME_REQ);
+}
+
 static void m_finger_state(struct fpi_ssm *ssm)
 {
 	struct fp_img_dev *idev = ssm->priv;
@@ -938,7 +987,8 @@ static void m_finger_state(struct fpi_ssm *ssm)
 		break;
 	case FGR_FPA_GET_FRAME_ANS:
 		if (process_frame_empty((uint8_t *)dev->ans, FRAME_SIZE)) {
-			fpi_ssm_jump_to_state(ssm, FGR_FPA_GET_FRAME_REQ);
+			if (fpi_imgdev_schedule_poll(idev, m_finger_poll_cb, ssm))
+				goto err;
 		} else {
 			fpi_imgdev_report_finger_status(idev, TRUE);
 			fpi_ssm_mark_completed(ssm);
@@ -1148,12 +1198,13 @@ static void m_tunevrb_complete(struct fpi_ssm *ssm)
 	fpi_imgdev_activate_complete(idev, ssm->error != 0);
 	if (!ssm->error) {
 		fp_dbg("Tuning is done. Starting finger detection.");
+		save_param(idev);
 		m_start_fingerdetect(idev);
 	} else {
 		struct etes603_dev *dev = idev->priv;
 		fp_err("Error while tuning VRT");
 		dev->is_active = FALSE;
-		reset_param(dev);
+		reset_param(idev);
 		fpi_imgdev_session_error(idev, -3);
 	}
 	fpi_ssm_free(ssm);
@@ -1279,7 +1330,7 @@ static void m_tunedc_complete(struct fpi_ssm *ssm)
 		struct etes603_dev *dev = idev->priv;
 		fp_err("Error while tuning DCOFFSET");
 		dev->is_active = FALSE;
-		reset_param(dev);
+		reset_param(idev);
 		fpi_imgdev_session_error(idev, -2);
 	}
 	fpi_ssm_free(ssm);
@@ -1389,17 +1440,25 @@ err:
 static void m_init_complete(struct fpi_ssm *ssm)
 {
 	struct fp_img_dev *idev = ssm->priv;
-	if (!ssm->error) {
+	struct etes603_dev *dev = idev->priv;
+
+	if (!ssm->error && dev->from_cache) {
+		fp_dbg("Using cached tuning (DCOFFSET=0x%02X,VRT=0x%02X,"
+			"VRB=0x%02X,GAIN=0x%02X).", dev->dcoffset, dev->vrt,
+			dev->vrb, dev->gain);
+		dev->from_cache = FALSE;
+		fpi_imgdev_activate_complete(idev, 0);
+		m_start_fingerdetect(idev);
+	} else if (!ssm->error) {
 		struct fpi_ssm *ssm_tune;
 		ssm_tune = fpi_ssm_new(idev->dev, m_tunedc_state,
 					TUNEDC_NUM_STATES);
 		ssm_tune->priv = idev;
 		fpi_ssm_start(ssm_tune, m_tunedc_complete);
 	} else {
-		struct etes603_dev *dev = idev->priv;
 		fp_err("Error initializing the device");
 		dev->is_active = FALSE;
-		reset_param(dev);
+		reset_param(idev);
 		fpi_imgdev_session_error(idev, -1);
 	}
 	fpi_ssm_free(ssm);
@@ -1421,8 +1480,8 @@ static int dev_activate(struct fp_img_dev *idev, enum fp_imgdev_state state)
 	/* Reset info and data */
 	dev->is_active = TRUE;
 
-	if (dev->dcoffset == 0) {
-		fp_dbg("Tuning device...");
+	if (dev->dcoffset == 0 || dev->from_cache) {
+		fp_dbg("Initializing device...");
 		ssm = fpi_ssm_new(idev->dev, m_init_state, INIT_NUM_STATES);
 		ssm->priv = idev;
 		fpi_ssm_start(ssm, m_init_complete);
@@ -1462,13 +1521,17 @@ static int dev_open(struct fp_img_dev *idev, unsigned long driver_data)
 	dev->req = g_malloc(sizeof(struct egis_msg));
 	dev->ans = g_malloc(FE_SIZE);
 	dev->fp = g_malloc(FE_SIZE * 4);
+	fpi_dev_mem_account(idev->dev, sizeof(*dev) + sizeof(struct egis_msg) +
+		FE_SIZE * 5);
 
-	ret = libusb_claim_interface(idev->udev, 0);
+	ret = fpi_usb_claim_interface(idev->udev, 0);
 	if (ret != LIBUSB_SUCCESS) {
 		fp_err("libusb_claim_interface failed on interface 0: %s", libusb_error_name(ret));
 		return ret;
 	}
 
+	load_param(idev);
+
 	fpi_imgdev_open_complete(idev, 0);
 	return 0;
 }
@@ -1482,7 +1545,7 @@ static void dev_close(struct fp_img_dev *idev)
 	g_free(dev->fp);
 	g_free(dev);
 
-	libusb_release_interface(idev->udev, 0);
+	fpi_usb_release_interface(idev->udev, 0);
 	fpi_imgdev_close_complete(idev);
 }
 
@@ -264,7 +264,7 @@ gint dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 	//if ( (r = usb_set_configuration(dev->udev, 1)) < 0 )
 	//	goto out;
 
-	if ( (r = libusb_claim_interface(dev->udev, 0)) < 0 ) {
+	if ( (r = fpi_usb_claim_interface(dev->udev, 0)) < 0 ) {
 		fp_err("could not claim interface 0: %s", libusb_error_name(r));
 		return r;
 	}
@@ -299,7 +299,7 @@ void dev_exit(struct fp_img_dev *dev)
 	if (bulk_write_safe(dev->udev, CAPTURE_END))
 		fp_err("Command: CAPTURE_END");
 
-	libusb_release_interface(dev->udev, 0);
+	fpi_usb_release_interface(dev->udev, 0);
 }
 
 static const struct usb_id id_table[] = {
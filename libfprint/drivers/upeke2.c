@@ -268,7 +268,7 @@ static int busy_ack_retry_read(struct read_msg_data *udata)
 	if (!transfer)
 		return -ENOMEM;
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(transfer->buffer);
 		libusb_free_transfer(transfer);
@@ -434,7 +434,7 @@ static void read_msg_cb(struct libusb_transfer *transfer)
 			data + MSG_READ_BUF_SIZE, needed, read_msg_extend_cb, udata,
 			TIMEOUT);
 
-		r = libusb_submit_transfer(etransfer);
+		r = fpi_usb_submit_transfer(etransfer);
 		if (r < 0) {
 			fp_err("extended read submission failed");
 			/* FIXME memory leak here? */
@@ -471,7 +471,7 @@ static int __read_msg_async(struct read_msg_data *udata)
 
 	libusb_fill_bulk_transfer(transfer, udata->dev->udev, EP_IN, buf,
 		MSG_READ_BUF_SIZE, read_msg_cb, udata, TIMEOUT);
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(buf);
 		libusb_free_transfer(transfer);
@@ -674,7 +674,7 @@ static void initsm_send_msg28_handler(struct fpi_ssm *ssm,
 		return;
 	}
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		fp_err("urb submission failed error %d in state %d", r, ssm->cur_state);
 		g_free(transfer->buffer);
@@ -706,7 +706,7 @@ static void initsm_run_state(struct fpi_ssm *ssm)
 		libusb_fill_control_transfer(transfer, ssm->dev->udev, data,
 			ctrl400_cb, ssm, TIMEOUT);
 
-		r = libusb_submit_transfer(transfer);
+		r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			g_free(data);
 			libusb_free_transfer(transfer);
@@ -724,7 +724,7 @@ static void initsm_run_state(struct fpi_ssm *ssm)
 			break;
 		}
 
-		r = libusb_submit_transfer(transfer);
+		r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			g_free(transfer->buffer);
 			libusb_free_transfer(transfer);
@@ -830,7 +830,7 @@ static void deinitsm_state_handler(struct fpi_ssm *ssm)
 			break;
 		}
 
-		r = libusb_submit_transfer(transfer);
+		r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			g_free(transfer->buffer);
 			libusb_free_transfer(transfer);
@@ -863,7 +863,7 @@ static int dev_init(struct fp_dev *dev, unsigned long driver_data)
 	struct upeke2_dev *upekdev = NULL;
 	int r;
 
-	r = libusb_claim_interface(dev->udev, 0);
+	r = fpi_usb_claim_interface(dev->udev, 0);
 	if (r < 0) {
 		fp_err("could not claim interface 0: %s", libusb_error_name(r));
 		return r;
@@ -872,6 +872,7 @@ static int dev_init(struct fp_dev *dev, unsigned long driver_data)
 	upekdev = g_malloc(sizeof(*upekdev));
 	upekdev->seq = 0xf0; /* incremented to 0x00 before first cmd */
 	dev->priv = upekdev;
+	fpi_dev_mem_account(dev, sizeof(*upekdev));
 	dev->nr_enroll_stages = 5;
 
 	fpi_drvcb_open_complete(dev, 0);
@@ -880,7 +881,7 @@ static int dev_init(struct fp_dev *dev, unsigned long driver_data)
 
 static void dev_exit(struct fp_dev *dev)
 {
-	libusb_release_interface(dev->udev, 0);
+	fpi_usb_release_interface(dev->udev, 0);
 	g_free(dev->priv);
 	fpi_drvcb_close_complete(dev);
 }
@@ -971,7 +972,7 @@ static void enroll_start_sm_run_state(struct fpi_ssm *ssm)
 			break;
 		}
 
-		r = libusb_submit_transfer(transfer);
+		r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			g_free(transfer->buffer);
 			libusb_free_transfer(transfer);
@@ -1142,7 +1143,7 @@ static void enroll_iterate(struct fp_dev *dev)
 		return;
 	}
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(transfer->buffer);
 		libusb_free_transfer(transfer);
@@ -1264,7 +1265,7 @@ static void verify_start_sm_run_state(struct fpi_ssm *ssm)
 			break;
 		}
 
-		r = libusb_submit_transfer(transfer);
+		r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			g_free(transfer->buffer);
 			libusb_free_transfer(transfer);
@@ -1417,7 +1418,7 @@ static void verify_iterate(struct fp_dev *dev)
 			return;
 		}
 
-		r = libusb_submit_transfer(transfer);
+		r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			g_free(transfer->buffer);
 			libusb_free_transfer(transfer);
@@ -58,7 +58,6 @@ struct img_transfer_data {
 	int idx;
 	struct fp_img_dev *dev;
 	gboolean flying;
-	gboolean cancelling;
 };
 
 enum sonly_kill_transfers_action {
@@ -86,6 +85,9 @@ enum sonly_fs {
 struct sonly_dev {
 	gboolean capturing;
 	gboolean deactivating;
+	/* the capture loop ended cleanly on deactivation, the sensor is
+	 * still initialised */
+	gboolean warm;
 	uint8_t read_reg_result;
 
 	int dev_model;
@@ -95,9 +97,10 @@ struct sonly_dev {
 	struct libusb_transfer *img_transfer[NUM_BULK_TRANSFERS];
 	struct img_transfer_data *img_transfer_data;
 	int num_flying;
+	/* transfer submitted last, see fpi_usb_cancel_transfers() */
+	int newest_transfer;
 
-	GSList *rows;
-	size_t num_rows;
+	struct fpi_asmbl_buf rows;
 	unsigned char *rowbuf;
 	int rowbuf_offset;
 
@@ -121,18 +124,9 @@ static int upeksonly_get_deviation2(struct fpi_line_asmbl_ctx *ctx,
 			  GSList *line1, GSList *line2)
 {
 	unsigned char *buf1 = line1->data, *buf2 = line2->data;
-	int res = 0, mean = 0, i;
-	for (i = 0; i < ctx->line_width; i+= 2)
-		mean += (int)buf1[i + 1] + (int)buf2[i];
 
-	mean /= (ctx->line_width / 2);
-
-	for (i = 0; i < ctx->line_width; i+= 2) {
-		int dev = (int)buf1[i + 1] + (int)buf2[i] - mean;
-		res += dev*dev;
-	}
-
-	return res / (ctx->line_width / 2);
+	/* Odd pixels of the first line with even pixels of the second one */
+	return fpi_std_sq_dev2(buf1 + 1, buf2, ctx->line_width / 2, 2);
 }
 
 
@@ -164,6 +158,7 @@ static struct fpi_line_asmbl_ctx assembling_ctx = {
 	.resolution = 8,
 	.median_filter_size = 25,
 	.max_search_offset = 30,
+	.line_search = FPI_LINE_SEARCH_PARALLEL,
 	.get_deviation = upeksonly_get_deviation2,
 	.get_pixel = upeksonly_get_pixel,
 };
@@ -208,28 +203,22 @@ static void last_transfer_killed(struct fp_img_dev *dev)
 static void cancel_img_transfers(struct fp_img_dev *dev)
 {
 	struct sonly_dev *sdev = dev->priv;
-	int i;
+	unsigned int n;
 
 	if (sdev->num_flying == 0) {
 		last_transfer_killed(dev);
 		return;
 	}
 
-	for (i = 0; i < NUM_BULK_TRANSFERS; i++) {
-		struct img_transfer_data *idata = &sdev->img_transfer_data[i];
-		if (!idata->flying || idata->cancelling)
-			continue;
-		fp_dbg("cancelling transfer %d", i);
-		int r = libusb_cancel_transfer(sdev->img_transfer[i]);
-		if (r < 0)
-			fp_dbg("cancel failed error %d", r);
-		idata->cancelling = TRUE;
-	}
+	/* all at once, the ones already cancelled just fail to cancel again */
+	n = fpi_usb_cancel_transfers(sdev->img_transfer, NUM_BULK_TRANSFERS,
+		sdev->newest_transfer);
+	fp_dbg("cancelling %u of %d transfers", n, sdev->num_flying);
 }
 
 static gboolean is_capturing(struct sonly_dev *sdev)
 {
-	return sdev->num_rows < MAX_ROWS && (sdev->finger_state != FINGER_REMOVED);
+	return sdev->rows.len < MAX_ROWS && (sdev->finger_state != FINGER_REMOVED);
 }
 
 static void handoff_img(struct fp_img_dev *dev)
@@ -237,20 +226,16 @@ static void handoff_img(struct fp_img_dev *dev)
 	struct sonly_dev *sdev = dev->priv;
 	struct fp_img *img;
 
-	GSList *elem = sdev->rows;
-
-	if (!elem) {
+	if (!sdev->rows.len) {
 		fp_err("no rows?");
 		return;
 	}
 
-	sdev->rows = g_slist_reverse(sdev->rows);
-
-	fp_dbg("%d rows", sdev->num_rows);
-	img = fpi_assemble_lines(&assembling_ctx, sdev->rows, sdev->num_rows);
-
-	g_slist_free_full(sdev->rows, g_free);
-	sdev->rows = NULL;
+	fp_dbg("%d rows", sdev->rows.len);
+	img = fpi_assemble_lines(&assembling_ctx, fpi_asmbl_buf_list(&sdev->rows),
+				 sdev->rows.len);
+	fpi_imgdev_report_assembled(dev, sdev->rows.len);
+	fpi_asmbl_buf_clear(&sdev->rows);
 
 	fpi_imgdev_image_captured(dev, img);
 	fpi_imgdev_report_finger_status(dev, FALSE);
@@ -265,12 +250,15 @@ static void row_complete(struct fp_img_dev *dev)
 	struct sonly_dev *sdev = dev->priv;
 	sdev->rowbuf_offset = -1;
 
-	if (sdev->num_rows > 0) {
-		unsigned char *lastrow = sdev->rows->data;
+	if (sdev->rows.len > 0) {
+		unsigned char *lastrow = fpi_asmbl_buf_get(&sdev->rows,
+							    sdev->rows.len - 1);
+		struct fpi_line_stats stats;
 		int std_sq_dev, mean_sq_diff;
 
-		std_sq_dev = fpi_std_sq_dev(sdev->rowbuf, sdev->img_width);
-		mean_sq_diff = fpi_mean_sq_diff_norm(lastrow, sdev->rowbuf, sdev->img_width);
+		fpi_line_stats(sdev->rowbuf, lastrow, sdev->img_width, &stats);
+		std_sq_dev = stats.std_sq_dev;
+		mean_sq_diff = stats.mean_sq_diff;
 
 		switch (sdev->finger_state) {
 		case AWAIT_FINGER:
@@ -312,7 +300,7 @@ static void row_complete(struct fp_img_dev *dev)
 			 */
 			if (sdev->num_blank > FINGER_REMOVED_THRESHOLD) {
 				sdev->finger_state = FINGER_REMOVED;
-				fp_dbg("detected finger removal. Blank rows: %d, Full rows: %d", sdev->num_blank, sdev->num_rows);
+				fp_dbg("detected finger removal. Blank rows: %d, Full rows: %d", sdev->num_blank, sdev->rows.len);
 				handoff_img(dev);
 				return;
 			}
@@ -326,22 +314,25 @@ static void row_complete(struct fp_img_dev *dev)
 
 	switch (sdev->finger_state) {
 	case AWAIT_FINGER:
-		if (!sdev->num_rows) {
-			sdev->rows = g_slist_prepend(sdev->rows, sdev->rowbuf);
-			sdev->num_rows++;
+		if (!sdev->rows.len) {
+			memcpy(fpi_asmbl_buf_add(&sdev->rows), sdev->rowbuf,
+			       sdev->img_width);
 		} else {
 			return;
 		}
 		break;
 	case FINGER_DETECTED:
 	case FINGER_REMOVED:
-		sdev->rows = g_slist_prepend(sdev->rows, sdev->rowbuf);
-		sdev->num_rows++;
+		memcpy(fpi_asmbl_buf_add(&sdev->rows), sdev->rowbuf,
+		       sdev->img_width);
 		break;
 	}
-	sdev->rowbuf = NULL;
 
-	if (sdev->num_rows >= MAX_ROWS) {
+	/* The rows so far, as read: still rolled and interleaved */
+	fpi_imgdev_preview(dev, FP_IMG_PREVIEW_GREY8, sdev->rows.data,
+			   sdev->img_width, sdev->rows.len, sdev->rows.entry_size);
+
+	if (sdev->rows.len >= MAX_ROWS) {
 		fp_dbg("row limit met");
 		handoff_img(dev);
 	}
@@ -407,9 +398,10 @@ static void handle_packet(struct fp_img_dev *dev, unsigned char *data)
 				abs_base_addr = (sdev->last_seqnum + 1) * 62;
 
 				/* If possible take the replacement data from last row */
-				if (sdev->num_rows > 1) {
+				if (sdev->rows.len > 1) {
 					int row_left = sdev->img_width - sdev->rowbuf_offset;
-					unsigned char *last_row = g_slist_nth_data (sdev->rows, 0);
+					unsigned char *last_row = fpi_asmbl_buf_get(&sdev->rows,
+										    sdev->rows.len - 1);
 
 					if (row_left >= 62) {
 						memcpy(dummy_data, last_row + sdev->rowbuf_offset, 62);
@@ -484,7 +476,6 @@ static void img_data_cb(struct libusb_transfer *transfer)
 	int i;
 
 	idata->flying = FALSE;
-	idata->cancelling = FALSE;
 	sdev->num_flying--;
 
 	if (sdev->killing_transfers) {
@@ -514,7 +505,7 @@ static void img_data_cb(struct libusb_transfer *transfer)
 	}
 
 	if (is_capturing(sdev)) {
-		int r = libusb_submit_transfer(transfer);
+		int r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			fp_warn("failed resubmit, error %d", r);
 			sdev->killing_transfers = IMG_SESSION_ERROR;
@@ -523,6 +514,7 @@ static void img_data_cb(struct libusb_transfer *transfer)
 			return;
 		}
 		sdev->num_flying++;
+		sdev->newest_transfer = idata->idx;
 		idata->flying = TRUE;
 	}
 }
@@ -567,7 +559,7 @@ static void write_regs_iterate(struct write_regs_data *wrdata)
 	setup->wIndex = regwrite->reg;
 	wrdata->transfer->buffer[LIBUSB_CONTROL_SETUP_SIZE] = regwrite->value;
 
-	r = libusb_submit_transfer(wrdata->transfer);
+	r = fpi_usb_submit_transfer(wrdata->transfer);
 	if (r < 0)
 		write_regs_finished(wrdata, r);
 }
@@ -643,7 +635,7 @@ static void sm_write_reg(struct fpi_ssm *ssm, uint8_t reg, uint8_t value)
 	transfer->flags = LIBUSB_TRANSFER_SHORT_NOT_OK |
 		LIBUSB_TRANSFER_FREE_TRANSFER;
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(data);
 		libusb_free_transfer(transfer);
@@ -688,7 +680,7 @@ static void sm_read_reg(struct fpi_ssm *ssm, uint8_t reg)
 	transfer->flags = LIBUSB_TRANSFER_SHORT_NOT_OK |
 		LIBUSB_TRANSFER_FREE_TRANSFER;
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(data);
 		libusb_free_transfer(transfer);
@@ -737,7 +729,7 @@ static void sm_await_intr(struct fpi_ssm *ssm)
 	transfer->flags = LIBUSB_TRANSFER_SHORT_NOT_OK |
 		LIBUSB_TRANSFER_FREE_TRANSFER;
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		libusb_free_transfer(transfer);
 		g_free(data);
@@ -861,7 +853,7 @@ static void capsm_fire_bulk(struct fpi_ssm *ssm)
 	struct sonly_dev *sdev = dev->priv;
 	int i;
 	for (i = 0; i < NUM_BULK_TRANSFERS; i++) {
-		int r = libusb_submit_transfer(sdev->img_transfer[i]);
+		int r = fpi_usb_submit_transfer(sdev->img_transfer[i]);
 		if (r < 0) {
 			if (i == 0) {
 				/* first one failed: easy peasy */
@@ -880,6 +872,7 @@ static void capsm_fire_bulk(struct fpi_ssm *ssm)
 		}
 		sdev->img_transfer_data[i].flying = TRUE;
 		sdev->num_flying++;
+		sdev->newest_transfer = i;
 	}
 	sdev->capturing = TRUE;
 	fpi_ssm_next_state(ssm);
@@ -893,7 +886,7 @@ static void capsm_2016_run_state(struct fpi_ssm *ssm)
 	switch (ssm->cur_state) {
 	case CAPSM_2016_INIT:
 		sdev->rowbuf_offset = -1;
-		sdev->num_rows = 0;
+		fpi_asmbl_buf_clear(&sdev->rows);
 		sdev->wraparounds = -1;
 		sdev->num_blank = 0;
 		sdev->num_nonblank = 0;
@@ -925,7 +918,7 @@ static void capsm_1000_run_state(struct fpi_ssm *ssm)
 	switch (ssm->cur_state) {
 	case CAPSM_1000_INIT:
 		sdev->rowbuf_offset = -1;
-		sdev->num_rows = 0;
+		fpi_asmbl_buf_clear(&sdev->rows);
 		sdev->wraparounds = -1;
 		sdev->num_blank = 0;
 		sdev->num_nonblank = 0;
@@ -951,7 +944,7 @@ static void capsm_1001_run_state(struct fpi_ssm *ssm)
 	switch (ssm->cur_state) {
 	case CAPSM_1001_INIT:
 		sdev->rowbuf_offset = -1;
-		sdev->num_rows = 0;
+		fpi_asmbl_buf_clear(&sdev->rows);
 		sdev->wraparounds = -1;
 		sdev->num_blank = 0;
 		sdev->num_nonblank = 0;
@@ -1229,10 +1222,7 @@ static void deactivate_done(struct fp_img_dev *dev)
 	g_free(sdev->rowbuf);
 	sdev->rowbuf = NULL;
 
-	if (sdev->rows) {
-		g_slist_foreach(sdev->rows, (GFunc) g_free, NULL);
-		sdev->rows = NULL;
-	}
+	fpi_asmbl_buf_clear(&sdev->rows);
 
 	fpi_imgdev_deactivate_complete(dev);
 }
@@ -1261,6 +1251,10 @@ static void loopsm_complete(struct fpi_ssm *ssm)
 	fpi_ssm_free(ssm);
 
 	if (sdev->deactivating) {
+		/* the loop only ends at LOOPSM_RUN_AWFSM, either right after
+		 * the initialisation or after deinitsm, the sensor is in the
+		 * same state both ways */
+		sdev->warm = (r == 0);
 		deactivate_done(dev);
 		return;
 	}
@@ -1271,10 +1265,18 @@ static void loopsm_complete(struct fpi_ssm *ssm)
 	}
 }
 
+static void start_loop(struct fp_img_dev *dev)
+{
+	struct sonly_dev *sdev = dev->priv;
+
+	sdev->loopsm = fpi_ssm_new(dev->dev, loopsm_run_state, LOOPSM_NUM_STATES);
+	sdev->loopsm->priv = dev;
+	fpi_ssm_start(sdev->loopsm, loopsm_complete);
+}
+
 static void initsm_complete(struct fpi_ssm *ssm)
 {
 	struct fp_img_dev *dev = ssm->priv;
-	struct sonly_dev *sdev = dev->priv;
 	int r = ssm->error;
 
 	fpi_ssm_free(ssm);
@@ -1282,9 +1284,7 @@ static void initsm_complete(struct fpi_ssm *ssm)
 	if (r != 0)
 		return;
 
-	sdev->loopsm = fpi_ssm_new(dev->dev, loopsm_run_state, LOOPSM_NUM_STATES);
-	sdev->loopsm->priv = dev;
-	fpi_ssm_start(sdev->loopsm, loopsm_complete);
+	start_loop(dev);
 }
 
 static int dev_activate(struct fp_img_dev *dev, enum fp_imgdev_state state)
@@ -1295,6 +1295,7 @@ static int dev_activate(struct fp_img_dev *dev, enum fp_imgdev_state state)
 
 	sdev->deactivating = FALSE;
 	sdev->capturing = FALSE;
+	fpi_asmbl_buf_reserve(&sdev->rows, MAX_ROWS);
 
 	memset(sdev->img_transfer, 0,
 		NUM_BULK_TRANSFERS * sizeof(struct libusb_transfer *));
@@ -1315,6 +1316,15 @@ static int dev_activate(struct fp_img_dev *dev, enum fp_imgdev_state state)
 			4096, img_data_cb, &sdev->img_transfer_data[i], 0);
 	}
 
+	if (dev->standby && sdev->warm) {
+		fp_dbg("resuming from standby");
+		sdev->warm = FALSE;
+		fpi_imgdev_activate_complete(dev, 0);
+		start_loop(dev);
+		return 0;
+	}
+	sdev->warm = FALSE;
+
 	switch (sdev->dev_model) {
 	case UPEKSONLY_2016:
 		ssm = fpi_ssm_new(dev->dev, initsm_2016_run_state, INITSM_2016_NUM_STATES);
@@ -1336,19 +1346,20 @@ static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 	int r;
 	struct sonly_dev *sdev;
 
-	r = libusb_set_configuration(dev->udev, 1);
+	r = fpi_usb_set_configuration(dev->udev, 1);
 	if (r < 0) {
 		fp_err("could not set configuration 1");
 		return r;
 	}
 
-	r = libusb_claim_interface(dev->udev, 0);
+	r = fpi_usb_claim_interface(dev->udev, 0);
 	if (r < 0) {
 		fp_err("could not claim interface 0: %s", libusb_error_name(r));
 		return r;
 	}
 
 	sdev = dev->priv = g_malloc0(sizeof(struct sonly_dev));
+	fpi_dev_mem_account(dev->dev, sizeof(*sdev));
 	sdev->dev_model = (int)driver_data;
 	switch (driver_data) {
 	case UPEKSONLY_1000:
@@ -1368,14 +1379,18 @@ static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 		assembling_ctx.line_width = IMG_WIDTH_2016;
 		break;
 	}
+	fpi_asmbl_buf_init(&sdev->rows, sdev->img_width);
 	fpi_imgdev_open_complete(dev, 0);
 	return 0;
 }
 
 static void dev_deinit(struct fp_img_dev *dev)
 {
-	g_free(dev->priv);
-	libusb_release_interface(dev->udev, 0);
+	struct sonly_dev *sdev = dev->priv;
+
+	fpi_asmbl_buf_free(&sdev->rows);
+	g_free(sdev);
+	fpi_usb_release_interface(dev->udev, 0);
 	fpi_imgdev_close_complete(dev);
 }
 
@@ -1412,7 +1427,7 @@ struct fp_img_driver upeksonly_driver = {
 		.scan_type = FP_SCAN_TYPE_SWIPE,
 		.discover = dev_discover,
 	},
-	.flags = 0,
+	.flags = FP_IMGDRV_SUPPORTS_STANDBY,
 	.img_width = -1,
 	.img_height = -1,
 
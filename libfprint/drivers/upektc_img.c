@@ -49,7 +49,8 @@ static void start_deactivation(struct fp_img_dev *dev);
 struct upektc_img_dev {
 	unsigned char cmd[MAX_CMD_SIZE];
 	unsigned char response[MAX_RESPONSE_SIZE];
-	unsigned char image_bits[IMAGE_SIZE * 2];
+	/* image being received, frames are decoded straight into it */
+	struct fp_img *img;
 	unsigned char seq;
 	size_t image_size;
 	size_t response_rest;
@@ -146,7 +147,7 @@ static void upektc_img_submit_req(struct fpi_ssm *ssm,
 	libusb_fill_bulk_transfer(transfer, dev->udev, EP_OUT, upekdev->cmd, buf_size,
 		cb, ssm, BULK_TIMEOUT);
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		libusb_free_transfer(transfer);
 		fpi_ssm_mark_aborted(ssm, r);
@@ -172,7 +173,7 @@ static void upektc_img_read_data(struct fpi_ssm *ssm, size_t buf_size, size_t bu
 	libusb_fill_bulk_transfer(transfer, dev->udev, EP_IN, upekdev->response + buf_offset, buf_size,
 		cb, ssm, BULK_TIMEOUT);
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		libusb_free_transfer(transfer);
 		fpi_ssm_mark_aborted(ssm, r);
@@ -211,7 +212,8 @@ static void capture_reqs_cb(struct libusb_transfer *transfer)
 	}
 }
 
-static int upektc_img_process_image_frame(unsigned char *image_buf, unsigned char *cmd_res)
+static int upektc_img_process_image_frame(struct upektc_img_dev *upekdev,
+	unsigned char *cmd_res)
 {
 	int offset = 8;
 	int len = ((cmd_res[5] & 0x0f) << 8) | (cmd_res[6]);
@@ -224,9 +226,14 @@ static int upektc_img_process_image_frame(unsigned char *image_buf, unsigned cha
 	if (cmd_res[7] == 0x20) {
 		len -= 4;
 	}
-	memcpy(image_buf, cmd_res + offset, len);
+	if (len < 0 || upekdev->image_size + len > IMAGE_SIZE) {
+		fp_err("frame of %d bytes overflows the image", len);
+		return -EPROTO;
+	}
+	memcpy(upekdev->img->data + upekdev->image_size, cmd_res + offset, len);
+	upekdev->image_size += len;
 
-	return len;
+	return 0;
 }
 
 static void capture_read_data_cb(struct libusb_transfer *transfer)
@@ -237,6 +244,7 @@ static void capture_read_data_cb(struct libusb_transfer *transfer)
 	unsigned char *data = upekdev->response;
 	struct fp_img *img;
 	size_t response_size;
+	int r;
 
 	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
 		fp_dbg("request is not completed, %d", transfer->status);
@@ -320,21 +328,25 @@ static void capture_read_data_cb(struct libusb_transfer *transfer)
 				fpi_imgdev_report_finger_status(dev, TRUE);
 			/* Plain image frame */
 			case 0x24:
-				upekdev->image_size +=
-					upektc_img_process_image_frame(upekdev->image_bits + upekdev->image_size,
-						data);
+				r = upektc_img_process_image_frame(upekdev, data);
+				if (r < 0) {
+					fpi_ssm_mark_aborted(ssm, r);
+					break;
+				}
 				fpi_ssm_jump_to_state(ssm, CAPTURE_ACK_FRAME);
 				break;
 			/* Last image frame */
 			case 0x20:
-				upekdev->image_size +=
-					upektc_img_process_image_frame(upekdev->image_bits + upekdev->image_size,
-						data);
+				r = upektc_img_process_image_frame(upekdev, data);
+				if (r < 0) {
+					fpi_ssm_mark_aborted(ssm, r);
+					break;
+				}
 				BUG_ON(upekdev->image_size != IMAGE_SIZE);
 				fp_dbg("Image size is %d\n", upekdev->image_size);
-				img = fpi_img_new(IMAGE_SIZE);
+				img = upekdev->img;
+				upekdev->img = NULL;
 				img->flags = FP_IMG_PARTIAL;
-				memcpy(img->data, upekdev->image_bits, IMAGE_SIZE);
 				fpi_imgdev_image_captured(dev, img);
 				fpi_imgdev_report_finger_status(dev, FALSE);
 				fpi_ssm_mark_completed(ssm);
@@ -413,6 +425,9 @@ static void start_capture(struct fp_img_dev *dev)
 	struct upektc_img_dev *upekdev = dev->priv;
 	struct fpi_ssm *ssm;
 
+	/* Kept over captures which didn't complete an image */
+	if (!upekdev->img)
+		upekdev->img = fpi_img_new_for_imgdev(dev);
 	upekdev->image_size = 0;
 
 	ssm = fpi_ssm_new(dev->dev, capture_run_state, CAPTURE_NUM_STATES);
@@ -492,6 +507,8 @@ static void start_deactivation(struct fp_img_dev *dev)
 	struct upektc_img_dev *upekdev = dev->priv;
 	struct fpi_ssm *ssm;
 
+	fp_img_free(upekdev->img);
+	upekdev->img = NULL;
 	upekdev->image_size = 0;
 
 	ssm = fpi_ssm_new(dev->dev, deactivate_run_state, DEACTIVATE_NUM_STATES);
@@ -576,7 +593,7 @@ static void activate_run_state(struct fpi_ssm *ssm)
 			LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE, 0x0c, 0x100, 0x0400, 1);
 		libusb_fill_control_transfer(transfer, ssm->dev->udev, data,
 			init_reqs_ctrl_cb, ssm, CTRL_TIMEOUT);
-		r = libusb_submit_transfer(transfer);
+		r = fpi_usb_submit_transfer(transfer);
 		if (r < 0) {
 			g_free(data);
 			libusb_free_transfer(transfer);
@@ -649,21 +666,25 @@ static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 	/* TODO check that device has endpoints we're using */
 	int r;
 
-	r = libusb_claim_interface(dev->udev, 0);
+	r = fpi_usb_claim_interface(dev->udev, 0);
 	if (r < 0) {
 		fp_err("could not claim interface 0: %s", libusb_error_name(r));
 		return r;
 	}
 
 	dev->priv = g_malloc0(sizeof(struct upektc_img_dev));
+	fpi_dev_mem_account(dev->dev, sizeof(struct upektc_img_dev));
 	fpi_imgdev_open_complete(dev, 0);
 	return 0;
 }
 
 static void dev_deinit(struct fp_img_dev *dev)
 {
+	struct upektc_img_dev *upekdev = dev->priv;
+
+	fp_img_free(upekdev->img);
 	g_free(dev->priv);
-	libusb_release_interface(dev->udev, 0);
+	fpi_usb_release_interface(dev->udev, 0);
 	fpi_imgdev_close_complete(dev);
 }
 
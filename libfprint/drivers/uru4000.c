@@ -47,6 +47,10 @@
 
 #define ENC_THRESHOLD		5000
 
+/* The image header and the first lines are read on their own, so that the
+ * frame can be checked while its remaining lines come in. */
+#define IMAGE_HEAD_SIZE		1024
+
 enum {
 	IRQDATA_SCANPWR_ON = 0x56aa,
 	IRQDATA_FINGER_ON = 0x0101,
@@ -129,9 +133,18 @@ struct uru4k_dev {
 
 	struct libusb_transfer *irq_transfer;
 	struct libusb_transfer *img_transfer;
+	struct libusb_transfer *img_rest_transfer;
 	void *img_data;
 	uint16_t img_lines_done, img_block;
 	uint32_t img_enc_seed;
+	gboolean img_rest_flying;
+	gboolean img_plain;
+	/* the remaining lines of a bad frame are read only to be dropped */
+	gboolean img_discard;
+	/* the ssm is waiting for the remaining lines */
+	struct fpi_ssm *img_rest_ssm;
+	/* the imaging loop ended before the remaining lines came in */
+	gboolean img_done;
 
 	irq_cb_fn irq_cb;
 	void *irq_cb_data;
@@ -211,7 +224,7 @@ static int write_regs(struct fp_img_dev *dev, uint16_t first_reg,
 	libusb_fill_control_transfer(transfer, dev->udev, data, write_regs_cb,
 		wrdata, CTRL_TIMEOUT);
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(wrdata);
 		g_free(data);
@@ -277,7 +290,7 @@ static int read_regs(struct fp_img_dev *dev, uint16_t first_reg,
 	libusb_fill_control_transfer(transfer, dev->udev, data, read_regs_cb,
 		rrdata, CTRL_TIMEOUT);
 
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(rrdata);
 		g_free(data);
@@ -446,7 +459,7 @@ static int start_irq_handler(struct fp_img_dev *dev)
 		irq_handler, dev, 0);
 
 	urudev->irq_transfer = transfer;
-	r = libusb_submit_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
 	if (r < 0) {
 		g_free(data);
 		libusb_free_transfer(transfer);
@@ -460,7 +473,7 @@ static void stop_irq_handler(struct fp_img_dev *dev, irqs_stopped_cb_fn cb)
 	struct uru4k_dev *urudev = dev->priv;
 	struct libusb_transfer *transfer = urudev->irq_transfer;
 	if (transfer) {
-		libusb_cancel_transfer(transfer);
+		fpi_usb_cancel_transfer(transfer);
 		urudev->irqs_stopped_cb = cb;
 	}
 }
@@ -585,8 +598,10 @@ static void sm_set_hwstat(struct fpi_ssm *ssm, unsigned char value)
 
 enum imaging_states {
 	IMAGING_CAPTURE,
+	IMAGING_READ_REST,
 	IMAGING_SEND_INDEX,
 	IMAGING_READ_KEY,
+	IMAGING_WAIT_REST,
 	IMAGING_DECODE,
 	IMAGING_REPORT_IMAGE,
 	IMAGING_NUM_STATES
@@ -607,6 +622,26 @@ static void image_transfer_cb(struct libusb_transfer *transfer)
 	}
 }
 
+static void imaging_finish(struct fp_img_dev *dev);
+
+static void image_rest_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct fp_img_dev *dev = transfer->user_data;
+	struct uru4k_dev *urudev = dev->priv;
+	struct fpi_ssm *ssm = urudev->img_rest_ssm;
+
+	urudev->img_rest_flying = FALSE;
+	if (urudev->img_done) {
+		imaging_finish(dev);
+		return;
+	}
+
+	if (ssm) {
+		urudev->img_rest_ssm = NULL;
+		fpi_ssm_jump_to_state(ssm, IMAGING_WAIT_REST);
+	}
+}
+
 enum {
 	BLOCKF_CHANGE_KEY	= 0x80,
 	BLOCKF_NO_KEY_UPDATE	= 0x04,
@@ -640,25 +675,107 @@ static uint32_t update_key(uint32_t key)
 	return (bit & 0x80000000) | (key >> 1);
 }
 
-static uint32_t do_decode(uint8_t *data, int num_bytes, uint32_t key)
+static uint8_t key_xorbyte(uint32_t key)
 {
 	uint8_t xorbyte;
-	int i;
 
-	for (i = 0; i < num_bytes - 1; i++) {
-		/* calculate xor byte and update key */
-		xorbyte  = ((key >>  4) & 1) << 0;
-		xorbyte |= ((key >>  8) & 1) << 1;
-		xorbyte |= ((key >> 11) & 1) << 2;
-		xorbyte |= ((key >> 14) & 1) << 3;
-		xorbyte |= ((key >> 18) & 1) << 4;
-		xorbyte |= ((key >> 21) & 1) << 5;
-		xorbyte |= ((key >> 24) & 1) << 6;
-		xorbyte |= ((key >> 29) & 1) << 7;
+	xorbyte  = ((key >>  4) & 1) << 0;
+	xorbyte |= ((key >>  8) & 1) << 1;
+	xorbyte |= ((key >> 11) & 1) << 2;
+	xorbyte |= ((key >> 14) & 1) << 3;
+	xorbyte |= ((key >> 18) & 1) << 4;
+	xorbyte |= ((key >> 21) & 1) << 5;
+	xorbyte |= ((key >> 24) & 1) << 6;
+	xorbyte |= ((key >> 29) & 1) << 7;
+	return xorbyte;
+}
+
+/* Both the LFSR and the xor byte are linear in the key bits, so the effect
+ * of several steps on a key is the xor of the effects on each of its bytes.
+ * These tables hold, for each key byte and value, the key after 8 and 32
+ * steps and the 8 xor bytes produced on the way (in memory order, ready to
+ * be xored with the data). */
+static struct {
+	uint32_t advance8[4][256];
+	uint32_t advance32[4][256];
+	uint64_t xor8[4][256];
+} key_tables;
+
+static void init_key_tables(void)
+{
+	static gsize initialized = 0;
+	uint32_t adv8[32], adv32[32];
+	uint64_t xor8[32];
+	int i, j, v;
+
+	if (!g_once_init_enter(&initialized))
+		return;
+
+	for (i = 0; i < 32; i++) {
+		uint32_t key = 1U << i;
+		xor8[i] = 0;
+		for (j = 0; j < 32; j++) {
+			if (j < 8)
+				xor8[i] |= (uint64_t) key_xorbyte(key) << (j * 8);
+			key = update_key(key);
+			if (j == 7)
+				adv8[i] = key;
+		}
+		adv32[i] = key;
+	}
+
+	for (i = 0; i < 4; i++) {
+		for (v = 0; v < 256; v++) {
+			uint32_t a8 = 0, a32 = 0;
+			uint64_t x8 = 0;
+			for (j = 0; j < 8; j++) {
+				if (!(v & (1 << j)))
+					continue;
+				a8 ^= adv8[i * 8 + j];
+				a32 ^= adv32[i * 8 + j];
+				x8 ^= xor8[i * 8 + j];
+			}
+			key_tables.advance8[i][v] = a8;
+			key_tables.advance32[i][v] = a32;
+			key_tables.xor8[i][v] = GUINT64_TO_LE(x8);
+		}
+	}
+
+	g_once_init_leave(&initialized, 1);
+}
+
+#define KEY_LOOKUP(table, key) \
+	((table)[0][(key) & 0xff] ^ (table)[1][((key) >> 8) & 0xff] ^ \
+	 (table)[2][((key) >> 16) & 0xff] ^ (table)[3][(key) >> 24])
+
+static uint32_t skip_key(uint32_t key, int num_steps)
+{
+	for (; num_steps >= 32; num_steps -= 32)
+		key = KEY_LOOKUP(key_tables.advance32, key);
+	for (; num_steps >= 8; num_steps -= 8)
+		key = KEY_LOOKUP(key_tables.advance8, key);
+	for (; num_steps > 0; num_steps--)
 		key = update_key(key);
+	return key;
+}
+
+static uint32_t do_decode(uint8_t *data, int num_bytes, uint32_t key)
+{
+	uint64_t word;
+	int i;
+
+	/* 8 bytes at a time: each one is read before it gets overwritten */
+	for (i = 0; i + 8 < num_bytes; i += 8) {
+		memcpy(&word, &data[i+1], sizeof(word));
+		word ^= KEY_LOOKUP(key_tables.xor8, key);
+		memcpy(&data[i], &word, sizeof(word));
+		key = KEY_LOOKUP(key_tables.advance8, key);
+	}
 
-		/* decrypt data */
-		data[i] = data[i+1] ^ xorbyte;
+	for (; i < num_bytes - 1; i++) {
+		/* decrypt data and update key */
+		data[i] = data[i+1] ^ key_xorbyte(key);
+		key = update_key(key);
 	}
 
 	/* the final byte is implictly zero */
@@ -694,6 +811,22 @@ static int calc_dev2(struct uru4k_image *img)
 	return res / IMAGE_WIDTH;
 }
 
+/* Reads the lines following a full image head, in the background */
+static int submit_img_rest(struct fp_img_dev *dev)
+{
+	struct uru4k_dev *urudev = dev->priv;
+	int r;
+
+	libusb_fill_bulk_transfer(urudev->img_rest_transfer, dev->udev, EP_DATA,
+		(unsigned char *) urudev->img_data + IMAGE_HEAD_SIZE,
+		sizeof(struct uru4k_image) - IMAGE_HEAD_SIZE,
+		image_rest_transfer_cb, dev, 0);
+	r = fpi_usb_submit_transfer(urudev->img_rest_transfer);
+	if (r == 0)
+		urudev->img_rest_flying = TRUE;
+	return r;
+}
+
 static void imaging_run_state(struct fpi_ssm *ssm)
 {
 	struct fp_img_dev *dev = ssm->priv;
@@ -702,40 +835,64 @@ static void imaging_run_state(struct fpi_ssm *ssm)
 	struct fp_img *fpimg;
 	uint32_t key;
 	uint8_t flags, num_lines;
-	int i, r, to, dev2;
+	int i, r, to, dev2, transferred;
 	char buf[5];
 
 	switch (ssm->cur_state) {
 	case IMAGING_CAPTURE:
 		urudev->img_lines_done = 0;
 		urudev->img_block = 0;
+		urudev->img_plain = FALSE;
 		libusb_fill_bulk_transfer(urudev->img_transfer, dev->udev, EP_DATA,
-			urudev->img_data, sizeof(struct uru4k_image), image_transfer_cb, ssm, 0);
-		r = libusb_submit_transfer(urudev->img_transfer);
+			urudev->img_data, IMAGE_HEAD_SIZE, image_transfer_cb, ssm, 0);
+		r = fpi_usb_submit_transfer(urudev->img_transfer);
 		if (r < 0)
 			fpi_ssm_mark_aborted(ssm, -EIO);
 		break;
-	case IMAGING_SEND_INDEX:
+	case IMAGING_READ_REST:
 		fp_dbg("hw header lines %d", img->num_lines);
 
 		if (img->num_lines >= IMAGE_HEIGHT ||
-		    urudev->img_transfer->actual_length < img->num_lines * IMAGE_WIDTH + 64) {
-			fp_err("bad captured image (%d lines) or size mismatch %d < %d",
-				img->num_lines,
-				urudev->img_transfer->actual_length,
-				img->num_lines * IMAGE_WIDTH + 64);
+		    urudev->img_transfer->actual_length < 64) {
+			fp_err("bad captured image (%d lines) or header size %d",
+				img->num_lines, urudev->img_transfer->actual_length);
+			/* the next capture would take the remaining lines of
+			 * this frame for a head, so they are read first */
+			if (urudev->img_transfer->actual_length == IMAGE_HEAD_SIZE) {
+				if (submit_img_rest(dev) < 0) {
+					fpi_ssm_mark_aborted(ssm, -EIO);
+					return;
+				}
+				urudev->img_discard = TRUE;
+				fpi_ssm_jump_to_state(ssm, IMAGING_WAIT_REST);
+				return;
+			}
 			fpi_ssm_jump_to_state(ssm, IMAGING_CAPTURE);
 			return;
 		}
+
+		/* a short head is the whole frame */
+		urudev->img_rest_transfer->actual_length = 0;
+		if (urudev->img_transfer->actual_length == IMAGE_HEAD_SIZE &&
+		    submit_img_rest(dev) < 0) {
+			fpi_ssm_mark_aborted(ssm, -EIO);
+			return;
+		}
+
+		/* the first two lines are already there */
 		if (!urudev->profile->encryption) {
 			dev2 = calc_dev2(img);
 			fp_dbg("dev2: %d", dev2);
 			if (dev2 < ENC_THRESHOLD) {
-				fpi_ssm_jump_to_state(ssm, IMAGING_REPORT_IMAGE);
+				urudev->img_plain = TRUE;
+				fpi_ssm_jump_to_state(ssm, IMAGING_WAIT_REST);
 				return;
 			}
 			fp_info("image seems to be encrypted");
 		}
+		fpi_ssm_next_state(ssm);
+		break;
+	case IMAGING_SEND_INDEX:
 		buf[0] = img->key_number;
 		buf[1] = urudev->img_enc_seed;
 		buf[2] = urudev->img_enc_seed >> 8;
@@ -746,6 +903,44 @@ static void imaging_run_state(struct fpi_ssm *ssm)
 	case IMAGING_READ_KEY:
 		sm_read_regs(ssm, REG_SCRAMBLE_DATA_KEY, 4);
 		break;
+	case IMAGING_WAIT_REST:
+		if (urudev->img_rest_flying) {
+			urudev->img_rest_ssm = ssm;
+			return;
+		}
+
+		if (urudev->img_discard) {
+			urudev->img_discard = FALSE;
+			if (urudev->img_rest_transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+				fp_dbg("error");
+				fpi_ssm_mark_aborted(ssm, -EIO);
+				return;
+			}
+			fpi_ssm_jump_to_state(ssm, IMAGING_CAPTURE);
+			return;
+		}
+
+		transferred = urudev->img_transfer->actual_length;
+		if (transferred == IMAGE_HEAD_SIZE) {
+			if (urudev->img_rest_transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+				fp_dbg("error");
+				fpi_ssm_mark_aborted(ssm, -EIO);
+				return;
+			}
+			transferred += urudev->img_rest_transfer->actual_length;
+		}
+		if (transferred < img->num_lines * IMAGE_WIDTH + 64) {
+			fp_err("size mismatch %d < %d", transferred,
+				img->num_lines * IMAGE_WIDTH + 64);
+			fpi_ssm_jump_to_state(ssm, IMAGING_CAPTURE);
+			return;
+		}
+
+		if (urudev->img_plain)
+			fpi_ssm_jump_to_state(ssm, IMAGING_REPORT_IMAGE);
+		else
+			fpi_ssm_next_state(ssm);
+		break;
 	case IMAGING_DECODE:
 		key  = urudev->last_reg_rd[0];
 		key |= urudev->last_reg_rd[1] << 8;
@@ -778,8 +973,7 @@ static void imaging_run_state(struct fpi_ssm *ssm)
 				break;
 			case 0:
 				fp_dbg("skipping %d lines", num_lines);
-				for (r = 0; r < IMAGE_WIDTH*num_lines; r++)
-					key = update_key(key);
+				key = skip_key(key, IMAGE_WIDTH*num_lines);
 				break;
 			}
 			if ((flags & BLOCKF_NOT_PRESENT) == 0)
@@ -830,11 +1024,31 @@ static void imaging_complete(struct fpi_ssm *ssm)
 	if (r)
 		fpi_imgdev_session_error(dev, r);
 
+	/* the remaining lines are read into img_data */
+	if (urudev->img_rest_flying) {
+		urudev->img_done = TRUE;
+		urudev->img_rest_ssm = NULL;
+		fpi_usb_cancel_transfer(urudev->img_rest_transfer);
+		return;
+	}
+
+	imaging_finish(dev);
+}
+
+static void imaging_finish(struct fp_img_dev *dev)
+{
+	struct uru4k_dev *urudev = dev->priv;
+	int r;
+
+	urudev->img_done = FALSE;
+	urudev->img_discard = FALSE;
 	g_free(urudev->img_data);
 	urudev->img_data = NULL;
 
 	libusb_free_transfer(urudev->img_transfer);
 	urudev->img_transfer = NULL;
+	libusb_free_transfer(urudev->img_rest_transfer);
+	urudev->img_rest_transfer = NULL;
 
 	r = execute_state_change(dev);
 	if (r)
@@ -902,7 +1116,7 @@ static void rebootpwr_run_state(struct fpi_ssm *ssm)
 			fpi_ssm_next_state(ssm);
 		break;
 	case REBOOTPWR_PAUSE:
-		if (fpi_timeout_add(10, rebootpwr_pause_cb, ssm) == NULL)
+		if (fpi_timeout_add(ssm->dev, 10, rebootpwr_pause_cb, ssm) == NULL)
 			fpi_ssm_mark_aborted(ssm, -ETIME);
 		break;
 	}
@@ -985,7 +1199,7 @@ static void powerup_run_state(struct fpi_ssm *ssm)
 			fpi_ssm_next_state(ssm);
 		break;
 	case POWERUP_PAUSE:
-		if (fpi_timeout_add(10, powerup_pause_cb, ssm) == NULL)
+		if (fpi_timeout_add(ssm->dev, 10, powerup_pause_cb, ssm) == NULL)
 			fpi_ssm_mark_aborted(ssm, -ETIME);
 		break;
 	case POWERUP_CHALLENGE_RESPONSE:
@@ -1115,7 +1329,7 @@ static void init_run_state(struct fpi_ssm *ssm)
 		/* sometimes the 56aa interrupt that we are waiting for never arrives,
 		 * so we include this timeout loop to retry the whole process 3 times
 		 * if we don't get an irq any time soon. */
-		urudev->scanpwr_irq_timeout = fpi_timeout_add(300,
+		urudev->scanpwr_irq_timeout = fpi_timeout_add(ssm->dev, 300,
 			init_scanpwr_timeout, ssm);
 		if (!urudev->scanpwr_irq_timeout) {
 			fpi_ssm_mark_aborted(ssm, -ETIME);
@@ -1227,6 +1441,7 @@ static int execute_state_change(struct fp_img_dev *dev)
 		urudev->irq_cb = NULL;
 
 		urudev->img_transfer = libusb_alloc_transfer(0);
+		urudev->img_rest_transfer = libusb_alloc_transfer(0);
 		urudev->img_data = g_malloc(sizeof(struct uru4k_image));
 		urudev->img_enc_seed = rand();
 
@@ -1263,6 +1478,8 @@ static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 	int i;
 	int r;
 
+	init_key_tables();
+
 	/* Find fingerprint interface */
 	r = libusb_get_config_descriptor(libusb_get_device(dev->udev), 0, &config);
 	if (r < 0) {
@@ -1318,7 +1535,7 @@ static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 
 	/* Device looks like a supported reader */
 
-	r = libusb_claim_interface(dev->udev, iface_desc->bInterfaceNumber);
+	r = fpi_usb_claim_interface(dev->udev, iface_desc->bInterfaceNumber);
 	if (r < 0) {
 		fp_err("interface claim failed: %s", libusb_error_name(r));
 		goto out;
@@ -1359,6 +1576,7 @@ static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 	urudev->param = PK11_ParamFromIV(urudev->cipher, NULL);
 
 	dev->priv = urudev;
+	fpi_dev_mem_account(dev->dev, sizeof(*urudev));
 	fpi_imgdev_open_complete(dev, 0);
 
 out:
@@ -1375,7 +1593,7 @@ static void dev_deinit(struct fp_img_dev *dev)
 		SECITEM_FreeItem(urudev->param, PR_TRUE);
 	if (urudev->slot)
 		PK11_FreeSlot(urudev->slot);
-	libusb_release_interface(dev->udev, urudev->interface);
+	fpi_usb_release_interface(dev->udev, urudev->interface);
 	g_free(urudev);
 	fpi_imgdev_close_complete(dev);
 }
@@ -66,7 +66,7 @@ static void async_write(struct fpi_ssm *ssm, void *data, int len)
 	vdev->transfer->flags |= LIBUSB_TRANSFER_FREE_TRANSFER;
 	libusb_fill_bulk_transfer(vdev->transfer, udev, 0x01, data, len,
 				  async_write_callback, ssm, VFS_USB_TIMEOUT);
-	libusb_submit_transfer(vdev->transfer);
+	fpi_usb_submit_transfer(vdev->transfer);
 }
 
 /* Callback for async_read */
@@ -118,7 +118,7 @@ static void async_read(struct fpi_ssm *ssm, int ep, void *data, int len)
 		libusb_fill_bulk_transfer(vdev->transfer, udev, ep, data, len,
 					  async_read_callback, ssm,
 					  VFS_USB_TIMEOUT);
-	libusb_submit_transfer(vdev->transfer);
+	fpi_usb_submit_transfer(vdev->transfer);
 }
 
 /* Callback for async_read */
@@ -176,18 +176,26 @@ static void async_abort(struct fpi_ssm *ssm, int ep)
 		libusb_fill_bulk_transfer(vdev->transfer, udev, ep, data, len,
 					  async_abort_callback, ssm,
 					  VFS_USB_ABORT_TIMEOUT);
-	libusb_submit_transfer(vdev->transfer);
+	fpi_usb_submit_transfer(vdev->transfer);
 }
 
 /* Image processing functions */
 
+static inline unsigned char vfs0050_pixel(GSList * line, unsigned int x)
+{
+	return ((struct vfs_line *)line->data)->data[x];
+}
+
 /* Pixel getter for fpi_assemble_lines */
 static unsigned char vfs0050_get_pixel(struct fpi_line_asmbl_ctx *ctx,
 				       GSList * line, unsigned int x)
 {
-	return ((struct vfs_line *)line->data)->data[x];
+	return vfs0050_pixel(line, x);
 }
 
+/* Whole line getter for fpi_assemble_lines */
+FPI_LINE_UNPACKER(vfs0050_unpack_line, VFS_IMAGE_WIDTH, vfs0050_pixel)
+
 /* Deviation getter for fpi_assemble_lines */
 static int vfs0050_get_difference(struct fpi_line_asmbl_ctx *ctx,
 				  GSList * line_list_1, GSList * line_list_2)
@@ -195,13 +203,9 @@ static int vfs0050_get_difference(struct fpi_line_asmbl_ctx *ctx,
 	struct vfs_line *line1 = line_list_1->data;
 	struct vfs_line *line2 = line_list_2->data;
 	const int shift = (VFS_IMAGE_WIDTH - VFS_NEXT_LINE_WIDTH) / 2 - 1;
-	int res = 0;
-	for (int i = 0; i < VFS_NEXT_LINE_WIDTH; ++i) {
-		int x =
-		    (int)line1->next_line_part[i] - (int)line2->data[shift + i];
-		res += x * x;
-	}
-	return res;
+
+	return fpi_ssd(line1->next_line_part, line2->data + shift,
+		       VFS_NEXT_LINE_WIDTH);
 }
 
 #define VFS_NOISE_THRESHOLD 40
@@ -225,8 +229,10 @@ static struct fpi_line_asmbl_ctx assembling_ctx = {
 	.resolution = 10,
 	.median_filter_size = 25,
 	.max_search_offset = 100,
+	.line_search = FPI_LINE_SEARCH_PARALLEL,
 	.get_deviation = vfs0050_get_difference,
 	.get_pixel = vfs0050_get_pixel,
+	.unpack_line = vfs0050_unpack_line,
 };
 
 /* Processes image before submitting */
@@ -272,10 +278,12 @@ static void submit_image(struct fp_img_dev *idev)
 
 	struct fp_img *img = prepare_image(vdev);
 
-	if (!img)
+	if (!img) {
 		fpi_imgdev_abort_scan(idev, FP_VERIFY_RETRY_TOO_SHORT);
-	else
+	} else {
+		fpi_imgdev_report_assembled(idev, img->height);
 		fpi_imgdev_image_captured(idev, img);
+	}
 
 	/* Finger not on the scanner */
 	fpi_imgdev_report_finger_status(idev, 0);
@@ -401,8 +409,11 @@ static void send_control_packet(struct fpi_ssm *ssm)
 }
 
 /* Clears all fprint data */
-static void clear_data(struct vfs_dev_t *vdev)
+static void clear_data(struct fp_img_dev *idev)
 {
+	struct vfs_dev_t *vdev = idev->priv;
+
+	fpi_dev_mem_account(idev->dev, -(gssize) vdev->memory);
 	g_free(vdev->lines_buffer);
 	vdev->lines_buffer = NULL;
 	vdev->memory = vdev->bytes = 0;
@@ -531,6 +542,12 @@ static void activate_ssm(struct fpi_ssm *ssm)
 
 	switch (ssm->cur_state) {
 	case SSM_INITIAL_ABORT_1:
+		/* Device is already turned off, see SSM_TURN_ON */
+		if (vdev->warm) {
+			vdev->warm = 0;
+			fpi_ssm_jump_to_state(ssm, SSM_TURN_ON);
+			break;
+		}
 		async_abort(ssm, 1);
 		break;
 
@@ -556,6 +573,7 @@ static void activate_ssm(struct fpi_ssm *ssm)
 	case SSM_TURN_ON:
 		if (!vdev->active) {
 			/* The only correct exit */
+			vdev->warm = 1;
 			fpi_ssm_mark_completed(ssm);
 
 			if (vdev->need_report) {
@@ -586,13 +604,13 @@ static void activate_ssm(struct fpi_ssm *ssm)
 					       vdev->interrupt,
 					       VFS_INTERRUPT_SIZE,
 					       interrupt_callback, ssm, 0);
-		libusb_submit_transfer(vdev->transfer);
+		fpi_usb_submit_transfer(vdev->transfer);
 
 		/* This flag could be turned off only in callback function */
 		vdev->wait_interrupt = 1;
 
 		/* I've put it here to be sure that data is cleared */
-		clear_data(vdev);
+		clear_data(idev);
 
 		fpi_ssm_next_state(ssm);
 		break;
@@ -600,13 +618,13 @@ static void activate_ssm(struct fpi_ssm *ssm)
 	case SSM_WAIT_INTERRUPT:
 		/* Check if user had interrupted the process */
 		if (!vdev->active) {
-			libusb_cancel_transfer(vdev->transfer);
+			fpi_usb_cancel_transfer(vdev->transfer);
 			fpi_ssm_jump_to_state(ssm, SSM_CLEAR_EP2);
 			break;
 		}
 
 		if (vdev->wait_interrupt)
-			fpi_timeout_add(VFS_SSM_TIMEOUT, wait_interrupt, ssm);
+			fpi_timeout_add(ssm->dev, VFS_SSM_TIMEOUT, wait_interrupt, ssm);
 		break;
 
 	case SSM_RECEIVE_FINGER:
@@ -615,6 +633,7 @@ static void activate_ssm(struct fpi_ssm *ssm)
 			g_free(vdev->lines_buffer);
 			vdev->memory = VFS_USB_BUFFER_SIZE;
 			vdev->lines_buffer = g_malloc(vdev->memory);
+			fpi_dev_mem_account(idev->dev, vdev->memory);
 			vdev->bytes = 0;
 
 			/* Finger is on the scanner */
@@ -627,6 +646,7 @@ static void activate_ssm(struct fpi_ssm *ssm)
 			vdev->lines_buffer =
 			    (struct vfs_line *)g_realloc(vdev->lines_buffer,
 							 vdev->memory);
+			fpi_dev_mem_account(idev->dev, vdev->memory / 2);
 		}
 
 		/* Receive chunk of data */
@@ -637,15 +657,15 @@ static void activate_ssm(struct fpi_ssm *ssm)
 					  vdev->bytes, VFS_USB_BUFFER_SIZE,
 					  receive_callback, ssm,
 					  VFS_USB_TIMEOUT);
-		libusb_submit_transfer(vdev->transfer);
+		fpi_usb_submit_transfer(vdev->transfer);
 		break;
 
 	case SSM_SUBMIT_IMAGE:
 		submit_image(idev);
-		clear_data(vdev);
+		clear_data(idev);
 
 		/* Wait for probable vdev->active changing */
-		fpi_timeout_add(VFS_SSM_TIMEOUT, scan_completed, ssm);
+		fpi_timeout_add(ssm->dev, VFS_SSM_TIMEOUT, scan_completed, ssm);
 		break;
 
 	case SSM_NEXT_RECEIVE:
@@ -663,7 +683,7 @@ static void activate_ssm(struct fpi_ssm *ssm)
 
 	case SSM_WAIT_ANOTHER_SCAN:
 		/* Orange light is on now */
-		fpi_timeout_add(VFS_SSM_ORANGE_TIMEOUT, another_scan, ssm);
+		fpi_timeout_add(ssm->dev, VFS_SSM_ORANGE_TIMEOUT, another_scan, ssm);
 		break;
 
 	default:
@@ -696,6 +716,10 @@ static int dev_activate(struct fp_img_dev *idev, enum fp_imgdev_state state)
 	vdev->need_report = 1;
 	vdev->ssm_active = 1;
 
+	/* Initial aborts and turning off could be skipped while in standby */
+	if (!idev->standby)
+		vdev->warm = 0;
+
 	struct fpi_ssm *ssm = fpi_ssm_new(idev->dev, activate_ssm, SSM_STATES);
 	ssm->priv = idev;
 	fpi_ssm_start(ssm, dev_activate_callback);
@@ -729,7 +753,7 @@ static void dev_open_callback(struct fpi_ssm *ssm)
 static int dev_open(struct fp_img_dev *idev, unsigned long driver_data)
 {
 	/* Claim usb interface */
-	int error = libusb_claim_interface(idev->udev, 0);
+	int error = fpi_usb_claim_interface(idev->udev, 0);
 	if (error < 0) {
 		/* Interface not claimed, return error */
 		fp_err("could not claim interface 0");
@@ -739,6 +763,7 @@ static int dev_open(struct fp_img_dev *idev, unsigned long driver_data)
 	/* Initialize private structure */
 	struct vfs_dev_t *vdev = g_malloc0(sizeof(struct vfs_dev_t));
 	idev->priv = vdev;
+	fpi_dev_mem_account(idev->dev, sizeof(*vdev));
 
 	/* Clearing previous device state */
 	struct fpi_ssm *ssm = fpi_ssm_new(idev->dev, activate_ssm, SSM_STATES);
@@ -754,7 +779,7 @@ static void dev_close(struct fp_img_dev *idev)
 	g_free(idev->priv);
 
 	/* Release usb interface */
-	libusb_release_interface(idev->udev, 0);
+	fpi_usb_release_interface(idev->udev, 0);
 
 	/* Notify close complete */
 	fpi_imgdev_close_complete(idev);
@@ -778,7 +803,7 @@ struct fp_img_driver vfs0050_driver = {
 		   },
 
 	/* Image specification */
-	.flags = 0,
+	.flags = FP_IMGDRV_SUPPORTS_STANDBY,
 	.img_width = VFS_IMAGE_WIDTH,
 	.img_height = -1,
 	.bz3_threshold = 24,
@@ -93,6 +93,9 @@ struct vfs_dev_t {
 	/* Should we wait more for interrupt */
 	char wait_interrupt;
 
+	/* One if the last run of the ssm turned the device off cleanly */
+	char warm;
+
 	/* Received fingerprint raw lines */
 	struct vfs_line *lines_buffer;
 
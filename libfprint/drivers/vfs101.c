@@ -24,6 +24,7 @@
 #define FP_COMPONENT "vfs101"
 
 #include <fp_internal.h>
+#include <assembling.h>
 
 #include "driver_ids.h"
 
@@ -38,12 +39,9 @@
 #define VFS_FRAME_SIZE		292
 #define VFS_BLOCK_SIZE		16 * VFS_FRAME_SIZE
 
-/* Buffer height */
+/* Maximum number of frames of a raw image */
 #define VFS_BUFFER_HEIGHT	5000
 
-/* Buffer size */
-#define VFS_BUFFER_SIZE		(VFS_BUFFER_HEIGHT * VFS_FRAME_SIZE)
-
 /* Image width */
 #define VFS_IMG_WIDTH		200
 
@@ -102,8 +100,20 @@ struct vfs101_dev
 	/* Usb transfer */
 	struct libusb_transfer *transfer;
 
-	/* Buffer for input/output */
-	unsigned char buffer[VFS_BUFFER_SIZE];
+	/* Buffer for commands and replies */
+	unsigned char buffer[VFS_FRAME_SIZE];
+
+	/* Block of frames being loaded */
+	unsigned char block[VFS_BLOCK_SIZE];
+
+	/* Image part of the loaded frames, noise already removed */
+	struct fpi_asmbl_buf lines;
+
+	/* Scan level of the loaded frames */
+	unsigned short levels[VFS_BUFFER_HEIGHT];
+
+	/* Sum of the contrast information of the loaded frames */
+	long int contrast_sum;
 
 	/* Length of data to send or received */
 	unsigned int length;
@@ -114,6 +124,9 @@ struct vfs101_dev
 	/* Timeout */
 	struct fpi_timeout *timeout;
 
+	/* State machine waiting for the next finger poll */
+	struct fpi_ssm *poll_ssm;
+
 	/* Loop counter */
 	int counter;
 
@@ -274,7 +287,7 @@ static void async_send(struct fpi_ssm *ssm)
 	libusb_fill_bulk_transfer(vdev->transfer, dev->udev, EP_OUT(1), vdev->buffer, vdev->length, async_send_cb, ssm, BULK_TIMEOUT);
 
 	/* Submit transfer */
-	r = libusb_submit_transfer(vdev->transfer);
+	r = fpi_usb_submit_transfer(vdev->transfer);
 	if (r != 0)
 	{
 		/* Submission of transfer failed, return IO error */
@@ -356,7 +369,7 @@ static void async_recv(struct fpi_ssm *ssm)
 	libusb_fill_bulk_transfer(vdev->transfer, dev->udev, EP_IN(1), vdev->buffer, 0x0f, async_recv_cb, ssm, BULK_TIMEOUT);
 
 	/* Submit transfer */
-	r = libusb_submit_transfer(vdev->transfer);
+	r = fpi_usb_submit_transfer(vdev->transfer);
 	if (r != 0)
 	{
 		/* Submission of transfer failed, free transfer and return IO error */
@@ -370,6 +383,36 @@ static void async_recv(struct fpi_ssm *ssm)
 
 static void async_load(struct fpi_ssm *ssm);
 
+#define offset(x, y)	((x) + ((y) * VFS_FRAME_SIZE))
+
+/* Keep what is needed of frames as they are loaded */
+static void parse_frames(struct vfs101_dev *vdev, unsigned char *data,
+	unsigned int count)
+{
+	unsigned int y;
+	int x;
+
+	for (y = 0; y < count; y++)
+	{
+		unsigned char *line;
+
+		/* Take image scan level */
+		vdev->levels[vdev->lines.len] = data[offset(283, y)] * 256 +
+			data[offset(282, y)];
+
+		/* Difference from byte 4 to byte 5 gives the contrast */
+		vdev->contrast_sum += data[offset(5, y)] - data[offset(4, y)];
+
+		/* Keep the image and remove noise */
+		line = fpi_asmbl_buf_add(&vdev->lines);
+		for (x = 0; x < VFS_IMG_WIDTH; x++)
+		{
+			unsigned char px = data[offset(x + 6, y)];
+			line[x] = px > VFS_IMG_MIN_IMAGE_LEVEL ? 255 : px;
+		}
+	}
+}
+
 /* Callback of asynchronous load */
 static void async_load_cb(struct libusb_transfer *transfer)
 {
@@ -404,10 +447,12 @@ static void async_load_cb(struct libusb_transfer *transfer)
 
 	/* Increase image length */
 	vdev->length += transfer->actual_length;
+	parse_frames(vdev, transfer->buffer,
+		transfer->actual_length / VFS_FRAME_SIZE);
 
 	if (transfer->actual_length == VFS_BLOCK_SIZE)
 	{
-		if ((VFS_BUFFER_SIZE - vdev->length) < VFS_BLOCK_SIZE)
+		if ((VFS_BUFFER_HEIGHT - vdev->lines.len) < 16)
 		{
 			/* Buffer full, image too large, return no memory error */
 			fp_err("buffer full, image too large");
@@ -426,7 +471,7 @@ static void async_load_cb(struct libusb_transfer *transfer)
 			vdev->ignore_error = FALSE;
 
 		/* Image load completed, go to next state */
-		vdev->height = vdev->length / VFS_FRAME_SIZE;
+		vdev->height = vdev->lines.len;
 		fp_dbg("image loaded, height = %d", vdev->height);
 		fpi_ssm_next_state(ssm);
 	}
@@ -440,7 +485,6 @@ static void async_load(struct fpi_ssm *ssm)
 {
 	struct fp_img_dev *dev = ssm->priv;
 	struct vfs101_dev *vdev = dev->priv;
-	unsigned char *buffer;
 	int r;
 
 	/* Allocation of transfer */
@@ -454,14 +498,11 @@ static void async_load(struct fpi_ssm *ssm)
 		return;
 	}
 
-	/* Append new data into the buffer */
-	buffer = vdev->buffer + vdev->length;
-
 	/* Prepare bulk transfer */
-	libusb_fill_bulk_transfer(vdev->transfer, dev->udev, EP_IN(2), buffer, VFS_BLOCK_SIZE, async_load_cb, ssm, BULK_TIMEOUT);
+	libusb_fill_bulk_transfer(vdev->transfer, dev->udev, EP_IN(2), vdev->block, VFS_BLOCK_SIZE, async_load_cb, ssm, BULK_TIMEOUT);
 
 	/* Submit transfer */
-	r = libusb_submit_transfer(vdev->transfer);
+	r = fpi_usb_submit_transfer(vdev->transfer);
 	if (r != 0)
 	{
 		/* Submission of transfer failed, return IO error */
@@ -482,6 +523,7 @@ static void async_sleep_cb(void *data)
 
 	/* Cleanup timeout */
 	vdev->timeout = NULL;
+	vdev->poll_ssm = NULL;
 
 	fpi_ssm_next_state(ssm);
 }
@@ -493,7 +535,7 @@ static void async_sleep(unsigned int msec, struct fpi_ssm *ssm)
 	struct vfs101_dev *vdev = dev->priv;
 
 	/* Add timeout */
-	vdev->timeout = fpi_timeout_add(msec, async_sleep_cb, ssm);
+	vdev->timeout = fpi_timeout_add(ssm->dev, msec, async_sleep_cb, ssm);
 
 	if (vdev->timeout == NULL)
 	{
@@ -638,6 +680,8 @@ static void vfs_img_load(struct fpi_ssm *ssm)
 
 	/* Reset buffer length */
 	vdev->length = 0;
+	fpi_asmbl_buf_clear(&vdev->lines);
+	vdev->contrast_sum = 0;
 
 	/* Reset image properties */
 	vdev->bottom = 0;
@@ -665,12 +709,10 @@ static int action_completed(struct fp_img_dev *dev)
 	return TRUE;
 }
 
-#define offset(x, y)	((x) + ((y) * VFS_FRAME_SIZE))
-
-/* Screen image to remove noise and find bottom line and height od image */
+/* Screen image to find bottom line and height of image */
 static void img_screen(struct vfs101_dev *vdev)
 {
-	int y, x, count, top;
+	int y, count, top;
 	long int level;
 	int last_line = vdev->height - 1;
 
@@ -687,8 +729,7 @@ static void img_screen(struct vfs101_dev *vdev)
 	for (y = last_line, top = last_line; y >= 0; y--)
 	{
 		/* Take image scan level */
-		level = vdev->buffer[offset(283, y)] * 256 +
-			vdev->buffer[offset(282, y)];
+		level = vdev->levels[y];
 
 		fp_dbg("line = %d, scan level = %ld", y, level);
 
@@ -731,32 +772,14 @@ static void img_screen(struct vfs101_dev *vdev)
 		vdev->height = VFS_IMG_MAX_HEIGHT;
 
 	fp_dbg("image height after screen = %d", vdev->height);
-
-	/* Scan image and remove noise */
-	for (y = vdev->bottom; y <= top; y++)
-		for (x = 6; x < VFS_IMG_WIDTH + 6; x++)
-			if (vdev->buffer[offset(x, y)] > VFS_IMG_MIN_IMAGE_LEVEL)
-				vdev->buffer[offset(x, y)] = 255;
 };
 
 /* Copy image from reader buffer and put it into image data */
 static void img_copy(struct vfs101_dev *vdev, struct fp_img *img)
 {
-	unsigned int line;
-	unsigned char *img_buffer = img->data;
-	unsigned char *vdev_buffer = vdev->buffer + (vdev->bottom * VFS_FRAME_SIZE) + 6;
-
-	for (line = 0; line < img->height; line++)
-	{
-		/* Copy image line from reader buffer to image data */
-		memcpy(img_buffer, vdev_buffer, VFS_IMG_WIDTH);
-
-		/* Next line of reader buffer */
-		vdev_buffer = vdev_buffer + VFS_FRAME_SIZE;
-
-		/* Next line of image buffer */
-		img_buffer = img_buffer + VFS_IMG_WIDTH;
-	}
+	/* The lines are stored back to back */
+	memcpy(img->data, fpi_asmbl_buf_get(&vdev->lines, vdev->bottom),
+		img->height * VFS_IMG_WIDTH);
 }
 
 /* Extract fingerpint image from raw data */
@@ -859,13 +882,10 @@ static inline int vfs_finger_state(struct vfs101_dev *vdev)
 /* Check contrast of image */
 static void vfs_check_contrast(struct vfs101_dev *vdev)
 {
-	int y;
-	long int count = 0;
+	long int count;
 
 	/* Check difference from byte 4 to byte 5 for verify contrast of image */
-	for (y = 0; y < vdev->height; y++)
-		count = count + vdev->buffer[offset(5, y)] - vdev->buffer[offset(4, y)];
-	count = count / vdev->height;
+	count = vdev->contrast_sum / vdev->height;
 
 	if (count < 16)
 	{
@@ -940,7 +960,9 @@ static void m_loop_state(struct fpi_ssm *ssm)
 
 	case M_LOOP_0_SLEEP:
 		/* Wait fingerprint scanning */
-		async_sleep(50, ssm);
+		async_sleep(fpi_imgdev_poll_interval(dev), ssm);
+		if (vdev->timeout)
+			vdev->poll_ssm = ssm;
 		break;
 
 	case M_LOOP_0_GET_STATE:
@@ -1485,14 +1507,32 @@ static void dev_deactivate(struct fp_img_dev *dev)
 	/* Reset active state */
 	vdev->active = FALSE;
 
+	/* Don't wait for the finger poll, which may be up to 500 ms away:
+	 * the loop stops at its next state */
+	if (vdev->poll_ssm)
+	{
+		fpi_timeout_cancel(vdev->timeout);
+		async_sleep_cb(vdev->poll_ssm);
+	}
+
 	/* Handle eventualy existing events */
 	while (vdev->transfer || vdev->timeout)
-		fp_handle_events();
+		fp_context_handle_events(dev->dev->ctx);
+
+	/* Release image lines */
+	fpi_asmbl_buf_free(&vdev->lines);
 
 	/* Notify deactivate complete */
 	fpi_imgdev_deactivate_complete(dev);
 }
 
+/* Finger polling, the reader needs 50 ms to scan */
+static const struct fpi_poll_policy vfs_poll_policy = {
+	.min_interval = 50,
+	.max_interval = 500,
+	.idle_after = 3000,
+};
+
 /* Open device */
 static int dev_open(struct fp_img_dev *dev, unsigned long driver_data)
 {
@@ -1500,7 +1540,7 @@ static int dev_open(struct fp_img_dev *dev, unsigned long driver_data)
 	int r;
 
 	/* Claim usb interface */
-	r = libusb_claim_interface(dev->udev, 0);
+	r = fpi_usb_claim_interface(dev->udev, 0);
 	if (r < 0)
 	{
 		/* Interface not claimed, return error */
@@ -1511,7 +1551,10 @@ static int dev_open(struct fp_img_dev *dev, unsigned long driver_data)
 	/* Initialize private structure */
 	vdev = g_malloc0(sizeof(struct vfs101_dev));
 	vdev->seqnum = -1;
+	fpi_asmbl_buf_init(&vdev->lines, VFS_IMG_WIDTH);
 	dev->priv = vdev;
+	fpi_imgdev_set_poll_policy(dev, &vfs_poll_policy);
+	fpi_dev_mem_account(dev->dev, sizeof(*vdev));
 
 	/* Notify open complete */
 	fpi_imgdev_open_complete(dev, 0);
@@ -1522,11 +1565,14 @@ static int dev_open(struct fp_img_dev *dev, unsigned long driver_data)
 /* Close device */
 static void dev_close(struct fp_img_dev *dev)
 {
+	struct vfs101_dev *vdev = dev->priv;
+
 	/* Release private structure */
-	g_free(dev->priv);
+	fpi_asmbl_buf_free(&vdev->lines);
+	g_free(vdev);
 
 	/* Release usb interface */
-	libusb_release_interface(dev->udev, 0);
+	fpi_usb_release_interface(dev->udev, 0);
 
 	/* Notify close complete */
 	fpi_imgdev_close_complete(dev);
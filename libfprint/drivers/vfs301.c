@@ -49,16 +49,14 @@ static void async_sleep_cb(void *data)
 /* Submit asynchronous sleep */
 static void async_sleep(unsigned int msec, struct fpi_ssm *ssm)
 {
-	struct fp_img_dev *dev = ssm->priv;
 	struct fpi_timeout *timeout;
 
 	/* Add timeout */
-	timeout = fpi_timeout_add(msec, async_sleep_cb, ssm);
+	timeout = fpi_timeout_add(ssm->dev, msec, async_sleep_cb, ssm);
 
 	if (timeout == NULL) {
 		/* Failed to add timeout */
 		fp_err("failed to add timeout");
-		fpi_imgdev_session_error(dev, -ETIME);
 		fpi_ssm_mark_aborted(ssm, -ETIME);
 	}
 }
@@ -104,10 +102,12 @@ enum
 	/* Step 0 - Scan finger */
 	M_REQUEST_PRINT,
 	M_WAIT_PRINT,
+	M_PEEK_PRINT,
 	M_CHECK_PRINT,
 	M_READ_PRINT_START,
 	M_READ_PRINT_WAIT,
 	M_READ_PRINT_POLL,
+	M_READ_PRINT_FINISH,
 	M_SUBMIT_PRINT,
 
 	/* Number of states */
@@ -120,10 +120,15 @@ static void m_loop_state(struct fpi_ssm *ssm)
 	struct fp_img_dev *dev = ssm->priv;
 	vfs301_dev_t *vdev = dev->priv;
 
+	/* Stop waiting for a finger once deactivated */
+	if (vdev->deactivating && ssm->cur_state <= M_CHECK_PRINT) {
+		fpi_ssm_mark_completed(ssm);
+		return;
+	}
+
 	switch (ssm->cur_state) {
 	case M_REQUEST_PRINT:
-		vfs301_proto_request_fingerprint(dev->udev, vdev);
-		fpi_ssm_next_state(ssm);
+		vfs301_proto_request_fingerprint(ssm, dev->udev, vdev);
 		break;
 
 	case M_WAIT_PRINT:
@@ -131,17 +136,25 @@ static void m_loop_state(struct fpi_ssm *ssm)
 		async_sleep(200, ssm);
 		break;
 
+	case M_PEEK_PRINT:
+		vfs301_proto_peek_event(ssm, dev->udev, vdev);
+		break;
+
 	case M_CHECK_PRINT:
-		if (!vfs301_proto_peek_event(dev->udev, vdev))
+		{
+		int r = vfs301_proto_peek_event_result(vdev);
+		if (r < 0)
+			fpi_ssm_mark_aborted(ssm, r);
+		else if (!r)
 			fpi_ssm_jump_to_state(ssm, M_WAIT_PRINT);
 		else
 			fpi_ssm_next_state(ssm);
+		}
 		break;
 
 	case M_READ_PRINT_START:
 		fpi_imgdev_report_finger_status(dev, TRUE);
-		vfs301_proto_process_event_start(dev->udev, vdev);
-		fpi_ssm_next_state(ssm);
+		vfs301_proto_process_event_start(ssm, dev->udev, vdev);
 		break;
 
 	case M_READ_PRINT_WAIT:
@@ -151,15 +164,20 @@ static void m_loop_state(struct fpi_ssm *ssm)
 
 	case M_READ_PRINT_POLL:
 		{
-		int rv = vfs301_proto_process_event_poll(dev->udev, vdev);
-		assert(rv != VFS301_FAILURE);
-		if (rv == VFS301_ONGOING)
+		int rv = vfs301_proto_process_event_poll(vdev);
+		if (rv == VFS301_FAILURE)
+			fpi_ssm_mark_aborted(ssm, -EIO);
+		else if (rv == VFS301_ONGOING)
 			fpi_ssm_jump_to_state(ssm, M_READ_PRINT_WAIT);
 		else
 			fpi_ssm_next_state(ssm);
 		}
 		break;
 
+	case M_READ_PRINT_FINISH:
+		vfs301_proto_process_event_finish(ssm, dev->udev, vdev);
+		break;
+
 	case M_SUBMIT_PRINT:
 		if (submit_image(ssm)) {
 			fpi_ssm_mark_completed(ssm);
@@ -175,8 +193,20 @@ static void m_loop_state(struct fpi_ssm *ssm)
 /* Complete loop sequential state machine */
 static void m_loop_complete(struct fpi_ssm *ssm)
 {
+	struct fp_img_dev *dev = ssm->priv;
+	vfs301_dev_t *vdev = dev->priv;
+	int error = ssm->error;
+
 	/* Free sequential state machine */
 	fpi_ssm_free(ssm);
+
+	vdev->loop_running = 0;
+	if (vdev->deactivating) {
+		vdev->deactivating = 0;
+		fpi_imgdev_deactivate_complete(dev);
+	} else if (error) {
+		fpi_imgdev_session_error(dev, error);
+	}
 }
 
 /* Exec init sequential state machine */
@@ -187,22 +217,22 @@ static void m_init_state(struct fpi_ssm *ssm)
 
 	assert(ssm->cur_state == 0);
 
-	vfs301_proto_init(dev->udev, vdev);
-
-	fpi_ssm_mark_completed(ssm);
+	vfs301_proto_init(ssm, dev->udev, vdev);
 }
 
 /* Complete init sequential state machine */
 static void m_init_complete(struct fpi_ssm *ssm)
 {
 	struct fp_img_dev *dev = ssm->priv;
+	vfs301_dev_t *vdev = dev->priv;
 	struct fpi_ssm *ssm_loop;
 
-	if (!ssm->error) {
-		/* Notify activate complete */
-		fpi_imgdev_activate_complete(dev, 0);
+	/* Notify activate complete */
+	fpi_imgdev_activate_complete(dev, ssm->error);
 
+	if (!ssm->error) {
 		/* Start loop ssm */
+		vdev->loop_running = 1;
 		ssm_loop = fpi_ssm_new(dev->dev, m_loop_state, M_LOOP_NUM_STATES);
 		ssm_loop->priv = dev;
 		fpi_ssm_start(ssm_loop, m_loop_complete);
@@ -228,6 +258,13 @@ static int dev_activate(struct fp_img_dev *dev, enum fp_imgdev_state state)
 /* Deactivate device */
 static void dev_deactivate(struct fp_img_dev *dev)
 {
+	vfs301_dev_t *vdev = dev->priv;
+
+	/* The loop completes once it is done with the device */
+	if (vdev->loop_running) {
+		vdev->deactivating = 1;
+		return;
+	}
 	fpi_imgdev_deactivate_complete(dev);
 }
 
@@ -237,7 +274,7 @@ static int dev_open(struct fp_img_dev *dev, unsigned long driver_data)
 	int r;
 
 	/* Claim usb interface */
-	r = libusb_claim_interface(dev->udev, 0);
+	r = fpi_usb_claim_interface(dev->udev, 0);
 	if (r < 0) {
 		/* Interface not claimed, return error */
 		fp_err("could not claim interface 0: %s", libusb_error_name(r));
@@ -247,6 +284,7 @@ static int dev_open(struct fp_img_dev *dev, unsigned long driver_data)
 	/* Initialize private structure */
 	vdev = g_malloc0(sizeof(vfs301_dev_t));
 	dev->priv = vdev;
+	fpi_dev_mem_account(dev->dev, sizeof(*vdev));
 
 	vdev->scanline_buf = malloc(0);
 	vdev->scanline_count = 0;
@@ -264,7 +302,7 @@ static void dev_close(struct fp_img_dev *dev)
 	g_free(dev->priv);
 
 	/* Release usb interface */
-	libusb_release_interface(dev->udev, 0);
+	fpi_usb_release_interface(dev->udev, 0);
 
 	/* Notify close complete */
 	fpi_imgdev_close_complete(dev);
@@ -19,9 +19,10 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#define FP_COMPONENT "vfs301"
+
 /*
  * TODO:
- * - async communication everywhere :)
  * - protocol decyphering
  *   - what is needed and what is redundant
  *   - is some part of the initial data the firmware?
@@ -39,6 +40,8 @@
 #include "vfs301_proto_fragments.h"
 #include <unistd.h>
 
+#include <fp_internal.h>
+
 #define min(a, b) (((a) < (b)) ? (a) : (b))
 
 /************************** USB STUFF *****************************************/
@@ -64,51 +67,6 @@ static void usb_print_packet(int dir, int rv, const unsigned char *data, int len
 }
 #endif
 
-static int usb_recv(
-	vfs301_dev_t *dev,
-	struct libusb_device_handle *devh, unsigned char endpoint, int max_bytes)
-{
-	assert(max_bytes <= sizeof(dev->recv_buf));
-
-	int r = libusb_bulk_transfer(
-		devh, endpoint,
-		dev->recv_buf, max_bytes,
-		&dev->recv_len, VFS301_DEFAULT_WAIT_TIMEOUT
-	);
-
-#ifdef DEBUG
-	usb_print_packet(0, r, dev->recv_buf, dev->recv_len);
-#endif
-
-	if (r < 0)
-		return r;
-	return 0;
-}
-
-static int usb_send(
-	struct libusb_device_handle *devh, const unsigned char *data, int length)
-{
-	int transferred = 0;
-
-	int r = libusb_bulk_transfer(
-		devh, VFS301_SEND_ENDPOINT,
-		(unsigned char *)data, length, &transferred, VFS301_DEFAULT_WAIT_TIMEOUT
-	);
-
-#ifdef DEBUG
-	usb_print_packet(1, r, data, length);
-#endif
-
-	assert(r == 0);
-
-	if (r < 0)
-		return r;
-	if (transferred < length)
-		return r;
-
-	return 0;
-}
-
 /************************** OUT MESSAGES GENERATION ***************************/
 
 static void vfs301_proto_generate_0B(int subtype, unsigned char *data, int *len)
@@ -368,21 +326,151 @@ static int img_process_data(
 
 /************************** PROTOCOL STUFF ************************************/
 
-static unsigned char usb_send_buf[0x2000];
+/* The messages exchanged with the device are described by sequences of
+ * steps, which are run asynchronously by a ssm with one state per step. */
+enum vfs301_step_op {
+	STEP_SEND,		/* send a generated message */
+	STEP_SEND_RAW,		/* send a message as is */
+	STEP_RECV,		/* receive, up to a length */
+	/* the following may come in either order: receive, then receive
+	 * again if the first one timed out */
+	STEP_RECV_MAY_TIME_OUT,
+	STEP_RECV_IF_TIMED_OUT,
+	/* start receiving the fingerprint data in the background */
+	STEP_READ_PRINT,
+};
+
+struct vfs301_step {
+	enum vfs301_step_op op;
+	int type;
+	int subtype;
+	const unsigned char *data;
+	int len;
+	unsigned char endpoint;
+};
+
+#define USB_SEND(type, subtype) \
+	{ STEP_SEND, type, subtype, NULL, 0, VFS301_SEND_ENDPOINT }
+
+#define USB_SEND_RAW(x) \
+	{ STEP_SEND_RAW, 0, 0, x, sizeof(x), VFS301_SEND_ENDPOINT }
 
 #define USB_RECV(from, len) \
-	usb_recv(dev, devh, from, len)
+	{ STEP_RECV, 0, 0, NULL, len, from }
 
-#define USB_SEND(type, subtype) \
-	{ \
-		int len; \
-		vfs301_proto_generate(type, subtype, usb_send_buf, &len); \
-		usb_send(devh, usb_send_buf, len); \
+#define VARIABLE_ORDER(from_a, len_a, from_b, len_b) \
+	{ STEP_RECV_MAY_TIME_OUT, 0, 0, NULL, len_a, from_a }, \
+	USB_RECV(from_b, len_b), \
+	{ STEP_RECV_IF_TIMED_OUT, 0, 0, NULL, len_a, from_a }
+
+#define IS_VFS301_FP_SEQ_START(b) ((b[0] == 0x01) && (b[1] == 0xfe))
+
+static void vfs301_proto_start_read_print(struct fpi_ssm *ssm,
+	vfs301_dev_t *dev);
+
+static void seq_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct fpi_ssm *ssm = transfer->user_data;
+	vfs301_dev_t *dev = ssm->priv;
+	const struct vfs301_step *step = &dev->seq[ssm->cur_state];
+
+#ifdef DEBUG
+	usb_print_packet(step->endpoint == VFS301_SEND_ENDPOINT,
+		transfer->status, transfer->buffer, transfer->actual_length);
+#endif
+
+	if (step->endpoint == VFS301_SEND_ENDPOINT) {
+		if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+			fp_err("send failed, status %d", transfer->status);
+			fpi_ssm_mark_aborted(ssm, -EIO);
+			return;
+		}
+		fpi_ssm_next_state(ssm);
+		return;
 	}
 
-#define RAW_DATA(x) x, sizeof(x)
+	/* as before, replies which don't come in time are not errors, and
+	 * whatever arrived is kept */
+	dev->recv_len = transfer->actual_length;
+	if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+		if (step->op == STEP_RECV_MAY_TIME_OUT)
+			dev->seq_timed_out = 1;
+	} else if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		fp_err("receive failed, status %d", transfer->status);
+		fpi_ssm_mark_aborted(ssm, -EIO);
+		return;
+	}
+	fpi_ssm_next_state(ssm);
+}
 
-#define IS_VFS301_FP_SEQ_START(b) ((b[0] == 0x01) && (b[1] == 0xfe))
+static void seq_run_state(struct fpi_ssm *ssm)
+{
+	vfs301_dev_t *dev = ssm->priv;
+	const struct vfs301_step *step = &dev->seq[ssm->cur_state];
+	struct libusb_transfer *transfer;
+	unsigned char *data;
+	int len;
+
+	switch (step->op) {
+	case STEP_SEND:
+		vfs301_proto_generate(step->type, step->subtype, dev->send_buf, &len);
+		data = dev->send_buf;
+		break;
+	case STEP_SEND_RAW:
+		data = (unsigned char *)step->data;
+		len = step->len;
+		break;
+	case STEP_RECV_IF_TIMED_OUT:
+		if (!dev->seq_timed_out) {
+			fpi_ssm_next_state(ssm);
+			return;
+		}
+		data = dev->recv_buf;
+		len = step->len;
+		break;
+	case STEP_RECV_MAY_TIME_OUT:
+		dev->seq_timed_out = 0;
+		/* fall through */
+	case STEP_RECV:
+		assert(step->len <= sizeof(dev->recv_buf));
+		data = dev->recv_buf;
+		len = step->len;
+		break;
+	case STEP_READ_PRINT:
+		vfs301_proto_start_read_print(ssm, dev);
+		return;
+	default:
+		BUG();
+		return;
+	}
+
+	transfer = libusb_alloc_transfer(0);
+	if (!transfer) {
+		fpi_ssm_mark_aborted(ssm, -ENOMEM);
+		return;
+	}
+	transfer->flags = LIBUSB_TRANSFER_FREE_TRANSFER;
+	libusb_fill_bulk_transfer(transfer, dev->devh, step->endpoint, data, len,
+		seq_transfer_cb, ssm, VFS301_DEFAULT_WAIT_TIMEOUT);
+	if (fpi_usb_submit_transfer(transfer) < 0) {
+		libusb_free_transfer(transfer);
+		fpi_ssm_mark_aborted(ssm, -EIO);
+	}
+}
+
+static void run_seq(struct fpi_ssm *parent, struct libusb_device_handle *devh,
+	vfs301_dev_t *dev, const struct vfs301_step *seq, int len)
+{
+	struct fpi_ssm *ssm = fpi_ssm_new(parent->dev, seq_run_state, len);
+
+	dev->devh = devh;
+	dev->seq = seq;
+	ssm->priv = dev;
+	fpi_ssm_start_subsm(parent, ssm);
+}
+
+#define RUN_SEQ(parent, devh, dev, seq) \
+	run_seq(parent, devh, dev, seq, sizeof(seq) / sizeof(seq[0]))
 
 static int vfs301_proto_process_data(int first_block, vfs301_dev_t *dev)
 {
@@ -403,39 +491,48 @@ static int vfs301_proto_process_data(int first_block, vfs301_dev_t *dev)
 	return img_process_data(first_block, dev, buf, len);
 }
 
-void vfs301_proto_request_fingerprint(
+static const struct vfs301_step request_fingerprint_seq[] = {
+	USB_SEND(0x0220, 0xFA00),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), /* 000000000000 */
+};
+
+void vfs301_proto_request_fingerprint(struct fpi_ssm *ssm,
 	struct libusb_device_handle *devh, vfs301_dev_t *dev)
 {
-	USB_SEND(0x0220, 0xFA00);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); /* 000000000000 */
+	RUN_SEQ(ssm, devh, dev, request_fingerprint_seq);
 }
 
-int vfs301_proto_peek_event(
+static const struct vfs301_step peek_event_seq[] = {
+	USB_SEND(0x17, -1),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 7),
+};
+
+void vfs301_proto_peek_event(struct fpi_ssm *ssm,
 	struct libusb_device_handle *devh, vfs301_dev_t *dev)
+{
+	RUN_SEQ(ssm, devh, dev, peek_event_seq);
+}
+
+int vfs301_proto_peek_event_result(vfs301_dev_t *dev)
 {
 	const char no_event[] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
 	const char got_event[] = {0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00};
 
-	USB_SEND(0x17, -1);
-	assert(USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 7) == 0);
+	if (dev->recv_len != sizeof(no_event)) {
+		fp_err("no reply to wait");
+		return -EIO;
+	}
 
 	if (memcmp(dev->recv_buf, no_event, sizeof(no_event)) == 0) {
 		return 0;
 	} else if (memcmp(dev->recv_buf, got_event, sizeof(no_event)) == 0) {
 		return 1;
 	} else {
-		assert(!"unexpected reply to wait");
+		fp_err("unexpected reply to wait");
+		return -EPROTO;
 	}
 }
 
-#define VARIABLE_ORDER(a, b) \
-	{ \
-		int _rv = a;\
-		b; \
-		if (_rv == -7) \
-			a; \
-	}
-
 static void vfs301_proto_process_event_cb(struct libusb_transfer *transfer)
 {
 	vfs301_dev_t *dev = transfer->user_data;
@@ -461,7 +558,7 @@ static void vfs301_proto_process_event_cb(struct libusb_transfer *transfer)
 			dev->recv_buf, dev->recv_exp_amt,
 			vfs301_proto_process_event_cb, dev, VFS301_FP_RECV_TIMEOUT);
 
-		if (libusb_submit_transfer(transfer) < 0) {
+		if (fpi_usb_submit_transfer(transfer) < 0) {
 			printf("cb::continue fail\n");
 			dev->recv_progress = VFS301_FAILURE;
 			goto end;
@@ -473,38 +570,16 @@ end:
 	libusb_free_transfer(transfer);
 }
 
-void vfs301_proto_process_event_start(
-	struct libusb_device_handle *devh, vfs301_dev_t *dev)
+static void vfs301_proto_start_read_print(struct fpi_ssm *ssm,
+	vfs301_dev_t *dev)
 {
 	struct libusb_transfer *transfer;
 
-	/*
-	 * Notes:
-	 *
-	 * seen next_scan order:
-	 *    o FA00
-	 *    o FA00
-	 *    o 2C01
-	 *    o FA00
-	 *    o FA00
-	 *    o 2C01
-	 *    o FA00
-	 *    o FA00
-	 *    o 2C01
-	 *    o 5E01 !?
-	 *    o FA00
-	 *    o FA00
-	 *    o 2C01
-	 *    o FA00
-	 *    o FA00
-	 *    o 2C01
-	 */
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 64);
-
 	/* now read the fingerprint data, while there are some */
 	transfer = libusb_alloc_transfer(0);
 	if (!transfer) {
 		dev->recv_progress = VFS301_FAILURE;
+		fpi_ssm_next_state(ssm);
 		return;
 	}
 
@@ -512,128 +587,172 @@ void vfs301_proto_process_event_start(
 	dev->recv_exp_amt = VFS301_FP_RECV_LEN_1;
 
 	libusb_fill_bulk_transfer(
-		transfer, devh, VFS301_RECEIVE_ENDPOINT_DATA,
+		transfer, dev->devh, VFS301_RECEIVE_ENDPOINT_DATA,
 		dev->recv_buf, dev->recv_exp_amt,
 		vfs301_proto_process_event_cb, dev, VFS301_FP_RECV_TIMEOUT);
 
-	if (libusb_submit_transfer(transfer) < 0) {
+	if (fpi_usb_submit_transfer(transfer) < 0) {
 		libusb_free_transfer(transfer);
 		dev->recv_progress = VFS301_FAILURE;
-		return;
 	}
+	fpi_ssm_next_state(ssm);
 }
 
-int /* vfs301_dev_t::recv_progress */ vfs301_proto_process_event_poll(
+/*
+ * Notes:
+ *
+ * seen next_scan order:
+ *    o FA00
+ *    o FA00
+ *    o 2C01
+ *    o FA00
+ *    o FA00
+ *    o 2C01
+ *    o FA00
+ *    o FA00
+ *    o 2C01
+ *    o 5E01 !?
+ *    o FA00
+ *    o FA00
+ *    o 2C01
+ *    o FA00
+ *    o FA00
+ *    o 2C01
+ */
+static const struct vfs301_step process_event_start_seq[] = {
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 64),
+	{ STEP_READ_PRINT, 0, 0, NULL, 0, 0 },
+};
+
+void vfs301_proto_process_event_start(struct fpi_ssm *ssm,
 	struct libusb_device_handle *devh, vfs301_dev_t *dev)
 {
-	if (dev->recv_progress != VFS301_ENDED)
-		return dev->recv_progress;
+	RUN_SEQ(ssm, devh, dev, process_event_start_seq);
+}
 
-	/* Finish the scan process... */
+int /* vfs301_dev_t::recv_progress */ vfs301_proto_process_event_poll(
+	vfs301_dev_t *dev)
+{
+	return dev->recv_progress;
+}
 
-	USB_SEND(0x04, -1);
+/* Finish the scan process... */
+static const struct vfs301_step process_event_finish_seq[] = {
+	USB_SEND(0x04, -1),
 	/* the following may come in random order, data may not come at all, don't
 	* try for too long... */
 	VARIABLE_ORDER(
-		USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), /* 1204 */
-		USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 16384)
-	);
+		VFS301_RECEIVE_ENDPOINT_CTRL, 2, /* 1204 */
+		VFS301_RECEIVE_ENDPOINT_DATA, 16384
+	),
 
-	USB_SEND(0x0220, 2);
+	USB_SEND(0x0220, 2),
 	VARIABLE_ORDER(
-		USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 5760), /* seems to always come */
-		USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2) /* 0000 */
-	);
+		VFS301_RECEIVE_ENDPOINT_DATA, 5760, /* seems to always come */
+		VFS301_RECEIVE_ENDPOINT_CTRL, 2 /* 0000 */
+	),
+};
 
-	return dev->recv_progress;
+void vfs301_proto_process_event_finish(struct fpi_ssm *ssm,
+	struct libusb_device_handle *devh, vfs301_dev_t *dev)
+{
+	RUN_SEQ(ssm, devh, dev, process_event_finish_seq);
 }
 
-void vfs301_proto_init(struct libusb_device_handle *devh, vfs301_dev_t *dev)
-{
-	USB_SEND(0x01, -1);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 38);
-	USB_SEND(0x0B, 0x04);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 6); /* 000000000000 */
-	USB_SEND(0x0B, 0x05);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 7); /* 00000000000000 */
-	USB_SEND(0x19, -1);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 64);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 4); /* 6BB4D0BC */
-	usb_send(devh, RAW_DATA(vfs301_06_1));
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); /* 0000 */
-
-	USB_SEND(0x01, -1);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 38);
-	USB_SEND(0x1A, -1);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); /* 0000 */
-	usb_send(devh, RAW_DATA(vfs301_06_2));
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); /* 0000 */
-	USB_SEND(0x0220, 1);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); /* 0000 */
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 256);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 32);
-
-	USB_SEND(0x1A, -1);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); /* 0000 */
-	usb_send(devh, RAW_DATA(vfs301_06_3));
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); /* 0000 */
-
-	USB_SEND(0x01, -1);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 38);
-	USB_SEND(0x02D0, 1);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); /* 0000 */
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 11648); /* 56 * vfs301_init_line_t[] */
-	USB_SEND(0x02D0, 2);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); /* 0000 */
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 53248); /* 2 * 128 * vfs301_init_line_t[] */
-	USB_SEND(0x02D0, 3);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); /* 0000 */
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 19968); /* 96 * vfs301_init_line_t[] */
-	USB_SEND(0x02D0, 4);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); /* 0000 */
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 5824); /* 28 * vfs301_init_line_t[] */
-	USB_SEND(0x02D0, 5);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); /* 0000 */
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 6656); /* 32 * vfs301_init_line_t[] */
-	USB_SEND(0x02D0, 6);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); /* 0000 */
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 6656); /* 32 * vfs301_init_line_t[] */
-	USB_SEND(0x02D0, 7);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); /* 0000 */
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 832);
-	usb_send(devh, RAW_DATA(vfs301_12));
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); /* 0000 */
-
-	USB_SEND(0x1A, -1);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); /* 0000 */
-	usb_send(devh, RAW_DATA(vfs301_06_2));
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); /* 0000 */
-	USB_SEND(0x0220, 2);
+static const struct vfs301_step init_seq[] = {
+	USB_SEND(0x01, -1),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 38),
+	USB_SEND(0x0B, 0x04),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 6), /* 000000000000 */
+	USB_SEND(0x0B, 0x05),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 7), /* 00000000000000 */
+	USB_SEND(0x19, -1),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 64),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 4), /* 6BB4D0BC */
+	USB_SEND_RAW(vfs301_06_1),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), /* 0000 */
+
+	USB_SEND(0x01, -1),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 38),
+	USB_SEND(0x1A, -1),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), /* 0000 */
+	USB_SEND_RAW(vfs301_06_2),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), /* 0000 */
+	USB_SEND(0x0220, 1),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), /* 0000 */
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 256),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 32),
+
+	USB_SEND(0x1A, -1),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), /* 0000 */
+	USB_SEND_RAW(vfs301_06_3),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), /* 0000 */
+
+	USB_SEND(0x01, -1),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 38),
+	USB_SEND(0x02D0, 1),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), /* 0000 */
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 11648), /* 56 * vfs301_init_line_t[] */
+	USB_SEND(0x02D0, 2),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), /* 0000 */
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 53248), /* 2 * 128 * vfs301_init_line_t[] */
+	USB_SEND(0x02D0, 3),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), /* 0000 */
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 19968), /* 96 * vfs301_init_line_t[] */
+	USB_SEND(0x02D0, 4),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), /* 0000 */
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 5824), /* 28 * vfs301_init_line_t[] */
+	USB_SEND(0x02D0, 5),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), /* 0000 */
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 6656), /* 32 * vfs301_init_line_t[] */
+	USB_SEND(0x02D0, 6),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), /* 0000 */
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 6656), /* 32 * vfs301_init_line_t[] */
+	USB_SEND(0x02D0, 7),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), /* 0000 */
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 832),
+	USB_SEND_RAW(vfs301_12),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), /* 0000 */
+
+	USB_SEND(0x1A, -1),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), /* 0000 */
+	USB_SEND_RAW(vfs301_06_2),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), /* 0000 */
+	USB_SEND(0x0220, 2),
 	VARIABLE_ORDER(
-		USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), /* 0000 */
-		USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 5760)
-	);
-
-	USB_SEND(0x1A, -1);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); /* 0000 */
-	usb_send(devh, RAW_DATA(vfs301_06_1));
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); /* 0000 */
-
-	USB_SEND(0x1A, -1);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); /* 0000 */
-	usb_send(devh, RAW_DATA(vfs301_06_4));
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); /* 0000 */
-	usb_send(devh, RAW_DATA(vfs301_24)); /* turns on white */
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2); /* 0000 */
-
-	USB_SEND(0x01, -1);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 38);
-	USB_SEND(0x0220, 3);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2368);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 36);
-	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 5760);
+		VFS301_RECEIVE_ENDPOINT_CTRL, 2, /* 0000 */
+		VFS301_RECEIVE_ENDPOINT_DATA, 5760
+	),
+
+	USB_SEND(0x1A, -1),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), /* 0000 */
+	USB_SEND_RAW(vfs301_06_1),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), /* 0000 */
+
+	USB_SEND(0x1A, -1),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), /* 0000 */
+	USB_SEND_RAW(vfs301_06_4),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), /* 0000 */
+	USB_SEND_RAW(vfs301_24), /* turns on white */
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2), /* 0000 */
+
+	USB_SEND(0x01, -1),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 38),
+	USB_SEND(0x0220, 3),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 2368),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_CTRL, 36),
+	USB_RECV(VFS301_RECEIVE_ENDPOINT_DATA, 5760),
+};
+
+void vfs301_proto_init(struct fpi_ssm *ssm,
+	struct libusb_device_handle *devh, vfs301_dev_t *dev)
+{
+	RUN_SEQ(ssm, devh, dev, init_seq);
 }
 
-void vfs301_proto_deinit(struct libusb_device_handle *devh, vfs301_dev_t *dev)
+void vfs301_proto_deinit(struct fpi_ssm *ssm,
+	struct libusb_device_handle *devh, vfs301_dev_t *dev)
 {
+	/* nothing to exchange */
+	fpi_ssm_next_state(ssm);
 }
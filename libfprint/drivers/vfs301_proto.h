@@ -20,6 +20,9 @@
  */
 #include <libusb-1.0/libusb.h>
 
+struct fpi_ssm;
+struct vfs301_step;
+
 enum {
 	VFS301_DEFAULT_WAIT_TIMEOUT = 300,
 
@@ -36,6 +39,14 @@ typedef struct {
 	unsigned char recv_buf[0x20000];
 	int recv_len;
 
+	/* buffer for generated messages */
+	unsigned char send_buf[0x2000];
+
+	/* sequence of messages being exchanged, see vfs301_proto.c */
+	struct libusb_device_handle *devh;
+	const struct vfs301_step *seq;
+	int seq_timed_out;
+
 	/* buffer to hold raw scanlines */
 	unsigned char *scanline_buf;
 	int scanline_count;
@@ -46,6 +57,10 @@ typedef struct {
 		VFS301_FAILURE = -1
 	} recv_progress;
 	int recv_exp_amt;
+
+	/* driver state */
+	int loop_running;
+	int deactivating;
 } vfs301_dev_t;
 
 enum {
@@ -120,18 +135,29 @@ typedef struct {
 	unsigned char sum3[3];
 } vfs301_line_t;
 
-void vfs301_proto_init(struct libusb_device_handle *devh, vfs301_dev_t *dev);
-void vfs301_proto_deinit(struct libusb_device_handle *devh, vfs301_dev_t *dev);
+/* The following run their message exchanges as a child of the given ssm,
+ * which moves to its next state once they are done, or is aborted if they
+ * fail. */
+void vfs301_proto_init(struct fpi_ssm *ssm,
+	struct libusb_device_handle *devh, vfs301_dev_t *dev);
+void vfs301_proto_deinit(struct fpi_ssm *ssm,
+	struct libusb_device_handle *devh, vfs301_dev_t *dev);
 
-void vfs301_proto_request_fingerprint(
+void vfs301_proto_request_fingerprint(struct fpi_ssm *ssm,
 	struct libusb_device_handle *devh, vfs301_dev_t *dev);
 
-/** returns 0 if no event is ready, or 1 if there is one... */
-int vfs301_proto_peek_event(
+void vfs301_proto_peek_event(struct fpi_ssm *ssm,
 	struct libusb_device_handle *devh, vfs301_dev_t *dev);
-void vfs301_proto_process_event_start(
+/** after vfs301_proto_peek_event(): returns 0 if no event is ready, 1 if
+ * there is one, or a negative error code */
+int vfs301_proto_peek_event_result(vfs301_dev_t *dev);
+
+/* starts receiving the fingerprint data in the background */
+void vfs301_proto_process_event_start(struct fpi_ssm *ssm,
 	struct libusb_device_handle *devh, vfs301_dev_t *dev);
-int vfs301_proto_process_event_poll(
+int vfs301_proto_process_event_poll(vfs301_dev_t *dev);
+/* once the data has been received */
+void vfs301_proto_process_event_finish(struct fpi_ssm *ssm,
 	struct libusb_device_handle *devh, vfs301_dev_t *dev);
 
 void vfs301_extract_image(vfs301_dev_t *vfs, unsigned char *output, int *output_height);
@@ -207,7 +207,7 @@ static void usbexchange_loop(struct fpi_ssm *ssm)
 					  action->endpoint, action->data,
 					  action->size, async_send_cb, ssm,
 					  data->timeout);
-		ret = libusb_submit_transfer(transfer);
+		ret = fpi_usb_submit_transfer(transfer);
 		break;
 
 	case ACTION_RECEIVE:
@@ -223,7 +223,7 @@ static void usbexchange_loop(struct fpi_ssm *ssm)
 					  action->endpoint, data->receive_buf,
 					  action->size, async_recv_cb, ssm,
 					  data->timeout);
-		ret = libusb_submit_transfer(transfer);
+		ret = fpi_usb_submit_transfer(transfer);
 		break;
 
 	default:
@@ -256,38 +256,35 @@ static void usb_exchange_async(struct fpi_ssm *ssm,
 static int vfs5011_get_deviation2(struct fpi_line_asmbl_ctx *ctx, GSList *row1, GSList *row2)
 {
 	unsigned char *buf1, *buf2;
-	int res = 0, mean = 0, i;
 	const int size = 64;
 
 	buf1 = row1->data + 56;
 	buf2 = row2->data + 168;
 
-	for (i = 0; i < size; i++)
-		mean += (int)buf1[i] + (int)buf2[i];
-
-	mean /= size;
+	return fpi_std_sq_dev2(buf1, buf2, size, 1);
+}
 
-	for (i = 0; i < size; i++) {
-		int dev = (int)buf1[i] + (int)buf2[i] - mean;
-		res += dev*dev;
-	}
+static inline unsigned char vfs5011_pixel(GSList *row, unsigned x)
+{
+	unsigned char *data = row->data + 8;
 
-	return res / size;
+	return data[x];
 }
 
 static unsigned char vfs5011_get_pixel(struct fpi_line_asmbl_ctx *ctx,
 				   GSList *row,
 				   unsigned x)
 {
-	unsigned char *data = row->data + 8;
-
-	return data[x];
+	return vfs5011_pixel(row, x);
 }
 
+FPI_LINE_UNPACKER(vfs5011_unpack_line, VFS5011_IMAGE_WIDTH, vfs5011_pixel)
+
 /* ====================== main stuff ======================= */
 
 enum {
 	CAPTURE_LINES = 256,
+	CAPTURE_TRANSFERS = 4,
 	MAXLINES = 2000,
 	MAX_CAPTURE_LINES = 100000,
 };
@@ -298,23 +295,24 @@ static struct fpi_line_asmbl_ctx assembling_ctx = {
 	.resolution = 10,
 	.median_filter_size = 25,
 	.max_search_offset = 30,
+	.line_search = FPI_LINE_SEARCH_PARALLEL,
 	.get_deviation = vfs5011_get_deviation2,
 	.get_pixel = vfs5011_get_pixel,
+	.unpack_line = vfs5011_unpack_line,
 };
 
 struct vfs5011_data {
 	unsigned char *total_buffer;
-	unsigned char *capture_buffer;
 	unsigned char *row_buffer;
-	unsigned char *lastline;
-	GSList *rows;
+	struct fpi_asmbl_buf rows;
 	int lines_captured, lines_recorded, empty_lines;
 	int max_lines_captured, max_lines_recorded;
 	int lines_total, lines_total_allocated;
 	gboolean loop_running;
 	gboolean deactivating;
 	struct usbexchange_data init_sequence;
-	struct libusb_transfer *flying_transfer;
+	struct fpi_usb_stream *stream;
+	struct fpi_ssm *capture_ssm;
 };
 
 enum {
@@ -335,7 +333,8 @@ static void capture_init(struct vfs5011_data *data, int max_captured,
 		int max_recorded)
 {
 	fp_dbg("capture_init");
-	data->lastline = NULL;
+	fpi_asmbl_buf_clear(&data->rows);
+	fpi_asmbl_buf_reserve(&data->rows, max_recorded);
 	data->lines_captured = 0;
 	data->lines_recorded = 0;
 	data->empty_lines = 0;
@@ -346,7 +345,8 @@ static void capture_init(struct vfs5011_data *data, int max_captured,
 	data->max_lines_recorded = max_recorded;
 }
 
-static int process_chunk(struct vfs5011_data *data, int transferred)
+static int process_chunk(struct vfs5011_data *data, unsigned char *buf,
+			 int transferred)
 {
 	enum {
 		DEVIATION_THRESHOLD = 15*15,
@@ -356,14 +356,19 @@ static int process_chunk(struct vfs5011_data *data, int transferred)
 
 	fp_dbg("process_chunk: got %d bytes", transferred);
 	int lines_captured = transferred/VFS5011_LINE_SIZE;
+	unsigned char *lastline = NULL;
 	int i;
 
+	if (data->rows.len > 0)
+		lastline = fpi_asmbl_buf_get(&data->rows, data->rows.len - 1);
+
 	for (i = 0; i < lines_captured; i++) {
-		unsigned char *linebuf = data->capture_buffer
-					 + i * VFS5011_LINE_SIZE;
+		unsigned char *linebuf = buf + i * VFS5011_LINE_SIZE;
+		struct fpi_line_stats stats;
 
-		if (fpi_std_sq_dev(linebuf + 8, VFS5011_IMAGE_WIDTH)
-				< DEVIATION_THRESHOLD) {
+		fpi_line_stats(linebuf + 8, lastline ? lastline + 8 : NULL,
+			       VFS5011_IMAGE_WIDTH, &stats);
+		if (stats.std_sq_dev < DEVIATION_THRESHOLD) {
 			if (data->lines_captured == 0)
 				continue;
 			else
@@ -383,14 +388,10 @@ static int process_chunk(struct vfs5011_data *data, int transferred)
 			return 1;
 		}
 
-		if ((data->lastline == NULL)
-			|| (fpi_mean_sq_diff_norm(
-				data->lastline + 8,
-				linebuf + 8,
-				VFS5011_IMAGE_WIDTH) >= DIFFERENCE_THRESHOLD)) {
-			data->lastline = g_malloc(VFS5011_LINE_SIZE);
-			data->rows = g_slist_prepend(data->rows, data->lastline);
-			g_memmove(data->lastline, linebuf, VFS5011_LINE_SIZE);
+		if ((lastline == NULL)
+			|| (stats.mean_sq_diff >= DIFFERENCE_THRESHOLD)) {
+			lastline = fpi_asmbl_buf_add(&data->rows);
+			memcpy(lastline, linebuf, VFS5011_LINE_SIZE);
 			data->lines_recorded++;
 			if (data->lines_recorded >= data->max_lines_recorded) {
 				fp_dbg("process_chunk: recorded %d lines, finishing",
@@ -407,64 +408,52 @@ void submit_image(struct fpi_ssm *ssm, struct vfs5011_data *data)
 	struct fp_img_dev *dev = (struct fp_img_dev *)ssm->priv;
 	struct fp_img *img;
 
-	data->rows = g_slist_reverse(data->rows);
-
-	img = fpi_assemble_lines(&assembling_ctx, data->rows, data->lines_recorded);
+	img = fpi_assemble_lines(&assembling_ctx, fpi_asmbl_buf_list(&data->rows),
+				 data->lines_recorded);
+	fpi_imgdev_report_assembled(dev, data->lines_recorded);
 
-	g_slist_free_full(data->rows, g_free);
-	data->rows = NULL;
+	fpi_asmbl_buf_clear(&data->rows);
 
 	fp_dbg("Image captured, commiting");
 
 	fpi_imgdev_image_captured(dev, img);
 }
 
-static void chunk_capture_callback(struct libusb_transfer *transfer)
+static void capture_chunk_cb(struct fpi_usb_stream *stream,
+			     unsigned char *buf, int length, void *user_data)
 {
-	struct fpi_ssm *ssm = (struct fpi_ssm *)transfer->user_data;
-	struct fp_img_dev *dev = (struct fp_img_dev *)ssm->priv;
-	struct vfs5011_data *data = (struct vfs5011_data *)dev->priv;
+	struct fp_img_dev *dev = user_data;
+	struct vfs5011_data *data = dev->priv;
 
-	if ((transfer->status == LIBUSB_TRANSFER_COMPLETED) ||
-	    (transfer->status == LIBUSB_TRANSFER_TIMED_OUT)) {
+	if (length > 0)
+		fpi_imgdev_report_finger_status(dev, TRUE);
 
-		if (transfer->actual_length > 0)
-			fpi_imgdev_report_finger_status(dev, TRUE);
+	if (process_chunk(data, buf, length))
+		fpi_usb_stream_stop(stream);
 
-		if (process_chunk(data, transfer->actual_length))
-			fpi_ssm_jump_to_state(ssm, DEV_ACTIVATE_DATA_COMPLETE);
-		else
-			fpi_ssm_jump_to_state(ssm, DEV_ACTIVATE_READ_DATA);
-	} else {
-		if (!data->deactivating) {
-			fp_err("Failed to capture data");
-			fpi_ssm_mark_aborted(ssm, -1);
-		} else {
-			fpi_ssm_mark_completed(ssm);
-		}
-	}
-	libusb_free_transfer(transfer);
-	data->flying_transfer = NULL;
+	/* The lines recorded so far, without their headers */
+	if (data->rows.len > 0)
+		fpi_imgdev_preview(dev, FP_IMG_PREVIEW_GREY8,
+				   data->rows.data + 8, VFS5011_IMAGE_WIDTH,
+				   data->rows.len, data->rows.entry_size);
 }
 
-static int capture_chunk_async(struct vfs5011_data *data,
-			       libusb_device_handle *handle, int nline,
-			       int timeout, struct fpi_ssm *ssm)
+static void capture_stopped_cb(struct fpi_usb_stream *stream, int status,
+			       void *user_data)
 {
-	fp_dbg("capture_chunk_async: capture %d lines, already have %d",
-		nline, data->lines_recorded);
-	enum {
-		DEVIATION_THRESHOLD = 15*15,
-		DIFFERENCE_THRESHOLD = 600,
-		STOP_CHECK_LINES = 50
-	};
+	struct fp_img_dev *dev = user_data;
+	struct vfs5011_data *data = dev->priv;
+	struct fpi_ssm *ssm = data->capture_ssm;
 
-	data->flying_transfer = libusb_alloc_transfer(0);
-	libusb_fill_bulk_transfer(data->flying_transfer, handle, VFS5011_IN_ENDPOINT_DATA,
-				  data->capture_buffer,
-				  nline * VFS5011_LINE_SIZE,
-				  chunk_capture_callback, ssm, timeout);
-	return libusb_submit_transfer(data->flying_transfer);
+	data->capture_ssm = NULL;
+	if (data->deactivating) {
+		fpi_ssm_mark_completed(ssm);
+	} else if (status < 0) {
+		fp_err("Failed to capture data");
+		fpi_ssm_mark_aborted(ssm, status);
+	} else {
+		fpi_ssm_jump_to_state(ssm, DEV_ACTIVATE_DATA_COMPLETE);
+	}
 }
 
 static void async_sleep_cb(void *data)
@@ -664,8 +653,6 @@ struct usb_action vfs5011_initiate_capture[] = {
 
 static void activate_loop(struct fpi_ssm *ssm)
 {
-	enum {READ_TIMEOUT = 0};
-
 	struct fp_img_dev *dev = (struct fp_img_dev *)ssm->priv;
 	struct vfs5011_data *data = (struct vfs5011_data *)dev->priv;
 	int r;
@@ -702,9 +689,11 @@ static void activate_loop(struct fpi_ssm *ssm)
 		break;
 
 	case DEV_ACTIVATE_READ_DATA:
-		r = capture_chunk_async(data, dev->udev, CAPTURE_LINES,
-					READ_TIMEOUT, ssm);
+		fp_dbg("capturing, already have %d lines", data->lines_recorded);
+		data->capture_ssm = ssm;
+		r = fpi_usb_stream_start(data->stream);
 		if (r != 0) {
+			data->capture_ssm = NULL;
 			fp_err("Failed to capture data");
 			fpi_imgdev_session_error(dev, r);
 			fpi_ssm_mark_aborted(ssm, r);
@@ -712,7 +701,7 @@ static void activate_loop(struct fpi_ssm *ssm)
 		break;
 
 	case DEV_ACTIVATE_DATA_COMPLETE:
-		timeout = fpi_timeout_add(1, async_sleep_cb, ssm);
+		timeout = fpi_timeout_add(ssm->dev, 1, async_sleep_cb, ssm);
 
 		if (timeout == NULL) {
 			/* Failed to add timeout */
@@ -803,17 +792,25 @@ static int dev_open(struct fp_img_dev *dev, unsigned long driver_data)
 	int r;
 
 	data = (struct vfs5011_data *)g_malloc0(sizeof(*data));
-	data->capture_buffer =
-		(unsigned char *)g_malloc0(CAPTURE_LINES * VFS5011_LINE_SIZE);
+	data->stream = fpi_usb_stream_new(dev->udev, VFS5011_IN_ENDPOINT_DATA,
+		CAPTURE_TRANSFERS, CAPTURE_LINES * VFS5011_LINE_SIZE, 0,
+		capture_chunk_cb, capture_stopped_cb, dev);
+	if (!data->stream) {
+		g_free(data);
+		return -ENOMEM;
+	}
+	fpi_asmbl_buf_init(&data->rows, VFS5011_LINE_SIZE);
 	dev->priv = data;
+	fpi_dev_mem_account(dev->dev, sizeof(*data) +
+		CAPTURE_TRANSFERS * CAPTURE_LINES * VFS5011_LINE_SIZE);
 
-	r = libusb_reset_device(dev->udev);
+	r = fpi_usb_reset_device(dev->udev);
 	if (r != 0) {
 		fp_err("Failed to reset the device");
 		return r;
 	}
 
-	r = libusb_claim_interface(dev->udev, 0);
+	r = fpi_usb_claim_interface(dev->udev, 0);
 	if (r != 0) {
 		fp_err("Failed to claim interface: %s", libusb_error_name(r));
 		return r;
@@ -829,11 +826,11 @@ static int dev_open(struct fp_img_dev *dev, unsigned long driver_data)
 
 static void dev_close(struct fp_img_dev *dev)
 {
-	libusb_release_interface(dev->udev, 0);
+	fpi_usb_release_interface(dev->udev, 0);
 	struct vfs5011_data *data = (struct vfs5011_data *)dev->priv;
 	if (data != NULL) {
-		g_free(data->capture_buffer);
-		g_slist_free_full(data->rows, g_free);
+		fpi_usb_stream_free(data->stream);
+		fpi_asmbl_buf_free(&data->rows);
 		g_free(data);
 	}
 	fpi_imgdev_close_complete(dev);
@@ -867,15 +864,10 @@ static int dev_activate(struct fp_img_dev *dev, enum fp_imgdev_state state)
 
 static void dev_deactivate(struct fp_img_dev *dev)
 {
-	int r;
 	struct vfs5011_data *data = dev->priv;
 	if (data->loop_running) {
 		data->deactivating = TRUE;
-		if (data->flying_transfer) {
-			r = libusb_cancel_transfer(data->flying_transfer);
-			if (r < 0)
-				fp_dbg("cancel failed error %d", r);
-		}
+		fpi_usb_stream_stop(data->stream);
 	} else
 		fpi_imgdev_deactivate_complete(dev);
 }
@@ -169,3 +169,292 @@ void fpi_ssm_jump_to_state(struct fpi_ssm *machine, int state)
 	__ssm_call_handler(machine);
 }
 
+
+/* Transfer pools
+ * Drivers which keep submitting the same kind of requests can take their
+ * transfers from a pool instead of allocating a transfer and a buffer for
+ * each one. fpi_transfer_pool_get() returns a transfer with a buffer of the
+ * pool's size attached as transfer->buffer, which must be left in place
+ * (fill the transfer with it, or with a static buffer if the pool has no
+ * buffers). Once the transfer has completed, the callback hands it back
+ * with fpi_transfer_pool_put() instead of freeing it. No transfer flags
+ * asking libusb to free things may be set.
+ *
+ * A pool is typically created per endpoint when the device is opened, and
+ * freed when it is closed. Transfers still in flight then, e.g. cancelled
+ * ones, are freed when they are put back.
+ */
+
+struct fpi_transfer_pool {
+	size_t buffer_size;
+	/* unused transfers, linked through their user_data */
+	struct libusb_transfer *free_transfers;
+	unsigned int nr_busy;
+	gboolean freed;
+};
+
+struct fpi_transfer_pool *fpi_transfer_pool_new(size_t buffer_size)
+{
+	struct fpi_transfer_pool *pool = g_malloc0(sizeof(*pool));
+	pool->buffer_size = buffer_size;
+	return pool;
+}
+
+static void transfer_free(struct libusb_transfer *transfer)
+{
+	g_free(transfer->buffer);
+	libusb_free_transfer(transfer);
+}
+
+void fpi_transfer_pool_free(struct fpi_transfer_pool *pool)
+{
+	struct libusb_transfer *transfer;
+
+	if (!pool)
+		return;
+
+	while ((transfer = pool->free_transfers)) {
+		pool->free_transfers = transfer->user_data;
+		transfer_free(transfer);
+	}
+
+	if (pool->nr_busy) {
+		fp_dbg("%u transfers in flight, freeing later", pool->nr_busy);
+		pool->freed = TRUE;
+		return;
+	}
+	g_free(pool);
+}
+
+struct libusb_transfer *fpi_transfer_pool_get(struct fpi_transfer_pool *pool)
+{
+	struct libusb_transfer *transfer = pool->free_transfers;
+
+	if (transfer) {
+		pool->free_transfers = transfer->user_data;
+	} else {
+		transfer = libusb_alloc_transfer(0);
+		if (!transfer)
+			return NULL;
+		if (pool->buffer_size)
+			transfer->buffer = g_malloc(pool->buffer_size);
+	}
+
+	transfer->flags = 0;
+	transfer->user_data = NULL;
+	transfer->length = pool->buffer_size;
+	pool->nr_busy++;
+	return transfer;
+}
+
+void fpi_transfer_pool_put(struct fpi_transfer_pool *pool,
+	struct libusb_transfer *transfer)
+{
+	pool->nr_busy--;
+
+	if (!pool->buffer_size)
+		transfer->buffer = NULL;
+
+	if (pool->freed) {
+		transfer_free(transfer);
+		if (!pool->nr_busy)
+			g_free(pool);
+		return;
+	}
+
+	transfer->user_data = pool->free_transfers;
+	pool->free_transfers = transfer;
+}
+
+/* Streaming capture
+ * Swipe sensors send their data as fast as the finger moves, so waiting
+ * for each transfer to complete before submitting the next one loses data
+ * and leaves the bus idle. A stream keeps a number of bulk transfers in
+ * flight on an endpoint, each reading into its own slot of one ring
+ * buffer. The chunk callback is called for each completed transfer, in
+ * order, after which the transfer is resubmitted into the same slot: the
+ * data is only valid during the callback. Transfers which time out are
+ * handed over with whatever they received, like completed ones.
+ *
+ * fpi_usb_stream_stop() cancels the transfers in flight, and may be called
+ * from the chunk callback. The stopped callback is called once none are
+ * left, with 0, or with a negative error code if the stream stopped
+ * because a transfer failed. Chunks completing after the stream was asked
+ * to stop are dropped. A stream can be started again once it has stopped,
+ * and must only be freed then.
+ */
+
+struct fpi_usb_stream {
+	libusb_device_handle *devh;
+	unsigned char endpoint;
+	unsigned int timeout;
+	unsigned int nr_transfers;
+	size_t chunk_size;
+	unsigned char *ring;
+	struct libusb_transfer **transfers;
+
+	unsigned int nr_flying;
+	/* transfer submitted last, see fpi_usb_cancel_transfers() */
+	unsigned int newest;
+	gboolean running;
+	gboolean stopping;
+	/* within the chunk callback */
+	gboolean dispatching;
+	int status;
+
+	fpi_usb_stream_chunk_fn chunk_cb;
+	fpi_usb_stream_stopped_fn stopped_cb;
+	void *user_data;
+};
+
+static void stream_transfer_cb(struct libusb_transfer *transfer);
+
+struct fpi_usb_stream *fpi_usb_stream_new(libusb_device_handle *devh,
+	unsigned char endpoint, unsigned int nr_transfers, size_t chunk_size,
+	unsigned int timeout, fpi_usb_stream_chunk_fn chunk_cb,
+	fpi_usb_stream_stopped_fn stopped_cb, void *user_data)
+{
+	struct fpi_usb_stream *stream;
+	unsigned int i;
+
+	BUG_ON(nr_transfers < 1);
+	stream = g_malloc0(sizeof(*stream));
+	stream->devh = devh;
+	stream->endpoint = endpoint;
+	stream->timeout = timeout;
+	stream->nr_transfers = nr_transfers;
+	stream->chunk_size = chunk_size;
+	stream->chunk_cb = chunk_cb;
+	stream->stopped_cb = stopped_cb;
+	stream->user_data = user_data;
+	stream->ring = g_malloc(nr_transfers * chunk_size);
+	stream->transfers = g_new0(struct libusb_transfer *, nr_transfers);
+
+	for (i = 0; i < nr_transfers; i++) {
+		struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+		if (!transfer) {
+			fpi_usb_stream_free(stream);
+			return NULL;
+		}
+		libusb_fill_bulk_transfer(transfer, devh, endpoint,
+			stream->ring + i * chunk_size, chunk_size,
+			stream_transfer_cb, stream, timeout);
+		stream->transfers[i] = transfer;
+	}
+	return stream;
+}
+
+void fpi_usb_stream_free(struct fpi_usb_stream *stream)
+{
+	unsigned int i;
+
+	if (!stream)
+		return;
+
+	BUG_ON(stream->running);
+	for (i = 0; i < stream->nr_transfers; i++)
+		libusb_free_transfer(stream->transfers[i]);
+	g_free(stream->transfers);
+	g_free(stream->ring);
+	g_free(stream);
+}
+
+static void stream_stopped(struct fpi_usb_stream *stream)
+{
+	stream->running = FALSE;
+	stream->stopping = FALSE;
+	if (stream->stopped_cb)
+		stream->stopped_cb(stream, stream->status, stream->user_data);
+}
+
+static void stream_cancel(struct fpi_usb_stream *stream, int status)
+{
+	stream->stopping = TRUE;
+	stream->status = status;
+	fpi_usb_cancel_transfers(stream->transfers, stream->nr_transfers,
+		stream->newest);
+}
+
+static void stream_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct fpi_usb_stream *stream = transfer->user_data;
+	int r;
+
+	stream->nr_flying--;
+
+	if (!stream->stopping) {
+		switch (transfer->status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			stream->dispatching = TRUE;
+			stream->chunk_cb(stream, transfer->buffer,
+				transfer->actual_length, stream->user_data);
+			stream->dispatching = FALSE;
+			break;
+		default:
+			fp_dbg("transfer failed, status %d", transfer->status);
+			stream_cancel(stream, -EIO);
+			break;
+		}
+	}
+
+	if (!stream->stopping) {
+		r = fpi_usb_submit_transfer(transfer);
+		if (r == 0) {
+			stream->nr_flying++;
+			stream->newest = (transfer->buffer - stream->ring) /
+				stream->chunk_size;
+			return;
+		}
+		fp_dbg("resubmit failed, error %d", r);
+		stream_cancel(stream, -EIO);
+	}
+
+	if (!stream->nr_flying)
+		stream_stopped(stream);
+}
+
+/* Returns a negative error code if no transfer could be submitted, in which
+ * case the stopped callback isn't called. A failure to submit the others
+ * stops the stream like a failed transfer. */
+int fpi_usb_stream_start(struct fpi_usb_stream *stream)
+{
+	unsigned int i;
+	int r;
+
+	BUG_ON(stream->running);
+	stream->status = 0;
+	stream->stopping = FALSE;
+
+	for (i = 0; i < stream->nr_transfers; i++) {
+		r = fpi_usb_submit_transfer(stream->transfers[i]);
+		if (r < 0) {
+			if (i == 0)
+				return r;
+			stream->running = TRUE;
+			stream_cancel(stream, r);
+			return 0;
+		}
+		stream->nr_flying++;
+		stream->newest = i;
+	}
+	stream->running = TRUE;
+	return 0;
+}
+
+void fpi_usb_stream_stop(struct fpi_usb_stream *stream)
+{
+	if (!stream->running || stream->stopping)
+		return;
+
+	stream_cancel(stream, 0);
+	/* from the chunk callback, the transfer being handed over
+	 * completes the stop */
+	if (!stream->nr_flying && !stream->dispatching)
+		stream_stopped(stream);
+}
+
+gboolean fpi_usb_stream_is_running(struct fpi_usb_stream *stream)
+{
+	return stream->running;
+}
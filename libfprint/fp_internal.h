@@ -39,17 +39,27 @@ enum fpi_log_level {
 	FPRINT_LOG_LEVEL_INFO,
 	FPRINT_LOG_LEVEL_WARNING,
 	FPRINT_LOG_LEVEL_ERROR,
+	FPRINT_LOG_LEVEL_NONE,
 };
 
 void fpi_log(enum fpi_log_level, const char *component, const char *function,
 	const char *format, ...);
+void fpi_log_set_limit(const char *component, unsigned int per_second);
+
+/* The lowest level of the messages which get printed. The logging macros
+ * check it before evaluating their arguments, so that a disabled message
+ * only costs a branch. */
+extern int fpi_log_threshold;
 
 #ifndef FP_COMPONENT
 #define FP_COMPONENT NULL
 #endif
 
 #ifdef ENABLE_LOGGING
-#define _fpi_log(level, fmt...) fpi_log(level, FP_COMPONENT, __FUNCTION__, fmt)
+#define _fpi_log(level, fmt...) do { \
+		if (G_UNLIKELY((level) >= fpi_log_threshold)) \
+			fpi_log(level, FP_COMPONENT, __FUNCTION__, fmt); \
+	} while (0)
 #else
 #define _fpi_log(level, fmt...)
 #endif
@@ -100,6 +110,7 @@ enum fp_dev_state {
 struct fp_driver **fprint_get_drivers (void);
 
 struct fp_dev {
+	struct fp_context *ctx;
 	struct fp_driver *drv;
 	libusb_device_handle *udev;
 	uint32_t devtype;
@@ -107,6 +118,17 @@ struct fp_dev {
 
 	int nr_enroll_stages;
 
+	/* instrumentation of the current scan, see stats.c */
+	struct fp_stats stats;
+	gint64 stats_start;
+	gboolean stats_reported;
+	/* when the operation being stopped was asked to stop */
+	gint64 stop_start;
+
+	/* memory accounting, see memory.c */
+	size_t mem_driver;
+	size_t mem_peak;
+
 	/* read-only to drivers */
 	struct fp_print_data *verify_data;
 
@@ -140,6 +162,11 @@ struct fp_dev {
 
 	/* FIXME: better place to put this? */
 	struct fp_print_data **identify_gallery;
+	struct fp_gallery *identify_indexed_gallery;
+	/* shared with other devices, see fp_async_identify_session_start() */
+	struct fp_identify_session *identify_session;
+	/* keep identifying fingers until stopped */
+	gboolean identify_continuous;
 };
 
 enum fp_imgdev_state {
@@ -162,6 +189,7 @@ enum fp_imgdev_enroll_state {
 	IMG_ACQUIRE_STATE_ACTIVATING,
 	IMG_ACQUIRE_STATE_AWAIT_FINGER_ON,
 	IMG_ACQUIRE_STATE_AWAIT_IMAGE,
+	IMG_ACQUIRE_STATE_PROCESSING,
 	IMG_ACQUIRE_STATE_AWAIT_FINGER_OFF,
 	IMG_ACQUIRE_STATE_DONE,
 	IMG_ACQUIRE_STATE_DEACTIVATING,
@@ -172,6 +200,15 @@ enum fp_imgdev_verify_state {
 	IMG_VERIFY_STATE_ACTIVATING
 };
 
+/* How often a sensor without a finger interrupt is polled for a finger, all
+ * in milliseconds. The interval starts at min_interval and doubles with each
+ * poll once no finger has been seen for idle_after, up to max_interval. */
+struct fpi_poll_policy {
+	unsigned int min_interval;
+	unsigned int max_interval;
+	unsigned int idle_after;
+};
+
 struct fp_img_dev {
 	struct fp_dev *dev;
 	libusb_device_handle *udev;
@@ -186,6 +223,40 @@ struct fp_img_dev {
 
 	/* FIXME: better place to put this? */
 	size_t identify_match_offset;
+	/* index of the enrolled sample which matched during verification */
+	size_t verify_match_sample;
+
+	/* image being processed on the worker thread, if any */
+	struct img_process *processing;
+	/* the finger was removed while the image was being processed */
+	gboolean finger_off_pending;
+
+	/* finger detection polling, see fpi_imgdev_schedule_poll() */
+	struct fpi_poll_policy poll_policy;
+	unsigned int poll_interval;
+	gint64 poll_activity;
+	struct fpi_timeout *poll_timeout;
+	void (*poll_cb)(void *data);
+	void *poll_data;
+
+	/* recycled images, for drivers declaring a fixed image size */
+	struct fpi_img_pool *img_pool;
+
+	/* warm standby between actions, read-only to drivers: while set
+	 * during activate(), the sensor is still initialised from the last
+	 * deactivation */
+	gboolean standby;
+	unsigned int standby_timeout;
+	struct fpi_timeout *standby_timer;
+
+	/* captured images are copied there, see fp_dev_set_img_archive() */
+	struct fp_img_archive *archive;
+
+	/* partial swipes shown while capturing, see fp_dev_set_img_preview() */
+	fp_img_preview_cb preview_cb;
+	void *preview_data;
+	unsigned int preview_interval;
+	gint64 preview_last;
 
 	void *priv;
 };
@@ -232,6 +303,9 @@ enum fp_print_data_type fpi_driver_get_data_type(struct fp_driver *drv);
 
 /* flags for fp_img_driver.flags */
 #define FP_IMGDRV_SUPPORTS_UNCONDITIONAL_CAPTURE (1 << 0)
+/* deactivate() leaves the sensor initialised, and activate() skips the
+ * initialisation while fp_img_dev.standby is set, see imgdev.c */
+#define FP_IMGDRV_SUPPORTS_STANDBY (1 << 1)
 
 struct fp_img_driver {
 	struct fp_driver driver;
@@ -312,8 +386,55 @@ extern struct fp_img_driver vfs0050_driver;
 extern struct fp_img_driver elan_driver;
 #endif
 
-extern libusb_context *fpi_usb_ctx;
-extern GSList *opened_devices;
+/* A context is only used by one thread at a time. Devices, timeouts and
+ * worker completions belong to the context their device was discovered
+ * from, and are only handled by fp_context_handle_events() on it. */
+struct fp_context {
+	libusb_context *usb_ctx;
+	GSList *opened_devices;
+
+	/* pending timers, a binary heap with the timer that is expiring
+	 * soonest first, and unused timers kept for reuse */
+	struct fpi_timeout **timers;
+	unsigned int nr_timers;
+	unsigned int timers_size;
+	struct fpi_timeout *free_timers;
+	guint64 timer_seq;
+	/* see fp_context_set_timeout_batch_limit() */
+	unsigned int timeout_batch_limit;
+	/* fd becoming readable when the first timer expires, or -1 */
+	int timer_fd;
+	struct timeval timer_fd_expiry;
+
+	/* notifiers for added or removed poll fds */
+	fp_pollfd_added_cb fd_added_cb;
+	fp_pollfd_removed_cb fd_removed_cb;
+
+	/* worker thread, see fpi_worker_run() */
+	GThreadPool *worker_pool;
+	GAsyncQueue *finished_work;
+	/* an eventfd, or a pipe, written to wake up the context */
+	int wake_fds[2];
+	GMutex worker_lock;
+
+	/* see fp_context_hotplug_register(): the discovered devices which are
+	 * plugged in, as a NULL-terminated array */
+	gboolean hotplug_registered;
+	int hotplug_handle;
+	GPtrArray *hotplug_devs;
+	fp_hotplug_cb hotplug_cb;
+	void *hotplug_cb_data;
+
+	/* see fp_context_set_stats_cb() */
+	fp_stats_cb stats_cb;
+	void *stats_cb_data;
+};
+
+extern struct fp_context *fpi_default_ctx;
+
+int fpi_dev_open_handle(struct fp_context *ctx, struct fp_driver *drv,
+	unsigned long driver_data, libusb_device_handle *udevh,
+	fp_dev_open_cb cb, void *user_data);
 
 void fpi_img_driver_setup(struct fp_img_driver *idriver);
 
@@ -321,6 +442,7 @@ void fpi_img_driver_setup(struct fp_img_driver *idriver);
 	container_of((drv), struct fp_img_driver, driver)
 
 struct fp_dscv_dev {
+	struct fp_context *ctx;
 	struct libusb_device *udev;
 	struct fp_driver *drv;
 	unsigned long driver_data;
@@ -339,9 +461,28 @@ enum fp_print_data_type {
 	PRINT_DATA_NBIS_MINUTIAE,
 };
 
+struct bz_template;
+struct xyt_struct;
+
+/* Sample data of PRINT_DATA_NBIS_MINUTIAE prints: the number of minutiae
+ * followed by the x, y and theta columns, nrows values each */
+struct fpi_xyt {
+	int nrows;
+	int cols[0];
+};
+
+#define FPI_XYT_SIZE(nrows)	(sizeof(struct fpi_xyt) + 3 * (nrows) * sizeof(int))
+
 struct fp_print_data_item {
 	size_t length;
-	unsigned char data[0];
+	/* matcher template compiled from data on first use, or borrowed from
+	 * a compiled gallery along with data, see template_borrowed */
+	struct bz_template *bz_template;
+	gboolean template_borrowed;
+	/* points at buf, or at borrowed memory which outlives the item, such
+	 * as a print database mapping */
+	unsigned char *data;
+	unsigned char buf[0];
 };
 
 struct fp_print_data {
@@ -349,6 +490,7 @@ struct fp_print_data {
 	uint32_t devtype;
 	enum fp_print_data_type type;
 	GSList *prints;
+	volatile gint refcount;
 };
 
 struct fpi_print_data_fp2 {
@@ -365,8 +507,29 @@ struct fpi_print_data_item_fp2 {
 } __attribute__((__packed__));
 
 void fpi_data_exit(void);
+char *fpi_data_get_store_sibling(const char *name);
 struct fp_print_data *fpi_print_data_new(struct fp_dev *dev);
+struct fp_print_data *fpi_print_data_new_typed(uint16_t driver_id,
+	uint32_t devtype, enum fp_print_data_type type);
+void fpi_print_data_move_samples(struct fp_print_data *to,
+	struct fp_print_data *from);
 struct fp_print_data_item *fpi_print_data_item_new(size_t length);
+struct fp_print_data_item *fpi_print_data_item_borrow(
+	const unsigned char *data, size_t length);
+/* Formats of serialized prints */
+enum fpi_print_data_format {
+	FPI_PRINT_DATA_FP2,	/* host layout, can be used in place */
+	FPI_PRINT_DATA_FP3,	/* portable */
+	FPI_PRINT_DATA_FP4,	/* portable, with packed minutiae */
+};
+
+size_t fpi_print_data_copy_data(struct fp_print_data *data,
+	unsigned char *buf, size_t buflen, enum fpi_print_data_format format);
+gboolean fpi_print_data_compression_enabled(void);
+struct fp_print_data *fpi_print_data_from_data(const unsigned char *buf,
+	size_t buflen, gboolean borrow);
+struct fp_print_data **fpi_print_data_gallery_new(size_t nr_prints,
+	size_t extra_size, void **extra);
 gboolean fpi_print_data_compatible(uint16_t driver_id1, uint32_t devtype1,
 	enum fp_print_data_type type1, uint16_t driver_id2, uint32_t devtype2,
 	enum fp_print_data_type type2);
@@ -393,35 +556,91 @@ struct fp_img {
 	size_t length;
 	uint16_t flags;
 	struct fp_minutiae *minutiae;
-	unsigned char *binarized;
+	/* summed up along with the minutiae, valid once they are detected */
+	struct fp_img_quality quality;
+	/* packed one bit per pixel, see nbis/mindtct/bitimage.c */
+	uint64_t *binarized;
+	/* pool the image returns to when freed, if any */
+	struct fpi_img_pool *pool;
+	volatile gint refcount;
+	/* serializes the lazy computation of minutiae and binarized */
+	GMutex lock;
 	unsigned char data[0];
 };
 
 struct fp_img *fpi_img_new(size_t length);
 struct fp_img *fpi_img_new_for_imgdev(struct fp_img_dev *dev);
 struct fp_img *fpi_img_resize(struct fp_img *img, size_t newsize);
+struct fpi_img_pool *fpi_img_pool_new(size_t length);
+void fpi_img_pool_close(struct fpi_img_pool *pool);
+size_t fpi_img_pool_get_memory_usage(struct fpi_img_pool *pool);
 gboolean fpi_img_is_sane(struct fp_img *img);
+void fpi_img_archive_add(struct fp_img_archive *archive, struct fp_dev *dev,
+	struct fp_img *img);
 int fpi_img_detect_minutiae(struct fp_img *img);
+guint64 fpi_img_get_comparisons(void);
+int fpi_img_get_template_max_minutiae(void);
+void fpi_img_set_cancel(volatile gint *cancel);
+typedef void (*fpi_stage_fn)(const int stage, void *data);
+int fpi_img_detect_minutiae_staged(struct fp_img *img, fpi_stage_fn stage_done,
+	void *stage_data);
+int fpi_img_check_quality(struct fp_img *img, enum fp_scan_type scan_type);
 int fpi_img_to_print_data(struct fp_img_dev *imgdev, struct fp_img *img,
 	struct fp_print_data **ret);
 int fpi_img_compare_print_data(struct fp_print_data *enrolled_print,
 	struct fp_print_data *new_print);
+int fpi_img_verify_print_data(struct fp_print_data *enrolled_print,
+	struct fp_print_data *new_print, int match_threshold,
+	size_t *match_sample);
 int fpi_img_compare_print_data_to_gallery(struct fp_print_data *print,
 	struct fp_print_data **gallery, int match_threshold, size_t *match_offset);
+struct bz_ctx *fpi_img_get_bz_ctx(void);
+struct bz_template *fpi_print_data_item_get_template(
+	struct fp_print_data_item *item);
+void fpi_print_data_item_get_xyt(struct fp_print_data_item *item,
+	struct xyt_struct *xyt);
+struct fp_print_data_item *fpi_print_data_item_from_xyt(
+	const unsigned char *buf, size_t length, gboolean borrow);
+int fpi_print_data_consolidate(struct fp_print_data *print,
+	struct fp_print_data **ret);
+gboolean fpi_print_data_consolidation_enabled(void);
+int fpi_gallery_identify(struct fp_gallery *gallery,
+	struct fp_print_data *print, int match_threshold, size_t *match_id);
 struct fp_img *fpi_im_resize(struct fp_img *img, unsigned int w_factor, unsigned int h_factor);
+void fpi_img_exit(void);
+
+#ifdef HAVE_OPENCL
+struct fpi_offload;
+struct fpi_offload *fpi_offload_new(void);
+void fpi_offload_free(struct fpi_offload *offload);
+int fpi_offload_score(struct fpi_offload *offload,
+	struct fp_print_data **prints, int nr_prints, unsigned int generation,
+	struct bz_template *probe, int *scores);
+#endif
 
 /* polling and timeouts */
 
-void fpi_poll_init(void);
-void fpi_poll_exit(void);
+void fpi_poll_init(struct fp_context *ctx);
+void fpi_poll_exit(struct fp_context *ctx);
 
 typedef void (*fpi_timeout_fn)(void *data);
 
 struct fpi_timeout;
-struct fpi_timeout *fpi_timeout_add(unsigned int msec, fpi_timeout_fn callback,
-	void *data);
+struct fpi_timeout *fpi_timeout_add(struct fp_dev *dev, unsigned int msec,
+	fpi_timeout_fn callback, void *data);
 void fpi_timeout_cancel(struct fpi_timeout *timeout);
 
+typedef void (*fpi_work_fn)(void *data);
+int fpi_worker_run(struct fp_context *ctx, fpi_work_fn work, fpi_work_fn done,
+	void *data);
+GThreadPool *fpi_worker_pool_new(unsigned int nr_threads);
+int fpi_worker_run_in_pool(GThreadPool *pool, struct fp_context *ctx,
+	fpi_work_fn work, fpi_work_fn done, void *data);
+struct fp_gallery *fpi_identify_session_get_gallery(
+	struct fp_identify_session *session);
+int fpi_identify_session_run(struct fp_identify_session *session,
+	struct fp_context *ctx, fpi_work_fn work, fpi_work_fn done, void *data);
+
 /* async drv <--> lib comms */
 
 struct fpi_ssm;
@@ -458,6 +677,68 @@ void fpi_ssm_jump_to_state(struct fpi_ssm *machine, int state);
 void fpi_ssm_mark_completed(struct fpi_ssm *machine);
 void fpi_ssm_mark_aborted(struct fpi_ssm *machine, int error);
 
+/* pool of reusable transfers, each with a buffer of the same size */
+struct fpi_transfer_pool;
+struct fpi_transfer_pool *fpi_transfer_pool_new(size_t buffer_size);
+void fpi_transfer_pool_free(struct fpi_transfer_pool *pool);
+struct libusb_transfer *fpi_transfer_pool_get(struct fpi_transfer_pool *pool);
+void fpi_transfer_pool_put(struct fpi_transfer_pool *pool,
+	struct libusb_transfer *transfer);
+
+/* streaming capture: several bulk transfers kept in flight on an endpoint */
+struct fpi_usb_stream;
+typedef void (*fpi_usb_stream_chunk_fn)(struct fpi_usb_stream *stream,
+	unsigned char *data, int length, void *user_data);
+typedef void (*fpi_usb_stream_stopped_fn)(struct fpi_usb_stream *stream,
+	int status, void *user_data);
+struct fpi_usb_stream *fpi_usb_stream_new(libusb_device_handle *devh,
+	unsigned char endpoint, unsigned int nr_transfers, size_t chunk_size,
+	unsigned int timeout, fpi_usb_stream_chunk_fn chunk_cb,
+	fpi_usb_stream_stopped_fn stopped_cb, void *user_data);
+void fpi_usb_stream_free(struct fpi_usb_stream *stream);
+int fpi_usb_stream_start(struct fpi_usb_stream *stream);
+void fpi_usb_stream_stop(struct fpi_usb_stream *stream);
+gboolean fpi_usb_stream_is_running(struct fpi_usb_stream *stream);
+
+/* instrumentation */
+void fpi_stats_begin(struct fp_dev *dev);
+void fpi_stats_stage(struct fp_dev *dev, enum fp_stats_stage stage);
+void fpi_stats_stage_at(struct fp_dev *dev, enum fp_stats_stage stage,
+	gint64 time);
+void fpi_stats_count(struct fp_dev *dev, enum fp_stats_counter counter,
+	guint64 n);
+void fpi_stats_report(struct fp_dev *dev, int result);
+void fpi_stats_stop_begin(struct fp_dev *dev);
+void fpi_stats_stopped(struct fp_dev *dev);
+
+/* memory accounting */
+void fpi_dev_mem_account(struct fp_dev *dev, gssize delta);
+void fpi_dev_mem_update(struct fp_dev *dev);
+size_t fpi_imgdev_get_memory_usage(struct fp_img_dev *imgdev);
+
+/* calibration cache, see calibration.c */
+int fpi_calibration_load(struct fp_dev *dev, uint8_t version, void *data,
+	size_t length, unsigned int max_age);
+void fpi_calibration_save(struct fp_dev *dev, uint8_t version,
+	const void *data, size_t length);
+void fpi_calibration_forget(struct fp_dev *dev);
+
+/* usb device access, recorded or replayed when tracing, see usbtrace.c */
+int fpi_usb_submit_transfer(struct libusb_transfer *transfer);
+int fpi_usb_cancel_transfer(struct libusb_transfer *transfer);
+unsigned int fpi_usb_cancel_transfers(struct libusb_transfer **transfers,
+	unsigned int nr_transfers, unsigned int newest);
+gboolean fpi_usb_is_traced(libusb_device_handle *devh);
+int fpi_usb_claim_interface(libusb_device_handle *devh, int iface);
+int fpi_usb_release_interface(libusb_device_handle *devh, int iface);
+int fpi_usb_set_configuration(libusb_device_handle *devh, int config);
+int fpi_usb_reset_device(libusb_device_handle *devh);
+void fpi_usb_close(libusb_device_handle *devh);
+void fpi_usb_trace_attach(struct fp_dev *dev, unsigned long driver_data);
+int fpi_usb_replay_open(struct fp_context *ctx, const char *path,
+	gboolean realtime, fp_dev_open_cb callback, void *user_data);
+unsigned int fpi_usb_replay_mismatches(struct fp_dev *dev);
+
 void fpi_drvcb_open_complete(struct fp_dev *dev, int status);
 void fpi_drvcb_close_complete(struct fp_dev *dev);
 
@@ -491,10 +772,33 @@ void fpi_imgdev_report_finger_status(struct fp_img_dev *imgdev,
 void fpi_imgdev_image_captured(struct fp_img_dev *imgdev, struct fp_img *img);
 void fpi_imgdev_abort_scan(struct fp_img_dev *imgdev, int result);
 void fpi_imgdev_session_error(struct fp_img_dev *imgdev, int error);
+void fpi_imgdev_report_assembled(struct fp_img_dev *imgdev,
+	unsigned int nr_frames);
+void fpi_imgdev_preview(struct fp_img_dev *imgdev,
+	enum fp_img_preview_format format, const unsigned char *data,
+	unsigned int width, unsigned int height, size_t stride);
+void fpi_imgdev_set_poll_policy(struct fp_img_dev *imgdev,
+	const struct fpi_poll_policy *policy);
+unsigned int fpi_imgdev_poll_interval(struct fp_img_dev *imgdev);
+int fpi_imgdev_set_standby_timeout(struct fp_img_dev *imgdev,
+	unsigned int timeout);
+int fpi_imgdev_schedule_poll(struct fp_img_dev *imgdev,
+	fpi_timeout_fn callback, void *data);
 
 /* utils */
 int fpi_std_sq_dev(const unsigned char *buf, int size);
 int fpi_mean_sq_diff_norm(unsigned char *buf1, unsigned char *buf2, int size);
 
+/* raw pixel conversion */
+void fpi_expand_4bpp(const unsigned char *in, unsigned int size,
+	unsigned char *out);
+void fpi_minmax_u16(const unsigned short *in, unsigned int size,
+	unsigned short *min, unsigned short *max);
+void fpi_normalize_u16(const unsigned short *in, unsigned int size,
+	unsigned short min, unsigned short max, unsigned char *out);
+void fpi_transpose_u16(const unsigned short *in, unsigned int in_stride,
+	unsigned short *out, unsigned int out_stride,
+	unsigned int width, unsigned int height);
+
 #endif
 
@@ -34,6 +34,11 @@ struct fp_dev;
 struct fp_driver;
 struct fp_print_data;
 struct fp_img;
+struct fp_gallery;
+struct fp_identify_session;
+struct fp_img_archive;
+struct fp_print_db;
+struct fp_context;
 
 /* misc/general stuff */
 
@@ -73,6 +78,7 @@ enum fp_scan_type fp_driver_get_scan_type(struct fp_driver *drv);
 
 /* Device discovery */
 struct fp_dscv_dev **fp_discover_devs(void);
+struct fp_dscv_dev **fp_context_discover_devs(struct fp_context *ctx);
 void fp_dscv_devs_free(struct fp_dscv_dev **devs);
 struct fp_driver *fp_dscv_dev_get_driver(struct fp_dscv_dev *dev);
 uint32_t fp_dscv_dev_get_devtype(struct fp_dscv_dev *dev);
@@ -85,6 +91,34 @@ struct fp_dscv_dev *fp_dscv_dev_for_print_data(struct fp_dscv_dev **devs,
 struct fp_dscv_dev *fp_dscv_dev_for_dscv_print(struct fp_dscv_dev **devs,
 	struct fp_dscv_print *print);
 
+/** \ingroup dscv_dev
+ * Events reported to a #fp_hotplug_cb.
+ */
+enum fp_hotplug_event {
+	/** A supported device was plugged in, or was already there when the
+	 * callback was registered */
+	FP_HOTPLUG_DEVICE_ARRIVED = 1,
+	/** A supported device was unplugged */
+	FP_HOTPLUG_DEVICE_LEFT = 2,
+};
+
+/** \ingroup dscv_dev
+ * Callback notified of supported devices being plugged in and unplugged,
+ * see fp_context_hotplug_register().
+ * \param ctx the context the callback was registered on
+ * \param ddev the discovered device, valid until the callback notified of
+ * its removal returns
+ * \param event what happened to the device
+ * \param user_data the user data passed to fp_context_hotplug_register()
+ */
+typedef void (*fp_hotplug_cb)(struct fp_context *ctx,
+	struct fp_dscv_dev *ddev, enum fp_hotplug_event event, void *user_data);
+
+int fp_context_hotplug_register(struct fp_context *ctx, fp_hotplug_cb cb,
+	void *user_data);
+void fp_context_hotplug_deregister(struct fp_context *ctx);
+struct fp_dscv_dev **fp_context_get_hotplug_devs(struct fp_context *ctx);
+
 static inline uint16_t fp_dscv_dev_get_driver_id(struct fp_dscv_dev *dev)
 {
 	return fp_driver_get_driver_id(fp_dscv_dev_get_driver(dev));
@@ -123,6 +157,105 @@ int fp_dev_img_capture(struct fp_dev *dev, int unconditional,
 	struct fp_img **image);
 int fp_dev_get_img_width(struct fp_dev *dev);
 int fp_dev_get_img_height(struct fp_dev *dev);
+int fp_dev_set_standby_timeout(struct fp_dev *dev, unsigned int timeout);
+int fp_dev_set_img_archive(struct fp_dev *dev,
+	struct fp_img_archive *archive);
+
+/** \ingroup dev
+ * Layouts of the pixels of a preview, see fp_dev_set_img_preview().
+ */
+enum fp_img_preview_format {
+	/** One byte per pixel, row after row */
+	FP_IMG_PREVIEW_GREY8 = 0,
+	/** Two pixels of 0 to 15 per byte, column after column, the pixel of
+	 * the even row in the low nibble */
+	FP_IMG_PREVIEW_GREY4_COLUMNS,
+};
+
+/** \ingroup dev
+ * Part of a swipe, as the driver holds it while capturing. The pixels are
+ * those read from the sensor, before the corrections and assembly giving
+ * the final image.
+ */
+struct fp_img_preview {
+	enum fp_img_preview_format format;
+	unsigned int width;
+	unsigned int height;
+	/** Bytes from the start of a row, or of a column for
+	 * FP_IMG_PREVIEW_GREY4_COLUMNS, to the start of the next */
+	size_t stride;
+	/** Only valid during the callback */
+	const unsigned char *data;
+};
+
+typedef void (*fp_img_preview_cb)(struct fp_dev *dev,
+	const struct fp_img_preview *preview, void *user_data);
+int fp_dev_set_img_preview(struct fp_dev *dev, fp_img_preview_cb callback,
+	unsigned int interval, void *user_data);
+
+/** \ingroup dev
+ * Stages of a scan, in the order they are normally reached, see
+ * \ref fp_stats.
+ */
+enum fp_stats_stage {
+	/** The finger was detected on the sensor */
+	FP_STATS_FINGER_ON = 0,
+	/** The swipe frames were assembled into an image */
+	FP_STATS_ASSEMBLED,
+	/** The driver handed over the image */
+	FP_STATS_CAPTURED,
+	/** The image was standardized */
+	FP_STATS_STANDARDIZED,
+	/** The minutiae were extracted */
+	FP_STATS_EXTRACTED,
+	/** The print was matched against the enrolled one or the gallery */
+	FP_STATS_MATCHED,
+	FP_STATS_NR_STAGES,
+};
+
+/** \ingroup dev
+ * Counters of an enroll, verify, identify or capture operation, see
+ * \ref fp_stats.
+ */
+enum fp_stats_counter {
+	/** Scans which ended with one of the RETRY results */
+	FP_STATS_RETRIES = 0,
+	/** Frames assembled into images, for swipe sensors */
+	FP_STATS_FRAMES,
+	/** Minutiae extracted from the images */
+	FP_STATS_MINUTIAE,
+	/** Prints compared by the matcher */
+	FP_STATS_COMPARISONS,
+	FP_STATS_NR_COUNTERS,
+};
+
+/** \ingroup dev
+ * Instrumentation of the last scan of a device. Each stage holds the time it
+ * completed at, in microseconds since the scan started, or -1 if it wasn't
+ * reached. The first scan of an operation starts with it, the following ones
+ * when the result of the previous one is reported. The counters add up from
+ * the start of the operation.
+ */
+struct fp_stats {
+	int64_t stages[FP_STATS_NR_STAGES];
+	uint64_t counters[FP_STATS_NR_COUNTERS];
+	/** Time the last stop of an operation took, in microseconds, from
+	 * the fp_async_*_stop() call to the stop callback, or 0 if no
+	 * operation was stopped yet. Read it from the stop callback. */
+	int64_t stop_latency;
+};
+
+void fp_dev_get_stats(struct fp_dev *dev, struct fp_stats *stats);
+
+/** \ingroup dev
+ * Memory held by an object, in bytes, along with the most it ever held.
+ */
+struct fp_memory_usage {
+	size_t current;
+	size_t peak;
+};
+
+void fp_dev_get_memory_usage(struct fp_dev *dev, struct fp_memory_usage *usage);
 
 /** \ingroup dev
  * Enrollment result codes returned from fp_enroll_finger().
@@ -251,20 +384,131 @@ static inline int fp_identify_finger(struct fp_dev *dev,
 	return fp_identify_finger_img(dev, print_gallery, match_offset, NULL);
 }
 
+/** \ingroup dev
+ * Gallery search modes used during identification, see
+ * fp_set_identify_mode().
+ */
+enum fp_identify_mode {
+	/** Report the first print in the gallery which reaches the match
+	 * threshold. Prints after it are not examined. */
+	FP_IDENTIFY_FIRST_MATCH = 0,
+	/** Examine the whole gallery and report the best scoring print, if it
+	 * reaches the match threshold. */
+	FP_IDENTIFY_BEST_MATCH,
+};
+
+/** \ingroup dev
+ * Arithmetic used by minutiae extraction, see
+ * fp_set_extraction_precision().
+ */
+enum fp_extraction_precision {
+	/** Double precision, as in the NIST reference implementation */
+	FP_EXTRACTION_PRECISE = 0,
+	/** Single precision for the ridge flow analysis */
+	FP_EXTRACTION_FAST,
+};
+
+void fp_set_identify_threads(unsigned int nr_threads);
+int fp_set_identify_cpus(const unsigned int *cpus, size_t nr_cpus);
+void fp_set_extraction_threads(unsigned int nr_threads);
+void fp_set_extraction_precision(enum fp_extraction_precision precision);
+void fp_set_extraction_scan_bands(int enabled);
+void fp_set_template_max_minutiae(unsigned int max_minutiae);
+void fp_set_identify_mode(enum fp_identify_mode mode);
+void fp_set_identify_prefilter(int min_similarity);
+void fp_set_identify_prescreen(unsigned int nr_minutiae,
+	unsigned int shortlist);
+void fp_get_identify_prefilter_stats(uint64_t *passed, uint64_t *rejected);
+void fp_reset_identify_prefilter_stats(void);
+
+int fp_identify_finger_gallery_img(struct fp_dev *dev,
+	struct fp_gallery *gallery, size_t *match_id, struct fp_img **img);
+
+/* Indexed galleries */
+struct fp_gallery *fp_gallery_new(void);
+void fp_gallery_free(struct fp_gallery *gallery);
+int fp_gallery_add_print(struct fp_gallery *gallery,
+	struct fp_print_data *print);
+int fp_gallery_remove_print(struct fp_gallery *gallery, int id);
+int fp_gallery_get_nr_prints(struct fp_gallery *gallery);
+void fp_gallery_set_max_candidates(struct fp_gallery *gallery,
+	unsigned int max_candidates);
+void fp_gallery_set_adaptive_order(struct fp_gallery *gallery,
+	int enabled);
+int fp_gallery_set_offload(struct fp_gallery *gallery,
+	unsigned int shortlist);
+void fp_gallery_get_memory_usage(struct fp_gallery *gallery,
+	struct fp_memory_usage *usage);
+int fp_gallery_save_compiled(struct fp_gallery *gallery, const char *path);
+int fp_gallery_open_compiled(const char *path, struct fp_gallery **gallery);
+int fp_gallery_reload(struct fp_gallery *gallery);
+
+/* Identification sessions */
+struct fp_identify_session *fp_identify_session_new(
+	struct fp_gallery *gallery, unsigned int nr_threads);
+void fp_identify_session_free(struct fp_identify_session *session);
+
 /* Data handling */
 int fp_print_data_load(struct fp_dev *dev, enum fp_finger finger,
 	struct fp_print_data **data);
 int fp_print_data_from_dscv_print(struct fp_dscv_print *print,
 	struct fp_print_data **data);
 int fp_print_data_save(struct fp_print_data *data, enum fp_finger finger);
+int fp_print_data_save_new(struct fp_print_data *data, enum fp_finger finger);
 int fp_print_data_delete(struct fp_dev *dev, enum fp_finger finger);
+int fp_print_data_load_gallery(struct fp_dev *dev,
+	struct fp_print_data ***gallery, enum fp_finger **fingers);
+void fp_print_data_gallery_free(struct fp_print_data **gallery);
 void fp_print_data_free(struct fp_print_data *data);
+struct fp_print_data *fp_print_data_ref(struct fp_print_data *data);
+size_t fp_print_data_get_memory_usage(struct fp_print_data *data);
+size_t fp_print_data_gallery_get_memory_usage(struct fp_print_data **gallery);
 size_t fp_print_data_get_data(struct fp_print_data *data, unsigned char **ret);
+size_t fp_print_data_copy_data(struct fp_print_data *data, unsigned char *buf,
+	size_t buflen);
+int fp_print_data_score_gallery(struct fp_print_data *print,
+	struct fp_print_data **gallery, int *scores);
+int fp_print_data_consolidate(struct fp_print_data *print,
+	struct fp_print_data **ret);
+void fp_set_enroll_consolidation(int enabled);
+int fp_print_data_find_duplicates(struct fp_print_data **prints,
+	int match_threshold, int min_similarity, unsigned int nr_threads,
+	int *clusters);
 struct fp_print_data *fp_print_data_from_data(unsigned char *buf,
 	size_t buflen);
+struct fp_print_data *fp_print_data_from_data_borrowed(const unsigned char *buf,
+	size_t buflen);
+void fp_set_print_data_cache_limits(unsigned int max_prints,
+	size_t max_size);
+void fp_get_print_data_cache_stats(uint64_t *hits, uint64_t *misses);
+void fp_reset_print_data_cache_stats(void);
+void fp_set_print_data_compression(int enabled);
 uint16_t fp_print_data_get_driver_id(struct fp_print_data *data);
 uint32_t fp_print_data_get_devtype(struct fp_print_data *data);
 
+/* Print databases */
+int fp_print_db_open(const char *path, struct fp_print_db **db);
+void fp_print_db_close(struct fp_print_db *db);
+int fp_print_db_get_nr_prints(struct fp_print_db *db);
+int fp_print_db_find(struct fp_print_db *db, const char *name,
+	enum fp_finger finger, uint16_t driver_id, uint32_t devtype);
+const char *fp_print_db_get_name(struct fp_print_db *db, int index);
+enum fp_finger fp_print_db_get_finger(struct fp_print_db *db, int index);
+uint16_t fp_print_db_get_driver_id(struct fp_print_db *db, int index);
+uint32_t fp_print_db_get_devtype(struct fp_print_db *db, int index);
+int fp_print_db_load(struct fp_print_db *db, int index,
+	struct fp_print_data **data);
+int fp_print_db_load_gallery(struct fp_print_db *db, struct fp_dev *dev,
+	struct fp_print_data ***gallery, int **indices);
+int fp_print_db_save(struct fp_print_db *db, const char *name,
+	enum fp_finger finger, struct fp_print_data *data);
+int fp_print_db_save_new(struct fp_print_db *db, const char *name,
+	enum fp_finger finger, struct fp_print_data *data);
+int fp_print_db_delete(struct fp_print_db *db, int index);
+int fp_print_db_begin(struct fp_print_db *db);
+int fp_print_db_commit(struct fp_print_db *db);
+void fp_print_db_rollback(struct fp_print_db *db);
+
 /* Image handling */
 
 /** \ingroup img */
@@ -283,6 +527,19 @@ struct fp_minutia {
 	int num_nbrs;
 };
 
+/** \ingroup img
+ * Quality of an image, summed up from the maps built while detecting its
+ * minutiae, see fp_img_get_quality().
+ */
+struct fp_img_quality {
+	/** Percentage of the image showing usable ridges */
+	int foreground;
+	/** Mean quality of those ridges, as a percentage */
+	int ridge_quality;
+	/** Number of minutiae found where the ridges are of good quality */
+	int reliable_minutiae;
+};
+
 int fp_img_get_height(struct fp_img *img);
 int fp_img_get_width(struct fp_img *img);
 unsigned char *fp_img_get_data(struct fp_img *img);
@@ -290,7 +547,47 @@ int fp_img_save_to_file(struct fp_img *img, char *path);
 void fp_img_standardize(struct fp_img *img);
 struct fp_img *fp_img_binarize(struct fp_img *img);
 struct fp_minutia **fp_img_get_minutiae(struct fp_img *img, int *nr_minutiae);
+int fp_img_get_quality(struct fp_img *img, struct fp_img_quality *quality);
 void fp_img_free(struct fp_img *img);
+struct fp_img *fp_img_ref(struct fp_img *img);
+size_t fp_img_get_memory_usage(struct fp_img *img);
+void fp_get_img_memory_usage(struct fp_memory_usage *usage);
+struct fp_img *fp_img_new_from_data(int width, int height,
+	const unsigned char *data);
+
+/** \ingroup img
+ * An image to build a print of with fp_img_batch_to_print_data(), and the
+ * result.
+ */
+struct fp_img_batch_entry {
+	/** The image, which is standardized while processed */
+	struct fp_img *img;
+	/** \ref driver_id "Driver ID" to store in the print */
+	uint16_t driver_id;
+	/** Device type to store in the print */
+	uint32_t devtype;
+	/** Output: the print, to be freed with fp_print_data_free(), or NULL */
+	struct fp_print_data *print;
+	/** Output: 0 on success, negative error code otherwise */
+	int status;
+};
+
+int fp_img_batch_to_print_data(struct fp_img_batch_entry *entries,
+	size_t nr_entries, unsigned int nr_threads);
+
+/** \ingroup img_archive
+ * Options of an image archive, see fp_img_archive_open().
+ */
+enum fp_img_archive_flags {
+	/** Compress the images, trading a little CPU for less disk */
+	FP_IMG_ARCHIVE_COMPRESS = 1 << 0,
+};
+
+int fp_img_archive_open(const char *path, unsigned int flags,
+	struct fp_img_archive **archive);
+void fp_img_archive_set_sync_batch(struct fp_img_archive *archive,
+	unsigned int nr_images);
+int fp_img_archive_close(struct fp_img_archive *archive);
 
 /* Polling and timing */
 
@@ -309,10 +606,29 @@ typedef void (*fp_pollfd_removed_cb)(int fd);
 void fp_set_pollfd_notifiers(fp_pollfd_added_cb added_cb,
 	fp_pollfd_removed_cb removed_cb);
 
+int fp_context_handle_events_timeout(struct fp_context *ctx,
+	struct timeval *timeout);
+int fp_context_handle_events(struct fp_context *ctx);
+size_t fp_context_get_pollfds(struct fp_context *ctx,
+	struct fp_pollfd **pollfds);
+int fp_context_get_next_timeout(struct fp_context *ctx, struct timeval *tv);
+void fp_context_set_pollfd_notifiers(struct fp_context *ctx,
+	fp_pollfd_added_cb added_cb, fp_pollfd_removed_cb removed_cb);
+void fp_context_set_timeout_batch_limit(struct fp_context *ctx,
+	unsigned int max_timeouts);
+void fp_context_wakeup(struct fp_context *ctx);
+
+typedef void (*fp_stats_cb)(struct fp_dev *dev, const struct fp_stats *stats,
+	void *user_data);
+void fp_context_set_stats_cb(struct fp_context *ctx, fp_stats_cb callback,
+	void *user_data);
+
 /* Library */
 int fp_init(void);
 void fp_exit(void);
 void fp_set_debug(int level);
+struct fp_context *fp_context_new(void);
+void fp_context_free(struct fp_context *ctx);
 
 /* Asynchronous I/O */
 
@@ -346,6 +662,15 @@ typedef void (*fp_identify_cb)(struct fp_dev *dev, int result,
 	size_t match_offset, struct fp_img *img, void *user_data);
 int fp_async_identify_start(struct fp_dev *dev, struct fp_print_data **gallery,
 	fp_identify_cb callback, void *user_data);
+int fp_async_identify_gallery_start(struct fp_dev *dev,
+	struct fp_gallery *gallery, fp_identify_cb callback, void *user_data);
+int fp_async_identify_continuous_start(struct fp_dev *dev,
+	struct fp_print_data **gallery, fp_identify_cb callback, void *user_data);
+int fp_async_identify_gallery_continuous_start(struct fp_dev *dev,
+	struct fp_gallery *gallery, fp_identify_cb callback, void *user_data);
+int fp_async_identify_session_start(struct fp_dev *dev,
+	struct fp_identify_session *session, fp_identify_cb callback,
+	void *user_data);
 
 typedef void (*fp_identify_stop_cb)(struct fp_dev *dev, void *user_data);
 int fp_async_identify_stop(struct fp_dev *dev, fp_identify_stop_cb callback,
@@ -358,6 +683,19 @@ int fp_async_capture_start(struct fp_dev *dev, int unconditional, fp_capture_cb
 typedef void (*fp_capture_stop_cb)(struct fp_dev *dev, void *user_data);
 int fp_async_capture_stop(struct fp_dev *dev, fp_capture_stop_cb callback, void *user_data);
 
+typedef void (*fp_print_data_load_cb)(int status, struct fp_print_data *data,
+	void *user_data);
+int fp_async_print_data_load(struct fp_dev *dev, enum fp_finger finger,
+	fp_print_data_load_cb callback, void *user_data);
+
+typedef void (*fp_print_data_save_cb)(int status, void *user_data);
+int fp_async_print_data_save(struct fp_print_data *data, enum fp_finger finger,
+	fp_print_data_save_cb callback, void *user_data);
+
+typedef void (*fp_discover_prints_cb)(struct fp_dscv_print **prints,
+	void *user_data);
+int fp_async_discover_prints(fp_discover_prints_cb callback, void *user_data);
+
 #ifdef __cplusplus
 }
 #endif
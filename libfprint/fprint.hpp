@@ -0,0 +1,599 @@
+/*
+ * C++ bindings for libfprint
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __FPRINT_HPP__
+#define __FPRINT_HPP__
+
+/*
+ * A header-only C++ layer over fprint.h, in namespace fp:
+ *
+ *  - move-only handles owning the C objects, which free them when
+ *    destroyed: fp::device, fp::img, fp::print_data, fp::gallery, and
+ *    fp::discovered_devices;
+ *  - views over the memory of those objects, without copies: image pixels,
+ *    prints loaded from a buffer in place, and prints serialized straight
+ *    into a buffer of the caller;
+ *  - adapters over the fp_async_*() functions, calling a completion
+ *    function, fulfilling a std::future, or resuming a coroutine.
+ *
+ * Functions returning a negative error code in the C API throw
+ * std::system_error instead.
+ *
+ * Requires C++11. Views are std::span with C++20, and a minimal equivalent
+ * otherwise; coroutine support needs C++20 as well.
+ */
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <future>
+#include <memory>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#if __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<span>)
+#include <span>
+#define FP_HAVE_STD_SPAN 1
+#endif
+#if __has_include(<coroutine>) && defined(__cpp_impl_coroutine)
+#include <coroutine>
+#define FP_HAVE_COROUTINES 1
+#endif
+#endif
+
+#include "fprint.h"
+
+namespace fp {
+
+#ifdef FP_HAVE_STD_SPAN
+template<typename T>
+using span = std::span<T>;
+#else
+/* The part of std::span used here */
+template<typename T>
+class span {
+public:
+	span() noexcept : data_(nullptr), size_(0) {}
+	span(T *data, std::size_t size) noexcept : data_(data), size_(size) {}
+
+	T *data() const noexcept { return data_; }
+	std::size_t size() const noexcept { return size_; }
+	bool empty() const noexcept { return size_ == 0; }
+	T *begin() const noexcept { return data_; }
+	T *end() const noexcept { return data_ + size_; }
+	T &operator[](std::size_t i) const noexcept { return data_[i]; }
+
+private:
+	T *data_;
+	std::size_t size_;
+};
+#endif
+
+namespace detail {
+
+inline void check(int r)
+{
+	if (r < 0)
+		throw std::system_error(-r, std::generic_category());
+}
+
+/* Owns a pointer to a C object, freed with Free */
+template<typename T, void (*Free)(T *)>
+class handle {
+public:
+	handle() noexcept : ptr_(nullptr) {}
+	explicit handle(T *ptr) noexcept : ptr_(ptr) {}
+	handle(handle &&other) noexcept : ptr_(other.release()) {}
+	handle &operator=(handle &&other) noexcept
+	{
+		reset(other.release());
+		return *this;
+	}
+	handle(const handle &) = delete;
+	handle &operator=(const handle &) = delete;
+	~handle() { reset(); }
+
+	T *get() const noexcept { return ptr_; }
+	explicit operator bool() const noexcept { return ptr_ != nullptr; }
+
+	/* gives up ownership, the caller frees the object */
+	T *release() noexcept
+	{
+		T *ptr = ptr_;
+		ptr_ = nullptr;
+		return ptr;
+	}
+
+	void reset(T *ptr = nullptr) noexcept
+	{
+		if (ptr_)
+			Free(ptr_);
+		ptr_ = ptr;
+	}
+
+private:
+	T *ptr_;
+};
+
+inline void free_malloced(unsigned char *buf) noexcept
+{
+	std::free(buf);
+}
+
+} /* namespace detail */
+
+/* A scanned image */
+class img : public detail::handle<fp_img, fp_img_free> {
+public:
+	using handle::handle;
+
+	int width() const { return fp_img_get_width(get()); }
+	int height() const { return fp_img_get_height(get()); }
+
+	/* the pixels, row after row, valid as long as the image */
+	span<unsigned char> pixels() const
+	{
+		return span<unsigned char>(fp_img_get_data(get()),
+			static_cast<std::size_t>(width()) * height());
+	}
+
+	/* another reference to the same image */
+	img ref() const { return img(fp_img_ref(get())); }
+};
+
+/* Memory allocated by the library with malloc(), such as the data
+ * returned by fp_print_data_get_data() */
+class bytes : public detail::handle<unsigned char, detail::free_malloced> {
+public:
+	bytes() noexcept : size_(0) {}
+	bytes(unsigned char *data, std::size_t size) noexcept
+		: handle(data), size_(size) {}
+
+	span<const unsigned char> view() const
+	{
+		return span<const unsigned char>(get(), size_);
+	}
+
+private:
+	std::size_t size_;
+};
+
+/* A print, of one or more scans of a finger */
+class print_data : public detail::handle<fp_print_data, fp_print_data_free> {
+public:
+	using handle::handle;
+
+	/* Loads a print from data, which is copied */
+	static print_data from_data(span<const unsigned char> data)
+	{
+		fp_print_data *print = fp_print_data_from_data(
+			const_cast<unsigned char *>(data.data()), data.size());
+		if (!print)
+			detail::check(-EINVAL);
+		return print_data(print);
+	}
+
+	/* Loads a print referring to data instead of copying it, see
+	 * fp_print_data_from_data_borrowed(): data must outlive the print */
+	static print_data borrow(span<const unsigned char> data)
+	{
+		fp_print_data *print = fp_print_data_from_data_borrowed(
+			data.data(), data.size());
+		if (!print)
+			detail::check(-EINVAL);
+		return print_data(print);
+	}
+
+	/* Size of the serialized print */
+	std::size_t data_size() const
+	{
+		return fp_print_data_copy_data(get(), nullptr, 0);
+	}
+
+	/* Serializes the print straight into buf, which must hold
+	 * data_size() bytes. Returns the part of buf written to. */
+	span<unsigned char> copy_data(span<unsigned char> buf) const
+	{
+		std::size_t size = fp_print_data_copy_data(get(), buf.data(),
+			buf.size());
+		if (size > buf.size())
+			detail::check(-ENOSPC);
+		return span<unsigned char>(buf.data(), size);
+	}
+
+	/* Serializes the print into a buffer of the library */
+	bytes data() const
+	{
+		unsigned char *buf = nullptr;
+		std::size_t size = fp_print_data_get_data(get(), &buf);
+		if (!size)
+			detail::check(-ENOMEM);
+		return bytes(buf, size);
+	}
+
+	std::size_t memory_usage() const
+	{
+		return fp_print_data_get_memory_usage(get());
+	}
+
+	/* another reference to the same print */
+	print_data ref() const { return print_data(fp_print_data_ref(get())); }
+};
+
+/* An indexed gallery, which refers to the prints added to it: they must
+ * outlive the gallery, or be removed from it first */
+class gallery : public detail::handle<fp_gallery, fp_gallery_free> {
+public:
+	using handle::handle;
+
+	static gallery create() { return gallery(fp_gallery_new()); }
+
+	static gallery open_compiled(const char *path)
+	{
+		fp_gallery *g = nullptr;
+		detail::check(fp_gallery_open_compiled(path, &g));
+		return gallery(g);
+	}
+
+	int add(const print_data &print)
+	{
+		int id = fp_gallery_add_print(get(), print.get());
+		detail::check(id);
+		return id;
+	}
+
+	void remove(int id) { detail::check(fp_gallery_remove_print(get(), id)); }
+	int size() const { return fp_gallery_get_nr_prints(get()); }
+};
+
+/* The devices found by fp_discover_devs() */
+class discovered_devices {
+public:
+	static discovered_devices discover()
+	{
+		fp_dscv_dev **devs = fp_discover_devs();
+		if (!devs)
+			detail::check(-EIO);
+		return discovered_devices(devs);
+	}
+
+	discovered_devices(discovered_devices &&other) noexcept
+		: devs_(other.devs_)
+	{
+		other.devs_ = nullptr;
+	}
+	discovered_devices &operator=(discovered_devices &&other) noexcept
+	{
+		std::swap(devs_, other.devs_);
+		return *this;
+	}
+	discovered_devices(const discovered_devices &) = delete;
+	discovered_devices &operator=(const discovered_devices &) = delete;
+	~discovered_devices()
+	{
+		if (devs_)
+			fp_dscv_devs_free(devs_);
+	}
+
+	/* valid as long as this object */
+	span<fp_dscv_dev *> devices() const
+	{
+		std::size_t n = 0;
+
+		while (devs_ && devs_[n])
+			n++;
+		return span<fp_dscv_dev *>(devs_, n);
+	}
+
+private:
+	explicit discovered_devices(fp_dscv_dev **devs) noexcept
+		: devs_(devs) {}
+
+	fp_dscv_dev **devs_;
+};
+
+/* An open device */
+class device : public detail::handle<fp_dev, fp_dev_close> {
+public:
+	using handle::handle;
+
+	static device open(fp_dscv_dev *ddev)
+	{
+		fp_dev *dev = fp_dev_open(ddev);
+		if (!dev)
+			detail::check(-EIO);
+		return device(dev);
+	}
+};
+
+/*
+ * Asynchronous operations. Each one scans a single finger, stops the
+ * action, and then passes its result to a completion function, called
+ * from fp_handle_events() like the callbacks of the C API.
+ */
+
+struct verify_result {
+	/* one of fp_verify_result, or a negative error code */
+	int result;
+	img image;
+};
+
+struct identify_result {
+	/* one of fp_verify_result, or a negative error code */
+	int result;
+	/* offset or ID of the matched print, for FP_VERIFY_MATCH */
+	std::size_t match_offset;
+	img image;
+};
+
+struct capture_result {
+	/* one of fp_capture_result, or a negative error code */
+	int result;
+	img image;
+};
+
+namespace detail {
+
+template<typename Result, typename Done>
+struct operation {
+	Result result;
+	Done done;
+
+	static void stopped(fp_dev *, void *data)
+	{
+		operation *op = static_cast<operation *>(data);
+		op->done(std::move(op->result));
+		delete op;
+	}
+
+	/* stops the action, completing once it is stopped */
+	template<typename Stop>
+	void stop(fp_dev *dev, Stop stop_fn)
+	{
+		if (stop_fn(dev, &operation::stopped, this) < 0)
+			stopped(dev, this);
+	}
+};
+
+template<typename Result, typename Done>
+operation<Result, Done> *new_operation(Done &&done)
+{
+	return new operation<Result, Done>{Result(), std::forward<Done>(done)};
+}
+
+template<typename Op>
+void start(Op *op, int r)
+{
+	if (r < 0) {
+		delete op;
+		check(r);
+	}
+}
+
+} /* namespace detail */
+
+/* Verifies a finger against an enrolled print, which must outlive the
+ * operation, and calls done(verify_result) */
+template<typename Done>
+void verify(device &dev, const print_data &enrolled, Done done)
+{
+	auto *op = detail::new_operation<verify_result>(std::move(done));
+	using op_type = typename std::remove_pointer<decltype(op)>::type;
+
+	detail::start(op, fp_async_verify_start(dev.get(), enrolled.get(),
+		[](fp_dev *d, int result, fp_img *image, void *data) {
+			op_type *op = static_cast<op_type *>(data);
+			op->result.result = result;
+			op->result.image.reset(image);
+			op->stop(d, fp_async_verify_stop);
+		}, op));
+}
+
+/* Identifies a finger against a NULL-terminated array of prints, or an
+ * indexed gallery, which must outlive the operation, and calls
+ * done(identify_result) */
+template<typename Done>
+void identify(device &dev, fp_print_data **prints, Done done)
+{
+	auto *op = detail::new_operation<identify_result>(std::move(done));
+	using op_type = typename std::remove_pointer<decltype(op)>::type;
+
+	detail::start(op, fp_async_identify_start(dev.get(), prints,
+		[](fp_dev *d, int result, std::size_t offset, fp_img *image,
+				void *data) {
+			op_type *op = static_cast<op_type *>(data);
+			op->result.result = result;
+			op->result.match_offset = offset;
+			op->result.image.reset(image);
+			op->stop(d, fp_async_identify_stop);
+		}, op));
+}
+
+template<typename Done>
+void identify(device &dev, const gallery &g, Done done)
+{
+	auto *op = detail::new_operation<identify_result>(std::move(done));
+	using op_type = typename std::remove_pointer<decltype(op)>::type;
+
+	detail::start(op, fp_async_identify_gallery_start(dev.get(), g.get(),
+		[](fp_dev *d, int result, std::size_t offset, fp_img *image,
+				void *data) {
+			op_type *op = static_cast<op_type *>(data);
+			op->result.result = result;
+			op->result.match_offset = offset;
+			op->result.image.reset(image);
+			op->stop(d, fp_async_identify_stop);
+		}, op));
+}
+
+/* Captures an image, and calls done(capture_result) */
+template<typename Done>
+void capture(device &dev, bool unconditional, Done done)
+{
+	auto *op = detail::new_operation<capture_result>(std::move(done));
+	using op_type = typename std::remove_pointer<decltype(op)>::type;
+
+	detail::start(op, fp_async_capture_start(dev.get(), unconditional,
+		[](fp_dev *d, int result, fp_img *image, void *data) {
+			op_type *op = static_cast<op_type *>(data);
+			op->result.result = result;
+			op->result.image.reset(image);
+			op->stop(d, fp_async_capture_stop);
+		}, op));
+}
+
+/*
+ * Future adapters. The futures are fulfilled from fp_handle_events():
+ * waiting on them from the thread handling events would never return.
+ */
+
+namespace detail {
+
+template<typename Result>
+struct fulfil {
+	std::shared_ptr<std::promise<Result>> promise;
+
+	void operator()(Result result)
+	{
+		promise->set_value(std::move(result));
+	}
+};
+
+template<typename Result, typename Start>
+std::future<Result> make_future(Start start)
+{
+	auto promise = std::make_shared<std::promise<Result>>();
+	std::future<Result> future = promise->get_future();
+
+	start(fulfil<Result>{promise});
+	return future;
+}
+
+} /* namespace detail */
+
+inline std::future<verify_result> verify(device &dev,
+	const print_data &enrolled)
+{
+	return detail::make_future<verify_result>(
+		[&](detail::fulfil<verify_result> done) {
+			verify(dev, enrolled, std::move(done));
+		});
+}
+
+inline std::future<identify_result> identify(device &dev,
+	fp_print_data **prints)
+{
+	return detail::make_future<identify_result>(
+		[&](detail::fulfil<identify_result> done) {
+			identify(dev, prints, std::move(done));
+		});
+}
+
+inline std::future<identify_result> identify(device &dev, const gallery &g)
+{
+	return detail::make_future<identify_result>(
+		[&](detail::fulfil<identify_result> done) {
+			identify(dev, g, std::move(done));
+		});
+}
+
+inline std::future<capture_result> capture(device &dev, bool unconditional)
+{
+	return detail::make_future<capture_result>(
+		[&](detail::fulfil<capture_result> done) {
+			capture(dev, unconditional, std::move(done));
+		});
+}
+
+#ifdef FP_HAVE_COROUTINES
+/*
+ * Coroutine adapters: co_await fp::verified(dev, print) and the like
+ * suspend the coroutine until the result is in, and resume it from
+ * fp_handle_events(), on the thread handling events.
+ */
+
+namespace detail {
+
+template<typename Result, typename Start>
+class awaitable {
+public:
+	explicit awaitable(Start start) : start_(std::move(start)) {}
+
+	bool await_ready() const noexcept { return false; }
+
+	void await_suspend(std::coroutine_handle<> waiter)
+	{
+		start_([this, waiter](Result result) {
+			result_ = std::move(result);
+			waiter.resume();
+		});
+	}
+
+	Result await_resume() { return std::move(result_); }
+
+private:
+	Start start_;
+	Result result_;
+};
+
+template<typename Result, typename Start>
+awaitable<Result, Start> make_awaitable(Start start)
+{
+	return awaitable<Result, Start>(std::move(start));
+}
+
+} /* namespace detail */
+
+inline auto verified(device &dev, const print_data &enrolled)
+{
+	return detail::make_awaitable<verify_result>(
+		[&dev, &enrolled](auto done) {
+			verify(dev, enrolled, std::move(done));
+		});
+}
+
+inline auto identified(device &dev, fp_print_data **prints)
+{
+	return detail::make_awaitable<identify_result>(
+		[&dev, prints](auto done) {
+			identify(dev, prints, std::move(done));
+		});
+}
+
+inline auto identified(device &dev, const gallery &g)
+{
+	return detail::make_awaitable<identify_result>(
+		[&dev, &g](auto done) {
+			identify(dev, g, std::move(done));
+		});
+}
+
+inline auto captured(device &dev, bool unconditional)
+{
+	return detail::make_awaitable<capture_result>(
+		[&dev, unconditional](auto done) {
+			capture(dev, unconditional, std::move(done));
+		});
+}
+#endif
+
+} /* namespace fp */
+
+#endif
@@ -0,0 +1,1234 @@
+/*
+ * Indexed print galleries for libfprint
+ * Copyright (C) 2017 libfprint contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "gallery"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "fp_internal.h"
+#include "nbis/include/bozorth.h"
+
+/** @defgroup gallery Indexed print galleries
+ * Identifying against a plain array of prints, with fp_identify_finger_img(),
+ * means running the matcher against every single print. An indexed gallery
+ * is built once from many prints and keeps an index of the geometry of their
+ * minutiae. During identification, the index is used to pick the few prints
+ * which look alike the scanned finger, and only those are passed on to the
+ * matcher.
+ *
+ * Prints can be added to and removed from a gallery at any time. The gallery
+ * does not copy the prints it is given, they must stay around until removed
+ * from the gallery or until the gallery is freed.
+ *
+ * A gallery can also be saved in compiled form with
+ * fp_gallery_save_compiled(), which holds the prints along with their
+ * matcher templates and the index, ready to be used in place. Any number of
+ * processes can then open it with fp_gallery_open_compiled(): the file is
+ * mapped in memory and shared between them, instead of every process
+ * loading the prints and compiling their templates on its own. Compiled
+ * galleries are read-only. Saving replaces the file atomically, and readers
+ * switch to the new version with fp_gallery_reload().
+ */
+
+/* The index is keyed on quantized minutia pairs: the distance between the two
+ * minutiae and the angle of each minutia relative to the line joining them.
+ * All three are translation and rotation invariant. */
+#define DIST_STEP	6
+#define DIST_BINS	(DM / DIST_STEP + 1)
+#define BETA_STEP	24
+#define BETA_BINS	(360 / BETA_STEP)
+#define NR_KEYS		(DIST_BINS * BETA_BINS * BETA_BINS)
+
+/* Tolerances used by bz_match() to accept a pair of edges, also used here to
+ * look up neighbouring index cells. Distances may differ by about 10%. */
+#define DIST_TOLERANCE(d)	((d) / 10 + 1)
+#define BETA_TOLERANCE		11
+#define MAX_NEIGHBOURS		8
+
+#define DEFAULT_MAX_CANDIDATES	64
+
+/* With adaptive ordering, every match adds a weight to the matched print
+ * which grows by 1 / HIT_DECAY with each match, so that older matches count
+ * for less and less. Everything is scaled down once the weight gets too
+ * large. */
+#define HIT_DECAY		0.99
+#define HIT_RESCALE		1e100
+
+struct gallery_entry {
+	struct fp_print_data *print;
+	/* keys under which this print is indexed */
+	GArray *keys;
+	/* memory held by the entry and its print, when it was added */
+	size_t mem;
+	/* decayed number of matches, see record_hit() */
+	double hits;
+};
+
+struct fp_gallery {
+	/* identifications only take it for reading, so that the scans of several
+	 * devices can be matched at once, see session.c */
+	GRWLock lock;
+	/* entries indexed by print ID, NULL for free IDs */
+	GPtrArray *entries;
+	GArray *free_ids;
+	int nr_prints;
+	unsigned int max_candidates;
+	/* see fp_gallery_set_adaptive_order(), hits are updated during
+	 * identification, under their own lock */
+	gboolean adaptive_order;
+	GMutex hits_lock;
+	double hit_weight;
+	/* print IDs for each key */
+	GArray *postings[NR_KEYS];
+	/* memory accounting, see fp_gallery_get_memory_usage() */
+	size_t mem;
+	size_t mem_peak;
+	/* set for galleries opened from a compiled file, whose postings are
+	 * used instead */
+	struct compiled_map *map;
+	char *path;
+	/* see fp_gallery_set_offload(), the generation changes with the
+	 * prints so that the device knows when to upload them again */
+#ifdef HAVE_OPENCL
+	struct fpi_offload *offload;
+#endif
+	unsigned int offload_shortlist;
+	unsigned int generation;
+};
+
+/* Compiled galleries are kept in the host's layout. The header is followed
+ * by the samples of every print, each one being a compiled_sample followed
+ * by its xyt data and its matcher template, then by a compiled_entry for
+ * each print ID, and last by NR_KEYS + 1 offsets into the print IDs of all
+ * postings, which follow them. */
+#define COMPILED_MAGIC		"FPG1"
+#define COMPILED_VERSION	1
+#define COMPILED_PERMS		0600
+#define COMPILED_ALIGN		8
+#define COMPILED_ALIGN_UP(n)	(((n) + COMPILED_ALIGN - 1) & ~(uint64_t) (COMPILED_ALIGN - 1))
+
+struct compiled_header {
+	char magic[4];
+	uint32_t version;
+	/* files from builds with another index layout are rejected */
+	uint32_t nr_keys;
+	uint32_t nr_ids;
+	uint64_t entries_offset;
+	uint64_t postings_offset;
+	uint64_t length;
+} __attribute__((__packed__));
+
+struct compiled_entry {
+	/* first sample of the print, 0 for a free ID */
+	uint64_t offset;
+	uint32_t nr_samples;
+	uint16_t driver_id;
+	uint32_t devtype;
+} __attribute__((__packed__));
+
+struct compiled_sample {
+	uint32_t xyt_length;
+	uint32_t template_length;
+} __attribute__((__packed__));
+
+struct compiled_map {
+	void *addr;
+	size_t length;
+	/* identity of the file, which changes when a new version is saved */
+	dev_t dev;
+	ino_t ino;
+	const uint32_t *posting_offsets;
+	const int32_t *posting_ids;
+	/* memory held by the entries built from the file */
+	size_t mem;
+};
+
+/* beta is in (-180, 180] */
+#define BETA_OFFSET	179
+
+static int beta_bin(int beta)
+{
+	return (beta + BETA_OFFSET) / BETA_STEP;
+}
+
+static void edge_bins(struct bz_template *tmpl, int e, int *dist, int *beta1,
+	int *beta2)
+{
+	*dist = (int) sqrt(BZ_TEMPLATE_COL(tmpl, 0)[e]) / DIST_STEP;
+	*beta1 = beta_bin(BZ_TEMPLATE_COL(tmpl, 1)[e]);
+	*beta2 = beta_bin(BZ_TEMPLATE_COL(tmpl, 2)[e]);
+}
+
+static int make_key(int dist, int beta1, int beta2)
+{
+	return (dist * BETA_BINS + beta1) * BETA_BINS + beta2;
+}
+
+/* Bins a value may fall into once the matcher tolerance is accounted for */
+static int neighbour_bins(int value, int step, int nr_bins, int tolerance,
+	gboolean wrap, int bins[MAX_NEIGHBOURS])
+{
+	int lo = value - tolerance;
+	int hi = value + tolerance;
+	int bin, n = 0;
+
+	lo = lo < 0 ? -1 - (-lo - 1) / step : lo / step;
+	hi = hi / step;
+	for (bin = lo; bin <= hi && n < MAX_NEIGHBOURS; bin++) {
+		if (bin >= 0 && bin < nr_bins)
+			bins[n++] = bin;
+		else if (wrap)
+			bins[n++] = (bin + nr_bins) % nr_bins;
+	}
+	return n;
+}
+
+static void entry_free(struct gallery_entry *entry)
+{
+	/* entries of compiled galleries own their print instead of keys */
+	if (entry->keys)
+		g_array_free(entry->keys, TRUE);
+	else
+		fp_print_data_free(entry->print);
+	g_free(entry);
+}
+
+static void entries_free(GPtrArray *entries)
+{
+	unsigned int i;
+
+	for (i = 0; i < entries->len; i++) {
+		struct gallery_entry *entry = g_ptr_array_index(entries, i);
+		if (entry)
+			entry_free(entry);
+	}
+	g_ptr_array_free(entries, TRUE);
+}
+
+/* Print IDs indexed under a key */
+static const int32_t *get_posting(struct fp_gallery *gallery, int key,
+	unsigned int *len)
+{
+	if (gallery->map) {
+		const uint32_t *offsets = gallery->map->posting_offsets;
+
+		*len = offsets[key + 1] - offsets[key];
+		return gallery->map->posting_ids + offsets[key];
+	}
+
+	if (!gallery->postings[key]) {
+		*len = 0;
+		return NULL;
+	}
+	*len = gallery->postings[key]->len;
+	return (const int32_t *) gallery->postings[key]->data;
+}
+
+static void compiled_map_free(struct compiled_map *map)
+{
+	munmap(map->addr, map->length);
+	g_free(map);
+}
+
+/** \ingroup gallery
+ * Creates a new, empty, indexed gallery.
+ * \returns the new gallery, to be freed with fp_gallery_free()
+ */
+API_EXPORTED struct fp_gallery *fp_gallery_new(void)
+{
+	struct fp_gallery *gallery = g_malloc0(sizeof(*gallery));
+
+	g_rw_lock_init(&gallery->lock);
+	g_mutex_init(&gallery->hits_lock);
+	gallery->entries = g_ptr_array_new();
+	gallery->free_ids = g_array_new(FALSE, FALSE, sizeof(int));
+	gallery->max_candidates = DEFAULT_MAX_CANDIDATES;
+	gallery->hit_weight = 1.0;
+	gallery->mem = gallery->mem_peak = sizeof(*gallery);
+	return gallery;
+}
+
+/** \ingroup gallery
+ * Frees a gallery. The prints it contains are not freed.
+ * \param gallery the gallery to free, or NULL
+ */
+API_EXPORTED void fp_gallery_free(struct fp_gallery *gallery)
+{
+	unsigned int i;
+
+	if (!gallery)
+		return;
+
+	/* the prints of a compiled gallery refer to its mapping */
+	entries_free(gallery->entries);
+	for (i = 0; i < NR_KEYS; i++)
+		if (gallery->postings[i])
+			g_array_free(gallery->postings[i], TRUE);
+	if (gallery->map)
+		compiled_map_free(gallery->map);
+#ifdef HAVE_OPENCL
+	fpi_offload_free(gallery->offload);
+#endif
+
+	g_free(gallery->path);
+	g_array_free(gallery->free_ids, TRUE);
+	g_mutex_clear(&gallery->hits_lock);
+	g_rw_lock_clear(&gallery->lock);
+	g_free(gallery);
+}
+
+/** \ingroup gallery
+ * Adds a print to a gallery. The print is not copied, and must not be freed
+ * before it is removed from the gallery with fp_gallery_remove_print(), or
+ * before the gallery is freed.
+ *
+ * \param gallery the gallery
+ * \param print the print to add, obtained from an imaging device
+ * \returns the ID of the print within the gallery on success, -EROFS for
+ * compiled galleries, negative error code otherwise
+ */
+API_EXPORTED int fp_gallery_add_print(struct fp_gallery *gallery,
+	struct fp_print_data *print)
+{
+	struct gallery_entry *entry;
+	gboolean *seen;
+	GSList *elem;
+	int id, i;
+
+	if (print->type != PRINT_DATA_NBIS_MINUTIAE) {
+		fp_err("only image-based prints can be indexed");
+		return -EINVAL;
+	}
+	if (gallery->map)
+		return -EROFS;
+
+	entry = g_malloc0(sizeof(*entry));
+	entry->print = print;
+	entry->keys = g_array_new(FALSE, FALSE, sizeof(guint16));
+
+	/* Collect the keys of all samples, each one only once */
+	seen = g_new0(gboolean, NR_KEYS);
+	for (elem = print->prints; elem; elem = g_slist_next(elem)) {
+		struct bz_template *tmpl;
+
+		tmpl = fpi_print_data_item_get_template(elem->data);
+		if (!tmpl) {
+			g_free(seen);
+			entry_free(entry);
+			return -ENOMEM;
+		}
+
+		for (i = 0; i < tmpl->nedges; i++) {
+			int dist, beta1, beta2;
+			guint16 key;
+
+			edge_bins(tmpl, i, &dist, &beta1, &beta2);
+			key = make_key(dist, beta1, beta2);
+			if (!seen[key]) {
+				seen[key] = TRUE;
+				g_array_append_val(entry->keys, key);
+			}
+		}
+	}
+	g_free(seen);
+
+	/* the templates compiled above are included */
+	entry->mem = sizeof(*entry) + sizeof(entry) +
+		entry->keys->len * (sizeof(guint16) + sizeof(int)) +
+		fp_print_data_get_memory_usage(print);
+
+	g_rw_lock_writer_lock(&gallery->lock);
+	if (gallery->free_ids->len) {
+		id = g_array_index(gallery->free_ids, int,
+			gallery->free_ids->len - 1);
+		g_array_set_size(gallery->free_ids, gallery->free_ids->len - 1);
+		g_ptr_array_index(gallery->entries, id) = entry;
+	} else {
+		id = gallery->entries->len;
+		g_ptr_array_add(gallery->entries, entry);
+	}
+
+	for (i = 0; i < entry->keys->len; i++) {
+		guint16 key = g_array_index(entry->keys, guint16, i);
+
+		if (!gallery->postings[key])
+			gallery->postings[key] = g_array_new(FALSE, FALSE, sizeof(int));
+		g_array_append_val(gallery->postings[key], id);
+	}
+	gallery->nr_prints++;
+	gallery->generation++;
+	gallery->mem += entry->mem;
+	if (gallery->mem > gallery->mem_peak)
+		gallery->mem_peak = gallery->mem;
+	fp_dbg("print %d indexed under %u keys", id, entry->keys->len);
+	g_rw_lock_writer_unlock(&gallery->lock);
+
+	return id;
+}
+
+/** \ingroup gallery
+ * Removes a print from a gallery. Its ID may be reused by prints added later
+ * on.
+ *
+ * \param gallery the gallery
+ * \param id the ID returned by fp_gallery_add_print()
+ * \returns 0 on success, -ENOENT if there is no such print in the gallery,
+ * -EROFS for compiled galleries
+ */
+API_EXPORTED int fp_gallery_remove_print(struct fp_gallery *gallery, int id)
+{
+	struct gallery_entry *entry;
+	unsigned int i, j;
+
+	if (gallery->map)
+		return -EROFS;
+
+	g_rw_lock_writer_lock(&gallery->lock);
+	if (id < 0 || id >= gallery->entries->len ||
+	    !(entry = g_ptr_array_index(gallery->entries, id))) {
+		g_rw_lock_writer_unlock(&gallery->lock);
+		return -ENOENT;
+	}
+
+	for (i = 0; i < entry->keys->len; i++) {
+		GArray *posting = gallery->postings[g_array_index(entry->keys,
+			guint16, i)];
+
+		for (j = 0; j < posting->len; j++)
+			if (g_array_index(posting, int, j) == id) {
+				g_array_remove_index_fast(posting, j);
+				break;
+			}
+	}
+
+	g_ptr_array_index(gallery->entries, id) = NULL;
+	g_array_append_val(gallery->free_ids, id);
+	gallery->nr_prints--;
+	gallery->generation++;
+	gallery->mem -= entry->mem;
+	g_rw_lock_writer_unlock(&gallery->lock);
+
+	entry_free(entry);
+	return 0;
+}
+
+/** \ingroup gallery
+ * Gets the number of prints in a gallery.
+ * \param gallery the gallery
+ * \returns the number of prints
+ */
+API_EXPORTED int fp_gallery_get_nr_prints(struct fp_gallery *gallery)
+{
+	int r;
+
+	g_rw_lock_reader_lock(&gallery->lock);
+	r = gallery->nr_prints;
+	g_rw_lock_reader_unlock(&gallery->lock);
+	return r;
+}
+
+/** \ingroup gallery
+ * Gets the memory held by a gallery: its index, and the prints it contains
+ * as they were when added, including their matcher templates. For compiled
+ * galleries, only the memory private to the process is counted, not the
+ * shared mapping of the file.
+ * \param gallery the gallery
+ * \param usage where to store the current and peak sizes, in bytes
+ */
+API_EXPORTED void fp_gallery_get_memory_usage(struct fp_gallery *gallery,
+	struct fp_memory_usage *usage)
+{
+	g_rw_lock_reader_lock(&gallery->lock);
+	usage->current = gallery->mem;
+	usage->peak = gallery->mem_peak;
+	g_rw_lock_reader_unlock(&gallery->lock);
+}
+
+/** \ingroup gallery
+ * Sets the maximum number of prints passed on to the matcher for each
+ * identification, picked by decreasing similarity according to the index.
+ * Lower values make identification faster but may miss prints which the
+ * index ranks poorly.
+ *
+ * \param gallery the gallery
+ * \param max_candidates maximum number of candidates, or 0 to pass on every
+ * print sharing some geometry with the scanned finger
+ */
+API_EXPORTED void fp_gallery_set_max_candidates(struct fp_gallery *gallery,
+	unsigned int max_candidates)
+{
+	g_rw_lock_writer_lock(&gallery->lock);
+	gallery->max_candidates = max_candidates;
+	g_rw_lock_writer_unlock(&gallery->lock);
+}
+
+/** \ingroup gallery
+ * Moves the search for candidates of large galleries to a GPU, through
+ * OpenCL. The device compares the scanned finger with every print of the
+ * gallery, instead of only those the index picks, and the shortlist of
+ * the prints most alike is passed on to the matcher. The prints are copied
+ * to the device memory, once for every change to the gallery.
+ *
+ * The device only runs a coarse comparison of the minutiae of the prints,
+ * the matcher still decides which print matches. Galleries with fewer
+ * prints than the shortlist keep using the index, which is faster then.
+ *
+ * \param gallery the gallery
+ * \param shortlist number of prints passed on to the matcher, or 0 to stop
+ * using the device
+ * \returns 0 on success, -ENOTSUP if libfprint was built without OpenCL
+ * or if no suitable device was found
+ */
+API_EXPORTED int fp_gallery_set_offload(struct fp_gallery *gallery,
+	unsigned int shortlist)
+{
+#ifdef HAVE_OPENCL
+	struct fpi_offload *offload = NULL, *old_offload;
+
+	if (shortlist) {
+		g_rw_lock_reader_lock(&gallery->lock);
+		offload = gallery->offload;
+		g_rw_lock_reader_unlock(&gallery->lock);
+		if (!offload)
+			offload = fpi_offload_new();
+		if (!offload)
+			return -ENOTSUP;
+	}
+
+	g_rw_lock_writer_lock(&gallery->lock);
+	old_offload = gallery->offload;
+	gallery->offload = offload;
+	gallery->offload_shortlist = shortlist;
+	g_rw_lock_writer_unlock(&gallery->lock);
+
+	if (old_offload != offload)
+		fpi_offload_free(old_offload);
+	return 0;
+#else
+	return shortlist ? -ENOTSUP : 0;
+#endif
+}
+
+static int compiled_pwrite(int fd, const void *buf, size_t length,
+	uint64_t offset)
+{
+	const unsigned char *p = buf;
+
+	while (length) {
+		ssize_t r = pwrite(fd, p, length, offset);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			fp_err("write failed: %s", g_strerror(errno));
+			return -errno;
+		}
+		p += r;
+		offset += r;
+		length -= r;
+	}
+
+	return 0;
+}
+
+/* Writes the samples of a print at offset, which is moved past them */
+static int compiled_write_print(int fd, struct fp_print_data *print,
+	struct compiled_entry *centry, uint64_t *offset)
+{
+	GSList *elem;
+
+	centry->offset = *offset;
+	centry->driver_id = print->driver_id;
+	centry->devtype = print->devtype;
+	for (elem = print->prints; elem; elem = g_slist_next(elem)) {
+		struct fp_print_data_item *item = elem->data;
+		struct compiled_sample sample;
+		struct bz_template *tmpl;
+		uint64_t xyt_offset, tmpl_offset;
+		int r;
+
+		tmpl = fpi_print_data_item_get_template(item);
+		if (!tmpl)
+			return -ENOMEM;
+
+		sample.xyt_length = item->length;
+		sample.template_length = BZ_TEMPLATE_SIZE(tmpl->nedges);
+		xyt_offset = *offset + sizeof(sample);
+		tmpl_offset = xyt_offset + COMPILED_ALIGN_UP(sample.xyt_length);
+
+		r = compiled_pwrite(fd, &sample, sizeof(sample), *offset);
+		if (r == 0)
+			r = compiled_pwrite(fd, item->data, item->length,
+				xyt_offset);
+		if (r == 0)
+			r = compiled_pwrite(fd, tmpl, sample.template_length,
+				tmpl_offset);
+		if (r < 0)
+			return r;
+
+		*offset = tmpl_offset + COMPILED_ALIGN_UP(sample.template_length);
+		centry->nr_samples++;
+	}
+
+	return 0;
+}
+
+/* Writes the postings at offset, and returns the end of the file */
+static int compiled_write_postings(int fd, struct fp_gallery *gallery,
+	uint64_t offset, uint64_t *end)
+{
+	uint32_t *offsets = g_new(uint32_t, NR_KEYS + 1);
+	GArray *ids = g_array_new(FALSE, FALSE, sizeof(int32_t));
+	int key, r;
+
+	for (key = 0; key < NR_KEYS; key++) {
+		const int32_t *posting;
+		unsigned int len;
+
+		offsets[key] = ids->len;
+		posting = get_posting(gallery, key, &len);
+		if (len)
+			g_array_append_vals(ids, posting, len);
+	}
+	offsets[NR_KEYS] = ids->len;
+
+	r = compiled_pwrite(fd, offsets, (NR_KEYS + 1) * sizeof(*offsets),
+		offset);
+	offset += (NR_KEYS + 1) * sizeof(*offsets);
+	if (r == 0)
+		r = compiled_pwrite(fd, ids->data, ids->len * sizeof(int32_t),
+			offset);
+	*end = offset + ids->len * sizeof(int32_t);
+
+	g_array_free(ids, TRUE);
+	g_free(offsets);
+	return r;
+}
+
+/** \ingroup gallery
+ * Saves a gallery in compiled form, to be opened with
+ * fp_gallery_open_compiled(). The matcher templates of the prints are
+ * compiled if needed. A previous file is replaced atomically: processes
+ * which opened it keep using the old version until they call
+ * fp_gallery_reload().
+ *
+ * Print IDs are kept, so that they remain valid in the compiled gallery.
+ * The file is only readable by its owner, processes running as other users
+ * can be given access by changing its permissions.
+ *
+ * \param gallery the gallery to save
+ * \param path the file to save the gallery to
+ * \returns 0 on success, negative error code otherwise
+ */
+API_EXPORTED int fp_gallery_save_compiled(struct fp_gallery *gallery,
+	const char *path)
+{
+	struct compiled_header hdr;
+	struct compiled_entry *centries;
+	uint64_t offset, end = 0;
+	unsigned int i;
+	char *tmp_path;
+	int fd, r = 0;
+
+	tmp_path = g_strdup_printf("%s.XXXXXX", path);
+	fd = g_mkstemp_full(tmp_path, O_RDWR, COMPILED_PERMS);
+	if (fd < 0) {
+		r = -errno;
+		fp_err("couldn't create %s: %s", tmp_path, g_strerror(errno));
+		g_free(tmp_path);
+		return r;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, COMPILED_MAGIC, sizeof(hdr.magic));
+	hdr.version = COMPILED_VERSION;
+	hdr.nr_keys = NR_KEYS;
+
+	g_rw_lock_reader_lock(&gallery->lock);
+	hdr.nr_ids = gallery->entries->len;
+	centries = g_new0(struct compiled_entry, hdr.nr_ids);
+	offset = COMPILED_ALIGN_UP(sizeof(hdr));
+	for (i = 0; i < hdr.nr_ids && r == 0; i++) {
+		struct gallery_entry *entry = g_ptr_array_index(gallery->entries, i);
+		if (entry)
+			r = compiled_write_print(fd, entry->print, &centries[i],
+				&offset);
+	}
+
+	hdr.entries_offset = offset;
+	if (r == 0)
+		r = compiled_pwrite(fd, centries,
+			hdr.nr_ids * sizeof(*centries), offset);
+	hdr.postings_offset = COMPILED_ALIGN_UP(offset +
+		hdr.nr_ids * sizeof(*centries));
+	if (r == 0)
+		r = compiled_write_postings(fd, gallery, hdr.postings_offset,
+			&end);
+	g_rw_lock_reader_unlock(&gallery->lock);
+	g_free(centries);
+
+	hdr.length = end;
+	if (r == 0)
+		r = compiled_pwrite(fd, &hdr, sizeof(hdr), 0);
+	if (r == 0 && fsync(fd) < 0) {
+		r = -errno;
+		fp_err("fsync failed: %s", g_strerror(errno));
+	}
+	close(fd);
+
+	if (r == 0 && g_rename(tmp_path, path) < 0) {
+		r = -errno;
+		fp_err("couldn't replace %s: %s", path, g_strerror(errno));
+	}
+	if (r < 0)
+		g_unlink(tmp_path);
+	else
+		fp_dbg("saved %u print IDs to %s", hdr.nr_ids, path);
+	g_free(tmp_path);
+	return r;
+}
+
+static gboolean compiled_range_ok(struct compiled_map *map, uint64_t offset,
+	uint64_t length)
+{
+	return offset % COMPILED_ALIGN == 0 && offset <= map->length &&
+		length <= map->length - offset;
+}
+
+/* Builds a print whose samples and templates refer to the mapping */
+static struct fp_print_data *compiled_load_print(struct compiled_map *map,
+	const struct compiled_entry *centry)
+{
+	struct fp_print_data *print;
+	uint64_t offset = centry->offset;
+	uint32_t i;
+
+	print = fpi_print_data_new_typed(centry->driver_id, centry->devtype,
+		PRINT_DATA_NBIS_MINUTIAE);
+	for (i = 0; i < centry->nr_samples; i++) {
+		const struct compiled_sample *sample;
+		const struct fpi_xyt *xyt;
+		struct fp_print_data_item *item;
+		struct bz_template *tmpl;
+		uint64_t xyt_offset, tmpl_offset;
+
+		if (!compiled_range_ok(map, offset, sizeof(*sample)))
+			goto err;
+		sample = (const struct compiled_sample *)
+			((const unsigned char *) map->addr + offset);
+		xyt_offset = offset + sizeof(*sample);
+		tmpl_offset = xyt_offset + COMPILED_ALIGN_UP(sample->xyt_length);
+		if (sample->xyt_length < sizeof(*xyt) ||
+				sample->template_length < sizeof(*tmpl) ||
+				!compiled_range_ok(map, xyt_offset, sample->xyt_length) ||
+				!compiled_range_ok(map, tmpl_offset,
+					sample->template_length))
+			goto err;
+
+		xyt = (const struct fpi_xyt *)
+			((const unsigned char *) map->addr + xyt_offset);
+		tmpl = (struct bz_template *)
+			((unsigned char *) map->addr + tmpl_offset);
+		if (xyt->nrows < 0 || tmpl->nedges < 0 ||
+				FPI_XYT_SIZE((uint64_t) xyt->nrows) != sample->xyt_length ||
+				BZ_TEMPLATE_SIZE((uint64_t) tmpl->nedges) !=
+				sample->template_length)
+			goto err;
+
+		item = fpi_print_data_item_borrow((const unsigned char *) xyt,
+			sample->xyt_length);
+		item->bz_template = tmpl;
+		item->template_borrowed = TRUE;
+		print->prints = g_slist_prepend(print->prints, item);
+		offset = tmpl_offset + COMPILED_ALIGN_UP(sample->template_length);
+	}
+	print->prints = g_slist_reverse(print->prints);
+	return print;
+
+err:
+	fp_print_data_free(print);
+	return NULL;
+}
+
+/* Maps a compiled gallery and builds its entries */
+static int compiled_load(const char *path, struct compiled_map **ret_map,
+	GPtrArray **ret_entries, int *nr_prints)
+{
+	const struct compiled_header *hdr;
+	const struct compiled_entry *centries;
+	const uint32_t *offsets;
+	struct compiled_map *map;
+	GPtrArray *entries;
+	struct stat st;
+	uint64_t ids_offset;
+	uint32_t i;
+	int fd, r;
+
+	fd = g_open(path, O_RDONLY, 0);
+	if (fd < 0) {
+		r = -errno;
+		fp_err("couldn't open %s: %s", path, g_strerror(errno));
+		return r;
+	}
+	if (fstat(fd, &st) < 0) {
+		r = -errno;
+		close(fd);
+		return r;
+	}
+	if ((uint64_t) st.st_size < sizeof(*hdr)) {
+		close(fd);
+		fp_err("%s is not a compiled gallery", path);
+		return -EINVAL;
+	}
+
+	map = g_malloc0(sizeof(*map));
+	map->length = st.st_size;
+	map->dev = st.st_dev;
+	map->ino = st.st_ino;
+	map->addr = mmap(NULL, map->length, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map->addr == MAP_FAILED) {
+		r = -errno;
+		fp_err("mmap failed: %s", g_strerror(errno));
+		g_free(map);
+		return r;
+	}
+
+	hdr = map->addr;
+	if (memcmp(hdr->magic, COMPILED_MAGIC, sizeof(hdr->magic)) ||
+			hdr->version != COMPILED_VERSION ||
+			hdr->nr_keys != NR_KEYS || hdr->length != map->length ||
+			!compiled_range_ok(map, hdr->entries_offset,
+				(uint64_t) hdr->nr_ids * sizeof(*centries)) ||
+			!compiled_range_ok(map, hdr->postings_offset,
+				(NR_KEYS + 1) * sizeof(*offsets))) {
+		fp_err("%s is not a compiled gallery of this build", path);
+		compiled_map_free(map);
+		return -EINVAL;
+	}
+	centries = (const struct compiled_entry *)
+		((const unsigned char *) map->addr + hdr->entries_offset);
+	offsets = (const uint32_t *)
+		((const unsigned char *) map->addr + hdr->postings_offset);
+	ids_offset = hdr->postings_offset + (NR_KEYS + 1) * sizeof(*offsets);
+
+	map->mem = sizeof(*map) + sizeof(*entries) +
+		hdr->nr_ids * sizeof(gpointer);
+	entries = g_ptr_array_sized_new(hdr->nr_ids);
+	*nr_prints = 0;
+	for (i = 0; i < hdr->nr_ids; i++) {
+		struct gallery_entry *entry = NULL;
+
+		if (centries[i].offset) {
+			entry = g_malloc0(sizeof(*entry));
+			entry->print = compiled_load_print(map, &centries[i]);
+			if (!entry->print) {
+				g_free(entry);
+				goto err;
+			}
+			entry->mem = sizeof(*entry) +
+				fp_print_data_get_memory_usage(entry->print);
+			map->mem += entry->mem;
+			(*nr_prints)++;
+		}
+		g_ptr_array_add(entries, entry);
+	}
+
+	/* the postings are used as they are, check them once and for all */
+	for (i = 0; i < NR_KEYS; i++)
+		if (offsets[i] > offsets[i + 1])
+			goto err;
+	if (offsets[0] != 0 || offsets[NR_KEYS] >
+			(map->length - ids_offset) / sizeof(int32_t))
+		goto err;
+	map->posting_offsets = offsets;
+	map->posting_ids = (const int32_t *)
+		((const unsigned char *) map->addr + ids_offset);
+	for (i = 0; i < offsets[NR_KEYS]; i++) {
+		int32_t id = map->posting_ids[i];
+		if (id < 0 || id >= hdr->nr_ids ||
+				!g_ptr_array_index(entries, id))
+			goto err;
+	}
+
+	fp_dbg("mapped %d prints from %s", *nr_prints, path);
+	*ret_map = map;
+	*ret_entries = entries;
+	return 0;
+
+err:
+	fp_err("%s is corrupted", path);
+	entries_free(entries);
+	compiled_map_free(map);
+	return -EINVAL;
+}
+
+/** \ingroup gallery
+ * Opens a gallery saved by fp_gallery_save_compiled(). The file is mapped
+ * in memory, shared with the other processes which opened it, and the
+ * gallery can be used right away. It is read-only: prints can neither be
+ * added to it nor removed from it.
+ *
+ * The file must have been saved by a build of libfprint running on the same
+ * architecture.
+ *
+ * \param path the file to open
+ * \param gallery output location for the gallery, to be freed with
+ * fp_gallery_free()
+ * \returns 0 on success, negative error code otherwise
+ */
+API_EXPORTED int fp_gallery_open_compiled(const char *path,
+	struct fp_gallery **gallery)
+{
+	struct compiled_map *map;
+	struct fp_gallery *g;
+	GPtrArray *entries;
+	int nr_prints, r;
+
+	r = compiled_load(path, &map, &entries, &nr_prints);
+	if (r < 0)
+		return r;
+
+	g = fp_gallery_new();
+	g_ptr_array_free(g->entries, TRUE);
+	g->entries = entries;
+	g->nr_prints = nr_prints;
+	g->map = map;
+	g->path = g_strdup(path);
+	g->mem += strlen(path) + 1 + map->mem;
+	g->mem_peak = g->mem;
+	*gallery = g;
+	return 0;
+}
+
+/** \ingroup gallery
+ * Switches a compiled gallery to the latest version of its file, if it was
+ * saved again since the gallery was opened or last reloaded. Identifications
+ * in progress complete against the previous version.
+ *
+ * \param gallery a gallery opened with fp_gallery_open_compiled()
+ * \returns 1 if the gallery was reloaded, 0 if the file did not change,
+ * negative error code otherwise, in which case the gallery is left as it was
+ */
+API_EXPORTED int fp_gallery_reload(struct fp_gallery *gallery)
+{
+	struct compiled_map *map, *old_map;
+	GPtrArray *entries, *old_entries;
+	struct stat st;
+	gboolean unchanged;
+	int nr_prints, r;
+
+	if (!gallery->map)
+		return -EINVAL;
+
+	if (g_stat(gallery->path, &st) < 0)
+		return -errno;
+
+	/* new versions are renamed into place, the inode tells them apart */
+	g_rw_lock_reader_lock(&gallery->lock);
+	unchanged = st.st_dev == gallery->map->dev &&
+		st.st_ino == gallery->map->ino;
+	g_rw_lock_reader_unlock(&gallery->lock);
+	if (unchanged)
+		return 0;
+
+	r = compiled_load(gallery->path, &map, &entries, &nr_prints);
+	if (r < 0)
+		return r;
+
+	g_rw_lock_writer_lock(&gallery->lock);
+	old_map = gallery->map;
+	old_entries = gallery->entries;
+	gallery->map = map;
+	gallery->entries = entries;
+	gallery->nr_prints = nr_prints;
+	gallery->generation++;
+	gallery->mem = gallery->mem - old_map->mem + map->mem;
+	if (gallery->mem > gallery->mem_peak)
+		gallery->mem_peak = gallery->mem;
+	g_rw_lock_writer_unlock(&gallery->lock);
+
+	entries_free(old_entries);
+	compiled_map_free(old_map);
+	return 1;
+}
+
+/** \ingroup gallery
+ * Makes identification favour the prints matched most often and most
+ * recently. In fp_identify_mode#FP_IDENTIFY_FIRST_MATCH mode, the matcher
+ * stops at the first print reaching the threshold, so trying the prints
+ * of frequent users first makes their identification faster, while prints
+ * which are rarely matched sink behind the others. Candidates which were
+ * never matched keep being ordered by similarity, after the others.
+ *
+ * Match counts are kept in memory only, and start from zero again when a
+ * compiled gallery is reloaded.
+ *
+ * \param gallery the gallery
+ * \param enabled whether to order candidates by past matches, disabled by
+ * default
+ */
+API_EXPORTED void fp_gallery_set_adaptive_order(struct fp_gallery *gallery,
+	int enabled)
+{
+	g_rw_lock_writer_lock(&gallery->lock);
+	gallery->adaptive_order = enabled;
+	g_rw_lock_writer_unlock(&gallery->lock);
+}
+
+/* Accounts for a match of the print with the given ID, called with the
+ * gallery locked for reading */
+static void record_hit(struct fp_gallery *gallery, int id)
+{
+	struct gallery_entry *entry = g_ptr_array_index(gallery->entries, id);
+	unsigned int i;
+
+	g_mutex_lock(&gallery->hits_lock);
+	entry->hits += gallery->hit_weight;
+	gallery->hit_weight /= HIT_DECAY;
+	if (gallery->hit_weight > HIT_RESCALE) {
+		for (i = 0; i < gallery->entries->len; i++) {
+			entry = g_ptr_array_index(gallery->entries, i);
+			if (entry)
+				entry->hits /= gallery->hit_weight;
+		}
+		gallery->hit_weight = 1.0;
+	}
+	g_mutex_unlock(&gallery->hits_lock);
+}
+
+struct candidate {
+	int id;
+	guint32 votes;
+	double hits;
+};
+
+static int cmp_candidates(const void *a, const void *b)
+{
+	const struct candidate *ca = a;
+	const struct candidate *cb = b;
+
+	if (ca->votes != cb->votes)
+		return ca->votes > cb->votes ? -1 : 1;
+	return ca->id - cb->id;
+}
+
+static int cmp_candidates_by_hits(const void *a, const void *b)
+{
+	const struct candidate *ca = a;
+	const struct candidate *cb = b;
+
+	if (ca->hits != cb->hits)
+		return ca->hits > cb->hits ? -1 : 1;
+	return cmp_candidates(a, b);
+}
+
+/* Sorts candidates by decreasing votes and keeps the first max_candidates
+ * of them, if not 0. Returns the number of candidates kept. */
+static int rank_candidates(struct fp_gallery *gallery,
+	struct candidate *candidates, int nr_candidates,
+	unsigned int max_candidates)
+{
+	int i;
+
+	qsort(candidates, nr_candidates, sizeof(*candidates), cmp_candidates);
+	if (max_candidates && nr_candidates > max_candidates)
+		nr_candidates = max_candidates;
+
+	/* frequent users go first among the prints looking alike */
+	if (gallery->adaptive_order) {
+		g_mutex_lock(&gallery->hits_lock);
+		for (i = 0; i < nr_candidates; i++) {
+			struct gallery_entry *entry = g_ptr_array_index(
+				gallery->entries, candidates[i].id);
+			candidates[i].hits = entry->hits;
+		}
+		g_mutex_unlock(&gallery->hits_lock);
+		qsort(candidates, nr_candidates, sizeof(*candidates),
+			cmp_candidates_by_hits);
+	}
+
+	return nr_candidates;
+}
+
+/* Each probe edge votes for the prints having an edge under a compatible
+ * key. Returns the number of candidates stored, best first. */
+static int select_candidates(struct fp_gallery *gallery,
+	struct bz_template *tmpl, struct candidate **ret)
+{
+	guint32 *votes = g_new0(guint32, gallery->entries->len);
+	struct candidate *candidates;
+	int nr_candidates = 0;
+	unsigned int i;
+	const short *dist_col = BZ_TEMPLATE_COL(tmpl, 0);
+	const short *beta1_col = BZ_TEMPLATE_COL(tmpl, 1);
+	const short *beta2_col = BZ_TEMPLATE_COL(tmpl, 2);
+	int e;
+
+	for (e = 0; e < tmpl->nedges; e++) {
+		int dists[MAX_NEIGHBOURS];
+		int betas1[MAX_NEIGHBOURS];
+		int betas2[MAX_NEIGHBOURS];
+		int dist = (int) sqrt(dist_col[e]);
+		int nd, nb1, nb2, a, b, c;
+
+		nd = neighbour_bins(dist, DIST_STEP, DIST_BINS,
+			DIST_TOLERANCE(dist), FALSE, dists);
+		nb1 = neighbour_bins(beta1_col[e] + BETA_OFFSET, BETA_STEP,
+			BETA_BINS, BETA_TOLERANCE, TRUE, betas1);
+		nb2 = neighbour_bins(beta2_col[e] + BETA_OFFSET, BETA_STEP,
+			BETA_BINS, BETA_TOLERANCE, TRUE, betas2);
+
+		for (a = 0; a < nd; a++)
+			for (b = 0; b < nb1; b++)
+				for (c = 0; c < nb2; c++) {
+					const int32_t *posting;
+					unsigned int len;
+
+					posting = get_posting(gallery, make_key(
+						dists[a], betas1[b], betas2[c]), &len);
+					for (i = 0; i < len; i++)
+						votes[posting[i]]++;
+				}
+	}
+
+	candidates = g_new(struct candidate, gallery->nr_prints);
+	for (i = 0; i < gallery->entries->len; i++)
+		if (votes[i]) {
+			candidates[nr_candidates].id = i;
+			candidates[nr_candidates].votes = votes[i];
+			candidates[nr_candidates].hits = 0;
+			nr_candidates++;
+		}
+	g_free(votes);
+
+	*ret = candidates;
+	return rank_candidates(gallery, candidates, nr_candidates,
+		gallery->max_candidates);
+}
+
+#ifdef HAVE_OPENCL
+/* Same as select_candidates(), with the votes counted by the device over
+ * all prints. Returns a negative error code if the device failed. */
+static int offload_candidates(struct fp_gallery *gallery,
+	struct bz_template *tmpl, struct candidate **ret)
+{
+	unsigned int nr_ids = gallery->entries->len;
+	struct fp_print_data **prints = g_new(struct fp_print_data *, nr_ids);
+	int *scores = g_new(int, nr_ids);
+	struct candidate *candidates;
+	int nr_candidates = 0;
+	unsigned int i;
+	int r;
+
+	for (i = 0; i < nr_ids; i++) {
+		struct gallery_entry *entry = g_ptr_array_index(gallery->entries, i);
+
+		prints[i] = entry ? entry->print : NULL;
+	}
+
+	r = fpi_offload_score(gallery->offload, prints, nr_ids,
+		gallery->generation, tmpl, scores);
+	g_free(prints);
+	if (r < 0) {
+		g_free(scores);
+		return r;
+	}
+
+	candidates = g_new(struct candidate, gallery->nr_prints);
+	for (i = 0; i < nr_ids; i++)
+		if (scores[i] > 0) {
+			candidates[nr_candidates].id = i;
+			candidates[nr_candidates].votes = scores[i];
+			candidates[nr_candidates].hits = 0;
+			nr_candidates++;
+		}
+	g_free(scores);
+
+	*ret = candidates;
+	return rank_candidates(gallery, candidates, nr_candidates,
+		gallery->offload_shortlist);
+}
+#endif
+
+int fpi_gallery_identify(struct fp_gallery *gallery,
+	struct fp_print_data *print, int match_threshold, size_t *match_id)
+{
+	struct fp_print_data **prints;
+	struct candidate *candidates;
+	struct bz_template *tmpl;
+	size_t match_offset;
+	int nr_candidates;
+	int i, r;
+
+	if (g_slist_length(print->prints) != 1) {
+		fp_err("new_print contains more than one sample, is it enrolled print?");
+		return -EINVAL;
+	}
+
+	tmpl = fpi_print_data_item_get_template(print->prints->data);
+	if (!tmpl)
+		return -ENOMEM;
+
+	g_rw_lock_reader_lock(&gallery->lock);
+	nr_candidates = -1;
+#ifdef HAVE_OPENCL
+	if (gallery->offload &&
+	    gallery->nr_prints > gallery->offload_shortlist) {
+		nr_candidates = offload_candidates(gallery, tmpl, &candidates);
+		if (nr_candidates < 0)
+			fp_warn("offload failed, falling back to the index");
+	}
+#endif
+	if (nr_candidates < 0)
+		nr_candidates = select_candidates(gallery, tmpl, &candidates);
+	fp_dbg("%d candidates out of %d prints", nr_candidates,
+		gallery->nr_prints);
+
+	prints = g_new(struct fp_print_data *, nr_candidates + 1);
+	for (i = 0; i < nr_candidates; i++) {
+		struct gallery_entry *entry;
+
+		entry = g_ptr_array_index(gallery->entries, candidates[i].id);
+		prints[i] = entry->print;
+	}
+	prints[nr_candidates] = NULL;
+
+	r = fpi_img_compare_print_data_to_gallery(print, prints,
+		match_threshold, &match_offset);
+	if (r == FP_VERIFY_MATCH) {
+		*match_id = candidates[match_offset].id;
+		if (gallery->adaptive_order)
+			record_hit(gallery, *match_id);
+	}
+	g_rw_lock_reader_unlock(&gallery->lock);
+
+	g_free(prints);
+	g_free(candidates);
+	return r;
+}
@@ -17,10 +17,13 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <config.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <sched.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <glib.h>
 
@@ -45,20 +48,155 @@
  * natural upright orientation.
  */
 
+/* Memory held by all images, see fp_get_img_memory_usage() */
+static GMutex img_mem_lock;
+static size_t img_mem_current = 0;
+static size_t img_mem_peak = 0;
+
+static void img_mem_account(gssize delta)
+{
+	g_mutex_lock(&img_mem_lock);
+	img_mem_current += delta;
+	if (img_mem_current > img_mem_peak)
+		img_mem_peak = img_mem_current;
+	g_mutex_unlock(&img_mem_lock);
+}
+
 struct fp_img *fpi_img_new(size_t length)
 {
 	struct fp_img *img = g_malloc0(sizeof(*img) + length);
 	fp_dbg("length=%zd", length);
 	img->length = length;
+	img->refcount = 1;
+	g_mutex_init(&img->lock);
+	img_mem_account(sizeof(*img) + length);
+	return img;
+}
+
+/* Images of a fixed size device are recycled rather than allocated for each
+ * scan. The pool is referenced by its device and by each image taken from
+ * it, which may outlive the device. */
+#define IMG_POOL_MAX_FREE	4
+
+struct fpi_img_pool {
+	GMutex lock;
+	int refcount;
+	size_t length;
+	gboolean closed;
+	GSList *free_imgs;
+	unsigned int nr_free;
+};
+
+struct fpi_img_pool *fpi_img_pool_new(size_t length)
+{
+	struct fpi_img_pool *pool = g_malloc0(sizeof(*pool));
+
+	g_mutex_init(&pool->lock);
+	pool->refcount = 1;
+	pool->length = length;
+	return pool;
+}
+
+/* Drops a reference, freeing the pool and its free images with the last
+ * one. Must be called without the pool lock held. */
+static void img_pool_unref(struct fpi_img_pool *pool)
+{
+	gboolean last;
+
+	g_mutex_lock(&pool->lock);
+	last = --pool->refcount == 0;
+	g_mutex_unlock(&pool->lock);
+	if (!last)
+		return;
+
+	g_slist_free_full(pool->free_imgs, g_free);
+	g_mutex_clear(&pool->lock);
+	g_free(pool);
+}
+
+/* Called as the device goes away, the images still out are freed as they
+ * come back */
+void fpi_img_pool_close(struct fpi_img_pool *pool)
+{
+	GSList *free_imgs;
+
+	g_mutex_lock(&pool->lock);
+	pool->closed = TRUE;
+	free_imgs = pool->free_imgs;
+	pool->free_imgs = NULL;
+	pool->nr_free = 0;
+	g_mutex_unlock(&pool->lock);
+
+	g_slist_free_full(free_imgs, g_free);
+	img_pool_unref(pool);
+}
+
+size_t fpi_img_pool_get_memory_usage(struct fpi_img_pool *pool)
+{
+	size_t size;
+
+	g_mutex_lock(&pool->lock);
+	size = sizeof(*pool) + pool->nr_free *
+		(sizeof(struct fp_img) + pool->length + sizeof(GSList));
+	g_mutex_unlock(&pool->lock);
+	return size;
+}
+
+static struct fp_img *img_pool_get(struct fpi_img_pool *pool)
+{
+	struct fp_img *img = NULL;
+
+	g_mutex_lock(&pool->lock);
+	if (pool->free_imgs) {
+		img = pool->free_imgs->data;
+		pool->free_imgs = g_slist_delete_link(pool->free_imgs,
+			pool->free_imgs);
+		pool->nr_free--;
+	}
+	pool->refcount++;
+	g_mutex_unlock(&pool->lock);
+
+	if (img) {
+		/* cleared as a fresh image would be, drivers may leave parts
+		 * of the image untouched */
+		memset(img, 0, sizeof(*img) + pool->length);
+		img->length = pool->length;
+		img->refcount = 1;
+		g_mutex_init(&img->lock);
+		img_mem_account(sizeof(*img) + img->length);
+	} else {
+		img = fpi_img_new(pool->length);
+	}
+	img->pool = pool;
 	return img;
 }
 
+/* Takes back an image stripped of its minutiae and binarized copy */
+static void img_pool_put(struct fpi_img_pool *pool, struct fp_img *img)
+{
+	g_mutex_lock(&pool->lock);
+	if (!pool->closed && pool->nr_free < IMG_POOL_MAX_FREE) {
+		pool->free_imgs = g_slist_prepend(pool->free_imgs, img);
+		pool->nr_free++;
+		img = NULL;
+	}
+	g_mutex_unlock(&pool->lock);
+
+	g_free(img);
+	img_pool_unref(pool);
+}
+
 struct fp_img *fpi_img_new_for_imgdev(struct fp_img_dev *imgdev)
 {
 	struct fp_img_driver *imgdrv = fpi_driver_to_img_driver(imgdev->dev->drv);
 	int width = imgdrv->img_width;
 	int height = imgdrv->img_height;
-	struct fp_img *img = fpi_img_new(width * height);
+	struct fp_img *img;
+
+	if (imgdev->img_pool)
+		img = img_pool_get(imgdev->img_pool);
+	else
+		img = fpi_img_new(width * height);
 	img->width = width;
 	img->height = height;
 	return img;
@@ -79,23 +217,102 @@ gboolean fpi_img_is_sane(struct fp_img *img)
 
 struct fp_img *fpi_img_resize(struct fp_img *img, size_t newsize)
 {
-	return g_realloc(img, sizeof(*img) + newsize);
+	/* a resized image no longer fits in its pool */
+	if (img->pool) {
+		img_pool_unref(img->pool);
+		img->pool = NULL;
+	}
+	img_mem_account((gssize) newsize - (gssize) img->length);
+	g_mutex_clear(&img->lock);
+	img = g_realloc(img, sizeof(*img) + newsize);
+	g_mutex_init(&img->lock);
+	img->length = newsize;
+	return img;
+}
+
+/** \ingroup img
+ * Takes a reference on an image, so that it can be handed to another part
+ * of the application, possibly running on another thread, without copying
+ * it. Each reference is released with fp_img_free().
+ *
+ * The images libfprint passes to the application are already
+ * \ref img_std "standardized" and must not be modified once shared.
+ * fp_img_get_minutiae() and fp_img_binarize() may be called concurrently on
+ * a shared image.
+ *
+ * \param img the image
+ * \returns img
+ */
+API_EXPORTED struct fp_img *fp_img_ref(struct fp_img *img)
+{
+	g_atomic_int_inc(&img->refcount);
+	return img;
 }
 
 /** \ingroup img
- * Frees an image. Must be called when you are finished working with an image.
- * \param img the image to destroy. If NULL, function simply returns.
+ * Releases a reference on an image, freeing it with the last one. Must be
+ * called when you are finished working with an image.
+ * \param img the image to release. If NULL, function simply returns.
  */
 API_EXPORTED void fp_img_free(struct fp_img *img)
 {
 	if (!img)
 		return;
+	if (!g_atomic_int_dec_and_test(&img->refcount))
+		return;
 
+	g_mutex_clear(&img->lock);
+	img_mem_account(-(gssize) fp_img_get_memory_usage(img));
 	if (img->minutiae)
 		free_minutiae(img->minutiae);
 	if (img->binarized)
 		free(img->binarized);
-	g_free(img);
+	if (img->pool)
+		img_pool_put(img->pool, img);
+	else
+		g_free(img);
+}
+
+static size_t minutiae_memory_usage(struct fp_minutiae *minutiae)
+{
+	size_t size = sizeof(*minutiae) + minutiae->alloc * sizeof(minutiae->list[0]);
+	int i;
+
+	for (i = 0; i < minutiae->num; i++)
+		size += sizeof(struct fp_minutia) +
+			2 * minutiae->list[i]->num_nbrs * sizeof(int);
+	return size;
+}
+
+/** \ingroup img
+ * Gets the memory held by an image: its pixels, and the binarized copy and
+ * minutiae which were computed from it, if any.
+ * \param img an image
+ * \returns the size of the image in memory, in bytes
+ */
+API_EXPORTED size_t fp_img_get_memory_usage(struct fp_img *img)
+{
+	size_t size = sizeof(*img) + img->length;
+
+	if (img->binarized)
+		size += img->height * BITIMAGE_STRIDE(img->width) * sizeof(BITWORD);
+	if (img->minutiae)
+		size += minutiae_memory_usage(img->minutiae);
+	return size;
+}
+
+/** \ingroup img
+ * Gets the memory held by all the images which exist at the moment,
+ * whether the application or libfprint holds them, and the most they ever
+ * held at once.
+ * \param usage where to store the current and peak sizes, in bytes
+ */
+API_EXPORTED void fp_get_img_memory_usage(struct fp_memory_usage *usage)
+{
+	g_mutex_lock(&img_mem_lock);
+	usage->current = img_mem_current;
+	usage->peak = img_mem_peak;
+	g_mutex_unlock(&img_mem_lock);
 }
 
 /** \ingroup img
@@ -150,65 +367,59 @@ API_EXPORTED int fp_img_save_to_file(struct fp_img *img, char *path)
 	r = fprintf(fd, "P5 %d %d 255\n", img->width, img->height);
 	if (r < 0) {
 		fp_err("pgm header write failed, error %d", r);
-		return r;
+		fclose(fd);
+		return -EIO;
 	}
 
 	r = fwrite(img->data, 1, write_size, fd);
 	if (r < write_size) {
 		fp_err("short write (%d)", r);
+		fclose(fd);
 		return -EIO;
 	}
 
-	fclose(fd);
+	if (fclose(fd) != 0) {
+		fp_err("pgm write failed: %d", errno);
+		return -EIO;
+	}
 	fp_dbg("written to '%s'", path);
 	return 0;
 }
 
-static void vflip(struct fp_img *img)
+/* Exchanges two rows, or reverses one if row1 == row2, possibly flipping
+ * them horizontally. The pixels are XORed with mask on the way. */
+static void standardize_rows(unsigned char *row1, unsigned char *row2,
+	int width, gboolean hflip, unsigned char mask)
 {
-	int width = img->width;
-	int data_len = img->width * img->height;
-	unsigned char rowbuf[width];
+	unsigned char tmp;
 	int i;
 
-	for (i = 0; i < img->height / 2; i++) {
-		int offset = i * width;
-		int swap_offset = data_len - (width * (i + 1));
-
-		/* copy top row into buffer */
-		memcpy(rowbuf, img->data + offset, width);
-
-		/* copy lower row over upper row */
-		memcpy(img->data + offset, img->data + swap_offset, width);
-
-		/* copy buffer over lower row */
-		memcpy(img->data + swap_offset, rowbuf, width);
-	}
-}
-
-static void hflip(struct fp_img *img)
-{
-	int width = img->width;
-	unsigned char rowbuf[width];
-	int i, j;
-
-	for (i = 0; i < img->height; i++) {
-		int offset = i * width;
-
-		memcpy(rowbuf, img->data + offset, width);
-		for (j = 0; j < width; j++)
-			img->data[offset + j] = rowbuf[width - j - 1];
+	if (row1 == row2 && !hflip) {
+		for (i = 0; i < width; i++)
+			row1[i] ^= mask;
+	} else if (row1 == row2) {
+		for (i = 0; i < width / 2; i++) {
+			tmp = row1[i];
+			row1[i] = row1[width - i - 1] ^ mask;
+			row1[width - i - 1] = tmp ^ mask;
+		}
+		if (width % 2)
+			row1[width / 2] ^= mask;
+	} else if (hflip) {
+		for (i = 0; i < width; i++) {
+			tmp = row1[i];
+			row1[i] = row2[width - i - 1] ^ mask;
+			row2[width - i - 1] = tmp ^ mask;
+		}
+	} else {
+		for (i = 0; i < width; i++) {
+			tmp = row1[i];
+			row1[i] = row2[i] ^ mask;
+			row2[i] = tmp ^ mask;
+		}
 	}
 }
 
-static void invert_colors(struct fp_img *img)
-{
-	int data_len = img->width * img->height;
-	int i;
-	for (i = 0; i < data_len; i++)
-		img->data[i] = 0xff - img->data[i];
-}
-
 /** \ingroup img
  * \ref img_std "Standardizes" an image by normalizing its orientation, colors,
  * etc. It is safe to call this multiple times on an image, libfprint keeps
@@ -218,35 +429,76 @@ static void invert_colors(struct fp_img *img)
  */
 API_EXPORTED void fp_img_standardize(struct fp_img *img)
 {
-	if (img->flags & FP_IMG_V_FLIPPED) {
-		vflip(img);
-		img->flags &= ~FP_IMG_V_FLIPPED;
-	}
-	if (img->flags & FP_IMG_H_FLIPPED) {
-		hflip(img);
-		img->flags &= ~FP_IMG_H_FLIPPED;
-	}
-	if (img->flags & FP_IMG_COLORS_INVERTED) {
-		invert_colors(img);
-		img->flags &= ~FP_IMG_COLORS_INVERTED;
+	gboolean vflip = img->flags & FP_IMG_V_FLIPPED;
+	gboolean hflip = img->flags & FP_IMG_H_FLIPPED;
+	unsigned char mask = (img->flags & FP_IMG_COLORS_INVERTED) ? 0xff : 0;
+	int width = img->width;
+	int i;
+
+	if (!vflip && !hflip && !mask)
+		return;
+
+	/* All the flags are handled in a single pass over the rows, a vertical
+	 * flip exchanging rows from both ends of the image */
+	for (i = 0; i < (vflip ? (img->height + 1) / 2 : img->height); i++) {
+		unsigned char *row = img->data + i * width;
+		unsigned char *other = vflip ?
+			img->data + (img->height - i - 1) * width : row;
+
+		standardize_rows(row, other, width, hflip, mask);
 	}
+
+	img->flags &= ~(FP_IMG_V_FLIPPED | FP_IMG_H_FLIPPED |
+		FP_IMG_COLORS_INVERTED);
+}
+
+/* Minutiae kept in each sample, see fp_set_template_max_minutiae() */
+static volatile gint template_max_minutiae = MAX_BOZORTH_MINUTIAE;
+
+struct ranked_minutia {
+	int index;
+	int quality;
+};
+
+/* Best quality first, in detection order among equals */
+static int cmp_ranked_minutiae(const void *a, const void *b)
+{
+	const struct ranked_minutia *ra = a;
+	const struct ranked_minutia *rb = b;
+
+	if (ra->quality != rb->quality)
+		return rb->quality - ra->quality;
+	return ra->index - rb->index;
 }
 
-/* Based on write_minutiae_XYTQ and bz_load */
-static void minutiae_to_xyt(struct fp_minutiae *minutiae, int bwidth,
-	int bheight, unsigned char *buf)
+/* Based on write_minutiae_XYTQ and bz_load. When there are too many minutiae,
+ * the most reliable ones are kept. */
+static struct fp_print_data_item *minutiae_to_xyt(
+	struct fp_minutiae *minutiae, int bwidth, int bheight)
 {
 	int i;
 	struct fp_minutia *minutia;
-	struct minutiae_struct c[MAX_FILE_MINUTIAE];
-	struct xyt_struct *xyt = (struct xyt_struct *) buf;
-
-	/* FIXME: only considers first 150 minutiae (MAX_FILE_MINUTIAE) */
-	/* nist does weird stuff with 150 vs 1000 limits */
-	int nmin = min(minutiae->num, MAX_FILE_MINUTIAE);
+	struct minutiae_struct c[MAX_BOZORTH_MINUTIAE];
+	struct ranked_minutia *ranked = NULL;
+	struct fp_print_data_item *item;
+	struct fpi_xyt *xyt;
+	int nmin = min(minutiae->num, g_atomic_int_get(&template_max_minutiae));
+
+	if (nmin < minutiae->num) {
+		ranked = g_new(struct ranked_minutia, minutiae->num);
+		for (i = 0; i < minutiae->num; i++) {
+			ranked[i].index = i;
+			ranked[i].quality =
+				sround(minutiae->list[i]->reliability * 100.0);
+		}
+		qsort(ranked, minutiae->num, sizeof(*ranked),
+			cmp_ranked_minutiae);
+		fp_dbg("keeping %d out of %d minutiae, down to quality %d", nmin,
+			minutiae->num, ranked[nmin - 1].quality);
+	}
 
 	for (i = 0; i < nmin; i++){
-		minutia = minutiae->list[i];
+		minutia = minutiae->list[ranked ? ranked[i].index : i];
 
 		lfs2nist_minutia_XYT(&c[i].col[0], &c[i].col[1], &c[i].col[2],
 				minutia, bwidth, bheight);
@@ -255,28 +507,427 @@ static void minutiae_to_xyt(struct fp_minutiae *minutiae, int bwidth,
 		if (c[i].col[2] > 180)
 			c[i].col[2] -= 360;
 	}
+	g_free(ranked);
 
 	qsort((void *) &c, (size_t) nmin, sizeof(struct minutiae_struct),
 			sort_x_y);
 
+	item = fpi_print_data_item_new(FPI_XYT_SIZE(nmin));
+	xyt = (struct fpi_xyt *) item->data;
 	for (i = 0; i < nmin; i++) {
-		xyt->xcol[i]     = c[i].col[0];
-		xyt->ycol[i]     = c[i].col[1];
-		xyt->thetacol[i] = c[i].col[2];
+		xyt->cols[i]            = c[i].col[0];
+		xyt->cols[nmin + i]     = c[i].col[1];
+		xyt->cols[2 * nmin + i] = c[i].col[2];
 	}
 	xyt->nrows = nmin;
+	return item;
 }
 
-int fpi_img_detect_minutiae(struct fp_img *img)
+/** \ingroup dev
+ * Sets the maximum number of minutiae kept in the prints made from scanned
+ * images. When more minutiae are detected, the most reliable ones are kept
+ * and the others, often caused by noise, are dropped. Matching time grows
+ * with the square of the number of minutiae, so smaller values make
+ * matching faster, but too small values make it less accurate. Prints made
+ * earlier are not affected.
+ *
+ * \param max_minutiae the number of minutiae to keep, or 0 for the default
+ * of 200, which is also the maximum
+ */
+API_EXPORTED void fp_set_template_max_minutiae(unsigned int max_minutiae)
+{
+	if (max_minutiae == 0 || max_minutiae > MAX_BOZORTH_MINUTIAE)
+		max_minutiae = MAX_BOZORTH_MINUTIAE;
+
+	fp_dbg("%u minutiae", max_minutiae);
+	g_atomic_int_set(&template_max_minutiae, max_minutiae);
+}
+
+int fpi_img_get_template_max_minutiae(void)
+{
+	return g_atomic_int_get(&template_max_minutiae);
+}
+
+/* Points xyt at the minutiae of an NBIS sample */
+void fpi_print_data_item_get_xyt(struct fp_print_data_item *item,
+	struct xyt_struct *xyt)
+{
+	struct fpi_xyt *data = (struct fpi_xyt *) item->data;
+
+	xyt->nrows = data->nrows;
+	xyt->xcol = data->cols;
+	xyt->ycol = data->cols + data->nrows;
+	xyt->thetacol = data->cols + 2 * data->nrows;
+}
+
+/* Older versions stored samples as a dump of a fixed size structure, with
+ * room for MAX_BOZORTH_MINUTIAE values in every column */
+#define LEGACY_XYT_SIZE		FPI_XYT_SIZE(MAX_BOZORTH_MINUTIAE)
+
+/* Creates an NBIS sample from stored data, which may come in either the
+ * compact or the legacy layout. Returns NULL if the data is invalid. If
+ * borrow is set, the sample refers to buf instead of copying it whenever
+ * possible; buf must then outlive the sample. */
+struct fp_print_data_item *fpi_print_data_item_from_xyt(
+	const unsigned char *buf, size_t length, gboolean borrow)
+{
+	struct fp_print_data_item *item;
+	struct fpi_xyt *xyt;
+	int nrows, i;
+
+	if (length < sizeof(struct fpi_xyt)) {
+		fp_err("minutiae data too short");
+		return NULL;
+	}
+
+	/* buf may be unaligned */
+	memcpy(&nrows, buf, sizeof(nrows));
+	if (nrows < 0 || nrows > MAX_BOZORTH_MINUTIAE) {
+		fp_err("invalid number of minutiae %d", nrows);
+		return NULL;
+	}
+
+	/* Both layouts are the same when all the room is used */
+	if (length == FPI_XYT_SIZE(nrows)) {
+		if (borrow && ((uintptr_t) buf % sizeof(int)) == 0)
+			return fpi_print_data_item_borrow(buf, length);
+		item = fpi_print_data_item_new(length);
+		memcpy(item->data, buf, length);
+		return item;
+	}
+
+	if (length != LEGACY_XYT_SIZE) {
+		fp_err("invalid minutiae data length %zd for %d minutiae", length,
+			nrows);
+		return NULL;
+	}
+
+	item = fpi_print_data_item_new(FPI_XYT_SIZE(nrows));
+	xyt = (struct fpi_xyt *) item->data;
+	xyt->nrows = nrows;
+	buf += sizeof(struct fpi_xyt);
+	for (i = 0; i < 3; i++) {
+		memcpy(xyt->cols + i * nrows, buf, nrows * sizeof(int));
+		buf += MAX_BOZORTH_MINUTIAE * sizeof(int);
+	}
+	return item;
+}
+
+/* The lookup tables used for minutiae detection only depend on the image
+ * width (remove_perimeter_pts, the only parameter changed per image, doesn't
+ * affect them). Each driver produces images of a fixed size, cropped to a few
+ * widths, see CROP_WIDTH_STEP. Tables are kept for the first few widths seen,
+ * until fpi_img_exit(). */
+#define MAX_CACHED_LFSTABLES	16
+
+static LFSTABLES *lfstables_cache[MAX_CACHED_LFSTABLES];
+static int nr_cached_lfstables = 0;
+static GMutex lfstables_lock;
+
+/* Returns NULL if the tables can't be cached, in which case detection builds
+ * its own */
+static const LFSTABLES *get_lfstables(int width, int height,
+	const LFSPARMS *lfsparms)
+{
+	LFSTABLES *tables = NULL;
+	int i;
+
+	g_mutex_lock(&lfstables_lock);
+	for (i = 0; i < nr_cached_lfstables; i++)
+		if (lfstables_cache[i]->iw == width) {
+			tables = lfstables_cache[i];
+			goto out;
+		}
+
+	if (nr_cached_lfstables < MAX_CACHED_LFSTABLES) {
+		fp_dbg("creating tables for %d pixel wide images", width);
+		if (init_lfstables(&tables, width, height, lfsparms) == 0)
+			lfstables_cache[nr_cached_lfstables++] = tables;
+		else
+			tables = NULL;
+	}
+
+out:
+	g_mutex_unlock(&lfstables_lock);
+	return tables;
+}
+
+/* Each thread extracting minutiae keeps an arena for the intermediate
+ * results, reset after every image. It is freed when the thread exits. */
+static GPrivate lfsarena_key = G_PRIVATE_INIT((GDestroyNotify) free_lfsarena);
+
+/* Returns NULL if no arena could be created, in which case detection falls
+ * back to malloc() */
+static LFSARENA *get_lfsarena(void)
+{
+	LFSARENA *arena = g_private_get(&lfsarena_key);
+
+	if (!arena) {
+		if (init_lfsarena(&arena))
+			return NULL;
+		g_private_set(&lfsarena_key, arena);
+	}
+	return arena;
+}
+
+/* Threads sharing the direction map of each image, see
+ * fp_set_extraction_threads() */
+static volatile gint extraction_threads = 1;
+
+/** \ingroup dev
+ * Sets the number of threads used to analyse the ridge flow of each scanned
+ * image during minutiae extraction, and to scan it for minutiae when
+ * fp_set_extraction_scan_bands() is enabled. The calling thread counts as
+ * one of them. By default, a single thread is used. Several threads mostly
+ * help with the large images produced by swipe sensors.
+ *
+ * \param nr_threads the number of threads to use, or 0 to use one thread per
+ * online CPU
+ */
+API_EXPORTED void fp_set_extraction_threads(unsigned int nr_threads)
+{
+	if (nr_threads == 0) {
+		long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nr_threads = nr_cpus > 0 ? nr_cpus : 1;
+	}
+
+	fp_dbg("%u threads", nr_threads);
+	g_atomic_int_set(&extraction_threads, MIN(nr_threads, G_MAXINT));
+}
+
+/* see fp_set_extraction_precision() */
+static volatile gint extraction_precision = FP_EXTRACTION_PRECISE;
+
+/** \ingroup dev
+ * Selects the arithmetic used to analyse the ridge flow of scanned images.
+ * fp_extraction_precision#FP_EXTRACTION_FAST halves the size of the
+ * numbers, so that twice as many fit in vector registers and caches, which
+ * helps most on processors without fast double precision vectors, such as
+ * many ARM ones. It may find a slightly different ridge direction in blurry
+ * areas, and thus slightly different minutiae: prints extracted with either
+ * setting still match each other, but scores may vary a little. The default
+ * is fp_extraction_precision#FP_EXTRACTION_PRECISE.
+ *
+ * \param precision the arithmetic to use
+ */
+API_EXPORTED void fp_set_extraction_precision(
+	enum fp_extraction_precision precision)
+{
+	g_atomic_int_set(&extraction_precision, precision);
+}
+
+/* see fp_set_extraction_scan_bands() */
+static volatile gint extraction_scan_bands = 0;
+
+/** \ingroup dev
+ * Sets whether the binarized image is scanned for minutiae in bands of rows
+ * and columns, shared between the threads set with
+ * fp_set_extraction_threads(), rather than in a single pass. Minutiae found
+ * along the band boundaries may differ slightly from those of a single
+ * pass, as do the duplicates kept when a minutia near a high curvature was
+ * moved into another block: prints extracted with either setting still
+ * match each other, but scores may vary a little. The results don't depend
+ * on the number of threads. Bands are off by default.
+ *
+ * \param enabled non-zero to scan in bands
+ */
+API_EXPORTED void fp_set_extraction_scan_bands(int enabled)
+{
+	g_atomic_int_set(&extraction_scan_bands, !!enabled);
+}
+
+/* Flag abandoning the extraction and matching run by each thread, see
+ * fpi_img_set_cancel() */
+static GPrivate cancel_key;
+
+/* Makes the minutiae extraction and the matching run by the calling thread,
+ * including the part handed over to the identification threads, give up with
+ * -ECANCELED soon after *cancel is set: at the next block of the direction
+ * map, row of the binarization or minutiae scan, or gallery print. NULL stops
+ * checking. */
+void fpi_img_set_cancel(volatile gint *cancel)
+{
+	g_private_set(&cancel_key, (gpointer) cancel);
+}
+
+static volatile gint *get_cancel(void)
+{
+	return g_private_get(&cancel_key);
+}
+
+static gboolean is_cancelled(volatile gint *cancel)
+{
+	return cancel && g_atomic_int_get(cancel);
+}
+
+/* The quality gate looks at the image in tiles of the size mindtct uses to
+ * tell ridges from background. Below these limits, there is no point in
+ * running the extraction: not enough minutiae would be found anyway. */
+#define QUALITY_TILE_SIZE	MAP_WINDOWSIZE_V2
+#define QUALITY_MIN_COVERAGE	10	/* percentage of contrasted tiles */
+#define QUALITY_MIN_TILES	12	/* number of contrasted tiles */
+
+/* Same test as low_contrast_block() in mindtct, on the 6-bit values mindtct
+ * works with, so that a tile is rejected here only if it would be so there */
+static gboolean low_contrast_tile(const unsigned char *data, int width,
+	int thresh)
+{
+	int table[IMG_6BIT_PIX_LIMIT] = { 0, };
+	int x, y, i, sum, min, max;
+
+	for (y = 0; y < QUALITY_TILE_SIZE; y++, data += width)
+		for (x = 0; x < QUALITY_TILE_SIZE; x++)
+			table[data[x] >> 2]++;
+
+	for (i = 0, sum = 0; i < IMG_6BIT_PIX_LIMIT - 1; i++)
+		if ((sum += table[i]) >= thresh)
+			break;
+	min = i;
+	for (i = IMG_6BIT_PIX_LIMIT - 1, sum = 0; i > 0; i--)
+		if ((sum += table[i]) >= thresh)
+			break;
+	max = i;
+
+	return max - min < g_lfsparms_V2.min_contrast_delta;
+}
+
+/* Before minutiae detection, the image is cropped to the tiles showing
+ * ridges, plus a tile of margin, so that mindtct doesn't analyse the blank
+ * margins of assembled swipes or the parts of area sensors the finger doesn't
+ * cover. The crop starts on a block boundary, so that the blocks mindtct
+ * analyses are those of the whole image, and its width is a multiple of
+ * CROP_WIDTH_STEP, as lookup tables are needed for each image width. */
+#define CROP_MARGIN		QUALITY_TILE_SIZE
+#define CROP_WIDTH_STEP		32
+#define CROP_MIN_SAVING		20	/* percentage of the image area */
+
+struct img_roi {
+	int x;
+	int y;
+	int width;
+	int height;
+};
+
+/* Finds the part of img worth detecting minutiae in. Returns FALSE if that
+ * is the whole image, or close enough to it. */
+static gboolean find_img_roi(struct fp_img *img, struct img_roi *roi)
+{
+	int numpix = QUALITY_TILE_SIZE * QUALITY_TILE_SIZE;
+	int thresh, x, y, x0, y0, x1, y1;
+
+	thresh = (g_lfsparms_V2.percentile_min_max * (numpix - 1) + 50) / 100;
+	x0 = img->width;
+	y0 = img->height;
+	x1 = y1 = 0;
+	for (y = 0; y + QUALITY_TILE_SIZE <= img->height; y += QUALITY_TILE_SIZE)
+		for (x = 0; x + QUALITY_TILE_SIZE <= img->width;
+				x += QUALITY_TILE_SIZE) {
+			if (low_contrast_tile(img->data + y * img->width + x,
+					img->width, thresh))
+				continue;
+			x0 = MIN(x0, x);
+			y0 = MIN(y0, y);
+			x1 = MAX(x1, x + QUALITY_TILE_SIZE);
+			y1 = MAX(y1, y + QUALITY_TILE_SIZE);
+		}
+	if (x1 == 0)
+		return FALSE;
+
+	x0 = MAX(x0 - CROP_MARGIN, 0) / MAP_BLOCKSIZE_V2 * MAP_BLOCKSIZE_V2;
+	y0 = MAX(y0 - CROP_MARGIN, 0) / MAP_BLOCKSIZE_V2 * MAP_BLOCKSIZE_V2;
+	x1 = MIN(x1 + CROP_MARGIN, img->width);
+	y1 = MIN(y1 + CROP_MARGIN, img->height);
+
+	roi->width = (x1 - x0 + CROP_WIDTH_STEP - 1) / CROP_WIDTH_STEP *
+		CROP_WIDTH_STEP;
+	if (roi->width >= img->width)
+		return FALSE;
+	/* a rounded up crop reaching past the right edge moves left instead */
+	if (x0 + roi->width > img->width)
+		x0 = (img->width - roi->width) / MAP_BLOCKSIZE_V2 *
+			MAP_BLOCKSIZE_V2;
+	roi->x = x0;
+	roi->y = y0;
+	roi->height = y1 - y0;
+
+	return roi->width * roi->height * 100 <=
+		img->width * img->height * (100 - CROP_MIN_SAVING);
+}
+
+/* Gives the binarized image of the roi of img the size of the whole image,
+ * the pixels around it being white */
+static BITWORD *uncrop_bitimage(struct fp_img *img, const struct img_roi *roi,
+	const BITWORD *bits)
+{
+	unsigned char *data = g_malloc0(img->width * img->height);
+	unsigned char *row = g_malloc(roi->width);
+	BITWORD *obits = NULL;
+	int y;
+
+	for (y = 0; y < roi->height; y++) {
+		unpack_bitimage(row, bits + y * BITIMAGE_STRIDE(roi->width),
+			roi->width, 1, 1, 0);
+		memcpy(data + (roi->y + y) * img->width + roi->x, row,
+			roi->width);
+	}
+	if (pack_bitimage(&obits, data, img->width, img->height, 1))
+		obits = NULL;
+
+	g_free(row);
+	g_free(data);
+	return obits;
+}
+
+/* Minutiae at least this reliable were found in blocks of quality A or B,
+ * see combined_minutia_quality() */
+#define RELIABLE_MINUTIA	0.25
+
+/* Sums up the quality map of img, or of the part of it minutiae were detected
+ * in, the blocks outside of it being background */
+static void summarize_quality(struct fp_img *img, const int *quality_map,
+	int map_w, int map_h, struct fp_minutiae *minutiae,
+	struct fp_img_quality *quality)
+{
+	int blocks = ((img->width + MAP_BLOCKSIZE_V2 - 1) / MAP_BLOCKSIZE_V2) *
+		((img->height + MAP_BLOCKSIZE_V2 - 1) / MAP_BLOCKSIZE_V2);
+	int i, foreground = 0, sum = 0;
+
+	/* quality 0 blocks have no ridges mindtct could follow */
+	for (i = 0; i < map_w * map_h; i++)
+		if (quality_map[i] > 0) {
+			foreground++;
+			sum += quality_map[i];
+		}
+
+	quality->foreground = MIN(foreground * 100 / blocks, 100);
+	quality->ridge_quality = foreground ? sum * 100 / (foreground * 4) : 0;
+	quality->reliable_minutiae = 0;
+	for (i = 0; i < minutiae->num; i++)
+		if (minutiae->list[i]->reliability >= RELIABLE_MINUTIA)
+			quality->reliable_minutiae++;
+	fp_dbg("foreground %d%%, ridge quality %d%%, %d reliable minutiae",
+		quality->foreground, quality->ridge_quality,
+		quality->reliable_minutiae);
+}
+
+/* Runs minutiae detection on img, cropped to its foreground, summing up its
+ * quality in oquality. The binarized image is only kept, packed, if obits is
+ * set, the maps are never kept. */
+static int detect_minutiae(struct fp_img *img, struct fp_minutiae **ominutiae,
+	struct fp_img_quality *oquality, BITWORD **obits, int map_threads,
+	fpi_stage_fn stage_done, void *stage_data)
 {
 	struct fp_minutiae *minutiae;
-	int r;
-	int *direction_map, *low_contrast_map, *low_flow_map;
-	int *high_curve_map, *quality_map;
-	int map_w, map_h;
-	unsigned char *bdata;
-	int bw, bh, bd;
+	struct img_roi roi = { 0, 0, img->width, img->height };
+	unsigned char *data = img->data;
+	BITWORD *bits = NULL;
+	int *quality_map = NULL;
+	int map_w = 0, map_h = 0;
+	int i, r;
 	GTimer *timer;
+	/* Per-call copy, so that several images can be processed at once */
+	LFSPARMS lfsparms = g_lfsparms_V2;
+	LFSARENA *arena;
 
 	if (img->flags & FP_IMG_STANDARDIZATION_FLAGS) {
 		fp_err("cant detect minutiae for non-standardized image");
@@ -284,43 +935,148 @@ int fpi_img_detect_minutiae(struct fp_img *img)
 	}
 
 	/* Remove perimeter points from partial image */
-	g_lfsparms_V2.remove_perimeter_pts = img->flags & FP_IMG_PARTIAL ? TRUE : FALSE;
+	lfsparms.remove_perimeter_pts = img->flags & FP_IMG_PARTIAL ? TRUE : FALSE;
+	lfsparms.map_threads = map_threads;
+	lfsparms.dft_single = g_atomic_int_get(&extraction_precision) ==
+		FP_EXTRACTION_FAST;
+	lfsparms.scan_bands = g_atomic_int_get(&extraction_scan_bands);
+	lfsparms.stage_done = stage_done;
+	lfsparms.stage_data = stage_data;
+	lfsparms.cancel = get_cancel();
 
-	/* 25.4 mm per inch */
 	timer = g_timer_new();
-	r = get_minutiae(&minutiae, &quality_map, &direction_map,
-                         &low_contrast_map, &low_flow_map, &high_curve_map,
-                         &map_w, &map_h, &bdata, &bw, &bh, &bd,
-                         img->data, img->width, img->height, 8,
-						 DEFAULT_PPI / (double)25.4, &g_lfsparms_V2);
+	if (find_img_roi(img, &roi)) {
+		fp_dbg("cropped to %dx%d at %d,%d", roi.width, roi.height,
+			roi.x, roi.y);
+		data = g_malloc(roi.width * roi.height);
+		for (i = 0; i < roi.height; i++)
+			memcpy(data + i * roi.width,
+				img->data + (roi.y + i) * img->width + roi.x,
+				roi.width);
+	}
+
+	/* 25.4 mm per inch */
+	arena = get_lfsarena();
+	r = get_minutiae(&minutiae, &quality_map, NULL, NULL, NULL, NULL,
+		&map_w, &map_h, obits ? &bits : NULL, NULL, NULL, NULL, data, roi.width,
+		roi.height, 8, DEFAULT_PPI / (double)25.4, &lfsparms,
+		get_lfstables(roi.width, roi.height, &lfsparms), arena);
+	if (data != img->data)
+		g_free(data);
 	g_timer_stop(timer);
 	fp_dbg("minutiae scan completed in %f secs", g_timer_elapsed(timer, NULL));
 	g_timer_destroy(timer);
-	if (r) {
+
+	if (r == 0)
+		summarize_quality(img, quality_map, map_w, map_h, minutiae,
+			oquality);
+
+	/* Only the minutiae and the binarized image were allocated outside of
+	 * the arena */
+	if (arena)
+		reset_lfsarena(arena);
+	else
+		free(quality_map);
+	if (r == LFS_CANCELLED) {
+		fp_dbg("minutiae scan cancelled");
+		return -ECANCELED;
+	} else if (r) {
 		fp_err("get minutiae failed, code %d", r);
 		return r;
 	}
+
+	/* Back to the coordinates of the whole image */
+	for (i = 0; i < minutiae->num; i++) {
+		minutiae->list[i]->x += roi.x;
+		minutiae->list[i]->y += roi.y;
+		minutiae->list[i]->ex += roi.x;
+		minutiae->list[i]->ey += roi.y;
+	}
+	if (obits && roi.width != img->width) {
+		*obits = uncrop_bitimage(img, &roi, bits);
+		free(bits);
+		if (!*obits) {
+			free_minutiae(minutiae);
+			return -ENOMEM;
+		}
+	} else if (obits) {
+		*obits = bits;
+	}
+
 	fp_dbg("detected %d minutiae", minutiae->num);
-	img->minutiae = minutiae;
-	img->binarized = bdata;
-
-	free(quality_map);
-	free(direction_map);
-	free(low_contrast_map);
-	free(low_flow_map);
-	free(high_curve_map);
+	*ominutiae = minutiae;
 	return minutiae->num;
 }
 
-int fpi_img_to_print_data(struct fp_img_dev *imgdev, struct fp_img *img,
-	struct fp_print_data **ret)
+/* Detects the minutiae of img and attaches them to it */
+static int detect_img_minutiae(struct fp_img *img, int map_threads,
+	fpi_stage_fn stage_done, void *stage_data)
+{
+	int r = detect_minutiae(img, &img->minutiae, &img->quality, NULL,
+		map_threads, stage_done, stage_data);
+
+	if (r >= 0)
+		img_mem_account(minutiae_memory_usage(img->minutiae));
+	return r;
+}
+
+/* The binarized image is left out, fp_img_binarize() creates it on demand */
+int fpi_img_detect_minutiae(struct fp_img *img)
+{
+	return fpi_img_detect_minutiae_staged(img, NULL, NULL);
+}
+
+/* Same as fpi_img_detect_minutiae(), calling stage_done with one of the
+ * LFS_STAGE_* values as each step of the extraction completes, for profiling */
+int fpi_img_detect_minutiae_staged(struct fp_img *img, fpi_stage_fn stage_done,
+	void *stage_data)
+{
+	return detect_img_minutiae(img, g_atomic_int_get(&extraction_threads),
+		stage_done, stage_data);
+}
+
+/* Cheap check run before minutiae extraction, rejecting images which are
+ * mostly background. Returns 0 if the image is worth processing, otherwise
+ * the FP_ENROLL_RETRY code (shared with FP_VERIFY_RETRY) explaining why it
+ * was rejected. */
+int fpi_img_check_quality(struct fp_img *img, enum fp_scan_type scan_type)
+{
+	int numpix = QUALITY_TILE_SIZE * QUALITY_TILE_SIZE;
+	int thresh, x, y, tiles = 0, contrasted = 0;
+
+	thresh = (g_lfsparms_V2.percentile_min_max * (numpix - 1) + 50) / 100;
+	for (y = 0; y + QUALITY_TILE_SIZE <= img->height; y += QUALITY_TILE_SIZE)
+		for (x = 0; x + QUALITY_TILE_SIZE <= img->width;
+				x += QUALITY_TILE_SIZE) {
+			tiles++;
+			if (!low_contrast_tile(img->data + y * img->width + x,
+					img->width, thresh))
+				contrasted++;
+		}
+
+	fp_dbg("%d/%d contrasted tiles", contrasted, tiles);
+	if (contrasted * 100 < tiles * QUALITY_MIN_COVERAGE) {
+		/* Hardly any ridges: no finger, or a wet or pressed too hard one */
+		return FP_ENROLL_RETRY_REMOVE_FINGER;
+	} else if (contrasted < QUALITY_MIN_TILES) {
+		/* Some ridges, but too small an area */
+		return scan_type == FP_SCAN_TYPE_SWIPE ?
+			FP_ENROLL_RETRY_TOO_SHORT : FP_ENROLL_RETRY_CENTER_FINGER;
+	}
+
+	return 0;
+}
+
+/* Makes a print of the minutiae of img, detecting them first if needed */
+static int img_to_print_data(struct fp_img *img, int map_threads,
+	uint16_t driver_id, uint32_t devtype, struct fp_print_data **ret)
 {
 	struct fp_print_data *print;
 	struct fp_print_data_item *item;
 	int r;
 
 	if (!img->minutiae) {
-		r = fpi_img_detect_minutiae(img);
+		r = detect_img_minutiae(img, map_threads, NULL, NULL);
 		if (r < 0)
 			return r;
 		if (!img->minutiae) {
@@ -329,94 +1085,1302 @@ int fpi_img_to_print_data(struct fp_img_dev *imgdev, struct fp_img *img,
 		}
 	}
 
-	/* FIXME: space is wasted if we dont hit the max minutiae count. would
-	 * be good to make this dynamic. */
-	print = fpi_print_data_new(imgdev->dev);
-	item = fpi_print_data_item_new(sizeof(struct xyt_struct));
-	print->type = PRINT_DATA_NBIS_MINUTIAE;
-	minutiae_to_xyt(img->minutiae, img->width, img->height, item->data);
+	print = fpi_print_data_new_typed(driver_id, devtype,
+		PRINT_DATA_NBIS_MINUTIAE);
+	item = minutiae_to_xyt(img->minutiae, img->width, img->height);
 	print->prints = g_slist_prepend(print->prints, item);
-
-	/* FIXME: the print buffer at this point is endian-specific, and will
-	 * only work when loaded onto machines with identical endianness. not good!
-	 * data format should be platform-independent. */
 	*ret = print;
 
 	return 0;
 }
 
-int fpi_img_compare_print_data(struct fp_print_data *enrolled_print,
-	struct fp_print_data *new_print)
+int fpi_img_to_print_data(struct fp_img_dev *imgdev, struct fp_img *img,
+	struct fp_print_data **ret)
 {
-	int score, max_score = 0, probe_len;
-	struct xyt_struct *pstruct = NULL;
-	struct xyt_struct *gstruct = NULL;
-	struct fp_print_data_item *data_item;
-	GSList *list_item;
+	struct fp_dev *dev = imgdev->dev;
 
-	if (enrolled_print->type != PRINT_DATA_NBIS_MINUTIAE ||
-	     new_print->type != PRINT_DATA_NBIS_MINUTIAE) {
-		fp_err("invalid print format");
-		return -EINVAL;
-	}
+	return img_to_print_data(img, g_atomic_int_get(&extraction_threads),
+		dev->drv->id, dev->devtype, ret);
+}
 
-	if (g_slist_length(new_print->prints) != 1) {
-		fp_err("new_print contains more than one sample, is it enrolled print?");
-		return -EINVAL;
-	}
+/** \ingroup img
+ * Creates an image from greyscale pixels obtained elsewhere, for example
+ * from a legacy system, to build prints with fp_img_batch_to_print_data().
+ * Prints can only be matched against prints of images taken at the same
+ * resolution, 500 dpi for the drivers shipped with libfprint.
+ *
+ * \param width the width of the image, in pixels
+ * \param height the height of the image, in pixels
+ * \param data width * height bytes of 8-bit pixels, row after row, with the
+ * finger flesh as black on white surroundings, upright
+ * \returns the new image, to be freed with fp_img_free()
+ */
+API_EXPORTED struct fp_img *fp_img_new_from_data(int width, int height,
+	const unsigned char *data)
+{
+	struct fp_img *img;
+
+	g_return_val_if_fail(width > 0 && height > 0, NULL);
+
+	img = fpi_img_new((size_t) width * height);
+	img->width = width;
+	img->height = height;
+	memcpy(img->data, data, img->length);
+	return img;
+}
+
+struct batch_job {
+	struct fp_img_batch_entry *entries;
+	gint nr_entries;
+	/* next entry to be claimed by a worker */
+	volatile gint next;
+	volatile gint nr_prints;
+};
+
+/* Runs on the calling thread and on the pool threads, until the batch is
+ * exhausted. Each thread keeps its minutiae detection arena and matcher
+ * context for all the images it processes, and all share the tables. */
+static void batch_worker(gpointer data, gpointer user_data)
+{
+	struct batch_job *job = data;
+	gint i;
+
+	while ((i = g_atomic_int_add(&job->next, 1)) < job->nr_entries) {
+		struct fp_img_batch_entry *entry = &job->entries[i];
+
+		entry->print = NULL;
+		if (entry->img->flags & FP_IMG_BINARIZED_FORM) {
+			entry->status = -EINVAL;
+			continue;
+		}
+
+		/* images are processed in parallel, one thread each */
+		fp_img_standardize(entry->img);
+		entry->status = img_to_print_data(entry->img, 1,
+			entry->driver_id, entry->devtype, &entry->print);
+		if (entry->status == 0)
+			g_atomic_int_inc(&job->nr_prints);
+	}
+}
+
+/** \ingroup img
+ * Builds the prints of many images at once, for instance to import
+ * fingerprints recorded by other systems. The images are spread over a
+ * group of threads, each one processing whole images.
+ *
+ * Each image is standardized, and keeps its minutiae, as if passed to
+ * fp_img_get_minutiae(). In each entry, print is set to the print of the
+ * image, or NULL if it couldn't be made, and status to 0 or a negative error
+ * code. The prints are marked as coming from the driver and device type given
+ * in the entry, so that they can be matched against prints scanned from such
+ * a device later on.
+ *
+ * \param entries the images and the origin of their prints
+ * \param nr_entries the number of entries
+ * \param nr_threads the number of threads to use, including the calling one,
+ * 0 for one per online CPU
+ * \returns the number of prints made, or a negative error code
+ */
+API_EXPORTED int fp_img_batch_to_print_data(struct fp_img_batch_entry *entries,
+	size_t nr_entries, unsigned int nr_threads)
+{
+	struct batch_job job;
+	GThreadPool *pool = NULL;
+	GError *error = NULL;
+	unsigned int i;
+
+	if (nr_entries > G_MAXINT / 2)
+		return -EINVAL;
+
+	if (nr_threads == 0) {
+		long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nr_threads = nr_cpus > 0 ? nr_cpus : 1;
+	}
+	nr_threads = MIN(nr_threads, nr_entries);
+
+	job.entries = entries;
+	job.nr_entries = nr_entries;
+	job.next = 0;
+	job.nr_prints = 0;
+
+	if (nr_threads > 1) {
+		pool = g_thread_pool_new(batch_worker, NULL, nr_threads - 1,
+			TRUE, &error);
+		if (!pool) {
+			fp_err("couldn't create batch thread pool: %s, "
+				"processing on a single thread", error->message);
+			g_error_free(error);
+		}
+	}
+
+	fp_dbg("%zu images, %u threads", nr_entries, pool ? nr_threads : 1);
+	for (i = 1; pool && i < nr_threads; i++)
+		g_thread_pool_push(pool, &job, NULL);
+
+	/* The calling thread takes its share of the work too */
+	batch_worker(&job, NULL);
+	if (pool)
+		g_thread_pool_free(pool, FALSE, TRUE);
+
+	return job.nr_prints;
+}
+
+/* Each thread gets its own matcher context, allocated on first use and
+ * released when the thread exits. This allows comparisons to run
+ * concurrently from several threads. */
+static GPrivate bz_ctx_key = G_PRIVATE_INIT((GDestroyNotify) bz_ctx_free);
+
+static struct bz_ctx *get_bz_ctx(void)
+{
+	struct bz_ctx *ctx = g_private_get(&bz_ctx_key);
+
+	if (!ctx) {
+		ctx = bz_ctx_new();
+		if (!ctx) {
+			fp_err("couldn't allocate matcher context");
+			return NULL;
+		}
+		g_private_set(&bz_ctx_key, ctx);
+	}
+	return ctx;
+}
+
+/* The matcher context of the calling thread, for the matching jobs living
+ * outside of this file */
+struct bz_ctx *fpi_img_get_bz_ctx(void)
+{
+	return get_bz_ctx();
+}
+
+/* Enrolled samples never change, so the gallery side of the matcher only
+ * needs to be computed once per sample. */
+static struct bz_template *get_bz_template(struct bz_ctx *ctx,
+	struct fp_print_data_item *item)
+{
+	struct bz_template *tmpl = g_atomic_pointer_get(&item->bz_template);
+	struct xyt_struct gstruct;
+
+	if (tmpl)
+		return tmpl;
+
+	fpi_print_data_item_get_xyt(item, &gstruct);
+	tmpl = bozorth_gallery_compile_ctx(ctx, &gstruct);
+	if (!tmpl)
+		return NULL;
+
+	/* Another thread may have compiled the same sample meanwhile */
+	if (!g_atomic_pointer_compare_and_exchange(&item->bz_template, NULL,
+			tmpl)) {
+		bozorth_template_free(tmpl);
+		tmpl = g_atomic_pointer_get(&item->bz_template);
+	}
+	return tmpl;
+}
+
+struct bz_template *fpi_print_data_item_get_template(
+	struct fp_print_data_item *item)
+{
+	struct bz_ctx *ctx = get_bz_ctx();
+
+	if (!ctx)
+		return NULL;
+	return get_bz_template(ctx, item);
+}
+
+/* Number of comparisons made by each thread, see fpi_img_get_comparisons() */
+static GPrivate comparisons_key = G_PRIVATE_INIT(g_free);
+
+static void count_comparisons(guint64 n)
+{
+	guint64 *count = g_private_get(&comparisons_key);
+
+	if (!count) {
+		count = g_new0(guint64, 1);
+		g_private_set(&comparisons_key, count);
+	}
+	*count += n;
+}
+
+/* Returns the number of prints the calling thread compared so far, including
+ * the comparisons it handed over to the identification threads */
+guint64 fpi_img_get_comparisons(void)
+{
+	guint64 *count = g_private_get(&comparisons_key);
+
+	return count ? *count : 0;
+}
+
+/* With a positive match_threshold, the score is only exact as far as
+ * reaching the threshold goes, which lets the matcher stop early */
+static int compare_to_item(struct bz_ctx *ctx, int probe_len,
+	struct xyt_struct *pstruct, struct fp_print_data_item *item,
+	int match_threshold)
+{
+	struct bz_template *tmpl = get_bz_template(ctx, item);
+	struct xyt_struct gstruct;
+
+	fpi_print_data_item_get_xyt(item, &gstruct);
+	if (!tmpl)
+		return bozorth_to_gallery_ctx(ctx, probe_len, pstruct, &gstruct);
+	if (match_threshold > 0)
+		return bozorth_to_template_bounded_ctx(ctx, probe_len, pstruct,
+			&gstruct, tmpl, match_threshold);
+	return bozorth_to_template_ctx(ctx, probe_len, pstruct, &gstruct, tmpl);
+}
+
+/* Score new_print against the samples of enrolled_print and return the best
+ * score. With a positive match_threshold, stop at the first sample reaching
+ * it, and only tell whether the threshold is reached. The index of the best
+ * (or matching) sample goes to best_sample. */
+static int compare_print_data(struct fp_print_data *enrolled_print,
+	struct fp_print_data *new_print, int match_threshold,
+	size_t *best_sample)
+{
+	int score, max_score = 0, probe_len;
+	struct xyt_struct pstruct;
+	struct fp_print_data_item *data_item;
+	volatile gint *cancel = get_cancel();
+	struct bz_ctx *ctx;
+	GSList *list_item;
+	size_t i = 0;
+
+	if (enrolled_print->type != PRINT_DATA_NBIS_MINUTIAE ||
+	     new_print->type != PRINT_DATA_NBIS_MINUTIAE) {
+		fp_err("invalid print format");
+		return -EINVAL;
+	}
+
+	if (g_slist_length(new_print->prints) != 1) {
+		fp_err("new_print contains more than one sample, is it enrolled print?");
+		return -EINVAL;
+	}
+
+	ctx = get_bz_ctx();
+	if (!ctx)
+		return -ENOMEM;
 
 	data_item = new_print->prints->data;
-	pstruct = (struct xyt_struct *)data_item->data;
+	fpi_print_data_item_get_xyt(data_item, &pstruct);
 
-	probe_len = bozorth_probe_init(pstruct);
+	*best_sample = 0;
+	probe_len = bozorth_probe_init_ctx(ctx, &pstruct);
 	list_item = enrolled_print->prints;
 	do {
+		if (is_cancelled(cancel)) {
+			count_comparisons(i);
+			return -ECANCELED;
+		}
 		data_item = list_item->data;
-		gstruct = (struct xyt_struct *)data_item->data;
-		score = bozorth_to_gallery(probe_len, pstruct, gstruct);
+		score = compare_to_item(ctx, probe_len, &pstruct, data_item,
+			match_threshold);
 		fp_dbg("score %d", score);
+		if (score > max_score) {
+			max_score = score;
+			*best_sample = i;
+		}
+		if (match_threshold > 0 && score >= match_threshold)
+			break;
+		list_item = g_slist_next(list_item);
+		i++;
+	} while (list_item);
+
+	count_comparisons(list_item ? i + 1 : i);
+	return max_score;
+}
+
+int fpi_img_compare_print_data(struct fp_print_data *enrolled_print,
+	struct fp_print_data *new_print)
+{
+	size_t best_sample;
+
+	return compare_print_data(enrolled_print, new_print, 0, &best_sample);
+}
+
+/* Like fpi_img_compare_print_data(), but stops as soon as one enrolled sample
+ * reaches match_threshold. Returns a code from #fp_verify_result, and the
+ * index of the matching sample in match_sample on FP_VERIFY_MATCH. */
+int fpi_img_verify_print_data(struct fp_print_data *enrolled_print,
+	struct fp_print_data *new_print, int match_threshold,
+	size_t *match_sample)
+{
+	size_t sample;
+	int r;
+
+	r = compare_print_data(enrolled_print, new_print, match_threshold,
+		&sample);
+	if (r < 0)
+		return r;
+	if (r < match_threshold)
+		return FP_VERIFY_NO_MATCH;
+
+	fp_dbg("sample %zu matched with score %d", sample, r);
+	*match_sample = sample;
+	return FP_VERIFY_MATCH;
+}
+
+/* Identification settings, see fp_set_identify_threads() and
+ * fp_set_identify_mode() */
+static unsigned int identify_threads = 1;
+static enum fp_identify_mode identify_mode = FP_IDENTIFY_FIRST_MATCH;
+
+/* Identification workers are split between the NUMA nodes, with a pool of
+ * threads for each node, restricted to its CPUs. The gallery is split the
+ * same way, see identify_job_run(). Everything below is set up on first use
+ * and torn down when the settings change, under identify_pool_lock. */
+#define MAX_IDENTIFY_NODES	16
+
+struct identify_node {
+	GThreadPool *pool;
+	cpu_set_t cpus;
+	unsigned int nr_cpus;
+	unsigned int nr_workers;
+	/* shard of the gallery matched first by the workers of this node */
+	int shard;
+};
+
+static struct identify_node identify_nodes[MAX_IDENTIFY_NODES];
+static int nr_identify_nodes = 0;
+/* node of each CPU, -1 for CPUs left out */
+static signed char identify_cpu_nodes[CPU_SETSIZE];
+/* see fp_set_identify_cpus(), workers are only pinned when it was called
+ * or when there is more than one node */
+static cpu_set_t identify_cpus;
+static gboolean identify_cpus_set = FALSE;
+static gboolean identify_pinned = FALSE;
+static GMutex identify_pool_lock;
+/* node the current worker thread is pinned to */
+static GPrivate identify_thread_node;
+
+/* Coarse identification tier, see fp_set_identify_prescreen() */
+static volatile gint prescreen_minutiae = 0;
+static volatile gint prescreen_shortlist = 0;
+
+/* Candidate rejection ahead of the full match, see
+ * fp_set_identify_prefilter() */
+static volatile gint prefilter_min_similarity = 0;
+static guint64 prefilter_passed = 0;
+static guint64 prefilter_rejected = 0;
+static GMutex prefilter_lock;
+
+struct prefilter {
+	int min_similarity;
+	int probe_nrows;
+	int probe_hist[BZ_HIST_BINS];
+	guint64 passed;
+	guint64 rejected;
+};
+
+/* Number of gallery prints a worker claims at once */
+#define IDENTIFY_CHUNK_SIZE	16
+
+/* Range of gallery offsets matched by the workers of a node */
+struct identify_shard {
+	/* next offset to be claimed */
+	volatile gint next;
+	gint end;
+};
+
+struct identify_job {
+	struct xyt_struct pstruct;
+	struct fp_print_data **gallery;
+	gint gallery_len;
+	int match_threshold;
+	enum fp_identify_mode mode;
+	/* if set, the score of every print is stored here and nothing else
+	 * is computed */
+	int *scores;
+	/* see fpi_img_set_cancel(), checked before each print */
+	volatile gint *cancel;
+
+	/* workers claim prints from the shard of their node first, then help
+	 * the other nodes once it is done */
+	struct identify_shard shards[MAX_IDENTIFY_NODES];
+	int nr_shards;
+	/* prints at or beyond this offset need not be looked at, in
+	 * FP_IDENTIFY_FIRST_MATCH mode this ends up as the matching offset */
+	volatile gint limit;
+
+	/* protected by lock */
+	GMutex lock;
+	GCond cond;
+	int pending;
+	int error;
+	guint64 comparisons;
+	/* FP_IDENTIFY_BEST_MATCH result */
+	int best_score;
+	gint best_offset;
+};
+
+static void prefilter_init(struct prefilter *pf, struct bz_ctx *ctx,
+	int probe_len, struct xyt_struct *pstruct)
+{
+	pf->min_similarity = g_atomic_int_get(&prefilter_min_similarity);
+	pf->probe_nrows = pstruct->nrows;
+	pf->passed = 0;
+	pf->rejected = 0;
+	if (pf->min_similarity > 0)
+		bozorth_probe_hist_ctx(ctx, probe_len, pf->probe_hist);
+}
+
+/* Returns FALSE if the sample can't possibly reach a meaningful score */
+static gboolean prefilter_pass(struct prefilter *pf, struct bz_ctx *ctx,
+	struct fp_print_data_item *item)
+{
+	struct fpi_xyt *gstruct = (struct fpi_xyt *)item->data;
+	struct bz_template *tmpl;
+
+	/* bz_match_score() scores these as zero anyway */
+	if (pf->probe_nrows < MIN_COMPUTABLE_BOZORTH_MINUTIAE ||
+	    gstruct->nrows < MIN_COMPUTABLE_BOZORTH_MINUTIAE)
+		goto reject;
+
+	if (pf->min_similarity > 0) {
+		tmpl = get_bz_template(ctx, item);
+		if (tmpl && bozorth_hist_similarity(pf->probe_hist, tmpl->hist)
+				< pf->min_similarity)
+			goto reject;
+	}
+
+	pf->passed++;
+	return TRUE;
+
+reject:
+	pf->rejected++;
+	return FALSE;
+}
+
+static void prefilter_flush(struct prefilter *pf)
+{
+	g_mutex_lock(&prefilter_lock);
+	prefilter_passed += pf->passed;
+	prefilter_rejected += pf->rejected;
+	g_mutex_unlock(&prefilter_lock);
+}
+
+/* Score a probe against all samples of a gallery print. If stop_early is set,
+ * return as soon as a sample reaches the threshold. */
+static int score_gallery_print(struct bz_ctx *ctx, int probe_len,
+	struct xyt_struct *pstruct, struct prefilter *pf,
+	struct fp_print_data *gallery_print, int match_threshold,
+	gboolean stop_early)
+{
+	GSList *list_item = gallery_print->prints;
+	int score, max_score = 0;
+
+	do {
+		if (!prefilter_pass(pf, ctx, list_item->data)) {
+			list_item = g_slist_next(list_item);
+			continue;
+		}
+		score = compare_to_item(ctx, probe_len, pstruct, list_item->data,
+			stop_early ? match_threshold : 0);
 		max_score = max(score, max_score);
+		if (stop_early && score >= match_threshold)
+			break;
 		list_item = g_slist_next(list_item);
 	} while (list_item);
 
 	return max_score;
 }
 
-int fpi_img_compare_print_data_to_gallery(struct fp_print_data *print,
-	struct fp_print_data **gallery, int match_threshold, size_t *match_offset)
+/* Stop all workers from looking at prints at or beyond offset */
+static void identify_job_limit(struct identify_job *job, gint offset)
 {
-	struct xyt_struct *pstruct;
-	struct xyt_struct *gstruct;
-	struct fp_print_data *gallery_print;
-	struct fp_print_data_item *data_item;
+	gint limit;
+
+	do {
+		limit = g_atomic_int_get(&job->limit);
+	} while (offset < limit &&
+		 !g_atomic_int_compare_and_exchange(&job->limit, limit, offset));
+}
+
+/* Claims the next chunk of prints below the limit, from the given shard
+ * first. Returns the first offset of the chunk and stores the end of the
+ * chunk in end, or returns -1 if there is nothing left. */
+static gint identify_job_claim(struct identify_job *job, int shard, gint *end)
+{
+	gint limit = g_atomic_int_get(&job->limit);
+	gint start;
+	int i;
+
+	for (i = 0; i < job->nr_shards; i++) {
+		struct identify_shard *s =
+			&job->shards[(shard + i) % job->nr_shards];
+		gint shard_end = MIN(s->end, limit);
+
+		if (g_atomic_int_get(&s->next) >= shard_end)
+			continue;
+		start = g_atomic_int_add(&s->next, IDENTIFY_CHUNK_SIZE);
+		if (start < shard_end) {
+			*end = MIN(start + IDENTIFY_CHUNK_SIZE, shard_end);
+			return start;
+		}
+	}
+	return -1;
+}
+
+static void identify_worker(struct identify_job *job, int shard)
+{
+	struct bz_ctx *ctx = get_bz_ctx();
+	struct prefilter pf;
+	gboolean first_match = !job->scores &&
+		job->mode == FP_IDENTIFY_FIRST_MATCH;
+	gboolean cancelled = FALSE;
+	int best_score = -1;
+	gint best_offset = 0;
+	gint start, end, i;
 	int probe_len;
-	size_t i = 0;
-	int r;
-	GSList *list_item;
+	int score;
+
+	if (!ctx) {
+		identify_job_limit(job, 0);
+		g_mutex_lock(&job->lock);
+		job->error = -ENOMEM;
+		goto out;
+	}
+
+	probe_len = bozorth_probe_init_ctx(ctx, &job->pstruct);
+	prefilter_init(&pf, ctx, probe_len, &job->pstruct);
+	while ((start = identify_job_claim(job, shard, &end)) >= 0) {
+		for (i = start; i < end && i < g_atomic_int_get(&job->limit); i++) {
+			if (is_cancelled(job->cancel)) {
+				/* Stops the other workers as well */
+				identify_job_limit(job, 0);
+				cancelled = TRUE;
+				break;
+			}
+			score = score_gallery_print(ctx, probe_len, &job->pstruct,
+				&pf, job->gallery[i], job->match_threshold,
+				first_match);
+			if (job->scores) {
+				job->scores[i] = score;
+			} else if (first_match) {
+				/* The ones after it can be skipped, those
+				 * before it are still matched by whoever
+				 * claims them, so the first match wins */
+				if (score >= job->match_threshold) {
+					identify_job_limit(job, i);
+					break;
+				}
+			} else if (score > best_score) {
+				best_score = score;
+				best_offset = i;
+			}
+		}
+	}
+	prefilter_flush(&pf);
+
+	g_mutex_lock(&job->lock);
+	job->comparisons += pf.passed;
+	if (cancelled)
+		job->error = -ECANCELED;
+	if (best_score > job->best_score ||
+	    (best_score == job->best_score && best_offset < job->best_offset)) {
+		job->best_score = best_score;
+		job->best_offset = best_offset;
+	}
+out:
+	job->pending--;
+	g_cond_signal(&job->cond);
+	g_mutex_unlock(&job->lock);
+}
+
+/* Restricts the calling thread to the CPUs of node, once */
+static void identify_thread_pin(struct identify_node *node)
+{
+	if (g_private_get(&identify_thread_node) == node)
+		return;
+	g_private_set(&identify_thread_node, node);
+#ifdef HAVE_SCHED_SETAFFINITY
+	if (sched_setaffinity(0, sizeof(node->cpus), &node->cpus) < 0)
+		fp_warn("couldn't pin identification thread: %d", errno);
+#endif
+}
+
+static void identify_pool_func(gpointer data, gpointer user_data)
+{
+	struct identify_node *node = user_data;
+
+	if (identify_pinned)
+		identify_thread_pin(node);
+	identify_worker(data, node->shard);
+}
+
+/* Parses a sysfs CPU list such as "0-7,16-23" into cpus */
+static void parse_cpulist(const char *list, cpu_set_t *cpus)
+{
+	char *end;
+
+	CPU_ZERO(cpus);
+	while (*list) {
+		unsigned long first, last;
+
+		first = last = strtoul(list, &end, 10);
+		if (end == list)
+			break;
+		if (*end == '-')
+			last = strtoul(end + 1, &end, 10);
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, cpus);
+		list = *end == ',' ? end + 1 : end;
+	}
+}
+
+/* Finds the CPUs of each NUMA node, keeping only those in allowed. Systems
+ * without NUMA information are seen as a single node. */
+static void identify_find_nodes(cpu_set_t *allowed)
+{
+	GDir *dir;
+	const char *name;
+	int cpu, n;
+
+	nr_identify_nodes = 0;
+	dir = g_dir_open("/sys/devices/system/node", 0, NULL);
+	while (dir && (name = g_dir_read_name(dir)) &&
+	       nr_identify_nodes < MAX_IDENTIFY_NODES) {
+		struct identify_node *node = &identify_nodes[nr_identify_nodes];
+		char *path, *list;
+
+		if (!g_str_has_prefix(name, "node") ||
+		    !g_ascii_isdigit(name[4]))
+			continue;
+		path = g_strdup_printf("/sys/devices/system/node/%s/cpulist",
+			name);
+		if (g_file_get_contents(path, &list, NULL, NULL)) {
+			parse_cpulist(list, &node->cpus);
+			CPU_AND(&node->cpus, &node->cpus, allowed);
+			node->nr_cpus = CPU_COUNT(&node->cpus);
+			if (node->nr_cpus)
+				nr_identify_nodes++;
+			g_free(list);
+		}
+		g_free(path);
+	}
+	if (dir)
+		g_dir_close(dir);
+
+	if (nr_identify_nodes == 0) {
+		identify_nodes[0].cpus = *allowed;
+		identify_nodes[0].nr_cpus = CPU_COUNT(allowed);
+		nr_identify_nodes = 1;
+	}
+
+	memset(identify_cpu_nodes, -1, sizeof(identify_cpu_nodes));
+	for (n = 0; n < nr_identify_nodes; n++)
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, &identify_nodes[n].cpus))
+				identify_cpu_nodes[cpu] = n;
+}
+
+/* Sets up the pools for nr_threads pool workers, spread over the nodes by
+ * their number of CPUs. Called with identify_pool_lock held. */
+static void identify_nodes_init(unsigned int nr_threads)
+{
+	cpu_set_t allowed;
+	unsigned int t;
+	int n, best;
+
+	if (nr_identify_nodes)
+		return;
+
+	if (identify_cpus_set) {
+		allowed = identify_cpus;
+	} else {
+		CPU_ZERO(&allowed);
+#ifdef HAVE_SCHED_SETAFFINITY
+		if (sched_getaffinity(getpid(), sizeof(allowed), &allowed) < 0)
+#endif
+		{
+			long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+			for (n = 0; n < nr_cpus && n < CPU_SETSIZE; n++)
+				CPU_SET(n, &allowed);
+		}
+	}
+	identify_find_nodes(&allowed);
+	identify_pinned = identify_cpus_set || nr_identify_nodes > 1;
+
+	for (t = 0; t < nr_threads; t++) {
+		best = 0;
+		for (n = 1; n < nr_identify_nodes; n++)
+			if (identify_nodes[n].nr_cpus *
+			    (identify_nodes[best].nr_workers + 1) >
+			    identify_nodes[best].nr_cpus *
+			    (identify_nodes[n].nr_workers + 1))
+				best = n;
+		identify_nodes[best].nr_workers++;
+	}
+
+	for (n = 0, t = 0; n < nr_identify_nodes; n++) {
+		struct identify_node *node = &identify_nodes[n];
+		GError *error = NULL;
+
+		if (!node->nr_workers)
+			continue;
+		/* pinned threads must not be lent to other pools */
+		node->pool = g_thread_pool_new(identify_pool_func, node,
+			node->nr_workers, identify_pinned, &error);
+		if (!node->pool) {
+			fp_err("couldn't create identification thread pool: %s",
+				error->message);
+			g_error_free(error);
+			node->nr_workers = 0;
+			continue;
+		}
+		node->shard = t++;
+	}
+	fp_dbg("%d nodes, %u pool threads%s", nr_identify_nodes, nr_threads,
+		identify_pinned ? ", pinned" : "");
+}
+
+/* Called with identify_pool_lock held, waits for the jobs in progress */
+static void identify_nodes_free(void)
+{
+	int n;
+
+	for (n = 0; n < nr_identify_nodes; n++) {
+		if (identify_nodes[n].pool)
+			g_thread_pool_free(identify_nodes[n].pool, FALSE, TRUE);
+		memset(&identify_nodes[n], 0, sizeof(identify_nodes[n]));
+	}
+	nr_identify_nodes = 0;
+}
+
+void fpi_img_exit(void)
+{
+	int i;
+
+	g_mutex_lock(&identify_pool_lock);
+	identify_nodes_free();
+	g_mutex_unlock(&identify_pool_lock);
+
+	g_mutex_lock(&lfstables_lock);
+	for (i = 0; i < nr_cached_lfstables; i++)
+		free_lfstables(lfstables_cache[i]);
+	nr_cached_lfstables = 0;
+	g_mutex_unlock(&lfstables_lock);
+
+	/* Other threads free their arena and contours when exiting */
+	g_private_replace(&lfsarena_key, NULL);
+	free_contour_pool();
+}
+
+/* Validates print and the NULL-terminated gallery, and prepares a job
+ * matching one against the other */
+static int identify_job_init(struct identify_job *job,
+	struct fp_print_data *print, struct fp_print_data **gallery,
+	int match_threshold)
+{
+	struct fp_print_data_item *data_item;
+	size_t gallery_len = 0;
 
 	if (g_slist_length(print->prints) != 1) {
 		fp_err("new_print contains more than one sample, is it enrolled print?");
 		return -EINVAL;
 	}
 
+	while (gallery[gallery_len])
+		gallery_len++;
+	if (gallery_len > G_MAXINT / 2) {
+		fp_err("gallery too large");
+		return -EINVAL;
+	}
+
 	data_item = print->prints->data;
-	pstruct = (struct xyt_struct *)data_item->data;
-
-	probe_len = bozorth_probe_init(pstruct);
-	while ((gallery_print = gallery[i++])) {
-		list_item = gallery_print->prints;
-		do {
-			data_item = list_item->data;
-			gstruct = (struct xyt_struct *)data_item->data;
-			r = bozorth_to_gallery(probe_len, pstruct, gstruct);
-			if (r >= match_threshold) {
-				*match_offset = i - 1;
-				return FP_VERIFY_MATCH;
-			}
-			list_item = g_slist_next(list_item);
-		} while (list_item);
+	fpi_print_data_item_get_xyt(data_item, &job->pstruct);
+	job->gallery = gallery;
+	job->gallery_len = gallery_len;
+	job->match_threshold = match_threshold;
+	job->mode = identify_mode;
+	job->scores = NULL;
+	job->cancel = get_cancel();
+	job->shards[0].next = 0;
+	job->shards[0].end = gallery_len;
+	job->nr_shards = 1;
+	job->limit = gallery_len;
+	job->error = 0;
+	job->comparisons = 0;
+	job->best_score = -1;
+	job->best_offset = 0;
+	return 0;
+}
+
+/* Pushes a job to the pool of node, returns the number of workers started */
+static unsigned int identify_job_push(struct identify_job *job,
+	struct identify_node *node, unsigned int nr_workers)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_workers; i++)
+		if (!g_thread_pool_push(node->pool, job, NULL))
+			break;
+	return i;
+}
+
+/* Runs a job on as many pool threads as configured, and on the calling
+ * thread unless identification was restricted to some CPUs. Returns once
+ * the job is done.
+ *
+ * Large galleries are split into one shard per node, in proportion to its
+ * workers. The split only depends on the gallery length, so the workers of
+ * a node keep matching the same prints from one scan to the next, and the
+ * matcher templates they compile on first use stay in the memory of their
+ * node. */
+static int identify_job_run(struct identify_job *job)
+{
+	gboolean caller_works;
+	unsigned int nr_pool_threads, nr_workers, nr_chunks, wanted;
+	unsigned int pushed = 0;
+	int shard = 0;
+	int n;
+
+	g_mutex_init(&job->lock);
+	g_cond_init(&job->cond);
+	/* the calling thread is counted until it is done pushing the job,
+	 * whether it works on it or not */
+	job->pending = 1;
+
+	nr_chunks = (job->gallery_len + IDENTIFY_CHUNK_SIZE - 1) /
+		IDENTIFY_CHUNK_SIZE;
+
+	g_mutex_lock(&identify_pool_lock);
+	caller_works = !identify_cpus_set;
+	identify_nodes_init(identify_threads - (caller_works ? 1 : 0));
+	nr_workers = MIN(identify_threads, nr_chunks);
+	wanted = nr_workers - (caller_works ? 1 : 0);
+
+	nr_pool_threads = 0;
+	for (n = 0; n < nr_identify_nodes; n++)
+		nr_pool_threads += identify_nodes[n].nr_workers;
+
+	if (nr_workers == identify_threads && nr_pool_threads &&
+	    nr_identify_nodes > 1) {
+		unsigned int before = 0;
+#ifdef HAVE_SCHED_GETCPU
+		int cpu = sched_getcpu();
+#else
+		int cpu = -1;
+#endif
+
+		job->nr_shards = 0;
+		for (n = 0; n < nr_identify_nodes; n++) {
+			struct identify_node *node = &identify_nodes[n];
+			struct identify_shard *s = &job->shards[node->shard];
+
+			if (!node->nr_workers)
+				continue;
+			if (cpu >= 0 && cpu < CPU_SETSIZE &&
+			    identify_cpu_nodes[cpu] == n)
+				shard = node->shard;
+			s->next = (gint64) job->gallery_len * before /
+				nr_pool_threads;
+			before += node->nr_workers;
+			s->end = (gint64) job->gallery_len * before /
+				nr_pool_threads;
+			job->nr_shards++;
+		}
+	}
+
+	for (n = 0; n < nr_identify_nodes && pushed < wanted; n++) {
+		struct identify_node *node = &identify_nodes[n];
+		unsigned int count = MIN(node->nr_workers, wanted - pushed);
+		unsigned int started;
+
+		if (!node->pool)
+			continue;
+		g_mutex_lock(&job->lock);
+		job->pending += count;
+		g_mutex_unlock(&job->lock);
+		started = identify_job_push(job, node, count);
+		if (started < count) {
+			g_mutex_lock(&job->lock);
+			job->pending -= count - started;
+			g_mutex_unlock(&job->lock);
+		}
+		pushed += started;
 	}
-	return FP_VERIFY_NO_MATCH;
+	g_mutex_unlock(&identify_pool_lock);
+
+	/* The calling thread takes its share of the work too, or does all
+	 * of it if the pools couldn't be used */
+	if (caller_works || pushed == 0) {
+		identify_worker(job, shard);
+	} else {
+		g_mutex_lock(&job->lock);
+		job->pending--;
+		g_mutex_unlock(&job->lock);
+	}
+
+	g_mutex_lock(&job->lock);
+	while (job->pending)
+		g_cond_wait(&job->cond, &job->lock);
+	g_mutex_unlock(&job->lock);
+	g_mutex_clear(&job->lock);
+	g_cond_clear(&job->cond);
+
+	count_comparisons(job->comparisons);
+	return job->error;
+}
+
+struct prescreened {
+	gint offset;
+	int score;
+};
+
+static int cmp_prescreened(const void *a, const void *b)
+{
+	const struct prescreened *pa = a;
+	const struct prescreened *pb = b;
+
+	if (pa->score != pb->score)
+		return pa->score > pb->score ? -1 : 1;
+	return pa->offset - pb->offset;
+}
+
+static int cmp_prescreened_offsets(const void *a, const void *b)
+{
+	const struct prescreened *pa = a;
+	const struct prescreened *pb = b;
+
+	return pa->offset - pb->offset;
+}
+
+/* Reduces the probe to the nr_minutiae minutiae closest to its centroid.
+ * They form a compact area, whose edges can all be found in a matching
+ * gallery print, which is also the area most likely to be in focus. */
+static void prescreen_probe(struct xyt_struct *pstruct, int nr_minutiae,
+	int *cols, struct xyt_struct *coarse)
+{
+	struct prescreened *dist = g_new(struct prescreened, pstruct->nrows);
+	long cx = 0, cy = 0;
+	int i;
+
+	for (i = 0; i < pstruct->nrows; i++) {
+		cx += pstruct->xcol[i];
+		cy += pstruct->ycol[i];
+	}
+	cx /= pstruct->nrows;
+	cy /= pstruct->nrows;
+
+	/* closest first, by negated squared distance */
+	for (i = 0; i < pstruct->nrows; i++) {
+		long dx = pstruct->xcol[i] - cx;
+		long dy = pstruct->ycol[i] - cy;
+
+		dist[i].offset = i;
+		dist[i].score = -(int) MIN(dx * dx + dy * dy, G_MAXINT);
+	}
+	qsort(dist, pstruct->nrows, sizeof(*dist), cmp_prescreened);
+
+	/* the rows stay in their original order, sorted on x and y */
+	qsort(dist, nr_minutiae, sizeof(*dist), cmp_prescreened_offsets);
+	coarse->nrows = nr_minutiae;
+	coarse->xcol = cols;
+	coarse->ycol = cols + nr_minutiae;
+	coarse->thetacol = cols + 2 * nr_minutiae;
+	for (i = 0; i < nr_minutiae; i++) {
+		coarse->xcol[i] = pstruct->xcol[dist[i].offset];
+		coarse->ycol[i] = pstruct->ycol[dist[i].offset];
+		coarse->thetacol[i] = pstruct->thetacol[dist[i].offset];
+	}
+	g_free(dist);
+}
+
+/* Scores the gallery of job with a reduced probe, and keeps the prints
+ * scoring best for the full match. On success, shortlist is set to a
+ * NULL-terminated array of those prints, best first, and offsets to their
+ * offsets in the gallery, or both are left NULL if prescreening does not
+ * apply. */
+static int prescreen_gallery(struct identify_job *job,
+	struct fp_print_data ***shortlist, gint **offsets)
+{
+	int nr_minutiae = g_atomic_int_get(&prescreen_minutiae);
+	int nr_shortlisted = g_atomic_int_get(&prescreen_shortlist);
+	struct identify_job coarse_job = *job;
+	struct prescreened *ranked;
+	int *scores, *cols;
+	gint i;
+	int r;
+
+	if (nr_minutiae == 0 || nr_shortlisted == 0 ||
+	    job->pstruct.nrows <= nr_minutiae ||
+	    job->gallery_len <= nr_shortlisted)
+		return 0;
+
+	cols = g_new(int, 3 * nr_minutiae);
+	prescreen_probe(&job->pstruct, nr_minutiae, cols, &coarse_job.pstruct);
+	scores = g_new(int, job->gallery_len);
+	coarse_job.scores = scores;
+	r = identify_job_run(&coarse_job);
+	g_free(cols);
+	if (r < 0) {
+		g_free(scores);
+		return r;
+	}
+
+	ranked = g_new(struct prescreened, job->gallery_len);
+	for (i = 0; i < job->gallery_len; i++) {
+		ranked[i].offset = i;
+		ranked[i].score = scores[i];
+	}
+	g_free(scores);
+	qsort(ranked, job->gallery_len, sizeof(*ranked), cmp_prescreened);
+
+	*shortlist = g_new(struct fp_print_data *, nr_shortlisted + 1);
+	*offsets = g_new(gint, nr_shortlisted);
+	for (i = 0; i < nr_shortlisted; i++) {
+		(*shortlist)[i] = job->gallery[ranked[i].offset];
+		(*offsets)[i] = ranked[i].offset;
+	}
+	(*shortlist)[nr_shortlisted] = NULL;
+	fp_dbg("%d out of %d prints shortlisted, down to score %d",
+		nr_shortlisted, job->gallery_len,
+		ranked[nr_shortlisted - 1].score);
+	g_free(ranked);
+	return 0;
+}
+
+int fpi_img_compare_print_data_to_gallery(struct fp_print_data *print,
+	struct fp_print_data **gallery, int match_threshold, size_t *match_offset)
+{
+	struct fp_print_data **shortlist = NULL;
+	struct identify_job job;
+	gint *offsets = NULL;
+	int r;
+
+	r = identify_job_init(&job, print, gallery, match_threshold);
+	if (r < 0)
+		return r;
+	if (job.gallery_len == 0)
+		return FP_VERIFY_NO_MATCH;
+
+	r = prescreen_gallery(&job, &shortlist, &offsets);
+	if (r < 0)
+		return r;
+	if (shortlist)
+		identify_job_init(&job, print, shortlist, match_threshold);
+
+	r = identify_job_run(&job);
+	g_free(shortlist);
+	if (r < 0) {
+		g_free(offsets);
+		return r;
+	}
+
+	if (job.mode == FP_IDENTIFY_FIRST_MATCH) {
+		job.best_offset = job.limit;
+		r = job.limit < job.gallery_len;
+	} else {
+		fp_dbg("best score %d at offset %d", job.best_score,
+			job.best_offset);
+		r = job.best_score >= match_threshold;
+	}
+
+	if (r)
+		*match_offset = offsets ? offsets[job.best_offset] :
+			job.best_offset;
+	g_free(offsets);
+	return r ? FP_VERIFY_MATCH : FP_VERIFY_NO_MATCH;
+}
+
+/** \ingroup print_data
+ * Matches a print against each print of a gallery, and reports all the
+ * scores. Unlike identification, every gallery print is always scored, which
+ * is useful to find duplicates or to tune the match threshold. The work is
+ * spread over the threads set with fp_set_identify_threads(), and samples
+ * rejected by the prefilter set with fp_set_identify_prefilter() score zero.
+ *
+ * All prints must come from imaging devices.
+ *
+ * \param print the print to match, made of a single scan
+ * \param gallery NULL-terminated array of prints to match against
+ * \param scores output array, with room for one score per gallery print.
+ * The score of a print is the best score over its samples, higher scores
+ * mean closer matches.
+ * \returns 0 on success, negative error code otherwise
+ */
+API_EXPORTED int fp_print_data_score_gallery(struct fp_print_data *print,
+	struct fp_print_data **gallery, int *scores)
+{
+	struct identify_job job;
+	gint i;
+	int r;
+
+	if (print->type != PRINT_DATA_NBIS_MINUTIAE) {
+		fp_err("invalid print format");
+		return -EINVAL;
+	}
+
+	r = identify_job_init(&job, print, gallery, 0);
+	if (r < 0)
+		return r;
+	for (i = 0; i < job.gallery_len; i++)
+		if (gallery[i]->type != PRINT_DATA_NBIS_MINUTIAE) {
+			fp_err("invalid print format at offset %d", i);
+			return -EINVAL;
+		}
+	if (job.gallery_len == 0)
+		return 0;
+
+	job.scores = scores;
+	return identify_job_run(&job);
+}
+
+/** \ingroup dev
+ * Sets the number of threads used to match a scan against the print gallery
+ * during identification, see fp_identify_finger_img() and
+ * fp_async_identify_start(). The calling thread counts as one of them. By
+ * default, a single thread is used.
+ *
+ * \param nr_threads the number of threads to use, or 0 to use one thread per
+ * online CPU
+ */
+API_EXPORTED void fp_set_identify_threads(unsigned int nr_threads)
+{
+	if (nr_threads == 0) {
+		long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nr_threads = nr_cpus > 0 ? nr_cpus : 1;
+	}
+
+	fp_dbg("%u threads", nr_threads);
+	g_mutex_lock(&identify_pool_lock);
+	identify_threads = nr_threads;
+	/* the workers are spread over the nodes again on next use */
+	identify_nodes_free();
+	g_mutex_unlock(&identify_pool_lock);
+}
+
+/** \ingroup dev
+ * Restricts the threads matching scans against the print gallery to some
+ * CPUs, for example to keep them off the CPUs running fp_handle_events()
+ * and the USB transfers. The calling thread then only waits for the others,
+ * and the number of threads set with fp_set_identify_threads() are all
+ * started on these CPUs.
+ *
+ * Whether restricted or not, on NUMA systems the threads are split between
+ * the nodes, each one matching the prints of its own part of the gallery
+ * first, so that matcher templates are mostly read from local memory.
+ *
+ * \param cpus array of CPU numbers, as numbered by the operating system
+ * \param nr_cpus the length of cpus, or 0 to allow all CPUs again
+ * \returns 0 on success, -EINVAL if a CPU is out of range, -ENOTSUP if
+ * threads can't be pinned on this system
+ */
+API_EXPORTED int fp_set_identify_cpus(const unsigned int *cpus,
+	size_t nr_cpus)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t set;
+	size_t i;
+
+	CPU_ZERO(&set);
+	for (i = 0; i < nr_cpus; i++) {
+		if (cpus[i] >= CPU_SETSIZE)
+			return -EINVAL;
+		CPU_SET(cpus[i], &set);
+	}
+
+	g_mutex_lock(&identify_pool_lock);
+	identify_cpus = set;
+	identify_cpus_set = nr_cpus > 0;
+	identify_nodes_free();
+	g_mutex_unlock(&identify_pool_lock);
+	return 0;
+#else
+	return nr_cpus ? -ENOTSUP : 0;
+#endif
+}
+
+/** \ingroup dev
+ * Selects how the print gallery is searched during identification. This
+ * applies to both fp_identify_finger_img() and fp_async_identify_start().
+ * The default is fp_identify_mode#FP_IDENTIFY_FIRST_MATCH.
+ *
+ * \param mode the search mode
+ */
+API_EXPORTED void fp_set_identify_mode(enum fp_identify_mode mode)
+{
+	identify_mode = mode;
+}
+
+/** \ingroup dev
+ * Enables a cheap candidate rejection stage during identification. Gallery
+ * samples whose edge length distribution overlaps the scanned print's one by
+ * less than min_similarity percent are rejected without running the full
+ * matcher. Higher values reject more samples, at the cost of more false
+ * rejections. Samples that have too few minutiae to ever score are always
+ * rejected.
+ *
+ * Use fp_get_identify_prefilter_stats() to tune this value.
+ *
+ * \param min_similarity minimum similarity, from 0 (disabled, the default)
+ * to 100
+ */
+API_EXPORTED void fp_set_identify_prefilter(int min_similarity)
+{
+	g_atomic_int_set(&prefilter_min_similarity,
+		CLAMP(min_similarity, 0, 100));
+}
+
+/** \ingroup dev
+ * Enables a coarse identification tier, for large galleries. The scanned
+ * print is first reduced to its nr_minutiae most central minutiae, and
+ * matched against the whole gallery. As matching time grows with the
+ * square of the number of minutiae, this is much faster than the full
+ * match. Only the shortlist prints which score best are then matched with
+ * the full print, best first in fp_identify_mode#FP_IDENTIFY_FIRST_MATCH
+ * mode.
+ *
+ * Fewer minutiae make the first tier faster and less discriminating, and a
+ * shorter list makes the second tier faster; both raise the chances of
+ * missing the enrolled print. The first tier is skipped for galleries of
+ * no more than shortlist prints, and for scans with no more than
+ * nr_minutiae minutiae. With indexed galleries, it applies to the
+ * candidates picked by the index.
+ *
+ * \param nr_minutiae minutiae kept for the first tier, 0 to disable it
+ * (the default)
+ * \param shortlist number of prints passed on to the full match
+ */
+API_EXPORTED void fp_set_identify_prescreen(unsigned int nr_minutiae,
+	unsigned int shortlist)
+{
+	if (shortlist == 0)
+		nr_minutiae = 0;
+	fp_dbg("%u minutiae, %u prints", nr_minutiae, shortlist);
+	g_atomic_int_set(&prescreen_shortlist, MIN(shortlist, G_MAXINT / 2));
+	g_atomic_int_set(&prescreen_minutiae,
+		MIN(nr_minutiae, MAX_BOZORTH_MINUTIAE));
+}
+
+/** \ingroup dev
+ * Gets the number of gallery samples which went through the identification
+ * prefilter, and the number of those which got rejected by it, since the
+ * last call to fp_reset_identify_prefilter_stats().
+ *
+ * \param passed location to store the number of samples passed to the
+ * matcher, or NULL
+ * \param rejected location to store the number of rejected samples, or NULL
+ */
+API_EXPORTED void fp_get_identify_prefilter_stats(uint64_t *passed,
+	uint64_t *rejected)
+{
+	g_mutex_lock(&prefilter_lock);
+	if (passed)
+		*passed = prefilter_passed;
+	if (rejected)
+		*rejected = prefilter_rejected;
+	g_mutex_unlock(&prefilter_lock);
+}
+
+/** \ingroup dev
+ * Resets the counters returned by fp_get_identify_prefilter_stats().
+ */
+API_EXPORTED void fp_reset_identify_prefilter_stats(void)
+{
+	g_mutex_lock(&prefilter_lock);
+	prefilter_passed = 0;
+	prefilter_rejected = 0;
+	g_mutex_unlock(&prefilter_lock);
 }
 
 /** \ingroup img
@@ -425,6 +2389,9 @@ int fpi_img_compare_print_data_to_gallery(struct fp_print_data *print,
  * on a pure white background. Internally, image processing happens on top
  * of the binarized image.
  *
+ * The binarized image isn't kept by minutiae detection, so this runs the
+ * detection again the first time it is called on an image.
+ *
  * The image must have been \ref img_std "standardized" otherwise this function
  * will fail.
  *
@@ -449,21 +2416,36 @@ API_EXPORTED struct fp_img *fp_img_binarize(struct fp_img *img)
 		return NULL;
 	}
 
+	/* Detection runs again to produce the binarized image. If minutiae were
+	 * already detected, they are kept as the caller may be using them. */
+	g_mutex_lock(&img->lock);
 	if (!img->binarized) {
-		int r = fpi_img_detect_minutiae(img);
-		if (r < 0)
-			return NULL;
-		if (!img->binarized) {
-			fp_err("no minutiae after successful detection?");
+		size_t size = fp_img_get_memory_usage(img);
+		struct fp_minutiae *minutiae;
+		struct fp_img_quality quality;
+		int r = detect_minutiae(img, &minutiae, &quality,
+			&img->binarized, g_atomic_int_get(&extraction_threads),
+			NULL, NULL);
+		if (r < 0) {
+			g_mutex_unlock(&img->lock);
 			return NULL;
 		}
+		if (img->minutiae) {
+			free_minutiae(minutiae);
+		} else {
+			img->minutiae = minutiae;
+			img->quality = quality;
+		}
+		img_mem_account(fp_img_get_memory_usage(img) - size);
 	}
+	g_mutex_unlock(&img->lock);
 
 	ret = fpi_img_new(imgsize);
 	ret->flags |= FP_IMG_BINARIZED_FORM;
 	ret->width = width;
 	ret->height = height;
-	memcpy(ret->data, img->binarized, imgsize);
+	unpack_bitimage(ret->data, img->binarized, width, height,
+		BLACK_PIXEL, WHITE_PIXEL);
 	return ret;
 }
 
@@ -497,20 +2479,49 @@ API_EXPORTED struct fp_minutia **fp_img_get_minutiae(struct fp_img *img,
 		return NULL;
 	}
 
+	/* the minutiae never change once detected */
+	g_mutex_lock(&img->lock);
 	if (!img->minutiae) {
 		int r = fpi_img_detect_minutiae(img);
-		if (r < 0)
-			return NULL;
-		if (!img->minutiae) {
-			fp_err("no minutiae after successful detection?");
+		if (r < 0 || !img->minutiae) {
+			if (r >= 0)
+				fp_err("no minutiae after successful detection?");
+			g_mutex_unlock(&img->lock);
 			return NULL;
 		}
 	}
+	g_mutex_unlock(&img->lock);
 
 	*nr_minutiae = img->minutiae->num;
 	return img->minutiae->list;
 }
 
+/** \ingroup img
+ * Gets the quality of an image, as summed up from the maps built while
+ * detecting its minutiae, for instance to turn down poor enrollment scans.
+ * This comes at no extra cost once the minutiae are detected, and detects
+ * them otherwise.
+ *
+ * The image must have been \ref img_std "standardized" otherwise this function
+ * will fail. You cannot pass a binarized image to this function.
+ *
+ * \param img a standardized image
+ * \param quality where to store the quality of the image
+ * \returns 0 on success, or a negative error code
+ */
+API_EXPORTED int fp_img_get_quality(struct fp_img *img,
+	struct fp_img_quality *quality)
+{
+	int nr_minutiae;
+
+	if (!fp_img_get_minutiae(img, &nr_minutiae))
+		return -EINVAL;
+
+	/* set along with the minutiae, which fp_img_get_minutiae() waited for */
+	*quality = img->quality;
+	return 0;
+}
+
 /* Calculate squared standand deviation */
 int fpi_std_sq_dev(const unsigned char *buf, int size)
 {
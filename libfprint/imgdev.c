@@ -27,6 +27,16 @@
 #define BOZORTH3_DEFAULT_THRESHOLD 40
 #define IMG_ENROLL_STAGES 5
 
+/* default finger detection polling policy, in milliseconds */
+#define POLL_MIN_INTERVAL 0
+#define POLL_MAX_INTERVAL 250
+#define POLL_IDLE_AFTER 3000
+/* first interval when backing off from no delay at all */
+#define POLL_BACKOFF_START 10
+
+/* default time a sensor stays warm after an action, in milliseconds */
+#define STANDBY_TIMEOUT 10000
+
 static int img_dev_open(struct fp_dev *dev, unsigned long driver_data)
 {
 	struct fp_img_dev *imgdev = g_malloc0(sizeof(*imgdev));
@@ -35,12 +45,20 @@ static int img_dev_open(struct fp_dev *dev, unsigned long driver_data)
 
 	imgdev->dev = dev;
 	imgdev->enroll_stage = 0;
+	imgdev->poll_policy.min_interval = POLL_MIN_INTERVAL;
+	imgdev->poll_policy.max_interval = POLL_MAX_INTERVAL;
+	imgdev->poll_policy.idle_after = POLL_IDLE_AFTER;
+	imgdev->standby_timeout = STANDBY_TIMEOUT;
 	dev->priv = imgdev;
 	dev->nr_enroll_stages = IMG_ENROLL_STAGES;
 
 	/* for consistency in driver code, allow udev access through imgdev */
 	imgdev->udev = dev->udev;
 
+	if (imgdrv->img_width > 0 && imgdrv->img_height > 0)
+		imgdev->img_pool = fpi_img_pool_new(imgdrv->img_width *
+			imgdrv->img_height);
+
 	if (imgdrv->open) {
 		r = imgdrv->open(imgdev, driver_data);
 		if (r)
@@ -51,6 +69,8 @@ static int img_dev_open(struct fp_dev *dev, unsigned long driver_data)
 
 	return 0;
 err:
+	if (imgdev->img_pool)
+		fpi_img_pool_close(imgdev->img_pool);
 	g_free(imgdev);
 	return r;
 }
@@ -60,11 +80,21 @@ void fpi_imgdev_open_complete(struct fp_img_dev *imgdev, int status)
 	fpi_drvcb_open_complete(imgdev->dev, status);
 }
 
+static void leave_standby(struct fp_img_dev *imgdev);
+
 static void img_dev_close(struct fp_dev *dev)
 {
 	struct fp_img_dev *imgdev = dev->priv;
 	struct fp_img_driver *imgdrv = fpi_driver_to_img_driver(dev->drv);
 
+	leave_standby(imgdev);
+
+	/* the images still held are freed when they come back */
+	if (imgdev->img_pool) {
+		fpi_img_pool_close(imgdev->img_pool);
+		imgdev->img_pool = NULL;
+	}
+
 	if (imgdrv->close)
 		imgdrv->close(imgdev);
 	else
@@ -77,6 +107,8 @@ void fpi_imgdev_close_complete(struct fp_img_dev *imgdev)
 	g_free(imgdev);
 }
 
+static void dev_deactivate(struct fp_img_dev *imgdev);
+
 static int dev_change_state(struct fp_img_dev *imgdev,
 	enum fp_imgdev_state state)
 {
@@ -118,6 +150,141 @@ static int sanitize_image(struct fp_img_dev *imgdev, struct fp_img **_img)
 	return 0;
 }
 
+/* Sensors with an interrupt endpoint for finger events simply wait on it.
+ * The others poll for a finger, quickly while somebody is using the reader,
+ * and less and less often while it is left idle. */
+
+void fpi_imgdev_set_poll_policy(struct fp_img_dev *imgdev,
+	const struct fpi_poll_policy *policy)
+{
+	imgdev->poll_policy = *policy;
+	if (imgdev->poll_policy.max_interval < policy->min_interval)
+		imgdev->poll_policy.max_interval = policy->min_interval;
+	imgdev->poll_interval = policy->min_interval;
+}
+
+static void poll_activity(struct fp_img_dev *imgdev)
+{
+	imgdev->poll_activity = g_get_monotonic_time();
+	imgdev->poll_interval = imgdev->poll_policy.min_interval;
+}
+
+/* Returns the delay before the next poll, in milliseconds. Backs off on each
+ * call while the reader is idle. */
+unsigned int fpi_imgdev_poll_interval(struct fp_img_dev *imgdev)
+{
+	struct fpi_poll_policy *policy = &imgdev->poll_policy;
+	gint64 idle = (g_get_monotonic_time() - imgdev->poll_activity) / 1000;
+	unsigned int interval = imgdev->poll_interval;
+
+	if (idle < policy->idle_after)
+		interval = policy->min_interval;
+	else if (interval < policy->max_interval)
+		interval = MIN(MAX(interval * 2, POLL_BACKOFF_START),
+			policy->max_interval);
+
+	imgdev->poll_interval = interval;
+	return interval;
+}
+
+/* Drivers supporting it keep the sensor initialised between actions, in
+ * whatever idle state their deactivation leaves it, so that the next action
+ * starts without the initialisation sequence. As the sensor may lose that
+ * state while nobody watches it, it is only trusted for a while; after that,
+ * the next activation starts from scratch again. Nothing is in flight during
+ * standby, so it doesn't keep the device from suspending once closed. */
+
+static void standby_expired(void *data)
+{
+	struct fp_img_dev *imgdev = data;
+
+	fp_dbg("standby expired");
+	imgdev->standby_timer = NULL;
+	imgdev->standby = FALSE;
+}
+
+static void leave_standby(struct fp_img_dev *imgdev)
+{
+	if (imgdev->standby_timer) {
+		fpi_timeout_cancel(imgdev->standby_timer);
+		imgdev->standby_timer = NULL;
+	}
+	imgdev->standby = FALSE;
+}
+
+static void enter_standby(struct fp_img_dev *imgdev)
+{
+	struct fp_img_driver *imgdrv =
+		fpi_driver_to_img_driver(imgdev->dev->drv);
+
+	leave_standby(imgdev);
+	if (!(imgdrv->flags & FP_IMGDRV_SUPPORTS_STANDBY) ||
+			!imgdev->standby_timeout)
+		return;
+
+	imgdev->standby_timer = fpi_timeout_add(imgdev->dev,
+		imgdev->standby_timeout, standby_expired, imgdev);
+	imgdev->standby = imgdev->standby_timer != NULL;
+}
+
+/* Sets how long the sensor stays warm after an action, in milliseconds, 0
+ * disabling the standby */
+int fpi_imgdev_set_standby_timeout(struct fp_img_dev *imgdev,
+	unsigned int timeout)
+{
+	struct fp_img_driver *imgdrv =
+		fpi_driver_to_img_driver(imgdev->dev->drv);
+
+	if (!(imgdrv->flags & FP_IMGDRV_SUPPORTS_STANDBY))
+		return -ENOTSUP;
+
+	imgdev->standby_timeout = timeout;
+	if (!timeout)
+		leave_standby(imgdev);
+	return 0;
+}
+
+static void poll_timeout_cb(void *data)
+{
+	struct fp_img_dev *imgdev = data;
+
+	imgdev->poll_timeout = NULL;
+	imgdev->poll_cb(imgdev->poll_data);
+}
+
+/* Calls callback once it is time to poll the sensor again. The driver should
+ * check whether it is being deactivated from there, as for any other
+ * callback, the poll is brought forward on deactivation so that it doesn't
+ * have to wait for the interval. */
+int fpi_imgdev_schedule_poll(struct fp_img_dev *imgdev,
+	fpi_timeout_fn callback, void *data)
+{
+	unsigned int interval = fpi_imgdev_poll_interval(imgdev);
+
+	BUG_ON(imgdev->poll_timeout);
+	imgdev->poll_cb = callback;
+	imgdev->poll_data = data;
+	imgdev->poll_timeout = fpi_timeout_add(imgdev->dev, interval,
+		poll_timeout_cb, imgdev);
+	if (!imgdev->poll_timeout)
+		return -ENOMEM;
+	return 0;
+}
+
+static void flush_poll(struct fp_img_dev *imgdev)
+{
+	if (!imgdev->poll_timeout)
+		return;
+
+	fpi_timeout_cancel(imgdev->poll_timeout);
+	imgdev->poll_timeout = fpi_timeout_add(imgdev->dev, 0, poll_timeout_cb,
+		imgdev);
+	if (!imgdev->poll_timeout) {
+		fp_err("failed to flush the finger poll");
+		poll_timeout_cb(imgdev);
+	}
+}
+
 void fpi_imgdev_report_finger_status(struct fp_img_dev *imgdev,
 	gboolean present)
 {
@@ -126,6 +293,15 @@ void fpi_imgdev_report_finger_status(struct fp_img_dev *imgdev,
 	struct fp_img *img = imgdev->acquire_img;
 
 	fp_dbg(present ? "finger on sensor" : "finger removed");
+	poll_activity(imgdev);
+	if (present)
+		fpi_stats_stage(imgdev->dev, FP_STATS_FINGER_ON);
+
+	if (!present && imgdev->action_state == IMG_ACQUIRE_STATE_PROCESSING) {
+		/* reported once the image has been processed */
+		imgdev->finger_off_pending = TRUE;
+		return;
+	}
 
 	if (present && imgdev->action_state == IMG_ACQUIRE_STATE_AWAIT_FINGER_ON) {
 		dev_change_state(imgdev, IMGDEV_STATE_CAPTURE);
@@ -172,6 +348,15 @@ void fpi_imgdev_report_finger_status(struct fp_img_dev *imgdev,
 			imgdev->identify_match_offset, img);
 		imgdev->action_result = 0;
 		fp_print_data_free(data);
+		/* in continuous mode, wait for the next finger with the device
+		 * still active, unless the callback stopped identification */
+		if (imgdev->action == IMG_ACTION_IDENTIFY &&
+		    imgdev->action_state == IMG_ACQUIRE_STATE_AWAIT_FINGER_OFF &&
+		    imgdev->dev->identify_continuous && r >= 0) {
+			imgdev->identify_match_offset = 0;
+			imgdev->action_state = IMG_ACQUIRE_STATE_AWAIT_FINGER_ON;
+			dev_change_state(imgdev, IMGDEV_STATE_AWAIT_FINGER_ON);
+		}
 		break;
 	case IMG_ACTION_CAPTURE:
 		fpi_drvcb_report_capture_result(imgdev->dev, r, img);
@@ -183,128 +368,365 @@ void fpi_imgdev_report_finger_status(struct fp_img_dev *imgdev,
 	}
 }
 
-static void verify_process_img(struct fp_img_dev *imgdev)
+/* Captured images are processed on the worker thread, see fpi_worker_run(),
+ * so that minutiae detection and matching don't hold up USB transfers. The
+ * results are kept here until they are applied from the event loop. */
+struct img_process {
+	struct fp_img_dev *imgdev;
+	enum fp_imgdev_action action;
+	struct fp_img *img;
+	struct fp_print_data *print;
+	int result;
+	size_t match_offset;
+	size_t match_sample;
+	/* the last enroll stage is consolidated with the previous samples,
+	 * which the worker holds meanwhile, see fp_set_enroll_consolidation() */
+	gboolean consolidate;
+	struct fp_print_data *enroll_data;
+	struct fp_print_data *consolidated;
+	/* the action was stopped while the image was being processed */
+	gboolean stopped;
+	/* set along with stopped, makes the worker give up on the image, see
+	 * fpi_img_set_cancel() */
+	volatile gint cancel;
+	/* instrumentation, applied by img_processed() */
+	gint64 stages[FP_STATS_NR_STAGES];
+	guint64 comparisons;
+};
+
+static void verify_process_img(struct img_process *proc)
 {
-	struct fp_img_driver *imgdrv = fpi_driver_to_img_driver(imgdev->dev->drv);
+	struct fp_dev *dev = proc->imgdev->dev;
+	struct fp_img_driver *imgdrv = fpi_driver_to_img_driver(dev->drv);
 	int match_score = imgdrv->bz3_threshold;
-	int r;
 
 	if (match_score == 0)
 		match_score = BOZORTH3_DEFAULT_THRESHOLD;
 
-	r = fpi_img_compare_print_data(imgdev->dev->verify_data,
-		imgdev->acquire_data);
-
-	if (r >= match_score)
-		r = FP_VERIFY_MATCH;
-	else if (r >= 0)
-		r = FP_VERIFY_NO_MATCH;
-
-	imgdev->action_result = r;
+	proc->result = fpi_img_verify_print_data(dev->verify_data, proc->print,
+		match_score, &proc->match_sample);
 }
 
-static void identify_process_img(struct fp_img_dev *imgdev)
+static void identify_process_img(struct img_process *proc)
 {
-	struct fp_img_driver *imgdrv = fpi_driver_to_img_driver(imgdev->dev->drv);
+	struct fp_dev *dev = proc->imgdev->dev;
+	struct fp_img_driver *imgdrv = fpi_driver_to_img_driver(dev->drv);
 	int match_score = imgdrv->bz3_threshold;
-	size_t match_offset;
-	int r;
 
 	if (match_score == 0)
 		match_score = BOZORTH3_DEFAULT_THRESHOLD;
 
-	r = fpi_img_compare_print_data_to_gallery(imgdev->acquire_data,
-		imgdev->dev->identify_gallery, match_score, &match_offset);
-
-	imgdev->action_result = r;
-	imgdev->identify_match_offset = match_offset;
+	if (dev->identify_indexed_gallery)
+		proc->result = fpi_gallery_identify(dev->identify_indexed_gallery,
+			proc->print, match_score, &proc->match_offset);
+	else
+		proc->result = fpi_img_compare_print_data_to_gallery(proc->print,
+			dev->identify_gallery, match_score, &proc->match_offset);
 }
 
 void fpi_imgdev_abort_scan(struct fp_img_dev *imgdev, int result)
 {
 	imgdev->action_result = result;
+	if (imgdev->processing)
+		/* img_processed() moves on once the image is processed */
+		return;
 	imgdev->action_state = IMG_ACQUIRE_STATE_AWAIT_FINGER_OFF;
 	dev_change_state(imgdev, IMGDEV_STATE_AWAIT_FINGER_OFF);
 }
 
-void fpi_imgdev_image_captured(struct fp_img_dev *imgdev, struct fp_img *img)
+/* Consolidates the samples of a complete enrollment, along with the one just
+ * extracted, into proc->consolidated. The samples are kept if that fails. */
+static void consolidate_enroll_data(struct img_process *proc)
 {
-	struct fp_print_data *print;
+	struct fp_print_data *all;
+
+	/* in the order fpi_print_data_move_samples() leaves them, without
+	 * touching the enroll data: img_processed() may still drop the
+	 * sample just extracted */
+	all = fpi_print_data_new_typed(proc->print->driver_id,
+		proc->print->devtype, proc->print->type);
+	all->prints = g_slist_copy(proc->print->prints);
+	if (proc->enroll_data)
+		all->prints = g_slist_concat(all->prints,
+			g_slist_copy(proc->enroll_data->prints));
+
+	if (fpi_print_data_consolidate(all, &proc->consolidated) < 0) {
+		fp_err("couldn't consolidate enrolled print");
+		proc->consolidated = NULL;
+	}
+
+	/* the samples belong to the prints they were copied from */
+	g_slist_free(all->prints);
+	all->prints = NULL;
+	fp_print_data_free(all);
+}
+
+/* Processes the image as far as the action needs, giving up once proc->cancel
+ * is set */
+static void process_img_cancellable(struct img_process *proc)
+{
+	struct fp_img *img = proc->img;
+	guint64 comparisons;
 	int r;
-	fp_dbg("");
 
-	if (imgdev->action_state != IMG_ACQUIRE_STATE_AWAIT_IMAGE) {
-		fp_dbg("ignoring due to current state %d", imgdev->action_state);
+	fp_img_standardize(img);
+	proc->stages[FP_STATS_STANDARDIZED] = g_get_monotonic_time();
+	if (proc->action == IMG_ACTION_CAPTURE) {
+		proc->result = FP_CAPTURE_COMPLETE;
 		return;
 	}
 
-	if (imgdev->action_result) {
-		fp_dbg("not overwriting existing action result");
+	r = fpi_img_check_quality(img, proc->imgdev->dev->drv->scan_type);
+	if (r) {
+		fp_dbg("image rejected before minutiae extraction: %d", r);
+		/* depends on FP_ENROLL_RETRY_* == FP_VERIFY_RETRY_* */
+		proc->result = r;
 		return;
 	}
 
-	r = sanitize_image(imgdev, &img);
+	r = fpi_img_to_print_data(proc->imgdev, img, &proc->print);
+	proc->stages[FP_STATS_EXTRACTED] = g_get_monotonic_time();
 	if (r < 0) {
-		imgdev->action_result = r;
-		fp_img_free(img);
-		goto next_state;
+		fp_dbg("image to print data conversion error: %d", r);
+		proc->result = FP_ENROLL_RETRY;
+		return;
+	} else if (img->minutiae->num < MIN_ACCEPTABLE_MINUTIAE) {
+		fp_dbg("not enough minutiae, %d/%d", img->minutiae->num,
+			MIN_ACCEPTABLE_MINUTIAE);
+		fp_print_data_free(proc->print);
+		proc->print = NULL;
+		/* depends on FP_ENROLL_RETRY == FP_VERIFY_RETRY */
+		proc->result = FP_ENROLL_RETRY;
+		return;
 	}
 
-	fp_img_standardize(img);
-	imgdev->acquire_img = img;
-	if (imgdev->action != IMG_ACTION_CAPTURE) {
-		r = fpi_img_to_print_data(imgdev, img, &print);
-		if (r < 0) {
-			fp_dbg("image to print data conversion error: %d", r);
-			imgdev->action_result = FP_ENROLL_RETRY;
-			goto next_state;
-		} else if (img->minutiae->num < MIN_ACCEPTABLE_MINUTIAE) {
-			fp_dbg("not enough minutiae, %d/%d", img->minutiae->num,
-				MIN_ACCEPTABLE_MINUTIAE);
-			fp_print_data_free(print);
-			/* depends on FP_ENROLL_RETRY == FP_VERIFY_RETRY */
-			imgdev->action_result = FP_ENROLL_RETRY;
-			goto next_state;
-		}
+	comparisons = fpi_img_get_comparisons();
+	switch (proc->action) {
+	case IMG_ACTION_ENROLL:
+		/* the enroll stage is accounted for by img_processed() */
+		if (proc->consolidate)
+			consolidate_enroll_data(proc);
+		return;
+	case IMG_ACTION_VERIFY:
+		verify_process_img(proc);
+		break;
+	case IMG_ACTION_IDENTIFY:
+		identify_process_img(proc);
+		break;
+	default:
+		BUG();
+		break;
 	}
+	proc->stages[FP_STATS_MATCHED] = g_get_monotonic_time();
+	proc->comparisons = fpi_img_get_comparisons() - comparisons;
+}
 
-	imgdev->acquire_data = print;
-	switch (imgdev->action) {
-	case IMG_ACTION_ENROLL:
+/* Runs on the worker thread. Only reads the device's verify data or
+ * identify gallery, which can't go away before the action is stopped. */
+static void process_img(void *data)
+{
+	struct img_process *proc = data;
+
+	fpi_img_set_cancel(&proc->cancel);
+	process_img_cancellable(proc);
+	fpi_img_set_cancel(NULL);
+}
+
+/* Memory held by the imaging layer for a device, see memory.c */
+size_t fpi_imgdev_get_memory_usage(struct fp_img_dev *imgdev)
+{
+	size_t size = sizeof(*imgdev);
+
+	if (imgdev->img_pool)
+		size += fpi_img_pool_get_memory_usage(imgdev->img_pool);
+
+	/* only the pixels of an image being processed are stable, and the
+	 * enroll data it is consolidated with, which the worker only reads */
+	if (imgdev->processing) {
+		size += sizeof(*imgdev->processing) + sizeof(struct fp_img) +
+			imgdev->processing->img->length;
+		if (imgdev->processing->enroll_data)
+			size += fp_print_data_get_memory_usage(
+				imgdev->processing->enroll_data);
+	}
+	if (imgdev->acquire_img)
+		size += fp_img_get_memory_usage(imgdev->acquire_img);
+	if (imgdev->acquire_data)
+		size += fp_print_data_get_memory_usage(imgdev->acquire_data);
+	if (imgdev->enroll_data)
+		size += fp_print_data_get_memory_usage(imgdev->enroll_data);
+	return size;
+}
+
+static void apply_stats(struct img_process *proc)
+{
+	struct fp_dev *dev = proc->imgdev->dev;
+	int i;
+
+	for (i = FP_STATS_STANDARDIZED; i < FP_STATS_NR_STAGES; i++)
+		if (proc->stages[i])
+			fpi_stats_stage_at(dev, i, proc->stages[i]);
+	if (proc->img->minutiae)
+		fpi_stats_count(dev, FP_STATS_MINUTIAE,
+			proc->img->minutiae->num);
+	fpi_stats_count(dev, FP_STATS_COMPARISONS, proc->comparisons);
+}
+
+/* Applies the results of process_img() from the event loop */
+static void img_processed(void *data)
+{
+	struct img_process *proc = data;
+	struct fp_img_dev *imgdev = proc->imgdev;
+	struct fp_print_data *print = proc->print;
+
+	imgdev->processing = NULL;
+	apply_stats(proc);
+	if (proc->stopped) {
+		fp_dbg("action stopped during processing");
+		fp_print_data_free(print);
+		fp_print_data_free(proc->enroll_data);
+		fp_print_data_free(proc->consolidated);
+		fp_img_free(proc->img);
+		g_free(proc);
+		dev_deactivate(imgdev);
+		return;
+	}
+
+	if (proc->consolidate)
+		imgdev->enroll_data = proc->enroll_data;
+	imgdev->acquire_img = proc->img;
+	if (imgdev->action_result) {
+		fp_dbg("scan aborted during processing");
+		fp_print_data_free(print);
+	} else if (proc->action == IMG_ACTION_ENROLL && print) {
 		if (!imgdev->enroll_data) {
 			imgdev->enroll_data = fpi_print_data_new(imgdev->dev);
 		}
 		BUG_ON(g_slist_length(print->prints) != 1);
 		/* Move print data from acquire data into enroll_data */
-		imgdev->enroll_data->prints =
-			g_slist_prepend(imgdev->enroll_data->prints, print->prints->data);
-		print->prints = g_slist_remove(print->prints, print->prints->data);
+		fpi_print_data_move_samples(imgdev->enroll_data, print);
 
-		fp_print_data_free(imgdev->acquire_data);
-		imgdev->acquire_data = NULL;
+		fp_print_data_free(print);
 		imgdev->enroll_stage++;
-		if (imgdev->enroll_stage == imgdev->dev->nr_enroll_stages)
+		if (imgdev->enroll_stage == imgdev->dev->nr_enroll_stages) {
+			if (proc->consolidated) {
+				fp_print_data_free(imgdev->enroll_data);
+				imgdev->enroll_data = proc->consolidated;
+				proc->consolidated = NULL;
+			}
 			imgdev->action_result = FP_ENROLL_COMPLETE;
-		else
+		} else
 			imgdev->action_result = FP_ENROLL_PASS;
-		break;
-	case IMG_ACTION_VERIFY:
-		verify_process_img(imgdev);
-		break;
-	case IMG_ACTION_IDENTIFY:
-		identify_process_img(imgdev);
-		break;
-	case IMG_ACTION_CAPTURE:
-		imgdev->action_result = FP_CAPTURE_COMPLETE;
-		break;
-	default:
-		BUG();
-		break;
+	} else {
+		imgdev->acquire_data = print;
+		imgdev->action_result = proc->result;
+		imgdev->identify_match_offset = proc->match_offset;
+		imgdev->verify_match_sample = proc->match_sample;
 	}
+	fp_print_data_free(proc->consolidated);
+	g_free(proc);
+	fpi_dev_mem_update(imgdev->dev);
 
-next_state:
 	imgdev->action_state = IMG_ACQUIRE_STATE_AWAIT_FINGER_OFF;
 	dev_change_state(imgdev, IMGDEV_STATE_AWAIT_FINGER_OFF);
+	if (imgdev->finger_off_pending) {
+		imgdev->finger_off_pending = FALSE;
+		fpi_imgdev_report_finger_status(imgdev, FALSE);
+	}
+}
+
+/* Drivers of swipe sensors call this once the frames of a swipe have been
+ * assembled into an image, before passing it to fpi_imgdev_image_captured() */
+void fpi_imgdev_report_assembled(struct fp_img_dev *imgdev,
+	unsigned int nr_frames)
+{
+	fpi_stats_stage(imgdev->dev, FP_STATS_ASSEMBLED);
+	fpi_stats_count(imgdev->dev, FP_STATS_FRAMES, nr_frames);
+}
+
+/* Shows part of the swipe being captured, if a preview is due. data is only
+ * read during the call, drivers pass their own buffers. */
+void fpi_imgdev_preview(struct fp_img_dev *imgdev,
+	enum fp_img_preview_format format, const unsigned char *data,
+	unsigned int width, unsigned int height, size_t stride)
+{
+	struct fp_img_preview preview;
+	gint64 now;
+
+	if (!imgdev->preview_cb || !height)
+		return;
+
+	now = g_get_monotonic_time();
+	if (imgdev->preview_last &&
+			now - imgdev->preview_last <
+			(gint64) imgdev->preview_interval * 1000)
+		return;
+	imgdev->preview_last = now;
+
+	preview.format = format;
+	preview.width = width;
+	preview.height = height;
+	preview.stride = stride;
+	preview.data = data;
+	imgdev->preview_cb(imgdev->dev, &preview, imgdev->preview_data);
+}
+
+void fpi_imgdev_image_captured(struct fp_img_dev *imgdev, struct fp_img *img)
+{
+	struct img_process *proc;
+	int r;
+	fp_dbg("");
+
+	if (imgdev->action_state != IMG_ACQUIRE_STATE_AWAIT_IMAGE) {
+		fp_dbg("ignoring due to current state %d", imgdev->action_state);
+		return;
+	}
+
+	if (imgdev->action_result) {
+		fp_dbg("not overwriting existing action result");
+		return;
+	}
+
+	fpi_stats_stage(imgdev->dev, FP_STATS_CAPTURED);
+	r = sanitize_image(imgdev, &img);
+	if (r < 0) {
+		imgdev->action_result = r;
+		fp_img_free(img);
+		imgdev->action_state = IMG_ACQUIRE_STATE_AWAIT_FINGER_OFF;
+		dev_change_state(imgdev, IMGDEV_STATE_AWAIT_FINGER_OFF);
+		return;
+	}
+
+	if (imgdev->archive)
+		fpi_img_archive_add(imgdev->archive, imgdev->dev, img);
+
+	proc = g_malloc0(sizeof(*proc));
+	proc->imgdev = imgdev;
+	proc->action = imgdev->action;
+	proc->img = img;
+	if (proc->action == IMG_ACTION_ENROLL &&
+	    imgdev->enroll_stage + 1 == imgdev->dev->nr_enroll_stages &&
+	    fpi_print_data_consolidation_enabled()) {
+		proc->consolidate = TRUE;
+		proc->enroll_data = imgdev->enroll_data;
+		imgdev->enroll_data = NULL;
+	}
+	imgdev->processing = proc;
+	imgdev->finger_off_pending = FALSE;
+	imgdev->action_state = IMG_ACQUIRE_STATE_PROCESSING;
+	fpi_dev_mem_update(imgdev->dev);
+
+	if (proc->action == IMG_ACTION_IDENTIFY && imgdev->dev->identify_session)
+		r = fpi_identify_session_run(imgdev->dev->identify_session,
+			imgdev->dev->ctx, process_img, img_processed, proc);
+	else
+		r = fpi_worker_run(imgdev->dev->ctx, process_img, img_processed,
+			proc);
+	if (r < 0) {
+		fp_dbg("no worker thread, processing image in place");
+		process_img(proc);
+		img_processed(proc);
+	}
 }
 
 void fpi_imgdev_session_error(struct fp_img_dev *imgdev, int error)
@@ -382,6 +804,7 @@ void fpi_imgdev_deactivate_complete(struct fp_img_dev *imgdev)
 
 	imgdev->action = IMG_ACTION_NONE;
 	imgdev->action_state = 0;
+	enter_standby(imgdev);
 }
 
 int fpi_imgdev_get_img_width(struct fp_img_dev *imgdev)
@@ -412,10 +835,22 @@ static int dev_activate(struct fp_img_dev *imgdev, enum fp_imgdev_state state)
 {
 	struct fp_driver *drv = imgdev->dev->drv;
 	struct fp_img_driver *imgdrv = fpi_driver_to_img_driver(drv);
+	int r;
 
-	if (!imgdrv->activate)
+	poll_activity(imgdev);
+	if (!imgdrv->activate) {
+		leave_standby(imgdev);
 		return 0;
-	return imgdrv->activate(imgdev, state);
+	}
+
+	/* the driver sees whether it is resuming from standby */
+	if (imgdev->standby_timer) {
+		fpi_timeout_cancel(imgdev->standby_timer);
+		imgdev->standby_timer = NULL;
+	}
+	r = imgdrv->activate(imgdev, state);
+	imgdev->standby = FALSE;
+	return r;
 }
 
 static void dev_deactivate(struct fp_img_dev *imgdev)
@@ -425,7 +860,8 @@ static void dev_deactivate(struct fp_img_dev *imgdev)
 
 	if (!imgdrv->deactivate)
 		return;
-	return imgdrv->deactivate(imgdev);
+	imgdrv->deactivate(imgdev);
+	flush_poll(imgdev);
 }
 
 static int generic_acquire_start(struct fp_dev *dev, int action)
@@ -448,7 +884,14 @@ static int generic_acquire_start(struct fp_dev *dev, int action)
 static void generic_acquire_stop(struct fp_img_dev *imgdev)
 {
 	imgdev->action_state = IMG_ACQUIRE_STATE_DEACTIVATING;
-	dev_deactivate(imgdev);
+	/* The worker may still be using the verify data or the identify
+	 * gallery, so the device is only deactivated, and the action reported
+	 * as stopped, once the worker has given up on the image. */
+	if (imgdev->processing) {
+		imgdev->processing->stopped = TRUE;
+		g_atomic_int_set(&imgdev->processing->cancel, 1);
+	} else
+		dev_deactivate(imgdev);
 
 	fp_print_data_free(imgdev->acquire_data);
 	fp_print_data_free(imgdev->enroll_data);
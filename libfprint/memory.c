@@ -0,0 +1,74 @@
+/*
+ * Memory accounting for libfprint devices
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "memory"
+
+#include <config.h>
+
+#include "fp_internal.h"
+
+/* A device holds its own structures, the buffers its driver declares with
+ * fpi_dev_mem_account(), and for imaging devices the images and prints of
+ * the scan in progress. Everything runs from the event loop of the device's
+ * context. */
+
+static size_t dev_memory_usage(struct fp_dev *dev)
+{
+	size_t size = sizeof(*dev) + dev->mem_driver;
+
+	if (dev->drv->type == DRIVER_IMAGING && dev->priv)
+		size += fpi_imgdev_get_memory_usage(dev->priv);
+	return size;
+}
+
+/* Records the current usage of a device in its peak, to be called when the
+ * device starts holding more memory */
+void fpi_dev_mem_update(struct fp_dev *dev)
+{
+	size_t size = dev_memory_usage(dev);
+
+	if (size > dev->mem_peak)
+		dev->mem_peak = size;
+}
+
+/* Drivers call this when they allocate, with a positive delta, and free,
+ * with a negative one, their private data and buffers. What is left is
+ * forgotten as the device is closed. */
+void fpi_dev_mem_account(struct fp_dev *dev, gssize delta)
+{
+	dev->mem_driver += delta;
+	fpi_dev_mem_update(dev);
+}
+
+/** \ingroup dev
+ * Gets the memory held by an open device: the state of libfprint, the
+ * private data and buffers of the driver, and the images and prints of the
+ * scan in progress. Images and prints passed to the application are not
+ * included, see fp_img_get_memory_usage() and
+ * fp_print_data_get_memory_usage().
+ *
+ * \param dev the device
+ * \param usage where to store the current and peak sizes, in bytes
+ */
+API_EXPORTED void fp_dev_get_memory_usage(struct fp_dev *dev,
+	struct fp_memory_usage *usage)
+{
+	fpi_dev_mem_update(dev);
+	usage->current = dev_memory_usage(dev);
+	usage->peak = dev->mem_peak;
+}
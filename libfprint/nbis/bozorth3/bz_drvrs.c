@@ -76,6 +76,19 @@ identified are necessarily the best available for the purpose.
 #cat:                        single probe fingerprint is to be matched
 #cat:                        to a single gallery fingerprint as in
 #cat:                        verificaiton mode
+#cat: bozorth_*_ctx -        reentrant variants of the above working on
+#cat:                        the caller's matcher context
+#cat: bozorth_gallery_compile_ctx - saves the sorted pairwise minutia
+#cat:                        comparison table of a gallery fingerprint
+#cat:                        so it can be matched repeatedly
+#cat: bozorth_to_template_ctx - matches a probe to a compiled gallery
+#cat:                        template, skipping bozorth_gallery_init()
+#cat: bozorth_to_template_bounded_ctx - only finds out whether the
+#cat:                        score of a compiled template reaches a threshold
+#cat: bozorth_probe_hist_ctx - computes the edge length histogram of the
+#cat:                        probe fingerprint
+#cat: bozorth_hist_similarity - cheaply estimates how alike two edge length
+#cat:                        histograms are, to reject obvious non-matches
 
 ***********************************************************************/
 
@@ -86,7 +99,7 @@ identified are necessarily the best available for the purpose.
 
 /**************************************************************************/
 
-int bozorth_probe_init( struct xyt_struct * pstruct )
+int bozorth_probe_init_ctx( struct bz_ctx * ctx, struct xyt_struct * pstruct )
 {
 int sim;	/* number of pointwise comparisons for Subject's record*/
 int msim;	/* Pruned length of Subject's comparison pointer list */
@@ -96,19 +109,20 @@ int msim;	/* Pruned length of Subject's comparison pointer list */
 /* Take Subject's points and compute pointwise comparison statistics table and sorted row-pointer list. */
 /* This builds a "Web" of relative edge statistics between points. */
 bz_comp(
+	ctx,
 	pstruct->nrows,
 	pstruct->xcol,
 	pstruct->ycol,
 	pstruct->thetacol,
 	&sim,
-	scols,
-	scolpt );
+	ctx->scols,
+	ctx->scolpt );
 
 msim = sim;	/* Init search to end of Subject's pointwise comparison table (last edge in Web) */
 
 
 
-bz_find( &msim, scolpt );
+bz_find( &msim, ctx->scolpt );
 
 
 
@@ -124,7 +138,37 @@ return msim;
 
 /**************************************************************************/
 
-int bozorth_gallery_init( struct xyt_struct * gstruct )
+/* Lays the first nedges sorted rows of the On-File Record's table out    */
+/* column by column, for bz_match() to scan. Only the sorted rows are     */
+/* copied, bz_match() never looks at the rest of the table.               */
+static void bz_gallery_columns( struct bz_ctx * ctx, int nedges )
+{
+int i;
+int c;
+
+for ( c = 0; c < COLS_SIZE_2; c++ ) {
+	short * col = ctx->fedges[c];
+	for ( i = 0; i < nedges; i++ )
+		col[i] = ctx->fcolpt[i][c];
+	ctx->gallery.col[c] = col;
+}
+ctx->gallery.nedges = nedges;
+}
+
+/**************************************************************************/
+
+static void bz_gallery_template( struct bz_ctx * ctx, struct bz_template * tmpl )
+{
+int c;
+
+for ( c = 0; c < COLS_SIZE_2; c++ )
+	ctx->gallery.col[c] = BZ_TEMPLATE_COL( tmpl, c );
+ctx->gallery.nedges = tmpl->nedges;
+}
+
+/**************************************************************************/
+
+int bozorth_gallery_init_ctx( struct bz_ctx * ctx, struct xyt_struct * gstruct )
 {
 int fim;	/* number of pointwise comparisons for On-File record*/
 int mfim;	/* Pruned length of On-File Record's pointer list */
@@ -133,19 +177,20 @@ int mfim;	/* Pruned length of On-File Record's pointer list */
 /* Take On-File Record's points and compute pointwise comparison statistics table and sorted row-pointer list. */
 /* This builds a "Web" of relative edge statistics between points. */
 bz_comp(
+	ctx,
 	gstruct->nrows,
 	gstruct->xcol,
 	gstruct->ycol,
 	gstruct->thetacol,
 	&fim,
-	fcols,
-	fcolpt );
+	ctx->fcols,
+	ctx->fcolpt );
 
 mfim = fim;	/* Init search to end of On-File Record's pointwise comparison table (last edge in Web) */
 
 
 
-bz_find( &mfim, fcolpt );
+bz_find( &mfim, ctx->fcolpt );
 
 
 
@@ -154,14 +199,145 @@ if ( mfim < FDD )	/* Makes sure there are a reasonable number of edges (at least
 
 
 
-
+bz_gallery_columns( ctx, mfim );
 
 return mfim;
 }
 
 /**************************************************************************/
 
-int bozorth_to_gallery(
+/* Edge lengths are translation and rotation invariant, so their distribution */
+/* can be compared without aligning the two fingerprints first.               */
+static void bz_hist( int nedges, int * rows[], int hist[ BZ_HIST_BINS ] )
+{
+int i;
+int bin;
+
+INT_SET( hist, BZ_HIST_BINS, 0 );
+for ( i = 0; i < nedges; i++ ) {
+	bin = rows[i][0] * BZ_HIST_BINS / ( SQUARED(DM) + 1 );
+	hist[bin]++;
+}
+}
+
+/**************************************************************************/
+
+void bozorth_probe_hist_ctx(
+		struct bz_ctx * ctx,
+		int probe_len,
+		int hist[ BZ_HIST_BINS ]
+		)
+{
+bz_hist( probe_len, ctx->scolpt, hist );
+}
+
+/**************************************************************************/
+
+/* Returns the intersection of the two normalized histograms, in percent */
+int bozorth_hist_similarity(
+		const int hist1[ BZ_HIST_BINS ],
+		const int hist2[ BZ_HIST_BINS ]
+		)
+{
+long long total1 = 0;
+long long total2 = 0;
+long long common = 0;
+int i;
+
+for ( i = 0; i < BZ_HIST_BINS; i++ ) {
+	total1 += hist1[i];
+	total2 += hist2[i];
+}
+
+if ( total1 == 0 || total2 == 0 )
+	return 0;
+
+for ( i = 0; i < BZ_HIST_BINS; i++ ) {
+	long long a = hist1[i] * total2;
+	long long b = hist2[i] * total1;
+	common += ( a < b ) ? a : b;
+}
+
+return (int) ( common * 100 / ( total1 * total2 ) );
+}
+
+/**************************************************************************/
+
+struct bz_template * bozorth_gallery_compile_ctx(
+		struct bz_ctx * ctx,
+		struct xyt_struct * gstruct
+		)
+{
+struct bz_template * tmpl;
+int mfim;
+int c;
+
+
+mfim = bozorth_gallery_init_ctx( ctx, gstruct );
+
+/* Keep a copy of the columns bz_match() scans */
+tmpl = malloc( BZ_TEMPLATE_SIZE( mfim ) );
+if ( tmpl == (struct bz_template *) NULL )
+	return tmpl;
+
+tmpl->nedges = mfim;
+bz_hist( mfim, ctx->fcolpt, tmpl->hist );
+for ( c = 0; c < COLS_SIZE_2; c++ )
+	memcpy( BZ_TEMPLATE_COL( tmpl, c ), ctx->fedges[c], mfim * sizeof( short ) );
+
+return tmpl;
+}
+
+/**************************************************************************/
+
+void bozorth_template_free( struct bz_template * tmpl )
+{
+free( tmpl );
+}
+
+/**************************************************************************/
+
+int bozorth_to_template_ctx(
+		struct bz_ctx * ctx,
+		int probe_len,
+		struct xyt_struct * pstruct,
+		struct xyt_struct * gstruct,
+		struct bz_template * tmpl
+		)
+{
+int np;
+
+/* Scan the precompiled columns in place */
+bz_gallery_template( ctx, tmpl );
+
+np = bz_match( ctx, probe_len, tmpl->nedges );
+return bz_match_score( ctx, np, pstruct, gstruct );
+}
+
+/**************************************************************************/
+
+/* Returns a score reaching threshold if and only if the exact score does */
+int bozorth_to_template_bounded_ctx(
+		struct bz_ctx * ctx,
+		int probe_len,
+		struct xyt_struct * pstruct,
+		struct xyt_struct * gstruct,
+		struct bz_template * tmpl,
+		int threshold
+		)
+{
+int np;
+
+bz_gallery_template( ctx, tmpl );
+
+np = bz_match( ctx, probe_len, tmpl->nedges );
+return bz_match_score_bounded( ctx, np, pstruct, gstruct, threshold );
+}
+
+/**************************************************************************/
+
+int bozorth_to_gallery_ctx(
+		struct bz_ctx * ctx,
 		int probe_len,
 		struct xyt_struct * pstruct,
 		struct xyt_struct * gstruct
@@ -170,14 +346,15 @@ int bozorth_to_gallery(
 int np;
 int gallery_len;
 
-gallery_len = bozorth_gallery_init( gstruct );
-np = bz_match( probe_len, gallery_len );
-return bz_match_score( np, pstruct, gstruct );
+gallery_len = bozorth_gallery_init_ctx( ctx, gstruct );
+np = bz_match( ctx, probe_len, gallery_len );
+return bz_match_score( ctx, np, pstruct, gstruct );
 }
 
 /**************************************************************************/
 
-int bozorth_main(
+int bozorth_main_ctx(
+		struct bz_ctx * ctx,
 		struct xyt_struct * pstruct,
 		struct xyt_struct * gstruct
 		)
@@ -192,26 +369,26 @@ int gallery_len;
 #ifdef DEBUG
 	printf( "PROBE_INIT() called\n" );
 #endif
-probe_len   = bozorth_probe_init( pstruct );
+probe_len   = bozorth_probe_init_ctx( ctx, pstruct );
 
 
 #ifdef DEBUG
 	printf( "GALLERY_INIT() called\n" );
 #endif
-gallery_len = bozorth_gallery_init( gstruct );
+gallery_len = bozorth_gallery_init_ctx( ctx, gstruct );
 
 
 #ifdef DEBUG
 	printf( "BZ_MATCH() called\n" );
 #endif
-np = bz_match( probe_len, gallery_len );
+np = bz_match( ctx, probe_len, gallery_len );
 
 
 #ifdef DEBUG
 	printf( "BZ_MATCH() returned %d edge pairs\n", np );
 	printf( "COMPUTE() called\n" );
 #endif
-ms = bz_match_score( np, pstruct, gstruct );
+ms = bz_match_score( ctx, np, pstruct, gstruct );
 
 
 #ifdef DEBUG
@@ -221,3 +398,41 @@ ms = bz_match_score( np, pstruct, gstruct );
 
 return ms;
 }
+
+/**************************************************************************/
+/* Legacy entry points, all sharing the same process-wide context.        */
+/* They must not be used concurrently.                                     */
+/**************************************************************************/
+
+int bozorth_probe_init( struct xyt_struct * pstruct )
+{
+return bozorth_probe_init_ctx( bz_default_ctx(), pstruct );
+}
+
+/**************************************************************************/
+
+int bozorth_gallery_init( struct xyt_struct * gstruct )
+{
+return bozorth_gallery_init_ctx( bz_default_ctx(), gstruct );
+}
+
+/**************************************************************************/
+
+int bozorth_to_gallery(
+		int probe_len,
+		struct xyt_struct * pstruct,
+		struct xyt_struct * gstruct
+		)
+{
+return bozorth_to_gallery_ctx( bz_default_ctx(), probe_len, pstruct, gstruct );
+}
+
+/**************************************************************************/
+
+int bozorth_main(
+		struct xyt_struct * pstruct,
+		struct xyt_struct * gstruct
+		)
+{
+return bozorth_main_ctx( bz_default_ctx(), pstruct, gstruct );
+}
@@ -58,7 +58,7 @@ identified are necessarily the best available for the purpose.
                       Stan Janet (NIST)
       DATE:           09/21/2004
 
-      Contains global variables responsible for supporting the
+      Contains the matcher context responsible for supporting the
       Bozorth3 fingerprint matching "core" algorithm.
 
 ***********************************************************************
@@ -67,47 +67,28 @@ identified are necessarily the best available for the purpose.
 #include <bozorth.h>
 
 /**************************************************************************/
-/* General supporting global variables */
+/* Matcher context supporting the "core" algorithm */
 /**************************************************************************/
 
-int colp[ COLP_SIZE_1 ][ COLP_SIZE_2 ];		/* Output from match(), this is a sorted table of compatible edge pairs containing: */
-						/*	DeltaThetaKJs, Subject's K, J, then On-File's {K,J} or {J,K} depending */
-						/* Sorted first on Subject's point index K, */
-						/*	then On-File's K or J point index (depending), */
-						/*	lastly on Subject's J point index */
-int scols[ SCOLS_SIZE_1 ][ COLS_SIZE_2 ];	/* Subject's pointwise comparison table containing: */
-						/*	Distance,min(BetaK,BetaJ),max(BetaK,BbetaJ), K,J,ThetaKJ */
-int fcols[ FCOLS_SIZE_1 ][ COLS_SIZE_2 ];	/* On-File Record's pointwise comparison table with: */
-						/*	Distance,min(BetaK,BetaJ),max(BetaK,BbetaJ),K,J, ThetaKJ */
-int * scolpt[ SCOLPT_SIZE ];			/* Subject's list of pointers to pointwise comparison rows, sorted on: */
-						/*	Distance, min(BetaK,BetaJ), then max(BetaK,BetaJ) */
-int * fcolpt[ FCOLPT_SIZE ];			/* On-File Record's list of pointers to pointwise comparison rows sorted on: */
-						/*	Distance, min(BetaK,BetaJ), then max(BetaK,BetaJ) */
-int sc[ SC_SIZE ];				/* Flags all compatible edges in the Subject's Web */
+/* Context used by the legacy, non-reentrant entry points. Like the old    */
+/* global arrays, it lives in zero-initialized static storage.             */
+static struct bz_ctx default_ctx;
 
-int yl[ YL_SIZE_1 ][ YL_SIZE_2 ];
-
-
-/**************************************************************************/
-/* Globals used significantly by sift() */
 /**************************************************************************/
-int rq[ RQ_SIZE ] = {};
-int tq[ TQ_SIZE ] = {};
-int zz[ ZZ_SIZE ] = {};
-
-int rx[ RX_SIZE ] = {};
-int mm[ MM_SIZE ] = {};
-int nn[ NN_SIZE ] = {};
-
-int qq[ QQ_SIZE ] = {};
+struct bz_ctx *bz_ctx_new(void)
+{
+	return calloc(1, sizeof(struct bz_ctx));
+}
 
-int rk[ RK_SIZE ] = {};
-
-int cp[ CP_SIZE ] = {};
-int rp[ RP_SIZE ] = {};
-
-int rf[RF_SIZE_1][RF_SIZE_2] = {};
-int cf[CF_SIZE_1][CF_SIZE_2] = {};
-
-int y[20000] = {};
+/**************************************************************************/
+void bz_ctx_free(struct bz_ctx *ctx)
+{
+	if (ctx != &default_ctx)
+		free(ctx);
+}
 
+/**************************************************************************/
+struct bz_ctx *bz_default_ctx(void)
+{
+	return &default_ctx;
+}
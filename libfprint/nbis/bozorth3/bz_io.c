@@ -572,7 +572,7 @@ if ( verbose_load ) {
 
 
 
-s = (struct xyt_struct *) malloc( sizeof( struct xyt_struct ) );
+s = (struct xyt_struct *) malloc( sizeof( struct xyt_struct ) + 3 * nminutiae * sizeof( int ) );
 if ( s == XYT_NULL ) {
 	fprintf( stderr, "%s: ERROR: malloc() failure while loading minutiae file \"%s\" failed: %s\n",
 							get_progname(),
@@ -584,6 +584,9 @@ if ( s == XYT_NULL ) {
 
 
 
+s->xcol     = (int *) ( s + 1 );
+s->ycol     = s->xcol + nminutiae;
+s->thetacol = s->ycol + nminutiae;
 for ( j = 0; j < nminutiae; j++ ) {
 	s->xcol[j]     = c[j].col[0];
 	s->ycol[j]     = c[j].col[1];
@@ -107,6 +107,8 @@ extern float atanf( float );
 #define DEFAULT_SCORE_LINE_FORMAT	"s"
 
 #define DM	125
+#define THETA_KJ_SIZE	( 2 * DM + 1 )
+#define SORT_COUNT_SIZE	( DM * DM + 1 )
 #define FD	5625
 #define FDD	500
 #define TK	0.05F
@@ -167,15 +169,41 @@ struct cell {
 /**************************************************************************/
 #define MAX_FILE_MINUTIAE       1000 /* bz_load() */
 
+/* The columns point to nrows values each, at most MAX_BOZORTH_MINUTIAE */
 struct xyt_struct {
 	int nrows;
-	int xcol[     MAX_BOZORTH_MINUTIAE ];
-	int ycol[     MAX_BOZORTH_MINUTIAE ];
-	int thetacol[ MAX_BOZORTH_MINUTIAE ];
+	int * xcol;
+	int * ycol;
+	int * thetacol;
 };
 
 #define XYT_NULL ( (struct xyt_struct *) NULL ) /* bz_load() */
 
+/**************************************************************************/
+/* In BZ_DRVRS : Precompiled gallery-side pairwise comparison table */
+/**************************************************************************/
+#define BZ_HIST_BINS	16
+
+/* Gallery side of bz_match(): the sorted rows of a comparison table, one  */
+/* array per column and 16 bits per value. All values fit: distances are  */
+/* at most DM^2, angles within [ -180, 580 ] and point indices at most    */
+/* MAX_BOZORTH_MINUTIAE. The scan over the table then only pulls in the   */
+/* columns it compares, from contiguous memory.                           */
+struct bz_edges {
+	int nedges;
+	const short * col[ COLS_SIZE_2 ];
+};
+
+struct bz_template {
+	int nedges;			/* pruned length of the table */
+	int hist[ BZ_HIST_BINS ];	/* edge length histogram, see bozorth_hist_similarity() */
+	short cols[];			/* sorted rows, column by column, nedges values each */
+};
+
+#define BZ_TEMPLATE_COL(tmpl,c)	( (tmpl)->cols + (c) * (tmpl)->nedges )
+#define BZ_TEMPLATE_SIZE(nedges) \
+	( sizeof( struct bz_template ) + COLS_SIZE_2 * (nedges) * sizeof( short ) )
+
 
 /**************************************************************************/
 /**************************************************************************/
@@ -191,46 +219,93 @@ extern int verbose_threshold;
 /**************************************************************************/
 /* In: BZ_GBLS.C */
 /**************************************************************************/
-/* Global arrays supporting "core" bozorth algorithm */
-extern int colp[ COLP_SIZE_1 ][ COLP_SIZE_2 ];
-extern int scols[ SCOLS_SIZE_1 ][ COLS_SIZE_2 ];
-extern int fcols[ FCOLS_SIZE_1 ][ COLS_SIZE_2 ];
-extern int * scolpt[ SCOLPT_SIZE ];
-extern int * fcolpt[ FCOLPT_SIZE ];
-extern int sc[ SC_SIZE ];
-extern int yl[ YL_SIZE_1 ][ YL_SIZE_2 ];
-/* Global arrays supporting "core" bozorth algorithm continued: */
-/*    Globals used significantly by sift() */
-extern int rq[ RQ_SIZE ];
-extern int tq[ TQ_SIZE ];
-extern int zz[ ZZ_SIZE ];
-extern int rx[ RX_SIZE ];
-extern int mm[ MM_SIZE ];
-extern int nn[ NN_SIZE ];
-extern int qq[ QQ_SIZE ];
-extern int rk[ RK_SIZE ];
-extern int cp[ CP_SIZE ];
-extern int rp[ RP_SIZE ];
-extern int rf[RF_SIZE_1][RF_SIZE_2];
-extern int cf[CF_SIZE_1][CF_SIZE_2];
-extern int y[20000];
+/* Arrays supporting the "core" bozorth algorithm, formerly globals.    */
+/* They are gathered in a matcher context so that several matches can  */
+/* run concurrently, each one on its own context.                       */
+struct bz_ctx {
+	/* compatible edge pairs, see bz_match(); all values fit in 16 bits */
+	short colp[ COLP_SIZE_1 ][ COLP_SIZE_2 ];
+	int scols[ SCOLS_SIZE_1 ][ COLS_SIZE_2 ];
+	int fcols[ FCOLS_SIZE_1 ][ COLS_SIZE_2 ];
+	int * scolpt[ SCOLPT_SIZE ];
+	int * fcolpt[ FCOLPT_SIZE ];
+	/* gallery side of bz_match(), pointing at fedges or at a template */
+	struct bz_edges gallery;
+	short fedges[ COLS_SIZE_2 ][ FCOLPT_SIZE ];
+	int sc[ SC_SIZE ];
+	int yl[ YL_SIZE_1 ][ YL_SIZE_2 ];
+	/* Arrays used significantly by sift() */
+	int rq[ RQ_SIZE ];
+	int tq[ TQ_SIZE ];
+	int zz[ ZZ_SIZE ];
+	int rx[ RX_SIZE ];
+	int mm[ MM_SIZE ];
+	int nn[ NN_SIZE ];
+	int qq[ QQ_SIZE ];
+	int rk[ RK_SIZE ];
+	int cp[ CP_SIZE ];
+	int rp[ RP_SIZE ];
+	int rf[RF_SIZE_1][RF_SIZE_2];
+	int cf[CF_SIZE_1][CF_SIZE_2];
+	int y[ Y_SIZE ];
+	/* Formerly static to bz_match() */
+	int rot[ ROT_SIZE_1 ][ ROT_SIZE_2 ];
+	int * rtp[ ROT_SIZE_1 ];
+	/* Formerly static to bz_match_score() & bz_final_loop() */
+	int ct[ CT_SIZE ];
+	int gct[ GCT_SIZE ];
+	int ctt[ CTT_SIZE ];
+	int ctp[ CTP_SIZE_1 ][ CTP_SIZE_2 ];
+	int yy[ YY_SIZE_1 ][ YY_SIZE_2 ][ YY_SIZE_3 ];
+	int sct[ SCT_SIZE_1 ][ SCT_SIZE_2 ];
+	/* Edge angles for bz_comp(), indexed by [ dx + DM ][ dy + DM ] */
+	signed char theta_kj[ THETA_KJ_SIZE ][ THETA_KJ_SIZE ];
+	int theta_kj_ready;
+	/* Scratch space for sorting the tables built by bz_comp() */
+	int * sortpt[ SORTPT_SIZE ];
+	int sort_count[ SORT_COUNT_SIZE ];
+};
 
 /**************************************************************************/
 /**************************************************************************/
 /* ROUTINE PROTOTYPES */
 /**************************************************************************/
+/* In: BZ_GBLS.C */
+extern struct bz_ctx *bz_ctx_new(void);
+extern void bz_ctx_free(struct bz_ctx *);
+extern struct bz_ctx *bz_default_ctx(void);
 /* In: BZ_DRVRS.C */
+extern int bozorth_probe_init_ctx(struct bz_ctx *, struct xyt_struct *);
+extern int bozorth_gallery_init_ctx(struct bz_ctx *, struct xyt_struct *);
+extern int bozorth_to_gallery_ctx(struct bz_ctx *, int, struct xyt_struct *,
+                    struct xyt_struct *);
+extern int bozorth_main_ctx(struct bz_ctx *, struct xyt_struct *,
+                    struct xyt_struct *);
+extern struct bz_template *bozorth_gallery_compile_ctx(struct bz_ctx *,
+                    struct xyt_struct *);
+extern void bozorth_template_free(struct bz_template *);
+extern int bozorth_to_template_ctx(struct bz_ctx *, int, struct xyt_struct *,
+                    struct xyt_struct *, struct bz_template *);
+extern int bozorth_to_template_bounded_ctx(struct bz_ctx *, int,
+                    struct xyt_struct *, struct xyt_struct *,
+                    struct bz_template *, int);
+extern void bozorth_probe_hist_ctx(struct bz_ctx *, int, int []);
+extern int bozorth_hist_similarity(const int [], const int []);
 extern int bozorth_probe_init( struct xyt_struct *);
 extern int bozorth_gallery_init( struct xyt_struct *);
 extern int bozorth_to_gallery(int, struct xyt_struct *, struct xyt_struct *);
 extern int bozorth_main(struct xyt_struct *, struct xyt_struct *);
 /* In: BOZORTH3.C */
-extern void bz_comp(int, int [], int [], int [], int *, int [][COLS_SIZE_2],
+extern void bz_comp(struct bz_ctx *, int, int [], int [], int [], int *, int [][COLS_SIZE_2],
                     int *[]);
 extern void bz_find(int *, int *[]);
-extern int bz_match(int, int);
-extern int bz_match_score(int, struct xyt_struct *, struct xyt_struct *);
-extern void bz_sift(int *, int, int *, int, int, int, int *, int *);
+extern int bz_match(struct bz_ctx *, int, int);
+extern int bz_match_score(struct bz_ctx *, int, struct xyt_struct *,
+                    struct xyt_struct *);
+extern int bz_match_score_bounded(struct bz_ctx *, int, struct xyt_struct *,
+                    struct xyt_struct *, int);
+extern void bz_sift(struct bz_ctx *, int *, int, int *, int, int, int, int *,
+                    int *);
 /* In: BZ_ALLOC.C */
 extern char *malloc_or_exit(int, const char *);
 extern char *malloc_or_return_error(int, const char *);
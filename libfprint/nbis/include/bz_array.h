@@ -36,6 +36,7 @@ identified are necessarily the best available for the purpose.
 
 #define SCOLPT_SIZE 20000
 #define FCOLPT_SIZE 20000
+#define SORTPT_SIZE 20000
 
 #define SC_SIZE 20000
 
@@ -118,4 +119,7 @@ rp[x] == ctp[][x] :: sct[x][]
 #define CP_SIZE 20000
 #define RP_SIZE 20000
 
+#define ROT_SIZE_1 20000
+#define ROT_SIZE_2 5
+
 #endif /* !_BZ_ARRAY_H */
@@ -104,6 +104,10 @@ typedef struct dftwaves{
    int nwaves;
    int wavelen;
    DFTWAVE **waves;
+   /* Single precision copies of the wave forms, for LFSPARMS.dft_single, */
+   /* interleaved so that row i of all waves starts at i * nwaves         */
+   float *fcos;
+   float *fsin;
 }DFTWAVES;
 
 /* Rotated pixel offsets for a grid of specified dimensions */
@@ -121,6 +125,45 @@ typedef struct rotgrids{
    int **grids;
 } ROTGRIDS;
 
+/* Lookup tables used by lfs_detect_minutiae_V2(). They only depend on  */
+/* the image width (the rotated grids hold offsets into padded rows)    */
+/* and the LFS parameters, and are not modified while detecting         */
+/* minutiae, so they may be shared between images and threads.          */
+typedef struct lfstables{
+   int iw;
+   int ih;
+   int maxpad;
+   DIR2RAD *dir2rad;
+   DFTWAVES *dftwaves;
+   ROTGRIDS *dftgrids;
+   ROTGRIDS *dirbingrids;
+} LFSTABLES;
+
+/* Memory arena holding the intermediate results of get_minutiae().     */
+/* Allocations are carved out of large chunks and are all released at  */
+/* once by reset_lfsarena(), which keeps the memory for the next image. */
+typedef struct lfsarena_chunk{
+   struct lfsarena_chunk *next;
+   size_t size;
+   size_t used;
+   double data[1];
+} LFSARENA_CHUNK;
+
+typedef struct lfsarena{
+   LFSARENA_CHUNK *chunks;
+   /* Total size of the chunks, the size of the chunk kept on reset. */
+   size_t total;
+   /* Most recent allocation, which can be given back right away.    */
+   void *last;
+   size_t last_used;
+} LFSARENA;
+
+/* Binary images packed one bit per pixel (see bitimage.c).  A set bit  */
+/* is a black (ridge) pixel.  Each row starts on a word boundary.       */
+typedef uint64_t BITWORD;
+#define BITWORD_BITS             64
+#define BITIMAGE_STRIDE(iw)      (((iw) + BITWORD_BITS - 1) / BITWORD_BITS)
+
 /*************************************************************************/
 /* 10, 2X3 pixel pair feature patterns used to define ridge endings      */
 /* and bifurcations.                                                     */
@@ -242,8 +285,57 @@ typedef struct lfsparms{
    /* Ridge Counting Controls */
    int    max_nbrs;
    int    max_ridge_steps;
+
+   /* Number of threads sharing the blocks of gen_initial_maps() */
+   /* and the rows of binarize_image_V2(), 0 or 1 to use the     */
+   /* calling thread only                                        */
+   int    map_threads;
+
+   /* Non-zero to compute the DFT powers of the direction maps in single */
+   /* precision, see dft_dir_powers()                                    */
+   int    dft_single;
+
+   /* Non-zero to scan the binary image for minutiae in bands shared by */
+   /* map_threads threads, see detect_minutiae_V2()                     */
+   int    scan_bands;
+
+   /* Called as each stage of get_minutiae() completes, with one */
+   /* of the LFS_STAGE_* values, NULL when not profiling         */
+   void   (*stage_done)(const int stage, void *stage_data);
+   void   *stage_data;
+
+   /* Once the int pointed to is set, get_minutiae() gives up with    */
+   /* LFS_CANCELLED at the next checkpoint, see lfs_cancelled(); NULL */
+   /* to always run to completion                                     */
+   volatile int *cancel;
 } LFSPARMS;
 
+/* Stages of get_minutiae(), see LFSPARMS.stage_done */
+#define LFS_STAGE_INIT           0
+#define LFS_STAGE_MAPS           1
+#define LFS_STAGE_BINARIZATION   2
+#define LFS_STAGE_DETECTION      3
+#define LFS_STAGE_RIDGE_COUNT    4
+#define LFS_STAGE_QUALITY        5
+#define LFS_NUM_STAGES           6
+
+#define lfs_stage_done(lfsparms, stage) \
+   do { \
+      if((lfsparms)->stage_done != NULL) \
+         (lfsparms)->stage_done(stage, (lfsparms)->stage_data); \
+   } while(0)
+
+/* Checked for each block of the direction maps, each row of the       */
+/* binarization and pass filling its holes, each row and column of the */
+/* minutiae scan, between the passes removing false minutiae, and for  */
+/* each minutia of the ridge counting, so that get_minutiae() can be   */
+/* abandoned within a few milliseconds.                                */
+#define lfs_cancelled(lfsparms) \
+   ((lfsparms)->cancel != NULL && g_atomic_int_get((lfsparms)->cancel))
+
+/* Returned once LFSPARMS.cancel is set */
+#define LFS_CANCELLED            -700
+
 /*************************************************************************/
 /*        LFS CONSTANT DEFINITIONS                                       */
 /*************************************************************************/
@@ -688,17 +780,40 @@ typedef struct lfsparms{
 /*        EXTERNAL FUNCTION DEFINITIONS                                  */
 /*************************************************************************/
 
+/* arena.c */
+extern int init_lfsarena(LFSARENA **);
+extern void reset_lfsarena(LFSARENA *);
+extern void free_lfsarena(LFSARENA *);
+extern LFSARENA *use_lfsarena(LFSARENA *);
+extern int lfsarena_owns(const LFSARENA *, const void *);
+extern void *arena_malloc(const size_t);
+extern void *arena_calloc(const size_t, const size_t);
+extern void arena_free(void *);
+
 /* binar.c */
-extern int binarize_V2(unsigned char **, int *, int *,
+extern int binarize_V2(unsigned char **, BITWORD **, int *, int *,
                      unsigned char *, const int, const int,
                      int *, const int, const int,
                      const ROTGRIDS *, const LFSPARMS *);
 extern int binarize_image_V2(unsigned char **, int *, int *,
                      unsigned char *, const int, const int,
                      const int *, const int, const int,
-                     const int, const ROTGRIDS *);
+                     const int, const ROTGRIDS *, const LFSPARMS *);
 extern int dirbinarize(const unsigned char *, const int, const ROTGRIDS *);
 
+/* bitimage.c */
+extern int pack_bitimage(BITWORD **, const unsigned char *,
+                     const int, const int, const int);
+extern void unpack_bitimage(unsigned char *, const BITWORD *,
+                     const int, const int, const int, const int);
+extern int transpose_bitimage(BITWORD **, const BITWORD *,
+                     const int, const int);
+extern void fill_holes_bitimage(BITWORD *, const int, const int);
+extern void erode_bitimage(BITWORD *, BITWORD *, const int, const int);
+extern void dilate_bitimage(BITWORD *, BITWORD *, const int, const int);
+extern int next_bitimage_diff(const BITWORD *, const BITWORD *,
+                     const int, const int);
+
 /* block.c */
 extern int block_offsets(int **, int *, int *, const int, const int,
                      const int, const int);
@@ -713,6 +828,7 @@ extern void set_margin_blocks(int *, const int, const int, const int);
 int allocate_contour(int **ocontour_x, int **ocontour_y,
                      int **ocontour_ex, int **ocontour_ey, const int ncontour);
 extern void free_contour(int *, int *, int *, int *);
+extern void free_contour_pool(void);
 extern int get_high_curvature_contour(int **, int **, int **, int **, int *,
                      const int, const int, const int, const int, const int,
                      unsigned char *, const int, const int);
@@ -723,6 +839,9 @@ extern int trace_contour(int **, int **, int **, int **, int *,
                      const int, const int, const int, const int, const int,
                      const int, const int, const int,
                      unsigned char *, const int, const int);
+extern int walk_contour(int *, const int, const int, const int,
+                     const int, const int, const int, const int, const int,
+                     unsigned char *, const int, const int);
 extern int search_contour(const int, const int, const int,
                      const int, const int, const int, const int, const int,
                      unsigned char *, const int, const int);
@@ -734,16 +853,20 @@ extern void fix_edge_pixel_pair(int *, int *, int *, int *,
                      unsigned char *, const int, const int);
 
 /* detect.c */
+extern int init_lfstables(LFSTABLES **, const int, const int,
+                 const LFSPARMS *);
+extern void free_lfstables(LFSTABLES *);
 extern int get_minutiae(MINUTIAE **, int **, int **, int **,
                  int **, int **, int *, int *,
-                 unsigned char **, int *, int *, int *,
+                 BITWORD **, int *, int *, int *,
                  unsigned char *, const int, const int,
-                 const int, const double, const LFSPARMS *);
+                 const int, const double, const LFSPARMS *,
+                 const LFSTABLES *, LFSARENA *);
 
 /* dft.c */
 extern int dft_dir_powers(double **, unsigned char *, const int,
                      const int, const int, const DFTWAVES *,
-                     const ROTGRIDS *);
+                     const ROTGRIDS *, const int);
 extern int dft_power_stats(int *, double *, int *, double *, double **,
                      const int, const int, const int);
 
@@ -869,7 +992,7 @@ extern void skip_repeated_vertical_pair(int *, const int,
 extern int alloc_minutiae(MINUTIAE **, const int);
 extern int realloc_minutiae(MINUTIAE *, const int);
 extern int detect_minutiae_V2(MINUTIAE *,
-                     unsigned char *, const int, const int,
+                     unsigned char *, const BITWORD *, const int, const int,
                      int *, int *, int *, const int, const int,
                      const LFSPARMS *);
 extern int update_minutiae(MINUTIAE *, MINUTIA *, unsigned char *,
@@ -904,7 +1027,7 @@ extern int scan4minutiae_horizontally(MINUTIAE *, unsigned char *,
                      const int, const int, const int, const int,
                      const LFSPARMS *);
 extern int scan4minutiae_horizontally_V2(MINUTIAE *,
-                     unsigned char *, const int, const int,
+                     unsigned char *, const BITWORD *, const int, const int,
                      int *, int *, int *,
                      const LFSPARMS *);
 extern int scan4minutiae_vertically(MINUTIAE *, unsigned char *,
@@ -917,7 +1040,7 @@ extern int rescan4minutiae_horizontally(MINUTIAE *, unsigned char *bdata,
                      const int, const int, const int, const int,
                      const LFSPARMS *);
 extern int scan4minutiae_vertically_V2(MINUTIAE *,
-                     unsigned char *, const int, const int,
+                     unsigned char *, const BITWORD *, const int, const int,
                      int *, int *, int *, const LFSPARMS *);
 extern int rescan4minutiae_vertically(MINUTIAE *, unsigned char *,
                      const int, const int, const int *, const int *,
@@ -1003,10 +1126,10 @@ extern int shape_from_contour(SHAPE **, const int *, const int *, const int);
 /* sort.c */
 extern int sort_indices_int_inc(int **, int *, const int);
 extern int sort_indices_double_inc(int **, double *, const int);
-extern void bubble_sort_int_inc_2(int *, int *, const int);
-extern void bubble_sort_double_inc_2(double *, int *, const int);
-extern void bubble_sort_double_dec_2(double *, int *,  const int);
-extern void bubble_sort_int_inc(int *, const int);
+extern void sort_int_inc_2(int *, int *, const int);
+extern void sort_double_inc_2(double *, int *, const int);
+extern void sort_double_dec_2(double *, int *,  const int);
+extern void sort_int_inc(int *, const int);
 
 /* util.c */
 extern int maxv(const int *, const int);
@@ -1026,12 +1149,12 @@ extern int closest_dir_dist(const int, const int, const int);
 /*************************************************************************/
 /*        EXTERNAL GLOBAL VARIABLE DEFINITIONS                           */
 /*************************************************************************/
-extern double g_dft_coefs[];
-extern LFSPARMS g_lfsparms;
-extern LFSPARMS g_lfsparms_V2;
-extern int g_nbr8_dx[];
-extern int g_nbr8_dy[];
-extern int g_chaincodes_nbr8[];
-extern FEATURE_PATTERN g_feature_patterns[];
+extern const double g_dft_coefs[];
+extern const LFSPARMS g_lfsparms;
+extern const LFSPARMS g_lfsparms_V2;
+extern const int g_nbr8_dx[];
+extern const int g_nbr8_dy[];
+extern const int g_chaincodes_nbr8[];
+extern const FEATURE_PATTERN g_feature_patterns[];
 
 #endif
@@ -0,0 +1,293 @@
+/***********************************************************************
+      LIBRARY: LFS - NIST Latent Fingerprint System
+
+      FILE:    ARENA.C
+
+      Contains routines managing the memory arena from which the
+      intermediate results of the NIST Latent Fingerprint System (LFS)
+      are allocated.  While an arena is in use by a thread, memory
+      obtained through arena_malloc() is carved out of the arena, and
+      arena_free() only gives back the most recent allocation; all the
+      other allocations are released together by reset_lfsarena().
+      Without an arena, these routines fall back to malloc() and free().
+
+***********************************************************************
+               ROUTINES:
+                        init_lfsarena()
+                        reset_lfsarena()
+                        free_lfsarena()
+                        use_lfsarena()
+                        lfsarena_owns()
+                        arena_malloc()
+                        arena_calloc()
+                        arena_free()
+
+***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <lfs.h>
+
+/* Size of the first chunk of an arena, further chunks are at least as */
+/* big as all the previous ones together.                              */
+#define LFSARENA_CHUNK_SIZE   (64 * 1024)
+/* Allocations are aligned as the chunk data. */
+#define LFSARENA_ALIGN(n)     (((n) + sizeof(double) - 1) & ~(sizeof(double) - 1))
+
+/* Arena in use by the current thread, see use_lfsarena() */
+static GPrivate current_lfsarena;
+
+/*************************************************************************
+**************************************************************************
+#cat: alloc_lfsarena_chunk - Allocates a chunk able to hold at least the
+#cat:            specified number of bytes.
+
+   Input:
+      size     - minimum size of the chunk data, in bytes
+   Return Code:
+      Non-NULL - the new chunk
+      NULL     - system (allocation) error
+**************************************************************************/
+static LFSARENA_CHUNK *alloc_lfsarena_chunk(const size_t size)
+{
+   LFSARENA_CHUNK *chunk;
+
+   chunk = (LFSARENA_CHUNK *)malloc(sizeof(LFSARENA_CHUNK) + size);
+   if(chunk == (LFSARENA_CHUNK *)NULL)
+      return(chunk);
+
+   chunk->next = (LFSARENA_CHUNK *)NULL;
+   chunk->size = size;
+   chunk->used = 0;
+   return(chunk);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: init_lfsarena - Allocates an empty memory arena.
+
+   Output:
+      oarena   - points to the created arena
+   Return Code:
+      Zero     - successful completion
+      Negative - system error
+**************************************************************************/
+int init_lfsarena(LFSARENA **oarena)
+{
+   LFSARENA *arena;
+
+   arena = (LFSARENA *)calloc(1, sizeof(LFSARENA));
+   if(arena == (LFSARENA *)NULL){
+      fprintf(stderr, "ERROR : init_lfsarena : calloc : arena\n");
+      return(-584);
+   }
+
+   arena->chunks = alloc_lfsarena_chunk(LFSARENA_CHUNK_SIZE);
+   if(arena->chunks == (LFSARENA_CHUNK *)NULL){
+      free(arena);
+      fprintf(stderr, "ERROR : init_lfsarena : malloc : arena->chunks\n");
+      return(-585);
+   }
+   arena->total = LFSARENA_CHUNK_SIZE;
+
+   *oarena = arena;
+   return(0);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: reset_lfsarena - Releases all the allocations of a memory arena.
+#cat:            If the arena had to grow, its chunks are replaced by a
+#cat:            single one holding as much, so that the next image
+#cat:            is processed within one chunk.
+
+   Input:
+      arena    - the arena to be reset
+**************************************************************************/
+void reset_lfsarena(LFSARENA *arena)
+{
+   LFSARENA_CHUNK *chunk, *next;
+
+   arena->last = NULL;
+
+   /* If allocation error, simply keep the chunks there are. */
+   if(arena->chunks->next != (LFSARENA_CHUNK *)NULL &&
+      (chunk = alloc_lfsarena_chunk(arena->total)) != (LFSARENA_CHUNK *)NULL){
+      for(next = arena->chunks; next != (LFSARENA_CHUNK *)NULL; ){
+         arena->chunks = next;
+         next = next->next;
+         free(arena->chunks);
+      }
+      arena->chunks = chunk;
+      return;
+   }
+
+   for(chunk = arena->chunks; chunk != (LFSARENA_CHUNK *)NULL;
+       chunk = chunk->next)
+      chunk->used = 0;
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: free_lfsarena - Deallocates a memory arena along with all the memory
+#cat:            allocated from it.
+
+   Input:
+      arena    - the arena to be deallocated
+**************************************************************************/
+void free_lfsarena(LFSARENA *arena)
+{
+   LFSARENA_CHUNK *chunk, *next;
+
+   if(arena == (LFSARENA *)NULL)
+      return;
+
+   for(chunk = arena->chunks; chunk != (LFSARENA_CHUNK *)NULL; chunk = next){
+      next = chunk->next;
+      free(chunk);
+   }
+   free(arena);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: use_lfsarena - Sets the memory arena arena_malloc() allocates from
+#cat:            in the calling thread.
+
+   Input:
+      arena    - the arena to be used, or NULL to use malloc()
+   Return Code:
+      The arena previously in use by the calling thread, if any
+**************************************************************************/
+LFSARENA *use_lfsarena(LFSARENA *arena)
+{
+   LFSARENA *prev = (LFSARENA *)g_private_get(&current_lfsarena);
+
+   g_private_set(&current_lfsarena, arena);
+   return(prev);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: lfsarena_owns - Tells whether a pointer was allocated from a memory
+#cat:            arena.
+
+   Input:
+      arena    - the arena, may be NULL
+      ptr      - the pointer to be checked
+   Return Code:
+      TRUE     - the pointer is within one of the arena's chunks
+      FALSE    - otherwise
+**************************************************************************/
+int lfsarena_owns(const LFSARENA *arena, const void *ptr)
+{
+   const LFSARENA_CHUNK *chunk;
+   const char *p = (const char *)ptr;
+
+   if(arena == (LFSARENA *)NULL)
+      return(FALSE);
+
+   for(chunk = arena->chunks; chunk != (LFSARENA_CHUNK *)NULL;
+       chunk = chunk->next)
+      if(p >= (const char *)chunk->data &&
+         p < (const char *)chunk->data + chunk->size)
+         return(TRUE);
+
+   return(FALSE);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: arena_malloc - Allocates memory from the arena in use by the calling
+#cat:            thread, or with malloc() if there is none.
+
+   Input:
+      size     - number of bytes to allocate
+   Return Code:
+      Non-NULL - the allocated memory
+      NULL     - system (allocation) error
+**************************************************************************/
+void *arena_malloc(const size_t size)
+{
+   LFSARENA *arena = (LFSARENA *)g_private_get(&current_lfsarena);
+   LFSARENA_CHUNK *chunk;
+   size_t asize;
+   void *ptr;
+
+   if(arena == (LFSARENA *)NULL)
+      return(malloc(size));
+
+   asize = LFSARENA_ALIGN(size);
+   chunk = arena->chunks;
+   if(chunk->size - chunk->used < asize){
+      /* Grow the arena, at least doubling its size. */
+      chunk = alloc_lfsarena_chunk(max(asize, arena->total));
+      if(chunk == (LFSARENA_CHUNK *)NULL)
+         return(NULL);
+      chunk->next = arena->chunks;
+      arena->chunks = chunk;
+      arena->total += chunk->size;
+   }
+
+   ptr = (char *)chunk->data + chunk->used;
+   arena->last = ptr;
+   arena->last_used = chunk->used;
+   chunk->used += asize;
+   return(ptr);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: arena_calloc - Allocates zeroed memory from the arena in use by the
+#cat:            calling thread, or with calloc() if there is none.
+
+   Input:
+      nmemb    - number of items to allocate
+      size     - size of each item, in bytes
+   Return Code:
+      Non-NULL - the allocated memory
+      NULL     - system (allocation) error
+**************************************************************************/
+void *arena_calloc(const size_t nmemb, const size_t size)
+{
+   void *ptr;
+
+   if(g_private_get(&current_lfsarena) == NULL)
+      return(calloc(nmemb, size));
+
+   if(size && nmemb > (size_t)-1 / size)
+      return(NULL);
+
+   ptr = arena_malloc(nmemb * size);
+   if(ptr != NULL)
+      memset(ptr, 0, nmemb * size);
+   return(ptr);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: arena_free - Deallocates memory obtained from arena_malloc().  Only
+#cat:            the most recent allocation of an arena is given back,
+#cat:            the others remain until the arena is reset.  Memory
+#cat:            which isn't part of the calling thread's arena is passed
+#cat:            to free().
+
+   Input:
+      ptr      - the memory to be deallocated, may be NULL
+**************************************************************************/
+void arena_free(void *ptr)
+{
+   LFSARENA *arena = (LFSARENA *)g_private_get(&current_lfsarena);
+
+   if(!lfsarena_owns(arena, ptr)){
+      free(ptr);
+      return;
+   }
+
+   if(ptr == arena->last){
+      arena->chunks->used = arena->last_used;
+      arena->last = NULL;
+   }
+}
@@ -37,6 +37,9 @@ identified are necessarily the best available for the purpose.
 ***********************************************************************
                ROUTINES:
                         binarize_V2()
+                        grid_center_row()
+                        dirbinarize_grid()
+                        binarize_rows_V2()
 			binarize_image_V2()
                         dirbinarize()
 
@@ -44,6 +47,7 @@ identified are necessarily the best available for the purpose.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <glib.h>
 #include <lfs.h>
 
 /*************************************************************************
@@ -51,7 +55,11 @@ identified are necessarily the best available for the purpose.
 #cat: binarize_V2 - Takes a padded grayscale input image and its associated
 #cat:              Direction Map and produces a binarized version of the
 #cat:              image.  It then fills horizontal and vertical "holes" in
-#cat:              the binary image results.  Note that the input image must
+#cat:              the binary image results, packed one bit per pixel.  The
+#cat:              filled image is passed back both packed and as an 8-bit
+#cat:              image ready for minutiae detection, with black (ridge)
+#cat:              pixels set to 1 and white pixels set to 0.  Note that
+#cat:              the input image must
 #cat:              be padded sufficiently to contain in memory rotated
 #cat:              directional binarization grids applied to pixels along the
 #cat:              perimeter of the input image.
@@ -67,46 +75,221 @@ identified are necessarily the best available for the purpose.
                     binarization
       lfsparms    - parameters and thresholds for controlling LFS
    Output:
-      odata - points to created (unpadded) binary image
+      odata - points to created (unpadded) binary image {0,1}
+      obits - points to the same image packed one bit per pixel
       ow    - width of binary image
       oh    - height of binary image
    Return Code:
       Zero     - successful completion
+      LFS_CANCELLED - lfsparms->cancel was set
       Negative - system error
 **************************************************************************/
-int binarize_V2(unsigned char **odata, int *ow, int *oh,
+int binarize_V2(unsigned char **odata, BITWORD **obits, int *ow, int *oh,
           unsigned char *pdata, const int pw, const int ph,
           int *direction_map, const int mw, const int mh,
           const ROTGRIDS *dirbingrids, const LFSPARMS *lfsparms)
 {
    unsigned char *bdata;
+   BITWORD *bits;
    int i, bw, bh, ret; /* return code */
 
    /* 1. Binarize the padded input image using directional block info. */
    if((ret = binarize_image_V2(&bdata, &bw, &bh, pdata, pw, ph,
                             direction_map, mw, mh,
-                            lfsparms->blocksize, dirbingrids))){
+                            lfsparms->blocksize, dirbingrids, lfsparms))){
       return(ret);
    }
 
-   /* 2. Fill black and white holes in binary image. */
+   /* 2. Pack the binary image, black pixels being set. */
+   if((ret = pack_bitimage(&bits, bdata, bw, bh, BLACK_PIXEL))){
+      arena_free(bdata);
+      return(ret);
+   }
+
+   /* 3. Fill black and white holes in binary image. */
    /* LFS scans the binary image, filling holes, 3 times. */
-   for(i = 0; i < lfsparms->num_fill_holes; i++)
-      fill_holes(bdata, bw, bh);
+   for(i = 0; i < lfsparms->num_fill_holes; i++){
+      if(lfs_cancelled(lfsparms)){
+         arena_free(bits);
+         arena_free(bdata);
+         return(LFS_CANCELLED);
+      }
+      fill_holes_bitimage(bits, bw, bh);
+   }
+
+   /* 4. Unpack the filled image as {1 = black, 0 = white}. */
+   unpack_bitimage(bdata, bits, bw, bh, 1, 0);
 
    /* Return binarized input image. */
    *odata = bdata;
+   *obits = bits;
    *ow = bw;
    *oh = bh;
    return(0);
 }
 
+/* A band of rows binarized by one thread of binarize_image_V2(). */
+typedef struct binarize_work{
+   unsigned char *bdata;
+   int bw;
+   int first_row;
+   int last_row;
+   const unsigned char *pdata;
+   int pw;
+   const int *direction_map;
+   int mw;
+   int blocksize;
+   const ROTGRIDS *dirbingrids;
+   const LFSPARMS *lfsparms;
+} BINARIZE_WORK;
+
+/*************************************************************************
+**************************************************************************
+#cat: grid_center_row - Returns the center (0-oriented) row of the rotated
+#cat:              grids used for directional binarization.
+
+   Input:
+      dirbingrids - set of precomputed rotated grid offsets
+   Return Code:
+      the center row of the grids
+**************************************************************************/
+static int grid_center_row(const ROTGRIDS *dirbingrids)
+{
+   double dcy;
+
+   /* Calculate center (0-oriented) row in grid. */
+   dcy = (dirbingrids->grid_h-1)/(double)2.0;
+   /* Need to truncate precision so that answers are consistent */
+   /* on different computer architectures when rounding doubles. */
+   dcy = trunc_dbl_precision(dcy, TRUNC_SCALE);
+   return(sround(dcy));
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: dirbinarize_grid - Determines the binary value of a grayscale pixel
+#cat:              from one of the rotated grids, see dirbinarize().
+
+   Input:
+      pptr        - pointer to current grayscale pixel
+      grid        - offsets of the rotated grid for the pixel's direction
+      grid_w      - width of the grid
+      grid_h      - height of the grid
+      cy          - center row of the grid, from grid_center_row()
+   Return Code:
+      BLACK_PIXEL - pixel intensity for BLACK
+      WHITE_PIXEL - pixel intensity of WHITE
+**************************************************************************/
+static inline int dirbinarize_grid(const unsigned char *pptr, const int *grid,
+                const int grid_w, const int grid_h, const int cy)
+{
+   int gx, gy, gi;
+   int rsum, gsum, csum = 0;
+
+   /* Initialize grid's pixel offset index to zero. */
+   gi = 0;
+   /* Initialize grid's pixel accumulator to zero */
+   gsum = 0;
+
+   /* Foreach row in grid ... */
+   for(gy = 0; gy < grid_h; gy++){
+      /* Initialize row pixel sum to zero. */
+      rsum = 0;
+      /* Foreach column in grid ... */
+      for(gx = 0; gx < grid_w; gx++){
+         /* Accumulate next pixel along rotated row in grid. */
+         rsum += *(pptr+grid[gi]);
+         /* Bump grid's pixel offset index. */
+         gi++;
+      }
+      /* Accumulate row sum into grid pixel sum. */
+      gsum += rsum;
+      /* If current row is center row, then save row sum separately. */
+      if(gy == cy)
+         csum = rsum;
+   }
+
+   /* If the center row sum treated as an average is less than the */
+   /* total pixel sum in the rotated grid ...                      */
+   if((csum * grid_h) < gsum)
+      /* Set the binary pixel to BLACK. */
+      return(BLACK_PIXEL);
+   else
+      /* Otherwise set the binary pixel to WHITE. */
+      return(WHITE_PIXEL);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: binarize_rows_V2 - Binarizes a band of rows of the image for
+#cat:              binarize_image_V2().  A band only reads the padded
+#cat:              input rows its grids overlap, and only writes its own
+#cat:              rows of the binary image.  The band is left unfinished
+#cat:              once LFSPARMS.cancel is set.
+
+   Input:
+      work        - the band, along with the inputs of binarize_image_V2()
+   Output:
+      work        - the rows of the band are set in the binary image
+**************************************************************************/
+static void binarize_rows_V2(const BINARIZE_WORK *work)
+{
+   const ROTGRIDS *dirbingrids = work->dirbingrids;
+   const int pw = work->pw;
+   const int cy = grid_center_row(dirbingrids);
+   int ix, iy, bx, by, mapval;
+   unsigned char *bptr;
+   const unsigned char *pptr, *spptr;
+
+   bptr = work->bdata + (work->first_row * work->bw);
+   spptr = work->pdata + ((dirbingrids->pad + work->first_row) * pw) +
+           dirbingrids->pad;
+   for(iy = work->first_row; iy < work->last_row; iy++){
+      /* Give up if the image is no longer needed. */
+      if(lfs_cancelled(work->lfsparms))
+         return;
+      /* Set pixel pointer to start of next row in grid. */
+      pptr = spptr;
+      /* Compute which row of blocks the current pixel is in. */
+      by = (int)(iy/work->blocksize);
+      for(ix = 0; ix < work->bw; ix++){
+
+         /* Compute which block the current pixel is in. */
+         bx = (int)(ix/work->blocksize);
+         /* Get corresponding value in Direction Map. */
+         mapval = *(work->direction_map + (by*work->mw) + bx);
+         /* If current block has has INVALID direction ... */
+         if(mapval == INVALID_DIR)
+            /* Set binary pixel to white (255). */
+            *bptr = WHITE_PIXEL;
+         /* Otherwise, if block has a valid direction ... */
+         else /*if(mapval >= 0)*/
+            /* Use directional binarization based on block's direction. */
+            *bptr = dirbinarize_grid(pptr, dirbingrids->grids[mapval],
+                                dirbingrids->grid_w, dirbingrids->grid_h, cy);
+
+         /* Bump input and output pixel pointers. */
+         pptr++;
+         bptr++;
+      }
+      /* Bump pointer to the next row in padded input image. */
+      spptr += pw;
+   }
+}
+
+static gpointer binarize_rows_thread(gpointer data)
+{
+   binarize_rows_V2((const BINARIZE_WORK *)data);
+   return(NULL);
+}
+
 /*************************************************************************
 **************************************************************************
 #cat: binarize_image_V2 - Takes a grayscale input image and its associated
 #cat:              Direction Map and generates a binarized version of the
 #cat:              image.  Note that there is no "Isotropic" binarization
-#cat:              used in this version.
+#cat:              used in this version.  The image is processed in
+#cat:              horizontal bands, which may be shared between threads.
 
    Input:
       pdata       - padded input grayscale image
@@ -118,60 +301,87 @@ int binarize_V2(unsigned char **odata, int *ow, int *oh,
       blocksize   - dimension (in pixels) of each NMAP block
       dirbingrids - set of rotated grid offsets used for directional
                     binarization
+      lfsparms    - parameters and thresholds for controlling LFS, of
+                    which the number of threads to share the bands
+                    between and the cancel flag are used
    Output:
       odata  - points to binary image results
       ow     - points to binary image width
       oh     - points to binary image height
    Return Code:
       Zero     - successful completion
+      LFS_CANCELLED - lfsparms->cancel was set
       Negative - system error
 **************************************************************************/
 int binarize_image_V2(unsigned char **odata, int *ow, int *oh,
                    unsigned char *pdata, const int pw, const int ph,
                    const int *direction_map, const int mw, const int mh,
-                   const int blocksize, const ROTGRIDS *dirbingrids)
+                   const int blocksize, const ROTGRIDS *dirbingrids,
+                   const LFSPARMS *lfsparms)
 {
-   int ix, iy, bw, bh, bx, by, mapval;
-   unsigned char *bdata, *bptr;
-   unsigned char *pptr, *spptr;
+   int i, bw, bh, nbands;
+   unsigned char *bdata;
+   BINARIZE_WORK *works;
+   GThread **threads;
 
    /* Compute dimensions of "unpadded" binary image results. */
    bw = pw - (dirbingrids->pad<<1);
    bh = ph - (dirbingrids->pad<<1);
 
-   bdata = (unsigned char *)malloc(bw*bh*sizeof(unsigned char));
+   bdata = (unsigned char *)arena_malloc(bw*bh*sizeof(unsigned char));
    if(bdata == (unsigned char *)NULL){
       fprintf(stderr, "ERROR : binarize_image_V2 : malloc : bdata\n");
       return(-600);
    }
 
-   bptr = bdata;
-   spptr = pdata + (dirbingrids->pad * pw) + dirbingrids->pad;
-   for(iy = 0; iy < bh; iy++){
-      /* Set pixel pointer to start of next row in grid. */
-      pptr = spptr;
-      for(ix = 0; ix < bw; ix++){
+   /* One band per thread, split on rows of blocks. */
+   nbands = min(lfsparms->map_threads, mh);
+   nbands = max(nbands, 1);
+   works = (BINARIZE_WORK *)malloc(nbands * sizeof(BINARIZE_WORK));
+   threads = (GThread **)calloc(nbands, sizeof(GThread *));
+   if(works == (BINARIZE_WORK *)NULL || threads == (GThread **)NULL){
+      free(works);
+      free(threads);
+      arena_free(bdata);
+      fprintf(stderr, "ERROR : binarize_image_V2 : malloc : works\n");
+      return(-601);
+   }
 
-         /* Compute which block the current pixel is in. */
-         bx = (int)(ix/blocksize);
-         by = (int)(iy/blocksize);
-         /* Get corresponding value in Direction Map. */
-         mapval = *(direction_map + (by*mw) + bx);
-         /* If current block has has INVALID direction ... */
-         if(mapval == INVALID_DIR)
-            /* Set binary pixel to white (255). */
-            *bptr = WHITE_PIXEL;
-         /* Otherwise, if block has a valid direction ... */
-         else /*if(mapval >= 0)*/
-            /* Use directional binarization based on block's direction. */
-            *bptr = dirbinarize(pptr, mapval, dirbingrids);
+   for(i = 0; i < nbands; i++){
+      works[i].bdata = bdata;
+      works[i].bw = bw;
+      works[i].first_row = min((mh * i / nbands) * blocksize, bh);
+      works[i].last_row = min((mh * (i + 1) / nbands) * blocksize, bh);
+      works[i].pdata = pdata;
+      works[i].pw = pw;
+      works[i].direction_map = direction_map;
+      works[i].mw = mw;
+      works[i].blocksize = blocksize;
+      works[i].dirbingrids = dirbingrids;
+      works[i].lfsparms = lfsparms;
+   }
+   /* The last band takes any rows past the last full row of blocks. */
+   works[nbands - 1].last_row = bh;
 
-         /* Bump input and output pixel pointers. */
-         pptr++;
-         bptr++;
-      }
-      /* Bump pointer to the next row in padded input image. */
-      spptr += pw;
+   /* The calling thread takes the first band, and also takes the */
+   /* bands of threads which couldn't be started.                 */
+   for(i = 1; i < nbands; i++)
+      threads[i] = g_thread_try_new("binarize", binarize_rows_thread,
+                                    &works[i], NULL);
+   binarize_rows_V2(&works[0]);
+   for(i = 1; i < nbands; i++){
+      if(threads[i] != (GThread *)NULL)
+         g_thread_join(threads[i]);
+      else
+         binarize_rows_V2(&works[i]);
+   }
+   free(works);
+   free(threads);
+
+   /* Bands may have been left unfinished. */
+   if(lfs_cancelled(lfsparms)){
+      arena_free(bdata);
+      return(LFS_CANCELLED);
    }
 
    *odata = bdata;
@@ -201,49 +411,7 @@ int binarize_image_V2(unsigned char **odata, int *ow, int *oh,
 int dirbinarize(const unsigned char *pptr, const int idir,
                 const ROTGRIDS *dirbingrids)
 {
-   int gx, gy, gi, cy;
-   int rsum, gsum, csum = 0;
-   int *grid;
-   double dcy;
-
-   /* Assign nickname pointer. */
-   grid = dirbingrids->grids[idir];
-   /* Calculate center (0-oriented) row in grid. */
-   dcy = (dirbingrids->grid_h-1)/(double)2.0;
-   /* Need to truncate precision so that answers are consistent */
-   /* on different computer architectures when rounding doubles. */
-   dcy = trunc_dbl_precision(dcy, TRUNC_SCALE);
-   cy = sround(dcy);
-   /* Initialize grid's pixel offset index to zero. */
-   gi = 0;
-   /* Initialize grid's pixel accumulator to zero */
-   gsum = 0;
-
-   /* Foreach row in grid ... */
-   for(gy = 0; gy < dirbingrids->grid_h; gy++){
-      /* Initialize row pixel sum to zero. */
-      rsum = 0;
-      /* Foreach column in grid ... */
-      for(gx = 0; gx < dirbingrids->grid_w; gx++){
-         /* Accumulate next pixel along rotated row in grid. */
-         rsum += *(pptr+grid[gi]);
-         /* Bump grid's pixel offset index. */
-         gi++;
-      }
-      /* Accumulate row sum into grid pixel sum. */
-      gsum += rsum;
-      /* If current row is center row, then save row sum separately. */
-      if(gy == cy)
-         csum = rsum;
-   }
-
-   /* If the center row sum treated as an average is less than the */
-   /* total pixel sum in the rotated grid ...                      */
-   if((csum * dirbingrids->grid_h) < gsum)
-      /* Set the binary pixel to BLACK. */
-      return(BLACK_PIXEL);
-   else
-      /* Otherwise set the binary pixel to WHITE. */
-      return(WHITE_PIXEL);
+   return(dirbinarize_grid(pptr, dirbingrids->grids[idir],
+                           dirbingrids->grid_w, dirbingrids->grid_h,
+                           grid_center_row(dirbingrids)));
 }
-
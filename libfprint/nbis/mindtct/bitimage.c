@@ -0,0 +1,363 @@
+/***********************************************************************
+      LIBRARY: LFS - NIST Latent Fingerprint System
+
+      FILE:    BITIMAGE.C
+
+      Contains routines handling binary images packed one bit per pixel,
+      BITWORD_BITS pixels to a word.  Pixel x of a row is bit x % BITWORD_BITS
+      of word x / BITWORD_BITS, least significant bit first, and each row
+      starts on a word boundary with its trailing bits cleared.  Whole words
+      of pixels are then processed at once, and a packed image takes an
+      eighth of the memory of an 8-bit one.  Packed images are allocated
+      with arena_malloc() and released with arena_free().
+
+***********************************************************************
+               ROUTINES:
+                        pack_bitimage()
+                        unpack_bitimage()
+                        transpose_bitimage()
+                        fill_holes_bitimage()
+                        erode_bitimage()
+                        dilate_bitimage()
+                        next_bitimage_diff()
+
+***********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lfs.h>
+
+/* Bits at even positions of a word. */
+#define EVEN_BITS   ((BITWORD)0x5555555555555555ULL)
+
+/*************************************************************************
+**************************************************************************
+#cat: pack_bitimage - Packs an 8-bit binary image one bit per pixel.  Pixels
+#cat:            of the specified value are set.
+
+   Input:
+      bdata    - 8-bit binary image
+      iw       - width (in pixels) of the image
+      ih       - height (in pixels) of the image
+      set      - value of the pixels to be set
+   Output:
+      obits    - points to the packed image, BITIMAGE_STRIDE(iw) words
+                 per row
+   Return Code:
+      Zero     - successful completion
+      Negative - system error
+**************************************************************************/
+int pack_bitimage(BITWORD **obits, const unsigned char *bdata,
+                  const int iw, const int ih, const int set)
+{
+   BITWORD *bits, *wptr, word;
+   int ix, iy, stride;
+
+   stride = BITIMAGE_STRIDE(iw);
+   bits = (BITWORD *)arena_malloc(stride * ih * sizeof(BITWORD));
+   if(bits == (BITWORD *)NULL){
+      fprintf(stderr, "ERROR : pack_bitimage : malloc : bits\n");
+      return(-680);
+   }
+
+   wptr = bits;
+   for(iy = 0; iy < ih; iy++){
+      word = 0;
+      for(ix = 0; ix < iw; ix++){
+         if(*bdata++ == set)
+            word |= (BITWORD)1 << (ix % BITWORD_BITS);
+         /* Store each word once it is full, and the last one of the row. */
+         if(ix % BITWORD_BITS == BITWORD_BITS-1 || ix == iw-1){
+            *wptr++ = word;
+            word = 0;
+         }
+      }
+   }
+
+   *obits = bits;
+   return(0);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: unpack_bitimage - Unpacks a binary image packed by pack_bitimage()
+#cat:            into one byte per pixel.
+
+   Input:
+      bits     - packed binary image
+      iw       - width (in pixels) of the image
+      ih       - height (in pixels) of the image
+      set      - value of the pixels which are set
+      unset    - value of the other pixels
+   Output:
+      bdata    - resulting 8-bit image, iw*ih bytes
+**************************************************************************/
+void unpack_bitimage(unsigned char *bdata, const BITWORD *bits,
+                     const int iw, const int ih,
+                     const int set, const int unset)
+{
+   BITWORD word = 0;
+   int ix, iy;
+
+   for(iy = 0; iy < ih; iy++){
+      for(ix = 0; ix < iw; ix++){
+         if(ix % BITWORD_BITS == 0)
+            word = *bits++;
+         *bdata++ = (word & 1) ? set : unset;
+         word >>= 1;
+      }
+   }
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: transpose_bitimage - Transposes a packed binary image, so that its
+#cat:            columns can be scanned a word at a time as rows.
+
+   Input:
+      bits     - packed binary image
+      iw       - width (in pixels) of the image
+      ih       - height (in pixels) of the image
+   Output:
+      obits    - points to the packed transposed image, ih pixels wide
+                 and iw pixels high
+   Return Code:
+      Zero     - successful completion
+      Negative - system error
+**************************************************************************/
+int transpose_bitimage(BITWORD **obits, const BITWORD *bits,
+                       const int iw, const int ih)
+{
+   BITWORD *tbits, word;
+   int i, x, iy, stride, tstride;
+
+   stride = BITIMAGE_STRIDE(iw);
+   tstride = BITIMAGE_STRIDE(ih);
+   tbits = (BITWORD *)arena_calloc(tstride * iw, sizeof(BITWORD));
+   if(tbits == (BITWORD *)NULL){
+      fprintf(stderr, "ERROR : transpose_bitimage : calloc : tbits\n");
+      return(-681);
+   }
+
+   /* Only the set pixels are moved, one at a time. */
+   for(iy = 0; iy < ih; iy++){
+      for(i = 0; i < stride; i++){
+         word = *bits++;
+         while(word){
+            x = (i * BITWORD_BITS) + __builtin_ctzll(word);
+            tbits[(x * tstride) + (iy / BITWORD_BITS)] |=
+                                  (BITWORD)1 << (iy % BITWORD_BITS);
+            /* Clear the lowest set bit. */
+            word &= word - 1;
+         }
+      }
+   }
+
+   *obits = tbits;
+   return(0);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: fill_holes_bitimage - Takes a packed binary image and analyzes
+#cat:            triplets of horizontal pixels first and then triplets of
+#cat:            vertical pixels, filling in holes of width 1.  A hole is
+#cat:            defined as the case where the neighboring 2 pixels are
+#cat:            equal, AND the center pixel is different.  Each hole is
+#cat:            filled with the value of its immediate neighbors. This
+#cat:            routine modifies the input image.
+
+   The image is scanned as pixel by pixel LFS does: once a hole is filled,
+   the next pixel of the run is never taken for a hole.  Neighbors are thus
+   always looked at before they are filled, so the holes of a whole word
+   are found from the pixels as they were, keeping every other hole of
+   the runs of consecutive holes.
+
+   Input:
+      bits  - packed binary image to be processed
+      iw    - width (in pixels) of the binary input image
+      ih    - height (in pixels) of the binary input image
+   Output:
+      bits  - points to the results
+**************************************************************************/
+void fill_holes_bitimage(BITWORD *bits, const int iw, const int ih)
+{
+   BITWORD *row, *col;
+   BITWORD prev, left, mid, right, valid, holes, starts, even_runs, fills;
+   BITWORD carry_hole, carry_fill, skips;
+   int i, iy, stride, last;
+
+   stride = BITIMAGE_STRIDE(iw);
+   last = stride - 1;
+
+   /* 1. Fill 1-pixel wide holes in horizontal runs first ... */
+   for(iy = 0, row = bits; iw >= 3 && iy < ih; iy++, row += stride){
+      /* Previous word as it was, whether its last pixel was a hole, */
+      /* and whether that hole got filled.                           */
+      prev = 0;
+      carry_hole = 0;
+      carry_fill = 0;
+      for(i = 0; i < stride; i++){
+         mid = row[i];
+         left = (mid << 1) | (prev >> (BITWORD_BITS-1));
+         right = (mid >> 1) |
+                 (i < last ? row[i+1] << (BITWORD_BITS-1) : 0);
+
+         /* The far left and right pixels are left alone. */
+         valid = ~(BITWORD)0;
+         if(i == 0)
+            valid &= ~(BITWORD)1;
+         if(i == last)
+            valid &= ((BITWORD)1 << ((iw-1) % BITWORD_BITS)) - 1;
+
+         holes = (left ^ mid) & ~(left ^ right) & valid;
+
+         /* Runs of holes starting at an even position get their even */
+         /* holes filled, the others their odd holes.  A run carried  */
+         /* over from the previous word is even if the last pixel of  */
+         /* that word, at an odd position, was not filled.            */
+         starts = holes & ~((holes << 1) | carry_hole);
+         if((holes & 1) && carry_hole && !carry_fill)
+            starts |= 1;
+         /* Adding the start of a run carries through the whole run. */
+         even_runs = holes & ~(holes + (starts & EVEN_BITS));
+         fills = (even_runs & EVEN_BITS) | (holes & ~even_runs & ~EVEN_BITS);
+
+         prev = mid;
+         carry_hole = holes >> (BITWORD_BITS-1);
+         carry_fill = fills >> (BITWORD_BITS-1);
+         row[i] = mid ^ fills;
+      }
+   }
+
+   /* 2. Now, fill 1-pixel wide holes in vertical runs, a word of */
+   /*    columns at a time.                                       */
+   for(i = 0; i < stride; i++){
+      /* Columns whose pixel above was filled. */
+      skips = 0;
+      for(iy = 1, col = bits + stride + i; iy < ih-1; iy++, col += stride){
+         fills = (col[-stride] ^ col[0]) & ~(col[-stride] ^ col[stride]) &
+                 ~skips;
+         col[0] ^= fills;
+         skips = fills;
+      }
+   }
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: erode_bitimage - Erodes a packed binary image by clearing set pixels
+#cat:             if any of their 4 neighbors is clear, as
+#cat:             erode_charimage_2() does.  Neighbors outside of the image
+#cat:             count as set.  The input image remains unchanged.
+
+   Input:
+      inp       - packed binary image to be eroded
+      iw        - width (in pixels) of image
+      ih        - height (in pixels) of image
+   Output:
+      out       - contains the resulting eroded image
+**************************************************************************/
+void erode_bitimage(BITWORD *inp, BITWORD *out, const int iw, const int ih)
+{
+   BITWORD *iptr, *optr, word, west, east, north, south;
+   int i, iy, stride, last;
+
+   stride = BITIMAGE_STRIDE(iw);
+   last = stride - 1;
+
+   for(iy = 0, iptr = inp, optr = out; iy < ih;
+       iy++, iptr += stride, optr += stride){
+      for(i = 0; i < stride; i++){
+         word = iptr[i];
+         west = (word << 1) |
+                (i > 0 ? iptr[i-1] >> (BITWORD_BITS-1) : 1);
+         east = (word >> 1);
+         if(i < last)
+            east |= iptr[i+1] << (BITWORD_BITS-1);
+         else
+            east |= (BITWORD)1 << ((iw-1) % BITWORD_BITS);
+         north = (iy > 0 ? iptr[i-stride] : ~(BITWORD)0);
+         south = (iy < ih-1 ? iptr[i+stride] : ~(BITWORD)0);
+         /* The trailing bits are clear in the input word. */
+         optr[i] = word & west & east & north & south;
+      }
+   }
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: dilate_bitimage - Dilates a packed binary image by setting clear
+#cat:             pixels if any of their 4 neighbors is set, as
+#cat:             dilate_charimage_2() does.  Neighbors outside of the
+#cat:             image count as clear.  The input image remains unchanged.
+
+   Input:
+      inp       - packed binary image to be dilated
+      iw        - width (in pixels) of image
+      ih        - height (in pixels) of image
+   Output:
+      out       - contains the resulting dilated image
+**************************************************************************/
+void dilate_bitimage(BITWORD *inp, BITWORD *out, const int iw, const int ih)
+{
+   BITWORD *iptr, *optr, word, west, east, north, south, mask;
+   int i, iy, stride, last;
+
+   stride = BITIMAGE_STRIDE(iw);
+   last = stride - 1;
+   /* Keeps the trailing bits of the last word of a row clear. */
+   mask = ~(BITWORD)0 >> ((stride * BITWORD_BITS) - iw);
+
+   for(iy = 0, iptr = inp, optr = out; iy < ih;
+       iy++, iptr += stride, optr += stride){
+      for(i = 0; i < stride; i++){
+         word = iptr[i];
+         west = (word << 1) |
+                (i > 0 ? iptr[i-1] >> (BITWORD_BITS-1) : 0);
+         east = (word >> 1) |
+                (i < last ? iptr[i+1] << (BITWORD_BITS-1) : 0);
+         north = (iy > 0 ? iptr[i-stride] : 0);
+         south = (iy < ih-1 ? iptr[i+stride] : 0);
+         word |= west | east | north | south;
+         optr[i] = (i < last ? word : word & mask);
+      }
+   }
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: next_bitimage_diff - Returns the first position, from the one
+#cat:            specified on, where two rows of packed binary images
+#cat:            differ.  A whole word of pixel pairs is compared at once.
+
+   Input:
+      row1     - first packed row
+      row2     - second packed row
+      x        - position the search starts from
+      iw       - width (in pixels) of the rows
+   Return Code:
+      Position - first position at or after x where the rows differ, or
+                 iw if there is none
+**************************************************************************/
+int next_bitimage_diff(const BITWORD *row1, const BITWORD *row2,
+                       const int x, const int iw)
+{
+   BITWORD word;
+   int i, stride;
+
+   if(x >= iw)
+      return(iw);
+
+   stride = BITIMAGE_STRIDE(iw);
+   i = x / BITWORD_BITS;
+   word = (row1[i] ^ row2[i]) & (~(BITWORD)0 << (x % BITWORD_BITS));
+   while(!word){
+      if(++i >= stride)
+         return(iw);
+      word = row1[i] ^ row2[i];
+   }
+
+   return((i * BITWORD_BITS) + __builtin_ctzll(word));
+}
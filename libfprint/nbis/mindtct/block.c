@@ -115,7 +115,7 @@ int block_offsets(int **optr, int *ow, int *oh,
    lastbh = bh - 1;
 
    /* Allocate list of block offsets */
-   blkoffs = (int *)malloc(bsize * sizeof(int));
+   blkoffs = (int *)arena_malloc(bsize * sizeof(int));
    if(blkoffs == (int *)NULL){
       fprintf(stderr, "ERROR : block_offsets : malloc : blkoffs\n");
       return(-81);
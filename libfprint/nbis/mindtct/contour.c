@@ -38,9 +38,12 @@ identified are necessarily the best available for the purpose.
                ROUTINES:
                         allocate_contour()
                         free_contour()
+                        free_contour_pool()
                         get_high_curvature_contour()
                         get_centered_contour()
+                        follow_contour()
                         trace_contour()
+                        walk_contour()
                         search_contour()
                         next_contour_pixel()
                         start_scan_nbr()
@@ -51,8 +54,36 @@ identified are necessarily the best available for the purpose.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <glib.h>
 #include <lfs.h>
 
+/* Contours are traced thousands of times per image, and most of them are */
+/* released right away.  Each thread keeps the blocks of a few released   */
+/* contours, so that tracing doesn't go through malloc() every time.      */
+#define CONTOUR_POOL_SIZE        8
+/* Minimum length of the coordinate lists of a block. */
+#define MIN_CONTOUR_CAPACITY     64
+/* A block starts with its capacity, padded to keep the lists aligned. */
+#define CONTOUR_BLOCK_HEADER     2
+#define CONTOUR_BLOCK_CAPACITY(block)   ((block)[0])
+
+typedef struct contour_pool{
+   int nblocks;
+   int *blocks[CONTOUR_POOL_SIZE];
+} CONTOUR_POOL;
+
+static void destroy_contour_pool(gpointer data)
+{
+   CONTOUR_POOL *pool = (CONTOUR_POOL *)data;
+   int i;
+
+   for(i = 0; i < pool->nblocks; i++)
+      free(pool->blocks[i]);
+   free(pool);
+}
+
+static GPrivate contour_pool = G_PRIVATE_INIT(destroy_contour_pool);
+
 /*************************************************************************
 **************************************************************************
 #cat: allocate_contour - Allocates the lists needed to represent the
@@ -85,54 +116,40 @@ identified are necessarily the best available for the purpose.
 int allocate_contour(int **ocontour_x, int **ocontour_y,
                      int **ocontour_ex, int **ocontour_ey, const int ncontour)
 {
-   int *contour_x, *contour_y, *contour_ex, *contour_ey;
-
-   /* Allocate contour's x-coord list. */
-   contour_x = (int *)malloc(ncontour*sizeof(int));
-   /* If allocation error... */
-   if(contour_x == (int *)NULL){
-      fprintf(stderr, "ERROR : allocate_contour : malloc : contour_x\n");
-      return(-180);
-   }
-
-   /* Allocate contour's y-coord list. */
-   contour_y = (int *)malloc(ncontour*sizeof(int));
-   /* If allocation error... */
-   if(contour_y == (int *)NULL){
-      /* Deallocate memory allocated to this point in this routine. */
-      free(contour_x);
-      fprintf(stderr, "ERROR : allocate_contour : malloc : contour_y\n");
-      return(-181);
-   }
-
-   /* Allocate contour's edge x-coord list. */
-   contour_ex = (int *)malloc(ncontour*sizeof(int));
-   /* If allocation error... */
-   if(contour_ex == (int *)NULL){
-      /* Deallocate memory allocated to this point in this routine. */
-      free(contour_x);
-      free(contour_y);
-      fprintf(stderr, "ERROR : allocate_contour : malloc : contour_ex\n");
-      return(-182);
+   CONTOUR_POOL *pool = (CONTOUR_POOL *)g_private_get(&contour_pool);
+   int *block = (int *)NULL;
+   int i, capacity;
+
+   /* Reuse a block released by this thread, if one is large enough. */
+   if(pool != (CONTOUR_POOL *)NULL){
+      for(i = pool->nblocks-1; i >= 0; i--){
+         if(CONTOUR_BLOCK_CAPACITY(pool->blocks[i]) >= ncontour){
+            block = pool->blocks[i];
+            pool->blocks[i] = pool->blocks[--pool->nblocks];
+            break;
+         }
+      }
    }
 
-   /* Allocate contour's edge y-coord list. */
-   contour_ey = (int *)malloc(ncontour*sizeof(int));
-   /* If allocation error... */
-   if(contour_ey == (int *)NULL){
-      /* Deallocate memory allocated to this point in this routine. */
-      free(contour_x);
-      free(contour_y);
-      free(contour_ex);
-      fprintf(stderr, "ERROR : allocate_contour : malloc : contour_ey\n");
-      return(-183);
+   if(block == (int *)NULL){
+      /* Allocate the four coordinate lists as one block, rounding  */
+      /* small contours up so that the block suits most later ones. */
+      capacity = max(ncontour, MIN_CONTOUR_CAPACITY);
+      block = (int *)malloc((CONTOUR_BLOCK_HEADER + 4*capacity)*sizeof(int));
+      /* If allocation error... */
+      if(block == (int *)NULL){
+         fprintf(stderr, "ERROR : allocate_contour : malloc : contour_x\n");
+         return(-180);
+      }
+      CONTOUR_BLOCK_CAPACITY(block) = capacity;
    }
+   capacity = CONTOUR_BLOCK_CAPACITY(block);
 
-   /* Otherwise, allocations successful, so assign output pointers. */
-   *ocontour_x = contour_x;
-   *ocontour_y = contour_y;
-   *ocontour_ex = contour_ex;
-   *ocontour_ey = contour_ey;
+   /* Assign output pointers. */
+   *ocontour_x = block + CONTOUR_BLOCK_HEADER;
+   *ocontour_y = *ocontour_x + capacity;
+   *ocontour_ex = *ocontour_x + 2*capacity;
+   *ocontour_ey = *ocontour_x + 3*capacity;
 
    /* Return normally. */
    return(0);
@@ -159,10 +176,31 @@ int allocate_contour(int **ocontour_x, int **ocontour_y,
 void free_contour(int *contour_x, int *contour_y,
                   int *contour_ex, int *contour_ey)
 {
-   free(contour_x);
-   free(contour_y);
-   free(contour_ex);
-   free(contour_ey);
+   CONTOUR_POOL *pool = (CONTOUR_POOL *)g_private_get(&contour_pool);
+   /* All four lists are part of the block holding contour_x. */
+   int *block = contour_x - CONTOUR_BLOCK_HEADER;
+
+   /* Keep the block for the next contours of this thread. */
+   if(pool == (CONTOUR_POOL *)NULL){
+      pool = (CONTOUR_POOL *)calloc(1, sizeof(CONTOUR_POOL));
+      if(pool != (CONTOUR_POOL *)NULL)
+         g_private_set(&contour_pool, pool);
+   }
+   if(pool != (CONTOUR_POOL *)NULL && pool->nblocks < CONTOUR_POOL_SIZE)
+      pool->blocks[pool->nblocks++] = block;
+   else
+      free(block);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: free_contour_pool - Deallocates the contour blocks kept for reuse by
+#cat:            the calling thread.  Other threads release theirs when
+#cat:            exiting.
+**************************************************************************/
+void free_contour_pool(void)
+{
+   g_private_replace(&contour_pool, NULL);
 }
 
 /*************************************************************************
@@ -823,70 +861,37 @@ static int next_contour_pixel(int *next_x_loc, int *next_y_loc,
 
 /*************************************************************************
 **************************************************************************
-#cat: trace_contour - Takes the pixel coordinate of a detected minutia
-#cat:            feature point and its corresponding/adjacent edge pixel
-#cat:            and extracts a contour (up to a specified maximum length)
-#cat:            of the feature's edge in either a clockwise or counter-
-#cat:            clockwise direction.  A second point is specified, such that
-#cat:            if this point is encounted while extracting the contour,
-#cat:            it is to be assumed that a loop has been found and a code
-#cat:            of (LOOP_FOUND) is returned with the contour. By independently
-#cat:            specifying this point, successive calls can be made to
-#cat:            this routine from the same starting point, and loops across
-#cat:            successive calls can be detected.
+#cat: follow_contour - Collects up to a maximum number of contour points of
+#cat:            a minutia feature for trace_contour() and walk_contour().
+#cat:            The points are stored in the given lists, which must hold
+#cat:            at least max_len points, unless the lists are NULL.
 
    Input:
-      max_len - maximum length of contour to be extracted
-      x_loop  - x-pixel coord of point, if encountered, triggers LOOP_FOUND
-      y_loop  - y-pixel coord of point, if encountered, triggers LOOP_FOUND
-      x_loc   - starting x-pixel coord of feature (interior to feature)
-      y_loc   - starting y-pixel coord of feature (interior to feature)
-      x_edge  - x-pixel coord of corresponding edge pixel (exterior to feature)
-      y_edge  - y-pixel coord of corresponding edge pixel (exterior to feature)
-      scan_clock - direction in which neighboring pixels are to be scanned
-                for the next contour pixel
-      bdata  - binary image data (0==while & 1==black)
-      iw     - width (in pixels) of image
-      ih     - height (in pixels) of image
+      contour_x  - x-pixel coords of contour (interior to feature), or NULL
+      contour_y  - y-pixel coords of contour (interior to feature), or NULL
+      contour_ex - x-pixel coords of corresponding edge, or NULL
+      contour_ey - y-pixel coords of corresponding edge, or NULL
+      the other inputs are those of trace_contour()
    Output:
-      ocontour_x  - x-pixel coords of contour (interior to feature)
-      ocontour_y  - y-pixel coords of contour (interior to feature)
-      ocontour_ex - x-pixel coords of corresponding edge (exterior to feature)
-      ocontour_ey - y-pixel coords of corresponding edge (exterior to feature)
-      oncontour   - number of contour points returned
+      oncontour  - number of contour points collected
    Return Code:
-      Zero       - resulting contour was successfully allocated and extracted
-      LOOP_FOUND - resulting contour forms a complete loop
-      IGNORE     - trace is not possible due to state of inputs
-      Negative   - system error
+      Zero       - contour was successfully extracted
+      LOOP_FOUND - contour forms a complete loop
 **************************************************************************/
-int trace_contour(int **ocontour_x, int **ocontour_y,
-                  int **ocontour_ex, int **ocontour_ey, int *oncontour,
+static int follow_contour(int *contour_x, int *contour_y,
+                  int *contour_ex, int *contour_ey, int *oncontour,
                   const int max_len, const int x_loop, const int y_loop,
                   const int x_loc, const int y_loc,
                   const int x_edge, const int y_edge,
                   const int scan_clock,
                   unsigned char *bdata, const int iw, const int ih)
 {
-   int *contour_x, *contour_y, *contour_ex, *contour_ey, ncontour;
+   int ncontour;
    int cur_x_loc, cur_y_loc;
    int cur_x_edge, cur_y_edge;
    int next_x_loc, next_y_loc;
    int next_x_edge, next_y_edge;
-   int i, ret;
-
-   /* Check to make sure that the feature and edge values are opposite. */
-   if(*(bdata+(y_loc*iw)+x_loc) ==
-      *(bdata+(y_edge*iw)+x_edge))
-      /* If not opposite, then the trace will not work, so return IGNORE. */
-      return(IGNORE);
-
-   /* Allocate contour buffers. */
-   if((ret = allocate_contour(&contour_x, &contour_y,
-                     &contour_ex, &contour_ey, max_len))){
-      /* If allocation error, return code. */
-      return(ret);
-   }
+   int i;
 
    /* Set pixel counter to 0. */
    ncontour = 0;
@@ -911,20 +916,18 @@ int trace_contour(int **ocontour_x, int **ocontour_y,
          if((next_x_loc == x_loop) && (next_y_loc == y_loop)){
             /* Then we have found a loop, so return what we */
             /* have traced to this point.                   */
-            *ocontour_x = contour_x;
-            *ocontour_y = contour_y;
-            *ocontour_ex = contour_ex;
-            *ocontour_ey = contour_ey;
             *oncontour = ncontour;
             return(LOOP_FOUND);
          }
 
          /* Otherwise, we found another point on our feature's contour, */
          /* so store the new contour point.                             */
-         contour_x[i] = next_x_loc;
-         contour_y[i] = next_y_loc;
-         contour_ex[i] = next_x_edge;
-         contour_ey[i] = next_y_edge;
+         if(contour_x != (int *)NULL){
+            contour_x[i] = next_x_loc;
+            contour_y[i] = next_y_loc;
+            contour_ex[i] = next_x_edge;
+            contour_ey[i] = next_y_edge;
+         }
          /* Bump the number of points stored. */
          ncontour++;
 
@@ -938,10 +941,6 @@ int trace_contour(int **ocontour_x, int **ocontour_y,
       else{
          /* So, stop short and return the number of pixels found */
          /* on the contour to this point.                        */
-         *ocontour_x = contour_x;
-         *ocontour_y = contour_y;
-         *ocontour_ex = contour_ex;
-         *ocontour_ey = contour_ey;
          *oncontour = ncontour;
 
          /* Return normally. */
@@ -949,17 +948,135 @@ int trace_contour(int **ocontour_x, int **ocontour_y,
       }
    }
 
-   /* If we get here, we successfully found the maximum points we    */
-   /* were looking for on the feature contour, so assign the contour */
-   /* buffers to the output pointers and return.                     */
+   /* If we get here, we successfully found the maximum points we */
+   /* were looking for on the feature contour.                    */
+   *oncontour = ncontour;
+
+   /* Return normally. */
+   return(0);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: trace_contour - Takes the pixel coordinate of a detected minutia
+#cat:            feature point and its corresponding/adjacent edge pixel
+#cat:            and extracts a contour (up to a specified maximum length)
+#cat:            of the feature's edge in either a clockwise or counter-
+#cat:            clockwise direction.  A second point is specified, such that
+#cat:            if this point is encounted while extracting the contour,
+#cat:            it is to be assumed that a loop has been found and a code
+#cat:            of (LOOP_FOUND) is returned with the contour. By independently
+#cat:            specifying this point, successive calls can be made to
+#cat:            this routine from the same starting point, and loops across
+#cat:            successive calls can be detected.
+
+   Input:
+      max_len - maximum length of contour to be extracted
+      x_loop  - x-pixel coord of point, if encountered, triggers LOOP_FOUND
+      y_loop  - y-pixel coord of point, if encountered, triggers LOOP_FOUND
+      x_loc   - starting x-pixel coord of feature (interior to feature)
+      y_loc   - starting y-pixel coord of feature (interior to feature)
+      x_edge  - x-pixel coord of corresponding edge pixel (exterior to feature)
+      y_edge  - y-pixel coord of corresponding edge pixel (exterior to feature)
+      scan_clock - direction in which neighboring pixels are to be scanned
+                for the next contour pixel
+      bdata  - binary image data (0==while & 1==black)
+      iw     - width (in pixels) of image
+      ih     - height (in pixels) of image
+   Output:
+      ocontour_x  - x-pixel coords of contour (interior to feature)
+      ocontour_y  - y-pixel coords of contour (interior to feature)
+      ocontour_ex - x-pixel coords of corresponding edge (exterior to feature)
+      ocontour_ey - y-pixel coords of corresponding edge (exterior to feature)
+      oncontour   - number of contour points returned
+   Return Code:
+      Zero       - resulting contour was successfully allocated and extracted
+      LOOP_FOUND - resulting contour forms a complete loop
+      IGNORE     - trace is not possible due to state of inputs
+      Negative   - system error
+**************************************************************************/
+int trace_contour(int **ocontour_x, int **ocontour_y,
+                  int **ocontour_ex, int **ocontour_ey, int *oncontour,
+                  const int max_len, const int x_loop, const int y_loop,
+                  const int x_loc, const int y_loc,
+                  const int x_edge, const int y_edge,
+                  const int scan_clock,
+                  unsigned char *bdata, const int iw, const int ih)
+{
+   int *contour_x, *contour_y, *contour_ex, *contour_ey;
+   int ret;
+
+   /* Check to make sure that the feature and edge values are opposite. */
+   if(*(bdata+(y_loc*iw)+x_loc) ==
+      *(bdata+(y_edge*iw)+x_edge))
+      /* If not opposite, then the trace will not work, so return IGNORE. */
+      return(IGNORE);
+
+   /* Allocate contour buffers. */
+   if((ret = allocate_contour(&contour_x, &contour_y,
+                     &contour_ex, &contour_ey, max_len))){
+      /* If allocation error, return code. */
+      return(ret);
+   }
+
+   ret = follow_contour(contour_x, contour_y, contour_ex, contour_ey,
+                        oncontour, max_len, x_loop, y_loop,
+                        x_loc, y_loc, x_edge, y_edge, scan_clock,
+                        bdata, iw, ih);
+
+   /* Assign the contour buffers to the output pointers, whether a */
+   /* loop was found or not.                                       */
    *ocontour_x = contour_x;
    *ocontour_y = contour_y;
    *ocontour_ex = contour_ex;
    *ocontour_ey = contour_ey;
-   *oncontour = ncontour;
+   return(ret);
+}
 
-   /* Return normally. */
-   return(0);
+/*************************************************************************
+**************************************************************************
+#cat: walk_contour - Follows the contour of a minutia feature just as
+#cat:            trace_contour() does, but without storing the contour
+#cat:            points, for callers only interested in whether a loop
+#cat:            is found or in the contour's length.
+
+   Input:
+      max_len - maximum number of contour points to be walked
+      x_loop  - x-pixel coord of point, if encountered, triggers LOOP_FOUND
+      y_loop  - y-pixel coord of point, if encountered, triggers LOOP_FOUND
+      x_loc   - starting x-pixel coord of feature (interior to feature)
+      y_loc   - starting y-pixel coord of feature (interior to feature)
+      x_edge  - x-pixel coord of corresponding edge pixel (exterior to feature)
+      y_edge  - y-pixel coord of corresponding edge pixel (exterior to feature)
+      scan_clock - direction in which neighboring pixels are to be scanned
+                for the next contour pixel
+      bdata  - binary image data (0==while & 1==black)
+      iw     - width (in pixels) of image
+      ih     - height (in pixels) of image
+   Output:
+      oncontour   - number of contour points walked
+   Return Code:
+      Zero       - contour was successfully walked
+      LOOP_FOUND - contour forms a complete loop
+      IGNORE     - walk is not possible due to state of inputs
+**************************************************************************/
+int walk_contour(int *oncontour, const int max_len,
+                 const int x_loop, const int y_loop,
+                 const int x_loc, const int y_loc,
+                 const int x_edge, const int y_edge,
+                 const int scan_clock,
+                 unsigned char *bdata, const int iw, const int ih)
+{
+   /* Check to make sure that the feature and edge values are opposite. */
+   if(*(bdata+(y_loc*iw)+x_loc) ==
+      *(bdata+(y_edge*iw)+x_edge))
+      /* If not opposite, then the walk will not work, so return IGNORE. */
+      return(IGNORE);
+
+   return(follow_contour((int *)NULL, (int *)NULL, (int *)NULL, (int *)NULL,
+                         oncontour, max_len, x_loop, y_loop,
+                         x_loc, y_loc, x_edge, y_edge, scan_clock,
+                         bdata, iw, ih));
 }
 
 /*************************************************************************
@@ -35,7 +35,11 @@ identified are necessarily the best available for the purpose.
 
 ***********************************************************************
                ROUTINES:
+                        init_lfstables()
+                        free_lfstables()
                         lfs_detect_minutiae_V2()
+                        detach_minutiae()
+                        pass_map()
                         get_minutiae()
 
 ***********************************************************************/
@@ -45,6 +49,106 @@ identified are necessarily the best available for the purpose.
 #include <lfs.h>
 #include <log.h>
 
+/*************************************************************************
+**************************************************************************
+#cat: init_lfstables - Allocates and initializes the lookup tables used
+#cat:          to detect minutiae in images of a given size.  The
+#cat:          tables suit any image of the same width.
+
+   Input:
+      iw        - width (in pixels) of the images
+      ih        - height (in pixels) of the images
+      lfsparms  - parameters and thresholds for controlling LFS
+   Output:
+      olfstables - points to the created tables
+   Return Code:
+      Zero      - successful completion
+      Negative  - system error
+**************************************************************************/
+int init_lfstables(LFSTABLES **olfstables, const int iw, const int ih,
+                   const LFSPARMS *lfsparms)
+{
+   LFSTABLES *lfstables;
+   int ret;
+
+   lfstables = (LFSTABLES *)calloc(1, sizeof(LFSTABLES));
+   if(lfstables == (LFSTABLES *)NULL){
+      fprintf(stderr, "ERROR : init_lfstables : calloc : lfstables\n");
+      return(-582);
+   }
+   lfstables->iw = iw;
+   lfstables->ih = ih;
+
+   /* Determine the maximum amount of image padding required to support */
+   /* LFS processes.                                                    */
+   lfstables->maxpad = get_max_padding_V2(lfsparms->windowsize,
+                          lfsparms->windowoffset,
+                          lfsparms->dirbin_grid_w, lfsparms->dirbin_grid_h);
+
+   /* Initialize lookup table for converting integer directions */
+   /* to angles in radians.                                     */
+   if((ret = init_dir2rad(&(lfstables->dir2rad),
+                          lfsparms->num_directions))){
+      free_lfstables(lfstables);
+      return(ret);
+   }
+
+   /* Initialize wave form lookup tables for DFT analyses. */
+   /* used for direction binarization.                             */
+   if((ret = init_dftwaves(&(lfstables->dftwaves), g_dft_coefs,
+                        lfsparms->num_dft_waves, lfsparms->windowsize))){
+      free_lfstables(lfstables);
+      return(ret);
+   }
+
+   /* Initialize lookup table for pixel offsets to rotated grids */
+   /* used for DFT analyses.                                     */
+   if((ret = init_rotgrids(&(lfstables->dftgrids), iw, ih, lfstables->maxpad,
+                        lfsparms->start_dir_angle, lfsparms->num_directions,
+                        lfsparms->windowsize, lfsparms->windowsize,
+                        RELATIVE2ORIGIN))){
+      free_lfstables(lfstables);
+      return(ret);
+   }
+
+   /* Initialize lookup table for pixel offsets to rotated grids */
+   /* used for directional binarization.                         */
+   if((ret = init_rotgrids(&(lfstables->dirbingrids), iw, ih,
+                        lfstables->maxpad,
+                        lfsparms->start_dir_angle, lfsparms->num_directions,
+                        lfsparms->dirbin_grid_w, lfsparms->dirbin_grid_h,
+                        RELATIVE2CENTER))){
+      free_lfstables(lfstables);
+      return(ret);
+   }
+
+   *olfstables = lfstables;
+   return(0);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: free_lfstables - Deallocates tables created by init_lfstables().
+
+   Input:
+      lfstables - the tables to free, may be NULL
+**************************************************************************/
+void free_lfstables(LFSTABLES *lfstables)
+{
+   if(lfstables == (LFSTABLES *)NULL)
+      return;
+
+   if(lfstables->dir2rad != (DIR2RAD *)NULL)
+      free_dir2rad(lfstables->dir2rad);
+   if(lfstables->dftwaves != (DFTWAVES *)NULL)
+      free_dftwaves(lfstables->dftwaves);
+   if(lfstables->dftgrids != (ROTGRIDS *)NULL)
+      free_rotgrids(lfstables->dftgrids);
+   if(lfstables->dirbingrids != (ROTGRIDS *)NULL)
+      free_rotgrids(lfstables->dirbingrids);
+   free(lfstables);
+}
+
 /*************************************************************************
 #cat: lfs_detect_minutiae_V2 - Takes a grayscale fingerprint image (of
 #cat:          arbitrary size), and returns a set of image block maps,
@@ -60,6 +164,10 @@ identified are necessarily the best available for the purpose.
       iw        - width (in pixels) of the image
       ih        - height (in pixels) of the image
       lfsparms  - parameters and thresholds for controlling LFS
+      lfstables - lookup tables from init_lfstables() for images of this
+                  size, or NULL to create them just for this image
+      keep_bdata - TRUE if the binarized image is passed back to the
+                  caller, so that it must not come from the memory arena
 
    Output:
       ominutiae - resulting list of minutiae
@@ -73,8 +181,9 @@ identified are necessarily the best available for the purpose.
                   {high curvature (TRUE), low curvature (FALSE)}
       omw       - width (in blocks) of image maps
       omh       - height (in blocks) of image maps
-      obdata    - resulting binarized image
-                  {0 = black pixel (ridge) and 255 = white pixel (valley)}
+      obits     - resulting binarized image, packed one bit per pixel
+                  {set = black pixel (ridge), clear = white pixel (valley)}
+                  if keep_bdata is TRUE
       obw       - width (in pixels) of the binary image
       obh       - height (in pixels) of the binary image
    Return Code:
@@ -84,16 +193,16 @@ identified are necessarily the best available for the purpose.
 static int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
                         int **odmap, int **olcmap, int **olfmap, int **ohcmap,
                         int *omw, int *omh,
-                        unsigned char **obdata, int *obw, int *obh,
+                        BITWORD **obits, int *obw, int *obh,
                         unsigned char *idata, const int iw, const int ih,
-                        const LFSPARMS *lfsparms)
+                        const LFSPARMS *lfsparms, const LFSTABLES *lfstables,
+                        const int keep_bdata)
 {
+   LFSARENA *lfsarena;
    unsigned char *pdata, *bdata;
+   BITWORD *bits, *kept_bits = (BITWORD *)NULL;
    int pw, ph, bw, bh;
-   DIR2RAD *dir2rad;
-   DFTWAVES *dftwaves;
-   ROTGRIDS *dftgrids;
-   ROTGRIDS *dirbingrids;
+   LFSTABLES *own_lfstables = (LFSTABLES *)NULL;
    int *direction_map, *low_contrast_map, *low_flow_map, *high_curve_map;
    int mw, mh;
    int ret, maxpad;
@@ -108,58 +217,35 @@ static int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
       /* If system error, exit with error code. */
       return(ret);
 
-   /* Determine the maximum amount of image padding required to support */
-   /* LFS processes.                                                    */
-   maxpad = get_max_padding_V2(lfsparms->windowsize, lfsparms->windowoffset,
-                          lfsparms->dirbin_grid_w, lfsparms->dirbin_grid_h);
-
-   /* Initialize lookup table for converting integer directions */
-   /* to angles in radians.                                     */
-   if((ret = init_dir2rad(&dir2rad, lfsparms->num_directions))){
-      /* Free memory allocated to this point. */
-      return(ret);
-   }
-
-   /* Initialize wave form lookup tables for DFT analyses. */
-   /* used for direction binarization.                             */
-   if((ret = init_dftwaves(&dftwaves, g_dft_coefs, lfsparms->num_dft_waves,
-                        lfsparms->windowsize))){
-      /* Free memory allocated to this point. */
-      free_dir2rad(dir2rad);
-      return(ret);
+   /* Create the lookup tables if the caller has none for this size. */
+   if(lfstables == (LFSTABLES *)NULL){
+      if((ret = init_lfstables(&own_lfstables, iw, ih, lfsparms)))
+         return(ret);
+      lfstables = own_lfstables;
    }
-
-   /* Initialize lookup table for pixel offsets to rotated grids */
-   /* used for DFT analyses.                                     */
-   if((ret = init_rotgrids(&dftgrids, iw, ih, maxpad,
-                        lfsparms->start_dir_angle, lfsparms->num_directions,
-                        lfsparms->windowsize, lfsparms->windowsize,
-                        RELATIVE2ORIGIN))){
-      /* Free memory allocated to this point. */
-      free_dir2rad(dir2rad);
-      free_dftwaves(dftwaves);
-      return(ret);
+   else if(lfstables->iw != iw){
+      fprintf(stderr, "ERROR : lfs_detect_minutiae_V2 :");
+      fprintf(stderr, "tables are for %d pixel wide images, not %d\n",
+              lfstables->iw, iw);
+      return(-583);
    }
+   maxpad = lfstables->maxpad;
 
    /* Pad input image based on max padding. */
    if(maxpad > 0){   /* May not need to pad at all */
       if((ret = pad_uchar_image(&pdata, &pw, &ph, idata, iw, ih,
                              maxpad, lfsparms->pad_value))){
          /* Free memory allocated to this point. */
-         free_dir2rad(dir2rad);
-         free_dftwaves(dftwaves);
-         free_rotgrids(dftgrids);
+         free_lfstables(own_lfstables);
          return(ret);
       }
    }
    else{
       /* If padding is unnecessary, then copy the input image. */
-      pdata = (unsigned char *)malloc(iw*ih);
+      pdata = (unsigned char *)arena_malloc(iw*ih);
       if(pdata == (unsigned char *)NULL){
          /* Free memory allocated to this point. */
-         free_dir2rad(dir2rad);
-         free_dftwaves(dftwaves);
-         free_rotgrids(dftgrids);
+         free_lfstables(own_lfstables);
          fprintf(stderr, "ERROR : lfs_detect_minutiae_V2 : malloc : pdata\n");
          return(-580);
       }
@@ -177,6 +263,7 @@ static int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
    bits_8to6(pdata, pw, ph);
 
    print2log("\nINITIALIZATION AND PADDING DONE\n");
+   lfs_stage_done(lfsparms, LFS_STAGE_INIT);
 
    /******************/
    /*      MAPS      */
@@ -185,67 +272,49 @@ static int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
    /* Generate block maps from the input image. */
    if((ret = gen_image_maps(&direction_map, &low_contrast_map,
                     &low_flow_map, &high_curve_map, &mw, &mh,
-                    pdata, pw, ph, dir2rad, dftwaves, dftgrids, lfsparms))){
+                    pdata, pw, ph, lfstables->dir2rad, lfstables->dftwaves,
+                    lfstables->dftgrids, lfsparms))){
       /* Free memory allocated to this point. */
-      free_dir2rad(dir2rad);
-      free_dftwaves(dftwaves);
-      free_rotgrids(dftgrids);
-      free(pdata);
+      free_lfstables(own_lfstables);
+      arena_free(pdata);
       return(ret);
    }
-   /* Deallocate working memories. */
-   free_dir2rad(dir2rad);
-   free_dftwaves(dftwaves);
-   free_rotgrids(dftgrids);
 
    print2log("\nMAPS DONE\n");
+   lfs_stage_done(lfsparms, LFS_STAGE_MAPS);
 
    /******************/
    /* BINARIZARION   */
    /******************/
 
-   /* Initialize lookup table for pixel offsets to rotated grids */
-   /* used for directional binarization.                         */
-   if((ret = init_rotgrids(&dirbingrids, iw, ih, maxpad,
-                        lfsparms->start_dir_angle, lfsparms->num_directions,
-                        lfsparms->dirbin_grid_w, lfsparms->dirbin_grid_h,
-                        RELATIVE2CENTER))){
-      /* Free memory allocated to this point. */
-      free(pdata);
-      free(direction_map);
-      free(low_contrast_map);
-      free(low_flow_map);
-      free(high_curve_map);
-      return(ret);
-   }
-
    /* Binarize input image based on NMAP information. */
-   if((ret = binarize_V2(&bdata, &bw, &bh,
+   if((ret = binarize_V2(&bdata, &bits, &bw, &bh,
                       pdata, pw, ph, direction_map, mw, mh,
-                      dirbingrids, lfsparms))){
+                      lfstables->dirbingrids, lfsparms))){
       /* Free memory allocated to this point. */
-      free(pdata);
-      free(direction_map);
-      free(low_contrast_map);
-      free(low_flow_map);
-      free(high_curve_map);
-      free_rotgrids(dirbingrids);
+      free_lfstables(own_lfstables);
+      arena_free(pdata);
+      arena_free(direction_map);
+      arena_free(low_contrast_map);
+      arena_free(low_flow_map);
+      arena_free(high_curve_map);
       return(ret);
    }
 
    /* Deallocate working memory. */
-   free_rotgrids(dirbingrids);
+   free_lfstables(own_lfstables);
 
    /* Check dimension of binary image.  If they are different from */
    /* the input image, then ERROR.                                 */
    if((iw != bw) || (ih != bh)){
       /* Free memory allocated to this point. */
-      free(pdata);
-      free(direction_map);
-      free(low_contrast_map);
-      free(low_flow_map);
-      free(high_curve_map);
-      free(bdata);
+      arena_free(pdata);
+      arena_free(direction_map);
+      arena_free(low_contrast_map);
+      arena_free(low_flow_map);
+      arena_free(high_curve_map);
+      arena_free(bdata);
+      arena_free(bits);
       fprintf(stderr, "ERROR : lfs_detect_minutiae_V2 :");
       fprintf(stderr,"binary image has bad dimensions : %d, %d\n",
               bw, bh);
@@ -253,14 +322,13 @@ static int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
    }
 
    print2log("\nBINARIZATION DONE\n");
+   lfs_stage_done(lfsparms, LFS_STAGE_BINARIZATION);
 
    /******************/
    /*   DETECTION    */
    /******************/
 
-   /* Convert 8-bit grayscale binary image [0,255] to */
-   /* 8-bit binary image [0,1].                       */
-   gray2bin(1, 1, 0, bdata, iw, ih);
+   /* The binary image is already 8-bit [0,1], black pixels being 1. */
 
    /* Allocate initial list of minutia pointers. */
    if((ret = alloc_minutiae(&minutiae, MAX_MINUTIAE))){
@@ -268,16 +336,20 @@ static int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
    }
 
    /* Detect the minutiae in the binarized image. */
-   if((ret = detect_minutiae_V2(minutiae, bdata, iw, ih,
+   ret = detect_minutiae_V2(minutiae, bdata, bits, iw, ih,
                              direction_map, low_flow_map, high_curve_map,
-                             mw, mh, lfsparms))){
+                             mw, mh, lfsparms);
+   /* The packed image is only used by the scans, as removing false */
+   /* minutiae may fill in loops of the 8-bit image.                 */
+   arena_free(bits);
+   if(ret){
       /* Free memory allocated to this point. */
-      free(pdata);
-      free(direction_map);
-      free(low_contrast_map);
-      free(low_flow_map);
-      free(high_curve_map);
-      free(bdata);
+      arena_free(pdata);
+      arena_free(direction_map);
+      arena_free(low_contrast_map);
+      arena_free(low_flow_map);
+      arena_free(high_curve_map);
+      arena_free(bdata);
       return(ret);
    }
 
@@ -285,45 +357,63 @@ static int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
                        direction_map, low_flow_map, high_curve_map, mw, mh,
                        lfsparms))){
       /* Free memory allocated to this point. */
-      free(pdata);
-      free(direction_map);
-      free(low_contrast_map);
-      free(low_flow_map);
-      free(high_curve_map);
-      free(bdata);
+      arena_free(pdata);
+      arena_free(direction_map);
+      arena_free(low_contrast_map);
+      arena_free(low_flow_map);
+      arena_free(high_curve_map);
+      arena_free(bdata);
       free_minutiae(minutiae);
       return(ret);
    }
 
    print2log("\nMINUTIA DETECTION DONE\n");
+   lfs_stage_done(lfsparms, LFS_STAGE_DETECTION);
 
    /******************/
    /*  RIDGE COUNTS  */
    /******************/
    if((ret = count_minutiae_ridges(minutiae, bdata, iw, ih, lfsparms))){
       /* Free memory allocated to this point. */
-      free(pdata);
-      free(direction_map);
-      free(low_contrast_map);
-      free(low_flow_map);
-      free(high_curve_map);
+      arena_free(pdata);
+      arena_free(direction_map);
+      arena_free(low_contrast_map);
+      arena_free(low_flow_map);
+      arena_free(high_curve_map);
+      arena_free(bdata);
       free_minutiae(minutiae);
       return(ret);
    }
 
 
    print2log("\nNEIGHBOR RIDGE COUNT DONE\n");
+   lfs_stage_done(lfsparms, LFS_STAGE_RIDGE_COUNT);
 
    /******************/
    /*    WRAP-UP     */
    /******************/
 
-   /* Convert 8-bit binary image [0,1] to 8-bit */
-   /* grayscale binary image [0,255].           */
-   gray2bin(1, 255, 0, bdata, iw, ih);
+   /* Pack the final binary image for the caller, outside of the arena. */
+   if(keep_bdata){
+      lfsarena = use_lfsarena((LFSARENA *)NULL);
+      ret = pack_bitimage(&kept_bits, bdata, iw, ih, 1);
+      use_lfsarena(lfsarena);
+      if(ret){
+         /* Free memory allocated to this point. */
+         arena_free(pdata);
+         arena_free(direction_map);
+         arena_free(low_contrast_map);
+         arena_free(low_flow_map);
+         arena_free(high_curve_map);
+         arena_free(bdata);
+         free_minutiae(minutiae);
+         return(ret);
+      }
+   }
 
    /* Deallocate working memory. */
-   free(pdata);
+   arena_free(pdata);
+   arena_free(bdata);
 
    /* Assign results to output pointers. */
    *odmap = direction_map;
@@ -332,7 +422,7 @@ static int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
    *ohcmap = high_curve_map;
    *omw = mw;
    *omh = mh;
-   *obdata = bdata;
+   *obits = kept_bits;
    *obw = bw;
    *obh = bh;
    *ominutiae = minutiae;
@@ -344,6 +434,60 @@ static int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
    return(0);
 }
 
+/*************************************************************************
+**************************************************************************
+#cat: detach_minutiae - Replaces the minutiae of a list which were allocated
+#cat:            from a memory arena with copies allocated with malloc().
+#cat:            Must be called while the arena is in use.
+
+   Input:
+      minutiae - list of minutiae
+      lfsarena - the arena, may be NULL
+   Output:
+      minutiae - the minutiae no longer depend on the arena
+   Return Code:
+      Zero     - successful completion
+      Negative - system error
+**************************************************************************/
+static int detach_minutiae(MINUTIAE *minutiae, const LFSARENA *lfsarena)
+{
+   MINUTIA *minutia;
+   int i;
+
+   for(i = 0; i < minutiae->num; i++){
+      if(!lfsarena_owns(lfsarena, minutiae->list[i]))
+         continue;
+
+      minutia = (MINUTIA *)malloc(sizeof(MINUTIA));
+      if(minutia == (MINUTIA *)NULL){
+         fprintf(stderr, "ERROR : detach_minutiae : malloc : minutia\n");
+         return(-586);
+      }
+      *minutia = *minutiae->list[i];
+      minutiae->list[i] = minutia;
+   }
+
+   return(0);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: pass_map - Passes an image map back to the caller of get_minutiae(),
+#cat:            or deallocates it if the caller doesn't need it.
+
+   Input:
+      map      - the image map
+   Output:
+      omap     - points to the image map, may be NULL
+**************************************************************************/
+static void pass_map(int **omap, int *map)
+{
+   if(omap != (int **)NULL)
+      *omap = map;
+   else
+      arena_free(map);
+}
+
 /*************************************************************************
 **************************************************************************
 #cat:   get_minutiae - Takes a grayscale fingerprint image, binarizes the input
@@ -358,7 +502,18 @@ static int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
       id       - pixel depth (in bits) of the grayscale image
       ppmm     - the scan resolution (in pixels/mm) of the grayscale image
       lfsparms - parameters and thresholds for controlling LFS
+      lfstables - lookup tables from init_lfstables() for images of this
+                 size, or NULL to create them just for this image
+      lfsarena - memory arena from init_lfsarena() to allocate intermediate
+                 results from, or NULL to use malloc().  The image maps
+                 are then allocated from the arena too, and remain valid
+                 until it is reset; the minutiae and the binarized image
+                 are allocated with malloc() either way.
    Output:
+      Only ominutiae is required, the other outputs may be NULL if they
+      aren't needed by the caller.  The binarized image is then released
+      along with the maps, or comes from the arena.
+
       ominutiae         - points to a structure containing the
                           detected minutiae
       oquality_map      - resulting integrated image quality map
@@ -368,10 +523,11 @@ static int lfs_detect_minutiae_V2(MINUTIAE **ominutiae,
       ohigh_curve_map   - resulting high curvature map
       omap_w   - width (in blocks) of image maps
       omap_h   - height (in blocks) of image maps
-      obdata   - points to binarized image data
+      obits    - points to binarized image data, packed one bit per
+                 pixel with black (ridge) pixels set, see bitimage.c
       obw      - width (in pixels) of binarized image
       obh      - height (in pixels) of binarized image
-      obd      - pixel depth (in bits) of binarized image
+      obd      - pixel depth (in bits) of binarized image, always 1
    Return Code:
       Zero     - successful completion
       Negative - system error
@@ -380,16 +536,18 @@ int get_minutiae(MINUTIAE **ominutiae, int **oquality_map,
                  int **odirection_map, int **olow_contrast_map,
                  int **olow_flow_map, int **ohigh_curve_map,
                  int *omap_w, int *omap_h,
-                 unsigned char **obdata, int *obw, int *obh, int *obd,
+                 BITWORD **obits, int *obw, int *obh, int *obd,
                  unsigned char *idata, const int iw, const int ih,
-                 const int id, const double ppmm, const LFSPARMS *lfsparms)
+                 const int id, const double ppmm, const LFSPARMS *lfsparms,
+                 const LFSTABLES *lfstables, LFSARENA *lfsarena)
 {
    int ret;
+   LFSARENA *prev_lfsarena;
    MINUTIAE *minutiae = NULL;
    int *direction_map = NULL, *low_contrast_map = NULL, *low_flow_map = NULL;
    int *high_curve_map = NULL, *quality_map = NULL;
    int map_w = 0, map_h = 0;
-   unsigned char *bdata = NULL;
+   BITWORD *bits = NULL;
    int bw = 0, bh = 0;
 
    /* If input image is not 8-bit grayscale ... */
@@ -399,13 +557,18 @@ int get_minutiae(MINUTIAE **ominutiae, int **oquality_map,
       return(-2);
    }
 
+   /* Allocate intermediate results from the arena, if any. */
+   prev_lfsarena = use_lfsarena(lfsarena);
+
    /* Detect minutiae in grayscale fingerpeint image. */
    if((ret = lfs_detect_minutiae_V2(&minutiae,
                                    &direction_map, &low_contrast_map,
                                    &low_flow_map, &high_curve_map,
                                    &map_w, &map_h,
-                                   &bdata, &bw, &bh,
-                                   idata, iw, ih, lfsparms))){
+                                   &bits, &bw, &bh,
+                                   idata, iw, ih, lfsparms, lfstables,
+                                   obits != (BITWORD **)NULL))){
+      use_lfsarena(prev_lfsarena);
       return(ret);
    }
 
@@ -414,11 +577,12 @@ int get_minutiae(MINUTIAE **ominutiae, int **oquality_map,
                             direction_map, low_contrast_map,
                             low_flow_map, high_curve_map, map_w, map_h))){
       free_minutiae(minutiae);
-      free(direction_map);
-      free(low_contrast_map);
-      free(low_flow_map);
-      free(high_curve_map);
-      free(bdata);
+      arena_free(direction_map);
+      arena_free(low_contrast_map);
+      arena_free(low_flow_map);
+      arena_free(high_curve_map);
+      free(bits);
+      use_lfsarena(prev_lfsarena);
       return(ret);
    }
 
@@ -427,28 +591,53 @@ int get_minutiae(MINUTIAE **ominutiae, int **oquality_map,
                                      lfsparms->blocksize,
                                      idata, iw, ih, id, ppmm))){
       free_minutiae(minutiae);
-      free(direction_map);
-      free(low_contrast_map);
-      free(low_flow_map);
-      free(high_curve_map);
-      free(quality_map);
-      free(bdata);
+      arena_free(direction_map);
+      arena_free(low_contrast_map);
+      arena_free(low_flow_map);
+      arena_free(high_curve_map);
+      arena_free(quality_map);
+      free(bits);
+      use_lfsarena(prev_lfsarena);
       return(ret);
    }
 
+   lfs_stage_done(lfsparms, LFS_STAGE_QUALITY);
+
+   /* Move the minutiae out of the arena, so they outlive it. */
+   if((ret = detach_minutiae(minutiae, lfsarena))){
+      free_minutiae(minutiae);
+      arena_free(direction_map);
+      arena_free(low_contrast_map);
+      arena_free(low_flow_map);
+      arena_free(high_curve_map);
+      arena_free(quality_map);
+      free(bits);
+      use_lfsarena(prev_lfsarena);
+      return(ret);
+   }
+
+   /* Release the results which aren't passed back. */
+   pass_map(oquality_map, quality_map);
+   pass_map(odirection_map, direction_map);
+   pass_map(olow_contrast_map, low_contrast_map);
+   pass_map(olow_flow_map, low_flow_map);
+   pass_map(ohigh_curve_map, high_curve_map);
+   if(obits != (BITWORD **)NULL)
+      *obits = bits;
+   use_lfsarena(prev_lfsarena);
+
    /* Set output pointers. */
    *ominutiae = minutiae;
-   *oquality_map = quality_map;
-   *odirection_map = direction_map;
-   *olow_contrast_map = low_contrast_map;
-   *olow_flow_map = low_flow_map;
-   *ohigh_curve_map = high_curve_map;
-   *omap_w = map_w;
-   *omap_h = map_h;
-   *obdata = bdata;
-   *obw = bw;
-   *obh = bh;
-   *obd = id;
+   if(omap_w != (int *)NULL)
+      *omap_w = map_w;
+   if(omap_h != (int *)NULL)
+      *omap_h = map_h;
+   if(obw != (int *)NULL)
+      *obw = bw;
+   if(obh != (int *)NULL)
+      *obh = bh;
+   if(obd != (int *)NULL)
+      *obd = 1;
 
    /* Return normally. */
    return(0);
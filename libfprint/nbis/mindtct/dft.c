@@ -38,6 +38,8 @@ identified are necessarily the best available for the purpose.
                         dft_dir_powers()
                         sum_rot_block_rows()
                         dft_power()
+                        dft_powers()
+                        dft_powers_single()
                         dft_power_stats()
                         get_max_norm()
                         sort_dft_waves()
@@ -46,6 +48,11 @@ identified are necessarily the best available for the purpose.
 #include <stdio.h>
 #include <stdlib.h>
 #include <lfs.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 /*************************************************************************
 **************************************************************************
@@ -67,22 +74,28 @@ identified are necessarily the best available for the purpose.
 static void sum_rot_block_rows(int *rowsums, const unsigned char *blkptr,
                         const int *grid_offsets, const int blocksize)
 {
-   int ix, iy, gi;
-
-   /* Initialize rotation offset index. */
-   gi = 0;
+   int ix, iy;
+   const int *offsets;
 
    /* For each row in block ... */
    for(iy = 0; iy < blocksize; iy++){
-      /* The sums are accumlated along the rotated rows of the grid, */
-      /* so initialize row sum to 0.                                 */
-      rowsums[iy] = 0;
+      /* The sums are accumlated along the rotated rows of the grid.     */
+      /* Integer sums don't depend on the order of the additions, so     */
+      /* four independent partial sums are kept to overlap the gathers.  */
+      int sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+
+      offsets = grid_offsets + iy * blocksize;
       /* Foreach column in block ... */
-      for(ix = 0; ix < blocksize; ix++){
+      for(ix = 0; ix + 3 < blocksize; ix += 4){
          /* Accumulate pixel value at rotated grid position in image */
-         rowsums[iy] += *(blkptr + grid_offsets[gi]);
-         gi++;
+         sum0 += blkptr[offsets[ix]];
+         sum1 += blkptr[offsets[ix+1]];
+         sum2 += blkptr[offsets[ix+2]];
+         sum3 += blkptr[offsets[ix+3]];
       }
+      for(; ix < blocksize; ix++)
+         sum0 += blkptr[offsets[ix]];
+      rowsums[iy] = sum0 + sum1 + sum2 + sum3;
    }
 }
 
@@ -125,6 +138,141 @@ static void dft_power(double *power, const int *rowsums,
    *power = (cospart * cospart) + (sinpart * sinpart);
 }
 
+/*************************************************************************
+**************************************************************************
+#cat: dft_powers - Computes the DFT power of every wave form for one
+#cat:              orientation of an image block.
+
+   Input:
+      rowsums  - accumulated rows of pixels from within a rotated grid
+                 overlaying an input image block
+      dir      - the orientation of the rotated grid
+      dftwaves - structure containing the DFT wave forms
+   Output:
+      powers   - DFT power computed from each wave form at orientation dir
+**************************************************************************/
+static void dft_powers(double **powers, const int dir, const int *rowsums,
+               const DFTWAVES *dftwaves)
+{
+   int w = 0;
+#ifdef __SSE2__
+   int i;
+
+   /* Two wave forms at a time, one per lane.  Each lane performs the */
+   /* same operations in the same order as dft_power(), so the        */
+   /* resulting powers are identical.                                 */
+   for(; w + 1 < dftwaves->nwaves; w += 2){
+      const DFTWAVE *wave0 = dftwaves->waves[w];
+      const DFTWAVE *wave1 = dftwaves->waves[w+1];
+      __m128d cospart = _mm_setzero_pd();
+      __m128d sinpart = _mm_setzero_pd();
+      __m128d power;
+      double out[2];
+
+      for(i = 0; i < dftwaves->wavelen; i++){
+         __m128d rowsum = _mm_set1_pd((double)rowsums[i]);
+
+         cospart = _mm_add_pd(cospart, _mm_mul_pd(rowsum,
+                             _mm_set_pd(wave1->cos[i], wave0->cos[i])));
+         sinpart = _mm_add_pd(sinpart, _mm_mul_pd(rowsum,
+                             _mm_set_pd(wave1->sin[i], wave0->sin[i])));
+      }
+
+      power = _mm_add_pd(_mm_mul_pd(cospart, cospart),
+                         _mm_mul_pd(sinpart, sinpart));
+      _mm_storeu_pd(out, power);
+      powers[w][dir] = out[0];
+      powers[w+1][dir] = out[1];
+   }
+#endif
+
+   /* Foreach remaining DFT wave ... */
+   for(; w < dftwaves->nwaves; w++){
+      dft_power(&(powers[w][dir]), rowsums,
+                dftwaves->waves[w], dftwaves->wavelen);
+   }
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: dft_powers_single - Computes the DFT power of every wave form for one
+#cat:              orientation of an image block, in single precision.
+
+   Row sums are small integers, which are exact as floats, but the
+   products and their sums are rounded to about 7 digits instead of 16.
+   The powers are compared to each other and to thresholds afterwards,
+   so the resulting directions only change for blocks where two of them
+   are that close, which is within the noise of the image anyway.
+
+   Input:
+      rowsums  - accumulated rows of pixels from within a rotated grid
+                 overlaying an input image block
+      dir      - the orientation of the rotated grid
+      dftwaves - structure containing the DFT wave forms
+   Output:
+      powers   - DFT power computed from each wave form at orientation dir
+**************************************************************************/
+static void dft_powers_single(double **powers, const int dir,
+               const int *rowsums, const DFTWAVES *dftwaves)
+{
+   const int nwaves = dftwaves->nwaves;
+   const float *fcos = dftwaves->fcos;
+   const float *fsin = dftwaves->fsin;
+   int w = 0, i;
+#if defined(__SSE2__) || defined(__ARM_NEON)
+   float out[4];
+
+   /* Four wave forms at a time, one per lane, the table rows of all */
+   /* waves being contiguous.                                        */
+   for(; w + 3 < nwaves; w += 4){
+#ifdef __SSE2__
+      __m128 cospart = _mm_setzero_ps();
+      __m128 sinpart = _mm_setzero_ps();
+
+      for(i = 0; i < dftwaves->wavelen; i++){
+         __m128 rowsum = _mm_set1_ps((float)rowsums[i]);
+
+         cospart = _mm_add_ps(cospart, _mm_mul_ps(rowsum,
+                             _mm_loadu_ps(fcos + i * nwaves + w)));
+         sinpart = _mm_add_ps(sinpart, _mm_mul_ps(rowsum,
+                             _mm_loadu_ps(fsin + i * nwaves + w)));
+      }
+      _mm_storeu_ps(out, _mm_add_ps(_mm_mul_ps(cospart, cospart),
+                                    _mm_mul_ps(sinpart, sinpart)));
+#else
+      float32x4_t cospart = vdupq_n_f32(0.0f);
+      float32x4_t sinpart = vdupq_n_f32(0.0f);
+
+      for(i = 0; i < dftwaves->wavelen; i++){
+         float32x4_t rowsum = vdupq_n_f32((float)rowsums[i]);
+
+         cospart = vaddq_f32(cospart, vmulq_f32(rowsum,
+                             vld1q_f32(fcos + i * nwaves + w)));
+         sinpart = vaddq_f32(sinpart, vmulq_f32(rowsum,
+                             vld1q_f32(fsin + i * nwaves + w)));
+      }
+      vst1q_f32(out, vaddq_f32(vmulq_f32(cospart, cospart),
+                               vmulq_f32(sinpart, sinpart)));
+#endif
+      powers[w][dir] = out[0];
+      powers[w+1][dir] = out[1];
+      powers[w+2][dir] = out[2];
+      powers[w+3][dir] = out[3];
+   }
+#endif
+
+   /* Foreach remaining DFT wave, with the same operations as a lane. */
+   for(; w < nwaves; w++){
+      float cospart = 0.0f, sinpart = 0.0f;
+
+      for(i = 0; i < dftwaves->wavelen; i++){
+         cospart += (float)rowsums[i] * fcos[i * nwaves + w];
+         sinpart += (float)rowsums[i] * fsin[i * nwaves + w];
+      }
+      powers[w][dir] = (cospart * cospart) + (sinpart * sinpart);
+   }
+}
+
 /*************************************************************************
 **************************************************************************
 #cat: dft_dir_powers - Conducts the DFT analysis on a block of image data.
@@ -150,6 +298,9 @@ static void dft_power(double *power, const int *rowsums,
       ph        - the height (in pixels) of the padded input image
       dftwaves  - structure containing the DFT wave forms
       dftgrids  - structure containing the rotated pixel grid offsets
+      single    - non-zero to compute the powers in single precision,
+                  which is faster, but may pick another direction for
+                  blocks whose strongest directions are nearly as strong
    Output:
       powers    - DFT power computed from each wave form frequencies at each
                   orientation (direction) in the current image block
@@ -159,9 +310,10 @@ static void dft_power(double *power, const int *rowsums,
 **************************************************************************/
 int dft_dir_powers(double **powers, unsigned char *pdata,
                const int blkoffset, const int pw, const int ph,
-               const DFTWAVES *dftwaves, const ROTGRIDS *dftgrids)
+               const DFTWAVES *dftwaves, const ROTGRIDS *dftgrids,
+               const int single)
 {
-   int w, dir;
+   int dir;
    int *rowsums;
    unsigned char *blkptr;
 
@@ -184,11 +336,11 @@ int dft_dir_powers(double **powers, unsigned char *pdata,
       sum_rot_block_rows(rowsums, blkptr,
                          dftgrids->grids[dir], dftgrids->grid_w);
 
-      /* Foreach DFT wave ... */
-      for(w = 0; w < dftwaves->nwaves; w++){
-         dft_power(&(powers[w][dir]), rowsums,
-                   dftwaves->waves[w], dftwaves->wavelen);
-      }
+      /* Compute the power of each DFT wave. */
+      if(single)
+         dft_powers_single(powers, dir, rowsums, dftwaves);
+      else
+         dft_powers(powers, dir, rowsums, dftwaves);
    }
 
    /* Deallocate working memory. */
@@ -292,7 +444,7 @@ static int sort_dft_waves(int *wis, const double *powmaxs, const double *pownorm
    }
 
    /* Sort the statistic indices on the normalized squared power. */
-   bubble_sort_double_dec_2(pownorms2, wis, nstats);
+   sort_double_dec_2(pownorms2, wis, nstats);
 
    /* Deallocate the working memory. */
    free(pownorms2);
@@ -75,6 +75,8 @@ void free_dftwaves(DFTWAVES *dftwaves)
        free(dftwaves->waves[i]);
    }
    free(dftwaves->waves);
+   free(dftwaves->fcos);
+   free(dftwaves->fsin);
    free(dftwaves);
 }
 
@@ -183,7 +183,7 @@ int pad_uchar_image(unsigned char **optr, int *ow, int *oh,
    psize = pw * ph;
 
    /* Allocate padded image */
-   pdata = (unsigned char *)malloc(psize * sizeof(unsigned char));
+   pdata = (unsigned char *)arena_malloc(psize * sizeof(unsigned char));
    if(pdata == (unsigned char *)NULL){
       fprintf(stderr, "ERROR : pad_uchar_image : malloc : pdata\n");
       return(-160);
@@ -347,8 +347,8 @@ int free_path(const int x1, const int y1, const int x2, const int y2,
          /* If number of transitions seen > than threshold (ex. 2) ... */
          if(trans > lfsparms->maxtrans){
             /* Deallocate the line segment's coordinate lists. */
-            free(x_list);
-            free(y_list);
+            arena_free(x_list);
+            arena_free(y_list);
             /* Return free path to be FALSE. */
             return(FALSE);
          }
@@ -362,8 +362,8 @@ int free_path(const int x1, const int y1, const int x2, const int y2,
 
    /* If we get here we did not exceed the maximum allowable number        */
    /* of transitions.  So, deallocate the line segment's coordinate lists. */
-   free(x_list);
-   free(y_list);
+   arena_free(x_list);
+   arena_free(y_list);
 
    /* Return free path to be TRUE. */
    return(TRUE);
@@ -238,6 +238,26 @@ int init_dftwaves(DFTWAVES **optr, const double *dft_coefs,
       }
    }
 
+   /* Allocate and fill in the single precision wave forms */
+   dftwaves->fcos = (float *)malloc(nwaves * blocksize * sizeof(float));
+   dftwaves->fsin = (float *)malloc(nwaves * blocksize * sizeof(float));
+   if(dftwaves->fcos == (float *)NULL || dftwaves->fsin == (float *)NULL){
+      free(dftwaves->fcos);
+      free(dftwaves->fsin);
+      dftwaves->fcos = (float *)NULL;
+      dftwaves->fsin = (float *)NULL;
+      free_dftwaves(dftwaves);
+      fprintf(stderr,
+              "ERROR : init_dftwaves : malloc : dftwaves->fcos\n");
+      return(-25);
+   }
+   for (i = 0; i < nwaves; ++i) {
+      for (j = 0; j < blocksize; ++j) {
+         dftwaves->fcos[j * nwaves + i] = (float)dftwaves->waves[i]->cos[j];
+         dftwaves->fsin[j * nwaves + i] = (float)dftwaves->waves[i]->sin[j];
+      }
+   }
+
    *optr = dftwaves;
    return(0);
 }
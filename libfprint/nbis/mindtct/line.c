@@ -75,14 +75,14 @@ int line_points(int **ox_list, int **oy_list, int *onum,
    asize = max(abs(x2-x1)+2, abs(y2-y1)+2);
 
    /* Allocate x and y-pixel coordinate lists to length 'asize'. */
-   x_list = (int *)malloc(asize*sizeof(int));
+   x_list = (int *)arena_malloc(asize*sizeof(int));
    if(x_list == (int *)NULL){
       fprintf(stderr, "ERROR : line_points : malloc : x_list\n");
       return(-410);
    }
-   y_list = (int *)malloc(asize*sizeof(int));
+   y_list = (int *)arena_malloc(asize*sizeof(int));
    if(y_list == (int *)NULL){
-      free(x_list);
+      arena_free(x_list);
       fprintf(stderr, "ERROR : line_points : malloc : y_list\n");
       return(-411);
    }
@@ -170,8 +170,8 @@ int line_points(int **ox_list, int **oy_list, int *onum,
 
       if(i >= asize){
          fprintf(stderr, "ERROR : line_points : coord list overflow\n");
-         free(x_list);
-         free(y_list);
+         arena_free(x_list);
+         arena_free(y_list);
          return(-412);
       }
 
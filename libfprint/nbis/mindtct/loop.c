@@ -93,7 +93,7 @@ static int chain_code_loop(int **ochain, int *onchain,
    /* number of points in the contour.  There will be one chain code */
    /* between each point on the contour including a code between the */
    /* last to the first point on the contour (completing the loop).  */
-   chain = (int *)malloc(ncontour * sizeof(int));
+   chain = (int *)arena_malloc(ncontour * sizeof(int));
    /* If the allocation fails ... */
    if(chain == (int *)NULL){
       fprintf(stderr, "ERROR : chain_code_loop : malloc : chain\n");
@@ -644,7 +644,7 @@ int is_loop_clockwise(const int *contour_x, const int *contour_y,
    ret = is_chain_clockwise(chain, nchain, default_ret);
 
    /* Free the chain code and return result. */
-   free(chain);
+   arena_free(chain);
    return(ret);
 }
 
@@ -40,6 +40,7 @@ identified are necessarily the best available for the purpose.
 ***********************************************************************
                ROUTINES:
                         gen_image_maps()
+                        gen_initial_maps_blocks()
                         gen_initial_maps()
                         interpolate_direction_map()
                         morph_TF_map()
@@ -67,8 +68,8 @@ identified are necessarily the best available for the purpose.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <glib.h>
 #include <lfs.h>
-#include <morph.h>
 #include <log.h>
 
 /*************************************************************************
@@ -133,7 +134,7 @@ int gen_image_maps(int **odmap, int **olcmap, int **olfmap, int **ohcmap,
                               &low_flow_map, blkoffs, mw, mh,
                               pdata, pw, ph, dftwaves, dftgrids, lfsparms))){
       /* Free memory allocated to this point. */
-      free(blkoffs);
+      arena_free(blkoffs);
       return(ret);
    }
 
@@ -175,7 +176,7 @@ int gen_image_maps(int **odmap, int **olcmap, int **olfmap, int **ohcmap,
    }
 
    /* Deallocate working memory. */
-   free(blkoffs);
+   arena_free(blkoffs);
 
    *odmap = direction_map;
    *olcmap = low_contrast_map;
@@ -186,51 +187,49 @@ int gen_image_maps(int **odmap, int **olcmap, int **olfmap, int **ohcmap,
    return(0);
 }
 
+/* A range of blocks processed by one thread of gen_initial_maps(). */
+typedef struct initial_maps_work{
+   int *direction_map;
+   int *low_contrast_map;
+   int *low_flow_map;
+   int *blkoffs;
+   int first_block;
+   int last_block;
+   unsigned char *pdata;
+   int pw;
+   int ph;
+   const DFTWAVES *dftwaves;
+   const ROTGRIDS *dftgrids;
+   const LFSPARMS *lfsparms;
+   int ret;
+} INITIAL_MAPS_WORK;
+
 /*************************************************************************
 **************************************************************************
-#cat: gen_initial_maps - Creates an initial Direction Map from the given
-#cat:             input image.  It very important that the image be properly
-#cat:             padded so that rotated grids along the boundary of the image
-#cat:             do not access unkown memory.  The rotated grids are used by a
-#cat:             DFT-based analysis to determine the integer directions
-#cat:             in the map. Typically this initial vector of directions will
-#cat:             subsequently have weak or inconsistent directions removed
-#cat:             followed by a smoothing process.  The resulting Direction
-#cat:             Map contains valid directions >= 0 and INVALID values = -1.
-#cat:             This routine also computes and returns 2 other image maps.
-#cat:             The Low Contrast Map flags blocks in the image with
-#cat:             insufficient contrast.  Blocks with low contrast have a
-#cat:             corresponding direction of INVALID in the Direction Map.
-#cat:             The Low Flow Map flags blocks in which the DFT analyses
-#cat:             could not determine a significant ridge flow.  Blocks with
-#cat:             low ridge flow also have a corresponding direction of
-#cat:             INVALID in the Direction Map.
+#cat: gen_initial_maps_blocks - Fills in the maps of gen_initial_maps()
+#cat:             for a range of blocks, with its own DFT scratch memory.
 
    Input:
-      blkoffs   - offsets to the pixel origin of each block in the padded image
-      mw        - number of blocks horizontally in the padded input image
-      mh        - number of blocks vertically in the padded input image
-      pdata     - padded input image data (8 bits [0..256) grayscale)
-      pw        - width (in pixels) of the padded input image
-      ph        - height (in pixels) of the padded input image
-      dftwaves  - structure containing the DFT wave forms
-      dftgrids  - structure containing the rotated pixel grid offsets
-      lfsparms  - parameters and thresholds for controlling LFS
+      work      - the range of blocks, along with the inputs and maps of
+                  gen_initial_maps()
    Output:
-      odmap     - points to the newly created Direction Map
-      olcmap    - points to the newly created Low Contrast Map
+      work      - the maps entries of the blocks in the range are set
    Return Code:
       Zero     - successful completion
       Negative - system error
 **************************************************************************/
-int gen_initial_maps(int **odmap, int **olcmap, int **olfmap,
-                int *blkoffs, const int mw, const int mh,
-                unsigned char *pdata, const int pw, const int ph,
-                const DFTWAVES *dftwaves, const  ROTGRIDS *dftgrids,
-                const LFSPARMS *lfsparms)
+static int gen_initial_maps_blocks(INITIAL_MAPS_WORK *work)
 {
-   int *direction_map, *low_contrast_map, *low_flow_map;
-   int bi, bsize, blkdir;
+   int *direction_map = work->direction_map;
+   int *low_contrast_map = work->low_contrast_map;
+   int *low_flow_map = work->low_flow_map;
+   unsigned char *pdata = work->pdata;
+   const int pw = work->pw;
+   const int ph = work->ph;
+   const DFTWAVES *dftwaves = work->dftwaves;
+   const ROTGRIDS *dftgrids = work->dftgrids;
+   const LFSPARMS *lfsparms = work->lfsparms;
+   int bi, blkdir;
    int *wis, *powmax_dirs;
    double **powers, *powmaxs, *pownorms;
    int nstats;
@@ -239,52 +238,9 @@ int gen_initial_maps(int **odmap, int **olcmap, int **olfmap,
    int xminlimit, xmaxlimit, yminlimit, ymaxlimit;
    int win_x, win_y, low_contrast_offset;
 
-   print2log("INITIAL MAP\n");
-
-   /* Compute total number of blocks in map */
-   bsize = mw * mh;
-
-   /* Allocate Direction Map memory */
-   direction_map = (int *)malloc(bsize * sizeof(int));
-   if(direction_map == (int *)NULL){
-      fprintf(stderr,
-              "ERROR : gen_initial_maps : malloc : direction_map\n");
-      return(-550);
-   }
-   /* Initialize the Direction Map to INVALID (-1). */
-   memset(direction_map, INVALID_DIR, bsize * sizeof(int));
-
-   /* Allocate Low Contrast Map memory */
-   low_contrast_map = (int *)malloc(bsize * sizeof(int));
-   if(low_contrast_map == (int *)NULL){
-      free(direction_map);
-      fprintf(stderr,
-              "ERROR : gen_initial_maps : malloc : low_contrast_map\n");
-      return(-551);
-   }
-   /* Initialize the Low Contrast Map to FALSE (0). */
-   memset(low_contrast_map, 0, bsize * sizeof(int));
-
-   /* Allocate Low Ridge Flow Map memory */
-   low_flow_map = (int *)malloc(bsize * sizeof(int));
-   if(low_flow_map == (int *)NULL){
-      free(direction_map);
-      free(low_contrast_map);
-      fprintf(stderr,
-              "ERROR : gen_initial_maps : malloc : low_flow_map\n");
-      return(-552);
-   }
-   /* Initialize the Low Flow Map to FALSE (0). */
-   memset(low_flow_map, 0, bsize * sizeof(int));
-
    /* Allocate DFT directional power vectors */
-   if((ret = alloc_dir_powers(&powers, dftwaves->nwaves, dftgrids->ngrids))){
-      /* Free memory allocated to this point. */
-      free(direction_map);
-      free(low_contrast_map);
-      free(low_flow_map);
+   if((ret = alloc_dir_powers(&powers, dftwaves->nwaves, dftgrids->ngrids)))
       return(ret);
-   }
 
    /* Allocate DFT power statistic arrays */
    /* Compute length of statistics arrays.  Statistics not needed   */
@@ -293,9 +249,6 @@ int gen_initial_maps(int **odmap, int **olcmap, int **olfmap,
    if((ret = alloc_power_stats(&wis, &powmaxs, &powmax_dirs,
                             &pownorms, nstats))){
       /* Free memory allocated to this point. */
-      free(direction_map);
-      free(low_contrast_map);
-      free(low_flow_map);
       free_dir_powers(powers, dftwaves->nwaves);
       return(ret);
    }
@@ -311,11 +264,17 @@ int gen_initial_maps(int **odmap, int **olcmap, int **olfmap,
    xmaxlimit = MAX(xmaxlimit, 0);
    ymaxlimit = MAX(ymaxlimit, 0);
 
-   /* Foreach block in image ... */
-   for(bi = 0; bi < bsize; bi++){
+   /* Foreach block in the range ... */
+   for(bi = work->first_block; bi < work->last_block; bi++){
+      /* Give up if the maps are no longer needed. */
+      if(lfs_cancelled(lfsparms)){
+         ret = LFS_CANCELLED;
+         break;
+      }
+
       /* Adjust block offset from pointing to block origin to pointing */
       /* to surrounding window origin.                                 */
-      dft_offset = blkoffs[bi] - (lfsparms->windowoffset * pw) -
+      dft_offset = work->blkoffs[bi] - (lfsparms->windowoffset * pw) -
                       lfsparms->windowoffset;
 
       /* Compute pixel coords of window origin. */
@@ -330,28 +289,20 @@ int gen_initial_maps(int **odmap, int **olcmap, int **olfmap,
       win_y = min(ymaxlimit, win_y);
       low_contrast_offset = (win_y * pw) + win_x;
 
-      print2log("   BLOCK %2d (%2d, %2d) ", bi, bi%mw, bi/mw);
+      print2log("   BLOCK %2d ", bi);
 
       /* If block is low contrast ... */
       if((ret = low_contrast_block(low_contrast_offset, lfsparms->windowsize,
                                   pdata, pw, ph, lfsparms))){
          /* If system error ... */
-         if(ret < 0){
-            free(direction_map);
-            free(low_contrast_map);
-            free(low_flow_map);
-            free_dir_powers(powers, dftwaves->nwaves);
-            free(wis);
-            free(powmaxs);
-            free(powmax_dirs);
-            free(pownorms);
-            return(ret);
-         }
+         if(ret < 0)
+            break;
 
          /* Otherwise, block is low contrast ... */
          print2log("LOW CONTRAST\n");
          low_contrast_map[bi] = TRUE;
          /* Direction Map's block is already set to INVALID. */
+         ret = 0;
       }
       /* Otherwise, sufficient contrast for DFT processing ... */
       else {
@@ -359,35 +310,15 @@ int gen_initial_maps(int **odmap, int **olcmap, int **olfmap,
 
          /* Compute DFT powers */
          if((ret = dft_dir_powers(powers, pdata, low_contrast_offset, pw, ph,
-                               dftwaves, dftgrids))){
-            /* Free memory allocated to this point. */
-            free(direction_map);
-            free(low_contrast_map);
-            free(low_flow_map);
-            free_dir_powers(powers, dftwaves->nwaves);
-            free(wis);
-            free(powmaxs);
-            free(powmax_dirs);
-            free(pownorms);
-            return(ret);
-         }
+                               dftwaves, dftgrids, lfsparms->dft_single)))
+            break;
 
          /* Compute DFT power statistics, skipping first applied DFT  */
          /* wave.  This is dependent on how the primary and secondary */
          /* direction tests work below.                               */
          if((ret = dft_power_stats(wis, powmaxs, powmax_dirs, pownorms, powers,
-                                1, dftwaves->nwaves, dftgrids->ngrids))){
-            /* Free memory allocated to this point. */
-            free(direction_map);
-            free(low_contrast_map);
-            free(low_flow_map);
-            free_dir_powers(powers, dftwaves->nwaves);
-            free(wis);
-            free(powmaxs);
-            free(powmax_dirs);
-            free(pownorms);
-            return(ret);
-         }
+                                1, dftwaves->nwaves, dftgrids->ngrids)))
+            break;
 
 #ifdef LOG_REPORT /*vvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvv*/
          {  int _w;
@@ -430,6 +361,165 @@ int gen_initial_maps(int **odmap, int **olcmap, int **olfmap,
    free(powmax_dirs);
    free(pownorms);
 
+   return(ret);
+}
+
+static gpointer gen_initial_maps_thread(gpointer data)
+{
+   INITIAL_MAPS_WORK *work = (INITIAL_MAPS_WORK *)data;
+
+   work->ret = gen_initial_maps_blocks(work);
+   return(NULL);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: gen_initial_maps - Creates an initial Direction Map from the given
+#cat:             input image.  It very important that the image be properly
+#cat:             padded so that rotated grids along the boundary of the image
+#cat:             do not access unkown memory.  The rotated grids are used by a
+#cat:             DFT-based analysis to determine the integer directions
+#cat:             in the map. Typically this initial vector of directions will
+#cat:             subsequently have weak or inconsistent directions removed
+#cat:             followed by a smoothing process.  The resulting Direction
+#cat:             Map contains valid directions >= 0 and INVALID values = -1.
+#cat:             This routine also computes and returns 2 other image maps.
+#cat:             The Low Contrast Map flags blocks in the image with
+#cat:             insufficient contrast.  Blocks with low contrast have a
+#cat:             corresponding direction of INVALID in the Direction Map.
+#cat:             The Low Flow Map flags blocks in which the DFT analyses
+#cat:             could not determine a significant ridge flow.  Blocks with
+#cat:             low ridge flow also have a corresponding direction of
+#cat:             INVALID in the Direction Map.
+
+   Input:
+      blkoffs   - offsets to the pixel origin of each block in the padded image
+      mw        - number of blocks horizontally in the padded input image
+      mh        - number of blocks vertically in the padded input image
+      pdata     - padded input image data (8 bits [0..256) grayscale)
+      pw        - width (in pixels) of the padded input image
+      ph        - height (in pixels) of the padded input image
+      dftwaves  - structure containing the DFT wave forms
+      dftgrids  - structure containing the rotated pixel grid offsets
+      lfsparms  - parameters and thresholds for controlling LFS
+   Output:
+      odmap     - points to the newly created Direction Map
+      olcmap    - points to the newly created Low Contrast Map
+   Return Code:
+      Zero     - successful completion
+      Negative - system error
+**************************************************************************/
+int gen_initial_maps(int **odmap, int **olcmap, int **olfmap,
+                int *blkoffs, const int mw, const int mh,
+                unsigned char *pdata, const int pw, const int ph,
+                const DFTWAVES *dftwaves, const  ROTGRIDS *dftgrids,
+                const LFSPARMS *lfsparms)
+{
+   int *direction_map, *low_contrast_map, *low_flow_map;
+   int bsize;
+   int nthreads, i;
+   INITIAL_MAPS_WORK *works;
+   GThread **threads;
+   int ret; /* return code */
+
+   print2log("INITIAL MAP\n");
+
+   /* Compute total number of blocks in map */
+   bsize = mw * mh;
+
+   /* Allocate Direction Map memory */
+   direction_map = (int *)arena_malloc(bsize * sizeof(int));
+   if(direction_map == (int *)NULL){
+      fprintf(stderr,
+              "ERROR : gen_initial_maps : malloc : direction_map\n");
+      return(-550);
+   }
+   /* Initialize the Direction Map to INVALID (-1). */
+   memset(direction_map, INVALID_DIR, bsize * sizeof(int));
+
+   /* Allocate Low Contrast Map memory */
+   low_contrast_map = (int *)arena_malloc(bsize * sizeof(int));
+   if(low_contrast_map == (int *)NULL){
+      arena_free(direction_map);
+      fprintf(stderr,
+              "ERROR : gen_initial_maps : malloc : low_contrast_map\n");
+      return(-551);
+   }
+   /* Initialize the Low Contrast Map to FALSE (0). */
+   memset(low_contrast_map, 0, bsize * sizeof(int));
+
+   /* Allocate Low Ridge Flow Map memory */
+   low_flow_map = (int *)arena_malloc(bsize * sizeof(int));
+   if(low_flow_map == (int *)NULL){
+      arena_free(direction_map);
+      arena_free(low_contrast_map);
+      fprintf(stderr,
+              "ERROR : gen_initial_maps : malloc : low_flow_map\n");
+      return(-552);
+   }
+   /* Initialize the Low Flow Map to FALSE (0). */
+   memset(low_flow_map, 0, bsize * sizeof(int));
+
+   /* Split the rows of blocks between the threads.  The blocks are */
+   /* independent, and each one is only written by one thread.      */
+   nthreads = min(lfsparms->map_threads, mh);
+   nthreads = max(nthreads, 1);
+   works = (INITIAL_MAPS_WORK *)malloc(nthreads * sizeof(INITIAL_MAPS_WORK));
+   threads = (GThread **)calloc(nthreads, sizeof(GThread *));
+   if(works == (INITIAL_MAPS_WORK *)NULL || threads == (GThread **)NULL){
+      free(works);
+      free(threads);
+      arena_free(direction_map);
+      arena_free(low_contrast_map);
+      arena_free(low_flow_map);
+      fprintf(stderr,
+              "ERROR : gen_initial_maps : malloc : works\n");
+      return(-553);
+   }
+
+   for(i = 0; i < nthreads; i++){
+      works[i].direction_map = direction_map;
+      works[i].low_contrast_map = low_contrast_map;
+      works[i].low_flow_map = low_flow_map;
+      works[i].blkoffs = blkoffs;
+      works[i].first_block = (mh * i / nthreads) * mw;
+      works[i].last_block = (mh * (i + 1) / nthreads) * mw;
+      works[i].pdata = pdata;
+      works[i].pw = pw;
+      works[i].ph = ph;
+      works[i].dftwaves = dftwaves;
+      works[i].dftgrids = dftgrids;
+      works[i].lfsparms = lfsparms;
+      works[i].ret = 0;
+   }
+
+   /* The calling thread takes the first range, and also takes the */
+   /* ranges of threads which couldn't be started.                 */
+   for(i = 1; i < nthreads; i++)
+      threads[i] = g_thread_try_new("maps", gen_initial_maps_thread,
+                                    &works[i], NULL);
+   gen_initial_maps_thread(&works[0]);
+   for(i = 1; i < nthreads; i++){
+      if(threads[i] != (GThread *)NULL)
+         g_thread_join(threads[i]);
+      else
+         gen_initial_maps_thread(&works[i]);
+   }
+
+   /* Report the error of the first failed range, if any. */
+   ret = 0;
+   for(i = 0; i < nthreads && !ret; i++)
+      ret = works[i].ret;
+   free(works);
+   free(threads);
+
+   if(ret){
+      arena_free(direction_map);
+      arena_free(low_contrast_map);
+      arena_free(low_flow_map);
+      return(ret);
+   }
+
    *odmap = direction_map;
    *olcmap = low_contrast_map;
    *olfmap = low_flow_map;
@@ -476,7 +566,7 @@ int interpolate_direction_map(int *direction_map, int *low_contrast_map,
    print2log("INTERPOLATE DIRECTION MAP\n");
 
    /* Allocate output (interpolated) Direction Map. */
-   omap = (int *)malloc(mw*mh*sizeof(int));
+   omap = (int *)arena_malloc(mw*mh*sizeof(int));
    if(omap == (int *)NULL){
       fprintf(stderr,
               "ERROR : interpolate_direction_map : malloc : omap\n");
@@ -621,7 +711,7 @@ int interpolate_direction_map(int *direction_map, int *low_contrast_map,
    /* Copy the interpolated directions into the input map. */
    memcpy(direction_map, omap, mw*mh*sizeof(int));
    /* Deallocate the working memory. */
-   free(omap);
+   arena_free(omap);
 
    /* Return normally. */
    return(0);
@@ -644,43 +734,49 @@ int interpolate_direction_map(int *direction_map, int *low_contrast_map,
 int morph_TF_map(int *tfmap, const int mw, const int mh,
                  const LFSPARMS *lfsparms)
 {
-   unsigned char *cimage, *mimage, *cptr;
+   BITWORD *cbits, *mbits, word;
    int *mptr;
-   int i;
-   
+   int i, ix, iy, stride;
 
-   /* Convert TRUE/FALSE map into a binary byte image. */
-   cimage = (unsigned char *)malloc(mw*mh);
-   if(cimage == (unsigned char *)NULL){
-      fprintf(stderr, "ERROR : morph_TF_map : malloc : cimage\n");
+   /* Convert TRUE/FALSE map into a packed binary image. */
+   stride = BITIMAGE_STRIDE(mw);
+   cbits = (BITWORD *)arena_calloc(stride*mh, sizeof(BITWORD));
+   if(cbits == (BITWORD *)NULL){
+      fprintf(stderr, "ERROR : morph_TF_map : calloc : cbits\n");
       return(-660);
    }
 
-   mimage = (unsigned char *)malloc(mw*mh);
-   if(mimage == (unsigned char *)NULL){
-      fprintf(stderr, "ERROR : morph_TF_map : malloc : mimage\n");
+   mbits = (BITWORD *)arena_malloc(stride*mh*sizeof(BITWORD));
+   if(mbits == (BITWORD *)NULL){
+      fprintf(stderr, "ERROR : morph_TF_map : malloc : mbits\n");
       return(-661);
    }
 
-   cptr = cimage;
    mptr = tfmap;
-   for(i = 0; i < mw*mh; i++){
-      *cptr++ = *mptr++;
-   }
+   for(iy = 0; iy < mh; iy++)
+      for(ix = 0; ix < mw; ix++)
+         if(*mptr++)
+            cbits[(iy*stride) + (ix/BITWORD_BITS)] |=
+                                  (BITWORD)1 << (ix%BITWORD_BITS);
 
-   dilate_charimage_2(cimage, mimage, mw, mh);
-   dilate_charimage_2(mimage, cimage, mw, mh);
-   erode_charimage_2(cimage, mimage, mw, mh);
-   erode_charimage_2(mimage, cimage, mw, mh);
+   dilate_bitimage(cbits, mbits, mw, mh);
+   dilate_bitimage(mbits, cbits, mw, mh);
+   erode_bitimage(cbits, mbits, mw, mh);
+   erode_bitimage(mbits, cbits, mw, mh);
 
-   cptr = cimage;
    mptr = tfmap;
-   for(i = 0; i < mw*mh; i++){
-      *mptr++ = *cptr++;
+   for(iy = 0; iy < mh; iy++){
+      word = 0;
+      for(ix = 0, i = iy*stride; ix < mw; ix++){
+         if(ix%BITWORD_BITS == 0)
+            word = cbits[i++];
+         *mptr++ = (int)(word & 1);
+         word >>= 1;
+      }
    }
 
-   free(cimage);
-   free(mimage);
+   arena_free(mbits);
+   arena_free(cbits);
 
    return(0);
 }
@@ -723,7 +819,7 @@ int pixelize_map(int **omap, const int iw, const int ih,
    }
 
    if((bw != mw) || (bh != mh)){
-      free(blkoffs);
+      arena_free(blkoffs);
       fprintf(stderr,
          "ERROR : pixelize_map : block dimensions do not match\n");
       return(-591);
@@ -741,7 +837,7 @@ int pixelize_map(int **omap, const int iw, const int ih,
    }
 
    /* Deallocate working memory. */
-   free(blkoffs);
+   arena_free(blkoffs);
    /* Assign pixelized map to output pointer. */
    *omap = pmap;
 
@@ -872,7 +968,7 @@ int gen_high_curve_map(int **ohcmap, int *direction_map,
    mapsize = mw*mh;
 
    /* Allocate High Curvature Map. */
-   high_curve_map = (int *)malloc(mapsize * sizeof(int));
+   high_curve_map = (int *)arena_malloc(mapsize * sizeof(int));
    if(high_curve_map == (int *)NULL){
       fprintf(stderr,
               "ERROR: gen_high_curve_map : malloc : high_curve_map\n");
@@ -977,7 +1073,7 @@ int gen_initial_imap(int **optr, int *blkoffs, const int mw, const int mh,
    bsize = mw * mh;
 
    /* Allocate IMAP memory */
-   imap = (int *)malloc(bsize * sizeof(int));
+   imap = (int *)arena_malloc(bsize * sizeof(int));
    if(imap == (int *)NULL){
       fprintf(stderr, "ERROR : gen_initial_imap : malloc : imap\n");
       return(-70);
@@ -986,7 +1082,7 @@ int gen_initial_imap(int **optr, int *blkoffs, const int mw, const int mh,
    /* Allocate DFT directional power vectors */
    if((ret = alloc_dir_powers(&powers, dftwaves->nwaves, dftgrids->ngrids))){
       /* Free memory allocated to this point. */
-      free(imap);
+      arena_free(imap);
       return(ret);
    }
 
@@ -997,7 +1093,7 @@ int gen_initial_imap(int **optr, int *blkoffs, const int mw, const int mh,
    if((ret = alloc_power_stats(&wis, &powmaxs, &powmax_dirs,
                             &pownorms, nstats))){
       /* Free memory allocated to this point. */
-      free(imap);
+      arena_free(imap);
       free_dir_powers(powers, dftwaves->nwaves);
       return(ret);
    }
@@ -1012,9 +1108,9 @@ int gen_initial_imap(int **optr, int *blkoffs, const int mw, const int mh,
 
       /* Compute DFT powers */
       if((ret = dft_dir_powers(powers, pdata, blkoffs[bi], pw, ph,
-                            dftwaves, dftgrids))){
+                            dftwaves, dftgrids, lfsparms->dft_single))){
          /* Free memory allocated to this point. */
-         free(imap);
+         arena_free(imap);
          free_dir_powers(powers, dftwaves->nwaves);
          free(wis);
          free(powmaxs);
@@ -1029,7 +1125,7 @@ int gen_initial_imap(int **optr, int *blkoffs, const int mw, const int mh,
       if((ret = dft_power_stats(wis, powmaxs, powmax_dirs, pownorms, powers,
                       1, dftwaves->nwaves, dftgrids->ngrids))){
          /* Free memory allocated to this point. */
-         free(imap);
+         arena_free(imap);
          free_dir_powers(powers, dftwaves->nwaves);
          free(wis);
          free(powmaxs);
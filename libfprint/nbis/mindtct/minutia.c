@@ -37,6 +37,7 @@ identified are necessarily the best available for the purpose.
                ROUTINES:
                         alloc_minutiae()
                         realloc_minutiae()
+                        scan_bands_V2()
                         detect_minutiae_V2()
                         update_minutiae()
                         update_minutiae_V2()
@@ -57,8 +58,10 @@ identified are necessarily the best available for the purpose.
                         scan4minutiae()
                         scan4minutiae_horizontally()
                         scan4minutiae_horizontally_V2()
+                        scan_rows_V2()
                         scan4minutiae_vertically()
                         scan4minutiae_vertically_V2()
+                        scan_columns_V2()
                         rescan4minutiae_horizontally()
                         rescan4minutiae_vertically()
                         rescan_partial_horizontally()
@@ -79,8 +82,316 @@ identified are necessarily the best available for the purpose.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <glib.h>
 #include <lfs.h>
 
+/* Size (in pixels) of the bands of rows or columns scanned separately */
+/* when LFSPARMS.scan_bands is set.                                    */
+#define SCAN_BAND_SIZE   64
+
+static int scan_rows_V2(MINUTIAE *, unsigned char *, const BITWORD *,
+                const int, const int, const int, const int,
+                int *, int *, int *, const LFSPARMS *);
+static int scan_columns_V2(MINUTIAE *, unsigned char *, const BITWORD *,
+                const int, const int, const int, const int,
+                int *, int *, int *, const LFSPARMS *);
+
+/* A band of rows or columns scanned by scan_bands_V2(), and its results. */
+typedef struct scan_band{
+   int first;
+   int last;
+   MINUTIAE *minutiae;
+   /* Pixels changed by the loops filled while scanning the band. */
+   int *fill_offs;
+   unsigned char *fill_vals;
+   int nfills;
+   int afills;
+   int ret;
+} SCAN_BAND;
+
+/* The bands of one scan direction, shared by the threads of */
+/* scan_bands_V2().                                          */
+typedef struct scan_work{
+   SCAN_BAND *bands;
+   int nbands;
+   gint next_band;
+   int vertical;
+   unsigned char *bdata;
+   const BITWORD *bits;
+   int iw;
+   int ih;
+   int *pdirection_map;
+   int *plow_flow_map;
+   int *phigh_curve_map;
+   const LFSPARMS *lfsparms;
+} SCAN_WORK;
+
+/*************************************************************************
+**************************************************************************
+#cat: save_band_fills - Records the pixels of a thread's copy of the
+#cat:            binary image changed by the loops filled while scanning
+#cat:            a band, and restores them in the copy for the next band.
+#cat:            Loops are found from the scan pairs of the band, so
+#cat:            only the pixels within a few contour lengths of the band
+#cat:            are compared.
+
+   Input:
+      work      - the bands, along with the original binary image
+      band      - the band just scanned
+      bcopy     - the thread's copy of the binary image
+   Output:
+      band      - the changed pixels are appended to its fills
+      bcopy     - the copy matches the original binary image again
+   Return Code:
+      Zero      - successful completion
+      Negative  - system error
+**************************************************************************/
+static int save_band_fills(SCAN_WORK *work, SCAN_BAND *band,
+                           unsigned char *bcopy)
+{
+   const int iw = work->iw;
+   const int ih = work->ih;
+   int margin, sx, ex, sy, ey, x, y, o, afills;
+   int *offs;
+   unsigned char *vals;
+
+   margin = (2 * work->lfsparms->high_curve_half_contour) + 2;
+   if(work->vertical){
+      sx = max(0, band->first - margin);
+      ex = min(iw, band->last + 1 + margin);
+      sy = 0;
+      ey = ih;
+   }
+   else{
+      sx = 0;
+      ex = iw;
+      sy = max(0, band->first - margin);
+      ey = min(ih, band->last + 1 + margin);
+   }
+
+   for(y = sy; y < ey; y++){
+      for(x = sx; x < ex; x++){
+         o = (y * iw) + x;
+         if(bcopy[o] == work->bdata[o])
+            continue;
+
+         if(band->nfills >= band->afills){
+            /* The buffers are left to the band on failure, to be freed */
+            /* along with it.                                           */
+            afills = max(2 * band->afills, 256);
+            offs = (int *)realloc(band->fill_offs, afills * sizeof(int));
+            if(offs == (int *)NULL){
+               fprintf(stderr,
+                       "ERROR : save_band_fills : realloc : fill_offs\n");
+               return(-690);
+            }
+            band->fill_offs = offs;
+            vals = (unsigned char *)realloc(band->fill_vals, afills);
+            if(vals == (unsigned char *)NULL){
+               fprintf(stderr,
+                       "ERROR : save_band_fills : realloc : fill_vals\n");
+               return(-693);
+            }
+            band->fill_vals = vals;
+            band->afills = afills;
+         }
+         band->fill_offs[band->nfills] = o;
+         band->fill_vals[band->nfills] = bcopy[o];
+         band->nfills++;
+         bcopy[o] = work->bdata[o];
+      }
+   }
+
+   return(0);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: scan_bands_thread - Scans the bands of a SCAN_WORK not yet taken by
+#cat:            another thread, each one in a copy of the binary image
+#cat:            and into its own minutiae list.  Bands which could not
+#cat:            be scanned are left with an error.
+**************************************************************************/
+static gpointer scan_bands_thread(gpointer data)
+{
+   SCAN_WORK *work = (SCAN_WORK *)data;
+   SCAN_BAND *band;
+   unsigned char *bcopy;
+   int i, ret;
+
+   bcopy = (unsigned char *)malloc(work->iw * work->ih);
+   if(bcopy == (unsigned char *)NULL){
+      fprintf(stderr, "ERROR : scan_bands_thread : malloc : bcopy\n");
+      return(NULL);
+   }
+   memcpy(bcopy, work->bdata, work->iw * work->ih);
+
+   while((i = g_atomic_int_add(&work->next_band, 1)) < work->nbands){
+      band = &work->bands[i];
+      if((ret = alloc_minutiae(&band->minutiae, MAX_MINUTIAE))){
+         band->ret = ret;
+         continue;
+      }
+
+      if(work->vertical)
+         ret = scan_columns_V2(band->minutiae, bcopy, work->bits,
+                               work->iw, work->ih, band->first, band->last,
+                               work->pdirection_map, work->plow_flow_map,
+                               work->phigh_curve_map, work->lfsparms);
+      else
+         ret = scan_rows_V2(band->minutiae, bcopy, work->bits,
+                            work->iw, work->ih, band->first, band->last,
+                            work->pdirection_map, work->plow_flow_map,
+                            work->phigh_curve_map, work->lfsparms);
+      band->ret = save_band_fills(work, band, bcopy);
+      if(ret)
+         band->ret = ret;
+   }
+
+   free(bcopy);
+   return(NULL);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: scan_bands_V2 - Scans an entire binary image for minutiae in one
+#cat:            direction, in bands of SCAN_BAND_SIZE rows or columns
+#cat:            shared by the threads.  Each band is scanned in a copy of
+#cat:            the image as it was before the scan, into a list of its
+#cat:            own, so that the results don't depend on the number of
+#cat:            threads nor on their timing.  The loops filled in each
+#cat:            band are then applied to the image, and the minutiae of
+#cat:            the bands are merged into the list in band order, the
+#cat:            duplicates found across band boundaries being removed by
+#cat:            update_minutiae_V2().  When merging, the direction map is
+#cat:            read at the minutia's final position, whereas a single
+#cat:            scan passes the value read before high-curvature
+#cat:            minutiae are moved, which the public MINUTIA structure
+#cat:            has no field to keep.  So a duplicate pair of which the new
+#cat:            minutia was moved into another block may be resolved
+#cat:            differently than by a single scan.
+
+   Input:
+      bdata     - binary image data (0==while & 1==black)
+      bits      - the same binary image packed one bit per pixel, or its
+                  transpose for the vertical scan
+      iw        - width (in pixels) of image
+      ih        - height (in pixels) of image
+      vertical  - non-zero to scan the columns, zero to scan the rows
+      pdirection_map  - pixelized Direction Map
+      plow_flow_map   - pixelized Low Ridge Flow Map
+      phigh_curve_map - pixelized High Curvature Map
+      lfsparms  - parameters and thresholds for controlling LFS
+   Output:
+      minutiae  - points to a list of detected minutia structures
+      bdata     - the loops filled by the scan are filled in
+   Return Code:
+      Zero      - successful completion
+      Negative  - system error
+**************************************************************************/
+static int scan_bands_V2(MINUTIAE *minutiae,
+                unsigned char *bdata, const BITWORD *bits,
+                const int iw, const int ih, const int vertical,
+                int *pdirection_map, int *plow_flow_map, int *phigh_curve_map,
+                const LFSPARMS *lfsparms)
+{
+   SCAN_WORK work;
+   SCAN_BAND *band;
+   GThread **threads;
+   MINUTIA *minutia;
+   int size, nthreads, i, j, o, ret;
+
+   size = vertical ? iw : ih;
+   work.nbands = max(1, (size + SCAN_BAND_SIZE - 1) / SCAN_BAND_SIZE);
+   work.bands = (SCAN_BAND *)calloc(work.nbands, sizeof(SCAN_BAND));
+   nthreads = min(max(lfsparms->map_threads, 1), work.nbands);
+   threads = (GThread **)calloc(nthreads, sizeof(GThread *));
+   if(work.bands == (SCAN_BAND *)NULL || threads == (GThread **)NULL){
+      free(work.bands);
+      free(threads);
+      fprintf(stderr, "ERROR : scan_bands_V2 : calloc : bands\n");
+      return(-691);
+   }
+
+   for(i = 0; i < work.nbands; i++){
+      work.bands[i].first = i * SCAN_BAND_SIZE;
+      work.bands[i].last = min(size, (i + 1) * SCAN_BAND_SIZE);
+      /* Left as is if no thread gets to scan the band. */
+      work.bands[i].ret = -692;
+   }
+   work.next_band = 0;
+   work.vertical = vertical;
+   work.bdata = bdata;
+   work.bits = bits;
+   work.iw = iw;
+   work.ih = ih;
+   work.pdirection_map = pdirection_map;
+   work.plow_flow_map = plow_flow_map;
+   work.phigh_curve_map = phigh_curve_map;
+   work.lfsparms = lfsparms;
+
+   /* The calling thread scans bands as well, and takes those */
+   /* left by threads which couldn't be started.              */
+   for(i = 1; i < nthreads; i++)
+      threads[i] = g_thread_try_new("scan", scan_bands_thread, &work, NULL);
+   scan_bands_thread(&work);
+   for(i = 1; i < nthreads; i++){
+      if(threads[i] != (GThread *)NULL)
+         g_thread_join(threads[i]);
+   }
+   free(threads);
+
+   /* Report the error of the first failed band, if any. */
+   ret = 0;
+   for(i = 0; i < work.nbands && !ret; i++)
+      ret = work.bands[i].ret;
+
+   if(!ret){
+      /* Fill the loops, in band order where bands overlap. */
+      for(i = 0; i < work.nbands; i++){
+         band = &work.bands[i];
+         for(j = 0; j < band->nfills; j++)
+            bdata[band->fill_offs[j]] = band->fill_vals[j];
+      }
+   }
+
+   for(i = 0; i < work.nbands; i++){
+      band = &work.bands[i];
+      free(band->fill_offs);
+      free(band->fill_vals);
+      if(band->minutiae == (MINUTIAE *)NULL)
+         continue;
+
+      for(j = 0; j < band->minutiae->num; j++){
+         minutia = band->minutiae->list[j];
+         if(ret){
+            free_minutia(minutia);
+            continue;
+         }
+
+         /* Merge the minutia as if just found by a scan of the */
+         /* whole image, but with the direction of the block it */
+         /* ended up in, see above.                            */
+         o = (minutia->y * iw) + minutia->x;
+         ret = update_minutiae_V2(minutiae, minutia,
+                                  vertical ? SCAN_VERTICAL : SCAN_HORIZONTAL,
+                                  pdirection_map[o], bdata, iw, ih, lfsparms);
+         if(ret == IGNORE){
+            free_minutia(minutia);
+            ret = 0;
+         }
+         else if(ret)
+            free_minutia(minutia);
+      }
+      /* The minutiae now belong to the merged list, or are freed. */
+      band->minutiae->num = 0;
+      free_minutiae(band->minutiae);
+   }
+   free(work.bands);
+
+   return(ret);
+}
 
 
 /*************************************************************************
@@ -152,9 +463,13 @@ int realloc_minutiae(MINUTIAE *minutiae, const int incr_minutiae)
 #cat:            Direction and Low Flow Maps and scans each image block
 #cat:            with valid direction for minutia points.  Minutia points
 #cat:            detected in LOW FLOW blocks are set with lower reliability.
+#cat:            With LFSPARMS.scan_bands set, the image is scanned in
+#cat:            bands by several threads, see scan_bands_V2(), which may
+#cat:            find slightly different minutiae than a single scan.
 
    Input:
       bdata     - binary image data (0==while & 1==black)
+      bits      - the same binary image packed one bit per pixel
       iw        - width (in pixels) of image
       ih        - height (in pixels) of image
       direction_map  - map of image blocks containing directional ridge flow
@@ -170,13 +485,15 @@ int realloc_minutiae(MINUTIAE *minutiae, const int incr_minutiae)
       Negative  - system error
 **************************************************************************/
 int detect_minutiae_V2(MINUTIAE *minutiae,
-            unsigned char *bdata, const int iw, const int ih,
+            unsigned char *bdata, const BITWORD *bits, const int iw,
+            const int ih,
             int *direction_map, int *low_flow_map, int *high_curve_map,
             const int mw, const int mh,
             const LFSPARMS *lfsparms)
 {
    int ret;
    int *pdirection_map, *plow_flow_map, *phigh_curve_map;
+   BITWORD *tbits;
 
    /* Pixelize the maps by assigning block values to individual pixels. */
    if((ret = pixelize_map(&pdirection_map, iw, ih, direction_map, mw, mh,
@@ -197,20 +514,38 @@ int detect_minutiae_V2(MINUTIAE *minutiae,
       return(ret);
    }
 
-   if((ret = scan4minutiae_horizontally_V2(minutiae, bdata, iw, ih,
-                 pdirection_map, plow_flow_map, phigh_curve_map, lfsparms))){
-      free(pdirection_map);
-      free(plow_flow_map);
-      free(phigh_curve_map);
-      return(ret);
+   if(lfsparms->scan_bands){
+      ret = scan_bands_V2(minutiae, bdata, bits, iw, ih, FALSE,
+                 pdirection_map, plow_flow_map, phigh_curve_map, lfsparms);
+      /* Columns of the image are rows of its transpose. */
+      if(!ret && !(ret = transpose_bitimage(&tbits, bits, iw, ih))){
+         ret = scan_bands_V2(minutiae, bdata, tbits, iw, ih, TRUE,
+                 pdirection_map, plow_flow_map, phigh_curve_map, lfsparms);
+         arena_free(tbits);
+      }
+      if(ret){
+         free(pdirection_map);
+         free(plow_flow_map);
+         free(phigh_curve_map);
+         return(ret);
+      }
    }
+   else{
+      if((ret = scan4minutiae_horizontally_V2(minutiae, bdata, bits, iw, ih,
+                 pdirection_map, plow_flow_map, phigh_curve_map, lfsparms))){
+         free(pdirection_map);
+         free(plow_flow_map);
+         free(phigh_curve_map);
+         return(ret);
+      }
 
-   if((ret = scan4minutiae_vertically_V2(minutiae, bdata, iw, ih,
+      if((ret = scan4minutiae_vertically_V2(minutiae, bdata, bits, iw, ih,
                  pdirection_map, plow_flow_map, phigh_curve_map, lfsparms))){
-      free(pdirection_map);
-      free(plow_flow_map);
-      free(phigh_curve_map);
-      return(ret);
+         free(pdirection_map);
+         free(plow_flow_map);
+         free(phigh_curve_map);
+         return(ret);
+      }
    }
 
    /* Deallocate working memories. */
@@ -797,7 +1132,7 @@ int create_minutia(MINUTIA **ominutia, const int x_loc, const int y_loc,
    MINUTIA *minutia;
 
    /* Allocate a minutia structure. */
-   minutia = (MINUTIA *)malloc(sizeof(MINUTIA));
+   minutia = (MINUTIA *)arena_malloc(sizeof(MINUTIA));
    /* If allocation error... */
    if(minutia == (MINUTIA *)NULL){
       fprintf(stderr, "ERROR : create_minutia : malloc : minutia\n");
@@ -863,7 +1198,7 @@ void free_minutia(MINUTIA *minutia)
       free(minutia->ridge_counts);
 
    /* Deallocate the minutia structure. */
-   free(minutia);
+   arena_free(minutia);
 }
 
 /*************************************************************************
@@ -1034,8 +1369,8 @@ int join_minutia(const MINUTIA *minutia1, const MINUTIA *minutia2,
    }
 
    /* Deallocate points along connecting line. */
-   free(x_list);
-   free(y_list);
+   arena_free(x_list);
+   arena_free(y_list);
 
    /* Return normally. */
    return(0);
@@ -1379,9 +1714,12 @@ int scan4minutiae_horizontally(MINUTIAE *minutiae,
 #cat:                horizontally, detecting potential minutiae points.
 #cat:                Minutia detected via the horizontal scan process are
 #cat:                by nature vertically oriented (orthogonal to the scan).
+#cat:                Stretches of identical pixel pairs, which can't hold
+#cat:                a feature's second pair, are skipped a word at a time.
 
    Input:
       bdata     - binary image data (0==while & 1==black)
+      bits      - the same binary image packed one bit per pixel
       iw        - width (in pixels) of image
       ih        - height (in pixels) of image
       pdirection_map  - pixelized Direction Map
@@ -1395,29 +1733,78 @@ int scan4minutiae_horizontally(MINUTIAE *minutiae,
       Negative  - system error
 **************************************************************************/
 int scan4minutiae_horizontally_V2(MINUTIAE *minutiae,
-                unsigned char *bdata, const int iw, const int ih,
+                unsigned char *bdata, const BITWORD *bits,
+                const int iw, const int ih,
                 int *pdirection_map, int *plow_flow_map, int *phigh_curve_map,
                 const LFSPARMS *lfsparms)
 {
-   int sx, sy, ex, ey, cx, cy, x2;
+   /* Set scan region to entire image. */
+   return(scan_rows_V2(minutiae, bdata, bits, iw, ih, 0, ih,
+                       pdirection_map, plow_flow_map, phigh_curve_map,
+                       lfsparms));
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: scan_rows_V2 - Scans the rows of a binary image starting in the
+#cat:                given range horizontally, as done by
+#cat:                scan4minutiae_horizontally_V2().  The second row of
+#cat:                a scan pair may lie past the range.
+
+   Input:
+      bdata     - binary image data (0==while & 1==black)
+      bits      - the same binary image packed one bit per pixel
+      iw        - width (in pixels) of image
+      ih        - height (in pixels) of image
+      first_row - first row scanned
+      last_row  - row after the last one scanned
+      pdirection_map  - pixelized Direction Map
+      plow_flow_map   - pixelized Low Ridge Flow Map
+      phigh_curve_map - pixelized High Curvature Map
+      lfsparms  - parameters and thresholds for controlling LFS
+   Output:
+      minutiae   - points to a list of detected minutia structures
+   Return Code:
+      Zero      - successful completion
+      Negative  - system error
+**************************************************************************/
+static int scan_rows_V2(MINUTIAE *minutiae,
+                unsigned char *bdata, const BITWORD *bits,
+                const int iw, const int ih,
+                const int first_row, const int last_row,
+                int *pdirection_map, int *plow_flow_map, int *phigh_curve_map,
+                const LFSPARMS *lfsparms)
+{
+   int sx, sy, ex, ey, cx, cy, x2, nx, stride;
    unsigned char *p1ptr, *p2ptr;
    int possible[NFEATURES], nposs;
    int ret;
 
-   /* Set scan region to entire image. */
+   /* Set scan region to the range of rows. */
    sx = 0;
    ex = iw;
-   sy = 0;
-   ey = ih;
+   sy = first_row;
+   ey = last_row;
+   stride = BITIMAGE_STRIDE(iw);
 
    /* Start at first row in region. */
    cy = sy;
-   /* While second scan row not outside the bottom of the scan region... */
-   while(cy+1 < ey){
+   /* While in the scan region and second scan row not outside */
+   /* the bottom of the image...                               */
+   while(cy < ey && cy+1 < ih){
+      /* Give up if the minutiae are no longer needed. */
+      if(lfs_cancelled(lfsparms))
+         return(LFS_CANCELLED);
       /* Start at beginning of new scan row in region. */
       cx = sx;
       /* While not at end of region's current scan row. */
       while(cx < ex){
+         /* Every second pair of a feature has different pixels, so */
+         /* move on to the pair before the next such pair.           */
+         nx = next_bitimage_diff(bits+(cy*stride), bits+((cy+1)*stride),
+                                 cx+1, iw) - 1;
+         if(nx > cx)
+            cx = nx;
          /* Get pixel pair from current x position in current and next */
          /* scan rows. */
          p1ptr = bdata+(cy*iw)+cx;
@@ -1640,9 +2027,13 @@ int scan4minutiae_vertically(MINUTIAE *minutiae,
 #cat:                vertically, detecting potential minutiae points.
 #cat:                Minutia detected via the vetical scan process are
 #cat:                by nature horizontally oriented (orthogonal to  the scan).
+#cat:                Stretches of identical pixel pairs, which can't hold
+#cat:                a feature's second pair, are skipped a word at a time
+#cat:                in a transposed copy of the packed image.
 
    Input:
       bdata     - binary image data (0==while & 1==black)
+      bits      - the same binary image packed one bit per pixel
       iw        - width (in pixels) of image
       ih        - height (in pixels) of image
       pdirection_map  - pixelized Direction Map
@@ -1656,29 +2047,89 @@ int scan4minutiae_vertically(MINUTIAE *minutiae,
       Negative  - system error
 **************************************************************************/
 int scan4minutiae_vertically_V2(MINUTIAE *minutiae,
-                unsigned char *bdata, const int iw, const int ih,
+                unsigned char *bdata, const BITWORD *bits,
+                const int iw, const int ih,
                 int *pdirection_map, int *plow_flow_map, int *phigh_curve_map,
                 const LFSPARMS *lfsparms)
 {
-   int sx, sy, ex, ey, cx, cy, y2;
+   BITWORD *tbits;
+   int ret;
+
+   /* Columns of the image are rows of its transpose. */
+   if((ret = transpose_bitimage(&tbits, bits, iw, ih)))
+      return(ret);
+
+   /* Set scan region to entire image. */
+   ret = scan_columns_V2(minutiae, bdata, tbits, iw, ih, 0, iw,
+                         pdirection_map, plow_flow_map, phigh_curve_map,
+                         lfsparms);
+
+   arena_free(tbits);
+   return(ret);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: scan_columns_V2 - Scans the columns of a binary image starting in
+#cat:                the given range vertically, as done by
+#cat:                scan4minutiae_vertically_V2().  The second column of
+#cat:                a scan pair may lie past the range.
+
+   Input:
+      bdata     - binary image data (0==while & 1==black)
+      tbits     - the transpose of the binary image, packed one bit per
+                  pixel
+      iw        - width (in pixels) of image
+      ih        - height (in pixels) of image
+      first_col - first column scanned
+      last_col  - column after the last one scanned
+      pdirection_map  - pixelized Direction Map
+      plow_flow_map   - pixelized Low Ridge Flow Map
+      phigh_curve_map - pixelized High Curvature Map
+      lfsparms  - parameters and thresholds for controlling LFS
+   Output:
+      minutiae   - points to a list of detected minutia structures
+   Return Code:
+      Zero      - successful completion
+      Negative  - system error
+**************************************************************************/
+static int scan_columns_V2(MINUTIAE *minutiae,
+                unsigned char *bdata, const BITWORD *tbits,
+                const int iw, const int ih,
+                const int first_col, const int last_col,
+                int *pdirection_map, int *plow_flow_map, int *phigh_curve_map,
+                const LFSPARMS *lfsparms)
+{
+   int sx, sy, ex, ey, cx, cy, y2, ny, tstride;
    unsigned char *p1ptr, *p2ptr;
    int possible[NFEATURES], nposs;
    int ret;
 
-   /* Set scan region to entire image. */
-   sx = 0;
-   ex = iw;
+   /* Set scan region to the range of columns. */
+   sx = first_col;
+   ex = last_col;
    sy = 0;
    ey = ih;
+   tstride = BITIMAGE_STRIDE(ih);
 
    /* Start at first column in region. */
    cx = sx;
-   /* While second scan column not outside the right of the region ... */
-   while(cx+1 < ex){
+   /* While in the scan region and second scan column not outside */
+   /* the right of the image ...                                  */
+   while(cx < ex && cx+1 < iw){
+      /* Give up if the minutiae are no longer needed. */
+      if(lfs_cancelled(lfsparms))
+         return(LFS_CANCELLED);
       /* Start at beginning of new scan column in region. */
       cy = sy;
       /* While not at end of region's current scan column. */
       while(cy < ey){
+         /* Every second pair of a feature has different pixels, so */
+         /* move on to the pair before the next such pair.           */
+         ny = next_bitimage_diff(tbits+(cx*tstride), tbits+((cx+1)*tstride),
+                                 cy+1, ih) - 1;
+         if(ny > cy)
+            cy = ny;
          /* Get pixel pair from current y position in current and next */
          /* scan columns. */
          p1ptr = bdata+(cy*iw)+cx;
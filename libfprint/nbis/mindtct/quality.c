@@ -95,7 +95,7 @@ int gen_quality_map(int **oqmap, int *direction_map, int *low_contrast_map,
    int arrayPos, arrayPos2;
    int QualOffset;
 
-   QualMap = (int *)malloc(map_w * map_h * sizeof(int));
+   QualMap = (int *)arena_malloc(map_w * map_h * sizeof(int));
    if(QualMap == (int *)NULL){
       fprintf(stderr, "ERROR : gen_quality_map : malloc : QualMap\n");
       return(-2);
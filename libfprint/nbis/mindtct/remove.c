@@ -781,8 +781,8 @@ static int remove_malformations(MINUTIAE *minutiae,
                         print2log("%d,%d RMMAL3 (%f)\n",
                                   minutia->x, minutia->y, ratio);
                         if((ret = remove_minutia(i, minutiae))){
-                           free(x_list);
-                           free(y_list);
+                           arena_free(x_list);
+                           arena_free(y_list);
                            /* If system error, return error code. */
                            return(ret);
                         }
@@ -792,8 +792,8 @@ static int remove_malformations(MINUTIAE *minutiae,
                   }
                }
 
-               free(x_list);
-               free(y_list);
+               arena_free(x_list);
+               arena_free(y_list);
 
             }
          }
@@ -871,11 +871,11 @@ static int remove_near_invblock_V2(MINUTIAE *minutiae, int *direction_map,
    /*                           |    |                       */
 
    /* LUT for starting neighbor index given (ix, iy).        */
-   static int startblk[9] = { 6, 0, 0,
+   static const int startblk[9] = { 6, 0, 0,
                               6,-1, 2,
                               4, 4, 2 };
    /* LUT for ending neighbor index given (ix, iy).          */
-   static int endblk[9] =   { 8, 0, 2,
+   static const int endblk[9] =   { 8, 0, 2,
                               6,-1, 2,
                               6, 4, 4 };
 
@@ -889,8 +889,8 @@ static int remove_near_invblock_V2(MINUTIAE *minutiae, int *direction_map,
    /*                      5 4 3                                    */
    /*                                                               */
    /*                       0  1  2  3  4  5  6  7  8                    */
-   static int blkdx[9] = {  0, 1, 1, 1, 0,-1,-1,-1, 0 };  /* Delta-X     */
-   static int blkdy[9] = { -1,-1, 0, 1, 1, 1, 0,-1,-1 };  /* Delta-Y     */
+   static const int blkdx[9] = {  0, 1, 1, 1, 0,-1,-1,-1, 0 };  /* Delta-X     */
+   static const int blkdy[9] = { -1,-1, 0, 1, 1, 1, 0,-1,-1 };  /* Delta-Y     */
 
    print2log("\nREMOVING MINUTIA NEAR INVALID BLOCKS:\n");
 
@@ -1350,17 +1350,89 @@ static int remove_overlaps(MINUTIAE *minutiae,
    return(0);
 }
 
-static void mark_minutiae_in_range(MINUTIAE *minutiae, int *to_remove, int x, int y,
-                                   const LFSPARMS *lfsparms)
+/* Uniform grid over the minutiae, with cells as large as the minimum
+ * distance to the edge, so that edge points are only compared with the
+ * minutiae of the neighbouring cells rather than with the whole list. */
+typedef struct minutiae_grid {
+    int cell_size;
+    int gw, gh;
+    /* Minutiae of cell c are index[cell_start[c]] to index[cell_start[c+1]-1] */
+    int *cell_start;
+    int *index;
+} MINUTIAE_GRID;
+
+static int build_minutiae_grid(MINUTIAE_GRID *grid, const MINUTIAE *minutiae,
+                               const int iw, const int ih, const int cell_size)
 {
-    int i, dist;
+    int i, c, cx, cy;
+
+    grid->cell_size = cell_size;
+    grid->gw = (iw + cell_size - 1) / cell_size;
+    grid->gh = (ih + cell_size - 1) / cell_size;
+    grid->cell_start = calloc(grid->gw * grid->gh + 1, sizeof(int));
+    grid->index = malloc(max(minutiae->num, 1) * sizeof(int));
+    if (!grid->cell_start || !grid->index) {
+        free(grid->cell_start);
+        free(grid->index);
+        fprintf(stderr, "ERROR : build_minutiae_grid : malloc : grid\n");
+        return(-670);
+    }
+
+    /* Count the minutiae of each cell, then turn the counts into offsets
+     * and fill the cells in list order. */
+    for (i = 0; i < minutiae->num; i++) {
+        cx = min(max(minutiae->list[i]->x, 0), iw - 1) / cell_size;
+        cy = min(max(minutiae->list[i]->y, 0), ih - 1) / cell_size;
+        grid->cell_start[cy * grid->gw + cx + 1]++;
+    }
+    for (c = 0; c < grid->gw * grid->gh; c++)
+        grid->cell_start[c + 1] += grid->cell_start[c];
     for (i = 0; i < minutiae->num; i++) {
-        if (to_remove[i])
-            continue;
-        dist = (int)sqrt((x - minutiae->list[i]->x) * (x - minutiae->list[i]->x) +
-                         (y - minutiae->list[i]->y) * (y - minutiae->list[i]->y));
-        if (dist < lfsparms->min_pp_distance) {
-            to_remove[i] = 1;
+        cx = min(max(minutiae->list[i]->x, 0), iw - 1) / cell_size;
+        cy = min(max(minutiae->list[i]->y, 0), ih - 1) / cell_size;
+        grid->index[grid->cell_start[cy * grid->gw + cx]++] = i;
+    }
+    /* Filling bumped each offset to the start of the next cell. */
+    for (c = grid->gw * grid->gh; c > 0; c--)
+        grid->cell_start[c] = grid->cell_start[c - 1];
+    grid->cell_start[0] = 0;
+
+    return(0);
+}
+
+static void free_minutiae_grid(MINUTIAE_GRID *grid)
+{
+    free(grid->cell_start);
+    free(grid->index);
+}
+
+static void mark_minutiae_in_range(const MINUTIAE *minutiae,
+                                   const MINUTIAE_GRID *grid, int *to_remove,
+                                   int x, int y, const LFSPARMS *lfsparms)
+{
+    const int d = lfsparms->min_pp_distance;
+    int cx, cy, cx1, cy1, cx2, cy2, c, k, i, dx, dy;
+
+    /* Every minutia closer than d is in the cells overlapping the square
+     * of side 2d around the point. */
+    cx1 = max(x - d, 0) / grid->cell_size;
+    cy1 = max(y - d, 0) / grid->cell_size;
+    cx2 = min(max(x + d, 0) / grid->cell_size, grid->gw - 1);
+    cy2 = min(max(y + d, 0) / grid->cell_size, grid->gh - 1);
+
+    for (cy = cy1; cy <= cy2; cy++) {
+        for (cx = cx1; cx <= cx2; cx++) {
+            c = cy * grid->gw + cx;
+            for (k = grid->cell_start[c]; k < grid->cell_start[c + 1]; k++) {
+                i = grid->index[k];
+                if (to_remove[i])
+                    continue;
+                dx = x - minutiae->list[i]->x;
+                dy = y - minutiae->list[i]->y;
+                /* Same as (int)sqrt(dx*dx + dy*dy) < d, d being an integer */
+                if (dx * dx + dy * dy < d * d)
+                    to_remove[i] = 1;
+            }
         }
     }
 }
@@ -1392,6 +1464,7 @@ static int remove_perimeter_pts(MINUTIAE *minutiae,
     int *right, *right_up, *right_down;
     int removed = 0;
     int left_min, right_max;
+    MINUTIAE_GRID grid;
 
     if (!lfsparms->remove_perimeter_pts)
         return(0);
@@ -1475,14 +1548,33 @@ static int remove_perimeter_pts(MINUTIAE *minutiae,
     free(right_up);
     free(right_down);
 
+    /* Nothing is closer to the edge than a distance of 0 */
+    if (lfsparms->min_pp_distance <= 0) {
+        free(left);
+        free(right);
+        free(to_remove);
+        return (0);
+    }
+
+    if ((ret = build_minutiae_grid(&grid, minutiae, iw, ih,
+                                   lfsparms->min_pp_distance))) {
+        free(left);
+        free(right);
+        free(to_remove);
+        return(ret);
+    }
+
     /* Mark minitiae close to the edge */
     for (i = 0; i < ih; i++) {
         if (left[i] != -1)
-            mark_minutiae_in_range(minutiae, to_remove, left[i], i, lfsparms);
+            mark_minutiae_in_range(minutiae, &grid, to_remove, left[i], i,
+                                   lfsparms);
         if (right[i] != -1)
-            mark_minutiae_in_range(minutiae, to_remove, right[i], i, lfsparms);
+            mark_minutiae_in_range(minutiae, &grid, to_remove, right[i], i,
+                                   lfsparms);
     }
 
+    free_minutiae_grid(&grid);
     free(left);
     free(right);
 
@@ -2061,9 +2153,9 @@ static int remove_or_adjust_side_minutiae_V2(MINUTIAE *minutiae,
                   free(rot_y);
                   free_contour(contour_x, contour_y, contour_ex, contour_ey);
                   if(minmax_alloc > 0){
-                     free(minmax_val);
-                     free(minmax_type);
-                     free(minmax_i);
+                     arena_free(minmax_val);
+                     arena_free(minmax_type);
+                     arena_free(minmax_i);
                   }
                   /* Return error code. */
                   return(ret);
@@ -2107,9 +2199,9 @@ static int remove_or_adjust_side_minutiae_V2(MINUTIAE *minutiae,
                   free(rot_y);
                   free_contour(contour_x, contour_y, contour_ex, contour_ey);
                   if(minmax_alloc > 0){
-                     free(minmax_val);
-                     free(minmax_type);
-                     free(minmax_i);
+                     arena_free(minmax_val);
+                     arena_free(minmax_type);
+                     arena_free(minmax_i);
                   }
                   /* Return error code. */
                   return(ret);
@@ -2136,9 +2228,9 @@ static int remove_or_adjust_side_minutiae_V2(MINUTIAE *minutiae,
                free(rot_y);
                free_contour(contour_x, contour_y, contour_ex, contour_ey);
                if(minmax_alloc > 0){
-                  free(minmax_val);
-                  free(minmax_type);
-                  free(minmax_i);
+                  arena_free(minmax_val);
+                  arena_free(minmax_type);
+                  arena_free(minmax_i);
                }
                /* Return error code. */
                return(ret);
@@ -2150,9 +2242,9 @@ static int remove_or_adjust_side_minutiae_V2(MINUTIAE *minutiae,
          /* Deallocate contour and min/max buffers. */
          free_contour(contour_x, contour_y, contour_ex, contour_ey);
          if(minmax_alloc > 0){
-            free(minmax_val);
-            free(minmax_type);
-            free(minmax_i);
+            arena_free(minmax_val);
+            arena_free(minmax_type);
+            arena_free(minmax_i);
          }
       } /* End else contour extracted. */
    } /* End while not end of minutiae list. */
@@ -2199,6 +2291,10 @@ int remove_false_minutia_V2(MINUTIAE *minutiae,
       return(ret);
    }
 
+   /* Give up between the passes if the minutiae are no longer needed. */
+   if(lfs_cancelled(lfsparms))
+      return(LFS_CANCELLED);
+
    /* 2. Remove minutiae on lakes (filled with white pixels) and        */
    /*    islands (filled with black pixels), both  defined by a pair of */
    /*    minutia points.                                                */
@@ -2226,6 +2322,10 @@ int remove_false_minutia_V2(MINUTIAE *minutiae,
       return(ret);
    }
 
+   /* Give up between the passes if the minutiae are no longer needed. */
+   if(lfs_cancelled(lfsparms))
+      return(LFS_CANCELLED);
+
    /* 6. Remove or adjust minutiae that reside on the side of a ridge */
    /*    or valley.                                                   */
    if((ret = remove_or_adjust_side_minutiae_V2(minutiae, bdata, iw, ih,
@@ -2238,6 +2338,10 @@ int remove_false_minutia_V2(MINUTIAE *minutiae,
       return(ret);
    }
 
+   /* Give up between the passes if the minutiae are no longer needed. */
+   if(lfs_cancelled(lfsparms))
+      return(LFS_CANCELLED);
+
    /* 8. Remove minutiae that are on opposite sides of an overlap. */
    if((ret = remove_overlaps(minutiae, bdata, iw, ih, lfsparms))){
       return(ret);
@@ -2249,6 +2353,10 @@ int remove_false_minutia_V2(MINUTIAE *minutiae,
       return(ret);
    }
 
+   /* Give up between the passes if the minutiae are no longer needed. */
+   if(lfs_cancelled(lfsparms))
+      return(LFS_CANCELLED);
+
    /* 10. Remove minutiae that form long, narrow, loops in the */
    /*     "unreliable" regions in the binary image.            */
    if((ret = remove_pores_V2(minutiae,  bdata, iw, ih,
@@ -336,7 +336,7 @@ static int sort_neighbors(int *nbr_list, const int nnbrs, const int first,
 {
    double *join_thetas, theta;
    int i;
-   static double pi2 = M_PI*2.0;
+   static const double pi2 = M_PI*2.0;
 
    /* List of angles of lines joining the current primary to each */
    /* of the secondary neighbors.                                 */
@@ -363,7 +363,7 @@ static int sort_neighbors(int *nbr_list, const int nnbrs, const int first,
    }
 
    /* Sort the neighbor indicies into rank order. */
-   bubble_sort_double_inc_2(join_thetas, nbr_list, nnbrs);
+   sort_double_inc_2(join_thetas, nbr_list, nnbrs);
 
    /* Deallocate the list of angles. */
    free(join_thetas);
@@ -463,7 +463,7 @@ static int validate_ridge_crossing(const int ridge_start, const int ridge_end,
 {
    int ret;
    int feat_x, feat_y, edge_x, edge_y;
-   int *contour_x, *contour_y, *contour_ex, *contour_ey, ncontour;
+   int ncontour;
 
    /* Assign edge pixel pair for contour trace. */
    feat_x = xlist[ridge_end];
@@ -483,22 +483,11 @@ static int validate_ridge_crossing(const int ridge_start, const int ridge_end,
    /* the ridge start is on the black (of a black to white trans),   */
    /* so the edge trace needs to look for the what pixel (not the    */
    /* black one) of the ridge start transition.                      */	
-   ret = trace_contour(&contour_x, &contour_y,
-                       &contour_ex, &contour_ey, &ncontour,
-                       max_ridge_steps,
-                       xlist[ridge_start-1], ylist[ridge_start-1],
-                       feat_x, feat_y, edge_x, edge_y,
-                       SCAN_CLOCKWISE, bdata, iw, ih);
-   /* If a system error occurred ... */
-   if(ret < 0)
-      /* Return error code. */
-      return(ret);
-
-   /* Otherwise, if the trace was not IGNORED, then a contour was */
-   /* was generated and returned.  We aren't interested in the    */
-   /* actual contour, so deallocate it.                           */
-   if(ret != IGNORE)
-      free_contour(contour_x, contour_y, contour_ex, contour_ey);
+   /* We aren't interested in the actual contour, so it is only walked. */
+   ret = walk_contour(&ncontour, max_ridge_steps,
+                      xlist[ridge_start-1], ylist[ridge_start-1],
+                      feat_x, feat_y, edge_x, edge_y,
+                      SCAN_CLOCKWISE, bdata, iw, ih);
 
    /* If the trace was IGNORED, then we had some sort of initialization */
    /* problem, so treat this the same as if was actually located the    */
@@ -509,22 +498,10 @@ static int validate_ridge_crossing(const int ridge_start, const int ridge_end,
 
       /* Now conduct contour trace scanning for edge neighbors counter- */
       /* clockwise.                                                     */
-      ret = trace_contour(&contour_x, &contour_y,
-                          &contour_ex, &contour_ey, &ncontour,
-                          max_ridge_steps,
-                          xlist[ridge_start-1], ylist[ridge_start-1],
-                          feat_x, feat_y, edge_x, edge_y,
-                          SCAN_COUNTER_CLOCKWISE, bdata, iw, ih);
-      /* If a system error occurred ... */
-      if(ret < 0)
-         /* Return error code. */
-         return(ret);
-
-      /* Otherwise, if the trace was not IGNORED, then a contour was */
-      /* was generated and returned.  We aren't interested in the    */
-      /* actual contour, so deallocate it.                           */
-      if(ret != IGNORE)
-         free_contour(contour_x, contour_y, contour_ex, contour_ey);
+      ret = walk_contour(&ncontour, max_ridge_steps,
+                         xlist[ridge_start-1], ylist[ridge_start-1],
+                         feat_x, feat_y, edge_x, edge_y,
+                         SCAN_COUNTER_CLOCKWISE, bdata, iw, ih);
 
       /* If trace not IGNORED and ridge start not encounted in 2nd trace ... */
       if((ret != IGNORE) &&
@@ -587,8 +564,8 @@ static int ridge_count(const int first, const int second, MINUTIAE *minutiae,
    /* It there are no points on the line trajectory, then no ridges */
    /* to count (this should not happen, but just in case) ...       */
    if(num == 0){
-      free(xlist);
-      free(ylist);
+      arena_free(xlist);
+      arena_free(ylist);
       return(0);
    }
 
@@ -608,8 +585,8 @@ static int ridge_count(const int first, const int second, MINUTIAE *minutiae,
 
    /* If opposite pixel not found ... then no ridges to count */
    if(!found){
-      free(xlist);
-      free(ylist);
+      arena_free(xlist);
+      arena_free(ylist);
       return(0);
    }
 
@@ -624,8 +601,8 @@ static int ridge_count(const int first, const int second, MINUTIAE *minutiae,
       /* If 0-to-1 transition not found ... */
       if(!find_transition(&i, 0, 1, xlist, ylist, num, bdata, iw, ih)){
          /* Then we are done looking for ridges. */
-         free(xlist);
-         free(ylist);
+         arena_free(xlist);
+         arena_free(ylist);
 
          print2log("\n");
 
@@ -641,8 +618,8 @@ static int ridge_count(const int first, const int second, MINUTIAE *minutiae,
       /* If 1-to-0 transition not found ... */
       if(!find_transition(&i, 1, 0, xlist, ylist, num, bdata, iw, ih)){
          /* Then we are done looking for ridges. */
-         free(xlist);
-         free(ylist);
+         arena_free(xlist);
+         arena_free(ylist);
 
          print2log("\n");
 
@@ -668,8 +645,8 @@ static int ridge_count(const int first, const int second, MINUTIAE *minutiae,
 
       /* If system error ... */
       if(ret < 0){
-         free(xlist);
-         free(ylist);
+         arena_free(xlist);
+         arena_free(ylist);
          /* Return the error code. */
          return(ret);
       }
@@ -688,8 +665,8 @@ static int ridge_count(const int first, const int second, MINUTIAE *minutiae,
    }
 
    /* Deallocate working memories. */
-   free(xlist);
-   free(ylist);
+   arena_free(xlist);
+   arena_free(ylist);
 
    print2log("\n");
 
@@ -818,6 +795,9 @@ int count_minutiae_ridges(MINUTIAE *minutiae,
 
    /* Foreach remaining sorted minutia in list ... */
    for(i = 0; i < minutiae->num-1; i++){
+      /* Give up if the ridge counts are no longer needed. */
+      if(lfs_cancelled(lfsparms))
+         return(LFS_CANCELLED);
       /* Located neighbors and count number of ridges in between. */
       /* NOTE: neighbor and ridge count results are stored in     */
       /*       minutiae->list[i].                                 */
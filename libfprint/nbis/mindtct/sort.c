@@ -36,14 +36,15 @@ identified are necessarily the best available for the purpose.
                ROUTINES:
                         sort_indices_int_inc()
                         sort_indices_double_inc()
-                        bubble_sort_int_inc_2()
-                        bubble_sort_double_inc_2()
-                        bubble_sort_double_dec_2()
-                        bubble_sort_int_inc()
+                        sort_int_inc_2()
+                        sort_double_inc_2()
+                        sort_double_dec_2()
+                        sort_int_inc()
 ***********************************************************************/
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <lfs.h>
 
 /*************************************************************************
@@ -79,7 +80,7 @@ int sort_indices_int_inc(int **optr, int *ranks, const int num)
       order[i] = i;
 
    /* Sort the indecies into rank order. */
-   bubble_sort_int_inc_2(ranks, order, num);
+   sort_int_inc_2(ranks, order, num);
 
    /* Set output pointer to the resulting order of sorted indices. */
    *optr = order;
@@ -120,7 +121,7 @@ int sort_indices_double_inc(int **optr, double *ranks, const int num)
       order[i] = i;
 
    /* Sort the indicies into rank order. */
-   bubble_sort_double_inc_2(ranks, order, num);
+   sort_double_inc_2(ranks, order, num);
 
    /* Set output pointer to the resulting order of sorted indices. */
    *optr = order;
@@ -130,10 +131,157 @@ int sort_indices_double_inc(int **optr, double *ranks, const int num)
 
 /*************************************************************************
 **************************************************************************
-#cat: bubble_sort_int_inc_2 - Takes a list of integer ranks and a corresponding
-#cat:                         list of integer attributes, and sorts the ranks
-#cat:                         into increasing order moving the attributes
-#cat:                         correspondingly.
+   The sorts below are stable merge sorts: runs shorter than SORT_RUN_LEN
+   are sorted by insertion, then merged into a scratch copy. An element is
+   only ever moved ahead of another one if its rank must strictly come
+   first, so equal ranks keep their original order and the results are the
+   same as those of the bubble sorts these routines used to be. If no
+   scratch memory can be allocated, the whole list is sorted by insertion.
+**************************************************************************/
+#define SORT_RUN_LEN 16
+
+/* Nonzero if rank a must come strictly before rank b. */
+#define INT_BEFORE(a, b)           ((a) < (b))
+#define DOUBLE_BEFORE(a, b, dec)   ((dec) ? (a) > (b) : (a) < (b))
+
+static void insert_sort_int_2(int *ranks, int *items, const int len)
+{
+   int i, j, trank, titem;
+
+   for(i = 1; i < len; i++){
+      trank = ranks[i];
+      titem = items[i];
+      for(j = i; j > 0 && INT_BEFORE(trank, ranks[j-1]); j--){
+         ranks[j] = ranks[j-1];
+         items[j] = items[j-1];
+      }
+      ranks[j] = trank;
+      items[j] = titem;
+   }
+}
+
+static void merge_sort_int_2(int *ranks, int *items,
+                             int *tranks, int *titems, const int len)
+{
+   int half, i, p, n;
+
+   if(len < SORT_RUN_LEN){
+      insert_sort_int_2(ranks, items, len);
+      return;
+   }
+
+   half = len >> 1;
+   merge_sort_int_2(ranks, items, tranks, titems, half);
+   merge_sort_int_2(ranks+half, items+half, tranks, titems, len-half);
+
+   /* Already in order, nothing to merge. */
+   if(!INT_BEFORE(ranks[half], ranks[half-1]))
+      return;
+
+   /* Merge the first half, moved out of the way, with the second one. */
+   memcpy(tranks, ranks, half * sizeof(int));
+   memcpy(titems, items, half * sizeof(int));
+   for(i = 0, p = half, n = 0; i < half && p < len; n++){
+      if(INT_BEFORE(ranks[p], tranks[i])){
+         ranks[n] = ranks[p];
+         items[n] = items[p++];
+      }
+      else{
+         ranks[n] = tranks[i];
+         items[n] = titems[i++];
+      }
+   }
+   for(; i < half; i++, n++){
+      ranks[n] = tranks[i];
+      items[n] = titems[i];
+   }
+}
+
+static void insert_sort_double_2(double *ranks, int *items, const int len,
+                                 const int dec)
+{
+   int i, j, titem;
+   double trank;
+
+   for(i = 1; i < len; i++){
+      trank = ranks[i];
+      titem = items[i];
+      for(j = i; j > 0 && DOUBLE_BEFORE(trank, ranks[j-1], dec); j--){
+         ranks[j] = ranks[j-1];
+         items[j] = items[j-1];
+      }
+      ranks[j] = trank;
+      items[j] = titem;
+   }
+}
+
+static void merge_sort_double_2(double *ranks, int *items,
+                                double *tranks, int *titems, const int len,
+                                const int dec)
+{
+   int half, i, p, n;
+
+   if(len < SORT_RUN_LEN){
+      insert_sort_double_2(ranks, items, len, dec);
+      return;
+   }
+
+   half = len >> 1;
+   merge_sort_double_2(ranks, items, tranks, titems, half, dec);
+   merge_sort_double_2(ranks+half, items+half, tranks, titems, len-half, dec);
+
+   /* Already in order, nothing to merge. */
+   if(!DOUBLE_BEFORE(ranks[half], ranks[half-1], dec))
+      return;
+
+   /* Merge the first half, moved out of the way, with the second one. */
+   memcpy(tranks, ranks, half * sizeof(double));
+   memcpy(titems, items, half * sizeof(int));
+   for(i = 0, p = half, n = 0; i < half && p < len; n++){
+      if(DOUBLE_BEFORE(ranks[p], tranks[i], dec)){
+         ranks[n] = ranks[p];
+         items[n] = items[p++];
+      }
+      else{
+         ranks[n] = tranks[i];
+         items[n] = titems[i++];
+      }
+   }
+   for(; i < half; i++, n++){
+      ranks[n] = tranks[i];
+      items[n] = titems[i];
+   }
+}
+
+static void stable_sort_double_2(double *ranks, int *items, const int len,
+                                 const int dec)
+{
+   double *tranks;
+   int *titems;
+
+   if(len < SORT_RUN_LEN){
+      insert_sort_double_2(ranks, items, len, dec);
+      return;
+   }
+
+   /* Scratch space for the first half of the largest merge. */
+   tranks = (double *)malloc((len >> 1) * sizeof(double));
+   titems = (int *)malloc((len >> 1) * sizeof(int));
+   if(tranks == (double *)NULL || titems == (int *)NULL)
+      insert_sort_double_2(ranks, items, len, dec);
+   else
+      merge_sort_double_2(ranks, items, tranks, titems, len, dec);
+
+   free(tranks);
+   free(titems);
+}
+
+/*************************************************************************
+**************************************************************************
+#cat: sort_int_inc_2 - Takes a list of integer ranks and a corresponding
+#cat:                  list of integer attributes, and sorts the ranks
+#cat:                  into increasing order moving the attributes
+#cat:                  correspondingly. Equal ranks keep their order.
 
    Input:
       ranks     - list of integers to be sort on
@@ -143,48 +291,33 @@ int sort_indices_double_inc(int **optr, double *ranks, const int num)
       ranks     - list of integers sorted in increasing order
       items     - list of attributes in corresponding sorted order
 **************************************************************************/
-void bubble_sort_int_inc_2(int *ranks, int *items, const int len)
+void sort_int_inc_2(int *ranks, int *items, const int len)
 {
-   int done = 0;
-   int i, p, n, trank, titem;
-
-   /* Set counter to the length of the list being sorted. */
-   n = len;
-
-   /* While swaps in order continue to occur from the */
-   /* previous iteration...                           */
-   while(!done){
-      /* Reset the done flag to TRUE. */
-      done = TRUE;
-      /* Foreach rank in list up to current end index...               */
-      /* ("p" points to current rank and "i" points to the next rank.) */
-      for (i=1, p = 0; i<n; i++, p++){
-         /* If previous rank is < current rank ... */
-         if(ranks[p] > ranks[i]){
-            /* Swap ranks. */
-            trank = ranks[i];
-            ranks[i] = ranks[p];
-            ranks[p] = trank;
-            /* Swap items. */
-            titem = items[i];
-            items[i] = items[p];
-            items[p] = titem;
-            /* Changes were made, so set done flag to FALSE. */
-            done = FALSE;
-         }
-         /* Otherwise, rank pair is in order, so continue. */
-      }
-      /* Decrement the ending index. */
-      n--;
-   }     
+   int *tranks, *titems;
+
+   if(len < SORT_RUN_LEN){
+      insert_sort_int_2(ranks, items, len);
+      return;
+   }
+
+   /* Scratch space for the first half of the largest merge. */
+   tranks = (int *)malloc((len >> 1) * sizeof(int));
+   titems = (int *)malloc((len >> 1) * sizeof(int));
+   if(tranks == (int *)NULL || titems == (int *)NULL)
+      insert_sort_int_2(ranks, items, len);
+   else
+      merge_sort_int_2(ranks, items, tranks, titems, len);
+
+   free(tranks);
+   free(titems);
 }
 
 /*************************************************************************
 **************************************************************************
-#cat: bubble_sort_double_inc_2 - Takes a list of double ranks and a
+#cat: sort_double_inc_2 - Takes a list of double ranks and a
 #cat:              corresponding list of integer attributes, and sorts the
 #cat:              ranks into increasing order moving the attributes
-#cat:              correspondingly.
+#cat:              correspondingly. Equal ranks keep their order.
 
    Input:
       ranks     - list of double to be sort on
@@ -194,48 +327,16 @@ void bubble_sort_int_inc_2(int *ranks, int *items, const int len)
       ranks     - list of doubles sorted in increasing order
       items     - list of attributes in corresponding sorted order
 **************************************************************************/
-void bubble_sort_double_inc_2(double *ranks, int *items, const int len)
+void sort_double_inc_2(double *ranks, int *items, const int len)
 {
-   int done = 0;
-   int i, p, n, titem;
-   double trank;
-
-   /* Set counter to the length of the list being sorted. */
-   n = len;
-
-   /* While swaps in order continue to occur from the */
-   /* previous iteration...                           */
-   while(!done){
-      /* Reset the done flag to TRUE. */
-      done = TRUE;
-      /* Foreach rank in list up to current end index...               */
-      /* ("p" points to current rank and "i" points to the next rank.) */
-      for (i=1, p = 0; i<n; i++, p++){
-         /* If previous rank is < current rank ... */
-         if(ranks[p] > ranks[i]){
-            /* Swap ranks. */
-            trank = ranks[i];
-            ranks[i] = ranks[p];
-            ranks[p] = trank;
-            /* Swap items. */
-            titem = items[i];
-            items[i] = items[p];
-            items[p] = titem;
-            /* Changes were made, so set done flag to FALSE. */
-            done = FALSE;
-         }
-         /* Otherwise, rank pair is in order, so continue. */
-      }
-      /* Decrement the ending index. */
-      n--;
-   }     
+   stable_sort_double_2(ranks, items, len, FALSE);
 }
 
 /***************************************************************************
 **************************************************************************
-#cat: bubble_sort_double_dec_2 - Conducts a simple bubble sort returning a list
-#cat:        of ranks in decreasing order and their associated items in sorted
-#cat:        order as well.
+#cat: sort_double_dec_2 - Returns a list of ranks in decreasing order and
+#cat:        their associated items in sorted order as well. Equal ranks
+#cat:        keep their order.
 
    Input:
       ranks - list of values to be sorted
@@ -247,37 +348,15 @@ void bubble_sort_double_inc_2(double *ranks, int *items, const int len)
               If these items are indices, upon return, they may be used as
               indirect addresses reflecting the sorted order of the ranks.
 ****************************************************************************/
-void bubble_sort_double_dec_2(double *ranks, int *items,  const int len)
+void sort_double_dec_2(double *ranks, int *items,  const int len)
 {
-   int done = 0;
-   int i, p, n, titem;
-   double trank;
-
-   n = len;
-   while(!done){
-      done = 1;
-      for (i=1, p = 0;i<n;i++, p++){
-         /* If previous rank is < current rank ... */
-         if(ranks[p] < ranks[i]){
-            /* Swap ranks */
-            trank = ranks[i];
-            ranks[i] = ranks[p];
-            ranks[p] = trank;
-            /* Swap corresponding items */
-            titem = items[i];
-            items[i] = items[p];
-            items[p] = titem;
-            done = 0;
-         }
-      }
-      n--;
-   }     
+   stable_sort_double_2(ranks, items, len, TRUE);
 }
 
 /*************************************************************************
 **************************************************************************
-#cat: bubble_sort_int_inc - Takes a list of integers and sorts them into
-#cat:            increasing order using a simple bubble sort.
+#cat: sort_int_inc - Takes a list of integers and sorts them into
+#cat:            increasing order.
 
    Input:
       ranks     - list of integers to be sort on
@@ -285,36 +364,16 @@ void bubble_sort_double_dec_2(double *ranks, int *items,  const int len)
    Output:
       ranks     - list of integers sorted in increasing order
 **************************************************************************/
-void bubble_sort_int_inc(int *ranks, const int len)
+static int cmp_int_inc(const void *a, const void *b)
 {
-   int done = 0;
-   int i, p, n;
-   int trank;
-
-   /* Set counter to the length of the list being sorted. */
-   n = len;
-
-   /* While swaps in order continue to occur from the */
-   /* previous iteration...                           */
-   while(!done){
-      /* Reset the done flag to TRUE. */
-      done = TRUE;
-      /* Foreach rank in list up to current end index...               */
-      /* ("p" points to current rank and "i" points to the next rank.) */
-      for (i=1, p = 0; i<n; i++, p++){
-         /* If previous rank is < current rank ... */
-         if(ranks[p] > ranks[i]){
-            /* Swap ranks. */
-            trank = ranks[i];
-            ranks[i] = ranks[p];
-            ranks[p] = trank;
-            /* Changes were made, so set done flag to FALSE. */
-            done = FALSE;
-         }
-         /* Otherwise, rank pair is in order, so continue. */
-      }
-      /* Decrement the ending index. */
-      n--;
-   }     
+   const int x = *(const int *)a;
+   const int y = *(const int *)b;
+
+   return (x > y) - (x < y);
 }
 
+void sort_int_inc(int *ranks, const int len)
+{
+   /* Equal integers can't be told apart, so stability does not matter. */
+   qsort(ranks, len, sizeof(int), cmp_int_inc);
+}
@@ -0,0 +1,373 @@
+/*
+ * OpenCL offload of gallery identification
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "offload"
+
+#include <errno.h>
+#include <string.h>
+
+#define CL_TARGET_OPENCL_VERSION 120
+#include <CL/cl.h>
+#include <glib.h>
+
+#include "fp_internal.h"
+#include "nbis/include/bozorth.h"
+
+/*
+ * The device scores a probe against every sample of a gallery at once, one
+ * work item per sample, by counting the edges of the sample that bz_match()
+ * would pair with an edge of the probe. That is the first step of the
+ * Bozorth matcher, and the only one which is regular enough for a GPU: the
+ * pairs are then grouped by rotation and linked into clusters, which
+ * branches too much. The count ranks the samples, and the best ones are
+ * scored exactly by the matcher, on the CPU.
+ *
+ * The edge tables of the samples stay in device memory, and are only
+ * uploaded again after the gallery changed. Edges are stored as three
+ * columns of total_edges values each: squared distance, then both beta
+ * angles, in the order of the matcher templates, which is by increasing
+ * distance.
+ */
+
+#define STR(x)		#x
+#define XSTR(x)		STR(x)
+
+static const char kernel_source[] =
+"__kernel void count_pairs(__global const short *edges,\n"
+"	__global const int *starts, int total_edges,\n"
+"	__global const short *probe, int probe_len,\n"
+"	int nr_samples, __global int *counts)\n"
+"{\n"
+"	int s = get_global_id(0);\n"
+"	int first, last, j, k, count = 0;\n"
+"\n"
+"	if (s >= nr_samples)\n"
+"		return;\n"
+"	first = starts[s];\n"
+"	last = starts[s + 1];\n"
+"\n"
+"	/* same tests, in the same order, as bz_match() */\n"
+"	for (k = 0; k < probe_len; k++) {\n"
+"		float pdist = probe[k];\n"
+"\n"
+"		for (j = first; j < last; j++) {\n"
+"			float fdist = edges[j];\n"
+"			float dz = fdist - pdist;\n"
+"			float fi = (2.0f * " XSTR(TK) ") * (fdist + pdist);\n"
+"			int i;\n"
+"\n"
+"			if (dz * dz > fi * fi) {\n"
+"				if (dz < 0) {\n"
+"					first = j + 1;\n"
+"					continue;\n"
+"				}\n"
+"				break;\n"
+"			}\n"
+"			for (i = 1; i < 3; i++) {\n"
+"				float db = probe[i * probe_len + k] -\n"
+"					edges[i * total_edges + j];\n"
+"\n"
+"				if (db * db > " XSTR(TXS) " && db * db < " XSTR(CTXS) ")\n"
+"					break;\n"
+"			}\n"
+"			if (i == 3)\n"
+"				count++;\n"
+"		}\n"
+"	}\n"
+"	counts[s] = count;\n"
+"}\n";
+
+struct fpi_offload {
+	/* uploads and scoring share the buffers, one at a time */
+	GMutex lock;
+	cl_context context;
+	cl_command_queue queue;
+	cl_program program;
+	cl_kernel kernel;
+	/* resident copy of the gallery, see fpi_offload_score() */
+	gboolean uploaded;
+	unsigned int generation;
+	cl_mem edges;
+	cl_mem starts;
+	cl_mem counts;
+	int total_edges;
+	int nr_samples;
+	/* print of each sample, as an offset in the gallery */
+	int *owners;
+};
+
+static cl_device_id find_device(void)
+{
+	static const cl_device_type types[] = {
+		CL_DEVICE_TYPE_GPU,
+		CL_DEVICE_TYPE_ACCELERATOR,
+	};
+	cl_platform_id platforms[8];
+	cl_uint nr_platforms, i, t;
+	cl_device_id device;
+	cl_uint nr_devices;
+
+	if (clGetPlatformIDs(G_N_ELEMENTS(platforms), platforms,
+			&nr_platforms) != CL_SUCCESS)
+		return NULL;
+	nr_platforms = MIN(nr_platforms, G_N_ELEMENTS(platforms));
+
+	/* the CPU already runs the matcher, an OpenCL CPU device would only
+	 * compete with it */
+	for (t = 0; t < G_N_ELEMENTS(types); t++)
+		for (i = 0; i < nr_platforms; i++)
+			if (clGetDeviceIDs(platforms[i], types[t], 1, &device,
+					&nr_devices) == CL_SUCCESS && nr_devices)
+				return device;
+	return NULL;
+}
+
+static void release_gallery(struct fpi_offload *offload)
+{
+	if (offload->edges)
+		clReleaseMemObject(offload->edges);
+	if (offload->starts)
+		clReleaseMemObject(offload->starts);
+	if (offload->counts)
+		clReleaseMemObject(offload->counts);
+	offload->edges = offload->starts = offload->counts = NULL;
+	g_free(offload->owners);
+	offload->owners = NULL;
+	offload->uploaded = FALSE;
+}
+
+/* Sets up the first GPU or accelerator found, returns NULL if there is
+ * none */
+struct fpi_offload *fpi_offload_new(void)
+{
+	struct fpi_offload *offload;
+	const char *source = kernel_source;
+	char name[128];
+	cl_device_id device;
+	cl_int err;
+
+	device = find_device();
+	if (!device) {
+		fp_dbg("no OpenCL device");
+		return NULL;
+	}
+	if (clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name), name,
+			NULL) == CL_SUCCESS)
+		fp_dbg("using %s", name);
+
+	offload = g_malloc0(sizeof(*offload));
+	g_mutex_init(&offload->lock);
+
+	offload->context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+	if (!offload->context)
+		goto err;
+	offload->queue = clCreateCommandQueue(offload->context, device, 0, &err);
+	if (!offload->queue)
+		goto err;
+	offload->program = clCreateProgramWithSource(offload->context, 1,
+		&source, NULL, &err);
+	if (!offload->program)
+		goto err;
+	err = clBuildProgram(offload->program, 1, &device, NULL, NULL, NULL);
+	if (err != CL_SUCCESS)
+		goto err;
+	offload->kernel = clCreateKernel(offload->program, "count_pairs", &err);
+	if (!offload->kernel)
+		goto err;
+	return offload;
+
+err:
+	fp_err("OpenCL setup failed: %d", err);
+	fpi_offload_free(offload);
+	return NULL;
+}
+
+void fpi_offload_free(struct fpi_offload *offload)
+{
+	if (!offload)
+		return;
+
+	release_gallery(offload);
+	if (offload->kernel)
+		clReleaseKernel(offload->kernel);
+	if (offload->program)
+		clReleaseProgram(offload->program);
+	if (offload->queue)
+		clReleaseCommandQueue(offload->queue);
+	if (offload->context)
+		clReleaseContext(offload->context);
+	g_mutex_clear(&offload->lock);
+	g_free(offload);
+}
+
+/* Copies the edge tables of all samples of prints to the device. NULL
+ * prints, and samples without a template, get no edges. */
+static int upload_gallery(struct fpi_offload *offload,
+	struct fp_print_data **prints, int nr_prints)
+{
+	GPtrArray *tmpls = g_ptr_array_new();
+	GArray *owners = g_array_new(FALSE, FALSE, sizeof(int));
+	cl_int *starts;
+	cl_short *edges;
+	cl_int err;
+	int total = 0;
+	guint i;
+	int p, c;
+
+	release_gallery(offload);
+
+	for (p = 0; p < nr_prints; p++) {
+		GSList *item;
+
+		if (!prints[p])
+			continue;
+		for (item = prints[p]->prints; item; item = item->next) {
+			struct bz_template *tmpl;
+
+			tmpl = fpi_print_data_item_get_template(item->data);
+			if (!tmpl || tmpl->nedges > G_MAXINT / 3 - total)
+				continue;
+			g_ptr_array_add(tmpls, tmpl);
+			g_array_append_val(owners, p);
+			total += tmpl->nedges;
+		}
+	}
+
+	starts = g_new(cl_int, tmpls->len + 1);
+	edges = g_new(cl_short, 3 * MAX(total, 1));
+	starts[0] = 0;
+	for (i = 0; i < tmpls->len; i++) {
+		struct bz_template *tmpl = g_ptr_array_index(tmpls, i);
+
+		for (c = 0; c < 3; c++)
+			memcpy(edges + c * total + starts[i],
+				BZ_TEMPLATE_COL(tmpl, c),
+				tmpl->nedges * sizeof(short));
+		starts[i + 1] = starts[i] + tmpl->nedges;
+	}
+
+	offload->edges = clCreateBuffer(offload->context,
+		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		3 * MAX(total, 1) * sizeof(cl_short), edges, &err);
+	if (offload->edges)
+		offload->starts = clCreateBuffer(offload->context,
+			CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			(tmpls->len + 1) * sizeof(cl_int), starts, &err);
+	if (offload->starts)
+		offload->counts = clCreateBuffer(offload->context,
+			CL_MEM_WRITE_ONLY, MAX(tmpls->len, 1) * sizeof(cl_int),
+			NULL, &err);
+	g_free(edges);
+	g_free(starts);
+	g_ptr_array_free(tmpls, TRUE);
+
+	offload->total_edges = total;
+	offload->nr_samples = owners->len;
+	offload->owners = (int *) g_array_free(owners, FALSE);
+	if (!offload->counts) {
+		fp_err("couldn't upload %d edges: %d", total, err);
+		release_gallery(offload);
+		return -ENOMEM;
+	}
+
+	fp_dbg("%d samples, %d edges", offload->nr_samples, total);
+	offload->uploaded = TRUE;
+	return 0;
+}
+
+/* Counts the edge pairs between probe and each print, keeping the best
+ * count over the samples of a print, or -1 for NULL prints. The prints are
+ * only uploaded when generation differs from the one last uploaded, so
+ * callers must change it whenever prints change. */
+int fpi_offload_score(struct fpi_offload *offload,
+	struct fp_print_data **prints, int nr_prints, unsigned int generation,
+	struct bz_template *probe, int *scores)
+{
+	cl_short *probe_edges;
+	cl_int *counts = NULL;
+	cl_mem probe_mem = NULL;
+	size_t global_size;
+	cl_int err, probe_len = probe->nedges;
+	int r = 0;
+	int c, s;
+
+	for (s = 0; s < nr_prints; s++)
+		scores[s] = -1;
+
+	g_mutex_lock(&offload->lock);
+	if (!offload->uploaded || offload->generation != generation) {
+		r = upload_gallery(offload, prints, nr_prints);
+		if (r < 0)
+			goto out;
+		offload->generation = generation;
+	}
+	if (offload->nr_samples == 0 || probe_len == 0)
+		goto out;
+
+	probe_edges = g_new(cl_short, 3 * probe_len);
+	for (c = 0; c < 3; c++)
+		memcpy(probe_edges + c * probe_len, BZ_TEMPLATE_COL(probe, c),
+			probe_len * sizeof(short));
+	probe_mem = clCreateBuffer(offload->context,
+		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		3 * probe_len * sizeof(cl_short), probe_edges, &err);
+	g_free(probe_edges);
+	if (!probe_mem)
+		goto err;
+
+	err = clSetKernelArg(offload->kernel, 0, sizeof(cl_mem), &offload->edges);
+	err |= clSetKernelArg(offload->kernel, 1, sizeof(cl_mem), &offload->starts);
+	err |= clSetKernelArg(offload->kernel, 2, sizeof(cl_int),
+		&offload->total_edges);
+	err |= clSetKernelArg(offload->kernel, 3, sizeof(cl_mem), &probe_mem);
+	err |= clSetKernelArg(offload->kernel, 4, sizeof(cl_int), &probe_len);
+	err |= clSetKernelArg(offload->kernel, 5, sizeof(cl_int),
+		&offload->nr_samples);
+	err |= clSetKernelArg(offload->kernel, 6, sizeof(cl_mem), &offload->counts);
+	if (err != CL_SUCCESS)
+		goto err;
+
+	global_size = offload->nr_samples;
+	err = clEnqueueNDRangeKernel(offload->queue, offload->kernel, 1, NULL,
+		&global_size, NULL, 0, NULL, NULL);
+	if (err != CL_SUCCESS)
+		goto err;
+
+	counts = g_new(cl_int, offload->nr_samples);
+	err = clEnqueueReadBuffer(offload->queue, offload->counts, CL_TRUE, 0,
+		offload->nr_samples * sizeof(cl_int), counts, 0, NULL, NULL);
+	if (err != CL_SUCCESS)
+		goto err;
+
+	for (s = 0; s < offload->nr_samples; s++) {
+		int p = offload->owners[s];
+
+		scores[p] = MAX(scores[p], counts[s]);
+	}
+	goto out;
+
+err:
+	fp_err("OpenCL scoring failed: %d", err);
+	r = -EIO;
+out:
+	if (probe_mem)
+		clReleaseMemObject(probe_mem);
+	g_free(counts);
+	g_mutex_unlock(&offload->lock);
+	return r;
+}
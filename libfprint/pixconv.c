@@ -0,0 +1,328 @@
+/*
+ * Raw sensor data conversion routines
+ * Copyright (C) 2015 Vasily Khoruzhick <anarsoul@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "pixconv"
+
+#include <glib.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "fp_internal.h"
+
+/* Pixel conversion kernels.
+ *
+ * Drivers turn the raw data of each frame into 8-bit grayscale pixels before
+ * handing it over to the image processing. As with the pixel difference
+ * kernels of the assembling code, the vector versions are picked at build
+ * time and the scalar loops handle the remaining pixels.
+ */
+
+/* Expand 4-bit pixels, high nibble first, to 8 bits: nibble n becomes n << 4.
+ * out must hold 2 * size pixels. */
+void fpi_expand_4bpp(const unsigned char *in, unsigned int size,
+		     unsigned char *out)
+{
+	unsigned int i = 0;
+
+#if defined(__SSE2__)
+	__m128i mask = _mm_set1_epi8(0xf0);
+
+	for (; i + 16 <= size; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+		__m128i hi = _mm_and_si128(v, mask);
+		__m128i lo = _mm_and_si128(_mm_slli_epi16(v, 4), mask);
+		_mm_storeu_si128((__m128i *)(out + 2 * i),
+				 _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i *)(out + 2 * i + 16),
+				 _mm_unpackhi_epi8(hi, lo));
+	}
+#elif defined(__ARM_NEON)
+	uint8x16_t mask = vdupq_n_u8(0xf0);
+
+	for (; i + 16 <= size; i += 16) {
+		uint8x16_t v = vld1q_u8(in + i);
+		uint8x16x2_t px;
+
+		px.val[0] = vandq_u8(v, mask);
+		px.val[1] = vshlq_n_u8(v, 4);
+		vst2q_u8(out + 2 * i, px);
+	}
+#endif
+
+	for (; i < size; i++) {
+		out[2 * i] = in[i] & 0xf0;
+		out[2 * i + 1] = in[i] << 4;
+	}
+}
+
+/* Smallest and largest of size 16-bit pixels */
+void fpi_minmax_u16(const unsigned short *in, unsigned int size,
+		    unsigned short *min, unsigned short *max)
+{
+	unsigned short mn = 0xffff, mx = 0;
+	unsigned int i = 0;
+
+#if defined(__SSE2__)
+	if (size >= 8) {
+		/* SSE2 only compares signed words: flip the sign bit around */
+		__m128i bias = _mm_set1_epi16((short)0x8000);
+		__m128i vmin = _mm_set1_epi16(0x7fff);
+		__m128i vmax = _mm_set1_epi16((short)0x8000);
+		unsigned short lanes[8];
+		int j;
+
+		for (; i + 8 <= size; i += 8) {
+			__m128i v = _mm_xor_si128(bias,
+				_mm_loadu_si128((const __m128i *)(in + i)));
+			vmin = _mm_min_epi16(vmin, v);
+			vmax = _mm_max_epi16(vmax, v);
+		}
+		_mm_storeu_si128((__m128i *)lanes, _mm_xor_si128(vmin, bias));
+		for (j = 0; j < 8; j++)
+			mn = MIN(mn, lanes[j]);
+		_mm_storeu_si128((__m128i *)lanes, _mm_xor_si128(vmax, bias));
+		for (j = 0; j < 8; j++)
+			mx = MAX(mx, lanes[j]);
+	}
+#elif defined(__ARM_NEON)
+	if (size >= 8) {
+		uint16x8_t vmin = vdupq_n_u16(0xffff);
+		uint16x8_t vmax = vdupq_n_u16(0);
+		uint16x4_t m;
+
+		for (; i + 8 <= size; i += 8) {
+			uint16x8_t v = vld1q_u16(in + i);
+			vmin = vminq_u16(vmin, v);
+			vmax = vmaxq_u16(vmax, v);
+		}
+		m = vpmin_u16(vget_low_u16(vmin), vget_high_u16(vmin));
+		m = vpmin_u16(m, m);
+		m = vpmin_u16(m, m);
+		mn = vget_lane_u16(m, 0);
+		m = vpmax_u16(vget_low_u16(vmax), vget_high_u16(vmax));
+		m = vpmax_u16(m, m);
+		m = vpmax_u16(m, m);
+		mx = vget_lane_u16(m, 0);
+	}
+#endif
+
+	for (; i < size; i++) {
+		if (in[i] < mn)
+			mn = in[i];
+		if (in[i] > mx)
+			mx = in[i];
+	}
+
+	*min = mn;
+	*max = mx;
+}
+
+/* Stretch 16-bit pixels so that min and max become 0 and 255:
+ * (px - min) * 255 / (max - min), clamped.
+ *
+ * The vector versions divide with a float reciprocal. The numerators stay
+ * below 2^24, so their products with the quotients are exact in single
+ * precision, which allows to correct the quotient when the rounding of the
+ * reciprocal makes it off by one: the result is the same as the integer
+ * division. */
+void fpi_normalize_u16(const unsigned short *in, unsigned int size,
+		       unsigned short min, unsigned short max,
+		       unsigned char *out)
+{
+	unsigned int range = max - min;
+	unsigned int i = 0;
+
+	if (max <= min) {
+		/* everything is either at or below min, or above max */
+		for (i = 0; i < size; i++)
+			out[i] = in[i] <= min ? 0 : 0xff;
+		return;
+	}
+
+#if defined(__SSE2__)
+	{
+		__m128i bias = _mm_set1_epi16((short)0x8000);
+		__m128i vmin = _mm_set1_epi16(min ^ 0x8000);
+		__m128i vmax = _mm_set1_epi16(max ^ 0x8000);
+		__m128i vbase = _mm_set1_epi16(min);
+		__m128i zero = _mm_setzero_si128();
+		__m128 d = _mm_set1_ps(range);
+		__m128 inv = _mm_set1_ps(1.0f / range);
+		__m128 one = _mm_set1_ps(1.0f);
+		__m128 k = _mm_set1_ps(255.0f);
+		__m128i q[2];
+
+		for (; i + 8 <= size; i += 8) {
+			__m128i v = _mm_xor_si128(bias,
+				_mm_loadu_si128((const __m128i *)(in + i)));
+			int j;
+
+			/* clamp to [min, max], then offset from min */
+			v = _mm_max_epi16(_mm_min_epi16(v, vmax), vmin);
+			v = _mm_sub_epi16(_mm_xor_si128(v, bias), vbase);
+
+			for (j = 0; j < 2; j++) {
+				__m128i n32 = j ? _mm_unpackhi_epi16(v, zero)
+						: _mm_unpacklo_epi16(v, zero);
+				__m128 n = _mm_mul_ps(_mm_cvtepi32_ps(n32), k);
+				__m128 qf = _mm_cvtepi32_ps(
+					_mm_cvttps_epi32(_mm_mul_ps(n, inv)));
+				__m128 over = _mm_cmpgt_ps(_mm_mul_ps(qf, d), n);
+				__m128 under = _mm_cmple_ps(
+					_mm_mul_ps(_mm_add_ps(qf, one), d), n);
+
+				qf = _mm_sub_ps(qf, _mm_and_ps(over, one));
+				qf = _mm_add_ps(qf, _mm_and_ps(under, one));
+				q[j] = _mm_cvttps_epi32(qf);
+			}
+			_mm_storel_epi64((__m128i *)(out + i),
+				_mm_packus_epi16(_mm_packs_epi32(q[0], q[1]),
+						 zero));
+		}
+	}
+#elif defined(__ARM_NEON)
+	{
+		uint16x8_t vmin = vdupq_n_u16(min);
+		uint16x8_t vmax = vdupq_n_u16(max);
+		float32x4_t d = vdupq_n_f32(range);
+		float32x4_t inv = vdupq_n_f32(1.0f / range);
+		uint32x4_t one = vdupq_n_u32(1);
+
+		for (; i + 8 <= size; i += 8) {
+			uint16x8_t v = vld1q_u16(in + i);
+			uint32x4_t q[2];
+			int j;
+
+			v = vsubq_u16(vmaxq_u16(vminq_u16(v, vmax), vmin), vmin);
+
+			for (j = 0; j < 2; j++) {
+				uint32x4_t n32 = vmull_n_u16(
+					j ? vget_high_u16(v) : vget_low_u16(v), 255);
+				float32x4_t n = vcvtq_f32_u32(n32);
+				uint32x4_t qi = vcvtq_u32_f32(vmulq_f32(n, inv));
+				float32x4_t qf = vcvtq_f32_u32(qi);
+				uint32x4_t over = vcgtq_f32(vmulq_f32(qf, d), n);
+				uint32x4_t under = vcleq_f32(
+					vmulq_f32(vaddq_f32(qf, vdupq_n_f32(1.0f)), d),
+					n);
+
+				qi = vsubq_u32(qi, vandq_u32(over, one));
+				q[j] = vaddq_u32(qi, vandq_u32(under, one));
+			}
+			vst1_u8(out + i, vmovn_u16(vcombine_u16(vmovn_u32(q[0]),
+								vmovn_u32(q[1]))));
+		}
+	}
+#endif
+
+	for (; i < size; i++) {
+		unsigned short px = in[i];
+
+		if (px <= min)
+			out[i] = 0;
+		else if (px >= max)
+			out[i] = 0xff;
+		else
+			out[i] = (px - min) * 0xff / range;
+	}
+}
+
+/* Transpose a width x height block of 16-bit pixels: the pixel at row y,
+ * column x of in is stored at row x, column y of out. Strides are in pixels.
+ * The vector versions move 8x8 tiles at once. */
+void fpi_transpose_u16(const unsigned short *in, unsigned int in_stride,
+		       unsigned short *out, unsigned int out_stride,
+		       unsigned int width, unsigned int height)
+{
+	unsigned int x, y, tx = 0, ty = 0;
+
+#if defined(__SSE2__) || defined(__ARM_NEON)
+	tx = width & ~7U;
+	ty = height & ~7U;
+
+	for (y = 0; y < ty; y += 8)
+		for (x = 0; x < tx; x += 8) {
+			const unsigned short *src = in + y * in_stride + x;
+			unsigned short *dst = out + x * out_stride + y;
+#if defined(__SSE2__)
+			__m128i r[8], a[8], b[8];
+			int i;
+
+			for (i = 0; i < 8; i++)
+				r[i] = _mm_loadu_si128(
+					(const __m128i *)(src + i * in_stride));
+			for (i = 0; i < 4; i++) {
+				a[2 * i] = _mm_unpacklo_epi16(r[2 * i], r[2 * i + 1]);
+				a[2 * i + 1] = _mm_unpackhi_epi16(r[2 * i], r[2 * i + 1]);
+			}
+			for (i = 0; i < 2; i++) {
+				b[4 * i] = _mm_unpacklo_epi32(a[4 * i], a[4 * i + 2]);
+				b[4 * i + 1] = _mm_unpackhi_epi32(a[4 * i], a[4 * i + 2]);
+				b[4 * i + 2] = _mm_unpacklo_epi32(a[4 * i + 1], a[4 * i + 3]);
+				b[4 * i + 3] = _mm_unpackhi_epi32(a[4 * i + 1], a[4 * i + 3]);
+			}
+			for (i = 0; i < 4; i++) {
+				_mm_storeu_si128((__m128i *)(dst + (2 * i) * out_stride),
+					_mm_unpacklo_epi64(b[i], b[i + 4]));
+				_mm_storeu_si128((__m128i *)(dst + (2 * i + 1) * out_stride),
+					_mm_unpackhi_epi64(b[i], b[i + 4]));
+			}
+#else
+			uint16x8_t r[8];
+			uint16x8x2_t t16[4];
+			uint32x4x2_t t32[4];
+			int i;
+
+			for (i = 0; i < 8; i++)
+				r[i] = vld1q_u16(src + i * in_stride);
+			for (i = 0; i < 4; i++)
+				t16[i] = vtrnq_u16(r[2 * i], r[2 * i + 1]);
+			for (i = 0; i < 2; i++) {
+				t32[2 * i] = vtrnq_u32(
+					vreinterpretq_u32_u16(t16[2 * i].val[0]),
+					vreinterpretq_u32_u16(t16[2 * i + 1].val[0]));
+				t32[2 * i + 1] = vtrnq_u32(
+					vreinterpretq_u32_u16(t16[2 * i].val[1]),
+					vreinterpretq_u32_u16(t16[2 * i + 1].val[1]));
+			}
+			for (i = 0; i < 4; i++) {
+				uint32x4_t lo = t32[i & 1].val[i >> 1];
+				uint32x4_t hi = t32[2 + (i & 1)].val[i >> 1];
+
+				vst1q_u16(dst + i * out_stride, vreinterpretq_u16_u32(
+					vcombine_u32(vget_low_u32(lo), vget_low_u32(hi))));
+				vst1q_u16(dst + (i + 4) * out_stride, vreinterpretq_u16_u32(
+					vcombine_u32(vget_high_u32(lo), vget_high_u32(hi))));
+			}
+#endif
+		}
+#endif
+
+	/* the columns right of the tiles, then the rows below them */
+	for (y = 0; y < ty; y++)
+		for (x = tx; x < width; x++)
+			out[x * out_stride + y] = in[y * in_stride + x];
+	for (y = ty; y < height; y++)
+		for (x = 0; x < width; x++)
+			out[x * out_stride + y] = in[y * in_stride + x];
+}
@@ -23,6 +23,83 @@
 
 #include "fp_internal.h"
 
+/* Largest factor handled by resize_bilinear(), the weights must fit in 16
+ * bits */
+#define MAX_FAST_FACTOR	4
+
+/* Source pixel to the left of (or above) each destination pixel, and weight
+ * of the next source pixel, in 1/(2 * factor) units. Pixels are sampled at
+ * their centers, like pixman does. */
+static void scale_weights(int size, unsigned int factor, int *index,
+	unsigned int *weight)
+{
+	int i;
+
+	for (i = 0; i < size * factor; i++) {
+		int pos = 2 * i + 1 - factor;
+
+		index[i] = pos < 0 ? -1 : pos / (2 * factor);
+		weight[i] = pos - 2 * factor * index[i];
+	}
+}
+
+/* Integer bilinear upscaling by small factors, without going through the
+ * generic transform code. As with pixman, the pixels outside the source image
+ * are taken as 0. */
+static void resize_bilinear(struct fp_img *img, unsigned char *dst,
+	unsigned int w_factor, unsigned int h_factor)
+{
+	int width = img->width;
+	int height = img->height;
+	int new_width = width * w_factor;
+	int new_height = height * h_factor;
+	unsigned int norm = 4 * w_factor * h_factor;
+	int *xindex = g_new(int, new_width);
+	unsigned int *xweight = g_new(unsigned int, new_width);
+	int *yindex = g_new(int, new_height);
+	unsigned int *yweight = g_new(unsigned int, new_height);
+	/* Vertically blended row, padded with a 0 on each side */
+	uint16_t *row = g_new0(uint16_t, width + 2);
+	int x, y;
+
+	scale_weights(width, w_factor, xindex, xweight);
+	scale_weights(height, h_factor, yindex, yweight);
+
+	for (y = 0; y < new_height; y++) {
+		/* Only dereferenced within the image */
+		const unsigned char *row1 = img->data + MAX(yindex[y], 0) * width;
+		const unsigned char *row2 = img->data + (yindex[y] + 1) * width;
+		unsigned int w2 = yweight[y];
+		unsigned int w1 = 2 * h_factor - w2;
+		unsigned char *out = dst + y * new_width;
+
+		if (yindex[y] < 0) {
+			for (x = 0; x < width; x++)
+				row[x + 1] = row2[x] * w2;
+		} else if (yindex[y] + 1 >= height) {
+			for (x = 0; x < width; x++)
+				row[x + 1] = row1[x] * w1;
+		} else {
+			for (x = 0; x < width; x++)
+				row[x + 1] = row1[x] * w1 + row2[x] * w2;
+		}
+
+		for (x = 0; x < new_width; x++) {
+			unsigned int w = xweight[x];
+			unsigned int v = row[xindex[x] + 1] * (2 * w_factor - w) +
+				row[xindex[x] + 2] * w;
+
+			out[x] = (v + norm / 2) / norm;
+		}
+	}
+
+	g_free(xindex);
+	g_free(xweight);
+	g_free(yindex);
+	g_free(yweight);
+	g_free(row);
+}
+
 struct fp_img *fpi_im_resize(struct fp_img *img, unsigned int w_factor, unsigned int h_factor)
 {
 	int new_width = img->width * w_factor;
@@ -30,9 +107,22 @@ struct fp_img *fpi_im_resize(struct fp_img *img, unsigned int w_factor, unsigned
 	pixman_image_t *orig, *resized;
 	pixman_transform_t transform;
 	struct fp_img *newimg;
+	/* pixman needs rows of whole 32-bit words to render into the image */
+	gboolean direct = (new_width % sizeof(uint32_t)) == 0;
+
+	newimg = fpi_img_new(new_width * new_height);
+	newimg->width = new_width;
+	newimg->height = new_height;
+	newimg->flags = img->flags;
+
+	if (w_factor <= MAX_FAST_FACTOR && h_factor <= MAX_FAST_FACTOR) {
+		resize_bilinear(img, newimg->data, w_factor, h_factor);
+		return newimg;
+	}
 
 	orig = pixman_image_create_bits(PIXMAN_a8, img->width, img->height, (uint32_t *)img->data, img->width);
-	resized = pixman_image_create_bits(PIXMAN_a8, new_width, new_height, NULL, new_width);
+	resized = pixman_image_create_bits(PIXMAN_a8, new_width, new_height,
+		direct ? (uint32_t *)newimg->data : NULL, new_width);
 
 	pixman_transform_init_identity(&transform);
 	pixman_transform_scale(NULL, &transform, pixman_int_to_fixed(w_factor), pixman_int_to_fixed(h_factor));
@@ -48,16 +138,11 @@ struct fp_img *fpi_im_resize(struct fp_img *img, unsigned int w_factor, unsigned
 		new_width, new_height /* width height */
 		);
 
-	newimg = fpi_img_new(new_width * new_height);
-	newimg->width = new_width;
-	newimg->height = new_height;
-	newimg->flags = img->flags;
-
-	memcpy(newimg->data, pixman_image_get_data(resized), new_width * new_height);
+	if (!direct)
+		memcpy(newimg->data, pixman_image_get_data(resized), new_width * new_height);
 
 	pixman_image_unref(orig);
 	pixman_image_unref(resized);
 
 	return newimg;
 }
-
@@ -21,8 +21,19 @@
 
 #include <config.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include <sys/time.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#ifdef HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#endif
 
 #include <glib.h>
 #include <libusb.h>
@@ -53,45 +64,149 @@
  * fp_handle_events_timeout() instead. If you wish to do a nonblocking
  * iteration, call fp_handle_events_timeout() with a zero timeout.
  *
+ * Some operations, such as fp_async_print_data_load(), run on an internal
+ * worker thread and complete through fp_handle_events() as well. The
+ * worker signals completions through a file descriptor which is part of the
+ * set returned by fp_get_pollfds(). Where the system supports it, the set
+ * also includes a file descriptor which becomes readable when libfprint's
+ * next timer expires, so that an event loop polling the set doesn't need
+ * to follow fp_get_next_timeout(); libusb's own timeouts may still need
+ * it, unless libusb handles them with a timer fd as well.
+ *
+ * These functions operate on the default context, which is set up by
+ * fp_init() and which devices returned by fp_discover_devs() belong to.
+ * Applications driving devices from several threads can create a context
+ * per thread with fp_context_new(), discover devices from it with
+ * fp_context_discover_devs(), and handle its events with the fp_context_*
+ * variants of these functions. A context must only be used from one thread
+ * at a time, but different contexts can be used concurrently.
+ *
  * TODO: document how application is supposed to know when to call these
  * functions.
  */
 
-/* this is a singly-linked list of pending timers, sorted with the timer that
- * is expiring soonest at the head. */
-static GSList *active_timers = NULL;
-
-/* notifiers for added or removed poll fds */
-static fp_pollfd_added_cb fd_added_cb = NULL;
-static fp_pollfd_removed_cb fd_removed_cb = NULL;
-
 struct fpi_timeout {
+	struct fp_context *ctx;
 	struct timeval expiry;
+	/* orders timers expiring at the same time as they were added */
+	guint64 seq;
 	fpi_timeout_fn callback;
 	void *data;
+	/* position in the context's heap, or next unused timer */
+	unsigned int index;
+	struct fpi_timeout *next_free;
+};
+
+/* Work is run on a single worker thread per context, one job at a time and
+ * in order, or on a pool shared by several contexts, see
+ * fpi_worker_pool_new(). Finished jobs are queued on their context, and the
+ * worker writes to the context's wake pipe so that
+ * fp_context_handle_events() calls their completion callbacks. */
+struct fpi_work {
+	struct fp_context *ctx;
+	fpi_work_fn work;
+	fpi_work_fn done;
+	void *data;
 };
 
-static int timeout_sort_fn(gconstpointer _a, gconstpointer _b)
+/* Timers are kept in a binary heap: each timer expires no later than the
+ * two timers at twice its index, plus one and plus two. */
+
+static gboolean timeout_before(struct fpi_timeout *a, struct fpi_timeout *b)
+{
+	if (timercmp(&a->expiry, &b->expiry, !=))
+		return timercmp(&a->expiry, &b->expiry, <);
+	return a->seq < b->seq;
+}
+
+static void heap_set(struct fp_context *ctx, unsigned int i,
+	struct fpi_timeout *timeout)
+{
+	ctx->timers[i] = timeout;
+	timeout->index = i;
+}
+
+/* Moves the timer at index i up or down to its place in the heap */
+static void heap_fix(struct fp_context *ctx, unsigned int i)
+{
+	struct fpi_timeout *timeout = ctx->timers[i];
+
+	while (i > 0 && timeout_before(timeout, ctx->timers[(i - 1) / 2])) {
+		heap_set(ctx, i, ctx->timers[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+
+	for (;;) {
+		unsigned int child = 2 * i + 1;
+
+		if (child >= ctx->nr_timers)
+			break;
+		if (child + 1 < ctx->nr_timers &&
+		    timeout_before(ctx->timers[child + 1], ctx->timers[child]))
+			child++;
+		if (!timeout_before(ctx->timers[child], timeout))
+			break;
+		heap_set(ctx, i, ctx->timers[child]);
+		i = child;
+	}
+	heap_set(ctx, i, timeout);
+}
+
+static void heap_remove(struct fp_context *ctx, struct fpi_timeout *timeout)
+{
+	unsigned int i = timeout->index;
+
+	ctx->nr_timers--;
+	if (i == ctx->nr_timers)
+		return;
+	heap_set(ctx, i, ctx->timers[ctx->nr_timers]);
+	heap_fix(ctx, i);
+}
+
+/* Arms the timer fd for the first timer to expire, so that event loops
+ * polling it wake up in time. Setting the timer fd also makes it
+ * unreadable until it expires again. */
+static void timer_fd_update(struct fp_context *ctx)
 {
-	struct fpi_timeout *a = (struct fpi_timeout *) _a;
-	struct fpi_timeout *b = (struct fpi_timeout *) _b;
-	struct timeval *tv_a = &a->expiry;
-	struct timeval *tv_b = &b->expiry;
+#ifdef HAVE_SYS_TIMERFD_H
+	struct itimerspec its;
+	struct timeval expiry;
 
-	if (timercmp(tv_a, tv_b, <))
-		return -1;
-	else if (timercmp(tv_a, tv_b, >))
-		return 1;
+	if (ctx->timer_fd < 0)
+		return;
+
+	if (ctx->nr_timers > 0)
+		expiry = ctx->timers[0]->expiry;
 	else
-		return 0;
+		timerclear(&expiry);
+	if (!timercmp(&expiry, &ctx->timer_fd_expiry, !=))
+		return;
+
+	memset(&its, 0, sizeof(its));
+	TIMEVAL_TO_TIMESPEC(&expiry, &its.it_value);
+	if (timerfd_settime(ctx->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		fp_err("couldn't set timer fd, errno=%d", errno);
+		return;
+	}
+	ctx->timer_fd_expiry = expiry;
+#endif
+}
+
+static void timeout_free(struct fpi_timeout *timeout)
+{
+	struct fp_context *ctx = timeout->ctx;
+
+	timeout->next_free = ctx->free_timers;
+	ctx->free_timers = timeout;
 }
 
 /* A timeout is the asynchronous equivalent of sleeping. You create a timeout
  * saying that you'd like to have a function invoked at a certain time in
- * the future. */
-struct fpi_timeout *fpi_timeout_add(unsigned int msec, fpi_timeout_fn callback,
-	void *data)
+ * the future. It is invoked from the event loop of the device's context. */
+struct fpi_timeout *fpi_timeout_add(struct fp_dev *dev, unsigned int msec,
+	fpi_timeout_fn callback, void *data)
 {
+	struct fp_context *ctx = dev->ctx;
 	struct timespec ts;
 	struct timeval add_msec;
 	struct fpi_timeout *timeout;
@@ -105,7 +220,13 @@ struct fpi_timeout *fpi_timeout_add(unsigned int msec, fpi_timeout_fn callback,
 		return NULL;
 	}
 
-	timeout = g_malloc(sizeof(*timeout));
+	timeout = ctx->free_timers;
+	if (timeout)
+		ctx->free_timers = timeout->next_free;
+	else
+		timeout = g_malloc(sizeof(*timeout));
+	timeout->ctx = ctx;
+	timeout->seq = ctx->timer_seq++;
 	timeout->callback = callback;
 	timeout->data = data;
 	TIMESPEC_TO_TIMEVAL(&timeout->expiry, &ts);
@@ -116,33 +237,44 @@ struct fpi_timeout *fpi_timeout_add(unsigned int msec, fpi_timeout_fn callback,
 	add_msec.tv_usec = (msec % 1000) * 1000;
 	timeradd(&timeout->expiry, &add_msec, &timeout->expiry);
 
-	active_timers = g_slist_insert_sorted(active_timers, timeout,
-		timeout_sort_fn);
+	if (ctx->nr_timers == ctx->timers_size) {
+		ctx->timers_size = MAX(16, 2 * ctx->timers_size);
+		ctx->timers = g_realloc(ctx->timers,
+			ctx->timers_size * sizeof(*ctx->timers));
+	}
+	heap_set(ctx, ctx->nr_timers++, timeout);
+	heap_fix(ctx, timeout->index);
+	if (timeout->index == 0)
+		timer_fd_update(ctx);
 
 	return timeout;
 }
 
 void fpi_timeout_cancel(struct fpi_timeout *timeout)
 {
+	struct fp_context *ctx = timeout->ctx;
+	gboolean first = timeout->index == 0;
+
 	fp_dbg("");
-	active_timers = g_slist_remove(active_timers, timeout);
-	g_free(timeout);
+	heap_remove(ctx, timeout);
+	timeout_free(timeout);
+	if (first)
+		timer_fd_update(ctx);
 }
 
-/* get the expiry time and optionally the timeout structure for the next
- * timeout. returns 0 if there are no expired timers, or 1 if the
- * timeval/timeout output parameters were populated. if the returned timeval
- * is zero then it means the timeout has already expired and should be handled
- * ASAP. */
-static int get_next_timeout_expiry(struct timeval *out,
-	struct fpi_timeout **out_timeout)
+/* get the expiry time for the next timeout. returns 0 if there are no
+ * expired timers, or 1 if the timeval output parameter was populated. if
+ * the returned timeval is zero then it means the timeout has already
+ * expired and should be handled ASAP. */
+static int get_next_timeout_expiry(struct fp_context *ctx,
+	struct timeval *out)
 {
 	struct timespec ts;
 	struct timeval tv;
 	struct fpi_timeout *next_timeout;
 	int r;
 
-	if (active_timers == NULL)
+	if (ctx->nr_timers == 0)
 		return 0;
 
 	r = clock_gettime(CLOCK_MONOTONIC, &ts);
@@ -152,10 +284,7 @@ static int get_next_timeout_expiry(struct timeval *out,
 	}
 	TIMESPEC_TO_TIMEVAL(&tv, &ts);
 
-	next_timeout = active_timers->data;
-	if (out_timeout)
-		*out_timeout = next_timeout;
-
+	next_timeout = ctx->timers[0];
 	if (timercmp(&tv, &next_timeout->expiry, >=)) {
 		fp_dbg("first timeout already expired");
 		timerclear(out);
@@ -167,58 +296,224 @@ static int get_next_timeout_expiry(struct timeval *out,
 	return 1;
 }
 
-/* handle a timeout that has expired */
-static void handle_timeout(struct fpi_timeout *timeout)
+/* handle up to max of the timeouts which have expired, reading the clock
+ * once. Timers added by the callbacks are handled next time. Returns the
+ * number of timeouts handled, or negative on error. */
+static int handle_timeouts(struct fp_context *ctx, unsigned int max)
 {
-	fp_dbg("");
-	timeout->callback(timeout->data);
-	active_timers = g_slist_remove(active_timers, timeout);
-	g_free(timeout);
+	struct fpi_timeout *timeout;
+	struct timespec ts;
+	struct timeval now;
+	guint64 seq = ctx->timer_seq;
+	int n = 0;
+	int r;
+
+	if (ctx->nr_timers == 0 || max == 0)
+		return 0;
+
+	r = clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (r < 0) {
+		fp_err("failed to read monotonic clock, errno=%d", errno);
+		return r;
+	}
+	TIMESPEC_TO_TIMEVAL(&now, &ts);
+
+	while (ctx->nr_timers > 0 && n < max) {
+		timeout = ctx->timers[0];
+		if (timercmp(&timeout->expiry, &now, >) || timeout->seq >= seq)
+			break;
+
+		fp_dbg("");
+		heap_remove(ctx, timeout);
+		timeout->callback(timeout->data);
+		timeout_free(timeout);
+		n++;
+	}
+	timer_fd_update(ctx);
+
+	return n;
 }
 
-static int handle_timeouts(void)
+/* Makes the wake fd readable. The same 8 bytes work for an eventfd and for
+ * a pipe. */
+static void wake(struct fp_context *ctx)
 {
-	struct timeval next_timeout_expiry;
-	struct fpi_timeout *next_timeout;
-	int r;
+	guint64 one = 1;
+	ssize_t r;
 
-	r = get_next_timeout_expiry(&next_timeout_expiry, &next_timeout);
-	if (r <= 0)
-		return r;
+	do
+		r = write(ctx->wake_fds[1], &one, sizeof(one));
+	while (r < 0 && errno == EINTR);
+}
+
+static void worker_func(gpointer data, gpointer user_data)
+{
+	struct fpi_work *work = data;
+	struct fp_context *ctx = work->ctx;
+
+	work->work(work->data);
+	g_async_queue_push(ctx->finished_work, work);
+	wake(ctx);
+}
+
+static int worker_init(struct fp_context *ctx)
+{
+	if (ctx->wake_fds[0] < 0)
+		return -EIO;
+
+	ctx->worker_pool = g_thread_pool_new(worker_func, NULL, 1, FALSE, NULL);
+	if (!ctx->worker_pool)
+		return -ENOMEM;
+	ctx->finished_work = g_async_queue_new();
+	return 0;
+}
+
+/* Creates a pool of nr_threads worker threads, on which work of any
+ * context can be run with fpi_worker_run_in_pool() */
+GThreadPool *fpi_worker_pool_new(unsigned int nr_threads)
+{
+	GError *error = NULL;
+	GThreadPool *pool;
 
-	if (!timerisset(&next_timeout_expiry))
-		handle_timeout(next_timeout);
+	pool = g_thread_pool_new(worker_func, NULL, nr_threads, FALSE, &error);
+	if (!pool) {
+		fp_err("couldn't create worker pool: %s", error->message);
+		g_error_free(error);
+	}
+	return pool;
+}
+
+/* Like fpi_worker_run(), but runs work(data) on one of the threads of pool,
+ * alongside work of other contexts */
+int fpi_worker_run_in_pool(GThreadPool *pool, struct fp_context *ctx,
+	fpi_work_fn work, fpi_work_fn done, void *data)
+{
+	struct fpi_work *job;
+	int r = 0;
+
+	/* done(data) still goes through the context's queue */
+	g_mutex_lock(&ctx->worker_lock);
+	if (!ctx->worker_pool)
+		r = worker_init(ctx);
+	g_mutex_unlock(&ctx->worker_lock);
+	if (r < 0)
+		return r;
 
+	job = g_malloc(sizeof(*job));
+	job->ctx = ctx;
+	job->work = work;
+	job->done = done;
+	job->data = data;
+	g_thread_pool_push(pool ? pool : ctx->worker_pool, job, NULL);
 	return 0;
 }
 
+/* Runs work(data) on the context's worker thread, then done(data) from
+ * fp_context_handle_events() on the thread using the context */
+int fpi_worker_run(struct fp_context *ctx, fpi_work_fn work, fpi_work_fn done,
+	void *data)
+{
+	return fpi_worker_run_in_pool(NULL, ctx, work, done, data);
+}
+
+static void handle_finished_work(struct fp_context *ctx)
+{
+	struct fpi_work *work;
+	char buf[64];
+
+	while (read(ctx->wake_fds[0], buf, sizeof(buf)) > 0)
+		;
+
+	if (!ctx->finished_work)
+		return;
+	while ((work = g_async_queue_try_pop(ctx->finished_work))) {
+		work->done(work->data);
+		g_free(work);
+	}
+}
+
+/* Waits for libusb and worker events at once, which libusb can't do by
+ * itself */
+static int handle_events_and_work(struct fp_context *ctx,
+	struct timeval *timeout)
+{
+	const struct libusb_pollfd **usbfds;
+	struct timeval usb_timeout;
+	struct timeval zero_timeout = { 0, 0 };
+	struct pollfd *fds;
+	nfds_t nfds = 1;
+	nfds_t i;
+	int r;
+
+	usbfds = libusb_get_pollfds(ctx->usb_ctx);
+	if (!usbfds)
+		return -EIO;
+	while (usbfds[nfds - 1])
+		nfds++;
+
+	fds = g_malloc(sizeof(*fds) * nfds);
+	fds[0].fd = ctx->wake_fds[0];
+	fds[0].events = POLLIN;
+	for (i = 1; i < nfds; i++) {
+		fds[i].fd = usbfds[i - 1]->fd;
+		fds[i].events = usbfds[i - 1]->events;
+	}
+	free(usbfds);
+
+	if (libusb_get_next_timeout(ctx->usb_ctx, &usb_timeout) == 1 &&
+	    timercmp(&usb_timeout, timeout, <))
+		*timeout = usb_timeout;
+
+	r = poll(fds, nfds, timeout->tv_sec * 1000 +
+		(timeout->tv_usec + 999) / 1000);
+	if (r < 0 && errno != EINTR) {
+		r = -errno;
+		g_free(fds);
+		return r;
+	}
+	if (r > 0 && fds[0].revents)
+		handle_finished_work(ctx);
+	g_free(fds);
+
+	return libusb_handle_events_timeout(ctx->usb_ctx, &zero_timeout);
+}
+
 /** \ingroup poll
- * Handle any pending events. If a non-zero timeout is specified, the function
- * will potentially block for the specified amount of time, although it may
- * return sooner if events have been handled. The function acts as non-blocking
- * for a zero timeout.
+ * Handle any pending events of a context. If a non-zero timeout is
+ * specified, the function will potentially block for the specified amount
+ * of time, although it may return sooner if events have been handled. The
+ * function acts as non-blocking for a zero timeout.
  *
+ * \param ctx the context to handle events of
  * \param timeout Maximum timeout for this blocking function
  * \returns 0 on success, non-zero on error.
  */
-API_EXPORTED int fp_handle_events_timeout(struct timeval *timeout)
+API_EXPORTED int fp_context_handle_events_timeout(struct fp_context *ctx,
+	struct timeval *timeout)
 {
 	struct timeval next_timeout_expiry;
 	struct timeval select_timeout;
-	struct fpi_timeout *next_timeout;
+	unsigned int budget = ctx->timeout_batch_limit;
 	int r;
 
-	r = get_next_timeout_expiry(&next_timeout_expiry, &next_timeout);
+	if (!budget)
+		budget = G_MAXUINT;
+
+	r = get_next_timeout_expiry(ctx, &next_timeout_expiry);
 	if (r < 0)
 		return r;
 
-	if (r) {
-		/* timer already expired? */
-		if (!timerisset(&next_timeout_expiry)) {
-			handle_timeout(next_timeout);
-			return 0;
-		}
-
+	if (r && !timerisset(&next_timeout_expiry)) {
+		/* timer already expired */
+		r = handle_timeouts(ctx, budget);
+		if (r < 0 || !ctx->timeout_batch_limit)
+			return r < 0 ? r : 0;
+
+		/* then handle the USB events which are already pending,
+		 * without blocking */
+		budget -= r;
+		timerclear(&select_timeout);
+	} else if (r) {
 		/* choose the smallest of next URB timeout or user specified timeout */
 		if (timercmp(&next_timeout_expiry, timeout, <))
 			select_timeout = next_timeout_expiry;
@@ -228,12 +523,68 @@ API_EXPORTED int fp_handle_events_timeout(struct timeval *timeout)
 		select_timeout = *timeout;
 	}
 
-	r = libusb_handle_events_timeout(fpi_usb_ctx, &select_timeout);
+	if (ctx->wake_fds[0] >= 0)
+		r = handle_events_and_work(ctx, &select_timeout);
+	else
+		r = libusb_handle_events_timeout(ctx->usb_ctx, &select_timeout);
 	*timeout = select_timeout;
 	if (r < 0)
 		return r;
 
-	return handle_timeouts();
+	r = handle_timeouts(ctx, budget);
+	return r < 0 ? r : 0;
+}
+
+/** \ingroup poll
+ * Sets how fp_context_handle_events_timeout() handles timers which have
+ * already expired when it is called. By default, it only handles those
+ * timers and returns, so each batch of expired timers costs an iteration
+ * of the application's event loop before USB events get handled.
+ *
+ * When a limit is set, it handles up to that many expired timers, then
+ * the pending USB events without waiting for more, and then the timers
+ * which expired meanwhile, still within the limit, all in the same call.
+ * The limit bounds the time spent in timer callbacks per iteration while
+ * several devices share a context.
+ *
+ * \param ctx the context to configure, or NULL for the default context
+ * \param max_timeouts the maximum number of timers handled per call, or 0
+ * for the default behaviour
+ */
+API_EXPORTED void fp_context_set_timeout_batch_limit(struct fp_context *ctx,
+	unsigned int max_timeouts)
+{
+	if (!ctx)
+		ctx = fpi_default_ctx;
+	ctx->timeout_batch_limit = max_timeouts;
+}
+
+/** \ingroup poll
+ * Handle any pending events of the default context, like
+ * fp_context_handle_events_timeout().
+ *
+ * \param timeout Maximum timeout for this blocking function
+ * \returns 0 on success, non-zero on error.
+ */
+API_EXPORTED int fp_handle_events_timeout(struct timeval *timeout)
+{
+	return fp_context_handle_events_timeout(fpi_default_ctx, timeout);
+}
+
+/** \ingroup poll
+ * Convenience function for calling fp_context_handle_events_timeout() with
+ * a sensible default timeout value of two seconds (subject to change if we
+ * decide another value is more sensible).
+ *
+ * \param ctx the context to handle events of
+ * \returns 0 on success, non-zero on error.
+ */
+API_EXPORTED int fp_context_handle_events(struct fp_context *ctx)
+{
+	struct timeval tv;
+	tv.tv_sec = 2;
+	tv.tv_usec = 0;
+	return fp_context_handle_events_timeout(ctx, &tv);
 }
 
 /** \ingroup poll
@@ -245,25 +596,23 @@ API_EXPORTED int fp_handle_events_timeout(struct timeval *timeout)
  */
 API_EXPORTED int fp_handle_events(void)
 {
-	struct timeval tv;
-	tv.tv_sec = 2;
-	tv.tv_usec = 0;
-	return fp_handle_events_timeout(&tv);
+	return fp_context_handle_events(fpi_default_ctx);
 }
 
 /* FIXME: docs
  * returns 0 if no timeouts active
  * returns 1 if timeout returned
  * zero timeout means events are to be handled immediately */
-API_EXPORTED int fp_get_next_timeout(struct timeval *tv)
+API_EXPORTED int fp_context_get_next_timeout(struct fp_context *ctx,
+	struct timeval *tv)
 {
 	struct timeval fprint_timeout;
 	struct timeval libusb_timeout;
 	int r_fprint;
 	int r_libusb;
 
-	r_fprint = get_next_timeout_expiry(&fprint_timeout, NULL);
-	r_libusb = libusb_get_next_timeout(fpi_usb_ctx, &libusb_timeout);
+	r_fprint = get_next_timeout_expiry(ctx, &fprint_timeout);
+	r_libusb = libusb_get_next_timeout(ctx->usb_ctx, &libusb_timeout);
 
 	/* if we have no pending timeouts and the same is true for libusb,
 	 * indicate that we have no pending timouts */
@@ -286,18 +635,26 @@ API_EXPORTED int fp_get_next_timeout(struct timeval *tv)
 	return 1;
 }
 
+/* FIXME: docs */
+API_EXPORTED int fp_get_next_timeout(struct timeval *tv)
+{
+	return fp_context_get_next_timeout(fpi_default_ctx, tv);
+}
+
 /** \ingroup poll
  * Retrieve a list of file descriptors that should be polled for events
- * interesting to libfprint. This function is only for users who wish to
- * combine libfprint's file descriptor set with other event sources - more
- * simplistic users will be able to call fp_handle_events() or a variant
- * directly.
+ * interesting to libfprint on a context. This function is only for users
+ * who wish to combine libfprint's file descriptor set with other event
+ * sources - more simplistic users will be able to call
+ * fp_context_handle_events() or a variant directly.
  *
+ * \param ctx the context to get the file descriptors of
  * \param pollfds output location for a list of pollfds. If non-NULL, must be
  * released with free() when done.
  * \returns the number of pollfds in the resultant list, or negative on error.
  */
-API_EXPORTED size_t fp_get_pollfds(struct fp_pollfd **pollfds)
+API_EXPORTED size_t fp_context_get_pollfds(struct fp_context *ctx,
+	struct fp_pollfd **pollfds)
 {
 	const struct libusb_pollfd **usbfds;
 	const struct libusb_pollfd *usbfd;
@@ -305,7 +662,7 @@ API_EXPORTED size_t fp_get_pollfds(struct fp_pollfd **pollfds)
 	size_t cnt = 0;
 	size_t i = 0;
 
-	usbfds = libusb_get_pollfds(fpi_usb_ctx);
+	usbfds = libusb_get_pollfds(ctx->usb_ctx);
 	if (!usbfds) {
 		*pollfds = NULL;
 		return -EIO;
@@ -313,6 +670,10 @@ API_EXPORTED size_t fp_get_pollfds(struct fp_pollfd **pollfds)
 
 	while ((usbfd = usbfds[i++]) != NULL)
 		cnt++;
+	if (ctx->wake_fds[0] >= 0)
+		cnt++;
+	if (ctx->timer_fd >= 0)
+		cnt++;
 
 	ret = g_malloc(sizeof(struct fp_pollfd) * cnt);
 	i = 0;
@@ -321,42 +682,166 @@ API_EXPORTED size_t fp_get_pollfds(struct fp_pollfd **pollfds)
 		ret[i].events = usbfd->events;
 		i++;
 	}
+	if (ctx->wake_fds[0] >= 0) {
+		ret[i].fd = ctx->wake_fds[0];
+		ret[i].events = POLLIN;
+		i++;
+	}
+	if (ctx->timer_fd >= 0) {
+		ret[i].fd = ctx->timer_fd;
+		ret[i].events = POLLIN;
+	}
+	free(usbfds);
 
 	*pollfds = ret;
 	return cnt;
 }
 
+/** \ingroup poll
+ * Retrieve a list of file descriptors that should be polled for events
+ * interesting to libfprint on the default context, like
+ * fp_context_get_pollfds().
+ *
+ * \param pollfds output location for a list of pollfds. If non-NULL, must be
+ * released with free() when done.
+ * \returns the number of pollfds in the resultant list, or negative on error.
+ */
+API_EXPORTED size_t fp_get_pollfds(struct fp_pollfd **pollfds)
+{
+	return fp_context_get_pollfds(fpi_default_ctx, pollfds);
+}
+
+/* FIXME: docs */
+API_EXPORTED void fp_context_set_pollfd_notifiers(struct fp_context *ctx,
+	fp_pollfd_added_cb added_cb, fp_pollfd_removed_cb removed_cb)
+{
+	ctx->fd_added_cb = added_cb;
+	ctx->fd_removed_cb = removed_cb;
+}
+
 /* FIXME: docs */
 API_EXPORTED void fp_set_pollfd_notifiers(fp_pollfd_added_cb added_cb,
 	fp_pollfd_removed_cb removed_cb)
 {
-	fd_added_cb = added_cb;
-	fd_removed_cb = removed_cb;
+	fp_context_set_pollfd_notifiers(fpi_default_ctx, added_cb, removed_cb);
 }
 
 static void add_pollfd(int fd, short events, void *user_data)
 {
-	if (fd_added_cb)
-		fd_added_cb(fd, events);
+	struct fp_context *ctx = user_data;
+
+	if (ctx->fd_added_cb)
+		ctx->fd_added_cb(fd, events);
 }
 
 static void remove_pollfd(int fd, void *user_data)
 {
-	if (fd_removed_cb)
-		fd_removed_cb(fd);
+	struct fp_context *ctx = user_data;
+
+	if (ctx->fd_removed_cb)
+		ctx->fd_removed_cb(fd);
+}
+
+/** \ingroup poll
+ * Makes a call to fp_context_handle_events_timeout() on a context return
+ * early, or the next call if there is none in progress. Unlike the other
+ * functions operating on contexts, this one can be called from any thread.
+ *
+ * \param ctx the context to wake up, or NULL for the default context
+ */
+API_EXPORTED void fp_context_wakeup(struct fp_context *ctx)
+{
+	if (!ctx)
+		ctx = fpi_default_ctx;
+	if (ctx->wake_fds[0] >= 0)
+		wake(ctx);
 }
 
-void fpi_poll_init(void)
+static int wake_fds_init(struct fp_context *ctx)
 {
-	libusb_set_pollfd_notifiers(fpi_usb_ctx, add_pollfd, remove_pollfd, NULL);
+	int i;
+
+#ifdef HAVE_SYS_EVENTFD_H
+	ctx->wake_fds[0] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (ctx->wake_fds[0] >= 0) {
+		ctx->wake_fds[1] = ctx->wake_fds[0];
+		return 0;
+	}
+#endif
+
+	if (pipe(ctx->wake_fds) < 0) {
+		ctx->wake_fds[0] = ctx->wake_fds[1] = -1;
+		return -errno;
+	}
+	for (i = 0; i < 2; i++) {
+		fcntl(ctx->wake_fds[i], F_SETFD, FD_CLOEXEC);
+		fcntl(ctx->wake_fds[i], F_SETFL, O_NONBLOCK);
+	}
+	return 0;
 }
 
-void fpi_poll_exit(void)
+/* Sets up the fds which are polled along with libusb's: one becomes
+ * readable when the context is woken up, by fp_context_wakeup() or by
+ * completed work, and one when the first timer expires. Without them,
+ * events are handled by libusb alone, and the application has to follow
+ * fp_get_next_timeout(). */
+void fpi_poll_init(struct fp_context *ctx)
 {
-	g_slist_free(active_timers);
-	active_timers = NULL;
-	fd_added_cb = NULL;
-	fd_removed_cb = NULL;
-	libusb_set_pollfd_notifiers(fpi_usb_ctx, NULL, NULL, NULL);
+	int r;
+
+	r = wake_fds_init(ctx);
+	if (r < 0)
+		fp_err("couldn't create wake fd: %d", r);
+
+	ctx->timer_fd = -1;
+#ifdef HAVE_SYS_TIMERFD_H
+	ctx->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+		TFD_CLOEXEC | TFD_NONBLOCK);
+	if (ctx->timer_fd < 0)
+		fp_err("couldn't create timer fd, errno=%d", errno);
+#endif
+
+	libusb_set_pollfd_notifiers(ctx->usb_ctx, add_pollfd, remove_pollfd,
+		ctx);
 }
 
+void fpi_poll_exit(struct fp_context *ctx)
+{
+	if (ctx->worker_pool) {
+		/* let pending work complete */
+		g_thread_pool_free(ctx->worker_pool, FALSE, TRUE);
+		ctx->worker_pool = NULL;
+		handle_finished_work(ctx);
+		g_async_queue_unref(ctx->finished_work);
+		ctx->finished_work = NULL;
+	}
+	while (ctx->nr_timers > 0)
+		fpi_timeout_cancel(ctx->timers[0]);
+
+	if (ctx->wake_fds[0] >= 0) {
+		if (ctx->fd_removed_cb)
+			ctx->fd_removed_cb(ctx->wake_fds[0]);
+		close(ctx->wake_fds[0]);
+		if (ctx->wake_fds[1] != ctx->wake_fds[0])
+			close(ctx->wake_fds[1]);
+		ctx->wake_fds[0] = ctx->wake_fds[1] = -1;
+	}
+	if (ctx->timer_fd >= 0) {
+		if (ctx->fd_removed_cb)
+			ctx->fd_removed_cb(ctx->timer_fd);
+		close(ctx->timer_fd);
+		ctx->timer_fd = -1;
+	}
+	while (ctx->free_timers) {
+		struct fpi_timeout *timeout = ctx->free_timers;
+
+		ctx->free_timers = timeout->next_free;
+		g_free(timeout);
+	}
+	g_free(ctx->timers);
+	ctx->timers = NULL;
+	ctx->timers_size = 0;
+	ctx->fd_added_cb = NULL;
+	ctx->fd_removed_cb = NULL;
+	libusb_set_pollfd_notifiers(ctx->usb_ctx, NULL, NULL, NULL);
+}
@@ -0,0 +1,892 @@
+/*
+ * Single file print databases for libfprint
+ * Copyright (C) 2017 libfprint contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "printdb"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "fp_internal.h"
+
+/** @defgroup print_db Print databases
+ * fp_print_data_save() keeps one file per finger and device type in the
+ * user's home directory, which suits a single user. A print database holds
+ * the prints of any number of users in a single file, each print being
+ * stored under a name chosen by the application along with its finger.
+ *
+ * The file is mapped in memory, and the prints loaded from it refer to the
+ * mapped data instead of copying it. They remain valid until the database is
+ * closed.
+ *
+ * Prints are only ever appended to the file: replacing or deleting a print
+ * leaves its old data in place, along with the previous copy of the index.
+ * Each change is committed by rewriting the small header at the start of
+ * the file, so an interrupted change leaves the database as it was before.
+ * A database must not be changed by several processes at once.
+ *
+ * Many changes can be grouped in a transaction with fp_print_db_begin().
+ * They are then committed at once by fp_print_db_commit(), which only
+ * syncs the file twice whatever the number of changes, or not at all if
+ * the transaction is rolled back.
+ *
+ * The samples are kept in the host's layout, so that they can be used in
+ * place. To move prints to a machine of another architecture, export them
+ * with fp_print_data_get_data().
+ */
+
+#define PRINT_DB_PERMS		0600
+#define PRINT_DB_VERSION	1
+#define MAX_NAME_LENGTH		255
+
+/* NBIS samples are arrays of ints. FP2 data has a 10 byte header and 4 bytes
+ * in front of every sample, whose lengths are multiples of 4; starting it 2
+ * bytes past an aligned offset keeps the samples aligned, so that they can
+ * be used straight from the mapping. */
+#define RECORD_ALIGN		4
+#define RECORD_OFFSET		2
+
+/* Smallest mapping of a database file */
+#define MIN_MAP_LENGTH		(64 * 1024)
+
+struct print_db_header {
+	char magic[4];
+	uint32_t version;
+	/* index of the last commit, and end of what it wrote */
+	uint64_t index_offset;
+	uint32_t index_length;
+	uint32_t nr_entries;
+	uint64_t end;
+} __attribute__((__packed__));
+
+struct print_db_index_entry {
+	/* FP2 data of the print */
+	uint64_t offset;
+	uint32_t length;
+	uint16_t driver_id;
+	uint32_t devtype;
+	uint8_t data_type;
+	uint8_t finger;
+	uint8_t name_length;
+	char name[0];
+} __attribute__((__packed__));
+
+struct print_db_entry {
+	uint64_t offset;
+	uint32_t length;
+	uint16_t driver_id;
+	uint32_t devtype;
+	enum fp_print_data_type type;
+	enum fp_finger finger;
+	char *name;
+};
+
+struct print_db_mapping {
+	void *addr;
+	size_t length;
+};
+
+struct fp_print_db {
+	int fd;
+	struct print_db_mapping map;
+	/* previous mappings, which prints loaded earlier may still refer to */
+	GSList *old_maps;
+	GArray *entries;
+	/* where the next data is appended, past the last commit during a
+	 * transaction */
+	uint64_t end;
+	/* state of the last commit, during a transaction */
+	GArray *txn_entries;
+	uint64_t txn_end;
+	/* numbers of the prints of each driver, devtype and data type, built
+	 * when needed after entries change */
+	GHashTable *shards;
+};
+
+#define SHARD_KEY(driver_id, devtype, type) \
+	(((guint64) (driver_id) << 40) | ((guint64) (devtype) << 8) | (type))
+
+#define FP_FINGER_IS_VALID(finger) \
+	((finger) >= LEFT_THUMB && (finger) <= RIGHT_LITTLE)
+
+static int db_pwrite(struct fp_print_db *db, const void *buf, size_t length,
+	uint64_t offset)
+{
+	const unsigned char *p = buf;
+
+	while (length) {
+		ssize_t r = pwrite(db->fd, p, length, offset);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			fp_err("write failed: %s", g_strerror(errno));
+			return -errno;
+		}
+		p += r;
+		offset += r;
+		length -= r;
+	}
+
+	return 0;
+}
+
+/* Makes sure the file is mapped up to db->end. The mapping goes beyond the
+ * end of the file, so that it only has to be replaced once in a while as the
+ * file grows; the previous mapping is kept, as it may be referred to by
+ * loaded prints. */
+static int db_map(struct fp_print_db *db)
+{
+	size_t length;
+	void *addr;
+
+	if (db->end <= db->map.length)
+		return 0;
+
+	length = MAX(2 * db->end, MIN_MAP_LENGTH);
+	addr = mmap(NULL, length, PROT_READ, MAP_SHARED, db->fd, 0);
+	if (addr == MAP_FAILED) {
+		fp_err("mmap failed: %s", g_strerror(errno));
+		return -errno;
+	}
+
+	if (db->map.addr) {
+		struct print_db_mapping *old = g_memdup(&db->map, sizeof(db->map));
+		db->old_maps = g_slist_prepend(db->old_maps, old);
+	}
+	db->map.addr = addr;
+	db->map.length = length;
+	return 0;
+}
+
+static void entry_clear(struct print_db_entry *entry)
+{
+	g_free(entry->name);
+}
+
+static void shard_free(GArray *shard)
+{
+	g_array_free(shard, TRUE);
+}
+
+static void shards_invalidate(struct fp_print_db *db)
+{
+	if (db->shards) {
+		g_hash_table_destroy(db->shards);
+		db->shards = NULL;
+	}
+}
+
+/* Returns the numbers of the prints matching a driver, devtype and data
+ * type, or NULL if there are none */
+static GArray *get_shard(struct fp_print_db *db, uint16_t driver_id,
+	uint32_t devtype, enum fp_print_data_type type)
+{
+	guint64 key = SHARD_KEY(driver_id, devtype, type);
+	unsigned int i;
+
+	if (!db->shards) {
+		db->shards = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+			g_free, (GDestroyNotify) shard_free);
+		for (i = 0; i < db->entries->len; i++) {
+			struct print_db_entry *entry = &g_array_index(db->entries,
+				struct print_db_entry, i);
+			guint64 entry_key = SHARD_KEY(entry->driver_id,
+				entry->devtype, entry->type);
+			GArray *shard = g_hash_table_lookup(db->shards,
+				&entry_key);
+
+			if (!shard) {
+				shard = g_array_new(FALSE, FALSE, sizeof(guint));
+				g_hash_table_insert(db->shards,
+					g_memdup(&entry_key, sizeof(entry_key)),
+					shard);
+			}
+			g_array_append_val(shard, i);
+		}
+	}
+
+	return g_hash_table_lookup(db->shards, &key);
+}
+
+static GArray *entries_new(void)
+{
+	GArray *entries = g_array_new(FALSE, FALSE,
+		sizeof(struct print_db_entry));
+	g_array_set_clear_func(entries, (GDestroyNotify) entry_clear);
+	return entries;
+}
+
+/* Builds the in-memory index from the one the header points to */
+static int read_index(struct fp_print_db *db,
+	const struct print_db_header *hdr)
+{
+	uint64_t index_offset = GUINT64_FROM_LE(hdr->index_offset);
+	uint32_t index_length = GUINT32_FROM_LE(hdr->index_length);
+	uint32_t nr_entries = GUINT32_FROM_LE(hdr->nr_entries);
+	const unsigned char *p = (const unsigned char *) db->map.addr +
+		index_offset;
+	const unsigned char *index_end = p + index_length;
+	uint32_t i;
+
+	if (index_offset < sizeof(*hdr) || index_offset > db->end ||
+	    index_length > db->end - index_offset) {
+		fp_err("invalid index location");
+		return -EIO;
+	}
+
+	for (i = 0; i < nr_entries; i++) {
+		const struct print_db_index_entry *raw =
+			(const struct print_db_index_entry *) p;
+		struct print_db_entry entry;
+		size_t left = index_end - p;
+
+		if (left < sizeof(*raw) ||
+		    left - sizeof(*raw) < raw->name_length) {
+			fp_err("truncated index");
+			return -EIO;
+		}
+
+		entry.offset = GUINT64_FROM_LE(raw->offset);
+		entry.length = GUINT32_FROM_LE(raw->length);
+		entry.driver_id = GUINT16_FROM_LE(raw->driver_id);
+		entry.devtype = GUINT32_FROM_LE(raw->devtype);
+		entry.type = raw->data_type;
+		entry.finger = raw->finger;
+		if (entry.offset > index_offset ||
+		    entry.length > index_offset - entry.offset) {
+			fp_err("invalid print location");
+			return -EIO;
+		}
+
+		entry.name = g_strndup(raw->name, raw->name_length);
+		g_array_append_val(db->entries, entry);
+		p += sizeof(*raw) + raw->name_length;
+	}
+
+	return 0;
+}
+
+static int write_header(struct fp_print_db *db, uint64_t index_offset,
+	uint32_t index_length, uint64_t end)
+{
+	struct print_db_header hdr;
+
+	memcpy(hdr.magic, "FPDB", sizeof(hdr.magic));
+	hdr.version = GUINT32_TO_LE(PRINT_DB_VERSION);
+	hdr.index_offset = GUINT64_TO_LE(index_offset);
+	hdr.index_length = GUINT32_TO_LE(index_length);
+	hdr.nr_entries = GUINT32_TO_LE(db->entries->len);
+	hdr.end = GUINT64_TO_LE(end);
+	return db_pwrite(db, &hdr, sizeof(hdr), 0);
+}
+
+/* Appends the index at offset, then points the header at it. The data
+ * is synced before the header is written, and the header before returning,
+ * so that the file is consistent at any time. */
+static int commit(struct fp_print_db *db, uint64_t offset)
+{
+	GByteArray *index = g_byte_array_new();
+	uint32_t index_length;
+	unsigned int i;
+	int r;
+
+	for (i = 0; i < db->entries->len; i++) {
+		struct print_db_entry *entry =
+			&g_array_index(db->entries, struct print_db_entry, i);
+		struct print_db_index_entry raw;
+		size_t name_length = strlen(entry->name);
+
+		raw.offset = GUINT64_TO_LE(entry->offset);
+		raw.length = GUINT32_TO_LE(entry->length);
+		raw.driver_id = GUINT16_TO_LE(entry->driver_id);
+		raw.devtype = GUINT32_TO_LE(entry->devtype);
+		raw.data_type = entry->type;
+		raw.finger = entry->finger;
+		raw.name_length = name_length;
+		g_byte_array_append(index, (guint8 *) &raw, sizeof(raw));
+		g_byte_array_append(index, (guint8 *) entry->name, name_length);
+	}
+
+	index_length = index->len;
+	r = db_pwrite(db, index->data, index->len, offset);
+	g_byte_array_free(index, TRUE);
+	if (r < 0)
+		return r;
+
+	if (fdatasync(db->fd) < 0)
+		return -errno;
+	r = write_header(db, offset, index_length, offset + index_length);
+	if (r < 0)
+		return r;
+	if (fdatasync(db->fd) < 0)
+		return -errno;
+
+	db->end = offset + index_length;
+	/* The change is done, fp_print_db_load() retries the mapping */
+	r = db_map(db);
+	if (r < 0)
+		fp_err("couldn't map the new prints: %d", r);
+	return 0;
+}
+
+/** \ingroup print_db
+ * Opens a print database, creating an empty one if the file doesn't exist.
+ * \param path the path to the database file
+ * \param db output location for the database. Must be closed with
+ * fp_print_db_close() after use.
+ * \returns 0 on success, negative on error. -EIO indicates that the file
+ * isn't a valid print database.
+ */
+API_EXPORTED int fp_print_db_open(const char *path, struct fp_print_db **db)
+{
+	struct fp_print_db *pdb;
+	struct print_db_header hdr;
+	struct stat st;
+	int r;
+
+	pdb = g_malloc0(sizeof(*pdb));
+	pdb->entries = entries_new();
+	pdb->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, PRINT_DB_PERMS);
+	if (pdb->fd < 0) {
+		r = -errno;
+		fp_err("couldn't open %s: %s", path, g_strerror(errno));
+		goto err;
+	}
+
+	if (fstat(pdb->fd, &st) < 0) {
+		r = -errno;
+		goto err;
+	}
+
+	if (st.st_size == 0) {
+		fp_dbg("creating %s", path);
+		pdb->end = sizeof(hdr);
+		r = write_header(pdb, sizeof(hdr), 0, sizeof(hdr));
+		if (r == 0)
+			r = db_map(pdb);
+		if (r < 0)
+			goto err;
+		*db = pdb;
+		return 0;
+	}
+
+	if (st.st_size < (off_t) sizeof(hdr) ||
+	    pread(pdb->fd, &hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr) ||
+	    memcmp(hdr.magic, "FPDB", sizeof(hdr.magic)) != 0 ||
+	    GUINT32_FROM_LE(hdr.version) != PRINT_DB_VERSION) {
+		fp_err("%s is not a print database", path);
+		r = -EIO;
+		goto err;
+	}
+
+	pdb->end = GUINT64_FROM_LE(hdr.end);
+	if (pdb->end < sizeof(hdr) || pdb->end > (uint64_t) st.st_size) {
+		fp_err("%s is truncated", path);
+		r = -EIO;
+		goto err;
+	}
+
+	r = db_map(pdb);
+	if (r == 0)
+		r = read_index(pdb, &hdr);
+	if (r < 0)
+		goto err;
+
+	fp_dbg("%s holds %d prints", path, pdb->entries->len);
+	*db = pdb;
+	return 0;
+
+err:
+	fp_print_db_close(pdb);
+	return r;
+}
+
+/** \ingroup print_db
+ * Closes a print database. The prints loaded from it must not be used
+ * afterwards, although they must still be freed with fp_print_data_free().
+ * The changes of a transaction which isn't committed yet are lost.
+ * \param db the database to close. If NULL, function simply returns.
+ */
+API_EXPORTED void fp_print_db_close(struct fp_print_db *db)
+{
+	GSList *elem;
+
+	if (!db)
+		return;
+
+	for (elem = db->old_maps; elem; elem = g_slist_next(elem)) {
+		struct print_db_mapping *map = elem->data;
+		munmap(map->addr, map->length);
+	}
+	g_slist_free_full(db->old_maps, g_free);
+	if (db->map.addr)
+		munmap(db->map.addr, db->map.length);
+	if (db->fd >= 0)
+		close(db->fd);
+	g_array_free(db->entries, TRUE);
+	if (db->txn_entries)
+		g_array_free(db->txn_entries, TRUE);
+	shards_invalidate(db);
+	g_free(db);
+}
+
+/** \ingroup print_db
+ * Gets the number of prints in a database. Prints are numbered from 0 to
+ * this number minus one; saving or deleting a print may change the number
+ * of the others.
+ * \param db the database
+ * \returns the number of prints
+ */
+API_EXPORTED int fp_print_db_get_nr_prints(struct fp_print_db *db)
+{
+	return db->entries->len;
+}
+
+static struct print_db_entry *get_entry(struct fp_print_db *db, int index)
+{
+	if (index < 0 || index >= db->entries->len)
+		return NULL;
+	return &g_array_index(db->entries, struct print_db_entry, index);
+}
+
+/** \ingroup print_db
+ * Looks a print up by name, finger and device type.
+ * \param db the database
+ * \param name the name the print was saved under
+ * \param finger the finger of the print
+ * \param driver_id the \ref driver_id "driver ID" of the print
+ * \param devtype the \ref devtype "devtype" of the print
+ * \returns the number of the print, or -ENOENT if there is no such print
+ */
+API_EXPORTED int fp_print_db_find(struct fp_print_db *db, const char *name,
+	enum fp_finger finger, uint16_t driver_id, uint32_t devtype)
+{
+	unsigned int i;
+
+	for (i = 0; i < db->entries->len; i++) {
+		struct print_db_entry *entry = get_entry(db, i);
+
+		if (entry->finger == finger && entry->driver_id == driver_id &&
+		    entry->devtype == devtype && strcmp(entry->name, name) == 0)
+			return i;
+	}
+
+	return -ENOENT;
+}
+
+/** \ingroup print_db
+ * Gets the name a print was saved under.
+ * \param db the database
+ * \param index the number of the print
+ * \returns the name, owned by the database and valid until it is changed,
+ * or NULL if there is no such print
+ */
+API_EXPORTED const char *fp_print_db_get_name(struct fp_print_db *db,
+	int index)
+{
+	struct print_db_entry *entry = get_entry(db, index);
+	return entry ? entry->name : NULL;
+}
+
+/** \ingroup print_db
+ * Gets the finger of a print.
+ * \param db the database
+ * \param index the number of the print
+ * \returns a finger code from #fp_finger, or 0 if there is no such print
+ */
+API_EXPORTED enum fp_finger fp_print_db_get_finger(struct fp_print_db *db,
+	int index)
+{
+	struct print_db_entry *entry = get_entry(db, index);
+	return entry ? entry->finger : 0;
+}
+
+/** \ingroup print_db
+ * Gets the \ref driver_id "driver ID" of a print, without loading it.
+ * \param db the database
+ * \param index the number of the print
+ * \returns the driver ID, or 0 if there is no such print
+ */
+API_EXPORTED uint16_t fp_print_db_get_driver_id(struct fp_print_db *db,
+	int index)
+{
+	struct print_db_entry *entry = get_entry(db, index);
+	return entry ? entry->driver_id : 0;
+}
+
+/** \ingroup print_db
+ * Gets the \ref devtype "devtype" of a print, without loading it.
+ * \param db the database
+ * \param index the number of the print
+ * \returns the devtype, or 0 if there is no such print
+ */
+API_EXPORTED uint32_t fp_print_db_get_devtype(struct fp_print_db *db,
+	int index)
+{
+	struct print_db_entry *entry = get_entry(db, index);
+	return entry ? entry->devtype : 0;
+}
+
+/** \ingroup print_db
+ * Loads a print from a database. The print refers to the database file
+ * mapping rather than holding a copy of the data, it can only be used until
+ * the database is closed.
+ * \param db the database
+ * \param index the number of the print
+ * \param data output location for the print. Must be freed with
+ * fp_print_data_free() after use.
+ * \returns 0 on success, -ENOENT if there is no such print, -EIO if the
+ * print is corrupted
+ */
+API_EXPORTED int fp_print_db_load(struct fp_print_db *db, int index,
+	struct fp_print_data **data)
+{
+	struct print_db_entry *entry = get_entry(db, index);
+	struct fp_print_data *fdata;
+
+	int r;
+
+	if (!entry)
+		return -ENOENT;
+
+	r = db_map(db);
+	if (r < 0)
+		return r;
+
+	fdata = fpi_print_data_from_data(
+		(const unsigned char *) db->map.addr + entry->offset,
+		entry->length, TRUE);
+	if (!fdata)
+		return -EIO;
+
+	*data = fdata;
+	return 0;
+}
+
+/* Asks for the records of a shard to be read ahead, leaving the other
+ * prints alone */
+static void shard_willneed(struct fp_print_db *db, GArray *shard)
+{
+	uint64_t page_mask = ~((uint64_t) sysconf(_SC_PAGESIZE) - 1);
+	uint64_t start = 0, end = 0;
+	unsigned int i;
+
+	for (i = 0; i < shard->len; i++) {
+		struct print_db_entry *entry =
+			get_entry(db, g_array_index(shard, guint, i));
+		uint64_t entry_start = entry->offset & page_mask;
+		uint64_t entry_end = entry->offset + entry->length;
+
+		/* merge records sharing pages */
+		if (end && entry_start >= start && entry_start <= end) {
+			end = MAX(end, entry_end);
+			continue;
+		}
+		if (end)
+			madvise((unsigned char *) db->map.addr + start,
+				end - start, MADV_WILLNEED);
+		start = entry_start;
+		end = entry_end;
+	}
+	if (end)
+		madvise((unsigned char *) db->map.addr + start, end - start,
+			MADV_WILLNEED);
+}
+
+/** \ingroup print_db
+ * Loads all the prints of a database which are compatible with a device,
+ * for use as an identification gallery. The prints of other devices are
+ * skipped from the index, without being read. Like with fp_print_db_load(),
+ * the prints refer to the database file mapping and can only be used until
+ * the database is closed.
+ * \param db the database
+ * \param dev the device to load prints for
+ * \param gallery output location for a NULL-terminated array of prints.
+ * Must be freed with fp_print_data_gallery_free() after use.
+ * \param indices output location for the numbers of the prints in the
+ * database, may be NULL. Freed along with the gallery.
+ * \returns the number of prints loaded, which may be 0, or negative on error
+ */
+API_EXPORTED int fp_print_db_load_gallery(struct fp_print_db *db,
+	struct fp_dev *dev, struct fp_print_data ***gallery, int **indices)
+{
+	enum fp_print_data_type type = fpi_driver_get_data_type(dev->drv);
+	struct fp_print_data **prints;
+	GArray *shard;
+	int *index_list;
+	unsigned int i, nr_prints;
+	int r, n = 0;
+
+	r = db_map(db);
+	if (r < 0)
+		return r;
+
+	/* Only the compatible prints are ever read */
+	shard = get_shard(db, dev->drv->id, dev->devtype, type);
+	nr_prints = shard ? shard->len : 0;
+	prints = fpi_print_data_gallery_new(nr_prints,
+		nr_prints * sizeof(*index_list), (void **) &index_list);
+	if (shard)
+		shard_willneed(db, shard);
+
+	for (i = 0; i < nr_prints; i++) {
+		guint index = g_array_index(shard, guint, i);
+		struct print_db_entry *entry = get_entry(db, index);
+		struct fp_print_data *fdata;
+
+		fdata = fpi_print_data_from_data(
+			(const unsigned char *) db->map.addr + entry->offset,
+			entry->length, TRUE);
+		if (!fdata) {
+			fp_err("print %d is corrupted", index);
+			continue;
+		}
+
+		index_list[n] = index;
+		prints[n++] = fdata;
+	}
+
+	fp_dbg("loaded %d prints", n);
+	*gallery = prints;
+	if (indices)
+		*indices = index_list;
+	return n;
+}
+
+static int db_save(struct fp_print_db *db, const char *name,
+	enum fp_finger finger, struct fp_print_data *data, gboolean replace)
+{
+	static const unsigned char padding[RECORD_ALIGN];
+	struct print_db_entry *entry, old_entry;
+	enum fpi_print_data_format format = FPI_PRINT_DATA_FP2;
+	unsigned char *buf;
+	uint64_t offset;
+	size_t len, pad;
+	int index, r;
+
+	if (!name || !*name || strlen(name) > MAX_NAME_LENGTH ||
+	    !FP_FINGER_IS_VALID(finger))
+		return -EINVAL;
+
+	index = fp_print_db_find(db, name, finger, data->driver_id,
+		data->devtype);
+	if (index >= 0 && !replace)
+		return -EEXIST;
+
+	if (fpi_print_data_compression_enabled())
+		format = FPI_PRINT_DATA_FP4;
+	len = fpi_print_data_copy_data(data, NULL, 0, format);
+	buf = g_malloc(len);
+	fpi_print_data_copy_data(data, buf, len, format);
+
+	pad = (RECORD_ALIGN + RECORD_OFFSET - db->end % RECORD_ALIGN) %
+		RECORD_ALIGN;
+	offset = db->end + pad;
+	r = db_pwrite(db, padding, pad, db->end);
+	if (r == 0)
+		r = db_pwrite(db, buf, len, offset);
+	g_free(buf);
+	if (r < 0)
+		return r;
+
+	shards_invalidate(db);
+	if (index < 0) {
+		struct print_db_entry new_entry = {
+			.name = g_strdup(name),
+			.finger = finger,
+			.driver_id = data->driver_id,
+			.devtype = data->devtype,
+		};
+
+		g_array_append_val(db->entries, new_entry);
+		index = db->entries->len - 1;
+	}
+
+	entry = get_entry(db, index);
+	old_entry = *entry;
+	entry->offset = offset;
+	entry->length = len;
+	entry->type = data->type;
+
+	if (db->txn_entries) {
+		db->end = offset + len;
+		fp_dbg("staged finger %d of %s as %d", finger, name, index);
+		return index;
+	}
+
+	r = commit(db, offset + len);
+	if (r < 0) {
+		fp_err("couldn't save print: %d", r);
+		if (old_entry.length)
+			*entry = old_entry;
+		else
+			g_array_remove_index(db->entries, index);
+		return r;
+	}
+
+	fp_dbg("saved finger %d of %s as %d", finger, name, index);
+	return index;
+}
+
+/** \ingroup print_db
+ * Saves a print into a database, under a name chosen by the application.
+ * A print previously saved for the same name, finger and device type is
+ * replaced.
+ * \param db the database
+ * \param name the name to save the print under, at most 255 bytes long
+ * \param finger the finger of the print
+ * \param data the print to save
+ * \returns the number of the print on success, negative on error
+ */
+API_EXPORTED int fp_print_db_save(struct fp_print_db *db, const char *name,
+	enum fp_finger finger, struct fp_print_data *data)
+{
+	return db_save(db, name, finger, data, TRUE);
+}
+
+/** \ingroup print_db
+ * Saves a print into a database like fp_print_db_save(), unless there
+ * already is a print for the same name, finger and device type. The check
+ * and the save happen as one change, so the existing print is never
+ * replaced.
+ * \param db the database
+ * \param name the name to save the print under, at most 255 bytes long
+ * \param finger the finger of the print
+ * \param data the print to save
+ * \returns the number of the print on success, -EEXIST if there already is
+ * such a print, other negative values on error
+ */
+API_EXPORTED int fp_print_db_save_new(struct fp_print_db *db,
+	const char *name, enum fp_finger finger, struct fp_print_data *data)
+{
+	return db_save(db, name, finger, data, FALSE);
+}
+
+/** \ingroup print_db
+ * Deletes a print from a database. The prints loaded from the database,
+ * including this one, remain usable until it is closed.
+ * \param db the database
+ * \param index the number of the print
+ * \returns 0 on success, negative on error
+ */
+API_EXPORTED int fp_print_db_delete(struct fp_print_db *db, int index)
+{
+	struct print_db_entry *entry = get_entry(db, index);
+	struct print_db_entry old_entry;
+	int r;
+
+	if (!entry)
+		return -ENOENT;
+
+	/* Take the entry out without freeing its name, in case the commit
+	 * fails */
+	old_entry = *entry;
+	entry->name = NULL;
+	shards_invalidate(db);
+	g_array_remove_index(db->entries, index);
+
+	if (db->txn_entries) {
+		g_free(old_entry.name);
+		return 0;
+	}
+
+	r = commit(db, db->end);
+	if (r < 0) {
+		g_array_insert_val(db->entries, index, old_entry);
+		return r;
+	}
+
+	g_free(old_entry.name);
+	return 0;
+}
+
+/** \ingroup print_db
+ * Starts a transaction. Until fp_print_db_commit() is called, the prints
+ * saved or deleted with fp_print_db_save(), fp_print_db_save_new() and
+ * fp_print_db_delete() are only changed in memory, and in the unused part
+ * of the file. They can be loaded and looked up as usual.
+ * \param db the database
+ * \returns 0 on success, -EBUSY if a transaction is already in progress
+ */
+API_EXPORTED int fp_print_db_begin(struct fp_print_db *db)
+{
+	unsigned int i;
+
+	if (db->txn_entries)
+		return -EBUSY;
+
+	db->txn_entries = entries_new();
+	for (i = 0; i < db->entries->len; i++) {
+		struct print_db_entry entry = *get_entry(db, i);
+
+		entry.name = g_strdup(entry.name);
+		g_array_append_val(db->txn_entries, entry);
+	}
+	db->txn_end = db->end;
+	return 0;
+}
+
+/** \ingroup print_db
+ * Undoes all the changes made since fp_print_db_begin(). The prints loaded
+ * from the database after the transaction was started must not be used
+ * anymore, although they must still be freed with fp_print_data_free().
+ * \param db the database
+ */
+API_EXPORTED void fp_print_db_rollback(struct fp_print_db *db)
+{
+	if (!db->txn_entries)
+		return;
+
+	shards_invalidate(db);
+	g_array_free(db->entries, TRUE);
+	db->entries = db->txn_entries;
+	db->txn_entries = NULL;
+	db->end = db->txn_end;
+}
+
+/** \ingroup print_db
+ * Commits all the changes made since fp_print_db_begin() at once. If the
+ * commit fails, the changes are rolled back.
+ * \param db the database
+ * \returns 0 on success, negative on error
+ */
+API_EXPORTED int fp_print_db_commit(struct fp_print_db *db)
+{
+	int r;
+
+	if (!db->txn_entries)
+		return -EINVAL;
+
+	r = commit(db, db->end);
+	if (r < 0) {
+		fp_err("couldn't commit transaction: %d", r);
+		fp_print_db_rollback(db);
+		return r;
+	}
+
+	g_array_free(db->txn_entries, TRUE);
+	db->txn_entries = NULL;
+	return 0;
+}
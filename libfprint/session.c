@@ -0,0 +1,107 @@
+/*
+ * Identification sessions shared by several devices
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "session"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "fp_internal.h"
+
+/** @defgroup session Identification sessions
+ * Several devices identifying against the same prints, such as the readers
+ * of an entrance, can share an identification session. A session holds one
+ * indexed gallery and a pool of threads: devices started with
+ * fp_async_identify_session_start() hand their scans over to the pool,
+ * where minutiae detection and matching of scans from different devices
+ * run side by side, instead of waiting for each other on the worker thread
+ * of their context. The results are routed back to the callback of the
+ * device which made the scan.
+ *
+ * The devices of a session may belong to different contexts.
+ */
+
+struct fp_identify_session {
+	struct fp_gallery *gallery;
+	GThreadPool *pool;
+};
+
+/** \ingroup session
+ * Creates an identification session. The gallery is not copied, and must
+ * not be freed before the session is. It can still be changed while the
+ * session is in use.
+ *
+ * \param gallery the gallery the devices of the session identify against
+ * \param nr_threads the number of scans processed at once, or 0 to process
+ * one per online CPU
+ * \returns the new session, to be freed with fp_identify_session_free(), or
+ * NULL on error
+ */
+API_EXPORTED struct fp_identify_session *fp_identify_session_new(
+	struct fp_gallery *gallery, unsigned int nr_threads)
+{
+	struct fp_identify_session *session;
+	GThreadPool *pool;
+
+	if (nr_threads == 0) {
+		long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nr_threads = nr_cpus > 0 ? nr_cpus : 1;
+	}
+
+	pool = fpi_worker_pool_new(nr_threads);
+	if (!pool)
+		return NULL;
+
+	fp_dbg("%u threads", nr_threads);
+	session = g_malloc0(sizeof(*session));
+	session->gallery = gallery;
+	session->pool = pool;
+	return session;
+}
+
+/** \ingroup session
+ * Frees an identification session, after waiting for the scans it is
+ * processing. Identification must have been stopped on all its devices.
+ * The gallery is not freed.
+ *
+ * \param session the session to free, or NULL
+ */
+API_EXPORTED void fp_identify_session_free(struct fp_identify_session *session)
+{
+	if (!session)
+		return;
+
+	g_thread_pool_free(session->pool, FALSE, TRUE);
+	g_free(session);
+}
+
+struct fp_gallery *fpi_identify_session_get_gallery(
+	struct fp_identify_session *session)
+{
+	return session->gallery;
+}
+
+/* Runs work(data) on a thread of the session, then done(data) from the
+ * context of the device, see fpi_worker_run() */
+int fpi_identify_session_run(struct fp_identify_session *session,
+	struct fp_context *ctx, fpi_work_fn work, fpi_work_fn done, void *data)
+{
+	return fpi_worker_run_in_pool(session->pool, ctx, work, done, data);
+}
@@ -0,0 +1,130 @@
+/*
+ * Operation instrumentation for libfprint
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "stats"
+
+#include <config.h>
+#include <string.h>
+
+#include "fp_internal.h"
+
+/* All of these run from the event loop of the device's context. The worker
+ * thread notes its own timings, which are applied once it is done. */
+
+static void clear_stages(struct fp_dev *dev)
+{
+	int i;
+
+	for (i = 0; i < FP_STATS_NR_STAGES; i++)
+		dev->stats.stages[i] = -1;
+	dev->stats_reported = FALSE;
+}
+
+/* The scan following a reported one starts when the result was reported */
+static void next_scan(struct fp_dev *dev)
+{
+	if (dev->stats_reported)
+		clear_stages(dev);
+}
+
+/* Called as an operation starts */
+void fpi_stats_begin(struct fp_dev *dev)
+{
+	memset(dev->stats.counters, 0, sizeof(dev->stats.counters));
+	clear_stages(dev);
+	dev->stats_start = g_get_monotonic_time();
+}
+
+void fpi_stats_stage_at(struct fp_dev *dev, enum fp_stats_stage stage,
+	gint64 time)
+{
+	next_scan(dev);
+	dev->stats.stages[stage] = time - dev->stats_start;
+}
+
+void fpi_stats_stage(struct fp_dev *dev, enum fp_stats_stage stage)
+{
+	fpi_stats_stage_at(dev, stage, g_get_monotonic_time());
+}
+
+void fpi_stats_count(struct fp_dev *dev, enum fp_stats_counter counter,
+	guint64 n)
+{
+	next_scan(dev);
+	dev->stats.counters[counter] += n;
+}
+
+/* Called before a scan result is passed to the application, hands the
+ * statistics to the context's callback */
+void fpi_stats_report(struct fp_dev *dev, int result)
+{
+	struct fp_context *ctx = dev->ctx;
+
+	next_scan(dev);
+	if (result >= FP_ENROLL_RETRY && result <= FP_ENROLL_RETRY_REMOVE_FINGER)
+		dev->stats.counters[FP_STATS_RETRIES]++;
+
+	if (ctx->stats_cb)
+		ctx->stats_cb(dev, &dev->stats, ctx->stats_cb_data);
+
+	dev->stats_reported = TRUE;
+	dev->stats_start = g_get_monotonic_time();
+}
+
+/* Called as the application asks for the current operation to stop */
+void fpi_stats_stop_begin(struct fp_dev *dev)
+{
+	dev->stop_start = g_get_monotonic_time();
+}
+
+/* Called once the operation stopped, before telling the application */
+void fpi_stats_stopped(struct fp_dev *dev)
+{
+	dev->stats.stop_latency = g_get_monotonic_time() - dev->stop_start;
+	fp_dbg("stopped in %" G_GINT64_FORMAT " us", dev->stats.stop_latency);
+}
+
+/** \ingroup dev
+ * Gets the instrumentation of the last scan of a device, or of the current
+ * one if its result hasn't been reported yet. Called from a result callback,
+ * this gets the statistics of the scan the result is about.
+ *
+ * \param dev the device
+ * \param stats where to store the statistics
+ */
+API_EXPORTED void fp_dev_get_stats(struct fp_dev *dev, struct fp_stats *stats)
+{
+	*stats = dev->stats;
+}
+
+/** \ingroup poll
+ * Sets a function to be called with the instrumentation of each scan of the
+ * devices of a context, just before its result is passed to the
+ * application. This allows exporting timings without polling
+ * fp_dev_get_stats().
+ *
+ * \param ctx the context
+ * \param callback the function, or NULL to stop calling any
+ * \param user_data data passed to callback
+ */
+API_EXPORTED void fp_context_set_stats_cb(struct fp_context *ctx,
+	fp_stats_cb callback, void *user_data)
+{
+	ctx->stats_cb = callback;
+	ctx->stats_cb_data = user_data;
+}
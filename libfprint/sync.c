@@ -24,7 +24,32 @@
 
 #include "fp_internal.h"
 
+/* How long a synchronous operation waits for events at once. The wait
+ * returns as soon as an event, a timer or completed work has been handled,
+ * so this only bounds how often an idle sensor wakes us up. */
+#define SYNC_WAIT_TIMEOUT_SEC	60
+
+/* Runs the context's event loop until an operation's callback sets *done.
+ * The callbacks run on this thread from within the loop, so there is
+ * nothing to signal across threads: handling the event which completes the
+ * operation is what makes the loop return. */
+static int sync_wait(struct fp_context *ctx, gboolean *done)
+{
+	struct timeval tv;
+	int r;
+
+	while (!*done) {
+		tv.tv_sec = SYNC_WAIT_TIMEOUT_SEC;
+		tv.tv_usec = 0;
+		r = fp_context_handle_events_timeout(ctx, &tv);
+		if (r < 0)
+			return r;
+	}
+	return 0;
+}
+
 struct sync_open_data {
+	gboolean populated;
 	struct fp_dev *dev;
 	int status;
 };
@@ -35,6 +60,7 @@ static void sync_open_cb(struct fp_dev *dev, int status, void *user_data)
 	fp_dbg("status %d", status);
 	odata->dev = dev;
 	odata->status = status;
+	odata->populated = TRUE;
 }
 
 /** \ingroup dev
@@ -46,27 +72,22 @@ static void sync_open_cb(struct fp_dev *dev, int status, void *user_data)
  */
 API_EXPORTED struct fp_dev *fp_dev_open(struct fp_dscv_dev *ddev)
 {
-	struct fp_dev *dev = NULL;
-	struct sync_open_data *odata = g_malloc0(sizeof(*odata));
+	struct sync_open_data odata = { FALSE, NULL, 0 };
 	int r;
 
 	fp_dbg("");
-	r = fp_async_dev_open(ddev, sync_open_cb, odata);
+	r = fp_async_dev_open(ddev, sync_open_cb, &odata);
 	if (r)
-		goto out;
+		return NULL;
 
-	while (!odata->dev)
-		if (fp_handle_events() < 0)
-			goto out;
+	if (sync_wait(ddev->ctx, &odata.populated) < 0)
+		return NULL;
 
-	if (odata->status == 0)
-		dev = odata->dev;
-	else
-		fp_dev_close(odata->dev);
+	if (odata.status == 0)
+		return odata.dev;
 
-out:
-	g_free(odata);
-	return dev;
+	fp_dev_close(odata.dev);
+	return NULL;
 }
 
 static void sync_close_cb(struct fp_dev *dev, void *user_data)
@@ -83,16 +104,17 @@ static void sync_close_cb(struct fp_dev *dev, void *user_data)
  */
 API_EXPORTED void fp_dev_close(struct fp_dev *dev)
 {
+	struct fp_context *ctx;
 	gboolean closed = FALSE;
 
 	if (!dev)
 		return;
 
 	fp_dbg("");
+	/* dev is freed once closed */
+	ctx = dev->ctx;
 	fp_async_dev_close(dev, sync_close_cb, &closed);
-	while (!closed)
-		if (fp_handle_events() < 0)
-			break;
+	sync_wait(ctx, &closed);
 }
 
 struct sync_enroll_data {
@@ -211,12 +233,10 @@ API_EXPORTED int fp_enroll_finger_img(struct fp_dev *dev,
 	/* FIXME this isn't very clean */
 	edata = dev->enroll_stage_cb_data;
 
-	while (!edata->populated) {
-		r = fp_handle_events();
-		if (r < 0) {
-			g_free(edata);
-			goto err;
-		}
+	r = sync_wait(dev->ctx, &edata->populated);
+	if (r < 0) {
+		g_free(edata);
+		goto err;
 	}
 
 	edata->populated = FALSE;
@@ -274,9 +294,7 @@ out:
 
 err:
 	if (fp_async_enroll_stop(dev, enroll_stop_cb, &stopped) == 0)
-		while (!stopped)
-			if (fp_handle_events() < 0)
-				break;
+		sync_wait(dev->ctx, &stopped);
 	return r;
 }
 
@@ -320,7 +338,7 @@ static void verify_stop_cb(struct fp_dev *dev, void *user_data)
 API_EXPORTED int fp_verify_finger_img(struct fp_dev *dev,
 	struct fp_print_data *enrolled_print, struct fp_img **img)
 {
-	struct sync_verify_data *vdata;
+	struct sync_verify_data vdata = { FALSE, 0, NULL };
 	gboolean stopped = FALSE;
 	int r;
 
@@ -335,29 +353,22 @@ API_EXPORTED int fp_verify_finger_img(struct fp_dev *dev,
 	}
 
 	fp_dbg("to be handled by %s", dev->drv->name);
-	vdata = g_malloc0(sizeof(struct sync_verify_data));
-	r = fp_async_verify_start(dev, enrolled_print, sync_verify_cb, vdata);
+	r = fp_async_verify_start(dev, enrolled_print, sync_verify_cb, &vdata);
 	if (r < 0) {
 		fp_dbg("verify_start error %d", r);
-		g_free(vdata);
 		return r;
 	}
 
-	while (!vdata->populated) {
-		r = fp_handle_events();
-		if (r < 0) {
-			g_free(vdata);
-			goto err;
-		}
-	}
+	r = sync_wait(dev->ctx, &vdata.populated);
+	if (r < 0)
+		goto err;
 
 	if (img)
-		*img = vdata->img;
+		*img = vdata.img;
 	else
-		fp_img_free(vdata->img);
+		fp_img_free(vdata.img);
 
-	r = vdata->result;
-	g_free(vdata);
+	r = vdata.result;
 	switch (r) {
 	case FP_VERIFY_NO_MATCH:
 		fp_dbg("result: no match");
@@ -385,9 +396,7 @@ API_EXPORTED int fp_verify_finger_img(struct fp_dev *dev,
 err:
 	fp_dbg("ending verification");
 	if (fp_async_verify_stop(dev, verify_stop_cb, &stopped) == 0)
-		while (!stopped)
-			if (fp_handle_events() < 0)
-				break;
+		sync_wait(dev->ctx, &stopped);
 
 	return r;
 }
@@ -416,73 +425,44 @@ static void identify_stop_cb(struct fp_dev *dev, void *user_data)
 	*stopped = TRUE;
 }
 
-/** \ingroup dev
- * Performs a new scan and attempts to identify the scanned finger against
- * a collection of previously enrolled fingerprints.
- * If the device is an imaging device, it can also return the image from
- * the scan, even when identification fails with a RETRY code. It is legal to
- * call this function even on non-imaging devices, just don't expect them to
- * provide images.
- *
- * This function returns codes from #fp_verify_result. The return code
- * fp_verify_result#FP_VERIFY_MATCH indicates that the scanned fingerprint
- * does appear in the print gallery, and the match_offset output parameter
- * will indicate the index into the print gallery array of the matched print.
- *
- * This function will not necessarily examine the whole print gallery, it
- * will return as soon as it finds a matching print.
- *
- * Not all devices support identification. -ENOTSUP will be returned when
- * this is the case.
- *
- * \param dev the device to perform the scan.
- * \param print_gallery NULL-terminated array of pointers to the prints to
- * identify against. Each one must have been previously enrolled with a device
- * compatible to the device selected to perform the scan.
- * \param match_offset output location to store the array index of the matched
- * gallery print (if any was found). Only valid if FP_VERIFY_MATCH was
- * returned.
- * \param img location to store the scan image. accepts NULL for no image
- * storage. If an image is returned, it must be freed with fp_img_free() after
- * use.
- * \return negative code on error, otherwise a code from #fp_verify_result
- */
-API_EXPORTED int fp_identify_finger_img(struct fp_dev *dev,
-	struct fp_print_data **print_gallery, size_t *match_offset,
-	struct fp_img **img)
+static int identify_finger(struct fp_dev *dev,
+	struct fp_print_data **print_gallery, struct fp_gallery *gallery,
+	size_t *match_offset, struct fp_img **img)
 {
 	gboolean stopped = FALSE;
-	struct sync_identify_data *idata
-		= g_malloc0(sizeof(struct sync_identify_data));
+	struct sync_identify_data idata = { FALSE, 0, 0, NULL };
 	int r;
 
 	fp_dbg("to be handled by %s", dev->drv->name);
 
-	r = fp_async_identify_start(dev, print_gallery, sync_identify_cb, idata);
+	if (gallery)
+		r = fp_async_identify_gallery_start(dev, gallery, sync_identify_cb,
+			&idata);
+	else
+		r = fp_async_identify_start(dev, print_gallery, sync_identify_cb,
+			&idata);
 	if (r < 0) {
 		fp_err("identify_start error %d", r);
-		goto err;
+		return r;
 	}
 
-	while (!idata->populated) {
-		r = fp_handle_events();
-		if (r < 0)
-			goto err_stop;
-	}
+	r = sync_wait(dev->ctx, &idata.populated);
+	if (r < 0)
+		goto err;
 
 	if (img)
-		*img = idata->img;
+		*img = idata.img;
 	else
-		fp_img_free(idata->img);
+		fp_img_free(idata.img);
 
-	r = idata->result;
-	switch (idata->result) {
+	r = idata.result;
+	switch (idata.result) {
 	case FP_VERIFY_NO_MATCH:
 		fp_dbg("result: no match");
 		break;
 	case FP_VERIFY_MATCH:
-		fp_dbg("result: match at offset %zd", idata->match_offset);
-		*match_offset = idata->match_offset;
+		fp_dbg("result: match at offset %zd", idata.match_offset);
+		*match_offset = idata.match_offset;
 		break;
 	case FP_VERIFY_RETRY:
 		fp_dbg("verify should retry");
@@ -501,17 +481,79 @@ API_EXPORTED int fp_identify_finger_img(struct fp_dev *dev,
 		r = -EINVAL;
 	}
 
-err_stop:
+err:
 	if (fp_async_identify_stop(dev, identify_stop_cb, &stopped) == 0)
-		while (!stopped)
-			if (fp_handle_events() < 0)
-				break;
+		sync_wait(dev->ctx, &stopped);
 
-err:
-	g_free(idata);
 	return r;
 }
 
+/** \ingroup dev
+ * Performs a new scan and attempts to identify the scanned finger against
+ * a collection of previously enrolled fingerprints.
+ * If the device is an imaging device, it can also return the image from
+ * the scan, even when identification fails with a RETRY code. It is legal to
+ * call this function even on non-imaging devices, just don't expect them to
+ * provide images.
+ *
+ * This function returns codes from #fp_verify_result. The return code
+ * fp_verify_result#FP_VERIFY_MATCH indicates that the scanned fingerprint
+ * does appear in the print gallery, and the match_offset output parameter
+ * will indicate the index into the print gallery array of the matched print.
+ *
+ * By default, this function will not necessarily examine the whole print
+ * gallery, it will return as soon as it finds a matching print. See
+ * fp_set_identify_mode() to look for the best matching print instead, and
+ * fp_set_identify_threads() to spread the gallery search over several threads.
+ *
+ * Not all devices support identification. -ENOTSUP will be returned when
+ * this is the case.
+ *
+ * \param dev the device to perform the scan.
+ * \param print_gallery NULL-terminated array of pointers to the prints to
+ * identify against. Each one must have been previously enrolled with a device
+ * compatible to the device selected to perform the scan.
+ * \param match_offset output location to store the array index of the matched
+ * gallery print (if any was found). Only valid if FP_VERIFY_MATCH was
+ * returned.
+ * \param img location to store the scan image. accepts NULL for no image
+ * storage. If an image is returned, it must be freed with fp_img_free() after
+ * use.
+ * \return negative code on error, otherwise a code from #fp_verify_result
+ */
+API_EXPORTED int fp_identify_finger_img(struct fp_dev *dev,
+	struct fp_print_data **print_gallery, size_t *match_offset,
+	struct fp_img **img)
+{
+	return identify_finger(dev, print_gallery, NULL, match_offset, img);
+}
+
+/** \ingroup dev
+ * Performs a new scan and attempts to identify the scanned finger against
+ * an indexed \ref gallery "print gallery". This behaves like
+ * fp_identify_finger_img(), but only the gallery prints which share enough
+ * minutiae geometry with the scan are compared in full, which keeps
+ * identification fast on large galleries.
+ *
+ * Only imaging devices support indexed galleries. -ENOTSUP will be returned
+ * for other devices.
+ *
+ * \param dev the device to perform the scan.
+ * \param gallery the gallery to identify against
+ * \param match_id output location to store the gallery ID of the matched
+ * print (if any was found), as returned by fp_gallery_add_print(). Only valid
+ * if FP_VERIFY_MATCH was returned.
+ * \param img location to store the scan image. accepts NULL for no image
+ * storage. If an image is returned, it must be freed with fp_img_free() after
+ * use.
+ * \return negative code on error, otherwise a code from #fp_verify_result
+ */
+API_EXPORTED int fp_identify_finger_gallery_img(struct fp_dev *dev,
+	struct fp_gallery *gallery, size_t *match_id, struct fp_img **img)
+{
+	return identify_finger(dev, NULL, gallery, match_id, img);
+}
+
 struct sync_capture_data {
 	gboolean populated;
 	int result;
@@ -554,7 +596,7 @@ static void capture_stop_cb(struct fp_dev *dev, void *user_data)
 API_EXPORTED int fp_dev_img_capture(struct fp_dev *dev, int unconditional,
 	struct fp_img **img)
 {
-	struct sync_capture_data *vdata;
+	struct sync_capture_data vdata = { FALSE, 0, NULL };
 	gboolean stopped = FALSE;
 	int r;
 
@@ -564,29 +606,22 @@ API_EXPORTED int fp_dev_img_capture(struct fp_dev *dev, int unconditional,
 	}
 
 	fp_dbg("to be handled by %s", dev->drv->name);
-	vdata = g_malloc0(sizeof(struct sync_capture_data));
-	r = fp_async_capture_start(dev, unconditional, sync_capture_cb, vdata);
+	r = fp_async_capture_start(dev, unconditional, sync_capture_cb, &vdata);
 	if (r < 0) {
 		fp_dbg("capture_start error %d", r);
-		g_free(vdata);
 		return r;
 	}
 
-	while (!vdata->populated) {
-		r = fp_handle_events();
-		if (r < 0) {
-			g_free(vdata);
-			goto err;
-		}
-	}
+	r = sync_wait(dev->ctx, &vdata.populated);
+	if (r < 0)
+		goto err;
 
 	if (img)
-		*img = vdata->img;
+		*img = vdata.img;
 	else
-		fp_img_free(vdata->img);
+		fp_img_free(vdata.img);
 
-	r = vdata->result;
-	g_free(vdata);
+	r = vdata.result;
 	switch (r) {
 	case FP_CAPTURE_COMPLETE:
 		fp_dbg("result: complete");
@@ -602,9 +637,7 @@ API_EXPORTED int fp_dev_img_capture(struct fp_dev *dev, int unconditional,
 err:
 	fp_dbg("ending capture");
 	if (fp_async_capture_stop(dev, capture_stop_cb, &stopped) == 0)
-		while (!stopped)
-			if (fp_handle_events() < 0)
-				break;
+		sync_wait(dev->ctx, &stopped);
 
 	return r;
 }
@@ -0,0 +1,621 @@
+/*
+ * USB transfer recording and replay for libfprint
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "usbtrace"
+
+#include <config.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fp_internal.h"
+
+/* Drivers talk to their device through the fpi_usb_* wrappers below. When
+ * the LIBFPRINT_USB_TRACE environment variable names a file, every transfer
+ * of the first device opened is written there as it completes. Such a trace
+ * can then be replayed with fpi_usb_replay_open(): the driver runs as usual,
+ * but its transfers are completed from the trace, without any device.
+ *
+ * A trace is a text file made of a header:
+ *
+ *	# libfprint usb trace 1
+ *	driver <driver name> <driver data>
+ *
+ * followed by one line per transfer, in completion order:
+ *
+ *	<submitted> <completed> <endpoint> <type> <status> <length>
+ *		<actual length> <data>
+ *
+ * with the times in microseconds since the device was opened, and the data
+ * in hex. The data of OUT transfers is what was sent, the data of IN
+ * transfers what was received. Control transfers start with their setup
+ * packet and use endpoint 0x00 or 0x80 depending on their direction.
+ *
+ * Replayed transfers are matched to the records of the same endpoint in
+ * order, so the driver has to follow the same path as when recording, which
+ * only holds for the same action on the same finger images. Sent data
+ * differing from the recorded one is reported. */
+
+#define TRACE_MAGIC "# libfprint usb trace 1"
+#define CONTROL_SETUP_SIZE LIBUSB_CONTROL_SETUP_SIZE
+
+struct trace_record {
+	gint64 submitted;
+	gint64 completed;
+	unsigned char endpoint;
+	unsigned char type;
+	int status;
+	int length;
+	int actual_length;
+	size_t size;
+	unsigned char data[0];
+};
+
+struct fpi_usb_trace {
+	struct fp_dev *dev;
+	FILE *file;
+	gint64 start;
+
+	/* replay only */
+	gboolean replay;
+	gboolean realtime;
+	GList *records;
+	GSList *pending;
+	unsigned int mismatches;
+};
+
+/* a transfer being recorded */
+struct traced_transfer {
+	struct fpi_usb_trace *trace;
+	libusb_transfer_cb_fn callback;
+	void *user_data;
+	gint64 submitted;
+};
+
+/* a transfer being replayed */
+struct replayed_transfer {
+	struct fpi_usb_trace *trace;
+	struct libusb_transfer *transfer;
+	struct trace_record *record;
+	struct fpi_timeout *timeout;
+	gboolean cancelled;
+};
+
+/* traces by device handle, NULL while there are none */
+static GHashTable *traces;
+static gboolean recorded;
+
+static struct fpi_usb_trace *get_trace(libusb_device_handle *devh)
+{
+	if (G_LIKELY(!traces))
+		return NULL;
+	return g_hash_table_lookup(traces, devh);
+}
+
+static void add_trace(libusb_device_handle *devh, struct fpi_usb_trace *trace)
+{
+	if (!traces)
+		traces = g_hash_table_new(g_direct_hash, g_direct_equal);
+	g_hash_table_insert(traces, devh, trace);
+}
+
+/* Endpoint and direction of a transfer, as recorded */
+static unsigned char transfer_endpoint(struct libusb_transfer *transfer)
+{
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+		return libusb_control_transfer_get_setup(transfer)->bmRequestType &
+			LIBUSB_ENDPOINT_DIR_MASK;
+	return transfer->endpoint;
+}
+
+/* Offset of the data in a transfer buffer */
+static int transfer_data_offset(struct libusb_transfer *transfer)
+{
+	return transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL ?
+		CONTROL_SETUP_SIZE : 0;
+}
+
+/****** RECORDING ******/
+
+static void write_record(struct fpi_usb_trace *trace,
+	struct libusb_transfer *transfer, gint64 submitted)
+{
+	unsigned char endpoint = transfer_endpoint(transfer);
+	size_t size, i;
+
+	if (endpoint & LIBUSB_ENDPOINT_IN)
+		size = transfer_data_offset(transfer) + transfer->actual_length;
+	else
+		size = transfer->length;
+
+	fprintf(trace->file, "%" G_GINT64_FORMAT " %" G_GINT64_FORMAT
+		" 0x%02x %d %d %d %d ", submitted - trace->start,
+		g_get_monotonic_time() - trace->start, endpoint, transfer->type,
+		transfer->status, transfer->length, transfer->actual_length);
+	for (i = 0; i < size; i++)
+		fprintf(trace->file, "%02x", transfer->buffer[i]);
+	fputc('\n', trace->file);
+}
+
+static void record_cb(struct libusb_transfer *transfer)
+{
+	struct traced_transfer *traced = transfer->user_data;
+
+	transfer->callback = traced->callback;
+	transfer->user_data = traced->user_data;
+	write_record(traced->trace, transfer, traced->submitted);
+	g_free(traced);
+
+	transfer->callback(transfer);
+}
+
+static int record_submit(struct fpi_usb_trace *trace,
+	struct libusb_transfer *transfer)
+{
+	struct traced_transfer *traced = g_malloc(sizeof(*traced));
+	int r;
+
+	traced->trace = trace;
+	traced->callback = transfer->callback;
+	traced->user_data = transfer->user_data;
+	traced->submitted = g_get_monotonic_time();
+	transfer->callback = record_cb;
+	transfer->user_data = traced;
+
+	r = libusb_submit_transfer(transfer);
+	if (r < 0) {
+		transfer->callback = traced->callback;
+		transfer->user_data = traced->user_data;
+		g_free(traced);
+	}
+	return r;
+}
+
+/* Called for every device being opened, starts recording the first one if
+ * LIBFPRINT_USB_TRACE is set */
+void fpi_usb_trace_attach(struct fp_dev *dev, unsigned long driver_data)
+{
+	struct fpi_usb_trace *trace = get_trace(dev->udev);
+	const char *path;
+	FILE *file;
+
+	if (trace) {
+		/* being replayed */
+		trace->dev = dev;
+		return;
+	}
+
+	path = getenv("LIBFPRINT_USB_TRACE");
+	if (!path || recorded)
+		return;
+
+	file = fopen(path, "w");
+	if (!file) {
+		fp_err("could not open trace file '%s': %d", path, errno);
+		return;
+	}
+
+	fp_dbg("recording usb transfers to '%s'", path);
+	fprintf(file, TRACE_MAGIC "\ndriver %s %lu\n", dev->drv->name,
+		driver_data);
+	trace = g_malloc0(sizeof(*trace));
+	trace->dev = dev;
+	trace->file = file;
+	trace->start = g_get_monotonic_time();
+	add_trace(dev->udev, trace);
+	recorded = TRUE;
+}
+
+/****** REPLAY ******/
+
+static void free_trace(struct fpi_usb_trace *trace)
+{
+	g_list_free_full(trace->records, g_free);
+	g_free(trace);
+}
+
+static int hex_digit(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+static struct trace_record *parse_record(const char *line)
+{
+	struct trace_record *record;
+	const char *hex;
+	unsigned int endpoint;
+	int type, n = 0;
+	gint64 submitted, completed;
+	int status, length, actual_length;
+	size_t size, i;
+
+	if (sscanf(line, "%" G_GINT64_FORMAT " %" G_GINT64_FORMAT
+			" %x %d %d %d %d %n", &submitted, &completed, &endpoint,
+			&type, &status, &length, &actual_length, &n) < 7 || !n)
+		return NULL;
+
+	hex = line + n;
+	size = strcspn(hex, "\r\n");
+	if (size % 2)
+		return NULL;
+	size /= 2;
+
+	record = g_malloc(sizeof(*record) + size);
+	record->submitted = submitted;
+	record->completed = completed;
+	record->endpoint = endpoint;
+	record->type = type;
+	record->status = status;
+	record->length = length;
+	record->actual_length = actual_length;
+	record->size = size;
+	for (i = 0; i < size; i++) {
+		int hi = hex_digit(hex[2 * i]);
+		int lo = hex_digit(hex[2 * i + 1]);
+
+		if (hi < 0 || lo < 0) {
+			g_free(record);
+			return NULL;
+		}
+		record->data[i] = hi << 4 | lo;
+	}
+
+	return record;
+}
+
+static struct fpi_usb_trace *load_trace(const char *path,
+	struct fp_driver **drv, unsigned long *driver_data)
+{
+	struct fpi_usb_trace *trace = NULL;
+	struct fp_driver **list = NULL;
+	char name[64];
+	char *line = NULL;
+	size_t size = 0;
+	FILE *file;
+	int nr = 2;
+	int i;
+
+	file = fopen(path, "r");
+	if (!file) {
+		fp_err("could not open trace file '%s': %d", path, errno);
+		return NULL;
+	}
+
+	if (getline(&line, &size, file) < 0 ||
+			strncmp(line, TRACE_MAGIC, strlen(TRACE_MAGIC)) ||
+			getline(&line, &size, file) < 0 ||
+			sscanf(line, "driver %63s %lu", name, driver_data) != 2) {
+		fp_err("'%s' is not a usb trace", path);
+		goto out;
+	}
+
+	list = fprint_get_drivers();
+	for (i = 0; list[i]; i++)
+		if (!strcmp(list[i]->name, name))
+			break;
+	*drv = list[i];
+	if (!*drv) {
+		fp_err("trace of unknown driver %s", name);
+		goto out;
+	}
+
+	trace = g_malloc0(sizeof(*trace));
+	trace->replay = TRUE;
+	while (getline(&line, &size, file) >= 0) {
+		struct trace_record *record = parse_record(line);
+
+		nr++;
+		if (!record) {
+			fp_err("%s:%d: bad record", path, nr);
+			free_trace(trace);
+			trace = NULL;
+			goto out;
+		}
+		trace->records = g_list_prepend(trace->records, record);
+	}
+	trace->records = g_list_reverse(trace->records);
+	fp_dbg("loaded %u transfers of driver %s",
+		g_list_length(trace->records), name);
+
+out:
+	g_free(list);
+	free(line);
+	fclose(file);
+	return trace;
+}
+
+static void replay_complete(void *data)
+{
+	struct replayed_transfer *rt = data;
+	struct fpi_usb_trace *trace = rt->trace;
+	struct libusb_transfer *transfer = rt->transfer;
+	struct trace_record *record = rt->record;
+
+	trace->pending = g_slist_remove(trace->pending, rt);
+
+	if (rt->cancelled || !record) {
+		transfer->status = LIBUSB_TRANSFER_CANCELLED;
+		transfer->actual_length = 0;
+	} else {
+		int offset = transfer_data_offset(transfer);
+
+		transfer->status = record->status;
+		transfer->actual_length = MIN(record->actual_length,
+			transfer->length - offset);
+		if ((record->endpoint & LIBUSB_ENDPOINT_IN) &&
+				record->size > offset)
+			memcpy(transfer->buffer + offset, record->data + offset,
+				MIN(record->size, transfer->length) - offset);
+	}
+
+	g_free(record);
+	g_free(rt);
+
+	transfer->callback(transfer);
+	if (transfer->flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+		libusb_free_transfer(transfer);
+}
+
+/* The first record left for the endpoint of transfer, removed from the
+ * trace, or NULL */
+static struct trace_record *take_record(struct fpi_usb_trace *trace,
+	struct libusb_transfer *transfer)
+{
+	unsigned char endpoint = transfer_endpoint(transfer);
+	GList *l;
+
+	for (l = trace->records; l; l = l->next) {
+		struct trace_record *record = l->data;
+
+		if (record->endpoint == endpoint &&
+				record->type == transfer->type) {
+			trace->records = g_list_delete_link(trace->records, l);
+			return record;
+		}
+	}
+	return NULL;
+}
+
+static int replay_submit(struct fpi_usb_trace *trace,
+	struct libusb_transfer *transfer)
+{
+	struct replayed_transfer *rt = g_malloc0(sizeof(*rt));
+	struct trace_record *record = take_record(trace, transfer);
+
+	rt->trace = trace;
+	rt->transfer = transfer;
+	rt->record = record;
+	trace->pending = g_slist_prepend(trace->pending, rt);
+
+	if (!record) {
+		/* Nothing more happened on this endpoint, wait for the driver
+		 * to give up on the transfer */
+		fp_dbg("no more transfers on endpoint %02x",
+			transfer_endpoint(transfer));
+		return 0;
+	}
+
+	if (!(record->endpoint & LIBUSB_ENDPOINT_IN) &&
+			(record->size != transfer->length ||
+			 memcmp(record->data, transfer->buffer, record->size))) {
+		trace->mismatches++;
+		fp_warn("data sent to endpoint %02x differs from the trace",
+			record->endpoint);
+	}
+
+	/* Cancelled while recording: wait for the driver to cancel it */
+	if (record->status == LIBUSB_TRANSFER_CANCELLED)
+		return 0;
+
+	rt->timeout = fpi_timeout_add(trace->dev, trace->realtime ?
+		(record->completed - record->submitted) / 1000 : 0,
+		replay_complete, rt);
+	if (!rt->timeout) {
+		trace->pending = g_slist_remove(trace->pending, rt);
+		g_free(record);
+		g_free(rt);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	return 0;
+}
+
+static int replay_cancel(struct fpi_usb_trace *trace,
+	struct libusb_transfer *transfer)
+{
+	GSList *l;
+
+	for (l = trace->pending; l; l = l->next) {
+		struct replayed_transfer *rt = l->data;
+
+		if (rt->transfer != transfer || rt->cancelled)
+			continue;
+
+		if (rt->timeout)
+			fpi_timeout_cancel(rt->timeout);
+		rt->cancelled = TRUE;
+		rt->timeout = fpi_timeout_add(trace->dev, 0, replay_complete, rt);
+		if (!rt->timeout)
+			return LIBUSB_ERROR_NO_MEM;
+		return 0;
+	}
+
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+/* Opens a device running the driver a trace was recorded with, its
+ * transfers being completed from the trace, as fast as possible or, if
+ * realtime is set, taking as long as when recording. The device is closed as
+ * usual. */
+int fpi_usb_replay_open(struct fp_context *ctx, const char *path,
+	gboolean realtime, fp_dev_open_cb callback, void *user_data)
+{
+	struct fpi_usb_trace *trace;
+	struct fp_driver *drv;
+	unsigned long driver_data;
+	int r;
+
+	trace = load_trace(path, &drv, &driver_data);
+	if (!trace)
+		return -EINVAL;
+
+	/* The trace stands for the device handle, which is never handed to
+	 * libusb */
+	trace->realtime = realtime;
+	trace->start = g_get_monotonic_time();
+	add_trace((libusb_device_handle *) trace, trace);
+
+	r = fpi_dev_open_handle(ctx, drv, driver_data,
+		(libusb_device_handle *) trace, callback, user_data);
+	if (r) {
+		g_hash_table_remove(traces, trace);
+		free_trace(trace);
+	}
+	return r;
+}
+
+/* Number of the transfers whose data didn't match the trace */
+unsigned int fpi_usb_replay_mismatches(struct fp_dev *dev)
+{
+	struct fpi_usb_trace *trace = get_trace(dev->udev);
+
+	return trace ? trace->mismatches : 0;
+}
+
+/****** DEVICE ACCESS ******/
+
+int fpi_usb_submit_transfer(struct libusb_transfer *transfer)
+{
+	struct fpi_usb_trace *trace = get_trace(transfer->dev_handle);
+
+	if (!trace)
+		return libusb_submit_transfer(transfer);
+	if (trace->replay)
+		return replay_submit(trace, transfer);
+	return record_submit(trace, transfer);
+}
+
+int fpi_usb_cancel_transfer(struct libusb_transfer *transfer)
+{
+	struct fpi_usb_trace *trace = get_trace(transfer->dev_handle);
+
+	if (trace && trace->replay)
+		return replay_cancel(trace, transfer);
+	return libusb_cancel_transfer(transfer);
+}
+
+/* Cancels a ring of transfers queued on one endpoint, which are submitted
+ * in turn, so that newest is the last one submitted. They are cancelled the
+ * other way round: cancelling the oldest one first would let the controller
+ * move on to the next one, which could then complete with data the driver
+ * has to wait for, and so on for each of them. The ones not in flight just
+ * fail to cancel. Returns the number of transfers being cancelled. */
+unsigned int fpi_usb_cancel_transfers(struct libusb_transfer **transfers,
+	unsigned int nr_transfers, unsigned int newest)
+{
+	unsigned int i, cancelled = 0;
+
+	for (i = 0; i < nr_transfers; i++)
+		if (fpi_usb_cancel_transfer(transfers[(newest + nr_transfers - i) %
+				nr_transfers]) == 0)
+			cancelled++;
+	return cancelled;
+}
+
+/* Without a device, the requests which don't go through transfers succeed */
+static gboolean is_replayed(libusb_device_handle *devh)
+{
+	struct fpi_usb_trace *trace = get_trace(devh);
+
+	return trace && trace->replay;
+}
+
+/* Whether transfers of the device are being recorded or replayed */
+gboolean fpi_usb_is_traced(libusb_device_handle *devh)
+{
+	return get_trace(devh) != NULL;
+}
+
+int fpi_usb_claim_interface(libusb_device_handle *devh, int iface)
+{
+	if (is_replayed(devh))
+		return 0;
+	return libusb_claim_interface(devh, iface);
+}
+
+int fpi_usb_release_interface(libusb_device_handle *devh, int iface)
+{
+	if (is_replayed(devh))
+		return 0;
+	return libusb_release_interface(devh, iface);
+}
+
+int fpi_usb_set_configuration(libusb_device_handle *devh, int config)
+{
+	if (is_replayed(devh))
+		return 0;
+	return libusb_set_configuration(devh, config);
+}
+
+int fpi_usb_reset_device(libusb_device_handle *devh)
+{
+	if (is_replayed(devh))
+		return 0;
+	return libusb_reset_device(devh);
+}
+
+void fpi_usb_close(libusb_device_handle *devh)
+{
+	struct fpi_usb_trace *trace = get_trace(devh);
+
+	if (trace)
+		g_hash_table_remove(traces, devh);
+
+	if (!trace || !trace->replay) {
+		libusb_close(devh);
+		if (trace) {
+			fclose(trace->file);
+			g_free(trace);
+		}
+		return;
+	}
+
+	if (trace->pending)
+		fp_warn("%u transfers still pending",
+			g_slist_length(trace->pending));
+	while (trace->pending) {
+		struct replayed_transfer *rt = trace->pending->data;
+
+		trace->pending = g_slist_delete_link(trace->pending,
+			trace->pending);
+		if (rt->timeout)
+			fpi_timeout_cancel(rt->timeout);
+		g_free(rt->record);
+		g_free(rt);
+	}
+	if (trace->records)
+		fp_dbg("%u transfers left in the trace",
+			g_list_length(trace->records));
+	free_trace(trace);
+}